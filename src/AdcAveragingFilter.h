@@ -16,6 +16,8 @@
 template<size_t numAveraged> class AdcAveragingFilter
 {
 public:
+	typedef void (*WindowCallbackFunction)(CallbackParameter) noexcept;
+
 	AdcAveragingFilter() noexcept
 	{
 		Init(0);
@@ -25,6 +27,7 @@ public:
 	{
 		TaskCriticalSectionLocker lock;
 
+		BeginUpdate();
 		sum = (uint32_t)val * (uint32_t)numAveraged;
 		index = 0;
 		isValid = false;
@@ -32,21 +35,39 @@ public:
 		{
 			readings[i] = val;
 		}
+		EndUpdate();
 	}
 
-	// Call this to put a new reading into the filter
+	// Call this to put a new reading into the filter. This is called for every ADC conversion, so it must be fast.
+	// There is only ever one writer for each filter, so instead of a critical section we use a sequence counter that readers check to get consistent values.
 	void ProcessReading(uint16_t r) noexcept
 	{
-		TaskCriticalSectionLocker lock;
+		BeginUpdate();
+		AddReading(r);
+		EndUpdate();
+		CheckWindowCompleted();
+	}
 
-		sum = sum - readings[index] + r;
-		readings[index] = r;
-		++index;
-		if (index == numAveraged)
+	// Put a block of readings into the filter, for example from a DMA buffer. Readers see either none or all of the block.
+	void ProcessReadings(const uint16_t *r, size_t count) noexcept
+	{
+		BeginUpdate();
+		while (count != 0)
 		{
-			index = 0;
-			isValid = true;
+			AddReading(*r++);
+			--count;
 		}
+		EndUpdate();
+		CheckWindowCompleted();
+	}
+
+	// Set a function to call each time the filter has replaced all of its readings, so that the user of the filter knows that it has a completely new average.
+	// The function is called from the same context as ProcessReading, which may be an ISR.
+	void SetWindowCallback(WindowCallbackFunction fn, CallbackParameter param) volatile noexcept
+	{
+		AtomicCriticalSectionLocker lock;
+		windowCallback = fn;
+		windowCallbackParam.u32 = param.u32;
 	}
 
 	// Return the raw sum
@@ -61,12 +82,38 @@ public:
 		return isValid;
 	}
 
+	// Get the sum and whether it is valid, consistently with each other
+	bool GetValidSum(uint32_t& rslt) const volatile noexcept
+	{
+		for (;;)
+		{
+			const uint32_t seq = sequence;
+			asm volatile("":::"memory");
+			const bool valid = isValid;
+			rslt = sum;
+			asm volatile("":::"memory");
+			if ((seq & 1u) == 0 && seq == sequence)
+			{
+				return valid;
+			}
+		}
+	}
+
 	// Get the latest reading
 	uint16_t GetLatestReading() const volatile noexcept
 	{
-		size_t indexOfLastReading = index;			// capture volatile variable
-		indexOfLastReading = (indexOfLastReading == 0) ? numAveraged - 1 : indexOfLastReading - 1;
-		return readings[indexOfLastReading];
+		for (;;)
+		{
+			const uint32_t seq = sequence;
+			asm volatile("":::"memory");
+			const size_t indexOfLastReading = (index == 0) ? numAveraged - 1 : index - 1;
+			const uint16_t rslt = readings[indexOfLastReading];
+			asm volatile("":::"memory");
+			if ((seq & 1u) == 0 && seq == sequence)
+			{
+				return rslt;
+			}
+		}
 	}
 
 	static constexpr size_t NumAveraged() noexcept { return numAveraged; }
@@ -77,10 +124,52 @@ public:
 	bool CheckIntegrity() const noexcept;
 
 private:
+	// The sequence counter is odd while an update is in progress. If a reader sees it change while reading then it must read again.
+	void BeginUpdate() volatile noexcept
+	{
+		sequence = sequence + 1;
+		asm volatile("":::"memory");
+	}
+
+	void EndUpdate() volatile noexcept
+	{
+		asm volatile("":::"memory");
+		sequence = sequence + 1;
+	}
+
+	void AddReading(uint16_t r) noexcept
+	{
+		sum = sum - readings[index] + r;
+		readings[index] = r;
+		++index;
+		if (index == numAveraged)
+		{
+			index = 0;
+			isValid = true;
+			windowCompleted = true;
+		}
+	}
+
+	void CheckWindowCompleted() noexcept
+	{
+		if (windowCompleted)
+		{
+			windowCompleted = false;
+			if (windowCallback != nullptr)
+			{
+				windowCallback(windowCallbackParam);
+			}
+		}
+	}
+
 	uint16_t readings[numAveraged];
 	size_t index;
 	uint32_t sum;
+	volatile uint32_t sequence = 0;
+	WindowCallbackFunction windowCallback = nullptr;
+	CallbackParameter windowCallbackParam;
 	bool isValid;
+	bool windowCompleted = false;
 	//invariant(sum == + over readings)
 	//invariant(index < numAveraged)
 };
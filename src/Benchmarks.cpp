@@ -0,0 +1,121 @@
+/*
+ * Benchmarks.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "Benchmarks.h"
+
+#if SUPPORT_BENCHMARKS
+
+#include <LatencyHistograms.h>
+#include <AdcAveragingFilter.h>
+#include <CanMessageFormats.h>
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+# include <Movement/DDA.h>
+#endif
+
+#if SUPPORT_CLOSED_LOOP
+# include <ClosedLoop/Trigonometry.h>
+#endif
+
+namespace Benchmarks
+{
+	constexpr unsigned int Iterations = 1000;					// how many times we repeat the short benchmarks
+
+#if SAME5x
+	constexpr uint32_t CyclesPerTimestamp = 1;
+#else
+	constexpr uint32_t CyclesPerTimestamp = SystemCoreClockFreq/StepTimer::StepClockRate;
+#endif
+
+	static volatile uint32_t sink;								// results are written here so that the compiler can't optimise the benchmarked code away
+
+#if SUPPORT_DRIVERS
+	static DDA *benchmarkDda = nullptr;
+
+	// Benchmark setting up and calculating the step times for a canned move with an acceleration, steady and deceleration phase
+	static void BenchmarkMove(const StringRef& reply) noexcept
+	{
+# if HAS_SMART_DRIVERS
+		if (moveInstance->HasExecutingMove())
+		{
+			reply.lcatf("Move benchmark skipped because a move is executing");
+			return;
+		}
+# endif
+		if (benchmarkDda == nullptr)
+		{
+			benchmarkDda = new DDA(nullptr);
+			benchmarkDda->SetPrevious(benchmarkDda);
+		}
+
+		CanMessageMovementLinear msg;
+		msg.accelerationClocks = msg.steadyClocks = msg.decelClocks = StepTimer::StepClockRate/10;
+		msg.whenToExecute = StepTimer::GetTimerTicks();
+		msg.numDrivers = NumDrivers;
+		msg.pressureAdvanceDrives = 0;
+		msg.seq = 0;
+		msg.initialSpeedFraction = msg.finalSpeedFraction = 0.0;
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			msg.perDrive[driver].steps = (int32_t)(3200 >> driver);			// use different step counts so that the step times of the drivers differ
+		}
+
+		uint32_t initTime, stepTime;
+		const uint32_t numSteps = benchmarkDda->Benchmark(msg, initTime, stepTime);
+		reply.lcatf("DDA init %" PRIu32 ", step calc %" PRIu32 " for %" PRIu32 " steps (%" PRIu32 "/step)",
+					initTime * CyclesPerTimestamp, stepTime * CyclesPerTimestamp, numSteps, (numSteps == 0) ? 0 : (stepTime * CyclesPerTimestamp)/numSteps);
+	}
+#endif
+
+#if SUPPORT_CLOSED_LOOP
+	static void BenchmarkSinCos(const StringRef& reply) noexcept
+	{
+		float sine, cosine, total = 0.0;
+		const LatencyHistograms::Timestamp startTime = LatencyHistograms::GetTimestamp();
+		for (unsigned int i = 0; i < Iterations; ++i)
+		{
+			Trigonometry::FastSinCos((uint16_t)(i * 37), sine, cosine);
+			total += sine + cosine;
+		}
+		const uint32_t elapsed = LatencyHistograms::GetTimestamp() - startTime;
+		sink = (uint32_t)total;
+		reply.catf(", FastSinCos %" PRIu32, (elapsed * CyclesPerTimestamp)/Iterations);
+	}
+#endif
+
+	static void BenchmarkAdcFilter(const StringRef& reply) noexcept
+	{
+		AdcAveragingFilter<64> filter;
+		const LatencyHistograms::Timestamp startTime = LatencyHistograms::GetTimestamp();
+		for (unsigned int i = 0; i < Iterations; ++i)
+		{
+			filter.ProcessReading((uint16_t)(2048 + (i & 63)));
+		}
+		const uint32_t elapsed = LatencyHistograms::GetTimestamp() - startTime;
+		sink = filter.GetSum();
+		reply.lcatf("Per call: ADC filter %" PRIu32, (elapsed * CyclesPerTimestamp)/Iterations);
+	}
+}
+
+// Run the benchmarks. Caution: the move benchmark enables the drivers, and the short benchmarks run with interrupts enabled so occasional results may be high.
+GCodeResult Benchmarks::Run(const StringRef& reply) noexcept
+{
+	reply.printf("Benchmarks (cycles):");
+#if SUPPORT_DRIVERS
+	BenchmarkMove(reply);
+#endif
+	BenchmarkAdcFilter(reply);
+#if SUPPORT_CLOSED_LOOP
+	BenchmarkSinCos(reply);
+#endif
+	return GCodeResult::ok;
+}
+
+#endif
+
+// End
@@ -0,0 +1,24 @@
+/*
+ * Benchmarks.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_BENCHMARKS_H_
+#define SRC_BENCHMARKS_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_BENCHMARKS
+
+// Module to run repeatable microbenchmarks of the time-critical code on the board, so that we can catch performance regressions before a release.
+// Results are reported in CPU cycles. On the SAMC21 they are measured using the step timer, so the resolution is 64 cycles.
+namespace Benchmarks
+{
+	GCodeResult Run(const StringRef& reply) noexcept;
+}
+
+#endif
+
+#endif /* SRC_BENCHMARKS_H_ */
@@ -0,0 +1,178 @@
+/*
+ * CanCapture.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "CanCapture.h"
+
+#if SUPPORT_CAN_CAPTURE
+
+#include "CanInterface.h"
+#include <CanMessageBuffer.h>
+#include <RTOSIface/RTOSIface.h>
+#include <Movement/StepTimer.h>
+
+namespace CanCapture
+{
+	constexpr unsigned int RecordVersion = 1;						// increase this if the format of the dump changes
+	constexpr size_t MaxCharsPerMessage = 8 + 1 + 8 + 1 + 2 + 1 + 2 * 64 + 1;	// the most characters that AppendMessages uses for one message
+
+	enum class CaptureMode : uint8_t { idle = 0, capturing, playingBack };
+
+	static CapturedMessage *messages = nullptr;						// the ring, allocated when we first start capturing
+	static size_t nextIndex = 0;									// where we store the next message
+	static size_t numMessages = 0;
+	static uint32_t messagesOverwritten = 0;						// how many of the oldest messages we overwrote because the ring was full
+	static size_t lastMessagesPlayed = 0;
+	static volatile CaptureMode mode = CaptureMode::idle;
+
+	static size_t OldestIndex() noexcept
+	{
+		return (nextIndex + MaxMessages - numMessages) % MaxMessages;
+	}
+
+	static void AppendStatus(const StringRef& reply) noexcept
+	{
+		reply.printf("CAN capture %s, %u messages",
+						(mode == CaptureMode::capturing) ? "capturing" : (mode == CaptureMode::playingBack) ? "playing back" : "stopped", (unsigned int)numMessages);
+		if (numMessages != 0)
+		{
+			reply.catf(" over %.1fms", (double)((float)(messages[(nextIndex + MaxMessages - 1) % MaxMessages].whenReceived - messages[OldestIndex()].whenReceived) * StepTimer::StepClocksToMillis));
+		}
+		reply.catf(", %" PRIu32 " overwritten, %u played last time", messagesOverwritten, (unsigned int)lastMessagesPlayed);
+	}
+}
+
+// Record a message if we are capturing. The general and motion receiver tasks both call this.
+void CanCapture::Record(const CanMessageBuffer *buf) noexcept
+{
+	if (mode == CaptureMode::capturing)
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		TaskCriticalSectionLocker lock;
+		if (mode != CaptureMode::capturing)
+		{
+			return;												// capture was stopped while we were getting the lock
+		}
+
+		CapturedMessage& cm = messages[nextIndex];
+		cm.whenReceived = now;
+		cm.id = buf->id.GetWholeId();
+		cm.dataLength = min<size_t>(buf->dataLength, sizeof(cm.data));
+		memcpy(cm.data, buf->msg.raw, cm.dataLength);
+		nextIndex = (nextIndex + 1) % MaxMessages;
+		if (numMessages < MaxMessages)
+		{
+			++numMessages;
+		}
+		else
+		{
+			++messagesOverwritten;
+		}
+	}
+}
+
+GCodeResult CanCapture::SetMode(uint16_t newMode, const StringRef& reply) noexcept
+{
+	switch (newMode)
+	{
+	case 0:
+		mode = CaptureMode::idle;								// this also stops playback after the current message
+		break;
+
+	case 1:
+		if (mode == CaptureMode::playingBack)
+		{
+			reply.copy("Can't capture during playback");
+			return GCodeResult::error;
+		}
+		if (messages == nullptr)
+		{
+			messages = new CapturedMessage[MaxMessages];
+		}
+		{
+			TaskCriticalSectionLocker lock;
+			nextIndex = numMessages = 0;
+			messagesOverwritten = 0;
+			mode = CaptureMode::capturing;
+		}
+		break;
+
+	case 2:
+		if (mode == CaptureMode::playingBack)
+		{
+			reply.copy("Playback already in progress");
+			return GCodeResult::error;
+		}
+		mode = CaptureMode::idle;								// stop capturing before we play back
+		if (numMessages == 0)
+		{
+			reply.copy("No messages captured");
+			return GCodeResult::error;
+		}
+		mode = CaptureMode::playingBack;
+		CanInterface::StartPlayback();
+		break;
+
+	default:
+		reply.printf("Bad CAN capture mode %u", newMode);
+		return GCodeResult::error;
+	}
+
+	AppendStatus(reply);
+	return GCodeResult::ok;
+}
+
+// Append the captured messages starting at the specified index, as many as will fit in the reply.
+// The format is: version, colon, the number of messages captured, colon, the index of the first message in the reply, colon, then the messages separated by semicolons.
+// Each message is the time it was received in step clocks since the oldest message, the CAN ID and the data length, separated by commas, then a comma and the data bytes.
+// All values are in hex.
+void CanCapture::AppendMessages(const StringRef& reply, unsigned int startIndex) noexcept
+{
+	reply.printf("%u:%x:%x:", RecordVersion, (unsigned int)numMessages, startIndex);
+	if (mode == CaptureMode::capturing || numMessages == 0)
+	{
+		return;													// don't dump the ring while it may be changing
+	}
+
+	const uint32_t firstTime = messages[OldestIndex()].whenReceived;
+	for (size_t i = startIndex; i < numMessages && reply.strlen() + MaxCharsPerMessage < reply.Capacity(); ++i)
+	{
+		const CapturedMessage& cm = GetMessage(i);
+		reply.catf((i == startIndex) ? "%" PRIx32 ",%" PRIx32 ",%x," : ";%" PRIx32 ",%" PRIx32 ",%x,", cm.whenReceived - firstTime, cm.id, cm.dataLength);
+		for (size_t j = 0; j < cm.dataLength; ++j)
+		{
+			reply.catf("%02x", cm.data[j]);
+		}
+	}
+}
+
+bool CanCapture::IsPlayingBack() noexcept
+{
+	return mode == CaptureMode::playingBack;
+}
+
+size_t CanCapture::GetNumMessages() noexcept
+{
+	return numMessages;
+}
+
+const CanCapture::CapturedMessage& CanCapture::GetMessage(size_t index) noexcept
+{
+	return messages[(OldestIndex() + index) % MaxMessages];
+}
+
+void CanCapture::EndPlayback(size_t messagesPlayed) noexcept
+{
+	lastMessagesPlayed = messagesPlayed;
+	if (mode == CaptureMode::playingBack)
+	{
+		mode = CaptureMode::idle;
+	}
+}
+
+#endif
+
+// End
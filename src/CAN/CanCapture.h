@@ -0,0 +1,45 @@
+/*
+ * CanCapture.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_CAN_CANCAPTURE_H_
+#define SRC_CAN_CANCAPTURE_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CAN_CAPTURE
+
+class CanMessageBuffer;
+
+// Module to capture the movement and command messages that we receive from the main board, so that a stream that causes a problem in the field can be
+// dumped over CAN and then played back on the bench with the original timing. The capture is held in a RAM ring that is allocated when we first start capturing.
+// Capturing and playback are selected by diagnostic test 222, and the captured messages are dumped by return info type 27.
+namespace CanCapture
+{
+	constexpr size_t MaxMessages = 128;						// the main board addresses the messages to dump using an 8-bit index
+
+	struct CapturedMessage
+	{
+		uint32_t whenReceived;								// the step clock when we received the message
+		uint32_t id;										// the whole CAN ID
+		uint8_t dataLength;
+		uint8_t data[64];
+	};
+
+	void Record(const CanMessageBuffer *buf) noexcept;		// called by the CAN receiver tasks for each message from the main board
+	GCodeResult SetMode(uint16_t mode, const StringRef& reply) noexcept;	// 0 = stop, 1 = start capturing, 2 = play back the captured messages
+	void AppendMessages(const StringRef& reply, unsigned int startIndex) noexcept;
+
+	// Functions used by the playback task in CanInterface
+	bool IsPlayingBack() noexcept;
+	size_t GetNumMessages() noexcept;
+	const CapturedMessage& GetMessage(size_t index) noexcept;	// index 0 is the oldest message
+	void EndPlayback(size_t messagesPlayed) noexcept;
+}
+
+#endif
+
+#endif /* SRC_CAN_CANCAPTURE_H_ */
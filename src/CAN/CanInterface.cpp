@@ -7,6 +7,12 @@
 
 #include "CanInterface.h"
 #include "CanMessageQueue.h"
+#include "CanStatistics.h"
+#include "CanCapture.h"
+#include <LatencyHistograms.h>
+#include <MemoryArenas.h>
+#include <DiagnosticsRecord.h>
+#include <DeferredLog.h>
 
 #include <CanSettings.h>
 #include <CanMessageFormats.h>
@@ -25,7 +31,9 @@
 #include <Version.h>
 #include <hpl_user_area.h>
 
-#define OOS_DEBUG		0				// debug for out-of-sequence errors
+#if HAS_SMART_DRIVERS
+# include <Movement/StepperDrivers/DriverFaultMonitor.h>
+#endif
 
 #if SAME5x
 constexpr uint32_t CanUserAreaDataOffset = 512 - sizeof(CanUserAreaData);
@@ -33,9 +41,10 @@ constexpr uint32_t CanUserAreaDataOffset = 512 - sizeof(CanUserAreaData);
 constexpr uint32_t CanUserAreaDataOffset = 256 - sizeof(CanUserAreaData);
 #endif
 
-constexpr unsigned int NumCanBuffers = 40;
+constexpr unsigned int NumCanBuffers = NUM_CAN_BUFFERS;
 
 static CanDevice *can0dev = nullptr;
+static Can *can0hw = nullptr;						// the CAN peripheral that can0dev uses, so that we can read the receive FIFO fill levels
 static CanUserAreaData canConfigData;
 static CanAddress boardAddress;
 static CanAddress currentMasterAddress =
@@ -46,24 +55,78 @@ static CanAddress currentMasterAddress =
 #endif
 
 static unsigned int txTimeouts = 0;
+static unsigned int bufferWaits = 0;				// how many times a task had to wait for a free message buffer
+static uint32_t totalBufferWaitTicks = 0, maxBufferWaitTicks = 0;	// how long tasks waited for free message buffers, in step clocks
 static uint32_t lastCancelledId = 0;
 static bool enabled = false;
 
+// Bus error statistics, so that the main board can tell whether the bus topology can sustain a candidate data phase rate.
+// The protocol status register resets the last error codes when it is read, so we only count the ticks in which errors occurred. Accessed in the tick interrupt.
+static uint32_t nominalPhaseErrorTicks = 0;
+static uint32_t dataPhaseErrorTicks = 0;
+static uint8_t lastNominalPhaseError = 0;
+static uint8_t lastDataPhaseError = 0;
+
+// Bus state statistics. When the CAN peripheral goes bus-off it sets CCCR.INIT, and it doesn't start the recovery sequence of 129 x 11 recessive bits until INIT is cleared.
+// We clear INIT from the tick interrupt as soon as we see bus-off, so that we rejoin the bus as soon as the protocol allows. Moves already in the queue keep running meanwhile.
+// Cumulative totals are kept so that periodic telemetry polling and M122 don't interfere with each other.
+static uint32_t busOffEvents = 0;
+static uint32_t errorPassiveEvents = 0;
+static uint32_t lastBusOffAt = 0;									// millis
+static uint32_t lastRecoveredAt = 0;								// millis
+static uint32_t maxRecoveryMillis = 0;
+static uint32_t receiveErrors = 0;
+static bool busOff = false;
+static bool errorPassive = false;
+static volatile bool resyncMotionSequence = false;					// set after we may have missed movement messages
+
+#if SUPPORT_DRIVERS
+constexpr unsigned int RxFifo0Size = 20;
+constexpr unsigned int RxFifo1Size = 12;
+#else
+constexpr unsigned int RxFifo0Size = 32;
+constexpr unsigned int RxFifo1Size = 0;
+#endif
+
 constexpr CanDevice::Config Can0Config =
 {
 	.dataSize = 64,									// must be one of: 8, 12, 16, 20, 24, 32, 48, 64
 	.numTxBuffers = 2,
 	.txFifoSize = 10,								// enough to send a 512-byte response broken into 60-byte fragments
 	.numRxBuffers = 1,								// we use a dedicated buffer for the clock sync messages
-	.rxFifo0Size = 32,
-	.rxFifo1Size = 0,
+	.rxFifo0Size = RxFifo0Size,						// FIFO 0 is for commands and other messages
+	.rxFifo1Size = RxFifo1Size,						// FIFO 1 is for movement messages, so that a burst of other traffic doesn't delay them
 	.numShortFilterElements = 0,
-	.numExtendedFilterElements = 3,
+	.numExtendedFilterElements = 6,
 	.txEventFifoSize = 2
 };
 
 static_assert(Can0Config.IsValid());
 
+// Receive FIFO statistics
+struct RxFifoStats
+{
+	unsigned int maxFill = 0;						// the largest number of messages we found in the FIFO, including the one we just read
+	unsigned int timesFull = 0;						// how many times we found the FIFO full, in which case any further messages were dropped
+
+	void Update(unsigned int fill, unsigned int size) noexcept
+	{
+		if (fill > maxFill) { maxFill = fill; }
+		if (fill >= size) { ++timesFull; }
+	}
+
+	void Report(const StringRef& reply, const char *name, unsigned int size) noexcept
+	{
+		reply.catf(", %s max %u/%u full %u", name, maxFill, size, timesFull);
+		maxFill = timesFull = 0;
+	}
+};
+
+static RxFifoStats rxFifo0Stats;
+#if SUPPORT_DRIVERS
+static RxFifoStats rxFifo1Stats;
+#endif
+
 // CAN buffer memory must be in the first 64Kb of RAM (SAME5x) or in non-cached RAM (SAME70), so put it in its own segment
 static uint32_t can0Memory[Can0Config.GetMemorySize()] __attribute__ ((section (".CanMessage")));
 
@@ -75,9 +138,23 @@ static Task<CanClockTaskStackWords> canClockTask;
 constexpr size_t CanReceiverTaskStackWords = 120;
 static Task<CanReceiverTaskStackWords> canReceiverTask;
 
+#if SUPPORT_DRIVERS
+// CanMotionReceiver task
+constexpr size_t CanMotionReceiverTaskStackWords = 150;
+static Task<CanMotionReceiverTaskStackWords> canMotionReceiverTask;
+#endif
+
 // Async sender task
 constexpr size_t CanAsyncSenderTaskStackWords = 100;
 static Task<CanAsyncSenderTaskStackWords> canAsyncSenderTask;
+static volatile bool asyncSenderCreated = false;			// the drivers task may report a fault before we have created the async sender task
+
+#if SUPPORT_CAN_CAPTURE
+// CanPlayback task, created when we first play back captured messages
+constexpr size_t CanPlaybackTaskStackWords = 150;			// the same as the motion receiver, because it processes the same messages
+static Task<CanPlaybackTaskStackWords> *canPlaybackTask = nullptr;
+constexpr uint32_t PlaybackStartDelayMillis = 10;			// time for the motion receiver to finish any message it was processing when playback started
+#endif
 
 static bool mainBoardAcknowledgedAnnounce = false;	// true after the main board has acknowledged our announcement
 static bool isProgrammed = false;					// true after the main board has sent us any configuration commands
@@ -105,28 +182,40 @@ uint8_t expectedSeq = 0xFF;
 //DEBUG
 //static int32_t accumulatedMotion = 0;
 
-static CanMessageQueue PendingMoves;
+#if SUPPORT_DRIVERS
+// Movement messages are added only by the CAN receiver task and removed only by the Move task, so we can use a lock-free queue.
+// The receiver copies each movement message into the queue and re-uses its buffer immediately, so a burst of moves doesn't use up the message buffers.
+# if SAMC21
+constexpr size_t MoveQueueLength = 16;
+# else
+constexpr size_t MoveQueueLength = 32;
+# endif
+static CanMessageSpscQueue<CanMessageMovementLinear, MoveQueueLength> PendingMoves;
+static size_t maxMoveQueueUsed = 0;
+#endif
 static CanMessageQueue PendingCommands;
 
+// Transmit priority classes. M_CAN transmits whichever is the highest priority of the messages in the dedicated Tx buffers and the message at the head of the Tx FIFO,
+// so urgent messages and replies have their own dedicated buffers and don't wait behind the messages queued in the FIFO.
+// Bulk data gets only some of the FIFO slots, so that status messages never wait behind a full FIFO of bulk data.
 static Mutex txFifoMutex;
-
-#if OOS_DEBUG
-
-struct OosInfo
-{
-	uint8_t seq;
-	uint32_t startTime;
-};
-
-OosInfo oosBuffer[16];
-
-size_t oosCount = 0;
-
-#endif
+static Mutex txUrgentBufferMutex;
+static Mutex txReplyBufferMutex;
+constexpr CanDevice::TxBufferNumber UrgentTxBuffer = CanDevice::TxBufferNumber::buffer0;		// for input monitor changes and events
+constexpr CanDevice::TxBufferNumber ReplyTxBuffer = CanDevice::TxBufferNumber::buffer1;			// for replies to commands
+constexpr unsigned int TxFifoSlotsReservedForNonBulk = 4;									// bulk data may not use the last few free slots of the Tx FIFO
+constexpr unsigned int MaxBulkSendDelayMillis = 100;
+static unsigned int bulkSendDelays = 0;
 
 extern "C" [[noreturn]] void CanClockLoop(void *) noexcept;
 extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept;
+#if SUPPORT_DRIVERS
+extern "C" [[noreturn]] void CanMotionReceiverLoop(void *) noexcept;
+#endif
 extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept;
+#if SUPPORT_CAN_CAPTURE
+extern "C" [[noreturn]] void CanPlaybackLoop(void *) noexcept;
+#endif
 
 namespace CanInterface
 {
@@ -138,6 +227,8 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 {
 	// Create the mutex
 	txFifoMutex.Create("CANtx");
+	txUrgentBufferMutex.Create("CANurgent");
+	txReplyBufferMutex.Create("CANreply");
 
 	// Read the CAN timing data from the top part of the NVM User Row
 	canConfigData = *reinterpret_cast<CanUserAreaData*>(NVMCTRL_USER + CanUserAreaDataOffset);
@@ -176,6 +267,11 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 
 	// Initialise the CAN hardware, using the timing data if it was valid
 	can0dev = CanDevice::Init(0, whichPort, Can0Config, can0Memory, timing, nullptr);
+#if SAME5x
+	can0hw = (whichPort == 0) ? CAN0 : CAN1;
+#else
+	can0hw = CAN0;
+#endif
 
 #ifdef SAMMYC21
 	pinMode(CanStandbyPin, OUTPUT_LOW);							// take the CAN drivers out of standby
@@ -183,21 +279,36 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 
 	boardAddress = canConfigData.GetCanAddress(defaultBoardAddress);
 
-	// Set up CAN receiver filtering
-	// Set up a CAN receive filter to receive all messages addressed to us in FIFO 0
-	can0dev->SetExtendedFilterElement(0, CanDevice::RxBufferNumber::fifo0,
+	// Set up CAN receiver filtering. The filter elements are checked in order and the first one that matches is used.
+	unsigned int filterIndex = 0;
+#if SUPPORT_DRIVERS
+	if (full)
+	{
+		// Set up CAN receive filters to receive movement messages addressed to us in FIFO 1
+		constexpr uint32_t MessageTypeAndDstMask = (0x1FFFFFFF & ~((1u << CanId::MessageTypeShift) - 1)) | (CanId::BoardAddressMask << CanId::DstAddressShift);
+		for (CanMessageType mt : { CanMessageType::movementLinear, CanMessageType::revertPosition, CanMessageType::stopMovement })
+		{
+			can0dev->SetExtendedFilterElement(filterIndex++, CanDevice::RxBufferNumber::fifo1,
+												((uint32_t)mt << CanId::MessageTypeShift) | ((uint32_t)boardAddress << CanId::DstAddressShift),
+												MessageTypeAndDstMask);
+		}
+	}
+#endif
+
+	// Set up a CAN receive filter to receive all other messages addressed to us in FIFO 0
+	can0dev->SetExtendedFilterElement(filterIndex++, CanDevice::RxBufferNumber::fifo0,
 										(uint32_t)boardAddress << CanId::DstAddressShift,
 										CanId::BoardAddressMask << CanId::DstAddressShift);
 
 	if (full)
 	{
 		// Set up a CAN receive filter to receive clock sync messages in buffer 0
-		can0dev->SetExtendedFilterElement(1, CanDevice::RxBufferNumber::buffer0,
+		can0dev->SetExtendedFilterElement(filterIndex++, CanDevice::RxBufferNumber::buffer0,
 											((uint32_t)CanMessageType::timeSync << CanId::MessageTypeShift) | ((uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift),
 											1);					// mask is unused when using a dedicated Rx buffer, but must be nonzero to enable the element
 
 		// Set up a filter for all other broadcast messages in FIFO 0
-		can0dev->SetExtendedFilterElement(2, CanDevice::RxBufferNumber::fifo0,
+		can0dev->SetExtendedFilterElement(filterIndex++, CanDevice::RxBufferNumber::fifo0,
 											(uint32_t)CanId::BroadcastAddress << CanId::DstAddressShift,
 											CanId::BoardAddressMask << CanId::DstAddressShift);
 	}
@@ -210,7 +321,10 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 
 	if (full)
 	{
-		CanMessageBuffer::Init(NumCanBuffers);
+		{
+			MemoryArenas::Scope scope(MemoryArena::canBuffers);
+			CanMessageBuffer::Init(NumCanBuffers);
+		}
 
 		// Create the clock sync
 		canClockTask.Create(CanClockLoop, "CanClock", nullptr, TaskPriority::CanClockPriority);
@@ -218,13 +332,138 @@ void CanInterface::Init(CanAddress defaultBoardAddress, bool useAlternatePins, b
 		// Create the task that receives CAN messages
 		canReceiverTask.Create(CanReceiverLoop, "CanRecv", nullptr, TaskPriority::CanReceiverPriority);
 
+#if SUPPORT_DRIVERS
+		// Create the task that receives movement messages
+		canMotionReceiverTask.Create(CanMotionReceiverLoop, "CanMotion", nullptr, TaskPriority::CanMotionReceiverPriority);
+#endif
+
 		// Create the task that send endstop etc. updates
 		canAsyncSenderTask.Create(CanAsyncSenderLoop, "CanAsync", nullptr, TaskPriority::CanAsyncSenderPriority);
+		asyncSenderCreated = true;
 	}
 
 #if SUPPORT_DRIVERS
 	ResetAdvance();
+	reply.catf(", move queue max %u/%u", maxMoveQueueUsed, MoveQueueLength);
+	maxMoveQueueUsed = 0;
+#endif
+	reply.lcatf("Rx FIFOs");
+	rxFifo0Stats.Report(reply, "commands", RxFifo0Size);
+#if SUPPORT_DRIVERS
+	rxFifo1Stats.Report(reply, "motion", RxFifo1Size);
 #endif
+	CanStatistics::AppendSummary(reply);
+	reply.catf(", bulk send delays %u", bulkSendDelays);
+	bulkSendDelays = 0;
+}
+
+// Sample whether the CAN bus is active. Called from the tick interrupt.
+// Record the error codes in a value read from the protocol status register. Call this with interrupts disabled.
+static void RecordBusErrors(uint32_t psr) noexcept
+{
+	// The error codes are 0 for no error and 7 for no change since the register was last read
+	const uint8_t lec = (psr & CAN_PSR_LEC_Msk) >> CAN_PSR_LEC_Pos;
+	if (lec != 0 && lec != 7)
+	{
+		++nominalPhaseErrorTicks;
+		lastNominalPhaseError = lec;
+	}
+	const uint8_t dlec = (psr & CAN_PSR_DLEC_Msk) >> CAN_PSR_DLEC_Pos;
+	if (dlec != 0 && dlec != 7)
+	{
+		++dataPhaseErrorTicks;
+		lastDataPhaseError = dlec;
+	}
+}
+
+// Track the error passive and bus-off states and start recovery from bus-off. Called from the tick interrupt.
+// We may have missed movement messages while we were bus-off or error passive, so when we leave either state we ask the motion receiver to resync the sequence number.
+static void RecordBusState(uint32_t psr) noexcept
+{
+	const uint32_t now = millis();
+	if (psr & CAN_PSR_BO)
+	{
+		if (!busOff)
+		{
+			busOff = true;
+			++busOffEvents;
+			lastBusOffAt = now;
+		}
+		if (enabled && (can0hw->CCCR.reg & CAN_CCCR_INIT) != 0)
+		{
+			can0hw->CCCR.reg &= ~CAN_CCCR_INIT;								// start the bus-off recovery sequence
+		}
+	}
+	else if (busOff)
+	{
+		busOff = false;
+		lastRecoveredAt = now;
+		if (now - lastBusOffAt > maxRecoveryMillis)
+		{
+			maxRecoveryMillis = now - lastBusOffAt;
+		}
+		resyncMotionSequence = true;
+	}
+
+	const bool nowErrorPassive = (psr & CAN_PSR_EP) != 0;
+	if (nowErrorPassive != errorPassive)
+	{
+		errorPassive = nowErrorPassive;
+		if (nowErrorPassive)
+		{
+			++errorPassiveEvents;
+		}
+		else
+		{
+			resyncMotionSequence = true;
+		}
+	}
+}
+
+void CanInterface::SampleBusActivity() noexcept
+{
+	if (can0hw != nullptr)
+	{
+		const uint32_t psr = can0hw->PSR.reg;
+		CanStatistics::RecordBusActivity(((psr & CAN_PSR_ACT_Msk) >> CAN_PSR_ACT_Pos) >= 2);		// ACT is 2 when receiving and 3 when transmitting
+		RecordBusErrors(psr);
+		RecordBusState(psr);
+	}
+}
+
+// Append the bus error counters and the transmitter delay compensation value, then reset the counters.
+// The main board reads these from every board after running traffic at a candidate data phase rate, to find the fastest rate that all the boards receive reliably.
+// The format is: version, colon, then transmit error count, receive error count, CAN error logging count, nominal phase error ticks, data phase error ticks,
+// last nominal phase error code, last data phase error code, transmitter delay compensation value, and 1 if the last message received was FD with bit rate switching.
+void CanInterface::AppendBusHealth(const StringRef& reply) noexcept
+{
+	constexpr unsigned int BusHealthVersion = 1;
+	if (can0hw == nullptr)
+	{
+		reply.copy("CAN not initialised");
+		return;
+	}
+
+	uint32_t ecr, psr, nominalErrors, dataErrors;
+	uint8_t lastNominal, lastData;
+	{
+		AtomicCriticalSectionLocker lock;
+		ecr = can0hw->ECR.reg;												// reading this resets the error logging count
+		psr = can0hw->PSR.reg;
+		RecordBusErrors(psr);
+		nominalErrors = nominalPhaseErrorTicks;
+		dataErrors = dataPhaseErrorTicks;
+		lastNominal = lastNominalPhaseError;
+		lastData = lastDataPhaseError;
+		nominalPhaseErrorTicks = dataPhaseErrorTicks = 0;
+		lastNominalPhaseError = lastDataPhaseError = 0;
+	}
+
+	reply.printf("%u:%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%u,%u,%" PRIu32 ",%u",
+					BusHealthVersion,
+					(ecr & CAN_ECR_TEC_Msk) >> CAN_ECR_TEC_Pos, (ecr & CAN_ECR_REC_Msk) >> CAN_ECR_REC_Pos, (ecr & CAN_ECR_CEL_Msk) >> CAN_ECR_CEL_Pos,
+					nominalErrors, dataErrors, lastNominal, lastData,
+					(psr & CAN_PSR_TDCV_Msk) >> CAN_PSR_TDCV_Pos, (unsigned int)((psr & CAN_PSR_RBRS) != 0));
 }
 
 // Shutdown is called when we are asked to update the firmware.
@@ -239,6 +478,10 @@ void CanInterface::Shutdown() noexcept
 
 	// It's safe to terminate the tasks even if they haven't been created
 	canReceiverTask.TerminateAndUnlink();
+#if SUPPORT_DRIVERS
+	canMotionReceiverTask.TerminateAndUnlink();
+#endif
+	asyncSenderCreated = false;
 	canAsyncSenderTask.TerminateAndUnlink();
 }
 
@@ -252,235 +495,426 @@ CanAddress CanInterface::GetCurrentMasterAddress() noexcept
 	return currentMasterAddress;
 }
 
-// Send a message. On return the buffer is available to the caller to re-use or free.
-// Any extra bytes needed as padding are set to zero by the CAN driver.
-bool CanInterface::Send(CanMessageBuffer *buf) noexcept
+// Send a message using the specified Tx buffer or the FIFO
+static bool DoSend(CanDevice::TxBufferNumber whichBuffer, Mutex& mutex, CanMessageBuffer *buf, uint32_t startTime) noexcept
 {
 	//TODO option to not force sending, and return true only if successful?
-	MutexLocker lock(txFifoMutex);
-	const uint32_t cancelledId = can0dev->SendMessage(CanDevice::TxBufferNumber::fifo, 1000, buf);
+	MutexLocker lock(mutex);
+	const uint32_t cancelledId = can0dev->SendMessage(whichBuffer, 1000, buf);
 	if (cancelledId != 0)
 	{
 		lastCancelledId = cancelledId;
 		++txTimeouts;
 	}
+	CanStatistics::RecordSent(buf->id.MsgType(), buf->dataLength, StepTimer::GetTimerTicks() - startTime);
 	return true;
 }
 
+// Send a message. On return the buffer is available to the caller to re-use or free.
+// Any extra bytes needed as padding are set to zero by the CAN driver.
+bool CanInterface::Send(CanMessageBuffer *buf) noexcept
+{
+	return DoSend(CanDevice::TxBufferNumber::fifo, txFifoMutex, buf, StepTimer::GetTimerTicks());
+}
+
+// Send a high priority message such as an input monitor change or an event. This doesn't wait for messages in the Tx FIFO to be sent.
 bool CanInterface::SendAsync(CanMessageBuffer *buf) noexcept
 {
-	//TODO use a dedicated buffer to send these high-priority messages
-	return Send(buf);
+	return DoSend(UrgentTxBuffer, txUrgentBufferMutex, buf, StepTimer::GetTimerTicks());
 }
 
-bool CanInterface::SendAndFree(CanMessageBuffer *buf) noexcept
+// Send a reply to a command. Replies have their own Tx buffer so that they don't wait for messages in the Tx FIFO to be sent, and fragments are sent in order.
+bool CanInterface::SendReply(CanMessageBuffer *buf) noexcept
 {
-	const bool ok = Send(buf);
+	return DoSend(ReplyTxBuffer, txReplyBufferMutex, buf, StepTimer::GetTimerTicks());
+}
+
+bool CanInterface::SendReplyAndFree(CanMessageBuffer *buf) noexcept
+{
+	const bool ok = SendReply(buf);
 	CanMessageBuffer::Free(buf);
 	return ok;
 }
 
-// Return a move message, if there is one. Caller must free the message buffer.
-CanMessageBuffer * CanInterface::GetCanMove(uint32_t timeout) noexcept
+// Send a bulk data message such as closed loop or accelerometer data. We wait until there are enough free slots in the Tx FIFO that other messages won't be held up.
+bool CanInterface::SendBulk(CanMessageBuffer *buf) noexcept
+{
+	const uint32_t startTime = StepTimer::GetTimerTicks();
+	if (can0hw->TXFQS.bit.TFFL <= TxFifoSlotsReservedForNonBulk)
+	{
+		++bulkSendDelays;
+		unsigned int millisWaited = 0;
+		do
+		{
+			delay(1);
+		} while (can0hw->TXFQS.bit.TFFL <= TxFifoSlotsReservedForNonBulk && ++millisWaited < MaxBulkSendDelayMillis);	// if the bus isn't working, don't wait for ever
+	}
+	return DoSend(CanDevice::TxBufferNumber::fifo, txFifoMutex, buf, startTime);
+}
+
+#if SUPPORT_DRIVERS
+
+// Return a move message, if there is one. The message remains valid until the caller calls FinishedWithCanMove.
+const CanMessageMovementLinear *CanInterface::GetCanMove(uint32_t timeout) noexcept
+{
+	return PendingMoves.BeginGet(timeout);
+}
+
+// Release the move message returned by GetCanMove
+void CanInterface::FinishedWithCanMove() noexcept
+{
+	PendingMoves.EndGet();
+}
+
+void CanInterface::InterruptCanMoveWait() noexcept
+{
+	PendingMoves.InterruptGet();
+}
+
+// Add a move message to the queue, waiting if the queue is full. Called only by the task that receives movement messages.
+static void QueueMove(const CanMessageMovementLinear& msg) noexcept
 {
-	return PendingMoves.GetMessage(timeout);
+	CanMessageMovementLinear * const slot = PendingMoves.BeginPut(TaskBase::TimeoutUnlimited);
+	*slot = msg;
+	PendingMoves.EndPut();
+	const size_t used = PendingMoves.GetUsed();
+	if (used > maxMoveQueueUsed)
+	{
+		maxMoveQueueUsed = used;
+	}
 }
 
+#endif
+
 CanMessageBuffer *CanInterface::GetCanCommand(uint32_t timeout) noexcept
 {
 	return PendingCommands.GetMessage(timeout);
 }
 
-// Process a received message. Return the buffer it arrived in if it is free for re-use, else nullptr.
-CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) noexcept
+#if SUPPORT_DRIVERS
+
+// Sequence number tracking for movement messages. The sequence numbers are 7 bits.
+// Bit n of seqWindow is set if we have accepted the move with sequence number expectedSeq - 1 - n, so that we can discard duplicates anywhere in the window.
+// Because of a bug in the CAN hardware, a message can arrive just after the one that followed it. So we hold moves that arrive a little ahead of the one expected
+// and queue them in sequence when the missing one arrives. If it hasn't arrived after MaxMoveHoldMillis we assume it was lost and queue the held moves anyway.
+constexpr unsigned int MaxMovesHeld = 2;
+constexpr uint32_t MaxMoveHoldMillis = 2;
+constexpr unsigned int SeqWindowSize = 32;
+
+struct HeldMove
 {
-	// Only respond to messages from a master address
-#if defined(ATEIO) || defined(ATECM)
-	if (buf->id.Src() == CanId::ATEMasterAddress)			// ATE boards only respond to the ATE master, because a main board under test may also transmit when it starts up
-#else
-	if (buf->id.Src() == CanId::MasterAddress || buf->id.Src() == CanId::ATEMasterAddress)
-#endif
+	CanMessageMovementLinear msg;
+	uint16_t timeStamp;
+	bool valid;
+};
+
+static uint32_t seqWindow = 0;
+static HeldMove heldMoves[MaxMovesHeld];							// heldMoves[n] holds the move with sequence number expectedSeq + 1 + n
+static unsigned int numMovesHeld = 0;
+static unsigned int reorderedMoves = 0, missingMoves = 0;
+
+// Convert a move whose sequence number has been checked to local time and add it to the move queue
+static void QueueCheckedMove(CanMessageMovementLinear& move, uint16_t timeStamp) noexcept
+{
+	//TODO if we haven't established time sync yet then we should defer this
+# if 0
+	//DEBUG
+	static uint32_t lastMoveEndedAt = 0;
+	if (lastMoveEndedAt != 0)
 	{
-		switch (buf->id.MsgType())
+		const int32_t gap = (int32_t)(move.whenToExecute - lastMoveEndedAt);
+		if (gap < 0)
 		{
-#if SUPPORT_DRIVERS
-		case CanMessageType::movementLinear:
-			// Check for duplicate and out-of-sequence message
-			// We can get out-of-sequence messages because of a bug in the CAN hardware; so use only the sequence number to detect duplicates
+			++badMoveCommands;
+			if ((uint32_t)(-gap) > worstBadMove)
 			{
-				const int8_t seq = buf->msg.moveLinear.seq;
-				if (((seq + 1) & 0x7F) == expectedSeq)
-				{
-					++duplicateMotionMessages;
-#if OOS_DEBUG
-					if (oosCount != 0)
-					{
-						oosBuffer[oosCount].seq = buf->msg.moveLinear.seq;
-						oosBuffer[oosCount].startTime = buf->msg.moveLinear.whenToExecute;
-					}
-#endif
-					break;
-				}
+				worstBadMove = (uint32_t)(-gap);
+			}
+		}
+	}
+	lastMoveEndedAt = move.whenToExecute + move.accelerationClocks + move.steadyClocks + move.decelClocks;
+# endif
+	move.whenToExecute = StepTimer::ConvertToLocalTime(move.whenToExecute);
 
-				lastMotionMessageScheduledTime = buf->msg.moveLinear.whenToExecute;
-				lastMotionMessageReceivedAt = millis();
+	// Correct the move phase durations for the difference between the local and master clock rates, so that long moves finish at the right master time.
+	// We convert the cumulative times so that the rounding errors don't accumulate over the three phases.
+	{
+		const uint32_t accelEnd = StepTimer::ConvertToLocalDuration(move.accelerationClocks);
+		const uint32_t decelStart = StepTimer::ConvertToLocalDuration(move.accelerationClocks + move.steadyClocks);
+		const uint32_t moveEnd = StepTimer::ConvertToLocalDuration(move.accelerationClocks + move.steadyClocks + move.decelClocks);
+		move.accelerationClocks = accelEnd;
+		move.steadyClocks = decelStart - accelEnd;
+		move.decelClocks = moveEnd - decelStart;
+	}
 
-				if (seq != expectedSeq && expectedSeq != 0xFF)
-				{
-					switch ((seq - expectedSeq) & 0x7F)
-					{
-					case 1:
-						++oosMessages1Ahead;
-						break;
+	// Track how much processing delay there was
+	{
+		const uint16_t timeStampNow = CanInterface::GetTimeStampCounter();
 
-					case 2:
-						++oosMessages2Ahead;
-						break;
+		// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the delay to in step clocks.
+		// Datasheet suggests that on the SAMC21 only 15 bits of timestamp counter are readable, but Microchip confirmed this is a documentation error (case 00625843)
+		const uint32_t timeStampDelay = ((uint32_t)((timeStampNow - timeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;	// timestamp counter is 16 bits
+		if (timeStampDelay > maxMotionProcessingDelay)
+		{
+			maxMotionProcessingDelay = timeStampDelay;
+		}
+	}
 
-					case 0x7E:
-						++oosMessages2Behind;
-						break;
+	// Track how much we are given moves in advance
+	{
+		const int32_t advance = (int32_t)(move.whenToExecute - StepTimer::GetTimerTicks());
+		if (advance < minAdvance)
+		{
+			minAdvance = advance;
+		}
+		if (advance > maxAdvance)
+		{
+			maxAdvance = advance;
+		}
+	}
 
-					default:
-						++oosMessagesOther;
-						break;
-					}
-#if OOS_DEBUG
-					if (oosCount == 0)
-					{
-						qq;
-						oosCount = 1;
-					}
-#endif
-				}
+	QueueMove(move);
+	Platform::OnProcessingCanMessage();
+}
 
-#if OOS_DEBUG
-				if (oosCount != 0)
-				{
-					oosBuffer[oosCount].seq = seq;
-					oosBuffer[oosCount].startTime = buf->msg.moveLinear.whenToExecute;
-				}
-#endif
-				expectedSeq = (seq + 1) & 0x7F;
-			}
+// Move on to the next sequence number after accepting the expected move or giving up waiting for it, then queue any held moves that are now in sequence
+static void AdvanceSequence(bool accepted) noexcept
+{
+	expectedSeq = (expectedSeq + 1) & 0x7F;
+	seqWindow = (seqWindow << 1) | ((accepted) ? 1u : 0u);
+	while (numMovesHeld != 0)
+	{
+		// heldMoves[0] is the slot for sequence number expectedSeq now
+		const bool inSequence = heldMoves[0].valid;
+		if (inSequence)
+		{
+			++reorderedMoves;
+			QueueCheckedMove(heldMoves[0].msg, heldMoves[0].timeStamp);
+			--numMovesHeld;
+		}
+		for (size_t i = 1; i < MaxMovesHeld; ++i)
+		{
+			heldMoves[i - 1] = heldMoves[i];
+		}
+		heldMoves[MaxMovesHeld - 1].valid = false;
+		if (!inSequence)
+		{
+			break;
+		}
+		expectedSeq = (expectedSeq + 1) & 0x7F;
+		seqWindow = (seqWindow << 1) | 1u;
+	}
+}
 
-			//TODO if we haven't established time sync yet then we should defer this
-# if 0
-			//DEBUG
-			static uint32_t lastMoveEndedAt = 0;
-			if (lastMoveEndedAt != 0)
+// Give up waiting for the moves missing before the held ones and queue the held moves
+static void FlushHeldMoves() noexcept
+{
+	while (numMovesHeld != 0)
+	{
+		++missingMoves;
+		AdvanceSequence(false);
+	}
+}
+
+// Check the sequence number of a movement message and queue it, hold it or discard it
+static void ReceiveMove(CanMessageBuffer *buf) noexcept
+{
+	CanMessageMovementLinear& move = buf->msg.moveLinear;
+	if (resyncMotionSequence)
+	{
+		// We may have missed some messages while the bus was recovering from errors, so accept whatever sequence number comes next
+		resyncMotionSequence = false;
+		FlushHeldMoves();
+		expectedSeq = 0xFF;
+	}
+
+	const uint8_t seq = move.seq & 0x7F;
+	if (expectedSeq != 0xFF)
+	{
+		const unsigned int ahead = (seq - expectedSeq) & 0x7F;
+		if (ahead != 0 && ahead <= MaxMovesHeld)
+		{
+			HeldMove& held = heldMoves[ahead - 1];
+			if (held.valid)
+			{
+				++duplicateMotionMessages;
+			}
+			else
 			{
-				const int32_t gap = (int32_t)(buf->msg.moveLinear.whenToExecute - lastMoveEndedAt);
-				if (gap < 0)
+				held.msg = move;
+				held.timeStamp = buf->timeStamp;
+				held.valid = true;
+				++numMovesHeld;
+				if (ahead == 1)
 				{
-					++badMoveCommands;
-					if ((uint32_t)(-gap) > worstBadMove)
-					{
-						worstBadMove = (uint32_t)(-gap);
-					}
+					++oosMessages1Ahead;
+				}
+				else
+				{
+					++oosMessages2Ahead;
 				}
 			}
-			lastMoveEndedAt = buf->msg.moveLinear.whenToExecute + buf->msg.moveLinear.accelerationClocks + buf->msg.moveLinear.steadyClocks + buf->msg.moveLinear.decelClocks;
-# endif
-			buf->msg.moveLinear.whenToExecute += StepTimer::GetLocalTimeOffset();
+			return;
+		}
 
-			// Track how much processing delay there was
+		if (ahead != 0)
+		{
+			const unsigned int behind = (expectedSeq - 1 - seq) & 0x7F;
+			if (behind < SeqWindowSize)
 			{
-				const uint16_t timeStampNow = CanInterface::GetTimeStampCounter();
-
-				// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the delay to in step clocks.
-				// Datasheet suggests that on the SAMC21 only 15 bits of timestamp counter are readable, but Microchip confirmed this is a documentation error (case 00625843)
-				const uint32_t timeStampDelay = ((uint32_t)((timeStampNow - buf->timeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;	// timestamp counter is 16 bits
-				if (timeStampDelay > maxMotionProcessingDelay)
+				if (seqWindow & (1u << behind))
 				{
-					maxMotionProcessingDelay = timeStampDelay;
+					++duplicateMotionMessages;
+					return;
 				}
-			}
 
-			// Track how much we are given moves in advance
-			{
-				const int32_t advance = (int32_t)(buf->msg.moveLinear.whenToExecute - StepTimer::GetTimerTicks());
-				if (advance < minAdvance)
+				// This is a move that we gave up waiting for. Queue it late rather than lose its steps.
+				seqWindow |= 1u << behind;
+				if (behind == 1)
 				{
-					minAdvance = advance;
+					++oosMessages2Behind;
 				}
-				if (advance > maxAdvance)
+				else
 				{
-					maxAdvance = advance;
+					++oosMessagesOther;
 				}
+				lastMotionMessageScheduledTime = move.whenToExecute;
+				lastMotionMessageReceivedAt = millis();
+				QueueCheckedMove(move, buf->timeStamp);
+				return;
 			}
 
-			//DEBUG
-			//accumulatedMotion +=buf->msg.moveLinear.perDrive[0].steps;
-			//END
-			PendingMoves.AddMessage(buf);
-			Platform::OnProcessingCanMessage();
-			return nullptr;
+			// Too far out of sequence, so we must have lost some messages. Queue the held moves and restart the sequence from this one.
+			++oosMessagesOther;
+			FlushHeldMoves();
+			expectedSeq = 0xFF;
+		}
+	}
 
-		case CanMessageType::stopMovement:
-			moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
+	if (expectedSeq == 0xFF)
+	{
+		expectedSeq = seq;
+		seqWindow = 0;
+	}
+	lastMotionMessageScheduledTime = move.whenToExecute;
+	lastMotionMessageReceivedAt = millis();
+	QueueCheckedMove(move, buf->timeStamp);
+	AdvanceSequence(true);
+}
+
+// Process a movement message. Return true if it was a movement message, false if it was some other type.
+// Called by the motion receiver task, which is the only task that receives movement messages when the CAN filters have been fully configured.
+static bool ProcessMotionMessage(CanMessageBuffer *buf) noexcept
+{
+	switch (buf->id.MsgType())
+	{
+	case CanMessageType::movementLinear:
+		ReceiveMove(buf);
+		break;
+
+	case CanMessageType::stopMovement:
+		FlushHeldMoves();										// keep the moves in the order they were sent
+		moveInstance->StopDrivers(buf->msg.stopMovement.whichDrives);
 # if 0
-			//DEBUG
-			lastMoveEndedAt = 0;
+		//DEBUG
+		lastMoveEndedAt = 0;
 # endif
-			Platform::OnProcessingCanMessage();
-			break;
+		Platform::OnProcessingCanMessage();
+		break;
 
-		case CanMessageType::revertPosition:
+	case CanMessageType::revertPosition:
+		FlushHeldMoves();
+		{
+			// Generate a regular movement message from this revert message. First, extract the data so that we can use the same buffer, in case we are short of buffers.
+			int32_t stepsToTake[NumDrivers];
+			size_t index = 0;
+			bool needSteps = false;
+			const volatile int32_t * const lastMoveStepsTaken = moveInstance->GetLastMoveStepsTaken();
+			for (size_t driver = 0; driver < NumDrivers; ++driver)
 			{
-				// Generate a regular movement message from this revert message. First, extract the data so that we can use the same buffer, in case we are short of buffers.
-				int32_t stepsToTake[NumDrivers];
-				size_t index = 0;
-				bool needSteps = false;
-				const volatile int32_t * const lastMoveStepsTaken = moveInstance->GetLastMoveStepsTaken();
-				for (size_t driver = 0; driver < NumDrivers; ++driver)
+				int32_t steps = 0;
+				if (buf->msg.revertPosition.whichDrives & (1u << driver))
 				{
-					int32_t steps = 0;
-					if (buf->msg.revertPosition.whichDrives & (1u << driver))
+					const int32_t stepsWanted = buf->msg.revertPosition.finalStepCounts[index++];
+					const int32_t stepsTaken = lastMoveStepsTaken[driver];
+					if (((stepsWanted >= 0 && stepsTaken > stepsWanted) || (stepsWanted <= 0 && stepsTaken < stepsWanted)))
 					{
-						const int32_t stepsWanted = buf->msg.revertPosition.finalStepCounts[index++];
-						const int32_t stepsTaken = lastMoveStepsTaken[driver];
-						if (((stepsWanted >= 0 && stepsTaken > stepsWanted) || (stepsWanted <= 0 && stepsTaken < stepsWanted)))
-						{
-							steps = stepsWanted - stepsTaken;
-							needSteps = true;
-						}
+						steps = stepsWanted - stepsTaken;
+						needSteps = true;
 					}
-					stepsToTake[driver] = steps;
-				}
-
-				if (!needSteps)
-				{
-					break;
 				}
+				stepsToTake[driver] = steps;
+			}
 
-				const uint32_t clocksAllowed = buf->msg.revertPosition.clocksAllowed;
+			if (!needSteps)
+			{
+				break;
+			}
 
-				// Now we can re-use the buffer to build a regular movement message
-				auto msg = buf->SetupRequestMessage<CanMessageMovementLinear>(0, GetCurrentMasterAddress(), GetCanAddress());
-				for (size_t driver = 0; driver < NumDrivers; ++driver)
-				{
-					msg->perDrive[driver].steps = stepsToTake[driver];
-				}
+			const uint32_t clocksAllowed = buf->msg.revertPosition.clocksAllowed;
 
-				// Set up some reasonable parameters for this move. The move must be shorter than clocksAllowed.
-				// When writing this, clocksAllowed was equivalent to 40ms.
-				// We allow 10ms delay time to allow the motor to stop and reverse direction, 10ms acceleration time, 5ms steady time and 10ms deceleration time.
-				msg->accelerationClocks = msg->decelClocks = clocksAllowed/4;
-				msg->steadyClocks = clocksAllowed/8;
-				msg->whenToExecute = StepTimer::GetTimerTicks() + clocksAllowed/4;
-				msg->numDrivers = NumDrivers;
-				msg->pressureAdvanceDrives = 0;
-				msg->seq = 0;
-				msg->initialSpeedFraction = msg->finalSpeedFraction = 0.0;
+			// Now we can re-use the buffer to build a regular movement message
+			auto msg = buf->SetupRequestMessage<CanMessageMovementLinear>(0, CanInterface::GetCurrentMasterAddress(), CanInterface::GetCanAddress());
+			for (size_t driver = 0; driver < NumDrivers; ++driver)
+			{
+				msg->perDrive[driver].steps = stepsToTake[driver];
 			}
-			PendingMoves.AddMessage(buf);
-			Platform::OnProcessingCanMessage();
-			return nullptr;
+
+			// Set up some reasonable parameters for this move. The move must be shorter than clocksAllowed.
+			// When writing this, clocksAllowed was equivalent to 40ms.
+			// We allow 10ms delay time to allow the motor to stop and reverse direction, 10ms acceleration time, 5ms steady time and 10ms deceleration time.
+			msg->accelerationClocks = msg->decelClocks = clocksAllowed/4;
+			msg->steadyClocks = clocksAllowed/8;
+			msg->whenToExecute = StepTimer::GetTimerTicks() + clocksAllowed/4;
+			msg->numDrivers = NumDrivers;
+			msg->pressureAdvanceDrives = 0;
+			msg->seq = 0;
+			msg->initialSpeedFraction = msg->finalSpeedFraction = 0.0;
+			QueueMove(*msg);
+		}
+		Platform::OnProcessingCanMessage();
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+#endif
+
+// Return true if a received message is from a master address
+static inline bool IsFromMaster(const CanMessageBuffer *buf) noexcept
+{
+#if defined(ATEIO) || defined(ATECM)
+	return buf->id.Src() == CanId::ATEMasterAddress;			// ATE boards only respond to the ATE master, because a main board under test may also transmit when it starts up
+#else
+	return buf->id.Src() == CanId::MasterAddress || buf->id.Src() == CanId::ATEMasterAddress;
+#endif
+}
+
+// Process a received message. Return the buffer it arrived in if it is free for re-use, else nullptr.
+CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) noexcept
+{
+	// Only respond to messages from a master address
+	if (IsFromMaster(buf))
+	{
+#if SUPPORT_CAN_CAPTURE
+		CanCapture::Record(buf);
+#endif
+		switch (buf->id.MsgType())
+		{
+#if SUPPORT_DRIVERS
+		case CanMessageType::movementLinear:
+		case CanMessageType::stopMovement:
+		case CanMessageType::revertPosition:
+			ProcessMotionMessage(buf);					// these are normally received in FIFO 1 by the motion receiver task
+			break;
 #endif
 
 		case CanMessageType::emergencyStop:
-			Platform::EmergencyStop();
+			Platform::EmergencyStop(buf->timeStamp);
 			break;
 
 		case CanMessageType::acknowledgeAnnounce:
@@ -491,7 +925,7 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 		case CanMessageType::startup:
 			if (millis() > 1000 || isProgrammed)		// if we've only just powered up and the main board hasn't programmed us yet, no need to start up again
 			{
-				Platform::EmergencyStop();
+				Platform::EmergencyStop(buf->timeStamp);
 			}
 			else
 			{
@@ -501,7 +935,7 @@ CanMessageBuffer *CanInterface::ProcessReceivedMessage(CanMessageBuffer *buf) no
 			break;
 
 		case CanMessageType::controlledStop:
-			debugPrintf("Unsupported CAN message type %u\n", (unsigned int)(buf->id.MsgType()));
+			logPrintf("Unsupported CAN message type %u\n", (unsigned int)(buf->id.MsgType()));
 			Platform::OnProcessingCanMessage();
 			break;
 
@@ -526,6 +960,10 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 	reply.lcatf("CAN messages queued %u, send timeouts %u, received %u, lost %u, free buffers %u, min %u, error reg %" PRIx32,
 					messagesQueuedForSending, txTimeouts, messagesReceived, messagesLost, CanMessageBuffer::GetFreeBuffers(), CanMessageBuffer::GetAndClearMinFreeBuffers(), can0dev->GetErrorRegister());
 	txTimeouts = 0;
+	reply.lcatf("CAN buffer pool %u, waits %u, total wait %.1fms, max wait %.2fms",
+					NumCanBuffers, bufferWaits, (double)((float)totalBufferWaitTicks * StepTimer::StepClocksToMillis), (double)((float)maxBufferWaitTicks * StepTimer::StepClocksToMillis));
+	bufferWaits = 0;
+	totalBufferWaitTicks = maxBufferWaitTicks = 0;
 	if (lastCancelledId != 0)
 	{
 		CanId id;
@@ -533,10 +971,23 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 		lastCancelledId = 0;
 		reply.lcatf("Last cancelled message type %u dest %u", (unsigned int)id.MsgType(), id.Dst());
 	}
+	reply.lcatf("CAN bus-off %" PRIu32 ", error passive %" PRIu32 ", max recovery %" PRIu32 "ms, receive errors %" PRIu32 ", state %s",
+					busOffEvents, errorPassiveEvents, maxRecoveryMillis, receiveErrors, (busOff) ? "bus-off" : (errorPassive) ? "error passive" : "ok");
+	if (busOffEvents != 0)
+	{
+		const uint32_t now = millis();
+		reply.catf(", last bus-off %.1fs ago", (double)((float)(now - lastBusOffAt) * 0.001));
+		if (!busOff)
+		{
+			reply.catf(", recovered %.1fs ago", (double)((float)(now - lastRecoveredAt) * 0.001));
+		}
+	}
 #if SUPPORT_DRIVERS
-	reply.lcatf("dup %u, oos %u/%u/%u/%u, bm %u, wbm %" PRIu32 ", rxMotionDelay %" PRIu32,
-					duplicateMotionMessages, oosMessages1Ahead, oosMessages2Ahead, oosMessages2Behind, oosMessagesOther, badMoveCommands, worstBadMove, maxMotionProcessingDelay);
+	reply.lcatf("dup %u, oos %u/%u/%u/%u, reordered %u, missing %u, bm %u, wbm %" PRIu32 ", rxMotionDelay %" PRIu32,
+					duplicateMotionMessages, oosMessages1Ahead, oosMessages2Ahead, oosMessages2Behind, oosMessagesOther, reorderedMoves, missingMoves,
+					badMoveCommands, worstBadMove, maxMotionProcessingDelay);
 	duplicateMotionMessages = oosMessages1Ahead = oosMessages2Ahead = oosMessages2Behind = oosMessagesOther = badMoveCommands = 0;
+	reorderedMoves = missingMoves = 0;
 	worstBadMove = maxMotionProcessingDelay = 0;
 	if (minAdvance <= maxAdvance)
 	{
@@ -546,6 +997,48 @@ void CanInterface::Diagnostics(const StringRef& reply) noexcept
 #endif
 }
 
+// Report the CAN counters for the compact diagnostics record, resetting them in the same way as Diagnostics does unless it is a telemetry record.
+// The CAN device message counts and the minimum free buffers can only be read by resetting them, so a telemetry record doesn't include them.
+void CanInterface::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
+{
+	if (rec.ResetCounters())
+	{
+		unsigned int messagesQueuedForSending, messagesReceived, messagesLost, busOffCount;
+		can0dev->GetAndClearStats(messagesQueuedForSending, messagesReceived, messagesLost, busOffCount);
+		rec.Set(DiagnosticsField::canMessagesQueued, messagesQueuedForSending);
+		rec.Set(DiagnosticsField::canMessagesReceived, messagesReceived);
+		rec.Set(DiagnosticsField::canMessagesLost, messagesLost);
+		rec.Set(DiagnosticsField::canMinFreeBuffers, CanMessageBuffer::GetAndClearMinFreeBuffers());
+	}
+	rec.Set(DiagnosticsField::canSendTimeouts, txTimeouts);
+	rec.Set(DiagnosticsField::canFreeBuffers, CanMessageBuffer::GetFreeBuffers());
+	rec.Set(DiagnosticsField::canErrorRegister, can0dev->GetErrorRegister());
+	rec.Set(DiagnosticsField::canBufferWaits, bufferWaits);
+	rec.Set(DiagnosticsField::canMaxBufferWait, maxBufferWaitTicks);
+	rec.Set(DiagnosticsField::canBusOffs, busOffEvents);
+	rec.Set(DiagnosticsField::canErrorPassives, errorPassiveEvents);
+	rec.Set(DiagnosticsField::canMaxBusOffRecovery, maxRecoveryMillis);
+	rec.Set(DiagnosticsField::canReceiveErrors, receiveErrors);
+#if SUPPORT_DRIVERS
+	rec.Set(DiagnosticsField::canDuplicateMotion, duplicateMotionMessages);
+	rec.Set(DiagnosticsField::canOutOfSequence, oosMessages1Ahead + oosMessages2Ahead + oosMessages2Behind + oosMessagesOther);
+	rec.Set(DiagnosticsField::canBadMoves, badMoveCommands);
+	rec.Set(DiagnosticsField::canMaxMotionDelay, maxMotionProcessingDelay);
+#endif
+	if (rec.ResetCounters())
+	{
+		txTimeouts = 0;
+		bufferWaits = 0;
+		totalBufferWaitTicks = maxBufferWaitTicks = 0;
+#if SUPPORT_DRIVERS
+		duplicateMotionMessages = oosMessages1Ahead = oosMessages2Ahead = oosMessages2Behind = oosMessagesOther = badMoveCommands = 0;
+		reorderedMoves = missingMoves = 0;
+		worstBadMove = maxMotionProcessingDelay = 0;
+		ResetAdvance();
+#endif
+	}
+}
+
 // Send an announcement message if we need to, returning true if we sent one. On return the buffer is available to use again.
 bool CanInterface::SendAnnounce(CanMessageBuffer *buf) noexcept
 {
@@ -567,6 +1060,15 @@ bool CanInterface::SendAnnounce(CanMessageBuffer *buf) noexcept
 	return true;
 }
 
+// Wake up the async sender task from another task
+void CanInterface::WakeAsyncSender() noexcept
+{
+	if (asyncSenderCreated)
+	{
+		canAsyncSenderTask.Give();
+	}
+}
+
 void CanInterface::WakeAsyncSenderFromIsr() noexcept
 {
 	canAsyncSenderTask.GiveFromISR();
@@ -644,7 +1146,7 @@ void CanInterface::RaiseEvent(EventType type, uint16_t param, uint8_t device, co
 	msg->zero = 0;
 	SafeVsnprintf(msg->text, ARRAY_SIZE(msg->text), format, vargs);
 	buf.dataLength = msg->GetActualDataLength();
-	CanInterface::Send(&buf);
+	CanInterface::SendAsync(&buf);
 }
 
 extern "C" [[noreturn]] void CanClockLoop(void *) noexcept
@@ -653,6 +1155,7 @@ extern "C" [[noreturn]] void CanClockLoop(void *) noexcept
 	{
 		CanMessageBuffer buf(nullptr);
 		can0dev->ReceiveMessage(CanDevice::RxBufferNumber::buffer0, TaskBase::TimeoutUnlimited, &buf);
+		CanStatistics::RecordReceived(buf.id.MsgType(), buf.dataLength);
 		if (buf.id.MsgType() == CanMessageType::timeSync
 #if defined(ATEIO) || defined(ATECM)
 			&& (buf.id.Src() == CanId::ATEMasterAddress))			// ATE boards only respond to the ATE master, because a main board under test may also transmit when it starts up
@@ -666,6 +1169,25 @@ extern "C" [[noreturn]] void CanClockLoop(void *) noexcept
 	}
 }
 
+// Allocate a message buffer, waiting for one to become free if necessary and recording how long we waited
+static CanMessageBuffer *AllocateBuffer() noexcept
+{
+	CanMessageBuffer *buf = CanMessageBuffer::Allocate();
+	if (buf == nullptr)
+	{
+		const uint32_t startTime = StepTimer::GetTimerTicks();
+		buf = CanMessageBuffer::BlockingAllocate();
+		const uint32_t waitTime = StepTimer::GetTimerTicks() - startTime;
+		++bufferWaits;
+		totalBufferWaitTicks += waitTime;
+		if (waitTime > maxBufferWaitTicks)
+		{
+			maxBufferWaitTicks = waitTime;
+		}
+	}
+	return buf;
+}
+
 extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 {
 	CanMessageBuffer *buf = nullptr;
@@ -680,28 +1202,174 @@ extern "C" [[noreturn]] void CanReceiverLoop(void *) noexcept
 			// Get a buffer
 			if (buf == nullptr)
 			{
-				buf = CanMessageBuffer::BlockingAllocate();
+				buf = AllocateBuffer();
 			}
 
 			if (can0dev->ReceiveMessage(CanDevice::RxBufferNumber::fifo0, TaskBase::TimeoutUnlimited, buf))
 			{
+				rxFifo0Stats.Update(can0hw->RXF0S.bit.F0FL + 1, RxFifo0Size);
+				CanStatistics::RecordReceived(buf->id.MsgType(), buf->dataLength);
+				const LatencyHistograms::Timestamp probeStartTime = LatencyHistograms::GetTimestamp();
 				buf = CanInterface::ProcessReceivedMessage(buf);
+				LatencyHistograms::Record(LatencyProbe::canReceiver, probeStartTime);
 			}
 			else
 			{
-				debugPrintf("CAN read err\n");
+				++receiveErrors;
 			}
 		}
 	}
 }
 
-extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
+#if SUPPORT_DRIVERS
+
+// Task to receive movement messages from FIFO 1. Movement messages are copied into the move queue, so we don't need to allocate message buffers.
+extern "C" [[noreturn]] void CanMotionReceiverLoop(void *) noexcept
 {
-	CanMessageBuffer *buf;
-	while ((buf = CanMessageBuffer::Allocate()) == nullptr)
+	CanMessageBuffer buf(nullptr);
+	for (;;)
 	{
-		delay(1);
+		// If we are holding moves that arrived out of sequence then don't wait long for the missing one. During playback the playback task flushes them instead.
+#if SUPPORT_CAN_CAPTURE
+		const uint32_t timeout = (numMovesHeld != 0 && !CanCapture::IsPlayingBack()) ? MaxMoveHoldMillis : TaskBase::TimeoutUnlimited;
+#else
+		const uint32_t timeout = (numMovesHeld != 0) ? MaxMoveHoldMillis : TaskBase::TimeoutUnlimited;
+#endif
+		if (can0dev->ReceiveMessage(CanDevice::RxBufferNumber::fifo1, timeout, &buf))
+		{
+			rxFifo1Stats.Update(can0hw->RXF1S.bit.F1FL + 1, RxFifo1Size);
+			CanStatistics::RecordReceived(buf.id.MsgType(), buf.dataLength);
+			if (IsFromMaster(&buf))
+			{
+#if SUPPORT_CAN_CAPTURE
+				CanCapture::Record(&buf);
+				if (CanCapture::IsPlayingBack())
+				{
+					continue;									// the playback task is feeding the move queue
+				}
+#endif
+				(void)ProcessMotionMessage(&buf);
+			}
+		}
+		else if (numMovesHeld != 0)
+		{
+			FlushHeldMoves();
+		}
+		else
+		{
+			++receiveErrors;
+		}
 	}
+}
+
+#endif
+
+#if SUPPORT_CAN_CAPTURE
+
+// Start playing back the captured messages. Called by CanCapture after it has set the playback mode.
+void CanInterface::StartPlayback() noexcept
+{
+	if (canPlaybackTask == nullptr)
+	{
+		canPlaybackTask = new Task<CanPlaybackTaskStackWords>;
+		canPlaybackTask->Create(CanPlaybackLoop, "CanPlayback", nullptr, TaskPriority::CanMotionReceiverPriority);
+	}
+	canPlaybackTask->Give();
+}
+
+// Return true if a captured message can be played back. We don't replay the commands that control capture and playback, or commands that would reset or reconfigure the board.
+static bool IsPlaybackAllowed(CanMessageType type) noexcept
+{
+	switch (type)
+	{
+	case CanMessageType::diagnosticTest:
+	case CanMessageType::updateFirmware:
+	case CanMessageType::reset:
+	case CanMessageType::setAddressAndNormalTiming:
+	case CanMessageType::setFastTiming:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
+// Task to play back the captured messages with their original timing. While it is running, the motion receiver ignores movement messages from the bus.
+// Movement messages are made to execute later by the time between capturing and playing back the first message, so that they arrive with the same advance as when they were captured.
+extern "C" [[noreturn]] void CanPlaybackLoop(void *) noexcept
+{
+	for (;;)
+	{
+		TaskBase::Take();
+		delay(PlaybackStartDelayMillis);
+# if SUPPORT_DRIVERS
+		resyncMotionSequence = true;						// the captured sequence numbers don't follow on from the ones we received last
+# endif
+
+		const size_t numMessages = CanCapture::GetNumMessages();
+		const uint32_t firstReceived = CanCapture::GetMessage(0).whenReceived;
+		const uint32_t startTime = StepTimer::GetTimerTicks();
+		size_t messagesPlayed = 0;
+		while (messagesPlayed < numMessages && CanCapture::IsPlayingBack())
+		{
+			const CanCapture::CapturedMessage& cm = CanCapture::GetMessage(messagesPlayed);
+
+			// Wait until it is time to play this message. The main board sends moves well in advance, so millisecond resolution is good enough.
+			const uint32_t playAt = startTime + (cm.whenReceived - firstReceived);
+			for (;;)
+			{
+				const int32_t ticksToWait = (int32_t)(playAt - StepTimer::GetTimerTicks());
+				const uint32_t millisToWait = (ticksToWait <= 0) ? 0 : (uint32_t)ticksToWait/(StepTimer::StepClockRate/1000);
+				if (millisToWait == 0)
+				{
+					break;
+				}
+# if SUPPORT_DRIVERS
+				if (numMovesHeld != 0 && millisToWait > MaxMoveHoldMillis)
+				{
+					// The motion receiver doesn't flush held moves during playback, so we must do it
+					delay(MaxMoveHoldMillis);
+					FlushHeldMoves();
+					continue;
+				}
+# endif
+				delay(millisToWait);
+			}
+
+			CanMessageBuffer *buf = AllocateBuffer();
+			buf->id.SetReceivedId(cm.id);
+			buf->dataLength = cm.dataLength;
+			memcpy(buf->msg.raw, cm.data, cm.dataLength);
+			buf->timeStamp = CanInterface::GetTimeStampCounter();
+			if (IsPlaybackAllowed(buf->id.MsgType()))
+			{
+# if SUPPORT_DRIVERS
+				if (buf->id.MsgType() == CanMessageType::movementLinear)
+				{
+					buf->msg.moveLinear.whenToExecute += startTime - firstReceived;
+				}
+# endif
+				buf = CanInterface::ProcessReceivedMessage(buf);
+			}
+			if (buf != nullptr)
+			{
+				CanMessageBuffer::Free(buf);
+			}
+			++messagesPlayed;
+		}
+
+# if SUPPORT_DRIVERS
+		FlushHeldMoves();
+# endif
+		CanCapture::EndPlayback(messagesPlayed);
+	}
+}
+
+#endif
+
+extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
+{
+	CanMessageBuffer * const buf = AllocateBuffer();
 
 	for (;;)
 	{
@@ -717,6 +1385,25 @@ extern "C" [[noreturn]] void CanAsyncSenderLoop(void *) noexcept
 			buf->dataLength = msg->GetActualDataLength();
 			CanInterface::SendAsync(buf);					// this doesn't free the buffer, so we can re-use it
 		}
+
+#if HAS_SMART_DRIVERS
+		// Send any driver errors and warnings that the drivers task has queued
+		size_t driver;
+		StandardDriverStatus stat;
+		bool isError;
+		while (DriverFaultMonitor::GetPendingEvent(driver, stat, isError))
+		{
+			const EventType evType = (isError) ? EventType::driver_error : EventType::driver_warning;
+			auto evMsg = buf->SetupStatusMessage<CanMessageEvent>(CanInterface::GetCanAddress(), currentMasterAddress);
+			evMsg->eventType = evType.ToBaseType();
+			evMsg->deviceNumber = driver;
+			evMsg->eventParam = stat.AsU16();
+			evMsg->zero = 0;
+			evMsg->text[0] = 0;
+			buf->dataLength = evMsg->GetActualDataLength();
+			CanInterface::SendAsync(buf);
+		}
+#endif
 		TaskBase::Take(timeToWait);							// wait until we are woken up because a message is available, or we time out
 	}
 }
@@ -20,15 +20,22 @@ namespace CanInterface
 	void Init(CanAddress defaultBoardAddress, bool useAlternatePins, bool full) noexcept;
 	void Shutdown() noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;
 
 	CanAddress GetCanAddress() noexcept;
 	CanAddress GetCurrentMasterAddress() noexcept;
 	GCodeResult ChangeAddressAndDataRate(const CanMessageSetAddressAndNormalTiming& msg, const StringRef& reply) noexcept;
 	bool GetCanMessage(CanMessageBuffer *buf) noexcept;
-	CanMessageBuffer *GetCanMove(uint32_t timeout) noexcept;
-	bool Send(CanMessageBuffer *buf) noexcept;
-	bool SendAsync(CanMessageBuffer *buf) noexcept;
-	bool SendAndFree(CanMessageBuffer *buf) noexcept;
+#if SUPPORT_DRIVERS
+	const CanMessageMovementLinear *GetCanMove(uint32_t timeout) noexcept;
+	void FinishedWithCanMove() noexcept;
+	void InterruptCanMoveWait() noexcept;				// make GetCanMove return nullptr early if there is no move, so that the Move task can do local work
+#endif
+	bool Send(CanMessageBuffer *buf) noexcept;						// send a normal priority message
+	bool SendAsync(CanMessageBuffer *buf) noexcept;					// send a high priority message
+	bool SendReply(CanMessageBuffer *buf) noexcept;					// send a reply to a command
+	bool SendReplyAndFree(CanMessageBuffer *buf) noexcept;
+	bool SendBulk(CanMessageBuffer *buf) noexcept;					// send a low priority bulk data message
 	CanMessageBuffer *GetCanCommand(uint32_t timeout) noexcept;
 
 #if !SAME70
@@ -39,7 +46,13 @@ namespace CanInterface
 	bool SendAnnounce(CanMessageBuffer *buf) noexcept;
 	void RaiseEvent(EventType type, uint16_t param, uint8_t device, const char *format, va_list vargs) noexcept;
 
+	void WakeAsyncSender() noexcept;
 	void WakeAsyncSenderFromIsr() noexcept;
+	void SampleBusActivity() noexcept;
+	void AppendBusHealth(const StringRef& reply) noexcept;			// append the bus error counters and reset them
+#if SUPPORT_CAN_CAPTURE
+	void StartPlayback() noexcept;									// play back the messages that CanCapture has captured
+#endif
 }
 
 #endif /* SRC_CAN_CANINTERFACE_H_ */
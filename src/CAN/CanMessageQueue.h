@@ -10,6 +10,7 @@
 
 #include "CanMessageBuffer.h"
 #include <RTOSIface/RTOSIface.h>
+#include <atomic>
 
 class CanMessageQueue
 {
@@ -24,4 +25,111 @@ private:
 	TaskBase * volatile taskWaitingToGet;
 };
 
+// Lock-free ring of CAN messages for use when there is a single producer task and a single consumer task.
+// The messages are held in the ring itself, so the producer builds each message in place and the consumer processes it in place; no message buffers are needed.
+// Each side is woken up only if it is waiting because it found the ring empty (consumer) or full (producer).
+template<class T, size_t N> class CanMessageSpscQueue
+{
+public:
+	static_assert(N != 0 && (N & (N - 1)) == 0, "Queue capacity must be a power of 2");
+
+	CanMessageSpscQueue() noexcept : putIndex(0), getIndex(0), taskWaitingToPut(nullptr), taskWaitingToGet(nullptr), getInterrupted(false) { }
+
+	// Producer functions
+	T *BeginPut(uint32_t timeout) noexcept;				// return the slot to build the next message in, waiting if the ring is full, or nullptr if we timed out
+	void EndPut() noexcept;								// add the message in the slot returned by BeginPut to the ring
+
+	// Consumer functions
+	const T *BeginGet(uint32_t timeout) noexcept;		// return the oldest message, waiting if the ring is empty, or nullptr if we timed out
+	void EndGet() noexcept;								// release the slot returned by BeginGet
+
+	void InterruptGet() noexcept;						// make the consumer return from BeginGet with nullptr if the ring is empty, so that it can do other work; may be called by any task
+
+	size_t GetUsed() const noexcept { return putIndex.load(std::memory_order_relaxed) - getIndex.load(std::memory_order_relaxed); }
+
+private:
+	static bool Wait(std::atomic<TaskBase*>& waitingTask, const std::atomic<uint32_t>& index, uint32_t oldIndex, uint32_t timeout) noexcept;
+	static void Wake(std::atomic<TaskBase*>& waitingTask) noexcept;
+
+	T slots[N];
+	std::atomic<uint32_t> putIndex;						// written only by the producer
+	std::atomic<uint32_t> getIndex;						// written only by the consumer
+	std::atomic<TaskBase*> taskWaitingToPut;
+	std::atomic<TaskBase*> taskWaitingToGet;
+	std::atomic<bool> getInterrupted;
+};
+
+// Wait until the index written by the other side changes from oldIndex. Return true if it did, false if we timed out.
+// We register that we are waiting, then check again in case the other side changed the index before it could see that we are waiting.
+template<class T, size_t N> bool CanMessageSpscQueue<T, N>::Wait(std::atomic<TaskBase*>& waitingTask, const std::atomic<uint32_t>& index, uint32_t oldIndex, uint32_t timeout) noexcept
+{
+	TaskBase::ClearNotifyCount();
+	waitingTask.store(TaskBase::GetCallerTaskHandle());
+	if (index.load() == oldIndex && !TaskBase::Take(timeout))
+	{
+		waitingTask.store(nullptr);
+		return index.load() != oldIndex;
+	}
+	waitingTask.store(nullptr);
+	return true;
+}
+
+// Wake up the other side if it is waiting. The caller must have updated its index using a sequentially consistent store.
+template<class T, size_t N> void CanMessageSpscQueue<T, N>::Wake(std::atomic<TaskBase*>& waitingTask) noexcept
+{
+	if (waitingTask.load() != nullptr)
+	{
+		TaskBase * const task = waitingTask.exchange(nullptr);
+		if (task != nullptr)
+		{
+			task->Give();
+		}
+	}
+}
+
+template<class T, size_t N> T *CanMessageSpscQueue<T, N>::BeginPut(uint32_t timeout) noexcept
+{
+	const uint32_t pi = putIndex.load(std::memory_order_relaxed);
+	uint32_t gi;
+	while (pi - (gi = getIndex.load(std::memory_order_acquire)) == N)
+	{
+		if (timeout == 0 || !Wait(taskWaitingToPut, getIndex, gi, timeout))
+		{
+			return nullptr;
+		}
+	}
+	return &slots[pi & (N - 1)];
+}
+
+template<class T, size_t N> void CanMessageSpscQueue<T, N>::EndPut() noexcept
+{
+	putIndex.store(putIndex.load(std::memory_order_relaxed) + 1);
+	Wake(taskWaitingToGet);
+}
+
+template<class T, size_t N> const T *CanMessageSpscQueue<T, N>::BeginGet(uint32_t timeout) noexcept
+{
+	const uint32_t gi = getIndex.load(std::memory_order_relaxed);
+	while (putIndex.load(std::memory_order_acquire) == gi)
+	{
+		if (getInterrupted.exchange(false) || timeout == 0 || !Wait(taskWaitingToGet, putIndex, gi, timeout))
+		{
+			return nullptr;
+		}
+	}
+	return &slots[gi & (N - 1)];
+}
+
+template<class T, size_t N> void CanMessageSpscQueue<T, N>::EndGet() noexcept
+{
+	getIndex.store(getIndex.load(std::memory_order_relaxed) + 1);
+	Wake(taskWaitingToPut);
+}
+
+template<class T, size_t N> void CanMessageSpscQueue<T, N>::InterruptGet() noexcept
+{
+	getInterrupted.store(true);
+	Wake(taskWaitingToGet);
+}
+
 #endif /* SRC_CAN_CANMESSAGEQUEUE_H_ */
@@ -0,0 +1,145 @@
+/*
+ * CanStatistics.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "CanStatistics.h"
+#include <RTOSIface/RTOSIface.h>
+#include <Movement/StepTimer.h>
+
+namespace CanStatistics
+{
+	// We record statistics for the first few message types we see, because there isn't enough RAM to have counters for every message type
+#if SAMC21
+	constexpr size_t NumTrackedTypes = 8;
+#else
+	constexpr size_t NumTrackedTypes = 16;
+#endif
+	constexpr size_t TypesPerReport = 8;						// how many message types we report in one return info message, limited by the reply length
+	constexpr unsigned int BusActivityWindow = 1000;			// how many bus activity samples we use to calculate the bus load, at one sample per tick
+
+	struct MessageTypeStats
+	{
+		uint16_t type;
+		uint32_t numReceived;
+		uint32_t numSent;
+		uint32_t bytesReceived;
+		uint32_t bytesSent;
+		uint32_t totalSendWait;									// in step clocks
+		uint32_t maxSendWait;									// in step clocks
+	};
+
+	static MessageTypeStats stats[NumTrackedTypes];
+	static size_t numTypesTracked = 0;
+	static uint32_t untrackedReceived = 0, untrackedSent = 0;
+
+	static unsigned int activitySamples = 0, busySamples = 0;
+	static volatile unsigned int lastBusLoad = 0, peakBusLoad = 0;	// in units of 0.1%
+
+	// Find the entry for a message type, creating one if possible. Must be called inside a critical section.
+	static MessageTypeStats *FindEntry(CanMessageType type) noexcept
+	{
+		for (size_t i = 0; i < numTypesTracked; ++i)
+		{
+			if (stats[i].type == (uint16_t)type)
+			{
+				return &stats[i];
+			}
+		}
+		if (numTypesTracked < NumTrackedTypes)
+		{
+			MessageTypeStats& entry = stats[numTypesTracked++];
+			memset(&entry, 0, sizeof(entry));
+			entry.type = (uint16_t)type;
+			return &entry;
+		}
+		return nullptr;
+	}
+}
+
+void CanStatistics::RecordReceived(CanMessageType type, size_t dataLength) noexcept
+{
+	TaskCriticalSectionLocker lock;
+	MessageTypeStats * const entry = FindEntry(type);
+	if (entry == nullptr)
+	{
+		++untrackedReceived;
+	}
+	else
+	{
+		++entry->numReceived;
+		entry->bytesReceived += dataLength;
+	}
+}
+
+void CanStatistics::RecordSent(CanMessageType type, size_t dataLength, uint32_t waitTicks) noexcept
+{
+	TaskCriticalSectionLocker lock;
+	MessageTypeStats * const entry = FindEntry(type);
+	if (entry == nullptr)
+	{
+		++untrackedSent;
+	}
+	else
+	{
+		++entry->numSent;
+		entry->bytesSent += dataLength;
+		entry->totalSendWait += waitTicks;
+		if (waitTicks > entry->maxSendWait)
+		{
+			entry->maxSendWait = waitTicks;
+		}
+	}
+}
+
+// Record whether the bus was busy when we sampled it. Called from the tick interrupt.
+// Because the samples are not synchronised to the bus traffic, the proportion of busy samples is an unbiased estimate of the bus load, including messages not addressed to us.
+void CanStatistics::RecordBusActivity(bool busy) noexcept
+{
+	if (busy)
+	{
+		++busySamples;
+	}
+	if (++activitySamples == BusActivityWindow)
+	{
+		const unsigned int load = (busySamples * 1000)/BusActivityWindow;
+		lastBusLoad = load;
+		if (load > peakBusLoad)
+		{
+			peakBusLoad = load;
+		}
+		activitySamples = busySamples = 0;
+	}
+}
+
+void CanStatistics::AppendSummary(const StringRef& reply) noexcept
+{
+	const unsigned int last = lastBusLoad, peak = peakBusLoad;
+	reply.lcatf("CAN bus load %u.%u%%, peak %u.%u%%, message types tracked %u", last/10, last % 10, peak/10, peak % 10, numTypesTracked);
+	peakBusLoad = 0;
+}
+
+// Append the statistics for up to TypesPerReport message types, starting at the specified index. These are not reset, so that the caller can fetch them in several parts.
+void CanStatistics::AppendMessageTypeStats(const StringRef& reply, unsigned int startIndex) noexcept
+{
+	AppendSummary(reply);
+	for (size_t i = startIndex; i < numTypesTracked && i < startIndex + TypesPerReport; ++i)
+	{
+		MessageTypeStats entry;
+		{
+			TaskCriticalSectionLocker lock;
+			entry = stats[i];
+		}
+		reply.lcatf("Type %u: rx %" PRIu32 " %" PRIu32 "b, tx %" PRIu32 " %" PRIu32 "b, wait avg %" PRIu32 " max %" PRIu32 "us",
+					entry.type, entry.numReceived, entry.bytesReceived, entry.numSent, entry.bytesSent,
+					(entry.numSent == 0) ? 0 : StepTimer::TicksToIntegerMicroseconds(entry.totalSendWait/entry.numSent), StepTimer::TicksToIntegerMicroseconds(entry.maxSendWait));
+	}
+	if (startIndex + TypesPerReport >= numTypesTracked && (untrackedReceived != 0 || untrackedSent != 0))
+	{
+		reply.lcatf("Other types: rx %" PRIu32 ", tx %" PRIu32, untrackedReceived, untrackedSent);
+	}
+}
+
+// End
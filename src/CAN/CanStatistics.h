@@ -0,0 +1,24 @@
+/*
+ * CanStatistics.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_CAN_CANSTATISTICS_H_
+#define SRC_CAN_CANSTATISTICS_H_
+
+#include <RepRapFirmware.h>
+#include <CanId.h>
+
+// Module to collect statistics about the CAN messages we send and receive and about the bus load, so that we can tell how close the bus is to being overloaded
+namespace CanStatistics
+{
+	void RecordReceived(CanMessageType type, size_t dataLength) noexcept;
+	void RecordSent(CanMessageType type, size_t dataLength, uint32_t waitTicks) noexcept;		// waitTicks is how long the sender waited for the FIFO, in step clocks
+	void RecordBusActivity(bool busy) noexcept;													// called at the tick rate with whether the bus was active
+	void AppendSummary(const StringRef& reply) noexcept;
+	void AppendMessageTypeStats(const StringRef& reply, unsigned int startIndex) noexcept;
+}
+
+#endif /* SRC_CAN_CANSTATISTICS_H_ */
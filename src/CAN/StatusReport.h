@@ -0,0 +1,52 @@
+/*
+ * StatusReport.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_CAN_STATUSREPORT_H_
+#define SRC_CAN_STATUSREPORT_H_
+
+#include <RepRapFirmware.h>
+
+// Class to decide when to send one class of periodic status report to the main board.
+// A report is sent when its content has changed by more than the deadband and the minimum interval has elapsed since we last sent it,
+// and also whenever the maximum interval has elapsed, so that the main board doesn't time out the data.
+class StatusReport
+{
+public:
+	StatusReport(uint16_t p_minInterval, uint16_t p_maxInterval) noexcept
+		: whenLastSent(0), minInterval(p_minInterval), maxInterval(p_maxInterval), numSent(0), numSuppressed(0), sentOnce(false) { }
+
+	// Return true if the report should be sent now, given whether its content has changed since we last sent it
+	bool IsDue(uint32_t now, bool changed) const noexcept
+	{
+		const uint32_t elapsed = now - whenLastSent;
+		return !sentOnce || elapsed >= maxInterval || (changed && elapsed >= minInterval);
+	}
+
+	void ReportSent(uint32_t now) noexcept { whenLastSent = now; sentOnce = true; ++numSent; }
+	void ReportSuppressed() noexcept { ++numSuppressed; }
+	void ForceNextReport() noexcept { sentOnce = false; }
+
+	// Set the minimum interval. It can't be more than the maximum interval, because that is limited by the timeout in the main board.
+	void SetMinInterval(uint32_t ms) noexcept { minInterval = min<uint32_t>(ms, maxInterval); }
+	uint32_t GetMinInterval() const noexcept { return minInterval; }
+
+	void Report(const StringRef& reply, const char *name) noexcept
+	{
+		reply.catf(" %s %u/%u/%u/%u", name, minInterval, maxInterval, numSent, numSuppressed);
+		numSent = numSuppressed = 0;
+	}
+
+private:
+	uint32_t whenLastSent;
+	uint16_t minInterval;
+	uint16_t maxInterval;
+	uint16_t numSent;
+	uint16_t numSuppressed;
+	bool sentOnce;
+};
+
+#endif /* SRC_CAN_STATUSREPORT_H_ */
@@ -33,6 +33,10 @@ static inline constexpr uint32_t NanoSecondsToClocks(uint32_t ns) noexcept
 constexpr uint32_t Clocks350ns = NanoSecondsToClocks(350);
 constexpr uint32_t ClocksHalfSclk = SystemCoreClockFreq/(2 * AS5047ClockFrequency);
 
+#if SHARED_SPI_USES_DMA
+constexpr uint32_t BackgroundReadTimeoutTicks = StepTimer::StepClockRate/10000;		// 100us, much longer than the two 16-bit transfers should take
+#endif
+
 // Adjust the top bit of a 16-bit word to make it even parity
 static inline constexpr uint16_t AddParityBit(uint16_t w) noexcept
 {
@@ -62,6 +66,9 @@ static inline bool CheckResponse(uint16_t response) noexcept
 AS5047D::AS5047D(SharedSpiDevice& spiDev, Pin p_csPin) noexcept
 	: SpiEncoder(spiDev, AS5047ClockFrequency, SpiMode::mode1, false, p_csPin),
 	  AbsoluteEncoder()
+#if SHARED_SPI_USES_DMA
+	  , backgroundReadState(BackgroundReadState::idle), backgroundReadOwner(nullptr), numBackgroundReads(0), numBackgroundReadFailures(0)
+#endif
 {
 }
 
@@ -123,15 +130,33 @@ void AS5047D::Disable() noexcept
 
 uint32_t AS5047D::GetAbsolutePosition(bool& error) noexcept
 {
+#if SHARED_SPI_USES_DMA
+	// If this task started a background read then use the result of it, else fall back to reading the encoder directly
+	if (backgroundReadState != BackgroundReadState::idle && backgroundReadOwner == TaskBase::GetCallerTaskHandle())
+	{
+		uint16_t response;
+		if (GetBackgroundReadResult(response) && CheckResponse(response))
+		{
+			RecordSampleTime(backgroundReadStartTime);
+			response &= 0x3FFF;
+			error = false;
+			return ((response & 0x2000) ? response | 0xFFFFC000 : response) + AS5047D_ABS_READING_OFFSET;
+		}
+		++numBackgroundReadFailures;
+	}
+#endif
+
 	if (spi.Select(0))			// get the mutex and set the clock rate
 	{
 		uint16_t response;
+		const StepTimer::Ticks sampleTime = StepTimer::GetTimerTicks();
 		const bool ok = DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegAngleCom), response)
 					 && (DelayCycles(GetCurrentCycles(), Clocks350ns), 				// need at least 350ns CS high time
 						 DoSpiTransaction(AddParityBit(AS5047ReadCommand | AS5047RegNop), response));
 		spi.Deselect();			// release the mutex
 		if (ok && CheckResponse(response))
 		{
+			RecordSampleTime(sampleTime);
 			response &= 0x3FFF;
 			error = false;
 			return ((response & 0x2000) ? response | 0xFFFFC000 : response) + AS5047D_ABS_READING_OFFSET;
@@ -142,6 +167,80 @@ uint32_t AS5047D::GetAbsolutePosition(bool& error) noexcept
 	return 0;
 }
 
+#if SHARED_SPI_USES_DMA
+
+// Start reading the angle in the background. The read is completed by the next call to GetAbsolutePosition from this task.
+// We keep ownership of the SPI device until then, so this should only be called by a task that will read the encoder again soon.
+void AS5047D::StartReading() noexcept
+{
+	if (backgroundReadState == BackgroundReadState::idle && spi.Select(0))
+	{
+		backgroundReadOwner = TaskBase::GetCallerTaskHandle();
+		const uint16_t command = AddParityBit(AS5047ReadCommand | AS5047RegAngleCom);
+		backgroundTxBuffer[0] = (uint8_t)(command >> 8);
+		backgroundTxBuffer[1] = (uint8_t)(command & 0xFF);
+		backgroundReadState = BackgroundReadState::sendingCommand;
+		++numBackgroundReads;
+		backgroundReadStartTime = StepTimer::GetTimerTicks();
+		IoPort::WriteDigital(csPin, false);
+		spi.StartDmaTransfer(backgroundTxBuffer, backgroundRxBuffer, 2, BackgroundReadCallback, CallbackParameter(this));
+	}
+}
+
+/*static*/ void AS5047D::BackgroundReadCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept
+{
+	static_cast<AS5047D*>(cb.vp)->BackgroundReadTransferDone(reason);
+}
+
+// This is called from the DMA interrupt when a background transfer has finished
+void AS5047D::BackgroundReadTransferDone(DmaCallbackReason reason) noexcept
+{
+	IoPort::WriteDigital(csPin, true);
+	if (reason != DmaCallbackReason::complete)
+	{
+		backgroundReadState = BackgroundReadState::failed;
+	}
+	else if (backgroundReadState == BackgroundReadState::sendingCommand)
+	{
+		// The command has been sent, so send a NOP to get the angle back
+		const uint16_t command = AddParityBit(AS5047ReadCommand | AS5047RegNop);
+		backgroundTxBuffer[0] = (uint8_t)(command >> 8);
+		backgroundTxBuffer[1] = (uint8_t)(command & 0xFF);
+		backgroundReadState = BackgroundReadState::fetchingResult;
+		DelayCycles(GetCurrentCycles(), Clocks350ns);					// need at least 350ns CS high time
+		IoPort::WriteDigital(csPin, false);
+		spi.StartDmaTransfer(backgroundTxBuffer, backgroundRxBuffer, 2, BackgroundReadCallback, CallbackParameter(this));
+	}
+	else
+	{
+		backgroundReadState = BackgroundReadState::complete;
+	}
+}
+
+// Wait for the background read to finish if it hasn't already, release the SPI device and return true if we got a response
+bool AS5047D::GetBackgroundReadResult(uint16_t& response) noexcept
+{
+	const uint32_t startedWaiting = StepTimer::GetTimerTicks();
+	while (backgroundReadState == BackgroundReadState::sendingCommand || backgroundReadState == BackgroundReadState::fetchingResult)
+	{
+		if (StepTimer::GetTimerTicks() - startedWaiting > BackgroundReadTimeoutTicks)
+		{
+			spi.AbortDmaTransfer();
+			IoPort::WriteDigital(csPin, true);
+			backgroundReadState = BackgroundReadState::failed;
+			break;
+		}
+	}
+
+	const bool ok = (backgroundReadState == BackgroundReadState::complete);
+	response = ((uint16_t)backgroundRxBuffer[0]) << 8 | backgroundRxBuffer[1];
+	backgroundReadState = BackgroundReadState::idle;
+	spi.Deselect();			// release the mutex
+	return ok;
+}
+
+#endif
+
 // Get the diagnostic register and the error flags register
 bool AS5047D::GetDiagnosticRegisters(DiagnosticRegisters& regs) noexcept
 {
@@ -166,7 +265,11 @@ void AS5047D::AppendDiagnostics(const StringRef &reply) noexcept
 {
 	reply.catf(", encoder full rotations %d", (int) fullRotations);
 	reply.catf(", encoder last angle %d", (int) lastAngle);
-	reply.catf(", zero crossing index=%d, zero crossing offset=%d", zeroCrossingIndex, zeroCrossingOffset);
+	reply.catf(", LUT %s", (LUTLoaded) ? "loaded" : "not loaded");
+	AppendReadStatistics(reply);
+#if SHARED_SPI_USES_DMA
+	reply.catf(", background reads %" PRIu32 " failed %" PRIu32, numBackgroundReads, numBackgroundReadFailures);
+#endif
 	DiagnosticRegisters regs;
 	if (GetDiagnosticRegisters(regs))
 	{
@@ -32,6 +32,9 @@ public:
 	void Enable() noexcept override;
 	void Disable() noexcept override;
 	uint32_t GetAbsolutePosition(bool& error) noexcept;
+#if SHARED_SPI_USES_DMA
+	void StartReading() noexcept override;
+#endif
 	void AppendDiagnostics(const StringRef& reply) noexcept override;
 	void AppendStatus(const StringRef& reply) noexcept override;
 
@@ -45,6 +48,23 @@ private:
 
 	bool DoSpiTransaction(uint16_t command, uint16_t& response) noexcept;
 	bool GetDiagnosticRegisters(DiagnosticRegisters& regs) noexcept;
+
+#if SHARED_SPI_USES_DMA
+	// Background reading of the angle. This sends the read command and then a NOP to fetch the result, using DMA for both.
+	enum class BackgroundReadState : uint8_t { idle, sendingCommand, fetchingResult, complete, failed };
+
+	static void BackgroundReadCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept;
+	void BackgroundReadTransferDone(DmaCallbackReason reason) noexcept;
+	bool GetBackgroundReadResult(uint16_t& response) noexcept;
+
+	volatile uint8_t backgroundTxBuffer[2];
+	volatile uint8_t backgroundRxBuffer[2];
+	volatile BackgroundReadState backgroundReadState;
+	TaskHandle backgroundReadOwner;				// the task that started the background read, which must also finish it because it owns the SPI mutex
+	StepTimer::Ticks backgroundReadStartTime;	// when we sent the read command, which is when the angle was sampled
+	uint32_t numBackgroundReads;
+	uint32_t numBackgroundReadFailures;
+#endif
 };
 
 #endif
@@ -57,10 +57,12 @@ protected:
 	int32_t fullRotations;
 
 	// LUT vars
+	static constexpr size_t LUTLength = MAX / LUT_RESOLUTION;
+	static_assert((LUT_RESOLUTION & (LUT_RESOLUTION - 1)) == 0);
+
 	bool LUTLoaded;
-	int zeroCrossingIndex;
-	int zeroCrossingOffset;
-	float correctionLUT[MAX / LUT_RESOLUTION];
+	float correctionLUT[LUTLength];							// the real world positions recorded during calibration, one per LUT_RESOLUTION encoder counts
+	int16_t correctionTable[LUTLength + 1];					// the correction to add to the reading at the start of each window, calculated from the stored harmonics. The extra entry is a copy of the first.
 
 };
 
@@ -72,25 +74,33 @@ int32_t AbsoluteEncoder<MAX, LUT_RESOLUTION>::GetReading() noexcept {
 	bool error;
 	int32_t currentAngle = GetAbsolutePosition(error);
 
+	// A failed read is usually a glitch on the SPI bus, so try once more. This takes only a few microseconds, which the control loop can afford.
+	const bool retried = error;
 	if (error) {
-		//TODO how to report an error?
+		currentAngle = GetAbsolutePosition(error);
+	}
+	RecordReadResult(error, retried);
+
+	if (error) {
+		// Return the previous reading. The sample time isn't updated, so the caller can tell how old it is.
 		return fullRotations * MAX + lastAngle;
 	}
 
-	// Apply LUT correction (if the LUT is loaded)
+	// Apply the correction (if the LUT is loaded), interpolating between the corrections at the start and end of the window
 	// (These divisions should be efficient because LUT_RESOLUTION is a power of 2)
 	if (LUTLoaded) {
-		int windowStartIndex = currentAngle / LUT_RESOLUTION;
-		float windowStart = correctionLUT[windowStartIndex];
-		int windowOffset = currentAngle % LUT_RESOLUTION;
-
-		// Handle the zero-crossing
-		if (windowStartIndex == zeroCrossingIndex && zeroCrossingOffset >= windowOffset) {
-			windowStart = 0;
-			windowOffset -= zeroCrossingOffset;
+		const unsigned int windowStartIndex = (unsigned int)currentAngle / LUT_RESOLUTION;
+		const int32_t windowOffset = (unsigned int)currentAngle % LUT_RESOLUTION;
+		const int32_t correctionStart = correctionTable[windowStartIndex];
+		const int32_t correctionEnd = correctionTable[windowStartIndex + 1];
+		currentAngle += correctionStart + ((correctionEnd - correctionStart) * windowOffset) / (int32_t)LUT_RESOLUTION;
+
+		// Keep the corrected angle in range so that the zero crossing is handled below
+		if (currentAngle < 0) {
+			currentAngle += MAX;
+		} else if (currentAngle >= (int32_t)MAX) {
+			currentAngle -= MAX;
 		}
-
-		currentAngle = windowStart + windowOffset;
 	}
 
 	// Accumulate the full rotations if one has occurred
@@ -112,26 +122,16 @@ bool AbsoluteEncoder<MAX, LUT_RESOLUTION>::LoadLUT() noexcept {
 	float* fourierAngles = mem.GetClosedLoopLUTHarmonicAngles();
 	float* fourierMagnitudes = mem.GetClosedLoopLUTHarmonicMagnitudes();
 
-	// TODO: Read back LUT from NVRAM (fourier transform -> array)
-	const size_t LUTLength = MAX / LUT_RESOLUTION;
+	// Build the correction table from the stored harmonics so that applying the correction to a reading is cheap
+	LUTLoaded = false;
 	for (size_t index=0; index<LUTLength; index++) {
-		correctionLUT[index] = index * LUT_RESOLUTION;
+		float correction = 0.0;
 		for (size_t harmonic=0; harmonic<NUM_HARMONICS; harmonic++) {
-			correctionLUT[index] -= fourierMagnitudes[harmonic] * sinf(harmonic * TwoPi * index / LUTLength + fourierAngles[harmonic]);
-		}
-	}
-
-	// Find the zero-crossing index and offset
-	float prevVal = correctionLUT[0];
-	for (unsigned int i = 1; i<(MAX/LUT_RESOLUTION); i++) {
-		float curVal = correctionLUT[i];
-		if (abs(prevVal - curVal) > MAX/2) {
-			zeroCrossingIndex = i-1;
-			zeroCrossingOffset = round(MAX - prevVal);
-			break;
+			correction -= fourierMagnitudes[harmonic] * sinf(harmonic * TwoPi * index / LUTLength + fourierAngles[harmonic]);
 		}
-		prevVal = curVal;
+		correctionTable[index] = (int16_t)constrain<long>(lrintf(correction), -(long)MAX/2, (long)MAX/2);
 	}
+	correctionTable[LUTLength] = correctionTable[0];
 
 	// Mark the LUT as loaded (and return true)
 	return LUTLoaded = true;
@@ -145,7 +145,6 @@ void AbsoluteEncoder<MAX, LUT_RESOLUTION>::StoreLUT() noexcept {
 	NonVolatileMemory mem(NvmPage::closedLoop);
 	for (size_t harmonic=0; harmonic<NUM_HARMONICS; harmonic++) {
 		float sum1 = 0.0, sum2 = 0.0;
-		const size_t LUTLength = MAX / LUT_RESOLUTION;
 		for (size_t i = 0; i < LUTLength; ++i)
 		{
 			const float offset = i * LUT_RESOLUTION - correctionLUT[i];
@@ -0,0 +1,476 @@
+/*
+ * Benchmark.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ *
+ *  Benchmark manoeuvres for comparing closed loop performance between firmware versions and controller settings.
+ *  Unlike the tuning manoeuvres, these run under normal PID control. Each control loop iteration moves the target position by the manoeuvre's
+ *  commanded offset before the error is calculated, and measures the response as the motor position relative to where the manoeuvre started.
+ *  The velocity and acceleration feedforward terms come from the move system, so they don't contribute during a benchmark.
+ */
+
+#include "ClosedLoop.h"
+
+#if SUPPORT_CLOSED_LOOP
+
+#include <CAN/CanInterface.h>
+
+namespace ClosedLoop
+{
+	// Step response
+	constexpr float BenchmarkStepAmplitude = 1.0;					// full steps
+	constexpr float BenchmarkStepWindow = 0.25;						// seconds to measure the response for, and then to wait after stepping back
+	constexpr float BenchmarkSettlingBand = 0.05;					// the fraction of the step that we must settle within
+
+	// Stepped sine sweep. The benchmark uses 7 frequencies doubling from 10Hz.
+	constexpr float BenchmarkSineAmplitude = 0.25;					// full steps
+	constexpr float BenchmarkSweepStartFrequency = 10.0;
+	constexpr float BenchmarkSweepEndFrequency = 640.0;
+	constexpr size_t BenchmarkSweepPoints = 7;
+	constexpr unsigned int SweepSettleCycles = 2;					// cycles at each frequency that we ignore while the response settles
+	constexpr unsigned int SweepMeasureCycles = 4;					// cycles at each frequency that we measure
+	constexpr float BenchmarkBandwidthGain = 0.7071;				// -3dB
+
+	// Limits for the frequency response sweep requested by diagnostic test 223
+	constexpr float MinSweepFrequency = 1.0;
+	constexpr float MaxSweepFrequency = 2000.0;						// 10 control loop iterations per cycle
+	constexpr float MaxSweepAmplitude = 2.0;						// full steps
+	constexpr float DefaultSweepAmplitude = 0.1;
+	constexpr size_t DefaultSweepPoints = 20;
+	constexpr unsigned int SweepRecordVersion = 1;					// increase this if the format of the frequency response record changes
+	constexpr size_t MaxCharsPerSweepPoint = 60;					// the most characters that AppendFrequencyResponse uses for one point
+
+	static Controller *sweepController = nullptr;					// the controller that last started a frequency response sweep, for return info type 28
+
+	// Trapezoid following
+	constexpr float BenchmarkTrapezoidDistance = 10.0;				// full steps
+	constexpr float BenchmarkTrapezoidSpeed = 200.0;				// full steps per second
+	constexpr float BenchmarkTrapezoidAcceleration = 10000.0;		// full steps per second squared
+	constexpr float BenchmarkTrapezoidAccelTime = BenchmarkTrapezoidSpeed/BenchmarkTrapezoidAcceleration;
+	constexpr float BenchmarkTrapezoidTime = BenchmarkTrapezoidDistance/BenchmarkTrapezoidSpeed + BenchmarkTrapezoidAccelTime;
+	constexpr float BenchmarkTrapezoidDwell = 0.1;					// seconds to wait at each end of the move
+
+	static_assert(BenchmarkTrapezoidDistance >= BenchmarkTrapezoidSpeed * BenchmarkTrapezoidAccelTime);	// the move must reach full speed
+
+	// Return the distance along the trapezoidal move at time t
+	static float TrapezoidPosition(float t) noexcept
+	{
+		if (t <= 0.0)
+		{
+			return 0.0;
+		}
+		if (t < BenchmarkTrapezoidAccelTime)
+		{
+			return 0.5 * BenchmarkTrapezoidAcceleration * fsquare(t);
+		}
+		if (t < BenchmarkTrapezoidTime - BenchmarkTrapezoidAccelTime)
+		{
+			return BenchmarkTrapezoidSpeed * (t - 0.5 * BenchmarkTrapezoidAccelTime);
+		}
+		if (t < BenchmarkTrapezoidTime)
+		{
+			return BenchmarkTrapezoidDistance - 0.5 * BenchmarkTrapezoidAcceleration * fsquare(BenchmarkTrapezoidTime - t);
+		}
+		return BenchmarkTrapezoidDistance;
+	}
+}
+
+// Set up the frequencies and amplitude of the sine sweep. The frequencies are evenly spaced on a log scale.
+void ClosedLoop::Controller::SetSweep(float startFrequency, float endFrequency, float amplitude, size_t numPoints) noexcept
+{
+	sweepStartFrequency = startFrequency;
+	sweepEndFrequency = endFrequency;
+	sweepAmplitude = amplitude;
+	numSweepPoints = numPoints;
+	numSweepPointsDone = 0;
+	const float ratio = (numPoints > 1) ? powf(endFrequency/startFrequency, 1.0/(float)(numPoints - 1)) : 1.0;
+	float frequency = startFrequency;
+	for (size_t i = 0; i < numPoints; ++i)
+	{
+		sweepPoints[i].frequency = frequency;
+		frequency *= ratio;
+	}
+}
+
+// Set up the sine sweep used by the benchmark
+void ClosedLoop::Controller::SetBenchmarkSweep() noexcept
+{
+	SetSweep(BenchmarkSweepStartFrequency, BenchmarkSweepEndFrequency, BenchmarkSineAmplitude, BenchmarkSweepPoints);
+}
+
+// Start the requested benchmark manoeuvres. They will run when any tuning has finished.
+void ClosedLoop::Controller::StartBenchmark(uint8_t manoeuvres) noexcept
+{
+	manoeuvres &= BENCHMARK_MANOEUVRES;
+	if (manoeuvres != 0)
+	{
+		Platform::DriveEnableOverride(driverNumber, true);			// enable the motor and prevent it becoming idle
+		benchmarkResultPending = false;
+		benchmarksDone = 0;
+		benchmarkVars.current = 0;
+		benchmarkVars.pending = manoeuvres;
+	}
+}
+
+// Stop benchmarking because something has stopped the manoeuvres from running, e.g. a tuning error or closed loop mode being disabled
+void ClosedLoop::Controller::AbandonBenchmark() noexcept
+{
+	if (benchmarkVars.pending != 0)
+	{
+		benchmarkVars.pending = 0;
+		benchmarkVars.current = 0;
+		Platform::DriveEnableOverride(driverNumber, false);
+	}
+}
+
+// Run one iteration of the current benchmark manoeuvre, starting the next one if necessary.
+// This is called from the control loop after we have read the encoder and updated the target from the move system, and before we calculate the error.
+void ClosedLoop::Controller::RunBenchmark(StepTimer::Ticks loopCallTime) noexcept
+{
+	if (benchmarkVars.current == 0)
+	{
+		// Start the next manoeuvre, using the lowest bit first
+		const uint8_t pending = benchmarkVars.pending;
+		benchmarkVars.current = pending & (uint8_t)(~pending + 1u);
+		benchmarkVars.phase = 0;
+		benchmarkVars.freqIndex = 0;
+		benchmarkVars.whenStarted = loopCallTime;
+		benchmarkVars.phaseStartTime = 0.0;
+		benchmarkVars.startPosition = currentMotorSteps;
+		benchmarkVars.commandedOffset = 0.0;
+		benchmarkVars.peakResponse = 0.0;
+		benchmarkVars.riseStartTime = benchmarkVars.riseEndTime = benchmarkVars.lastOutsideBandTime = -1.0;
+		benchmarkVars.sumSin = benchmarkVars.sumCos = benchmarkVars.errorSumSin = benchmarkVars.errorSumCos = 0.0;
+		benchmarkVars.sumSquaredError = benchmarkVars.maxError = 0.0;
+		benchmarkVars.numSamples = 0;
+	}
+
+	const float t = (float)(loopCallTime - benchmarkVars.whenStarted) * (1.0/(float)StepTimer::StepClockRate);
+	const float response = currentMotorSteps - benchmarkVars.startPosition;
+	float command = benchmarkVars.commandedOffset;
+	bool finished;
+	switch (benchmarkVars.current)
+	{
+	case BENCHMARK_STEP_MANOEUVRE:
+		finished = BenchmarkStep(t, response, command);
+		break;
+
+	case BENCHMARK_SINE_SWEEP_MANOEUVRE:
+		finished = BenchmarkSineSweep(t, response, command);
+		break;
+
+	case BENCHMARK_TRAPEZOID_MANOEUVRE:
+		finished = BenchmarkTrapezoid(t, response, command);
+		break;
+
+	default:
+		finished = true;
+		break;
+	}
+
+	AdjustTargetMotorSteps(command - benchmarkVars.commandedOffset);
+	benchmarkVars.commandedOffset = command;
+
+	if (finished)
+	{
+		benchmarksDone |= benchmarkVars.current;
+		const uint8_t stillPending = benchmarkVars.pending & ~benchmarkVars.current;
+		benchmarkVars.current = 0;
+		benchmarkVars.pending = stillPending;
+		if (stillPending == 0)
+		{
+			benchmarkResultPending = true;
+			Platform::DriveEnableOverride(driverNumber, false);
+		}
+	}
+}
+
+/*
+ * Step response
+ * -------------
+ *  - Phase 0: step the target forwards and measure the 10% to 90% rise time, the overshoot and the time taken to settle within 5% of the step
+ *  - Phase 1: step the target back and wait for the motor to settle
+ */
+bool ClosedLoop::Controller::BenchmarkStep(float t, float response, float& command) noexcept
+{
+	const float tp = t - benchmarkVars.phaseStartTime;
+	if (benchmarkVars.phase == 0)
+	{
+		command = BenchmarkStepAmplitude;
+		if (benchmarkVars.riseStartTime < 0.0 && response >= 0.1 * BenchmarkStepAmplitude)
+		{
+			benchmarkVars.riseStartTime = tp;
+		}
+		if (benchmarkVars.riseEndTime < 0.0 && response >= 0.9 * BenchmarkStepAmplitude)
+		{
+			benchmarkVars.riseEndTime = tp;
+		}
+		benchmarkVars.peakResponse = max<float>(benchmarkVars.peakResponse, response);
+		if (fabsf(response - BenchmarkStepAmplitude) > BenchmarkSettlingBand * BenchmarkStepAmplitude)
+		{
+			benchmarkVars.lastOutsideBandTime = tp;
+		}
+
+		if (tp >= BenchmarkStepWindow)
+		{
+			benchmarkRiseTime = (benchmarkVars.riseEndTime >= 0.0) ? benchmarkVars.riseEndTime - benchmarkVars.riseStartTime : -1.0;
+			benchmarkOvershoot = max<float>((benchmarkVars.peakResponse - BenchmarkStepAmplitude) * (100.0/BenchmarkStepAmplitude), 0.0);
+			// If we were outside the band during the last 10% of the window then we assume it didn't settle
+			benchmarkSettlingTime = (benchmarkVars.lastOutsideBandTime < 0.9 * BenchmarkStepWindow) ? max<float>(benchmarkVars.lastOutsideBandTime, 0.0) : -1.0;
+			benchmarkVars.phase = 1;
+			benchmarkVars.phaseStartTime = t;
+			command = 0.0;
+		}
+		return false;
+	}
+
+	command = 0.0;
+	return tp >= BenchmarkStepWindow;
+}
+
+/*
+ * Stepped sine sweep
+ * ------------------
+ *  - At each frequency, drive the target sinusoidally. Ignore the first few cycles, then correlate the response with the sine and cosine of
+ *    the command over a whole number of cycles to get the gain and phase lag of the fundamental.
+ *  - When all the frequencies are done, find where the gain first falls below -3dB, interpolating on a log frequency scale.
+ */
+bool ClosedLoop::Controller::BenchmarkSineSweep(float t, float response, float& command) noexcept
+{
+	SweepPoint& point = sweepPoints[benchmarkVars.freqIndex];
+	const float cycles = (t - benchmarkVars.phaseStartTime) * point.frequency;
+	if (cycles >= (float)(SweepSettleCycles + SweepMeasureCycles))
+	{
+		// Finished this frequency. A response of g * sin(wt - phi) correlates to (g/2) * cos(phi) with sin(wt) and to -(g/2) * sin(phi) with cos(wt).
+		const float scale = 2.0/((float)benchmarkVars.numSamples * 248.0 * sweepAmplitude);
+		const float inPhase = benchmarkVars.sumSin * scale, quadrature = benchmarkVars.sumCos * scale;
+		point.positionGain = sqrtf(fsquare(inPhase) + fsquare(quadrature));
+		point.positionPhaseLag = atan2f(-quadrature, inPhase) * (180.0/Pi);
+		const float errorInPhase = benchmarkVars.errorSumSin * scale, errorQuadrature = benchmarkVars.errorSumCos * scale;
+		point.errorGain = sqrtf(fsquare(errorInPhase) + fsquare(errorQuadrature));
+		point.errorPhaseLag = atan2f(-errorQuadrature, errorInPhase) * (180.0/Pi);
+		benchmarkVars.sumSin = benchmarkVars.sumCos = benchmarkVars.errorSumSin = benchmarkVars.errorSumCos = 0.0;
+		benchmarkVars.numSamples = 0;
+		benchmarkVars.phaseStartTime = t;
+		++benchmarkVars.freqIndex;
+		numSweepPointsDone = benchmarkVars.freqIndex;
+		command = 0.0;												// we finished at the end of a whole cycle, so the next frequency starts from zero
+		if (benchmarkVars.freqIndex < numSweepPoints)
+		{
+			return false;
+		}
+
+		benchmarkBandwidth = -1.0;
+		for (size_t i = 0; i < numSweepPoints; ++i)
+		{
+			if (sweepPoints[i].positionGain < BenchmarkBandwidthGain)
+			{
+				benchmarkBandwidth = (i == 0) ? 0.0
+									: sweepPoints[i - 1].frequency
+									  * powf(sweepPoints[i].frequency/sweepPoints[i - 1].frequency,
+											 (sweepPoints[i - 1].positionGain - BenchmarkBandwidthGain)/(sweepPoints[i - 1].positionGain - sweepPoints[i].positionGain));
+				break;
+			}
+		}
+		return true;
+	}
+
+	// The sine table has 65536 fine phase units per cycle, so just truncate the phase to 16 bits to take it modulo one cycle
+	float sine, cosine;
+	Trigonometry::FastSinCosFine((uint16_t)(uint32_t)(cycles * 65536.0), sine, cosine);
+	command = sine * (sweepAmplitude/248.0);
+	if (cycles >= (float)SweepSettleCycles)
+	{
+		benchmarkVars.sumSin += response * sine;
+		benchmarkVars.sumCos += response * cosine;
+		const float error = command - response;
+		benchmarkVars.errorSumSin += error * sine;
+		benchmarkVars.errorSumCos += error * cosine;
+		++benchmarkVars.numSamples;
+	}
+	return false;
+}
+
+/*
+ * Trapezoid following
+ * -------------------
+ *  - Phase 0: follow a trapezoidal move forwards, measuring the following error
+ *  - Phase 1: dwell
+ *  - Phase 2: follow the same move back to the start, measuring the following error
+ *  - Phase 3: dwell, then report the RMS and peak following error during the two moves
+ */
+bool ClosedLoop::Controller::BenchmarkTrapezoid(float t, float response, float& command) noexcept
+{
+	const float tp = t - benchmarkVars.phaseStartTime;
+	switch (benchmarkVars.phase)
+	{
+	case 0:
+	case 2:
+		{
+			// The target we set last time is the one the motor has been following
+			const float error = command - response;
+			benchmarkVars.sumSquaredError += fsquare(error);
+			benchmarkVars.maxError = max<float>(benchmarkVars.maxError, fabsf(error));
+			++benchmarkVars.numSamples;
+			const float distance = TrapezoidPosition(tp);
+			command = (benchmarkVars.phase == 0) ? distance : BenchmarkTrapezoidDistance - distance;
+			if (tp >= BenchmarkTrapezoidTime)
+			{
+				++benchmarkVars.phase;
+				benchmarkVars.phaseStartTime = t;
+			}
+		}
+		return false;
+
+	case 1:
+		command = BenchmarkTrapezoidDistance;
+		if (tp >= BenchmarkTrapezoidDwell)
+		{
+			benchmarkVars.phase = 2;
+			benchmarkVars.phaseStartTime = t;
+		}
+		return false;
+
+	default:
+		command = 0.0;
+		if (tp < BenchmarkTrapezoidDwell)
+		{
+			return false;
+		}
+		benchmarkRmsError = (benchmarkVars.numSamples == 0) ? 0.0 : sqrtf(benchmarkVars.sumSquaredError/(float)benchmarkVars.numSamples);
+		benchmarkPeakError = benchmarkVars.maxError;
+		return true;
+	}
+}
+
+// Append the benchmark results to the reply
+void ClosedLoop::Controller::AppendBenchmarkResults(const StringRef& reply) const noexcept
+{
+	reply.lcatf("Driver %u.%u benchmark, Kp %.1f Ki %.1f Kd %.3f", CanInterface::GetCanAddress(), driverNumber, (double)Kp, (double)Ki, (double)Kd);
+	if (benchmarksDone & BENCHMARK_STEP_MANOEUVRE)
+	{
+		reply.lcatf("Step %.1f steps: ", (double)BenchmarkStepAmplitude);
+		if (benchmarkRiseTime < 0.0)
+		{
+			reply.cat("did not reach 90%");
+		}
+		else
+		{
+			reply.catf("rise time %.2fms", (double)(benchmarkRiseTime * 1000.0));
+		}
+		reply.catf(", overshoot %.1f%%, ", (double)benchmarkOvershoot);
+		if (benchmarkSettlingTime < 0.0)
+		{
+			reply.cat("did not settle");
+		}
+		else
+		{
+			reply.catf("settling time %.2fms", (double)(benchmarkSettlingTime * 1000.0));
+		}
+	}
+	if (benchmarksDone & BENCHMARK_SINE_SWEEP_MANOEUVRE)
+	{
+		reply.lcatf("Sine %.2f steps, gain/phase lag:", (double)sweepAmplitude);
+		for (size_t i = 0; i < numSweepPoints; ++i)
+		{
+			reply.catf(" %.0fHz %.2f/%.0f", (double)sweepPoints[i].frequency, (double)sweepPoints[i].positionGain, (double)sweepPoints[i].positionPhaseLag);
+		}
+		if (benchmarkBandwidth < 0.0)
+		{
+			reply.catf(", bandwidth >%.0fHz", (double)sweepEndFrequency);
+		}
+		else if (benchmarkBandwidth == 0.0)
+		{
+			reply.catf(", bandwidth <%.0fHz", (double)sweepStartFrequency);
+		}
+		else
+		{
+			reply.catf(", bandwidth %.0fHz", (double)benchmarkBandwidth);
+		}
+	}
+	if (benchmarksDone & BENCHMARK_TRAPEZOID_MANOEUVRE)
+	{
+		reply.lcatf("Trapezoid %.0f steps at %.0f steps/sec: RMS following error %.3f steps, peak %.3f steps",
+					(double)BenchmarkTrapezoidDistance, (double)BenchmarkTrapezoidSpeed, (double)benchmarkRmsError, (double)benchmarkPeakError);
+	}
+}
+
+// Start a frequency response sweep. The control loop adds a sine of each frequency in turn to the target position and demodulates the response.
+// The frequencies parameter is the start frequency in the low 16 bits and the end frequency in the high 16 bits, both in Hz.
+// The amplitudeAndPoints parameter is the amplitude in thousandths of a full step in the low 16 bits and the number of points in the high 16 bits.
+// Zero values select the defaults.
+GCodeResult ClosedLoop::Controller::StartFrequencyResponse(uint32_t frequencies, uint32_t amplitudeAndPoints, const StringRef& reply) noexcept
+{
+	const float startFrequency = ((frequencies & 0xFFFF) != 0) ? (float)(frequencies & 0xFFFF) : BenchmarkSweepStartFrequency;
+	const float endFrequency = ((frequencies >> 16) != 0) ? (float)(frequencies >> 16) : BenchmarkSweepEndFrequency;
+	const float amplitude = ((amplitudeAndPoints & 0xFFFF) != 0) ? (float)(amplitudeAndPoints & 0xFFFF) * 0.001 : DefaultSweepAmplitude;
+	const size_t numPoints = ((amplitudeAndPoints >> 16) != 0) ? amplitudeAndPoints >> 16 : DefaultSweepPoints;
+
+	if (!closedLoopEnabled || tuning != 0 || tuningError != 0)
+	{
+		reply.copy("Closed loop must be enabled and the drive tuned before measuring the frequency response");
+		return GCodeResult::error;
+	}
+	if (benchmarkVars.pending != 0)
+	{
+		reply.copy("A benchmark or frequency response sweep is already running");
+		return GCodeResult::error;
+	}
+	if (startFrequency < MinSweepFrequency || endFrequency > MaxSweepFrequency || endFrequency < startFrequency)
+	{
+		reply.printf("Sweep frequencies must be between %.0fHz and %.0fHz", (double)MinSweepFrequency, (double)MaxSweepFrequency);
+		return GCodeResult::error;
+	}
+	if (amplitude <= 0.0 || amplitude > MaxSweepAmplitude)
+	{
+		reply.printf("Sweep amplitude must be greater than zero and not more than %.1f steps", (double)MaxSweepAmplitude);
+		return GCodeResult::error;
+	}
+	if (numPoints == 0 || numPoints > MaxSweepPoints)
+	{
+		reply.printf("Number of points must be 1 to %u", (unsigned int)MaxSweepPoints);
+		return GCodeResult::error;
+	}
+
+	SetSweep(startFrequency, endFrequency, amplitude, numPoints);
+	sweepController = this;
+	StartBenchmark(BENCHMARK_SINE_SWEEP_MANOEUVRE);
+	reply.printf("Driver %u.%u frequency response sweep started, %.1fHz to %.1fHz, %u points, amplitude %.3f steps",
+					CanInterface::GetCanAddress(), driverNumber, (double)startFrequency, (double)endFrequency, (unsigned int)numPoints, (double)amplitude);
+	return GCodeResult::ok;
+}
+
+// Append the frequency response record starting at the specified point, as many points as will fit in the reply.
+// The format is: version, colon, 1 if the sweep is still running else 0, colon, the number of points in the sweep, colon, the number of points done, colon,
+// the index of the first point in the reply, colon, the amplitude in full steps, colon, then the points separated by semicolons.
+// Each point is the frequency in Hz, the position gain, the position phase lag in degrees, the error gain and the error phase lag in degrees, separated by commas.
+void ClosedLoop::Controller::AppendFrequencyResponse(const StringRef& reply, unsigned int startIndex) const noexcept
+{
+	const size_t pointsDone = numSweepPointsDone;
+	reply.printf("%u:%u:%u:%u:%u:%.4f:", SweepRecordVersion, (benchmarkVars.pending & BENCHMARK_SINE_SWEEP_MANOEUVRE) ? 1u : 0u,
+					(unsigned int)numSweepPoints, (unsigned int)pointsDone, startIndex, (double)sweepAmplitude);
+	for (size_t i = startIndex; i < pointsDone && reply.strlen() + MaxCharsPerSweepPoint < reply.Capacity(); ++i)
+	{
+		const SweepPoint& point = sweepPoints[i];
+		reply.catf((i == startIndex) ? "%.2f,%.4f,%.1f,%.4f,%.1f" : ";%.2f,%.4f,%.1f,%.4f,%.1f",
+					(double)point.frequency, (double)point.positionGain, (double)point.positionPhaseLag, (double)point.errorGain, (double)point.errorPhaseLag);
+	}
+}
+
+// Append the frequency response record of the driver that last started a sweep
+void ClosedLoop::AppendFrequencyResponse(const StringRef& reply, unsigned int startIndex) noexcept
+{
+	if (sweepController == nullptr)
+	{
+		reply.printf("%u:0:0:0:%u:0:", SweepRecordVersion, startIndex);
+	}
+	else
+	{
+		sweepController->AppendFrequencyResponse(reply, startIndex);
+	}
+}
+
+#endif
+
+// End
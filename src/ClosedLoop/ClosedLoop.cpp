@@ -19,8 +19,13 @@ using std::numeric_limits;
 
 # include <math.h>
 # include <Platform.h>
+# include <Movement/Move.h>
 # include <General/Bitmap.h>
 # include <TaskPriorities.h>
+# include <LatencyHistograms.h>
+# include <MemoryArenas.h>
+# include <DiagnosticsRecord.h>
+# include <Hardware/NvmStore.h>
 # include <CAN/CanInterface.h>
 # include <CanMessageBuffer.h>
 # include <CanMessageFormats.h>
@@ -28,6 +33,8 @@ using std::numeric_limits;
 # include <CanMessageGenericTables.h>
 
 # include "QuadratureEncoderPdec.h"
+# include "CurrentSense.h"
+# include <DataCapture.h>
 
 # if SUPPORT_TMC2160
 #  include "Movement/StepperDrivers/TMC51xx.h"
@@ -35,27 +42,14 @@ using std::numeric_limits;
 #  error Cannot support closed loop with the specified hardware
 # endif
 
-#define BASIC_TUNING_DEBUG	0
-
-// Variables that are used by both the ClosedLoop and the Tuning modules
-
-Encoder*	ClosedLoop::encoder = nullptr;				// Pointer to the encoder object in use
-uint8_t		ClosedLoop::tuning = 0;						// Bitmask of any tuning manoeuvres that have been requested
-uint8_t		ClosedLoop::tuningError;					// Flags for any tuning errors
-uint16_t	ClosedLoop::measuredStepPhase;				// The measured position of the motor
-uint16_t	ClosedLoop::desiredStepPhase = 0;			// The desired position of the motor
-int32_t		ClosedLoop::currentEncoderReading;			// The raw reading taken from the encoder
-														// TODO no good for an extruder, use int32_t instead to count 1/256 microsteps and handle overflow
-float 		ClosedLoop::encoderPulsePerStep;			// How many encoder readings do we get per step?
-
 namespace ClosedLoop
 {
 	// Constants private to this module
 	constexpr size_t TaskStackWords = 200;				// Size of the stack for all closed loop tasks
-	constexpr unsigned int derivativeFilterSize = 8;	// The range of the derivative filter (use a power of 2 for efficiency)
-	constexpr unsigned int DataBufferSize = 2000 * 14;	// When collecting samples we can accommodate 2000 readings of up to 13 variables + timestamp
+	constexpr unsigned int DataBufferSize = 2000 * 14;	// When collecting samples we can accommodate 2000 readings of 13 variables + timestamp, fewer if we record more variables
 	constexpr unsigned int tuningStepsPerSecond = 2000;	// the rate at which we send 1/256 microsteps during tuning, slow enough for high-inertia motors
 	constexpr StepTimer::Ticks stepTicksPerTuningStep = StepTimer::StepClockRate/tuningStepsPerSecond;
+	constexpr unsigned int MaxBasicTuningStepsPerSecond = 8000;	// the rate at which we start basic tuning. We halve it down to tuningStepsPerSecond if the motor doesn't keep up.
 	constexpr StepTimer::Ticks stepTicksBeforeTuning = StepTimer::StepClockRate/10;
 														// 1/10 sec delay between enabling the driver and starting tuning, to allow for brake release and current buildup
 	constexpr StepTimer::Ticks DataCollectionIdleStepTicks = StepTimer::StepClockRate/200;
@@ -69,6 +63,27 @@ namespace ClosedLoop
 	constexpr float MaxSafeHysteresis = 0.2;			// the maximum hysteresis in full steps that we are happy with - warn if there is more
 
 	constexpr float PIDIlimit = 80.0;
+	constexpr float LoadEstimateDecayFactor = 1.0/2000;	// how fast the load estimate falls when the torque demand drops, per control loop iteration (about 100ms time constant)
+
+#if CL_USE_FIXED_POINT
+	// Fixed point values are in Q16 format unless stated otherwise
+	constexpr int32_t FixedOne = 1 << 16;
+	constexpr int32_t PIDIlimitQ16 = (int32_t)(PIDIlimit * FixedOne);
+	constexpr int32_t PIDControlLimitQ16 = 256 * FixedOne;
+	constexpr int32_t MinimumPhaseShiftQ16 = (int32_t)(MinimumPhaseShift * FixedOne);
+#endif
+
+	constexpr unsigned int ControlLoopFrequency = 20000;	// the nominal rate at which we run the control loop when closed loop mode is enabled
+	constexpr StepTimer::Ticks ControlLoopPeriodTicks = StepTimer::StepClockRate/ControlLoopFrequency;
+	constexpr float StallPredictionTime = 0.005;				// how far ahead in seconds we extrapolate the error to predict a stall, long enough for the main board to slow down
+	constexpr float SaturatedControlSignal = 250.0;				// if the PID control signal is at least this then the motor is producing close to maximum torque
+	constexpr unsigned int SaturatedLoopsForPreStall = 20;		// how many consecutive saturated control loop iterations with the error increasing cause a pre-stall warning
+	constexpr float EncoderVelocityObserverBandwidth = 1000.0;									// bandwidth in Hz of the observer that we use to extrapolate encoder readings
+	constexpr StepTimer::Ticks MonitorIntervalTicks = StepTimer::StepClockRate/100;				// how often we check the encoder position in open loop mode
+	constexpr float PolarityLearningSteps = 4.0;												// how far the motor must move in open loop mode before we decide the encoder polarity
+	constexpr StepTimer::Ticks MaxEncoderLatencyTicks = 2 * ControlLoopPeriodTicks;				// if a reading is older than this then it is stale and we don't try to extrapolate it
+	constexpr float MaxPlausibleEncoderJumpSteps = 2.0;											// a reading further than this in full steps from the predicted position is suspect
+	constexpr uint8_t MaxConsecutiveRejectedReadings = 2;										// if more suspect readings than this arrive in a row then the motor really has moved
 
 	// Enumeration of closed loop recording modes
 	enum RecordingMode : uint8_t
@@ -80,43 +95,36 @@ namespace ClosedLoop
 	};
 
 	// Variables private to this module
-	float	recipEncoderPulsesPerStep;					// Reciprocal of the encoder pulses per step, to avoid FP division when calculating the error
-
-	// Control variables, set by the user to determine how the closed loop controller works
-	bool 	closedLoopEnabled = false;					// Has closed loop been enabled by the user?
-	uint8_t prevTuningError;							// Used to see what errors have been introduced by tuning
-
-	// Holding current, and variables derived from it
-	float 	holdCurrentFraction = DefaultHoldCurrentFraction;			// The minimum holding current when stationary
-	float	recipHoldCurrentFraction = 1.0/DefaultHoldCurrentFraction;	// The reciprocal of the minimum holding current
-	float	holdCurrentFractionTimesMinPhaseShift = MinimumPhaseShift * DefaultHoldCurrentFraction;
-
-	int32_t	reversePolarityMultiplier = 1;				// +1 if encoder direction is forwards, -1 if it is reverse
+	Controller controllers[NumClosedLoopDrivers];		// The closed loop controllers, one per driver
 
-	float 	Kp = 100;									// The proportional constant for the PID controller
-	float 	Ki = 0;										// The proportional constant for the PID controller
-	float 	Kd = 0;										// The proportional constant for the PID controller
-
-	float 	errorThresholds[2];							// The error thresholds. [0] is pre-stall, [1] is stall
-
-	float 	ultimateGain = 0;							// The ultimate gain of the controller (used for tuning)
-	float 	oscillationPeriod = 0;						// The oscillation period when Kp = ultimate gain
-
-	// Data collection variables
+	// Data collection variables. There is only one data collection buffer so only one driver can collect data at a time.
 	// Input variables
 	volatile RecordingMode samplingMode = RecordingMode::None;	// What mode did they request? Volatile because we care about when it is written.
+	Controller * volatile dataCollectionController = nullptr;	// The controller that we are collecting data from
 	uint8_t 	movementRequested;						// Which calibration movement did they request? 0=none, 1=polarity, 2=continuous
 	uint16_t	filterRequested;						// What filter did they request?
-	volatile uint16_t samplesRequested;
+	volatile uint16_t samplesRequested;					// How many samples to collect, or 0 to stream data until told to stop
 
 	// Derived variables
 	volatile unsigned int variableCount;
-	volatile uint16_t samplesCollected = 0;
-	volatile uint16_t samplesSent = 0;;
+	volatile uint32_t samplesCollected = 0;				// 32-bit so that streamed data collection can run for a long time
+	volatile uint32_t samplesSent = 0;
+	uint32_t	samplesDropped;							// How many samples we discarded while streaming because the buffer was full
 	StepTimer::Ticks dataCollectionStartTicks;			// At what tick did data collection start?
 	StepTimer::Ticks dataCollectionIntervalTicks;		// the requested interval between samples
 	StepTimer::Ticks whenNextSampleDue;					// when it will be time to take the next sample
 
+	// The variables to record, compiled from the filter when data collection starts so that collecting a sample doesn't need to test every filter bit
+	enum class SampleSourceType : uint8_t { floatVar = 0, int32Var, int16Var, uint16Var, errorDerivative };
+	struct SampleRecipeItem
+	{
+		const void *source;
+		SampleSourceType type;
+	};
+	constexpr size_t MaxSampleRecipeItems = 16;
+	SampleRecipeItem sampleRecipe[MaxSampleRecipeItems];
+	size_t sampleRecipeLength = 0;
+
 	// Data collection buffer and related variables
 	float 	sampleBuffer[DataBufferSize];				// Ring buffer to store the samples in
 	volatile size_t sampleBufferReadPointer = 0;		// Send this sample next to the main board
@@ -124,104 +132,27 @@ namespace ClosedLoop
 	volatile size_t	sampleBufferLimit;					// the limit for the read/write pointers, to avoid wrapping within a single set of sampled variables
 	volatile bool	sampleBufferOverflowed;				// true if we collected data faster than we could send it
 
-	// Working variables
-	// These variables are all used to calculate the required motor currents. They are declared here so they can be reported on by the data collection task
-	bool 	stepDirection = true;						// The direction the motor is attempting to take steps in
-	float	targetMotorSteps;							// The number of steps the motor should have taken relative to it's zero position
-	float	currentMotorSteps;							// The number of steps the motor has taken relative to it's zero position
-	int32_t targetEncoderReading;						// The encoder reading we want, calculated from targetMotorSteps
-	float 	currentError;								// The current error
-
-	DerivativeAveragingFilter<derivativeFilterSize> derivativeFilter;	// An averaging filter to smooth the derivative of the error
-
-	float 	PIDPTerm;									// Proportional term
-	float 	PIDITerm = 0.0;								// Integral accumulator
-	float 	PIDDTerm;									// Derivative term
-	float	PIDControlSignal;							// The overall signal from the PID controller
-
-	float	phaseShift;									// The desired shift in the position of the motor, where 1024 = 1 full step
-
-	int16_t coilA;										// The current to run through coil A
-	int16_t coilB;										// The current to run through coil A
-
-	bool 	stall = false;								// Has the closed loop error threshold been exceeded?
-	bool 	preStall = false;							// Has the closed loop warning threshold been exceeded?
-
-	// Tuning variables
-	struct TuningResults
-	{
-		float slope;
-		float origin;
-		float xMean;
-		float revisedOrigin;
-
-		// Calculate the revised origin based on a different slope, using the mid point of the move as the reference point
-		void CalcRevisedOrigin(float slopeToUse) noexcept
-		{
-			revisedOrigin = origin + (slope - slopeToUse) * xMean;
-		}
-
-		// Print the values - used for debugging only
-		void Print(const char *s, const StringRef& reply) const noexcept
-		{
-			reply.catf("%s: slope %.4f meanX %.1f origin %.2f revised origin %.2f\n", s, (double)slope, (double)xMean, (double)origin, (double)revisedOrigin);
-		}
-	};
-
-	TuningResults forwardTuningResults, reverseTuningResults;
-	float measuredCountsPerStep;
-	float tuningHysteresis;
-	StepTimer::Ticks whenLastTuningStepTaken;			// when the control loop last called the tuning code
-
-#if BASIC_TUNING_DEBUG
-	int32_t originalRawEncoderReading = 0;
-	uint16_t originalDesiredStepPhase = 0, originalMeasuredStepPhase = 0;
-	float originalCurrentMotorSteps = 0.0;
-	float originalAssumedEncoderReading = 0.0, originalDesiredEncoderReading = 0.0;
-	int32_t offsetCorrectionMade = 0;
-	int32_t finalRawEncoderReading = 0;
-	uint16_t finalMeasuredStepPhase = 0;
-	float finalCurrentMotorSteps = 0.0;
-#endif
-
-	// The bitmask of a minimal tuning error for each encoder type
-	// This is an array so that ZEROING_MANOEUVRE can be removed from the magnetic encoders if the LUT is in NVM
-	uint8_t minimalTunes[5] =
-	{
-		// None
-		0,
-		// linearQuadrature
-		TUNE_ERR_NOT_DONE_BASIC,
-		// rotaryQuadrature
-		TUNE_ERR_NOT_DONE_BASIC,
-		// AS5047
-		TUNE_ERR_NOT_DONE_BASIC | TUNE_ERR_NOT_CALIBRATED,
-		// TLI5012
-		TUNE_ERR_NOT_DONE_BASIC | TUNE_ERR_NOT_CALIBRATED,
-	};
-
 	// Monitoring variables
-	// These variables monitor how fast the PID loop is running etc.
-	StepTimer::Ticks prevControlLoopCallTime;			// The last time the control loop was called
+	// These variables monitor how fast the PID loop is running etc. They cover the control loops of all drivers.
 	StepTimer::Ticks minControlLoopRuntime;				// The minimum time the control loop has taken to run
 	StepTimer::Ticks maxControlLoopRuntime;				// The maximum time the control loop has taken to run
 	StepTimer::Ticks minControlLoopCallInterval;		// The minimum interval between the control loop being called
 	StepTimer::Ticks maxControlLoopCallInterval;		// The maximum interval between the control loop being called
 
+	// Variables used to run the control loops at a fixed rate
+	StepTimer controlLoopTimer;							// Timer used to wake up the TMC task when the control loop is next due
+	TaskBase * volatile taskWaitingForControlLoop = nullptr;
+	StepTimer::Ticks whenControlLoopDue;				// The scheduled time of the current control loop iteration
+	StepTimer::Ticks prevControlLoopStartTime;			// The time at which the last control loop iteration actually started
+	unsigned int numControlLoopOverruns;				// How many times the control loop was late by more than one period
+
 	// Functions private to this module
-	EncoderType GetEncoderType() noexcept
-	{
-		return (encoder == nullptr) ? EncoderType::none : encoder->GetType();
-	}
 
 	// Return true if we are currently collecting data or primed to collect data or finishing sending data
 	inline bool CollectingData() noexcept { return samplingMode != RecordingMode::None; }
 
-	void ReadState() noexcept;
-	void CollectSample() noexcept;
-	void ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept;
-	void StartTuning(uint8_t tuningType) noexcept;
-	void ReportTuningErrors(uint8_t tuningErrorBitmask, const StringRef& reply) noexcept;
+	bool AnyClosedLoopEnabled() noexcept;
+	void WaitForControlLoopDue() noexcept;
 
 	extern "C" [[noreturn]] void DataTransmissionLoop(void *param) noexcept;
 
@@ -231,11 +162,6 @@ namespace ClosedLoop
 static Task<ClosedLoop::TaskStackWords> *dataTransmissionTask;		// Data transmission task - handles sending back the buffered sample data
 
 // Helper function to count the number of variables being collected by a given filter
-static inline unsigned int CountVariablesCollected(uint16_t filter)
-{
-	return (new Bitmap<uint16_t>(filter))->CountSetBits() + 1;
-}
-
 // Helper function to convert a time period (expressed in StepTimer::Ticks) to ms
 static inline float TickPeriodToTimePeriod(StepTimer::Ticks tickPeriod) {
 	return tickPeriod * StepTimer::StepClocksToMillis;
@@ -252,37 +178,53 @@ static void ResetMonitoringVariables() {
 	ClosedLoop::maxControlLoopRuntime = numeric_limits<StepTimer::Ticks>::min();
 	ClosedLoop::minControlLoopCallInterval = numeric_limits<StepTimer::Ticks>::max();
 	ClosedLoop::maxControlLoopCallInterval = numeric_limits<StepTimer::Ticks>::min();
+	ClosedLoop::numControlLoopOverruns = 0;
+	for (ClosedLoop::Controller& c : ClosedLoop::controllers)
+	{
+		c.ResetCurrentStatistics();
+	}
+}
+
+// Control loop timer callback, called from the step ISR
+static void ControlLoopTimerCallback(CallbackParameter) noexcept
+{
+	TaskBase * const waitingTask = ClosedLoop::taskWaitingForControlLoop;
+	if (waitingTask != nullptr)
+	{
+		ClosedLoop::taskWaitingForControlLoop = nullptr;
+		TaskBase::GiveFromISR(waitingTask);
+	}
 }
 
 // Helper function to convert between the internal representation of encoderCountPerStep, and the appropriate external representation (e.g. CPR)
 //TODO make this a virtual function member of the encoder?
-float ClosedLoop::PulsePerStepToExternalUnits(float pps, uint8_t encoderType) noexcept {
+float ClosedLoop::Controller::PulsePerStepToExternalUnits(float pps, uint8_t encoderType) const noexcept {
 	switch (encoderType)
 	{
 	case EncoderType::rotaryQuadrature:
 		return pps / 4;															// Output count per step
 	case EncoderType::AS5047:
-		return (360.0 / ((AS5047D*) ClosedLoop::encoder)->GetMaxValue()) * pps;	// Output degree per step
+		return (360.0 / ((AS5047D*) encoder)->GetMaxValue()) * pps;				// Output degree per step
 	default:
 		return pps;																// Output pulse per step
 	}
 }
 
 //TODO make this a virtual function member of the encoder?
-float ClosedLoop::ExternalUnitsToPulsePerStep(float externalUnits, uint8_t encoderType) noexcept {
+float ClosedLoop::Controller::ExternalUnitsToPulsePerStep(float externalUnits, uint8_t encoderType) const noexcept {
 	switch (encoderType)
 	{
 	case EncoderType::rotaryQuadrature:
 		return externalUnits * 4;												// Input is count per step
 	case EncoderType::AS5047:
-		return (((AS5047D*) ClosedLoop::encoder)->GetMaxValue() / 360.0) * externalUnits;	// Input is degree per step
+		return (((AS5047D*) encoder)->GetMaxValue() / 360.0) * externalUnits;	// Input is degree per step
 	default:
 		return externalUnits;													// Input is pulse per step
 	}
 }
 
 // Helper function to cat all the current tuning errors onto a reply in human-readable form
-void ClosedLoop::ReportTuningErrors(uint8_t tuningErrorBitmask, const StringRef &reply)
+void ClosedLoop::Controller::ReportTuningErrors(uint8_t tuningErrorBitmask, const StringRef &reply) const noexcept
 {
 	if (tuningErrorBitmask & TUNE_ERR_NOT_DONE_BASIC) 		{ reply.cat(" The drive has not had basic tuning done."); }
 	if (tuningErrorBitmask & TUNE_ERR_NOT_CALIBRATED) 		{ reply.cat(" The drive has not been calibrated."); }
@@ -294,15 +236,22 @@ void ClosedLoop::ReportTuningErrors(uint8_t tuningErrorBitmask, const StringRef
 
 // Helper function to set the motor to a given phase and magnitude
 // The phase is normally in the range 0 to 4095 but when tuning it can be 0 to somewhat over 8192. We must take it modulo 4096 when computing the currents.
-void ClosedLoop::SetMotorPhase(uint16_t phase, float magnitude) noexcept
+void ClosedLoop::Controller::SetMotorPhase(uint16_t phase, float magnitude) noexcept
 {
-	float sine, cosine;
-	Trigonometry::FastSinCos(phase, sine, cosine);
-	coilA = (int16_t)lrintf(cosine * magnitude);
-	coilB = (int16_t)lrintf(sine * magnitude);
+	SetMotorFinePhase((uint16_t)(phase << Trigonometry::FinePhaseBits), magnitude);		// the conversion to uint16_t takes the phase modulo 4096
+}
+
+// Set the motor to a given phase and magnitude, where the phase has FinePhaseBits more resolution than in SetMotorPhase so that 65536 is a complete cycle
+void ClosedLoop::Controller::SetMotorFinePhase(uint16_t finePhase, float magnitude) noexcept
+{
+	Trigonometry::FastSinCosFine(finePhase, (uint32_t)constrain<int32_t>(lrintf(magnitude * 65536.0), 0, 65536), coilB, coilA);
+	SetMotorCurrents();
+}
 
-# if SUPPORT_TMC2160 && SINGLE_DRIVER
-	SmartDrivers::SetRegister(0, SmartDriverRegister::xDirect, (((uint32_t)(uint16_t)coilB << 16) | (uint32_t)(uint16_t)coilA) & 0x01FF01FF);
+void ClosedLoop::Controller::SetMotorCurrents() noexcept
+{
+# if SUPPORT_TMC2160
+	SmartDrivers::SetRegister(driverNumber, SmartDriverRegister::xDirect, (((uint32_t)(uint16_t)coilB << 16) | (uint32_t)(uint16_t)coilA) & 0x01FF01FF);
 # else
 #  error Cannot support closed loop with the specified hardware
 # endif
@@ -318,40 +267,96 @@ static void GenerateTmcClock()
 
 void ClosedLoop::Init() noexcept
 {
+	MemoryArenas::Scope scope(MemoryArena::closedLoop);
 	pinMode(EncoderCsPin, OUTPUT_HIGH);											// make sure that any attached SPI encoder is not selected
 
 	GenerateTmcClock();															// generate the clock for the TMC2160A
 
-	// Initialise to no error thresholds
-	errorThresholds[0] = 0;
-	errorThresholds[1] = 0;
+	for (size_t driver = 0; driver < NumClosedLoopDrivers; ++driver)
+	{
+		controllers[driver].Init(driver);
+	}
 
 	// Initialise the monitoring variables
 	ResetMonitoringVariables();
 
-	derivativeFilter.Reset();
+	controlLoopTimer.SetCallback(ControlLoopTimerCallback, CallbackParameter(nullptr));
+#if SUPPORT_CL_CURRENT_SENSE
+	CurrentSense::Init();
+#endif
 
 	// Set up the data transmission task
 	dataTransmissionTask = new Task<ClosedLoop::TaskStackWords>;
 	dataTransmissionTask->Create(DataTransmissionLoop, "CLSend", nullptr, TaskPriority::ClosedLoopDataTransmission);
 }
 
+void ClosedLoop::Controller::Init(size_t p_driverNumber) noexcept
+{
+	driverNumber = p_driverNumber;
+
+	// Initialise to no error thresholds
+	errorThresholds[0] = 0;
+	errorThresholds[1] = 0;
+
+	holdCurrentFraction = DefaultHoldCurrentFraction;
+	recipHoldCurrentFraction = 1.0/DefaultHoldCurrentFraction;
+	holdCurrentFractionTimesMinPhaseShift = MinimumPhaseShift * DefaultHoldCurrentFraction;
+	basicTuningStepsPerSecond = tuningStepsPerSecond;
+	basicTuningStepTicks = stepTicksPerTuningStep;
+
+	ResetCurrentStatistics();
+	derivativeFilter.Reset();
+	errorObserver.Reset();
+	encoderVelocityObserver.SetBandwidth(EncoderVelocityObserverBandwidth, ControlLoopPeriodTicks);
+	encoderVelocityObserver.Reset();
+#if CL_USE_FIXED_POINT
+	UpdateFixedPointParameters();
+#endif
+}
+
+// Get the controller for the driver number in a M569.1 or M569.6 command, or return nullptr and set up the reply if it is out of range
+static ClosedLoop::Controller *GetController(CanMessageGenericParser& parser, const StringRef& reply) noexcept
+{
+	uint8_t drive = 0;
+	(void)parser.GetUintParam('P', drive);
+	if (drive >= NumClosedLoopDrivers)
+	{
+		reply.printf("Driver number %u.%u does not support closed loop mode", CanInterface::GetCanAddress(), drive);
+		return nullptr;
+	}
+	return &ClosedLoop::controllers[drive];
+}
+
 GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const StringRef &reply) noexcept
 {
 	CanMessageGenericParser parser(msg, M569Point1Params);
+	Controller * const c = GetController(parser, reply);
+	return (c == nullptr) ? GCodeResult::error : c->ProcessM569Point1(parser, reply);
+}
 
+GCodeResult ClosedLoop::Controller::ProcessM569Point1(CanMessageGenericParser& parser, const StringRef &reply) noexcept
+{
 	// Set default parameters
 	uint8_t tempEncoderType = GetEncoderType().ToBaseType();
 	float tempCPR;
 	float tempKp = Kp;
 	float tempKi = Ki;
 	float tempKd = Kd;
+	float tempKv = Kv;
+	float tempKa = Ka;
+	float tempLoadCurrentMargin = loadCurrentMargin;
+	uint8_t tempObserverType = (uint8_t)errorObserverType;
+	float tempObserverParameter = errorObserverParameter;
+	uint8_t tempFocMode = (focEnabled) ? 1 : 0;
+	float tempMonitorThreshold = monitorThreshold;
+	size_t numCurrentGains = 2;
+	float tempCurrentGains[2] = { currentKp, currentKi };
 	size_t numThresholds = 2;
 	float tempErrorThresholds[numThresholds];
 	float holdingCurrentPercent;
 
 	// Pull changed parameters
-	uint8_t seen = 0;
+	uint16_t seen = 0;
 	seen |= parser.GetUintParam('T', tempEncoderType) 			<< 0;
 	seen |= parser.GetFloatParam('C', tempCPR) 					<< 1;
 	seen |= parser.GetFloatParam('R', tempKp) 					<< 2;
@@ -359,6 +364,14 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 	seen |= parser.GetFloatParam('D', tempKd) 					<< 4;
 	seen |= parser.GetFloatArrayParam('E', numThresholds, tempErrorThresholds) << 5;
 	seen |= parser.GetFloatParam('H', holdingCurrentPercent)	<< 6;
+	seen |= parser.GetFloatParam('V', tempKv)					<< 7;
+	seen |= parser.GetFloatParam('A', tempKa)					<< 8;
+	seen |= parser.GetFloatParam('L', tempLoadCurrentMargin)	<< 9;
+	seen |= parser.GetUintParam('O', tempObserverType)			<< 10;
+	seen |= parser.GetFloatParam('B', tempObserverParameter)	<< 11;
+	seen |= parser.GetUintParam('F', tempFocMode)				<< 12;
+	seen |= parser.GetFloatArrayParam('G', numCurrentGains, tempCurrentGains) << 13;
+	seen |= parser.GetFloatParam('M', tempMonitorThreshold)		<< 14;
 
 	// Report back if !seen
 	if (seen == 0)
@@ -374,7 +387,30 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		{
 			encoder->AppendStatus(reply);
 		}
-		reply.catf(", PID parameters P=%.3f I=%.3f D=%.3f, min. current %.1f%%", (double) Kp, (double) Ki, (double) Kd, (double)(holdCurrentFraction * 100.0));
+		reply.catf(", PID parameters P=%.3f I=%.3f D=%.3f, feedforward V=%.3f A=%.5f, min. current %.1f%%, load current margin %.2f",
+					(double) Kp, (double) Ki, (double) Kd, (double) Kv, (double) Ka, (double)(holdCurrentFraction * 100.0), (double)loadCurrentMargin);
+		switch (errorObserverType)
+		{
+		case ErrorObserverType::alphaBeta:
+			reply.catf(", error observer bandwidth %.0fHz", (double)errorObserverParameter);
+			break;
+		case ErrorObserverType::kalman:
+			reply.catf(", Kalman error observer tracking index %.4f", (double)errorObserverParameter);
+			break;
+		default:
+			break;
+		}
+		if (monitorThreshold > 0.0)
+		{
+			reply.catf(", open loop layer shift threshold %.2f steps", (double)monitorThreshold);
+		}
+		if (focEnabled)
+		{
+			reply.catf(", field oriented control");
+#if SUPPORT_CL_CURRENT_SENSE
+			reply.catf(" with current loop P=%.3f I=%.1f", (double)currentKp, (double)currentKi);
+#endif
+		}
 		return GCodeResult::ok;
 	}
 
@@ -394,6 +430,31 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		reply.copy("Encoder counts per step most be positive");
 		return GCodeResult::error;
 	}
+	if (tempObserverType >= (uint8_t)ErrorObserverType::numTypes)
+	{
+		reply.copy("Invalid O value. Valid values are 0, 1 and 2");
+		return GCodeResult::error;
+	}
+	if (tempObserverType != (uint8_t)ErrorObserverType::averagingFilter && tempObserverParameter <= 0.0)
+	{
+		reply.copy("Error observer B parameter must be greater than zero");
+		return GCodeResult::error;
+	}
+	if ((seen & (0x1 << 14)) && tempMonitorThreshold > 0.0 && encoder == nullptr && (seen & (0x1 << 0)) == 0)
+	{
+		reply.copy("Open loop position monitoring needs an encoder");
+		return GCodeResult::error;
+	}
+	if (tempFocMode > 1)
+	{
+		reply.copy("Invalid F value. Valid values are 0 and 1");
+		return GCodeResult::error;
+	}
+	if ((seen & (0x1 << 13)) && (numCurrentGains != 2 || tempCurrentGains[0] < 0.0 || tempCurrentGains[1] < 0.0))
+	{
+		reply.copy("G parameter must be two non-negative current loop gains");
+		return GCodeResult::error;
+	}
 
 	// Set the new params
 	TaskCriticalSectionLocker lock;			// don't allow the closed loop task to see an inconsistent combination of these values
@@ -408,7 +469,34 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 	Kp = tempKp;
 	Ki = tempKi;
 	Kd = tempKd;
-	PIDITerm = 0;
+	Kv = tempKv;
+	Ka = tempKa;
+	loadCurrentMargin = max<float>(tempLoadCurrentMargin, 0.0);
+	focEnabled = (tempFocMode != 0);
+	if (seen & (0x1 << 14))
+	{
+		monitorThreshold = max<float>(tempMonitorThreshold, 0.0);
+		monitorPolarityKnown = (tuningError & TUNE_ERR_NOT_DONE_BASIC) == 0;
+		monitorReadingStarted = false;
+		layerShiftPending = false;
+		if (monitorThreshold > 0.0 && encoder != nullptr && !closedLoopEnabled)
+		{
+			ResetError();											// start monitoring from the current position
+		}
+	}
+	if (seen & (0x1 << 13))
+	{
+		currentKp = tempCurrentGains[0];
+		currentKi = tempCurrentGains[1];
+	}
+	ResetIntegralTerm();
+
+	if (seen & (0x3 << 10))
+	{
+		errorObserverType = (ErrorObserverType)tempObserverType;
+		errorObserverParameter = tempObserverParameter;
+		UpdateErrorObserver();
+	}
 
 	if (seen & (1u << 6))
 	{
@@ -417,6 +505,10 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		recipHoldCurrentFraction = 1.0/holdCurrentFraction;
 	}
 
+#if CL_USE_FIXED_POINT
+	UpdateFixedPointParameters();
+#endif
+
 	if (seen & (0x1 << 5)) {
 		errorThresholds[0] = tempErrorThresholds[0];
 		errorThresholds[1] = tempErrorThresholds[1];
@@ -425,6 +517,7 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 	// If encoder count per steps has changed, we need to re-tune
 	if ((seen & (0x1 << 1)) && encoder != nullptr) {
 		tuningError = minimalTunes[encoder->GetType().ToBaseType()];
+		RestoreBasicTuningResult();
 	}
 
 	//TODO need to get a lock here in case there is any movement
@@ -440,6 +533,7 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		else
 		{
 			DeleteObject(encoder);
+			MemoryArenas::Scope scope(MemoryArena::closedLoop);
 			switch (tempEncoderType)
 			{
 			case EncoderType::none:
@@ -472,6 +566,7 @@ GCodeResult ClosedLoop::ProcessM569Point1(const CanMessageGeneric &msg, const St
 		if (encoder != nullptr)
 		{
 			tuningError = minimalTunes[encoder->GetType().ToBaseType()];
+			RestoreBasicTuningResult();
 			return encoder->Init(reply);
 		}
 	}
@@ -483,7 +578,17 @@ static float startRecordingTrigger;
 
 GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCollection& msg, const StringRef& reply) noexcept
 {
-	if (encoder == nullptr || msg.deviceNumber != 0)
+	if (msg.deviceNumber >= NumClosedLoopDrivers)
+	{
+		reply.copy("No encoder has been configured");
+		return GCodeResult::error;
+	}
+	return controllers[msg.deviceNumber].ProcessM569Point5(msg, reply);
+}
+
+GCodeResult ClosedLoop::Controller::ProcessM569Point5(const CanMessageStartClosedLoopDataCollection& msg, const StringRef& reply) noexcept
+{
+	if (encoder == nullptr)
 	{
 		reply.copy("No encoder has been configured");
 		return GCodeResult::error;
@@ -491,10 +596,26 @@ GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCol
 
 	if (CollectingData())
 	{
+		// If we are streaming data then a new request stops it
+		if (samplesRequested == 0 && samplingMode == RecordingMode::Immediate && dataCollectionController == this)
+		{
+			samplingMode = RecordingMode::SendingData;
+			dataTransmissionTask->Give();
+			reply.printf("Data collection stopped after %" PRIu32 " samples, %" PRIu32 " dropped", samplesCollected, samplesDropped);
+			return GCodeResult::ok;
+		}
 		reply.copy("Driver is already collecting data");
 		return GCodeResult::error;
 	}
 
+#if SUPPORT_DATA_CAPTURE
+	if (DataCapture::IsRunning())
+	{
+		reply.copy("A data capture is in progress");				// it uses the same CAN message to stream its data
+		return GCodeResult::error;
+	}
+#endif
+
 	uint8_t requestedMode;
 	if (msg.movement != 0)
 	{
@@ -516,20 +637,22 @@ GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCol
 		return GCodeResult::error;
 	}
 
-	// Calculate how many samples will fit in the buffer
-	variableCount = CountVariablesCollected(msg.filter);
+	// Compile the filter and calculate how many samples will fit in the buffer. The time stamp is always recorded.
+	const uint16_t filter = BuildSampleRecipe(msg.filter);
+	variableCount = sampleRecipeLength + 1;
 	const unsigned int samplesPerBuffer =  ARRAY_SIZE(sampleBuffer) / variableCount;
 	sampleBufferLimit = samplesPerBuffer * variableCount;		// wrap the read/write pointers round when they reach this value
 
 	// Set up the recording vars
 	sampleBufferWritePointer = sampleBufferReadPointer = 0;
-	samplesCollected = samplesSent = 0;
+	samplesCollected = samplesSent = samplesDropped = 0;
 	sampleBufferOverflowed = false;
-	filterRequested = msg.filter;
+	filterRequested = filter;
 	samplesRequested = msg.numSamples;
 	startRecordingTrigger = targetMotorSteps;					// mark the current number of steps in case we are using RecordingMode::OnNextMove
 	dataCollectionIntervalTicks = (msg.rate == 0) ? 1 : StepTimer::StepClockRate/msg.rate;
 	dataCollectionStartTicks = whenNextSampleDue = StepTimer::GetTimerTicks();
+	dataCollectionController = this;
 	samplingMode = (RecordingMode)requestedMode;				// do this one last, it triggers data collection
 
 	StartTuning(msg.movement);
@@ -539,7 +662,12 @@ GCodeResult ClosedLoop::ProcessM569Point5(const CanMessageStartClosedLoopDataCol
 GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const StringRef &reply) noexcept
 {
 	CanMessageGenericParser parser(msg, M569Point6Params);
+	Controller * const c = GetController(parser, reply);
+	return (c == nullptr) ? GCodeResult::error : c->ProcessM569Point6(parser, reply);
+}
 
+GCodeResult ClosedLoop::Controller::ProcessM569Point6(CanMessageGenericParser& parser, const StringRef &reply) noexcept
+{
 	uint8_t desiredTuning;
 	if (!parser.GetUintParam('V', desiredTuning))
 	{
@@ -548,6 +676,19 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 		{
 			return GCodeResult::notFinished;
 		}
+		if (benchmarkVars.pending != 0)
+		{
+			if (tuningError == 0 && closedLoopEnabled)
+			{
+				return GCodeResult::notFinished;
+			}
+			AbandonBenchmark();
+			if (tuningError == 0)
+			{
+				reply.printf("Driver %u.%u benchmark abandoned because closed loop mode was disabled", CanInterface::GetCanAddress(), driverNumber);
+				return GCodeResult::error;
+			}
+		}
 
 #if BASIC_TUNING_DEBUG
 		forwardTuningResults.Print("Forward", reply);
@@ -560,6 +701,31 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 		// 3. A new tuning error has been introduced (else)					= WARNING
 		if (tuningError == 0)
 		{
+			if (basicTuningResultToStore && StoreBasicTuningResult())	// we do this here rather than when tuning finishes because we mustn't write to NVM in the control loop
+			{
+				basicTuningResultToStore = false;
+			}
+
+			if (benchmarkResultPending)
+			{
+				benchmarkResultPending = false;
+				AppendBenchmarkResults(reply);
+				if (!relayTuningResultPending)
+				{
+					return GCodeResult::ok;
+				}
+			}
+
+			if (relayTuningResultPending)
+			{
+				// Report the Ziegler-Nichols (classic PID) parameters using the same letters as M569.1
+				relayTuningResultPending = false;
+				reply.lcatf("Driver %u.%u ultimate gain %.2f, oscillation period %.2fms, suggested PID parameters P%.2f I%.2f D%.5f",
+							CanInterface::GetCanAddress(), driverNumber, (double)ultimateGain, (double)(oscillationPeriod * 1000.0),
+							(double)(0.6 * ultimateGain), (double)(1.2 * ultimateGain/oscillationPeriod), (double)(0.075 * ultimateGain * oscillationPeriod));
+				return GCodeResult::ok;
+			}
+
 #if BASIC_TUNING_DEBUG
 			reply.catf("OER %" PRIi32 " AER %.1f DER %.1f DSP %u OMSP %u OCMS %.3f\n",
 						originalRawEncoderReading, (double)originalAssumedEncoderReading, (double)originalDesiredEncoderReading,
@@ -567,7 +733,8 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 			reply.catf("OCM %" PRIi32 " FER %" PRIi32 " FMSP %u FCMS %.3f\n",
 						offsetCorrectionMade, finalRawEncoderReading, finalMeasuredStepPhase, (double)finalCurrentMotorSteps);
 #endif
-			reply.catf("Driver %u.0 tuned successfully, measured hysteresis %.2f step", CanInterface::GetCanAddress(), (double)tuningHysteresis);
+			reply.catf("Driver %u.%u tuned successfully, measured hysteresis %.2f step, tuning speed %.1f steps/sec", CanInterface::GetCanAddress(), driverNumber,
+						(double)tuningHysteresis, (double)((float)(basicTuningStepsPerSecond * BasicTuningPhaseIncrement) * (1.0/1024.0)));
 			if (tuningHysteresis <= MaxSafeHysteresis)
 			{
 				return GCodeResult::ok;
@@ -579,12 +746,12 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 		// Tuning failed so report the errors
 		if ((~prevTuningError & tuningError) != 0)
 		{
-			reply.catf("Driver %u.0 new tuning error(s):", CanInterface::GetCanAddress());
+			reply.catf("Driver %u.%u new tuning error(s):", CanInterface::GetCanAddress(), driverNumber);
 			ReportTuningErrors(~prevTuningError & tuningError, reply);
 		}
 		if ((prevTuningError & tuningError) != 0)
 		{
-			reply.lcatf("Driver %u.0 un-cleared previous tuning error(s):", CanInterface::GetCanAddress());
+			reply.lcatf("Driver %u.%u un-cleared previous tuning error(s):", CanInterface::GetCanAddress(), driverNumber);
 			ReportTuningErrors(prevTuningError & tuningError, reply);
 		}
 
@@ -593,7 +760,7 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 
 	// Here if this is a new command to start a tuning move
 	// Check we are in direct drive mode
-	if (SmartDrivers::GetDriverMode(0) != DriverMode::direct)
+	if (SmartDrivers::GetDriverMode(driverNumber) != DriverMode::direct)
 	{
 		reply.copy("Drive is not in closed loop mode");
 		return GCodeResult::error;
@@ -608,32 +775,72 @@ GCodeResult ClosedLoop::ProcessM569Point6(const CanMessageGeneric &msg, const St
 	}
 #endif
 
+	// The benchmark manoeuvres run under PID control, so they need closed loop mode and either a successful tune or one requested in the same command
+	if ((desiredTuning & BENCHMARK_MANOEUVRES) != 0 && (!closedLoopEnabled || ((desiredTuning & ~BENCHMARK_MANOEUVRES) == 0 && tuningError != 0)))
+	{
+		reply.copy("Closed loop must be enabled and the drive tuned before running benchmarks");
+		return GCodeResult::error;
+	}
+	if ((desiredTuning & BENCHMARK_MANOEUVRES) != 0 && benchmarkVars.pending != 0)
+	{
+		reply.copy("A benchmark or frequency response sweep is already running");
+		return GCodeResult::error;
+	}
+
 	prevTuningError = tuningError;
-	StartTuning(desiredTuning);
+	StartTuning(desiredTuning & ~BENCHMARK_MANOEUVRES);
+	if (desiredTuning & BENCHMARK_SINE_SWEEP_MANOEUVRE)
+	{
+		SetBenchmarkSweep();
+	}
+	StartBenchmark(desiredTuning);
 
 	return GCodeResult::notFinished;
 }
 
-void ClosedLoop::StartTuning(uint8_t tuningMode) noexcept
+void ClosedLoop::Controller::StartTuning(uint8_t tuningMode) noexcept
 {
 	if (tuningMode != 0)
 	{
-		Platform::DriveEnableOverride(0, true);					// enable the motor and prevent it becoming idle
+		Platform::DriveEnableOverride(driverNumber, true);					// enable the motor and prevent it becoming idle
 		whenLastTuningStepTaken = StepTimer::GetTimerTicks() + stepTicksBeforeTuning;	// delay the start to allow brake release and motor current buildup
 		if (tuningMode & ENCODER_CALIBRATION_MANOEUVRE)
 		{
 			tuningMode |= BASIC_TUNING_MANOEUVRE;				// always run basic tuning before encoder calibration
 		}
+		basicTuningStepsPerSecond = MaxBasicTuningStepsPerSecond;	// most motors can be tuned at this speed
+		basicTuningStepTicks = StepTimer::StepClockRate/basicTuningStepsPerSecond;
 		tuning = tuningMode;
 	}
 }
 
-void ClosedLoop::SetForwardPolarity() noexcept
+// Decide whether the results of the basic tuning manoeuvre show that the motor didn't keep up with the phase changes.
+// If so, and we can go more slowly, reduce the speed and return true so that the manoeuvre is repeated.
+// Lag shows up as hysteresis between the forward and reverse moves, and a motor that stalls or jumps gives inconsistent slopes.
+bool ClosedLoop::Controller::ReduceBasicTuningSpeed() noexcept
 {
-	reversePolarityMultiplier = 1;
+	if (basicTuningStepsPerSecond <= tuningStepsPerSecond)
+	{
+		return false;
+	}
+
+	const float averageSlope = (forwardTuningResults.slope + reverseTuningResults.slope) * 0.5;
+	bool reduce = fabsf(averageSlope) < MinimumSlope || fabsf(forwardTuningResults.slope - reverseTuningResults.slope) > MaxSlopeMismatch * 2 * fabsf(averageSlope);
+	if (!reduce)
+	{
+		forwardTuningResults.CalcRevisedOrigin(averageSlope);
+		reverseTuningResults.CalcRevisedOrigin(averageSlope);
+		reduce = fabsf(forwardTuningResults.revisedOrigin - reverseTuningResults.revisedOrigin) > MaxSafeHysteresis * fabsf(averageSlope) * 1024;
+	}
+	if (reduce)
+	{
+		basicTuningStepsPerSecond = max<unsigned int>(basicTuningStepsPerSecond/2, tuningStepsPerSecond);
+		basicTuningStepTicks = StepTimer::StepClockRate/basicTuningStepsPerSecond;
+	}
+	return reduce;
 }
 
-void ClosedLoop::SaveBasicTuningResult(float slope, float origin, float xMean, bool reverse) noexcept
+void ClosedLoop::Controller::SaveBasicTuningResult(float slope, float origin, float xMean, bool reverse) noexcept
 {
 	TuningResults& r = (reverse) ? reverseTuningResults : forwardTuningResults;
 	r.slope = slope;
@@ -642,7 +849,7 @@ void ClosedLoop::SaveBasicTuningResult(float slope, float origin, float xMean, b
 }
 
 // Call this when we have stopped basic tuning movement and are ready to switch to closed loop control
-void ClosedLoop::FinishedBasicTuning() noexcept
+void ClosedLoop::Controller::FinishedBasicTuning() noexcept
 {
 	// Check that the forward and reverse slopes are similar and a good match to the configured counts per step
 	const float averageSlope = (forwardTuningResults.slope + reverseTuningResults.slope) * 0.5;
@@ -676,6 +883,8 @@ void ClosedLoop::FinishedBasicTuning() noexcept
 		originalCurrentMotorSteps = currentMotorSteps;
 #endif
 		reversePolarityMultiplier = (averageSlope < 0.0) ? -1 : 1;
+		basicTuningResultToStore = (encoder->GetPositioningType() == EncoderPositioningType::absolute) || ((RelativeEncoder*)encoder)->HasIndex();
+		awaitingIndex = false;
 
 		if (encoder->GetPositioningType() == EncoderPositioningType::relative)
 		{
@@ -700,46 +909,254 @@ void ClosedLoop::FinishedBasicTuning() noexcept
 	tuningError &= ~TUNE_ERR_NOT_DONE_BASIC;
 }
 
+// The basic tuning result that we store in NVM. The result is only valid while the closed loop configuration is unchanged, so we store a hash of the configuration with it.
+// For a relative encoder with an index pulse we also store the encoder reading at the index modulo 4 full steps, which fixes the zero position once we have seen the index again.
+struct StoredBasicTuningResult
+{
+	uint32_t configHash;
+	float measuredCountsPerStep;
+	float hysteresis;
+	int32_t polarity;
+	float indexPhaseCounts;
+};
+
+// Get a hash of the configuration that the basic tuning result depends on
+uint32_t ClosedLoop::Controller::GetTuningConfigHash() const noexcept
+{
+	uint32_t hash = 2166136261u;									// FNV-1a
+	const uint32_t values[] = { (uint32_t)GetEncoderType().ToBaseType(), (uint32_t)lrintf(encoderPulsePerStep * 1000.0), (uint32_t)driverNumber };
+	for (uint32_t v : values)
+	{
+		for (unsigned int i = 0; i < 4; ++i)
+		{
+			hash = (hash ^ (uint8_t)(v >> (8 * i))) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+// Store the result of a successful basic tuning move so that we don't need to repeat it after a reset if the configuration is the same.
+// For a relative encoder we need to wait until an index pulse has been seen, so return false if we haven't stored the result yet.
+bool ClosedLoop::Controller::StoreBasicTuningResult() noexcept
+{
+	StoredBasicTuningResult result = { GetTuningConfigHash(), measuredCountsPerStep, tuningHysteresis, reversePolarityMultiplier, 0.0 };
+	if (encoder->GetPositioningType() == EncoderPositioningType::relative)
+	{
+		int32_t indexReading;
+		if (!((RelativeEncoder*)encoder)->GetIndexReading(indexReading))
+		{
+			return false;
+		}
+		const float countsPerCycle = 4.0 * encoderPulsePerStep;
+		const float indexPhase = fmodf((float)(indexReading * reversePolarityMultiplier), countsPerCycle);
+		result.indexPhaseCounts = (indexPhase < 0.0) ? indexPhase + countsPerCycle : indexPhase;
+	}
+	(void)NvmStore::Write(NvmStore::KeyClosedLoopBasicTuning + driverNumber, &result, sizeof(result));
+	return true;
+}
+
+// If we have a stored basic tuning result for this configuration then use it instead of requiring a basic tuning move.
+// The zero position of a relative encoder is lost when we reset, so we use the zero position from the motor microstep counter until we see an index pulse.
+void ClosedLoop::Controller::RestoreBasicTuningResult() noexcept
+{
+	awaitingIndex = false;
+	StoredBasicTuningResult result;
+	if (   encoder != nullptr
+		&& (encoder->GetPositioningType() == EncoderPositioningType::absolute || ((RelativeEncoder*)encoder)->HasIndex())
+		&& NvmStore::Read(NvmStore::KeyClosedLoopBasicTuning + driverNumber, &result, sizeof(result))
+		&& result.configHash == GetTuningConfigHash()
+		&& (result.polarity == 1 || result.polarity == -1)
+	   )
+	{
+		reversePolarityMultiplier = result.polarity;
+		measuredCountsPerStep = result.measuredCountsPerStep;
+		tuningHysteresis = result.hysteresis;
+		awaitingIndex = (encoder->GetPositioningType() == EncoderPositioningType::relative);
+		indexPhaseCounts = result.indexPhaseCounts;
+		tuningError &= ~TUNE_ERR_NOT_DONE_BASIC;
+	}
+}
+
+// If we are waiting for an index pulse to correct the zero position of a relative encoder and one has occurred, adjust the encoder offset.
+// We shift the target by the same amount so that the correction changes the commutation without moving the motor.
+void ClosedLoop::Controller::CheckIndexPulse() noexcept
+{
+	int32_t indexReading;
+	if (awaitingIndex && ((RelativeEncoder*)encoder)->GetIndexReading(indexReading))
+	{
+		awaitingIndex = false;
+		const float countsPerCycle = 4.0 * encoderPulsePerStep;
+		float correction = indexPhaseCounts - fmodf((float)(indexReading * reversePolarityMultiplier), countsPerCycle);
+		correction -= countsPerCycle * roundf(correction/countsPerCycle);		// make the correction as small as possible
+		const int32_t correctionCounts = lrintf(correction);
+		((RelativeEncoder*)encoder)->SetOffset(correctionCounts * reversePolarityMultiplier);
+		targetEncoderReading += correctionCounts;
+		targetMotorSteps += (float)correctionCounts / encoderPulsePerStep;
+	}
+}
+
 // This is called by tuning to execute a step
-void ClosedLoop::AdjustTargetMotorSteps(float amount) noexcept
+void ClosedLoop::Controller::AdjustTargetMotorSteps(float amount) noexcept
 {
 	targetMotorSteps += amount;
 	targetEncoderReading = lrintf(targetMotorSteps * encoderPulsePerStep);
 }
 
+// Save the result of relay feedback tuning. The relay amplitude is in control signal units, the oscillation amplitude is in full steps and the period is in seconds.
+void ClosedLoop::Controller::SaveRelayTuningResult(float relayAmplitude, float oscillationAmplitude, float period) noexcept
+{
+	ultimateGain = (4.0/Pi) * relayAmplitude/oscillationAmplitude;		// describing function of an ideal relay
+	oscillationPeriod = period;
+	relayTuningResultPending = true;
+}
+
+// Wait until the next control loop iteration is due. If we are already more than one period late, restart the timing from now.
+void ClosedLoop::WaitForControlLoopDue() noexcept
+{
+	whenControlLoopDue += ControlLoopPeriodTicks;
+	const StepTimer::Ticks now = StepTimer::GetTimerTicks();
+	if ((int32_t)(now - whenControlLoopDue) >= (int32_t)ControlLoopPeriodTicks)
+	{
+		++numControlLoopOverruns;
+		whenControlLoopDue = now;
+		return;
+	}
+
+	taskWaitingForControlLoop = TaskBase::GetCallerTaskHandle();
+	if (controlLoopTimer.ScheduleCallback(whenControlLoopDue))
+	{
+		taskWaitingForControlLoop = nullptr;						// already due
+	}
+	else
+	{
+		(void)TaskBase::Take(2);									// the timeout is only a safeguard
+	}
+}
+
+// Return true if closed loop mode is enabled on any driver
+bool ClosedLoop::AnyClosedLoopEnabled() noexcept
+{
+	for (const Controller& c : controllers)
+	{
+		if (c.GetClosedLoopEnabled())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Run the control loops of all drivers. When closed loop mode is enabled on any driver this waits for the next control loop period to start, so that the loops run at a fixed rate.
+// We use the scheduled time of each iteration as its time stamp, so that the PID time delta is constant and the derivative term is not affected by scheduling jitter.
 void ClosedLoop::ControlLoop() noexcept
 {
+	StepTimer::Ticks loopCallTime;
+	if (AnyClosedLoopEnabled())
+	{
+		WaitForControlLoopDue();
+		loopCallTime = whenControlLoopDue;
+	}
+	else
+	{
+		loopCallTime = whenControlLoopDue = StepTimer::GetTimerTicks();
+	}
+
 	// Record the control loop call interval
-	const StepTimer::Ticks loopCallTime = StepTimer::GetTimerTicks();
-	const StepTimer::Ticks timeElapsed = loopCallTime - prevControlLoopCallTime;
+	const LatencyHistograms::Timestamp probeStartTime = LatencyHistograms::GetTimestamp();
+	const StepTimer::Ticks loopStartTime = StepTimer::GetTimerTicks();
+	const StepTimer::Ticks timeElapsed = loopStartTime - prevControlLoopStartTime;
+	prevControlLoopStartTime = loopStartTime;
 	minControlLoopCallInterval = min<StepTimer::Ticks>(minControlLoopCallInterval, timeElapsed);
 	maxControlLoopCallInterval = max<StepTimer::Ticks>(maxControlLoopCallInterval, timeElapsed);
 
-	// Read the current state of the drive
+#if SUPPORT_CL_CURRENT_SENSE
+	CurrentSense::ScheduleSample(loopCallTime + ControlLoopPeriodTicks);	// sample the coil currents when the next iteration is due
+#endif
+
+	for (Controller& c : controllers)
+	{
+		c.RunControlLoop(loopCallTime);
+	}
+
+	// Record how long this has taken to run
+	const StepTimer::Ticks loopRuntime = StepTimer::GetTimerTicks() - loopStartTime;
+	minControlLoopRuntime = min<StepTimer::Ticks>(minControlLoopRuntime, loopRuntime);
+	maxControlLoopRuntime = max<StepTimer::Ticks>(maxControlLoopRuntime, loopRuntime);
+	LatencyHistograms::Record(LatencyProbe::controlLoop, probeStartTime);
+}
+
+// Run one iteration of the control loop for this driver
+void ClosedLoop::Controller::RunControlLoop(StepTimer::Ticks loopCallTime) noexcept
+{
+	// When we are only monitoring the position in open loop mode we read the encoder at a low rate. We start the reading on one call and process it
+	// on the next, so that the reading is fresh when we compare it with the target.
+	if (!closedLoopEnabled && monitorThreshold > 0.0 && tuning == 0 && !CollectingData() && !monitorReadingStarted)
+	{
+		if ((int32_t)(loopCallTime - whenMonitorDue) >= 0 && encoder != nullptr)
+		{
+			encoder->StartReading();
+			monitorReadingStarted = true;
+			whenMonitorDue = loopCallTime + MonitorIntervalTicks;
+		}
+		return;
+	}
+	monitorReadingStarted = false;
+
+	if (awaitingIndex && encoder != nullptr)
+	{
+		CheckIndexPulse();
+	}
+
+	// Read the current state of the drive and where the move says we should be
 	ReadState();
+#if SUPPORT_CL_CURRENT_SENSE
+	if (driverNumber == 0)											// the current sense ADC measures the first closed loop driver only
+	{
+		(void)CurrentSense::GetCurrents(measuredCoilA, measuredCoilB);
+	}
+#endif
+	UpdateTargetFromMotion();
+	if (benchmarkVars.pending != 0 && closedLoopEnabled && tuning == 0 && tuningError == 0)
+	{
+		RunBenchmark(loopCallTime);									// this moves the target, so do it before we calculate the error
+	}
 
 	// Calculate and store the current error
+#if CL_USE_FIXED_POINT
+	const int32_t errorCounts = targetEncoderReading - currentEncoderReading;
+	currentError = (float)errorCounts * recipEncoderPulsesPerStep;
+	derivativeFilter.ProcessReading(errorCounts, loopCallTime);
+#else
 	currentError = (float)(targetEncoderReading - currentEncoderReading) * recipEncoderPulsesPerStep;
 	derivativeFilter.ProcessReading(currentError, loopCallTime);
+#endif
+	if (errorObserverType != ErrorObserverType::averagingFilter)
+	{
+		errorObserver.ProcessReading(currentError, loopCallTime);
+	}
 
 	if (!closedLoopEnabled)
 	{
-		// If closed loop disabled, do nothing
+		// If closed loop disabled, just check for a layer shift if we are monitoring the position
+		if (monitorThreshold > 0.0 && tuning == 0 && encoder != nullptr)
+		{
+			MonitorOpenLoopPosition();
+		}
 	}
 	else if (tuning != 0)											// if we need to tune, do it
 	{
 		// Limit the rate at which we command tuning steps Need to do signed comparison because initially, whenLastTuningStepTaken is in the future.
 		const int32_t timeSinceLastTuningStep = (int32_t)(loopCallTime - whenLastTuningStepTaken);
-		if (timeSinceLastTuningStep >= (int32_t)stepTicksPerTuningStep)
+		if (timeSinceLastTuningStep >= (int32_t)((tuning & BASIC_TUNING_MANOEUVRE) ? basicTuningStepTicks : stepTicksPerTuningStep))
 		{
 			whenLastTuningStepTaken = loopCallTime;
 			PerformTune();
 			if (tuning == 0)
 			{
-				Platform::DriveEnableOverride(0, false);			// If that was the last tuning move, release the override
+				Platform::DriveEnableOverride(driverNumber, false);	// If that was the last tuning move, release the override
 			}
 		}
-		else if (samplingMode == RecordingMode::OnNextMove && timeSinceLastTuningStep + (int32_t)DataCollectionIdleStepTicks >= 0)
+		else if (samplingMode == RecordingMode::OnNextMove && dataCollectionController == this && timeSinceLastTuningStep + (int32_t)DataCollectionIdleStepTicks >= 0)
 		{
 			dataCollectionStartTicks = whenNextSampleDue = loopCallTime;
 			samplingMode = RecordingMode::Immediate;
@@ -754,28 +1171,51 @@ void ClosedLoop::ControlLoop() noexcept
 		ControlMotorCurrents(loopCallTime);							// otherwise control those motor currents!
 	}
 
-	// Look for a stall or pre-stall
-	preStall = errorThresholds[0] > 0 && fabsf(currentError) > errorThresholds[0];
+	// Look for a stall or pre-stall. If we have an error observer then use its estimate of the error, which is less affected by encoder noise.
+	// We also warn if the error is growing fast enough to reach the stall threshold soon, or if the control signal is saturated and the error is growing,
+	// so that the main board can slow down before we lose position.
+	const float error = (errorObserverType != ErrorObserverType::averagingFilter) ? errorObserver.GetPosition() : currentError;
+	const float absError = fabsf(error);
+	const float errorGrowthRate = (error >= 0.0) ? GetErrorDerivative() : -GetErrorDerivative();
+	if (closedLoopEnabled && fabsf(PIDControlSignal) >= SaturatedControlSignal && errorGrowthRate > 0.0)
+	{
+		++saturatedLoops;
+	}
+	else
+	{
+		saturatedLoops = 0;
+	}
+	const bool alreadyPreStalled = preStall;
+	const bool stallPredicted = errorThresholds[1] > 0 && errorGrowthRate > 0.0
+								&& (absError + errorGrowthRate * StallPredictionTime > errorThresholds[1] || saturatedLoops >= SaturatedLoopsForPreStall);
+	preStall = (errorThresholds[0] > 0 && absError > errorThresholds[0]) || stallPredicted;
 	const bool alreadyStalled = stall;
-	stall 	 = errorThresholds[1] > 0 && fabsf(currentError) > errorThresholds[1];
+	stall 	 = errorThresholds[1] > 0 && absError > errorThresholds[1];
 	if (stall && !alreadyStalled)
 	{
 		Platform::NewDriverFault();
 	}
+	else if (stallPredicted && !alreadyPreStalled)
+	{
+		++numPredictedStalls;
+		Platform::NewDriverFault();									// send the driver status now so that the main board sees the warning
+	}
 
 	// Collect a sample, if we need to
-	if (samplingMode == RecordingMode::Immediate && (int32_t)(loopCallTime - whenNextSampleDue) >= 0)
+	if (samplingMode == RecordingMode::Immediate && dataCollectionController == this && (int32_t)(loopCallTime - whenNextSampleDue) >= 0)
 	{
 		// It's time to take a sample
 		CollectSample();
 		whenNextSampleDue += dataCollectionIntervalTicks;
 	}
 
-	// Record how long this has taken to run
+	// Start reading the encoder ready for the next iteration
+	if (encoder != nullptr)
+	{
+		encoder->StartReading();
+	}
+
 	prevControlLoopCallTime = loopCallTime;
-	const StepTimer::Ticks loopRuntime = StepTimer::GetTimerTicks() - loopCallTime;
-	minControlLoopRuntime = min<StepTimer::Ticks>(minControlLoopRuntime, loopRuntime);
-	maxControlLoopRuntime = max<StepTimer::Ticks>(maxControlLoopRuntime, loopRuntime);
 }
 
 // Send data from the buffer to the main board over CAN
@@ -799,7 +1239,7 @@ void ClosedLoop::ControlLoop() noexcept
 				CanMessageClosedLoopData& msg = *(buf.SetupStatusMessage<CanMessageClosedLoopData>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress()));
 
 				// Populate the control fields
-				msg.firstSampleNumber = samplesSent;
+				msg.firstSampleNumber = (uint16_t)samplesSent;		// this wraps round if we stream more than 65536 samples
 				msg.filter = filterRequested;
 				msg.zero = msg.zero2 = 0;
 
@@ -813,7 +1253,7 @@ void ClosedLoop::ControlLoop() noexcept
 						TaskBase::Take();							// wait for data to be available
 					}
 
-					if (samplesSent < samplesCollected)
+					if (samplesSent != samplesCollected)
 					{
 						memcpy(msg.data + numCopied, sampleBuffer + copyReadPointer, variableCount * sizeof(float));
 						numCopied += variableCount;
@@ -835,7 +1275,7 @@ void ClosedLoop::ControlLoop() noexcept
 
 				// Send the CAN message
 				buf.dataLength = msg.GetActualDataLength();
-				CanInterface::Send(&buf);
+				CanInterface::SendBulk(&buf);
 			} while (!finished);
 			samplingMode = RecordingMode::None;
 		}
@@ -847,31 +1287,40 @@ void ClosedLoop::ControlLoop() noexcept
 }
 
 // Store a sample in the buffer
-void ClosedLoop::CollectSample() noexcept
+// If we are streaming data and the buffer is full then we drop the sample and carry on. The timestamps let the main board see where the gaps are.
+void ClosedLoop::Controller::CollectSample() noexcept
 {
 	size_t wp = sampleBufferWritePointer;						// capture volatile variable and don't update it until all data has been written
 	if (wp == sampleBufferReadPointer && samplesSent != samplesCollected)
 	{
 		sampleBufferOverflowed = true;							// the buffer is full so tell the sending task about it
-		samplingMode = RecordingMode::SendingData;				// stop collecting data
+		if (samplesRequested == 0)
+		{
+			++samplesDropped;
+		}
+		else
+		{
+			samplingMode = RecordingMode::SendingData;			// stop collecting data
+		}
 	}
 	else
 	{
 		sampleBuffer[wp++] = TickPeriodToTimePeriod(StepTimer::GetTimerTicks() - dataCollectionStartTicks);		// always collect this
 
-		if (filterRequested & CL_RECORD_RAW_ENCODER_READING) 	{sampleBuffer[wp++] = (float)currentEncoderReading;}
-		if (filterRequested & CL_RECORD_CURRENT_MOTOR_STEPS) 	{sampleBuffer[wp++] = currentMotorSteps;}
-		if (filterRequested & CL_RECORD_TARGET_MOTOR_STEPS)  	{sampleBuffer[wp++] = targetMotorSteps;}
-		if (filterRequested & CL_RECORD_CURRENT_ERROR) 			{sampleBuffer[wp++] = currentError;}
-		if (filterRequested & CL_RECORD_PID_CONTROL_SIGNAL)  	{sampleBuffer[wp++] = PIDControlSignal;}
-		if (filterRequested & CL_RECORD_PID_P_TERM)  			{sampleBuffer[wp++] = PIDPTerm;}
-		if (filterRequested & CL_RECORD_PID_I_TERM)  			{sampleBuffer[wp++] = PIDITerm;}
-		if (filterRequested & CL_RECORD_PID_D_TERM)  			{sampleBuffer[wp++] = PIDDTerm;}
-		if (filterRequested & CL_RECORD_STEP_PHASE)  			{sampleBuffer[wp++] = (float)measuredStepPhase;}
-		if (filterRequested & CL_RECORD_DESIRED_STEP_PHASE)  	{sampleBuffer[wp++] = (float)desiredStepPhase;}
-		if (filterRequested & CL_RECORD_PHASE_SHIFT)  			{sampleBuffer[wp++] = phaseShift;}
-		if (filterRequested & CL_RECORD_COIL_A_CURRENT) 		{sampleBuffer[wp++] = (float)coilA;}
-		if (filterRequested & CL_RECORD_COIL_B_CURRENT) 		{sampleBuffer[wp++] = (float)coilB;}
+		for (const SampleRecipeItem *item = sampleRecipe; item < sampleRecipe + sampleRecipeLength; ++item)
+		{
+			float val;
+			switch (item->type)
+			{
+			case SampleSourceType::floatVar:		val = *static_cast<const float*>(item->source); break;
+			case SampleSourceType::int32Var:		val = (float)*static_cast<const int32_t*>(item->source); break;
+			case SampleSourceType::int16Var:		val = (float)*static_cast<const int16_t*>(item->source); break;
+			case SampleSourceType::uint16Var:		val = (float)*static_cast<const uint16_t*>(item->source); break;
+			case SampleSourceType::errorDerivative:
+			default:								val = GetErrorDerivative(); break;
+			}
+			sampleBuffer[wp++] = val;
+		}
 
 		sampleBufferWritePointer = (wp >= sampleBufferLimit) ? 0 : wp;
 		++samplesCollected;
@@ -884,20 +1333,321 @@ void ClosedLoop::CollectSample() noexcept
 	dataTransmissionTask->Give();
 }
 
-void ClosedLoop::ReadState() noexcept
+// Compile the data collection filter into the list of variables to record, in the order that the main board expects them.
+// Return the filter with any bits that we don't recognise removed, so that the main board interprets the data correctly.
+uint16_t ClosedLoop::Controller::BuildSampleRecipe(uint16_t filter) noexcept
+{
+	const SampleRecipeItem items[] =
+	{
+		{ &currentEncoderReading,	SampleSourceType::int32Var },
+		{ &currentMotorSteps,		SampleSourceType::floatVar },
+		{ &targetMotorSteps,		SampleSourceType::floatVar },
+		{ &currentError,			SampleSourceType::floatVar },
+		{ &PIDControlSignal,		SampleSourceType::floatVar },
+		{ &PIDPTerm,				SampleSourceType::floatVar },
+		{ &PIDITerm,				SampleSourceType::floatVar },
+		{ &PIDDTerm,				SampleSourceType::floatVar },
+		{ &measuredStepPhase,		SampleSourceType::uint16Var },
+		{ &desiredStepPhase,		SampleSourceType::uint16Var },
+		{ &phaseShift,				SampleSourceType::floatVar },
+		{ &coilA,					SampleSourceType::int16Var },
+		{ &coilB,					SampleSourceType::int16Var },
+		{ nullptr,					SampleSourceType::errorDerivative },
+#if SUPPORT_CL_CURRENT_SENSE
+		{ &measuredCoilA,			SampleSourceType::int16Var },
+		{ &measuredCoilB,			SampleSourceType::int16Var },
+#endif
+	};
+	const uint16_t filterBits[] =
+	{
+		CL_RECORD_RAW_ENCODER_READING, CL_RECORD_CURRENT_MOTOR_STEPS, CL_RECORD_TARGET_MOTOR_STEPS, CL_RECORD_CURRENT_ERROR,
+		CL_RECORD_PID_CONTROL_SIGNAL, CL_RECORD_PID_P_TERM, CL_RECORD_PID_I_TERM, CL_RECORD_PID_D_TERM,
+		CL_RECORD_STEP_PHASE, CL_RECORD_DESIRED_STEP_PHASE, CL_RECORD_PHASE_SHIFT, CL_RECORD_COIL_A_CURRENT,
+		CL_RECORD_COIL_B_CURRENT, CL_RECORD_ERROR_DERIVATIVE,
+#if SUPPORT_CL_CURRENT_SENSE
+		CL_RECORD_MEASURED_COIL_A_CURRENT, CL_RECORD_MEASURED_COIL_B_CURRENT,
+#endif
+	};
+	static_assert(ARRAY_SIZE(items) == ARRAY_SIZE(filterBits) && ARRAY_SIZE(items) <= MaxSampleRecipeItems);
+
+	uint16_t usedFilter = 0;
+	sampleRecipeLength = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(items); ++i)
+	{
+		if (filter & filterBits[i])
+		{
+			usedFilter |= filterBits[i];
+			sampleRecipe[sampleRecipeLength++] = items[i];
+		}
+	}
+	return usedFilter;
+}
+
+void ClosedLoop::Controller::ReadState() noexcept
 {
 	if (encoder == nullptr) { return; }							// we can't read anything if there is no encoder
 
+	// Get the encoder reading and extrapolate it from the time it was sampled to now using the estimated encoder speed.
+	// The observer works on the raw reading so that its state doesn't depend on the polarity, which tuning may change.
+	// A bad reading would cause a current spike or a false stall, so if the encoder couldn't be read or the reading is implausible then we use the observer's prediction instead.
+	int32_t reading = encoder->GetReading();
+	StepTimer::Ticks sampleTime = encoder->GetLastSampleTime();
+	const StepTimer::Ticks now = StepTimer::GetTimerTicks();
+	if (encoder->LastReadFailed())
+	{
+		if (encoderVelocityObserver.IsValid())
+		{
+			reading = lrintf(encoderVelocityObserver.Predict(now));
+			sampleTime = now;
+		}
+	}
+	else
+	{
+		// Corruption that the parity check doesn't catch usually makes the reading jump a long way
+		const bool implausible = encoderVelocityObserver.IsValid()
+								&& fabsf((float)reading - encoderVelocityObserver.Predict(sampleTime)) > MaxPlausibleEncoderJumpSteps * encoderPulsePerStep;
+		if (implausible && consecutiveRejectedReadings < MaxConsecutiveRejectedReadings)
+		{
+			++consecutiveRejectedReadings;
+			++numRejectedReadings;
+			reading = lrintf(encoderVelocityObserver.Predict(sampleTime));
+		}
+		else
+		{
+			if (implausible)
+			{
+				encoderVelocityObserver.Reset();						// the readings have been consistent, so the jump was real
+			}
+			consecutiveRejectedReadings = 0;
+			encoderVelocityObserver.ProcessReading(reading, sampleTime);
+		}
+	}
+	const StepTimer::Ticks latency = now - sampleTime;
+	if (latency <= MaxEncoderLatencyTicks)
+	{
+		reading += lrintf(encoderVelocityObserver.GetVelocity() * (float)latency * (1.0/(float)StepTimer::StepClockRate));
+		if (latency > maxEncoderLatency)
+		{
+			maxEncoderLatency = latency;
+		}
+	}
+
 	// Calculate the current position & phase from the encoder reading
-	currentEncoderReading = encoder->GetReading() * reversePolarityMultiplier;
+	currentEncoderReading = reading * reversePolarityMultiplier;
+#if CL_USE_FIXED_POINT
+	currentMotorSteps = (float)currentEncoderReading * recipEncoderPulsesPerStep;
+
+	// Calculate stepPhase - a 0-4095 value representing the phase *within* the current 4 full steps. The conversion to uint16_t makes the fine phase 0-65535.
+	// The following assumes that signed arithmetic is 2's complement and that right shifts of signed values are arithmetic
+	measuredFineStepPhase = (uint16_t)(((int64_t)currentEncoderReading * phasePerEncoderCountQ16) >> (16 - Trigonometry::FinePhaseBits));
+	measuredStepPhase = measuredFineStepPhase >> Trigonometry::FinePhaseBits;
+#else
 	currentMotorSteps = (float)currentEncoderReading / encoderPulsePerStep;
 
 	// Calculate stepPhase - a 0-4095 value representing the phase *within* the current 4 full steps
 	const float tmp = currentMotorSteps * 0.25;
-	measuredStepPhase = (uint16_t)((tmp - floorf(tmp)) * 4095.9);
+	measuredFineStepPhase = (uint16_t)((tmp - floorf(tmp)) * 65535.9);
+	measuredStepPhase = measuredFineStepPhase >> Trigonometry::FinePhaseBits;
+#endif
+}
+
+// Get the current motion from the move system and advance the target position by however far the move has gone since the last control loop iteration.
+// Computing this from the DDA at control loop time means that the target doesn't depend on when the step interrupts happen, and isn't quantised to whole microsteps.
+// We track the position even when we don't use it, so that the target doesn't jump when closed loop mode is enabled or tuning finishes.
+void ClosedLoop::Controller::UpdateTargetFromMotion() noexcept
+{
+	MotionParameters mParams;
+	moveInstance->GetCurrentMotion(driverNumber, mParams);
+	currentMotionSpeed = mParams.speed;
+	currentMotionAcceleration = mParams.acceleration;
+	const float distanceMoved = mParams.position - lastMotionPosition;
+	lastMotionPosition = mParams.position;
+	if ((closedLoopEnabled || monitorThreshold > 0.0) && tuning == 0 && distanceMoved != 0.0)
+	{
+		// A step with the direction pin high reduces targetMotorSteps
+		targetMotorSteps += (Platform::GetForwardDirectionPinLevel(driverNumber)) ? -distanceMoved : distanceMoved;
+		targetEncoderReading = lrintf(targetMotorSteps * encoderPulsePerStep);
+	}
 }
 
-void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
+// Calculate the feedforward contribution to the control signal from the speed and acceleration of the current move
+float ClosedLoop::Controller::GetFeedForward() noexcept
+{
+	if (Kv == 0.0 && Ka == 0.0)
+	{
+		feedForwardTerm = 0.0;
+	}
+	else
+	{
+		// The motion parameters are in the direction of the move, but a positive control signal moves the motor in the direction of increasing target motor steps
+		const float ff = constrain<float>(Kv * currentMotionSpeed + Ka * currentMotionAcceleration, -1024.0, 1024.0);	// limit it so that it can be converted to fixed point
+		feedForwardTerm = (stepDirection) ? -ff : ff;
+	}
+	return feedForwardTerm;
+}
+
+// Set up the error observer gains after the observer type or parameter has been changed
+void ClosedLoop::Controller::UpdateErrorObserver() noexcept
+{
+	switch (errorObserverType)
+	{
+	case ErrorObserverType::alphaBeta:
+		errorObserver.SetBandwidth(errorObserverParameter, ControlLoopPeriodTicks);
+		break;
+	case ErrorObserverType::kalman:
+		errorObserver.SetTrackingIndex(errorObserverParameter, ControlLoopPeriodTicks);
+		break;
+	default:
+		break;
+	}
+	errorObserver.Reset();
+}
+
+// Return the rate of change of the position error in full steps per second, from the observer if we are using one
+float ClosedLoop::Controller::GetErrorDerivative() const noexcept
+{
+	if (errorObserverType != ErrorObserverType::averagingFilter)
+	{
+		return errorObserver.GetVelocity();
+	}
+#if CL_USE_FIXED_POINT
+	const uint32_t filterTime = derivativeFilter.GetTimestampDelta();
+	return (filterTime == 0) ? 0.0 : (float)derivativeFilter.GetReadingDelta() * recipEncoderPulsesPerStep * (float)StepTimer::StepClockRate / (float)filterTime;
+#else
+	return derivativeFilter.GetDerivative();
+#endif
+}
+
+// Clear the motor current statistics
+void ClosedLoop::Controller::ResetCurrentStatistics() noexcept
+{
+	currentFractionSumQ16 = currentFractionSquaredSumQ16 = 0;
+	numCurrentFractionsRecorded = 0;
+}
+
+// Clear the integral term accumulator
+void ClosedLoop::Controller::ResetIntegralTerm() noexcept
+{
+	PIDITerm = 0.0;
+#if CL_USE_FIXED_POINT
+	PIDITermQ16 = 0;
+#endif
+	idIntegral = iqIntegral = 0.0;
+}
+
+#if CL_USE_FIXED_POINT
+
+// Recalculate the fixed point control parameters. Must be called whenever the encoder resolution, PID parameters or holding current change.
+void ClosedLoop::Controller::UpdateFixedPointParameters() noexcept
+{
+	const float recip = (encoderPulsePerStep > 0.0) ? recipEncoderPulsesPerStep : 0.0;
+	phasePerEncoderCountQ16 = lrintf(1024.0 * recip * FixedOne);
+	KpQ16 = lrintf(Kp * recip * FixedOne);
+	KiQ24 = lrintf(Ki * recip * (float)(FixedOne << 8) * ((float)ControlLoopPeriodTicks/(float)StepTimer::StepClockRate));
+	KdQ8 = lrintf(Kd * recip * 256.0 * ((float)StepTimer::StepClockRate/(float)(derivativeFilterSize * ControlLoopPeriodTicks)));
+	holdCurrentFractionTimesMinPhaseShiftQ16 = lrintf(holdCurrentFractionTimesMinPhaseShift * FixedOne);
+	recipHoldCurrentFractionQ16 = lrintf(recipHoldCurrentFraction * FixedOne);
+}
+
+#endif
+
+#if CL_USE_FIXED_POINT
+
+// Fixed point version of ControlMotorCurrents. This produces the same results as the floating point version, but there are no divisions or rounding functions
+// in the normal case that the control loop is running at its nominal rate. The floating point values are still updated so that they can be reported.
+void ClosedLoop::Controller::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
+{
+	const int32_t errorCounts = targetEncoderReading - currentEncoderReading;
+	const uint32_t timeDelta = loopStartTime - prevControlLoopCallTime;
+
+	// Use a PID controller to calculate the required 'torque' - the control signal
+	// We choose to use a PID control signal in the range -256 to +256. This is rather arbitrary.
+	const int32_t pTerm = (int32_t)constrain<int64_t>((int64_t)errorCounts * KpQ16, -4 * PIDControlLimitQ16, 4 * PIDControlLimitQ16);	// limit P to avoid overflow, far enough out not to change the result
+	const int32_t kiThisLoop = (timeDelta == ControlLoopPeriodTicks) ? KiQ24 : (int32_t)(((int64_t)KiQ24 * timeDelta)/ControlLoopPeriodTicks);
+	PIDITermQ16 = (int32_t)constrain<int64_t>(PIDITermQ16 + (((int64_t)errorCounts * kiThisLoop) >> 8), -PIDIlimitQ16, PIDIlimitQ16);	// constrain I to prevent it running away
+
+	int32_t dTerm;
+	if (errorObserverType != ErrorObserverType::averagingFilter)
+	{
+		dTerm = lrintf(constrain<float>(Kd * errorObserver.GetVelocity(), -256.0, 256.0) * FixedOne);
+	}
+	else if (derivativeFilter.GetTimestampDelta() == derivativeFilterSize * ControlLoopPeriodTicks)
+	{
+		dTerm = (int32_t)constrain<int64_t>(((int64_t)derivativeFilter.GetReadingDelta() * KdQ8) << 8, -PIDControlLimitQ16, PIDControlLimitQ16);
+	}
+	else
+	{
+		// The control loop has not been running at the nominal rate, so use the measured time span of the derivative filter
+		const uint32_t filterTime = derivativeFilter.GetTimestampDelta();
+		const float derivative = (filterTime == 0) ? 0.0 : (float)derivativeFilter.GetReadingDelta() * recipEncoderPulsesPerStep * (float)StepTimer::StepClockRate / (float)filterTime;
+		dTerm = lrintf(constrain<float>(Kd * derivative, -256.0, 256.0) * FixedOne);
+	}
+	const int32_t feedForward = lrintf(GetFeedForward() * FixedOne);
+	const int32_t controlSignal = constrain<int32_t>(pTerm + PIDITermQ16 + dTerm + feedForward, -PIDControlLimitQ16, PIDControlLimitQ16);	// clamp the sum between +/- 256
+
+	if (focEnabled)
+	{
+		constexpr float FixedToFloat = 1.0/(float)FixedOne;
+		PIDPTerm = (float)pTerm * FixedToFloat;
+		PIDITerm = (float)PIDITermQ16 * FixedToFloat;
+		PIDDTerm = (float)dTerm * FixedToFloat;
+		PIDControlSignal = (float)controlSignal * FixedToFloat;
+		ApplyFocCurrents(PIDControlSignal * (1.0/256.0), (float)timeDelta * (1.0/(float)StepTimer::StepClockRate));
+		return;
+	}
+
+	// Calculate the offset required to produce the torque in the correct direction. See the floating point version for the explanation.
+	int32_t phaseShiftQ16 = controlSignal * 4;
+
+	// New control algorithm, see the floating point version
+	float currentFraction;
+	const int32_t absPhaseShift = abs(phaseShiftQ16);
+	if (loadCurrentMargin > 0.0)
+	{
+		// Load adaptive current, see the floating point version
+		constexpr float FixedToFloat = 1.0/(float)FixedOne;
+		currentFraction = GetLoadAdaptiveCurrentFraction((float)abs(controlSignal) * FixedToFloat, (float)abs(PIDITermQ16) * FixedToFloat);
+		phaseShiftQ16 = constrain<int32_t>(lrintf((float)phaseShiftQ16/currentFraction), -1024 * FixedOne, 1024 * FixedOne);
+	}
+	else if (absPhaseShift >= MinimumPhaseShiftQ16)
+	{
+		// Use the requested phase shift at full current
+		currentFraction = 1.0;
+	}
+	else if (absPhaseShift >= holdCurrentFractionTimesMinPhaseShiftQ16)
+	{
+		// Use the minimum phase shift but reduce the current
+		currentFraction = (float)absPhaseShift * (1.0/(float)MinimumPhaseShiftQ16);
+		phaseShiftQ16 = (phaseShiftQ16 >= 0) ? MinimumPhaseShiftQ16 : -MinimumPhaseShiftQ16;
+	}
+	else
+	{
+		// Reduce the phase shift and keep the current the same
+		currentFraction = holdCurrentFraction;
+		phaseShiftQ16 = (int32_t)(((int64_t)phaseShiftQ16 * recipHoldCurrentFractionQ16) >> 16);
+	}
+	RecordCurrentFraction(currentFraction);
+
+	// Calculate the required motor currents to induce that torque and reduce it modulo 65536 in fine phase units
+	// The following assumes that signed arithmetic is 2's complement and that right shifts of signed values are arithmetic
+	const uint16_t desiredFineStepPhase = (uint16_t)((int32_t)measuredFineStepPhase + ((phaseShiftQ16 + (FixedOne >> (Trigonometry::FinePhaseBits + 1))) >> (16 - Trigonometry::FinePhaseBits)));
+	desiredStepPhase = desiredFineStepPhase >> Trigonometry::FinePhaseBits;
+
+	// Update the floating point values so that they can be reported
+	constexpr float FixedToFloat = 1.0/(float)FixedOne;
+	PIDPTerm = (float)pTerm * FixedToFloat;
+	PIDITerm = (float)PIDITermQ16 * FixedToFloat;
+	PIDDTerm = (float)dTerm * FixedToFloat;
+	PIDControlSignal = (float)controlSignal * FixedToFloat;
+	phaseShift = (float)phaseShiftQ16 * FixedToFloat;
+
+	// Assert the required motor currents
+	SetMotorFinePhase(desiredFineStepPhase, currentFraction);
+}
+
+#else
+
+void ClosedLoop::Controller::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
 {
 	// Get the time delta in seconds
 	const float timeDelta = (float)(loopStartTime - prevControlLoopCallTime) * (1.0/(float)StepTimer::StepClockRate);
@@ -906,8 +1656,14 @@ void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
 	// We choose to use a PID control signal in the range -256 to +256. This is rather arbitrary.
 	PIDPTerm = Kp * currentError;
 	PIDITerm = constrain<float>(PIDITerm + Ki * currentError * timeDelta, -PIDIlimit, PIDIlimit);	// constrain I to prevent it running away
-	PIDDTerm = constrain<float>(Kd * derivativeFilter.GetDerivative(), -256.0, 256.0);		// constrain D so that we can graph it more sensibly after a sudden step input
-	PIDControlSignal = constrain<float>(PIDPTerm + PIDITerm + PIDDTerm, -256.0, 256.0);		// clamp the sum between +/- 256
+	PIDDTerm = constrain<float>(Kd * GetErrorDerivative(), -256.0, 256.0);		// constrain D so that we can graph it more sensibly after a sudden step input
+	PIDControlSignal = constrain<float>(PIDPTerm + PIDITerm + PIDDTerm + GetFeedForward(), -256.0, 256.0);		// clamp the sum between +/- 256
+
+	if (focEnabled)
+	{
+		ApplyFocCurrents(PIDControlSignal * (1.0/256.0), timeDelta);
+		return;
+	}
 
 	// Calculate the offset required to produce the torque in the correct direction
 	// i.e. if we are moving in the positive direction, we must apply currents with a positive phase shift
@@ -920,9 +1676,17 @@ void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
 	// - if the required phase shift is greater than about 15 degrees, apply it at maximum current
 	// - below 15 degrees, keep the phase shift at +/- 15 degrees and reduce the current, but not below the minimum holding current
 	// - after that, keep the current at the holding current and reduce the phase shift.
+	// Alternatively, in load adaptive mode:
+	// - set the current to a multiple of the estimated torque demand, but not below the minimum holding current
+	// - increase the phase shift to get the requested torque from that current, up to a maximum of 1 full step.
 	float currentFraction;
 	const float absPhaseShift = fabsf(phaseShift);
-	if (absPhaseShift >= MinimumPhaseShift)
+	if (loadCurrentMargin > 0.0)
+	{
+		currentFraction = GetLoadAdaptiveCurrentFraction(fabsf(PIDControlSignal), fabsf(PIDITerm));
+		phaseShift = constrain<float>(phaseShift/currentFraction, -1024.0, 1024.0);
+	}
+	else if (absPhaseShift >= MinimumPhaseShift)
 	{
 		// Use the requested phase shift at full current
 		currentFraction = 1.0;
@@ -939,33 +1703,207 @@ void ClosedLoop::ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept
 		currentFraction = holdCurrentFraction;
 		phaseShift *= recipHoldCurrentFraction;
 	}
+	RecordCurrentFraction(currentFraction);
 
-	// Calculate the required motor currents to induce that torque and reduce it module 4096
+	// Calculate the required motor currents to induce that torque and reduce it modulo 65536 in fine phase units
 	// The following assumes that signed arithmetic is 2's complement
-	desiredStepPhase = (uint16_t)((int32_t)measuredStepPhase + lrintf(phaseShift)) % 4096;
+	const uint16_t desiredFineStepPhase = (uint16_t)((int32_t)measuredFineStepPhase + lrintf(phaseShift * Trigonometry::FinePhasesPerEntry));
+	desiredStepPhase = desiredFineStepPhase >> Trigonometry::FinePhaseBits;
 
 	// Assert the required motor currents
-	SetMotorPhase(desiredStepPhase, currentFraction);
+	SetMotorFinePhase(desiredFineStepPhase, currentFraction);
+}
+
+#endif
+
+// Field oriented control. The measured fine step phase is the electrical angle of the rotor, so the q axis, which gives the most torque per amp, is one full step ahead of it.
+// The q axis current is proportional to the torque demand. We keep a d axis current that tops up the total to the holding current, so that the motor is still held firmly
+// when the demand is low, but it falls to zero as the demand rises. If we can measure the coil currents, PI loops on the d and q currents correct for the
+// driver not reaching the requested currents at speed. Otherwise we rely on the current regulation in the driver.
+void ClosedLoop::Controller::ApplyFocCurrents(float torqueDemand, float timeDelta) noexcept
+{
+	const float iqDemand = constrain<float>(torqueDemand, -1.0, 1.0);
+	const float idDemand = max<float>(holdCurrentFraction - fabsf(iqDemand), 0.0);
+
+	float sine, cosine;
+	Trigonometry::FastSinCosFine(measuredFineStepPhase, sine, cosine);			// these are scaled to 248
+
+	float id = idDemand, iq = iqDemand;
+#if SUPPORT_CL_CURRENT_SENSE
+	const float fullCurrent = SmartDrivers::GetCurrent(driverNumber);
+	if (currentKp + currentKi > 0.0 && fullCurrent > 0.0)
+	{
+		// Transform the measured coil currents to the rotor frame
+		const float scale = 1.0/(248.0 * fullCurrent);	// the sine and cosine are scaled to 248
+		const float measuredA = (float)measuredCoilA * scale, measuredB = (float)measuredCoilB * scale;
+		const float idError = idDemand - (measuredA * cosine + measuredB * sine);
+		const float iqError = iqDemand - (measuredB * cosine - measuredA * sine);
+		idIntegral = constrain<float>(idIntegral + currentKi * idError * timeDelta, -1.0, 1.0);
+		iqIntegral = constrain<float>(iqIntegral + currentKi * iqError * timeDelta, -1.0, 1.0);
+		id += currentKp * idError + idIntegral;
+		iq += currentKp * iqError + iqIntegral;
+	}
+#endif
+
+	// Limit the magnitude of the current vector to full current, keeping its direction
+	float magnitude = fastSqrtf(fsquare(id) + fsquare(iq));
+	if (magnitude > 1.0)
+	{
+		id /= magnitude;
+		iq /= magnitude;
+		magnitude = 1.0;
+	}
+	RecordCurrentFraction(magnitude);
+
+	// Transform the currents back to the coils. Coil A follows the cosine of the phase and coil B the sine, as in SetMotorFinePhase.
+	coilA = (int16_t)lrintf(id * cosine - iq * sine);
+	coilB = (int16_t)lrintf(id * sine + iq * cosine);
+
+	// Report the angle of the current vector relative to the rotor as the phase shift, in units where 1024 is one full step
+	phaseShift = (magnitude > 0.0) ? atan2f(iq, id) * (2048.0/Pi) : 0.0;
+	desiredStepPhase = (uint16_t)((int32_t)measuredStepPhase + lrintf(phaseShift)) & 4095;
+
+	SetMotorCurrents();
+}
+
+// Check the encoder position against the commanded position in open loop mode and record a layer shift if they differ by more than the threshold.
+// We don't know the encoder polarity unless basic tuning has been done in closed loop mode, so if necessary we learn it from the first few steps of movement.
+// After a layer shift we take the current position as the new reference, so that we detect any further shifts as well.
+void ClosedLoop::Controller::MonitorOpenLoopPosition() noexcept
+{
+	if (!monitorPolarityKnown)
+	{
+		const float commandedSteps = targetMotorSteps - monitorReferenceSteps;
+		if (fabsf(commandedSteps) >= PolarityLearningSteps)
+		{
+			if ((currentMotorSteps - monitorReferenceSteps) * commandedSteps < 0.0)
+			{
+				reversePolarityMultiplier = -reversePolarityMultiplier;
+			}
+			monitorPolarityKnown = true;
+			ResetError();
+		}
+		return;
+	}
+
+	if (fabsf(currentError) > monitorThreshold && !layerShiftPending)
+	{
+		layerShiftError = currentError;
+		whenLayerShift = millis();
+		++numLayerShifts;
+		layerShiftPending = true;
+		ResetError();
+	}
+}
+
+bool ClosedLoop::Controller::GetLayerShift(float& errorSteps, uint32_t& whenDetected) noexcept
+{
+	if (layerShiftPending)
+	{
+		errorSteps = layerShiftError;
+		whenDetected = whenLayerShift;
+		layerShiftPending = false;
+		return true;
+	}
+	return false;
+}
+
+// Update the estimated torque demand and return the current fraction to use in load adaptive mode. The arguments are in control signal units.
+// The integral term reflects the steady load and the control signal reflects the recent error history, so we use the larger of them.
+// The estimate follows an increase in demand immediately but decays slowly, so that we don't reduce the current between closely spaced moves.
+float ClosedLoop::Controller::GetLoadAdaptiveCurrentFraction(float absControlSignal, float absITerm) noexcept
+{
+	const float demand = max<float>(absControlSignal, absITerm) * (1.0/256.0);
+	loadEstimate = (demand >= loadEstimate) ? demand : loadEstimate + (demand - loadEstimate) * LoadEstimateDecayFactor;
+	return constrain<float>(loadEstimate * loadCurrentMargin, holdCurrentFraction, 1.0);
+}
+
+// Record the current fraction used so that we can report the average current
+void ClosedLoop::Controller::RecordCurrentFraction(float currentFraction) noexcept
+{
+	const uint32_t fractionQ16 = (uint32_t)lrintf(currentFraction * 65536.0);
+	currentFractionSumQ16 += fractionQ16;
+	currentFractionSquaredSumQ16 += ((uint64_t)fractionQ16 * fractionQ16) >> 16;
+	++numCurrentFractionsRecorded;
 }
 
 void ClosedLoop::Diagnostics(const StringRef& reply) noexcept
 {
-	reply.printf("Closed loop enabled: %s", closedLoopEnabled ? "yes" : "no");
+	reply.Clear();
+	for (Controller& c : controllers)
+	{
+		c.Diagnostics(reply);
+	}
+
+	// The rest is only relevant if we are in closed loop mode
+	if (AnyClosedLoopEnabled())
+	{
+		reply.lcatf("Control loop runtime (ms): min=%.3f, max=%.3f, frequency (Hz): min=%ld, max=%ld",
+					(double) TickPeriodToTimePeriod(minControlLoopRuntime), (double)TickPeriodToTimePeriod(maxControlLoopRuntime),
+					lrintf(TickPeriodToFreq(maxControlLoopCallInterval)), lrintf(TickPeriodToFreq(minControlLoopCallInterval)));
+		reply.catf(", nominal %u, overruns %u", ControlLoopFrequency, numControlLoopOverruns);
+		ResetMonitoringVariables();
+	}
+#if SUPPORT_CL_CURRENT_SENSE
+	CurrentSense::Diagnostics(reply);
+#endif
+
+	//DEBUG
+	//reply.catf(", event status 0x%08" PRIx32 ", TCC2 CTRLA 0x%08" PRIx32 ", TCC2 EVCTRL 0x%08" PRIx32, EVSYS->CHSTATUS.reg, QuadratureTcc->CTRLA.reg, QuadratureTcc->EVCTRL.reg);
+}
+
+// Report the control loop counters for the compact diagnostics record, resetting them in the same way as Diagnostics does unless it is a telemetry record
+void ClosedLoop::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
+{
+	unsigned int predictedStalls = 0;
+	for (Controller& c : controllers)
+	{
+		predictedStalls += c.GetPredictedStalls(rec.ResetCounters());
+	}
+	rec.Set(DiagnosticsField::clPredictedStalls, predictedStalls);
+	if (AnyClosedLoopEnabled())
+	{
+		rec.Set(DiagnosticsField::clMaxLoopRuntime, maxControlLoopRuntime);
+		rec.Set(DiagnosticsField::clLoopOverruns, numControlLoopOverruns);
+		if (rec.ResetCounters())
+		{
+			ResetMonitoringVariables();
+		}
+	}
+}
+
+void ClosedLoop::Controller::Diagnostics(const StringRef& reply) noexcept
+{
+	if (driverNumber != 0)
+	{
+		reply.lcatf("Driver %u: ", driverNumber);
+	}
+	reply.catf("Closed loop enabled: %s", closedLoopEnabled ? "yes" : "no");
 	reply.catf(", pre-error threshold: %.2f, error threshold: %.2f", (double) errorThresholds[0], (double) errorThresholds[1]);
 	reply.catf(", encoder type %s", GetEncoderType().ToString());
 	if (encoder != nullptr)
 	{
 		reply.catf(", reverse polarity: %s", (reversePolarityMultiplier < 0) ? "yes" : "no");
-		reply.catf(", position %" PRIi32, encoder->GetReading());
+		reply.catf(", position %" PRIi32 ", max encoder latency %.1fus", encoder->GetReading(),
+					(double)((float)maxEncoderLatency * (1.0e6/(float)StepTimer::StepClockRate)));
+		maxEncoderLatency = 0;
+		reply.catf(", implausible readings %" PRIu32, numRejectedReadings);
+		numRejectedReadings = 0;
 		encoder->AppendDiagnostics(reply);
+		if (monitorThreshold > 0.0)
+		{
+			reply.catf(", layer shifts %u", numLayerShifts);
+		}
 	}
 
 	// The rest is only relevant if we are in closed loop mode
 	if (closedLoopEnabled)
 	{
 		reply.catf(", tuning mode: %#x, tuning error: %#x", tuning, tuningError);
-		reply.catf(", collecting data: %s", CollectingData() ? "yes" : "no");
-		if (CollectingData())
+		reply.catf(", predicted stalls: %u", numPredictedStalls);
+		numPredictedStalls = 0;
+		reply.catf(", collecting data: %s", (CollectingData() && dataCollectionController == this) ? "yes" : "no");
+		if (CollectingData() && dataCollectionController == this)
 		{
 			reply.catf(" (filter: %#x, mode: %u, rate: %u, movement: %u)", filterRequested, samplingMode, (unsigned int)(StepTimer::StepClockRate/dataCollectionIntervalTicks), movementRequested);
 		}
@@ -973,83 +1911,154 @@ void ClosedLoop::Diagnostics(const StringRef& reply) noexcept
 #if 0	// DC disabled this because it doesn't work yet and the driver diagnostics were too long for the reply buffer
 		reply.catf(", ultimateGain=%f, oscillationPeriod=%f", (double) ultimateGain, (double) oscillationPeriod);
 #endif
-		reply.lcatf("Control loop runtime (ms): min=%.3f, max=%.3f, frequency (Hz): min=%ld, max=%ld",
-					(double) TickPeriodToTimePeriod(minControlLoopRuntime), (double)TickPeriodToTimePeriod(maxControlLoopRuntime),
-					lrintf(TickPeriodToFreq(maxControlLoopCallInterval)), lrintf(TickPeriodToFreq(minControlLoopCallInterval)));
-
-		ResetMonitoringVariables();
+		if (numCurrentFractionsRecorded != 0)
+		{
+			// Winding losses are proportional to current squared, so that is what we compare with running at full current
+			const float scale = 1.0/((float)numCurrentFractionsRecorded * 65536.0);
+			reply.lcatf("Average current %.1f%%, energy saved %.1f%%, load estimate %.1f%%",
+						(double)((float)currentFractionSumQ16 * scale * 100.0), (double)((1.0 - (float)currentFractionSquaredSumQ16 * scale) * 100.0), (double)(loadEstimate * 100.0));
+		}
 	}
-
-	//DEBUG
-	//reply.catf(", event status 0x%08" PRIx32 ", TCC2 CTRLA 0x%08" PRIx32 ", TCC2 EVCTRL 0x%08" PRIx32, EVSYS->CHSTATUS.reg, QuadratureTcc->CTRLA.reg, QuadratureTcc->EVCTRL.reg);
 }
 
-// TODO: Instead of having this take step, why not use the current DDA to calculate where we need to be?
-void ClosedLoop::TakeStep() noexcept
-{
-# if SUPPORT_TMC2160 && SINGLE_DRIVER
-	bool dummy;			// this receives the interpolation, but we don't use it
-	const unsigned int microsteps = SmartDrivers::GetMicrostepping(0, dummy);
-	const float microstepAngle = (microsteps == 0) ? 1.0 : 1.0/microsteps;
-	targetMotorSteps += (stepDirection ? -microstepAngle : +microstepAngle);
-	targetEncoderReading = lrintf(targetMotorSteps * encoderPulsePerStep);
+// Functions called by the motion system. These pass the call on to the controller for the specified driver.
 
-	if (samplingMode == RecordingMode::OnNextMove)
+void ClosedLoop::TakeStep(size_t driver) noexcept
+{
+	if (driver < NumClosedLoopDrivers)
 	{
-		dataCollectionStartTicks = whenNextSampleDue = StepTimer::GetTimerTicks();
-		samplingMode = RecordingMode::Immediate;
+		controllers[driver].TakeStep();
 	}
-# else
-#  error Cannot support closed loop with the specified hardware
-# endif
 }
 
-StandardDriverStatus ClosedLoop::ReadLiveStatus() noexcept
+StandardDriverStatus ClosedLoop::ReadLiveStatus(size_t driver) noexcept
 {
+	if (driver < NumClosedLoopDrivers)
+	{
+		return controllers[driver].ReadLiveStatus();
+	}
 	StandardDriverStatus result;
 	result.all = 0;
-	result.closedLoopPositionNotMaintained = stall;
-	result.closedLoopPositionWarning = preStall;
-	result.closedLoopNotTuned = ((tuningError & minimalTunes[encoder->GetType().ToBaseType()]) != 0);
-	result.closedLoopTuningError = ((tuningError & TUNE_ERR_TUNING_FAILURE) != 0);
 	return result;
 }
 
-void ClosedLoop::SetStepDirection(bool dir) noexcept
+void ClosedLoop::SetStepDirection(size_t driver, bool dir) noexcept
 {
-	stepDirection = dir;
+	if (driver < NumClosedLoopDrivers)
+	{
+		controllers[driver].SetStepDirection(dir);
+	}
 }
 
-bool ClosedLoop::GetClosedLoopEnabled() noexcept
+bool ClosedLoop::GetClosedLoopEnabled(size_t driver) noexcept
 {
-	return closedLoopEnabled;
+	return driver < NumClosedLoopDrivers && controllers[driver].GetClosedLoopEnabled();
 }
 
 void ClosedLoop::ResetError(size_t driver) noexcept
 {
-# if SINGLE_DRIVER
-	if (driver == 0) {
-		// Set the target position to the current position
-		ReadState();
-		derivativeFilter.Reset();
-		targetMotorSteps = currentMotorSteps;
-		targetEncoderReading = currentEncoderReading;
+	if (driver < NumClosedLoopDrivers)
+	{
+		controllers[driver].ResetError();
 	}
-# else
-#  error Cannot support closed loop with the specified hardware
-# endif
+}
+
+GCodeResult ClosedLoop::StartFrequencyResponse(size_t driver, uint32_t frequencies, uint32_t amplitudeAndPoints, const StringRef& reply) noexcept
+{
+	if (driver >= NumClosedLoopDrivers)
+	{
+		reply.printf("Driver number %u.%u does not support closed loop mode", CanInterface::GetCanAddress(), (unsigned int)driver);
+		return GCodeResult::error;
+	}
+	return controllers[driver].StartFrequencyResponse(frequencies, amplitudeAndPoints, reply);
 }
 
 // This is called before the driver mode is changed. Return true if success.
 bool ClosedLoop::SetClosedLoopEnabled(size_t driver, bool enabled, const StringRef &reply) noexcept
 {
-	// Trying to enable closed loop
-	if (driver != 0)
+	if (driver < NumClosedLoopDrivers)
+	{
+		return controllers[driver].SetClosedLoopEnabled(enabled, reply);
+	}
+	if (enabled)
 	{
 		reply.copy("Invalid driver number");
 		return false;
 	}
+	return true;
+}
+
+// This is called just after the driver has switched into closed loop mode (it may have been in closed loop mode already)
+void ClosedLoop::DriverSwitchedToClosedLoop(size_t driver) noexcept
+{
+	if (driver < NumClosedLoopDrivers)
+	{
+		controllers[driver].DriverSwitchedToClosedLoop();
+	}
+}
+
+// If we are in closed loop modify the driver status appropriately
+StandardDriverStatus ClosedLoop::ModifyDriverStatus(size_t driver, StandardDriverStatus originalStatus) noexcept
+{
+	return (driver < NumClosedLoopDrivers) ? controllers[driver].ModifyDriverStatus(originalStatus) : originalStatus;
+}
+
+bool ClosedLoop::GetLayerShift(size_t driver, float& errorSteps, uint32_t& whenDetected) noexcept
+{
+	return driver < NumClosedLoopDrivers && controllers[driver].GetLayerShift(errorSteps, whenDetected);
+}
+
+float ClosedLoop::GetPositionError(size_t driver) noexcept
+{
+	return (driver < NumClosedLoopDrivers) ? controllers[driver].GetPositionError() : 0.0;
+}
+
+bool ClosedLoop::IsCollectingData() noexcept
+{
+	return CollectingData();
+}
+
+// This is called from the step ISR when a step is due. The target position is calculated from the current DDA by UpdateTargetFromMotion,
+// so all we need do here is start recording if we were waiting for the next move.
+void ClosedLoop::Controller::TakeStep() noexcept
+{
+# if SUPPORT_TMC2160
+	if (samplingMode == RecordingMode::OnNextMove && dataCollectionController == this)
+	{
+		dataCollectionStartTicks = whenNextSampleDue = StepTimer::GetTimerTicks();
+		samplingMode = RecordingMode::Immediate;
+	}
+# else
+#  error Cannot support closed loop with the specified hardware
+# endif
+}
+
+StandardDriverStatus ClosedLoop::Controller::ReadLiveStatus() const noexcept
+{
+	StandardDriverStatus result;
+	result.all = 0;
+	result.closedLoopPositionNotMaintained = stall;
+	result.closedLoopPositionWarning = preStall;
+	result.closedLoopNotTuned = ((tuningError & minimalTunes[encoder->GetType().ToBaseType()]) != 0);
+	result.closedLoopTuningError = ((tuningError & TUNE_ERR_TUNING_FAILURE) != 0);
+	return result;
+}
 
+void ClosedLoop::Controller::ResetError() noexcept
+{
+	// Set the target position to the current position
+	encoderVelocityObserver.Reset();
+	ReadState();
+	derivativeFilter.Reset();
+	errorObserver.Reset();
+	targetMotorSteps = monitorReferenceSteps = currentMotorSteps;
+	targetEncoderReading = currentEncoderReading;
+}
+
+// This is called before the driver mode is changed. Return true if success.
+bool ClosedLoop::Controller::SetClosedLoopEnabled(bool enabled, const StringRef &reply) noexcept
+{
+	// Trying to enable closed loop
 	if (enabled && !closedLoopEnabled)
 	{
 		if (encoder == nullptr)
@@ -1059,50 +2068,57 @@ bool ClosedLoop::SetClosedLoopEnabled(size_t driver, bool enabled, const StringR
 		}
 
 		delay(3);														// delay long enough for the TMC driver to have read the microstep counter since the end of the last movement
-		const uint16_t initialStepPhase = SmartDrivers::GetMicrostepPosition(0) * 4;	// get the current coil A microstep position as 0..4095
+		const uint16_t initialStepPhase = SmartDrivers::GetMicrostepPosition(driverNumber) * 4;	// get the current coil A microstep position as 0..4095
 		reversePolarityMultiplier = 1;									// assume the encoder reads forwards
+
+		// Reset the tuning (We have already checked encoder != nullptr). This also restores the polarity if we have a stored tuning result.
+		tuningError = minimalTunes[encoder->GetType().ToBaseType()];
+		RestoreBasicTuningResult();
+
 		if (encoder->GetPositioningType() == EncoderPositioningType::relative)
 		{
-			// Temporarily calibrate the encoder zero position
+			// Temporarily calibrate the encoder zero position. If we restored the tuning result then we correct it when we see the index pulse.
 			// We assume that the motor is at the position given by its microstep counter. This may not be true e.g. if it has a brake.
 			ReadState();												// set up currentMotorSteps and measuredStepPhase
-			((RelativeEncoder*)encoder)->SetOffset(lrintf(((int32_t)initialStepPhase - (int32_t)measuredStepPhase) * encoderPulsePerStep / 1024.0));	// set the new zero position
+			((RelativeEncoder*)encoder)->SetOffset(lrintf(((int32_t)initialStepPhase - (int32_t)measuredStepPhase) * encoderPulsePerStep / 1024.0) * reversePolarityMultiplier);	// set the new zero position
 		}
 
 		desiredStepPhase = initialStepPhase;							// set this to be picked up later in DriverSwitchedToClosedLoop
 
 		// Set the target position to the current position
-		ResetError(0);													// this calls ReadState again and sets up targetMotorSteps
-
-		// Reset the tuning (We have already checked encoder != nullptr)
-		tuningError = minimalTunes[encoder->GetType().ToBaseType()];
+		ResetError();													// this calls ReadState again and sets up targetMotorSteps
 
 		ResetMonitoringVariables();										// to avoid getting stupid values
-		prevControlLoopCallTime = StepTimer::GetTimerTicks();			// to avoid huge integral term windup
+		if (!AnyClosedLoopEnabled())
+		{
+			whenControlLoopDue = StepTimer::GetTimerTicks();			// the control loop timing is about to start
+		}
+		prevControlLoopCallTime = whenControlLoopDue;					// to avoid huge integral term windup
 	}
 
 	// If we are disabling closed loop mode, we should ideally send steps to get the microstep counter to match the current phase here
 	closedLoopEnabled = enabled;
+	if (!enabled && monitorThreshold > 0.0 && encoder != nullptr)
+	{
+		ResetError();													// restart open loop position monitoring from here
+	}
 
 	return true;
 }
 
 // This is called just after the driver has switched into closed loop mode (it may have been in closed loop mode already)
-void ClosedLoop::DriverSwitchedToClosedLoop(size_t driver) noexcept
+void ClosedLoop::Controller::DriverSwitchedToClosedLoop() noexcept
 {
-	if (driver == 0)
-	{
-		delay(3);														// allow time for the switch to complete and a few control loop iterations to be done
-		SetMotorPhase(desiredStepPhase, SmartDrivers::GetStandstillCurrentPercent(0) * 0.01);	// set the motor currents to match the initial position using the open loop standstill current
-		PIDITerm = 0.0;													// clear the integral term accumulator
-		ResetMonitoringVariables();										// the first loop iteration will have recorded a higher than normal loop call interval, so start again
-	}
+	delay(3);															// allow time for the switch to complete and a few control loop iterations to be done
+	SetMotorPhase(desiredStepPhase, SmartDrivers::GetStandstillCurrentPercent(driverNumber) * 0.01);	// set the motor currents to match the initial position using the open loop standstill current
+	ResetIntegralTerm();												// clear the integral term accumulator
+	ResetMonitoringVariables();											// the first loop iteration will have recorded a higher than normal loop call interval, so start again
 }
 
 // If we are in closed loop modify the driver status appropriately
-StandardDriverStatus ClosedLoop::ModifyDriverStatus(size_t driver, StandardDriverStatus originalStatus) noexcept
+StandardDriverStatus ClosedLoop::Controller::ModifyDriverStatus(StandardDriverStatus originalStatus) const noexcept
 {
-	if (closedLoopEnabled && driver == 0)
+	if (closedLoopEnabled)
 	{
 		originalStatus.stall = 0;										// ignore stall detection in open loop mode
 		originalStatus.standstill = 0;									// ignore standstill detection in closed loop mode
@@ -18,13 +18,17 @@
 # include <ClosedLoop/Trigonometry.h>
 # include <Hardware/SharedSpiDevice.h>
 # include <ClosedLoop/DerivativeAveragingFilter.h>
+# include <ClosedLoop/VelocityObserver.h>
+# include <ClosedLoop/Encoder.h>
 
-class Encoder;
-class SpiEncoder;
+#define BASIC_TUNING_DEBUG	0
+#define CL_USE_FIXED_POINT	0		// set nonzero to keep the encoder position, phase and PID terms in fixed point in the control loop
+
+class CanMessageGenericParser;
 
 namespace ClosedLoop
 {
-	// Constants and variables that are used by both the ClosedLoop and the Tuning modules
+	// Constants that are used by both the ClosedLoop and the Tuning modules
 
 	// Possible tuning errors
 	constexpr uint8_t TUNE_ERR_NOT_DONE_BASIC				= 1u << 0;
@@ -41,20 +45,30 @@ namespace ClosedLoop
 	constexpr uint8_t BASIC_TUNING_MANOEUVRE 				= 1u << 0;		// this measures the polarity, check that the CPR looks OK, and for relative encoders sets the zero position
 	constexpr uint8_t ENCODER_CALIBRATION_MANOEUVRE 		= 1u << 1;		// this calibrates an absolute encoder
 	constexpr uint8_t STEP_MANOEUVRE 						= 1u << 6;		// this does a sudden step change in the requested position for PID tuning
+	constexpr uint8_t ZIEGLER_NICHOLS_MANOEUVRE 			= 1u << 7;		// this measures the ultimate gain and oscillation period using relay feedback and suggests PID parameters
+
+	// Benchmark manoeuvres. These run under normal PID control after any tuning manoeuvres requested at the same time, and report a summary of the control quality.
+	constexpr uint8_t BENCHMARK_STEP_MANOEUVRE				= 1u << 2;		// step response: rise time, overshoot and settling time
+	constexpr uint8_t BENCHMARK_SINE_SWEEP_MANOEUVRE		= 1u << 3;		// stepped sine frequency response: gain and phase lag at each frequency, and the bandwidth
+	constexpr uint8_t BENCHMARK_TRAPEZOID_MANOEUVRE			= 1u << 4;		// trapezoidal move forwards and back: RMS and peak following error
+	constexpr uint8_t BENCHMARK_MANOEUVRES					= BENCHMARK_STEP_MANOEUVRE | BENCHMARK_SINE_SWEEP_MANOEUVRE | BENCHMARK_TRAPEZOID_MANOEUVRE;
+
+	constexpr size_t MaxSweepPoints = 32;									// the most frequencies in a frequency response sweep
 
 #if 0	// The remainder are not currently implemented
 	constexpr uint8_t CONTINUOUS_PHASE_INCREASE_MANOEUVRE 	= 1u << 5;
-	constexpr uint8_t ZIEGLER_NICHOLS_MANOEUVRE 			= 1u << 7;
 #endif
 
-	//TODO reduce the number of these public variables, preferably to zero. Use a cleaner interface between the tuning module and the main closed loop module.
-	extern Encoder *encoder;						// Pointer to the encoder object in use
-	extern uint8_t tuning;							// Bitmask of any tuning manoeuvres that have been requested
-	extern uint8_t tuningError;						// Flags for any tuning errors
-	extern uint16_t measuredStepPhase;				// The measured position of the motor
-	extern uint16_t desiredStepPhase;				// The desired position of the motor
-	extern int32_t currentEncoderReading;			// The latest reading taken from the encoder
-	extern float encoderPulsePerStep;				// How many encoder readings do we get per step?
+	constexpr uint16_t BasicTuningPhaseIncrement = 8;						// how much basic tuning increments the phase by on each step, where 4096 is 4 full steps
+
+	static_assert(NumClosedLoopDrivers <= NumDrivers);
+
+	// Additional data collection variables. The other CL_RECORD_* bits are defined in CANlib.
+	constexpr uint16_t CL_RECORD_ERROR_DERIVATIVE			= 1u << 13;		// the rate of change of the position error used by the D term, in full steps per second
+#if SUPPORT_CL_CURRENT_SENSE
+	constexpr uint16_t CL_RECORD_MEASURED_COIL_A_CURRENT	= 1u << 14;		// the measured current in coil A, in mA
+	constexpr uint16_t CL_RECORD_MEASURED_COIL_B_CURRENT	= 1u << 15;		// the measured current in coil B, in mA
+#endif
 
 	// Closed loop public methods
 	void Init() noexcept;
@@ -64,33 +78,369 @@ namespace ClosedLoop
 	GCodeResult ProcessM569Point6(const CanMessageGeneric& msg, const StringRef& reply) noexcept;
 
 	void Diagnostics(const StringRef& reply) noexcept;
+	void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;
+	GCodeResult StartFrequencyResponse(size_t driver, uint32_t frequencies, uint32_t amplitudeAndPoints, const StringRef& reply) noexcept;
+	void AppendFrequencyResponse(const StringRef& reply, unsigned int startIndex) noexcept;
 
 	// Methods called by the motion system
-	void ControlLoop() noexcept;
-	void TakeStep() noexcept;
-	StandardDriverStatus ReadLiveStatus() noexcept;
-	void SetStepDirection(bool) noexcept;
-	bool GetClosedLoopEnabled() noexcept;
+	void ControlLoop() noexcept;					// run one iteration of the control loop of every closed loop driver
+	void TakeStep(size_t driver) noexcept;
+	StandardDriverStatus ReadLiveStatus(size_t driver) noexcept;
+	void SetStepDirection(size_t driver, bool) noexcept;
+	bool GetClosedLoopEnabled(size_t driver) noexcept;
 	bool SetClosedLoopEnabled(size_t driver, bool enabled, const StringRef &reply) noexcept;
 	void DriverSwitchedToClosedLoop(size_t driver) noexcept;
 	void ResetError(size_t driver) noexcept;
 	StandardDriverStatus ModifyDriverStatus(size_t driver, StandardDriverStatus originalStatus) noexcept;
+	bool GetLayerShift(size_t driver, float& errorSteps, uint32_t& whenDetected) noexcept;	// return true once for each layer shift detected in open loop mode
+	float GetPositionError(size_t driver) noexcept;	// return the current position error in full steps, or zero if the driver has no encoder
+	bool IsCollectingData() noexcept;				// return true if a data collection requested by M569.5 is in progress
 
 	// Methods called by the encoders
 	void EnableEncodersSpi() noexcept;
 	void DisableEncodersSpi() noexcept;
 
-	// Methods used only by closed loop and by the tuning module
-	float PulsePerStepToExternalUnits(float pps, uint8_t encoderType) noexcept;
-	float ExternalUnitsToPulsePerStep(float externalUnits, uint8_t encoderType) noexcept;
-	void SetMotorPhase(uint16_t phase, float magnitude) noexcept;
-	void SetForwardPolarity() noexcept;
-	void SaveBasicTuningResult(float slope, float origin, float xMean, bool reverse) noexcept;
-	void FinishedBasicTuning() noexcept;			// call this when we have stopped basic tuning movement and are ready to switch to closed loop control
-	void AdjustTargetMotorSteps(float amount) noexcept;	// called by tuning to execute a step
-
-	// Methods in the tuning module
-	void PerformTune() noexcept;
+	// Type of the readings that the derivative filter works with
+#if CL_USE_FIXED_POINT
+	typedef int32_t ErrorReading;					// the derivative filter works in encoder counts
+#else
+	typedef float ErrorReading;						// the derivative filter works in full steps
+#endif
+
+	constexpr unsigned int derivativeFilterSize = 8;	// The range of the derivative filter (use a power of 2 for efficiency)
+
+	// Class to hold the state of the closed loop controller for one driver.
+	// The control loops of all drivers are run in turn from ClosedLoop::ControlLoop, so they all share the same fixed control loop rate.
+	// The data collection buffer is shared too, so only one driver at a time can collect data.
+	class Controller
+	{
+	public:
+		void Init(size_t p_driverNumber) noexcept;
+
+		GCodeResult ProcessM569Point1(CanMessageGenericParser& parser, const StringRef& reply) noexcept;
+		GCodeResult ProcessM569Point5(const CanMessageStartClosedLoopDataCollection& msg, const StringRef& reply) noexcept;
+		GCodeResult ProcessM569Point6(CanMessageGenericParser& parser, const StringRef& reply) noexcept;
+		GCodeResult StartFrequencyResponse(uint32_t frequencies, uint32_t amplitudeAndPoints, const StringRef& reply) noexcept;
+		void AppendFrequencyResponse(const StringRef& reply, unsigned int startIndex) const noexcept;
+		void Diagnostics(const StringRef& reply) noexcept;
+		unsigned int GetPredictedStalls(bool reset) noexcept { const unsigned int ret = numPredictedStalls; if (reset) { numPredictedStalls = 0; } return ret; }
+		bool GetLayerShift(float& errorSteps, uint32_t& whenDetected) noexcept;
+		float GetPositionError() const noexcept { return (encoder == nullptr) ? 0.0 : currentError; }
+
+		void RunControlLoop(StepTimer::Ticks loopCallTime) noexcept;
+		void TakeStep() noexcept;
+		StandardDriverStatus ReadLiveStatus() const noexcept;
+		void SetStepDirection(bool dir) noexcept { stepDirection = dir; }
+		bool GetClosedLoopEnabled() const noexcept { return closedLoopEnabled; }
+		bool SetClosedLoopEnabled(bool enabled, const StringRef &reply) noexcept;
+		void DriverSwitchedToClosedLoop() noexcept;
+		void ResetError() noexcept;
+		StandardDriverStatus ModifyDriverStatus(StandardDriverStatus originalStatus) const noexcept;
+		void ResetCurrentStatistics() noexcept;
+		void CollectSample() noexcept;
+		uint16_t BuildSampleRecipe(uint16_t filter) noexcept;
+
+	private:
+		enum class BasicTuningState : uint8_t { forwardInitial = 0, forwards, reverseInitial, reverse };
+
+		// Ways of estimating the rate of change of the position error, selected by the M569.1 O parameter
+		enum class ErrorObserverType : uint8_t { averagingFilter = 0, alphaBeta, kalman, numTypes };
+
+		struct TuningResults
+		{
+			float slope;
+			float origin;
+			float xMean;
+			float revisedOrigin;
+
+			// Calculate the revised origin based on a different slope, using the mid point of the move as the reference point
+			void CalcRevisedOrigin(float slopeToUse) noexcept
+			{
+				revisedOrigin = origin + (slope - slopeToUse) * xMean;
+			}
+
+			// Print the values - used for debugging only
+			void Print(const char *s, const StringRef& reply) const noexcept
+			{
+				reply.catf("%s: slope %.4f meanX %.1f origin %.2f revised origin %.2f\n", s, (double)slope, (double)xMean, (double)origin, (double)revisedOrigin);
+			}
+		};
+
+		EncoderType GetEncoderType() const noexcept { return (encoder == nullptr) ? EncoderType::none : encoder->GetType(); }
+		float PulsePerStepToExternalUnits(float pps, uint8_t encoderType) const noexcept;
+		float ExternalUnitsToPulsePerStep(float externalUnits, uint8_t encoderType) const noexcept;
+		void ReportTuningErrors(uint8_t tuningErrorBitmask, const StringRef& reply) const noexcept;
+		void ReadState() noexcept;
+		void SetMotorPhase(uint16_t phase, float magnitude) noexcept;
+		void SetMotorFinePhase(uint16_t finePhase, float magnitude) noexcept;
+		void SetMotorCurrents() noexcept;				// Send coilA and coilB to the driver
+		float GetLoadAdaptiveCurrentFraction(float absControlSignal, float absITerm) noexcept;
+		void ApplyFocCurrents(float torqueDemand, float timeDelta) noexcept;
+		void RecordCurrentFraction(float currentFraction) noexcept;
+		void ResetIntegralTerm() noexcept;
+		void UpdateErrorObserver() noexcept;
+		float GetErrorDerivative() const noexcept;
+		float GetFeedForward() noexcept;
+		void UpdateTargetFromMotion() noexcept;
+#if CL_USE_FIXED_POINT
+		void UpdateFixedPointParameters() noexcept;
+#endif
+		void ControlMotorCurrents(StepTimer::Ticks loopStartTime) noexcept;
+		void MonitorOpenLoopPosition() noexcept;
+		void StartTuning(uint8_t tuningMode) noexcept;
+		void SaveBasicTuningResult(float slope, float origin, float xMean, bool reverse) noexcept;
+		void FinishedBasicTuning() noexcept;			// call this when we have stopped basic tuning movement and are ready to switch to closed loop control
+		bool ReduceBasicTuningSpeed() noexcept;			// call this when basic tuning has finished moving, returns true if it needs to be repeated at a lower speed
+		uint32_t GetTuningConfigHash() const noexcept;
+		bool StoreBasicTuningResult() noexcept;
+		void CheckIndexPulse() noexcept;
+		void RestoreBasicTuningResult() noexcept;
+		void AdjustTargetMotorSteps(float amount) noexcept;	// called by tuning to execute a step
+		void SaveRelayTuningResult(float relayAmplitude, float oscillationAmplitude, float period) noexcept;
+		void AbandonBenchmark() noexcept;
+		void AppendBenchmarkResults(const StringRef& reply) const noexcept;
+
+		// Methods in the tuning module
+		void PerformTune() noexcept;
+		bool BasicTuning(bool firstIteration) noexcept;
+		bool EncoderCalibration(bool firstIteration) noexcept;
+		bool Step(bool firstIteration) noexcept;
+		bool ZieglerNichols(bool firstIteration) noexcept;
+
+		// Methods in the benchmark module
+		void SetSweep(float startFrequency, float endFrequency, float amplitude, size_t numPoints) noexcept;
+		void SetBenchmarkSweep() noexcept;
+		void StartBenchmark(uint8_t manoeuvres) noexcept;
+		void RunBenchmark(StepTimer::Ticks loopCallTime) noexcept;
+		bool BenchmarkStep(float t, float response, float& command) noexcept;
+		bool BenchmarkSineSweep(float t, float response, float& command) noexcept;
+		bool BenchmarkTrapezoid(float t, float response, float& command) noexcept;
+
+		size_t	driverNumber;							// The local driver number that this controller controls
+		Encoder *encoder = nullptr;						// Pointer to the encoder object in use
+		float	encoderPulsePerStep;					// How many encoder readings do we get per step?
+		float	recipEncoderPulsesPerStep;				// Reciprocal of the encoder pulses per step, to avoid FP division when calculating the error
+
+		// Control variables, set by the user to determine how the closed loop controller works
+		bool	closedLoopEnabled = false;				// Has closed loop been enabled by the user?
+		uint8_t	tuning = 0;								// Bitmask of any tuning manoeuvres that have been requested
+		uint8_t	tuningError;							// Flags for any tuning errors
+		uint8_t	prevTuningError;						// Used to see what errors have been introduced by tuning
+
+		// Holding current, and variables derived from it
+		float	holdCurrentFraction;					// The minimum holding current when stationary
+		float	recipHoldCurrentFraction;				// The reciprocal of the minimum holding current
+		float	holdCurrentFractionTimesMinPhaseShift;
+
+		// Load adaptive current control
+		float	loadCurrentMargin = 0.0;				// If nonzero, set the current to this multiple of the estimated torque demand instead of using the phase shift thresholds
+		float	loadEstimate = 0.0;						// The estimated torque demand as a fraction of the torque at full current
+
+		// Open loop position monitoring
+		float	monitorThreshold = 0.0;					// If nonzero, the position error in full steps that we report as a layer shift when running open loop
+		float	monitorReferenceSteps = 0.0;			// The target motor steps when the position was last reset, used to learn the encoder polarity
+		float	layerShiftError;						// The position error when we detected the last layer shift
+		uint32_t whenLayerShift;						// The millis() time at which we detected the last layer shift
+		StepTimer::Ticks whenMonitorDue = 0;			// When we next need to read the encoder in open loop mode
+		unsigned int numLayerShifts = 0;				// How many layer shifts we have detected, for diagnostics
+		bool	monitorPolarityKnown = false;			// True if we know the encoder polarity, either from tuning or from the first movement
+		bool	monitorReadingStarted = false;			// True if we have started an encoder reading for the next monitoring check
+		volatile bool layerShiftPending = false;		// True if we have detected a layer shift that we haven't reported yet
+
+		// Field oriented control
+		bool	focEnabled = false;						// True to set the d and q axis currents from the control signal instead of using the phase shift algorithm
+		float	currentKp = 0.0;						// Proportional gain of the d and q axis current loops, only used if we can measure the coil currents
+		float	currentKi = 0.0;						// Integral gain of the current loops, per second
+		float	idIntegral = 0.0;						// Integral term of the d axis current loop, as a fraction of full current
+		float	iqIntegral = 0.0;						// Integral term of the q axis current loop, as a fraction of full current
+
+		// Motor current statistics
+		uint64_t currentFractionSumQ16;					// Sum of the current fractions we used, in Q16 format
+		uint64_t currentFractionSquaredSumQ16;			// Sum of the squares of the current fractions, proportional to the energy dissipated in the motor windings
+		uint32_t numCurrentFractionsRecorded;
+
+		int32_t	reversePolarityMultiplier = 1;			// +1 if encoder direction is forwards, -1 if it is reverse
+
+		float	Kp = 100;								// The proportional constant for the PID controller
+		float	Ki = 0;									// The proportional constant for the PID controller
+		float	Kd = 0;									// The proportional constant for the PID controller
+		float	Kv = 0;									// The velocity feedforward constant, per full step per second
+		float	Ka = 0;									// The acceleration feedforward constant, per full step per second squared
+
+		float	errorThresholds[2];						// The error thresholds. [0] is pre-stall, [1] is stall
+
+		float	ultimateGain = 0;						// The ultimate gain of the controller (used for tuning)
+		float	oscillationPeriod = 0;					// The oscillation period when Kp = ultimate gain
+
+		// Working variables
+		// These variables are all used to calculate the required motor currents. They are declared here so they can be reported on by the data collection task
+		bool	stepDirection = true;					// The direction the motor is attempting to take steps in
+		float	targetMotorSteps;						// The number of steps the motor should have taken relative to it's zero position
+		float	lastMotionPosition = 0.0;				// The position of the move system when we last updated targetMotorSteps from it
+		float	currentMotionSpeed = 0.0;				// The speed of the current move in full steps per second when the control loop last ran
+		float	currentMotionAcceleration = 0.0;		// The acceleration of the current move in full steps per second squared when the control loop last ran
+		float	currentMotorSteps;						// The number of steps the motor has taken relative to it's zero position
+		int32_t	currentEncoderReading;					// The latest reading taken from the encoder, extrapolated to the time at which we read it
+		int32_t	targetEncoderReading;					// The encoder reading we want, calculated from targetMotorSteps
+		float	currentError;							// The current error
+		StepTimer::Ticks prevControlLoopCallTime;		// The last time the control loop was called
+
+		DerivativeAveragingFilter<derivativeFilterSize, ErrorReading> derivativeFilter;	// An averaging filter to smooth the derivative of the error
+		VelocityObserver<float> errorObserver;			// An observer that estimates the error and its derivative with less lag than the averaging filter
+		VelocityObserver<int32_t> encoderVelocityObserver;	// An observer that estimates the encoder speed, so that we can allow for the time since the encoder was sampled
+		StepTimer::Ticks maxEncoderLatency = 0;			// The longest time between sampling the encoder and using the reading that we compensated for
+		uint32_t numRejectedReadings = 0;				// How many encoder readings we replaced by the prediction because they were implausible, for diagnostics
+		uint8_t consecutiveRejectedReadings = 0;		// How many encoder readings in a row we have replaced by the prediction
+		ErrorObserverType errorObserverType = ErrorObserverType::averagingFilter;
+		float	errorObserverParameter = 0.0;			// The observer bandwidth in Hz, or the tracking index for the Kalman filter
+
+		float	PIDPTerm;								// Proportional term
+		float	PIDITerm = 0.0;							// Integral accumulator
+		float	PIDDTerm;								// Derivative term
+		float	PIDControlSignal;						// The overall signal from the PID controller
+		float	feedForwardTerm;						// The velocity and acceleration feedforward contribution to the control signal
+
+		float	phaseShift;								// The desired shift in the position of the motor, where 1024 = 1 full step
+
+#if CL_USE_FIXED_POINT
+		// Fixed point versions of the above and of the control parameters. The parameters are recalculated by UpdateFixedPointParameters whenever they change.
+		int32_t	PIDITermQ16 = 0;						// Integral accumulator
+		int32_t	phasePerEncoderCountQ16;				// Phase units (4096 = 4 full steps) per encoder count
+		int32_t	KpQ16;									// Kp per encoder count of error
+		int32_t	KiQ24;									// Ki per encoder count of error, multiplied by the nominal control loop period, in Q24 format for better resolution
+		int32_t	KdQ8;									// Kd per encoder count of error, divided by the nominal time spanned by the derivative filter, in Q8 format to avoid overflow
+		int32_t	holdCurrentFractionTimesMinPhaseShiftQ16;
+		int32_t	recipHoldCurrentFractionQ16;
+#endif
+
+		uint16_t measuredStepPhase;						// The measured position of the motor
+		uint16_t desiredStepPhase = 0;					// The desired position of the motor
+		uint16_t measuredFineStepPhase;					// The measured position of the motor with FinePhaseBits more resolution than measuredStepPhase
+		int16_t	coilA;									// The current to run through coil A
+		int16_t	coilB;									// The current to run through coil A
+#if SUPPORT_CL_CURRENT_SENSE
+		int16_t	measuredCoilA = 0;						// The measured current in coil A in mA
+		int16_t	measuredCoilB = 0;						// The measured current in coil B in mA
+#endif
+
+		bool	stall = false;							// Has the closed loop error threshold been exceeded?
+		bool	preStall = false;						// Has the closed loop warning threshold been exceeded, or is a stall predicted?
+		unsigned int saturatedLoops = 0;				// How many consecutive control loop iterations the control signal has been saturated with the error increasing
+		unsigned int numPredictedStalls = 0;			// How many times we have predicted a stall since the last diagnostics
+
+		// Tuning variables
+		TuningResults forwardTuningResults, reverseTuningResults;
+		float	measuredCountsPerStep;
+		float	tuningHysteresis;
+		bool	relayTuningResultPending = false;		// true if relay feedback tuning has finished and we haven't reported the result yet
+		bool	basicTuningResultToStore = false;		// true if basic tuning has succeeded and we haven't stored the result in NVM yet
+		bool	awaitingIndex = false;					// true if we have restored the basic tuning result of a relative encoder and need an index pulse to correct the zero position
+		float	indexPhaseCounts;						// when awaitingIndex is true, the encoder reading at the index modulo 4 full steps, from the stored tuning result
+		bool	newTuningMove = true;					// true if a tuning move has just finished, so the next call to a tuning function is its first iteration
+		unsigned int basicTuningStepsPerSecond;			// the rate at which basic tuning is taking steps
+		StepTimer::Ticks basicTuningStepTicks;			// the interval between basic tuning steps
+		StepTimer::Ticks whenLastTuningStepTaken;		// when the control loop last called the tuning code
+
+		// Working variables of the tuning manoeuvres. Only one manoeuvre runs at a time.
+		union
+		{
+			struct
+			{
+				BasicTuningState state;					// state machine control
+				uint16_t initialStepPhase;				// the step phase we started at
+				int32_t initialEncoderReading;			// this stores the reading at the start of a data collection phase
+				unsigned int stepCounter;				// a counter to use within a state
+				float regressionAccumulator;
+				float readingAccumulator;
+			} basic;
+			struct
+			{
+				int targetPosition;
+				int positionCounter;
+			} calibration;
+			struct
+			{
+				bool relayPositive;						// true if we are applying the positive control signal
+				unsigned int cyclesDone;				// how many complete oscillations we have seen
+				unsigned int iterations;				// how many times we have been called, for the timeout
+				StepTimer::Ticks whenCycleStarted;
+				StepTimer::Ticks totalPeriodTicks;
+				float minError, maxError;
+				float totalPeakToPeak;
+			} relay;
+		} tuningVars;
+
+		// Working variables of the benchmark manoeuvres. These run under PID control, so they can't share tuningVars with the tuning manoeuvres.
+		struct
+		{
+			volatile uint8_t pending;					// bitmap of the benchmark manoeuvres still to run, including the current one
+			uint8_t current;							// the manoeuvre that is running, or 0 if we haven't started the next one yet
+			uint8_t phase;								// the phase within the current manoeuvre
+			uint8_t freqIndex;							// for the sine sweep, the index of the current frequency
+			StepTimer::Ticks whenStarted;				// when the current manoeuvre started
+			float phaseStartTime;						// when the current phase started, in seconds since the start of the manoeuvre
+			float startPosition;						// the motor position when the manoeuvre started, in full steps
+			float commandedOffset;						// how far we have moved the target from where the move system wants it, in full steps
+			float peakResponse;
+			float riseStartTime, riseEndTime, lastOutsideBandTime;
+			float sumSin, sumCos, errorSumSin, errorSumCos, sumSquaredError, maxError;
+			unsigned int numSamples;
+		} benchmarkVars;
+
+		// Benchmark results
+		float	benchmarkRiseTime;						// step response 10% to 90% rise time in seconds, or negative if the motor didn't reach 90%
+		float	benchmarkOvershoot;						// step response overshoot in percent
+		float	benchmarkSettlingTime;					// step response time to settle within 5% of the step in seconds, or negative if it didn't settle
+		float	benchmarkBandwidth;						// the -3dB frequency in Hz, 0 if below the lowest frequency, negative if above the highest
+		float	benchmarkRmsError, benchmarkPeakError;	// trapezoid following errors in full steps
+		uint8_t	benchmarksDone = 0;						// bitmap of the manoeuvres that the results are for
+		bool	benchmarkResultPending = false;			// true if the benchmark manoeuvres have finished and we haven't reported the results yet
+
+		// Frequency response sweep, used by the sine sweep benchmark and by diagnostic test 223.
+		// The gains and phase lags are of the motor position and of the following error, each relative to the sine added to the target position.
+		struct SweepPoint
+		{
+			float frequency;							// Hz
+			float positionGain;
+			float positionPhaseLag;						// degrees
+			float errorGain;
+			float errorPhaseLag;						// degrees
+		};
+
+		float	sweepStartFrequency;
+		float	sweepEndFrequency;
+		float	sweepAmplitude;							// full steps
+		size_t	numSweepPoints = 0;
+		volatile size_t numSweepPointsDone = 0;
+		SweepPoint sweepPoints[MaxSweepPoints];
+
+#if BASIC_TUNING_DEBUG
+		int32_t originalRawEncoderReading = 0;
+		uint16_t originalDesiredStepPhase = 0, originalMeasuredStepPhase = 0;
+		float originalCurrentMotorSteps = 0.0;
+		float originalAssumedEncoderReading = 0.0, originalDesiredEncoderReading = 0.0;
+		int32_t offsetCorrectionMade = 0;
+		int32_t finalRawEncoderReading = 0;
+		uint16_t finalMeasuredStepPhase = 0;
+		float finalCurrentMotorSteps = 0.0;
+#endif
+
+		// The bitmask of a minimal tuning error for each encoder type
+		// This is an array so that ZEROING_MANOEUVRE can be removed from the magnetic encoders if the LUT is in NVM
+		uint8_t minimalTunes[5] =
+		{
+			// None
+			0,
+			// linearQuadrature
+			TUNE_ERR_NOT_DONE_BASIC,
+			// rotaryQuadrature
+			TUNE_ERR_NOT_DONE_BASIC,
+			// AS5047
+			TUNE_ERR_NOT_DONE_BASIC | TUNE_ERR_NOT_CALIBRATED,
+			// TLI5012
+			TUNE_ERR_NOT_DONE_BASIC | TUNE_ERR_NOT_CALIBRATED,
+		};
+	};
 }
 
 #  if defined(EXP1HCLv0_3) || defined(EXP1HCLv1_0)
@@ -0,0 +1,125 @@
+/*
+ * CurrentSense.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "CurrentSense.h"
+
+#if SUPPORT_CL_CURRENT_SENSE
+
+#include <hri_mclk_e54.h>
+
+static_assert(SAME5x, "Closed loop current sensing is only implemented for the SAME5x");
+
+namespace CurrentSense
+{
+	Adc * const CurrentSenseAdc = ADC1;
+	constexpr uint8_t StepTcMc1EventGenerator = EVSYS_ID_GEN_TC0_MC_1 + 3 * StepTcNumber;	// each TC has three event generators: overflow, MC0 and MC1
+
+	static volatile uint16_t rawCurrents[2];				// the latest readings of coils A and B
+	static uint16_t pendingCoilA;							// the reading of coil A while we convert coil B, so that rawCurrents always holds a matching pair
+	static volatile uint32_t numSamples = 0;				// incremented when we have a new pair of readings
+	static volatile bool convertingCoilB = false;
+	static uint32_t lastSamplesRead = 0;
+	static unsigned int numMissedSamples = 0;				// for diagnostics, how many times the control loop found no new readings
+
+	static void SelectInput(uint8_t input) noexcept
+	{
+		CurrentSenseAdc->INPUTCTRL.reg = ADC_INPUTCTRL_MUXPOS(input) | ADC_INPUTCTRL_MUXNEG_GND;
+		while (CurrentSenseAdc->SYNCBUSY.reg & ADC_SYNCBUSY_INPUTCTRL) { }
+	}
+}
+
+void CurrentSense::Init() noexcept
+{
+	for (Pin p : CurrentSensePins)
+	{
+		SetPinFunction(p, GpioPinFunction::B);			// the analog function
+	}
+
+	MCLK->APBDMASK.reg |= MCLK_APBDMASK_ADC1;
+	hri_gclk_write_PCHCTRL_reg(GCLK, ADC1_GCLK_ID, GCLK_PCHCTRL_GEN(GclkNum60MHz) | GCLK_PCHCTRL_CHEN);
+
+	CurrentSenseAdc->CTRLA.reg = ADC_CTRLA_SWRST;
+	while (CurrentSenseAdc->SYNCBUSY.reg & ADC_SYNCBUSY_SWRST) { }
+
+	CurrentSenseAdc->CTRLA.reg = ADC_CTRLA_PRESCALER_DIV4;		// 15MHz ADC clock, so each conversion takes about 1us
+	CurrentSenseAdc->REFCTRL.reg = ADC_REFCTRL_REFSEL_INTVCC1;	// VDDANA, which is the supply to the current sense amplifiers
+	CurrentSenseAdc->CTRLB.reg = ADC_CTRLB_RESSEL_12BIT;
+	CurrentSenseAdc->SAMPCTRL.reg = ADC_SAMPCTRL_SAMPLEN(3);
+	while (CurrentSenseAdc->SYNCBUSY.reg & (ADC_SYNCBUSY_REFCTRL | ADC_SYNCBUSY_CTRLB | ADC_SYNCBUSY_SAMPCTRL)) { }
+	SelectInput(CurrentSenseAdcInputs[0]);
+	CurrentSenseAdc->EVCTRL.reg = ADC_EVCTRL_STARTEI;			// start a conversion when we get an event
+	CurrentSenseAdc->INTENSET.reg = ADC_INTENSET_RESRDY;
+	NVIC_SetPriority(ADC1_1_IRQn, NvicPriorityAdc);
+	NVIC_EnableIRQ(ADC1_1_IRQn);
+	CurrentSenseAdc->CTRLA.reg |= ADC_CTRLA_ENABLE;
+	while (CurrentSenseAdc->SYNCBUSY.reg & ADC_SYNCBUSY_ENABLE) { }
+
+	// Route the MC1 compare event of the step timer to the ADC start input. StepTimer enables the event output.
+	MCLK->APBBMASK.reg |= MCLK_APBBMASK_EVSYS;
+	EVSYS->Channel[CurrentSenseEventChannel].CHANNEL.reg = EVSYS_CHANNEL_EVGEN(StepTcMc1EventGenerator) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+	EVSYS->USER[EVSYS_ID_USER_ADC1_START].reg = EVSYS_USER_CHANNEL(CurrentSenseEventChannel + 1);
+}
+
+// Set the time at which the next pair of conversions starts. If the time has already passed, we miss this sample and the control loop uses the previous readings.
+void CurrentSense::ScheduleSample(StepTimer::Ticks when) noexcept
+{
+	StepTc->CC[1].reg = when;
+	while (StepTc->SYNCBUSY.reg & TC_SYNCBUSY_CC1) { }
+}
+
+bool CurrentSense::GetCurrents(int16_t& coilA, int16_t& coilB) noexcept
+{
+	uint16_t a, b;
+	uint32_t samples;
+	{
+		AtomicCriticalSectionLocker lock;
+		a = rawCurrents[0];
+		b = rawCurrents[1];
+		samples = numSamples;
+	}
+	coilA = (int16_t)lrintf((float)((int32_t)a - (int32_t)CurrentSenseZeroReading) * CurrentSenseMilliampsPerCount);
+	coilB = (int16_t)lrintf((float)((int32_t)b - (int32_t)CurrentSenseZeroReading) * CurrentSenseMilliampsPerCount);
+	const bool isNew = (samples != lastSamplesRead);
+	if (!isNew)
+	{
+		++numMissedSamples;
+	}
+	lastSamplesRead = samples;
+	return isNew;
+}
+
+void CurrentSense::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Current sense samples %" PRIu32 ", missed %u", numSamples, numMissedSamples);
+	numMissedSamples = 0;
+}
+
+// ADC result ready interrupt. The event starts the conversion of coil A, then we start the conversion of coil B from here.
+extern "C" void ADC1_1_Handler() noexcept
+{
+	using namespace CurrentSense;
+	const uint16_t result = CurrentSenseAdc->RESULT.reg;		// reading the result clears the interrupt
+	if (convertingCoilB)
+	{
+		rawCurrents[0] = pendingCoilA;
+		rawCurrents[1] = result;
+		convertingCoilB = false;
+		SelectInput(CurrentSenseAdcInputs[0]);					// ready for the next event
+		++numSamples;
+	}
+	else
+	{
+		pendingCoilA = result;
+		convertingCoilB = true;
+		SelectInput(CurrentSenseAdcInputs[1]);
+		CurrentSenseAdc->SWTRIG.reg = ADC_SWTRIG_START;
+	}
+}
+
+#endif
+
+// End
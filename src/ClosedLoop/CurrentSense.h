@@ -0,0 +1,31 @@
+/*
+ * CurrentSense.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_CLOSEDLOOP_CURRENTSENSE_H_
+#define SRC_CLOSEDLOOP_CURRENTSENSE_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_CL_CURRENT_SENSE
+
+#include <Movement/StepTimer.h>
+
+// Measurement of the coil currents of the closed loop driver using the ADC that the board reserves for this purpose.
+// A compare match on the step timer starts the conversion of coil A through the event system, so that the currents are sampled at a fixed point in the
+// control loop period without any software jitter. The ADC result interrupt then chains the conversion of coil B. The control loop reads the pair of results
+// from the previous sample time. We don't regulate the currents from these readings yet; they are available for data collection as the measured coil currents.
+namespace CurrentSense
+{
+	void Init() noexcept;
+	void ScheduleSample(StepTimer::Ticks when) noexcept;		// set the step timer time at which the next pair of conversions starts
+	bool GetCurrents(int16_t& coilA, int16_t& coilB) noexcept;	// get the latest currents in mA, returning true if they are new since the last call
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif
+
+#endif /* SRC_CLOSEDLOOP_CURRENTSENSE_H_ */
@@ -9,21 +9,24 @@
 #define SRC_DERIVATIVEAVERAGINGFILTER_H_
 
 #include "RepRapFirmware.h"
+#include <type_traits>
 
 // Class that takes in readings and timestamps
 // and outputs the current derivative
 // n should be a power of 2 for best efficiency
-template<size_t N> class DerivativeAveragingFilter
+// T is the type of the readings. If it is an integral type then the filter only records the change in reading and timestamp over the last N readings,
+// so that the caller can calculate the derivative in fixed point arithmetic.
+template<size_t N, typename T = float> class DerivativeAveragingFilter
 {
 public:
 	DerivativeAveragingFilter() noexcept { Reset(); }
 
-	void Reset() noexcept { valid = false; index = 0; derivative = 0.0; }
+	void Reset() noexcept { valid = false; index = 0; derivative = 0.0; readingDelta = 0; timestampDelta = 0; }
 
 	// Call this to put a new reading into the filter
-	void ProcessReading(float reading, uint32_t timestamp) noexcept
+	void ProcessReading(T reading, uint32_t timestamp) noexcept
 	{
-		const float prevReading = readings[index];
+		const T prevReading = readings[index];
 		const uint32_t prevTimestamp = timestamps[index];
 
 		readings[index] = reading;
@@ -31,9 +34,12 @@ public:
 
 		if (valid)
 		{
-			const float readingDelta = reading - prevReading;
-			const uint32_t timestampDelta = timestamp - prevTimestamp;
-			derivative = readingDelta * (float)StepTimer::StepClockRate / (float)timestampDelta;
+			readingDelta = reading - prevReading;
+			timestampDelta = timestamp - prevTimestamp;
+			if constexpr (std::is_floating_point<T>::value)
+			{
+				derivative = readingDelta * (float)StepTimer::StepClockRate / (float)timestampDelta;
+			}
 		}
 
 		index = (index + 1) % N;
@@ -45,13 +51,17 @@ public:
 
 	bool IsValid() const volatile noexcept { return valid; }
 	static constexpr size_t NumValues() noexcept { return N; }
-	float GetDerivative() const noexcept { return derivative; }
+	float GetDerivative() const noexcept { return derivative; }		// only valid if T is a floating point type
+	T GetReadingDelta() const noexcept { return readingDelta; }		// the change in reading over the last N readings, or 0 if not yet valid
+	uint32_t GetTimestampDelta() const noexcept { return timestampDelta; }
 
 private:
 	bool valid;
 	size_t index;
 	float derivative;
-	float readings[N];
+	T readingDelta;
+	uint32_t timestampDelta;
+	T readings[N];
 	uint32_t timestamps[N];
 };
 
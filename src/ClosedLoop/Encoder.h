@@ -13,6 +13,7 @@
 #if SUPPORT_CLOSED_LOOP
 
 #include <GCodeResult.h>
+#include <Movement/StepTimer.h>
 
 NamedEnum(EncoderPositioningType, uint8_t, absolute, relative);
 
@@ -40,11 +41,52 @@ public:
 	// Get the current reading
 	virtual int32_t GetReading() noexcept = 0;
 
+	// Start reading the encoder in the background so that the next call to GetReading from the same task need not wait for it. Encoders that can't do this ignore it.
+	virtual void StartReading() noexcept { }
+
 	// Get diagnostic information and append it to a string
 	virtual void AppendDiagnostics(const StringRef& reply) noexcept = 0;
 
 	// Append brief encoder status as a string
 	virtual void AppendStatus(const StringRef& reply) noexcept = 0;
+
+	// Get the step clock time at which the position returned by the last call to GetReading was sampled
+	StepTimer::Ticks GetLastSampleTime() const noexcept { return lastSampleTime; }
+
+	// Return true if the last call to GetReading failed to read the encoder, in which case it returned the previous reading
+	bool LastReadFailed() const noexcept { return lastReadFailed; }
+
+	// Append the communication error statistics to a string and reset them
+	void AppendReadStatistics(const StringRef& reply) noexcept
+	{
+		reply.catf(", encoder reads %" PRIu32 " failed %" PRIu32 " recovered by retry %" PRIu32, numReads, numFailedReads, numRetriedReads);
+		numReads = numFailedReads = numRetriedReads = 0;
+	}
+
+protected:
+	void RecordSampleTime(StepTimer::Ticks when) noexcept { lastSampleTime = when; }
+
+	// Record the outcome of a reading for the error statistics
+	void RecordReadResult(bool failed, bool retried) noexcept
+	{
+		++numReads;
+		lastReadFailed = failed;
+		if (failed)
+		{
+			++numFailedReads;
+		}
+		else if (retried)
+		{
+			++numRetriedReads;
+		}
+	}
+
+private:
+	StepTimer::Ticks lastSampleTime = 0;
+	uint32_t numReads = 0;
+	uint32_t numFailedReads = 0;							// readings that were still bad after the retry
+	uint32_t numRetriedReads = 0;							// readings that were bad the first time but good when retried
+	bool lastReadFailed = false;
 };
 
 #endif
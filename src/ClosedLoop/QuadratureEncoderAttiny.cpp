@@ -105,6 +105,7 @@ void QuadratureEncoderAttiny::Disable() noexcept
 int32_t QuadratureEncoderAttiny::GetReading() noexcept
 {
 	// Read the TCC register
+	RecordSampleTime(StepTimer::GetTimerTicks());				// the read command captures the count
 	QuadratureTcc->CTRLBSET.reg = TCC_CTRLBSET_CMD_READSYNC;
 	// On the EXP3HC board it wasn't enough just to wait for SYNCBUSY.COUNT here in similar code for the step timer
 	while (QuadratureTcc->CTRLBSET.bit.CMD != 0) { }
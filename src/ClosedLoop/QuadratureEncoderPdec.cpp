@@ -13,6 +13,11 @@
 #include <hri_mclk_e54.h>
 #include <cmath>
 
+static void IndexInterruptEntry(CallbackParameter p) noexcept
+{
+	static_cast<QuadratureEncoderPdec*>(p.vp)->IndexInterrupt();
+}
+
 // Overridden virtual functions
 
 // Initialise the encoder and enable it if successful. If there are any warnings or errors, put the corresponding message text in 'reply'.
@@ -26,10 +31,8 @@ GCodeResult QuadratureEncoderPdec::Init(const StringRef& reply) noexcept
 	PDEC->CTRLA.bit.SWRST = 1;
 	while (PDEC->SYNCBUSY.bit.SWRST) { }
 
-	for (Pin p : PositionDecoderPins)
-	{
-		SetPinFunction(p, PositionDecoderPinFunction);
-	}
+	SetPinFunction(PositionDecoderPins[0], PositionDecoderPinFunction);
+	SetPinFunction(PositionDecoderPins[1], PositionDecoderPinFunction);
 
 	// Set count per rev = 0
 	uint32_t ctrla = PDEC_CTRLA_MODE_QDEC | PDEC_CTRLA_CONF_X4
@@ -37,6 +40,16 @@ GCodeResult QuadratureEncoderPdec::Init(const StringRef& reply) noexcept
 					| PDEC_CTRLA_ANGULAR(7);
 	PDEC->CTRLA.reg = ctrla;
 
+	// If the PDEC handled the index input it would reset the count, which would upset our extension of the count to 32 bits.
+	// So we use a pin interrupt on the index input instead and record the count when it occurs.
+	indexSeen = false;
+	pinMode(PositionDecoderPins[2], INPUT_PULLUP);
+	if (!attachInterrupt(PositionDecoderPins[2], IndexInterruptEntry, InterruptMode::rising, CallbackParameter(this)))
+	{
+		reply.copy("Failed to attach encoder index interrupt");
+		return GCodeResult::warning;
+	}
+
 	// There's little if anything we can do to test the encoder
 	Enable();
 	return GCodeResult::ok;
@@ -57,6 +70,7 @@ void QuadratureEncoderPdec::Disable() noexcept
 	while (PDEC->SYNCBUSY.bit.CTRLB) { }
 	PDEC->CTRLA.bit.ENABLE = 0;
 	while (PDEC->SYNCBUSY.bit.ENABLE) { }
+	detachInterrupt(PositionDecoderPins[2]);
 }
 
 void QuadratureEncoderPdec::AppendDiagnostics(const StringRef &reply) noexcept
@@ -78,6 +92,7 @@ void QuadratureEncoderPdec::AppendStatus(const StringRef& reply) noexcept
 // Get the current position relative to the starting position
 int32_t QuadratureEncoderPdec::GetRelativePosition(bool& error) noexcept
 {
+	RecordSampleTime(StepTimer::GetTimerTicks());				// the read command captures the count
 	PDEC->CTRLBSET.reg = PDEC_CTRLBSET_CMD_READSYNC;
 	while (PDEC->SYNCBUSY.reg & (PDEC_SYNCBUSY_CTRLB | PDEC_SYNCBUSY_COUNT)) { }
 	const uint16_t count = PDEC->COUNT.reg;
@@ -100,6 +115,19 @@ int32_t QuadratureEncoderPdec::GetRelativePosition(bool& error) noexcept
 	return (int32_t)((counterHigh << 16) | count);
 }
 
+// Return the reading at the most recent index pulse.
+// The index pulse occurs once per revolution, so the count won't have changed by more than 32767 since then unless the encoder has more than 32768 counts per revolution.
+bool QuadratureEncoderPdec::GetIndexReading(int32_t& reading) noexcept
+{
+	if (!indexSeen)
+	{
+		return false;
+	}
+	const int32_t currentReading = GetReading();				// this sets lastCount to the low 16 bits of the current count
+	reading = currentReading + (int16_t)(indexCount - lastCount);
+	return true;
+}
+
 // End of overridden virtual functions
 
 // Set the position to the 32 bit signed value 'position'
@@ -123,4 +151,13 @@ void QuadratureEncoderPdec::SetPosition(int32_t position) noexcept
 	}
 }
 
+// Record the count when we see an index pulse
+void QuadratureEncoderPdec::IndexInterrupt() noexcept
+{
+	PDEC->CTRLBSET.reg = PDEC_CTRLBSET_CMD_READSYNC;
+	while (PDEC->SYNCBUSY.reg & (PDEC_SYNCBUSY_CTRLB | PDEC_SYNCBUSY_COUNT)) { }
+	indexCount = PDEC->COUNT.reg;
+	indexSeen = true;
+}
+
 #endif	// SUPPORT_CLOSED_LOOP
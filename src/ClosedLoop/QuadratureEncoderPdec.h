@@ -21,7 +21,7 @@ public:
 	void* operator new(size_t sz) noexcept { return FreelistManager::Allocate<QuadratureEncoderPdec>(); }
 	void operator delete(void* p) noexcept { FreelistManager::Release<QuadratureEncoderPdec>(p); }
 
-	inline QuadratureEncoderPdec() noexcept : RelativeEncoder(), lastCount(0), counterHigh(0) {}
+	inline QuadratureEncoderPdec() noexcept : RelativeEncoder(), lastCount(0), counterHigh(0), indexCount(0), indexSeen(false) {}
 	inline ~QuadratureEncoderPdec() { Disable(); }
 
 	EncoderType GetType() const noexcept override { return EncoderType::rotaryQuadrature; }
@@ -30,6 +30,10 @@ public:
 	void Disable() noexcept override;				// Disable the decoder. Call this during initialisation. Can also be called later if necessary.
 	void AppendDiagnostics(const StringRef& reply) noexcept override;
 	void AppendStatus(const StringRef& reply) noexcept override;
+	bool HasIndex() const noexcept override { return true; }
+	bool GetIndexReading(int32_t& reading) noexcept override;
+
+	void IndexInterrupt() noexcept;					// called by the ISR for the index input
 
 protected:
 	// Get the current position relative to the starting position
@@ -41,6 +45,8 @@ private:
 
 	uint16_t lastCount;
 	uint32_t counterHigh;
+	volatile uint16_t indexCount;					// the low 16 bits of the count when we last saw an index pulse
+	volatile bool indexSeen;
 };
 
 #endif
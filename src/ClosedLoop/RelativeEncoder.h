@@ -38,6 +38,10 @@ public:
 	// Constants
 	EncoderPositioningType GetPositioningType() const noexcept override { return EncoderPositioningType::relative; }
 
+	// Index pulse support. If the encoder has seen an index pulse, return true and set 'reading' to what GetReading returned when the most recent one occurred.
+	virtual bool HasIndex() const noexcept { return false; }
+	virtual bool GetIndexReading(int32_t& reading) noexcept { return false; }
+
 protected:
 	// Get the relative position since the start
 	virtual int32_t GetRelativePosition(bool& error) noexcept = 0;
@@ -36,6 +36,8 @@ void TLI5012B::Disable() noexcept
 uint32_t TLI5012B::GetAbsolutePosition(bool& error) noexcept
 {
 	//TODO
+	RecordSampleTime(StepTimer::GetTimerTicks());
+	error = false;
 	return 0;
 }
 
@@ -33,7 +33,30 @@ namespace Trigonometry
 	static_assert(lookupTable[0] == 0.0);
 	static_assert(lookupTable[Resolution] == 248.0);
 
+	// Fine phase values have this many extra bits of resolution, so that 65536 corresponds to 2*pi
+	constexpr unsigned int FinePhaseBits = 4;
+	constexpr unsigned int FinePhasesPerEntry = 1u << FinePhaseBits;
+
+	// The same table in integer form, scaled by 128 so that we can interpolate between entries without losing resolution
+	constexpr unsigned int IntegerTableShift = 7;
+	static constexpr std::array<uint16_t, Resolution + 1> integerLookupTable = [] () noexcept
+	{
+		std::array<uint16_t, Resolution + 1> LUT = {};
+
+		for (unsigned int i = 0; i <= Resolution; ++i)
+		{
+			LUT[i] = (uint16_t)(248.0 * (1u << IntegerTableShift) * sinf(((float)i/Resolution) * (Pi / 2.0)) + 0.5);
+		}
+
+		return LUT;
+	}();
+
+	static_assert(integerLookupTable[0] == 0);
+	static_assert(integerLookupTable[Resolution] == 248u << IntegerTableShift);
+
 	void FastSinCos(uint16_t phase, float& sine, float& cosine) noexcept;
+	void FastSinCosFine(uint16_t finePhase, float& sine, float& cosine) noexcept;
+	void FastSinCosFine(uint16_t finePhase, uint32_t magnitudeQ16, int16_t& sine, int16_t& cosine) noexcept;
 }
 
 // Calculate 248 * the sine and cosine of the phase value passed, where phase is between 0 and 4095, and 4096 would correspond to 2*pi
@@ -69,4 +92,73 @@ post(fabsf(sin) <= 248.0; fabsf(cosine) <= 248.0)
 	}
 }
 
+// Calculate 248 * the sine and cosine of the fine phase value passed, where 65536 would correspond to 2*pi, interpolating between table entries
+inline void Trigonometry::FastSinCosFine(uint16_t finePhase, float& sine, float& cosine) noexcept
+post(fabsf(sin) <= 248.0; fabsf(cosine) <= 248.0)
+{
+	const unsigned int phase = finePhase >> FinePhaseBits;
+	const unsigned int quadrant = (phase / Resolution) & 3;
+	const unsigned int index = phase % Resolution;
+	const float fraction = (float)(finePhase & (FinePhasesPerEntry - 1)) * (1.0/FinePhasesPerEntry);
+
+	// r1 is the sine of the phase within the quadrant and r2 is the cosine. Index + 1 never exceeds Resolution.
+	const float r1 = lookupTable[index] + (lookupTable[index + 1] - lookupTable[index]) * fraction;
+	const float r2 = lookupTable[Resolution - index] - (lookupTable[Resolution - index] - lookupTable[Resolution - index - 1]) * fraction;
+	switch (quadrant) {
+	case 0:
+		sine = r1;
+		cosine = r2;
+		break;
+	case 1:
+		sine = r2;
+		cosine = -r1;
+		break;
+	case 2:
+		sine = -r1;
+		cosine = -r2;
+		break;
+	case 3:
+		sine = -r2;
+		cosine = r1;
+		break;
+	}
+}
+
+// Calculate the sine and cosine of the fine phase value passed in TMC XDIRECT register units, i.e. 248 * magnitude * sin/cos rounded to the nearest integer.
+// The magnitude is in Q16 format and must not exceed 1.0. No floating point arithmetic is used.
+inline void Trigonometry::FastSinCosFine(uint16_t finePhase, uint32_t magnitudeQ16, int16_t& sine, int16_t& cosine) noexcept
+pre(magnitudeQ16 <= 65536)
+post(abs(sine) <= 248; abs(cosine) <= 248)
+{
+	const unsigned int phase = finePhase >> FinePhaseBits;
+	const unsigned int quadrant = (phase / Resolution) & 3;
+	const unsigned int index = phase % Resolution;
+	const uint32_t fraction = finePhase & (FinePhasesPerEntry - 1);
+
+	// Interpolate, giving values scaled by 128, then apply the magnitude. The maximum product is 31744 * 65536 which fits in 32 bits.
+	constexpr unsigned int TotalShift = IntegerTableShift + 16;
+	const uint32_t s1 = integerLookupTable[index] + (((integerLookupTable[index + 1] - integerLookupTable[index]) * fraction) >> FinePhaseBits);
+	const uint32_t c1 = integerLookupTable[Resolution - index] - (((integerLookupTable[Resolution - index] - integerLookupTable[Resolution - index - 1]) * fraction) >> FinePhaseBits);
+	const int16_t r1 = (int16_t)((s1 * magnitudeQ16 + (1u << (TotalShift - 1))) >> TotalShift);
+	const int16_t r2 = (int16_t)((c1 * magnitudeQ16 + (1u << (TotalShift - 1))) >> TotalShift);
+	switch (quadrant) {
+	case 0:
+		sine = r1;
+		cosine = r2;
+		break;
+	case 1:
+		sine = r2;
+		cosine = -r1;
+		break;
+	case 2:
+		sine = -r1;
+		cosine = -r2;
+		break;
+	case 3:
+		sine = -r2;
+		cosine = r1;
+		break;
+	}
+}
+
 #endif /* SRC_CLOSEDLOOP_TRIGONOMETRY_H_ */
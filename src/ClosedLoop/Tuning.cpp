@@ -21,7 +21,10 @@
  * the iteration was it's last. It will also be supplied with an argument representing
  * if this is it's first iteration.
  *
- * At the bottom of the file, ClosedLoop::PerformTune() is implemented to take advantage
+ * The functions are members of ClosedLoop::Controller and their working variables are in its
+ * tuningVars member, so that each closed loop driver can be tuned independently.
+ *
+ * At the bottom of the file, ClosedLoop::Controller::PerformTune() is implemented to take advantage
  * of these function
  */
 
@@ -69,19 +72,17 @@
  *   (sigma(i=0..N-1): yi*(i - (N-1)/2))) / (p*(N^3-N)/12)
  */
 
-static bool BasicTuning(bool firstIteration) noexcept
+bool ClosedLoop::Controller::BasicTuning(bool firstIteration) noexcept
 {
-	enum class BasicTuningState { forwardInitial = 0, forwards, reverseInitial, reverse };
-
-	static BasicTuningState state;									// state machine control
-	static uint16_t initialStepPhase;								// the step phase we started at
-	static int32_t initialEncoderReading;							// this stores the reading at the start of a data collection phase
-	static unsigned int stepCounter;								// a counter to use within a state
-	static float regressionAccumulator;
-	static float readingAccumulator;
+	BasicTuningState& state = tuningVars.basic.state;				// state machine control
+	uint16_t& initialStepPhase = tuningVars.basic.initialStepPhase;	// the step phase we started at
+	int32_t& initialEncoderReading = tuningVars.basic.initialEncoderReading;	// this stores the reading at the start of a data collection phase
+	unsigned int& stepCounter = tuningVars.basic.stepCounter;		// a counter to use within a state
+	float& regressionAccumulator = tuningVars.basic.regressionAccumulator;
+	float& readingAccumulator = tuningVars.basic.readingAccumulator;
 
 	constexpr unsigned int NumDummySteps = 8;						// how many steps to take before we start collecting data
-	constexpr uint16_t PhaseIncrement = 8;							// how much to increment the phase by on each step, must be a factor of 4096
+	constexpr uint16_t PhaseIncrement = BasicTuningPhaseIncrement;	// how much to increment the phase by on each step, must be a factor of 4096
 	static_assert(4096 % PhaseIncrement == 0);
 	constexpr unsigned int NumSamples = 4096/PhaseIncrement;		// the number of samples we take to d the linear regression
 	constexpr float HalfNumSamplesMinusOne = (float)(NumSamples - 1) * 0.5;
@@ -91,21 +92,21 @@ static bool BasicTuning(bool firstIteration) noexcept
 	{
 		state = BasicTuningState::forwardInitial;
 		stepCounter = 0;
-		ClosedLoop::SetForwardPolarity();
+		reversePolarityMultiplier = 1;
 	}
 
 	switch (state)
 	{
 	case BasicTuningState::forwardInitial:
 		// In this state we move forwards a few microsteps to allow the motor to settle down
-		ClosedLoop::desiredStepPhase += PhaseIncrement;
-		ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
+		desiredStepPhase += PhaseIncrement;
+		SetMotorPhase(desiredStepPhase, 1.0);
 		++stepCounter;
 		if (stepCounter == NumDummySteps)
 		{
 			regressionAccumulator = readingAccumulator = 0.0;
 			stepCounter = 0;
-			initialStepPhase = ClosedLoop::desiredStepPhase;
+			initialStepPhase = desiredStepPhase;
 			state = BasicTuningState::forwards;
 		}
 		break;
@@ -113,7 +114,7 @@ static bool BasicTuning(bool firstIteration) noexcept
 	case BasicTuningState::forwards:
 		// Collect data and move forwards, until we have moved 4 full steps
 		{
-			const int32_t reading = ClosedLoop::encoder->GetReading();
+			const int32_t reading = encoder->GetReading();
 			if (stepCounter == 0)
 			{
 				initialEncoderReading = reading;			// to reduce rounding error, get rid of any large constant offset when accumulating
@@ -129,29 +130,29 @@ static bool BasicTuning(bool firstIteration) noexcept
 			const float slope = regressionAccumulator / Denominator;
 			const float xMean = (float)initialStepPhase + (float)PhaseIncrement * HalfNumSamplesMinusOne;
 			const float origin = yMean - slope * xMean;
-			ClosedLoop::SaveBasicTuningResult(slope, origin, xMean, false);
+			SaveBasicTuningResult(slope, origin, xMean, false);
 
 			stepCounter = 0;
 			state = BasicTuningState::reverseInitial;
 		}
 		else
 		{
-			ClosedLoop::desiredStepPhase += PhaseIncrement;
-			ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
+			desiredStepPhase += PhaseIncrement;
+			SetMotorPhase(desiredStepPhase, 1.0);
 			++stepCounter;
 		}
 		break;
 
 	case BasicTuningState::reverseInitial:
 		// In this state we move backwards a few microsteps to allow the motor to settle down
-		ClosedLoop::desiredStepPhase -= PhaseIncrement;
-		ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
+		desiredStepPhase -= PhaseIncrement;
+		SetMotorPhase(desiredStepPhase, 1.0);
 		++stepCounter;
 		if (stepCounter == NumDummySteps)
 		{
 			regressionAccumulator = readingAccumulator = 0.0;
 			stepCounter = 0;
-			initialStepPhase = ClosedLoop::desiredStepPhase;
+			initialStepPhase = desiredStepPhase;
 			state = BasicTuningState::reverse;
 		}
 		break;
@@ -159,7 +160,7 @@ static bool BasicTuning(bool firstIteration) noexcept
 	case BasicTuningState::reverse:
 		// Collect data and move backwards, until we have moved 4 full steps
 		{
-			const int32_t reading = ClosedLoop::encoder->GetReading();
+			const int32_t reading = encoder->GetReading();
 			if (stepCounter == 0)
 			{
 				initialEncoderReading = reading;			// to reduce rounding error, get rid of any large constant offset when accumulating
@@ -175,14 +176,21 @@ static bool BasicTuning(bool firstIteration) noexcept
 			const float slope = regressionAccumulator / (-Denominator);			// negate the denominator because the phase increment was negative this time
 			const float xMean = (float)initialStepPhase - (float)PhaseIncrement * HalfNumSamplesMinusOne;
 			const float origin = yMean - slope * xMean;
-			ClosedLoop::SaveBasicTuningResult(slope, origin, xMean, true);
-			ClosedLoop::FinishedBasicTuning();									// call this when we have stopped and are ready to switch to closed loop control
+			SaveBasicTuningResult(slope, origin, xMean, true);
+			if (ReduceBasicTuningSpeed())
+			{
+				// The motor didn't keep up, so repeat the manoeuvre more slowly
+				stepCounter = 0;
+				state = BasicTuningState::forwardInitial;
+				break;
+			}
+			FinishedBasicTuning();									// call this when we have stopped and are ready to switch to closed loop control
 			return true;														// finished tuning
 		}
 		else
 		{
-			ClosedLoop::desiredStepPhase -= PhaseIncrement;
-			ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1.0);
+			desiredStepPhase -= PhaseIncrement;
+			SetMotorPhase(desiredStepPhase, 1.0);
 			++stepCounter;
 		}
 		break;
@@ -202,30 +210,30 @@ static bool BasicTuning(bool firstIteration) noexcept
  * 	- Store this reading in the encoder LUT
  */
 
-static bool EncoderCalibration(bool firstIteration) noexcept
+bool ClosedLoop::Controller::EncoderCalibration(bool firstIteration) noexcept
 {
-	static int targetPosition;
-	static int positionCounter;
+	int& targetPosition = tuningVars.calibration.targetPosition;
+	int& positionCounter = tuningVars.calibration.positionCounter;
 
-	if (ClosedLoop::encoder->GetPositioningType() == EncoderPositioningType::relative)
+	if (encoder->GetPositioningType() == EncoderPositioningType::relative)
 	{
 		return true;			// we don't do this tuning for relative encoders
 	}
 
-	AS5047D* absoluteEncoder = (AS5047D*) ClosedLoop::encoder;
+	AS5047D* absoluteEncoder = (AS5047D*) encoder;
 	if (firstIteration) {
 		absoluteEncoder->ClearLUT();
 		targetPosition = 0;
 		positionCounter = 0;
 	}
 
-	if (ClosedLoop::currentEncoderReading < targetPosition) {
+	if (currentEncoderReading < targetPosition) {
 		positionCounter += 1;
-	} else if (ClosedLoop::currentEncoderReading > targetPosition) {
+	} else if (currentEncoderReading > targetPosition) {
 		positionCounter -= 1;
 	} else {
-		const float realWorldPos = absoluteEncoder->GetMaxValue() * positionCounter / (1024 * (360.0 / ClosedLoop::PulsePerStepToExternalUnits(ClosedLoop::encoderPulsePerStep, EncoderType::AS5047)));
-		absoluteEncoder->StoreLUTValueForPosition(ClosedLoop::currentEncoderReading, realWorldPos);
+		const float realWorldPos = absoluteEncoder->GetMaxValue() * positionCounter / (1024 * (360.0 / PulsePerStepToExternalUnits(encoderPulsePerStep, EncoderType::AS5047)));
+		absoluteEncoder->StoreLUTValueForPosition(currentEncoderReading, realWorldPos);
 		targetPosition += absoluteEncoder->GetLUTResolution();
 	}
 
@@ -235,8 +243,8 @@ static bool EncoderCalibration(bool firstIteration) noexcept
 		return true;
 	}
 
-	ClosedLoop::desiredStepPhase = (positionCounter > 0 ? 0 : 4096) + positionCounter % 4096;
-	ClosedLoop::SetMotorPhase(ClosedLoop::desiredStepPhase, 1);
+	desiredStepPhase = (positionCounter > 0 ? 0 : 4096) + positionCounter % 4096;
+	SetMotorPhase(desiredStepPhase, 1);
 	return false;
 }
 
@@ -270,9 +278,9 @@ static bool ContinuousPhaseIncrease(bool firstIteration) noexcept
  *
  */
 
-static bool Step(bool firstIteration) noexcept
+bool ClosedLoop::Controller::Step(bool firstIteration) noexcept
 {
-	ClosedLoop::AdjustTargetMotorSteps(4.0);
+	AdjustTargetMotorSteps(4.0);
 	return true;
 }
 
@@ -283,159 +291,97 @@ static bool Step(bool firstIteration) noexcept
  *
  * Absolute:
  * Relative:
- *  - TODO!
+ *  - Replace the PID controller by a relay with a little hysteresis, i.e. apply a fixed positive control signal when the motor is behind the
+ *    target position and a fixed negative one when it is ahead. This makes the motor oscillate about the target position.
+ *  - Ignore the first few cycles while the oscillation builds up, then measure the amplitude and period of the next few
+ *  - The ultimate gain is 4 * relay amplitude/(pi * oscillation amplitude) and the ultimate period is the oscillation period.
+ *    The ClosedLoop module calculates suggested PID parameters from these.
  *
+ *  This is called at the tuning step rate, so the phase shift we apply is relative to the measured phase at the start of each tuning step.
  */
 
-#if 1
-// TODO: Implement ziegler-Nichols move
-
-#else
-static bool ZieglerNichols(bool firstIteration) noexcept
+bool ClosedLoop::Controller::ZieglerNichols(bool firstIteration) noexcept
 {
+	bool& relayPositive = tuningVars.relay.relayPositive;			// true if we are applying the positive control signal
+	unsigned int& cyclesDone = tuningVars.relay.cyclesDone;			// how many complete oscillations we have seen
+	unsigned int& iterations = tuningVars.relay.iterations;			// how many times we have been called, for the timeout
+	StepTimer::Ticks& whenCycleStarted = tuningVars.relay.whenCycleStarted;
+	StepTimer::Ticks& totalPeriodTicks = tuningVars.relay.totalPeriodTicks;
+	float& minError = tuningVars.relay.minError;
+	float& maxError = tuningVars.relay.maxError;
+	float& totalPeakToPeak = tuningVars.relay.totalPeakToPeak;
+
+	constexpr float RelayAmplitude = 64.0;							// the control signal we apply, in the same units as the PID control signal
+	constexpr float RelayHysteresis = 0.02;							// in full steps, to stop encoder noise switching the relay
+	constexpr unsigned int CyclesToIgnore = 3;
+	constexpr unsigned int CyclesToMeasure = 5;
+	constexpr unsigned int MaxIterations = 5 * 2000;				// about 5 seconds at the tuning step rate
+
+	const float error = currentError;
+	if (firstIteration)
+	{
+		relayPositive = (error >= 0.0);
+		cyclesDone = iterations = 0;
+		minError = maxError = error;
+		totalPeakToPeak = 0.0;
+		totalPeriodTicks = 0;
+		whenCycleStarted = StepTimer::GetTimerTicks();
+	}
 
-	// We will need to restore these afterwards...
-	const float prevKp = Kp;
-	const float prevKi = Ki;
-	const float prevKd = Kd;
-
-	// Reset the PID controller
-	Ki = 0;
-	Kd = 0;
-	Kp = 0;
-	PIDITerm = 0;
-
-	ultimateGain = 0;		// Reset the ultimate gain value
-	int direction = 1;		// Which direction are we moving in
-
-	float lowerBound = 0;
-	float upperBound = 10000;
-
-	while (upperBound - lowerBound > 100) {
-
-		Kp = lowerBound + (upperBound - lowerBound) / 2;
-
-		targetMotorSteps = currentMotorSteps + (direction * 10);
-
-		// Flip the direction
-		direction = -direction;
-
-		unsigned int initialRiseTime = 0;		// The time it takes to initially meet the target
-
-		float peakError = 0;			// The peak of the current oscillation
-		float prevPeakError = 0;		// The peak of the previous oscillation
-		unsigned int prevTimestamp = 0;			// The previous time of oscillation
-
-		unsigned int oscillationCount = 0;		// The number of oscillations that have occurred
-
-		float ewmaDecayFraction = 0;	// An EWMA of the decay fraction of oscillations
-		float ewmaOscillationPeriod = 0;// An EWMA of the oscillation period
-
-		// Run up to a maximum of 4096
-		for (unsigned int time=0; time<16384; time++) {
-			TaskBase::Take(10);		// TODO: Use delayuntil here? And run at PID frequency
-
-			ControlMotorCurrents();
-
-			float currentPosition = direction * currentMotorSteps;
-			float targetPosition = direction * targetMotorSteps;
-			float error = abs(currentPosition - targetPosition);
-
-			// Search for the initial rise time
-			if (initialRiseTime == 0) {
-				if (currentPosition > targetPosition) {
-					initialRiseTime = time;
-				} else {
-					continue;
-				}
-			}
-
-			// Wait another two initial rise times for oscillations to occur
-			if (time < 3 * initialRiseTime) {continue;}
-
-			// We're now in the prime time for oscillations - check if they are actually happening:
-
-			// Record data if we are above the target
-			if (currentPosition > targetPosition) {
-				peakError = max<float>(peakError, error);
-				continue;
-			}
-			// Process data if we have just crossed the target
-			float decayFraction;
-			if (peakError > 0) {
-				if (prevPeakError > 0) {
-					decayFraction = peakError / prevPeakError;
-					ewmaDecayFraction =
-							ewmaDecayFraction == 0
-							? decayFraction
-							: 0.7 * ewmaDecayFraction + 0.3 * decayFraction;
-					if (oscillationCount > 5) {
-						ewmaOscillationPeriod =
-								ewmaOscillationPeriod == 0
-								? (time - prevTimestamp)
-								: 0.3 * ewmaOscillationPeriod + 0.7 * (time - prevTimestamp);
-					}
-				}
-				oscillationCount++;
-				prevPeakError = peakError;
-				peakError = 0;
-				prevTimestamp = time;
-			}
-
-			PIDPTerm = ewmaOscillationPeriod;
-			PIDDTerm = (time - prevTimestamp);
-
-			// Wait for at least 5 oscillations
-			if (oscillationCount < 5) {
-				continue;
-			}
-
-			// Check that the next 5 oscillations all keep the average decay fraction above 98%
-			if (ewmaDecayFraction < 0.98) {
-				// No oscillations, this is the new lower bound.
-				lowerBound = Kp;
-				break;
-			}
-			if (oscillationCount >= 10) {
-				// Oscillations found! This is the new upper bound.
-				upperBound = Kp;
-				oscillationPeriod = ewmaOscillationPeriod;
-				break;
-			}
+	minError = min<float>(minError, error);
+	maxError = max<float>(maxError, error);
 
-			// If we time out of this loop, assume no oscillations
-			if (time == 16383) {
-				lowerBound = Kp;
+	if (relayPositive && error < -RelayHysteresis)
+	{
+		relayPositive = false;
+	}
+	else if (!relayPositive && error > RelayHysteresis)
+	{
+		// Switching the relay to positive marks the start of a new cycle
+		relayPositive = true;
+		const StepTimer::Ticks now = StepTimer::GetTimerTicks();
+		++cyclesDone;
+		if (cyclesDone > CyclesToIgnore)
+		{
+			totalPeriodTicks += now - whenCycleStarted;
+			totalPeakToPeak += maxError - minError;
+			if (cyclesDone == CyclesToIgnore + CyclesToMeasure)
+			{
+				SaveRelayTuningResult(RelayAmplitude, totalPeakToPeak * (0.5/CyclesToMeasure), (float)totalPeriodTicks/(float)(CyclesToMeasure * StepTimer::StepClockRate));
+				return true;
 			}
-
 		}
+		whenCycleStarted = now;
+		minError = maxError = error;
 	}
 
-	ultimateGain = upperBound;
-	Kp = prevKp;
-	Ki = prevKi;
-	Kd = prevKd;
+	if (++iterations >= MaxIterations)
+	{
+		tuningError |= TUNE_ERR_INCONSISTENT_MOTION;		// we didn't get a steady oscillation
+		return true;
+	}
 
-	tuning &= ~ZIEGLER_NICHOLS_MANOEUVRE;
+	// Apply full current with the phase shift that the relay control signal corresponds to, see ClosedLoop::Controller::ControlMotorCurrents
+	constexpr int32_t RelayPhaseShift = (int32_t)(RelayAmplitude * 4.0);
+	desiredStepPhase = (uint16_t)(((int32_t)measuredStepPhase + ((relayPositive) ? RelayPhaseShift : -RelayPhaseShift)) & 4095);
+	SetMotorPhase(desiredStepPhase, 1.0);
+	return false;
 }
-#endif
 
 
 /*
- * ClosedLoop::PerformTune()
- * -------------------------
+ * ClosedLoop::Controller::PerformTune()
+ * -------------------------------------
  *
  * Makes use of the above tuning functions.
  *
  */
 
 // This is called from every iteration of the closed loop control loop if tuning is enabled
-void ClosedLoop::PerformTune() noexcept
+void ClosedLoop::Controller::PerformTune() noexcept
 {
-	static bool newTuningMove = true;						// indicates if a tuning move has just finished
-
 	// Check we are in direct drive mode and we have an encoder
-	if (SmartDrivers::GetDriverMode(0) != DriverMode::direct || encoder == nullptr ) {
+	if (SmartDrivers::GetDriverMode(driverNumber) != DriverMode::direct || encoder == nullptr ) {
 		tuningError |= TUNE_ERR_SYSTEM_ERROR;
 		tuning = 0;
 		return;
@@ -461,14 +407,14 @@ void ClosedLoop::PerformTune() noexcept
 		if (newTuningMove) {
 			tuning = 0;
 		}
-#if 0	// not implemented
-	} else if (tuning & CONTINUOUS_PHASE_INCREASE_MANOEUVRE) {
-		newTuningMove = ContinuousPhaseIncrease(newTuningMove);
+	} else if (tuning & ZIEGLER_NICHOLS_MANOEUVRE) {
+		newTuningMove = ZieglerNichols(newTuningMove);
 		if (newTuningMove) {
 			tuning = 0;
 		}
-	} else if (tuning & ZIEGLER_NICHOLS_MANOEUVRE) {
-		newTuningMove = ZieglerNichols(newTuningMove);
+#if 0	// not implemented
+	} else if (tuning & CONTINUOUS_PHASE_INCREASE_MANOEUVRE) {
+		newTuningMove = ContinuousPhaseIncrease(newTuningMove);
 		if (newTuningMove) {
 			tuning = 0;
 		}
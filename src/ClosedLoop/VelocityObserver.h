@@ -0,0 +1,89 @@
+/*
+ * VelocityObserver.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_CLOSEDLOOP_VELOCITYOBSERVER_H_
+#define SRC_CLOSEDLOOP_VELOCITYOBSERVER_H_
+
+#include "RepRapFirmware.h"
+#include <Movement/StepTimer.h>
+
+// Class that takes in readings and timestamps and estimates the position and velocity using an alpha-beta observer.
+// Unlike DerivativeAveragingFilter, the velocity estimate is updated from every reading, so it has much less lag for the same amount of noise.
+// The gains can be set either from the required bandwidth (both observer poles at the same frequency) or from the ratio of process noise to measurement noise,
+// in which case the observer is a steady state Kalman filter for a constant acceleration model.
+// T is the type of the readings. The estimates are always floating point.
+template<typename T = float> class VelocityObserver
+{
+public:
+	VelocityObserver() noexcept { SetGains(1.0, 0.0, 1); Reset(); }
+
+	void Reset() noexcept { valid = false; position = velocity = 0.0; }
+
+	// Set the gains for the specified bandwidth in Hz, given the nominal interval between readings
+	void SetBandwidth(float bandwidth, uint32_t nominalInterval) noexcept
+	{
+		const float p = expf(-2.0 * Pi * bandwidth * (float)nominalInterval * (1.0/(float)StepTimer::StepClockRate));
+		SetGains(1.0 - fsquare(p), fsquare(1.0 - p), nominalInterval);
+	}
+
+	// Set the gains for the steady state Kalman filter. The tracking index is the ratio of the process noise (acceleration noise * interval squared) to the measurement noise.
+	void SetTrackingIndex(float trackingIndex, uint32_t nominalInterval) noexcept
+	{
+		const float r = (4.0 + trackingIndex - sqrtf(trackingIndex * (8.0 + trackingIndex))) * 0.25;
+		const float alpha = 1.0 - fsquare(r);
+		SetGains(alpha, 2.0 * (2.0 - alpha) - 4.0 * sqrtf(1.0 - alpha), nominalInterval);
+	}
+
+	// Call this to put a new reading into the filter
+	void ProcessReading(T reading, uint32_t timestamp) noexcept
+	{
+		if (!valid)
+		{
+			position = (float)reading;
+			velocity = 0.0;
+			valid = true;
+		}
+		else
+		{
+			// Predict the new position from the previous estimates, then correct both estimates using the difference between the predicted and measured positions.
+			// In the normal case that the interval is the nominal one we use the precomputed gain to avoid a division.
+			const uint32_t interval = timestamp - prevTimestamp;
+			const float dt = (float)interval * (1.0/(float)StepTimer::StepClockRate);
+			const float residual = (float)reading - (position + velocity * dt);
+			position += velocity * dt + alpha * residual;
+			velocity += ((interval == nominalInterval) ? betaOverNominalInterval : (interval == 0) ? 0.0 : beta/dt) * residual;
+		}
+		prevTimestamp = timestamp;
+	}
+
+	bool IsValid() const volatile noexcept { return valid; }
+	float GetPosition() const noexcept { return position; }			// the estimated reading
+	float GetVelocity() const noexcept { return velocity; }			// the estimated rate of change of reading per second
+
+	// Predict the reading at the specified time from the current estimates
+	float Predict(uint32_t timestamp) const noexcept { return position + velocity * (float)(int32_t)(timestamp - prevTimestamp) * (1.0/(float)StepTimer::StepClockRate); }
+
+private:
+	void SetGains(float a, float b, uint32_t p_nominalInterval) noexcept
+	{
+		alpha = a;
+		beta = b;
+		nominalInterval = p_nominalInterval;
+		betaOverNominalInterval = b * (float)StepTimer::StepClockRate/(float)p_nominalInterval;
+	}
+
+	bool valid;
+	float position;
+	float velocity;
+	float alpha;
+	float beta;
+	float betaOverNominalInterval;
+	uint32_t nominalInterval;
+	uint32_t prevTimestamp;
+};
+
+#endif /* SRC_CLOSEDLOOP_VELOCITYOBSERVER_H_ */
@@ -7,17 +7,31 @@
 
 #include "AccelerometerHandler.h"
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 
 #include <RTOSIface/RTOSIface.h>
-#include <Hardware/LIS3DH.h>
+#include <Hardware/Accelerometer.h>
+#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+# include <Hardware/LIS3DH.h>
+#endif
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+# include <Hardware/ADXL345.h>
+#endif
 #include <CanMessageFormats.h>
 #include <Platform.h>
 #include <TaskPriorities.h>
+#include <PriorityProfiles.h>
 #include <CanMessageBuffer.h>
 #include <CAN/CanInterface.h>
 #include <CanMessageGenericParser.h>
 #include <CanMessageGenericTables.h>
+#include <Movement/StepTimer.h>
+#include "AccelerometerSpectrum.h"
+#include "VibrationMonitor.h"
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+#endif
 
 #define TEST_PACKING	0
 
@@ -25,9 +39,30 @@ constexpr uint16_t DefaultSamplingRate = 1000;
 constexpr uint8_t DefaultResolution = 10;
 
 constexpr size_t AccelerometerTaskStackWords = 130;
+
+constexpr uint32_t MinVibrationWindowMillis = 100;
+constexpr uint32_t MaxVibrationWindowMillis = 60000;
+
+// In compressed mode the first sample in each packet is sent in full and the subsequent ones are sent as zig-zag encoded differences from the previous sample.
+// The zero field in the message is set to 1 to indicate compressed mode. The packet data starts with a 5-bit field giving the width W of the differences,
+// followed by the first sample at the normal resolution for each axis, followed by W bits for each axis for each subsequent sample. W is chosen per packet.
+constexpr unsigned int CompressionWidthBits = 5;
+constexpr unsigned int MaxCompressedSamplesPerPacket = 32;
+
+// When data collection is triggered, each packet starts with the master step clock time of its first sample, so that the main board can line up the samples with the motion
+constexpr size_t TimestampWords = 2;
+constexpr uint32_t MaxTriggerWaitMillis = 10000;			// how long we wait for the trigger before we start sending data anyway
+
+enum class TriggerMode : uint8_t
+{
+	immediate = 0,											// start sending data as soon as the start request is received
+	moveStart,												// start sending data from the start of the next move
+	masterTime												// start sending data from the specified master step clock time
+};
+
 static Task<AccelerometerTaskStackWords> *accelerometerTask;
 
-static LIS3DH *accelerometer = nullptr;
+static Accelerometer *accelerometer = nullptr;
 
 static uint16_t samplingRate = DefaultSamplingRate;
 static volatile uint32_t numSamplesRequested;
@@ -39,6 +74,151 @@ static volatile bool successfulStart = false;
 static volatile bool failedStart = false;
 static uint8_t axisLookup[3];								// mapping from each Cartesian axis to the corresponding accelerometer axis
 static bool axisInverted[3];
+static bool compressData = false;
+static AccelerometerSpectrum *spectrum = nullptr;			// created when spectrum analysis mode is first selected
+static VibrationMonitor *vibrationMonitor = nullptr;		// created when vibration monitoring is first enabled
+static volatile bool monitoring = false;					// true if we collect data for the vibration monitor when we are not doing a capture
+static volatile bool monitorFailed = false;
+static volatile bool monitorActive = false;					// true while the task is collecting data for the vibration monitor
+static int16_t latestSample[3];								// the most recent sample collected for the vibration monitor, used by the data capture module
+static bool analyseData = false;
+static TriggerMode triggerMode = TriggerMode::immediate;
+static uint32_t triggerMasterTime = 0;
+static uint32_t triggerLocalTime;
+static uint32_t triggerWaitStartedAt;
+static bool waitingForTrigger = false;
+static int16_t compressedSamples[MaxCompressedSamplesPerPacket][3];	// the samples in the compressed packet we are building, sign-extended
+
+// Class to pack values of up to 17 bits into the data words of a CAN message, least significant bits first
+class BitPacker
+{
+public:
+	explicit BitPacker(uint16_t *p_data) noexcept : data(p_data), index(0), pending(0), bitsUsed(0) { }
+
+	void Put(uint32_t val, unsigned int width) noexcept
+	{
+		pending |= val << bitsUsed;
+		bitsUsed += width;
+		while (bitsUsed >= 16)
+		{
+			data[index++] = (uint16_t)pending;
+			pending >>= 16;
+			bitsUsed -= 16;
+		}
+	}
+
+	// Store any pending bits and return the number of data words used
+	size_t Flush() noexcept
+	{
+		if (bitsUsed != 0)
+		{
+			data[index++] = (uint16_t)pending;
+			pending = 0;
+			bitsUsed = 0;
+		}
+		return index;
+	}
+
+	// Start a new packet in the same buffer
+	void Reset() noexcept
+	{
+		index = 0;
+		pending = 0;
+		bitsUsed = 0;
+	}
+
+private:
+	uint16_t *data;
+	size_t index;
+	uint32_t pending;
+	unsigned int bitsUsed;
+};
+
+static inline uint32_t ZigZag(int32_t val) noexcept
+{
+	return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+
+// Return the number of bits needed to represent an unsigned value
+static inline unsigned int BitsNeeded(uint32_t val) noexcept
+{
+	return (val == 0) ? 0 : 32 - __builtin_clz(val);
+}
+
+// How to extract the requested axes from the accelerometer data. This is set up when we start collecting, so that the per-sample code doesn't need
+// to test which axes are requested or whether they are inverted.
+struct PackingPlan
+{
+	unsigned int numChannels;								// the number of axes requested
+	unsigned int resolutionShift;							// 16 - resolution
+	uint8_t cartesianAxis[3];								// the Cartesian axis of each channel, in the order they are sent
+	uint8_t sourceIndex[3];									// the index of each channel in the accelerometer data
+	uint16_t invertMask[3];									// 0xFFFF if the channel is inverted, else 0
+};
+
+static PackingPlan plan;
+
+static void SetupPackingPlan(uint8_t axes) noexcept
+{
+	plan.numChannels = 0;
+	plan.resolutionShift = 16u - resolution;
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		if (axes & (1u << axis))
+		{
+			plan.cartesianAxis[plan.numChannels] = axis;
+			plan.sourceIndex[plan.numChannels] = axisLookup[axis];
+			plan.invertMask[plan.numChannels] = (axisInverted[axis]) ? 0xFFFF : 0;
+			++plan.numChannels;
+		}
+	}
+}
+
+// Get the value of one channel from the accelerometer data, adjusted for orientation and resolution.
+// Inverting is done without a branch. We add 1 to the one's complement to negate the value except for 0x8000, which would overflow and is saturated to 0x7FFF instead.
+static inline uint16_t GetChannelValue(const uint16_t *data, unsigned int channel) noexcept
+{
+	const uint16_t dataVal = data[plan.sourceIndex[channel]];
+	const uint16_t mask = plan.invertMask[channel];
+	const uint16_t adjustedVal = (dataVal ^ mask) + (mask & (uint16_t)(dataVal != 0x8000));
+	return adjustedVal >> plan.resolutionShift;				// data from the accelerometer is left justified
+}
+
+// Get the values of the requested axes from the accelerometer data, sign-extended
+static void GetSignedSample(const uint16_t *data, int16_t sample[3]) noexcept
+{
+	sample[0] = sample[1] = sample[2] = 0;
+	for (unsigned int channel = 0; channel < plan.numChannels; ++channel)
+	{
+		sample[plan.cartesianAxis[channel]] = (int16_t)(GetChannelValue(data, channel) << plan.resolutionShift) >> plan.resolutionShift;
+	}
+}
+
+// Pack a block of samples into a raw data packet. This is instantiated for each number of axes so that the inner loop is unrolled.
+template<unsigned int NumChannels> static void PackRawSamples(const uint16_t *data, unsigned int numSamples, BitPacker& packer) noexcept
+{
+	const unsigned int width = 16u - plan.resolutionShift;
+#if TEST_PACKING
+	static uint16_t pattern = 0;
+	const uint32_t patternMask = (1u << width) - 1;
+#endif
+	while (numSamples != 0)
+	{
+		for (unsigned int channel = 0; channel < NumChannels; ++channel)
+		{
+#if TEST_PACKING
+			packer.Put(pattern++ & patternMask, width);
+#else
+			packer.Put(GetChannelValue(data, channel), width);
+#endif
+		}
+		data += 3;
+		--numSamples;
+	}
+}
+
+typedef void (*RawPackingFunction)(const uint16_t *data, unsigned int numSamples, BitPacker& packer) noexcept;
+static constexpr RawPackingFunction RawPackingFunctions[3] = { PackRawSamples<1>, PackRawSamples<2>, PackRawSamples<3> };
 
 static uint8_t TranslateAxes(uint8_t axes) noexcept
 {
@@ -53,11 +233,138 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 	return rslt;
 }
 
+// Get the trigger time in local step clocks, returning false if it isn't known yet
+static bool GetTriggerTime(uint32_t& triggerTime) noexcept
+{
+	if (triggerMode == TriggerMode::masterTime)
+	{
+		triggerTime = triggerLocalTime;
+		return true;
+	}
+#if SUPPORT_DRIVERS
+	return moveInstance->GetCapturedMoveStartTime(triggerTime);
+#else
+	return false;
+#endif
+}
+
+// Get the data length of a message when we can't use GetActualDataLength, because the data is compressed or starts with a timestamp
+static size_t GetDataLength(const CanMessageAccelerometerData& msg, size_t wordsUsed) noexcept
+{
+	return (reinterpret_cast<const uint8_t*>(msg.data) - reinterpret_cast<const uint8_t*>(&msg)) + wordsUsed * sizeof(msg.data[0]);
+}
+
+// Store a timestamp in the first words of the message data
+static void SetTimestamp(CanMessageAccelerometerData& msg, uint32_t localTime) noexcept
+{
+	const uint32_t masterTime = StepTimer::ConvertToMasterTime(localTime);
+	msg.data[0] = (uint16_t)masterTime;
+	msg.data[1] = (uint16_t)(masterTime >> 16);
+}
+
+// Pack the samples in compressedSamples into the message and send it
+static void SendCompressedPacket(CanMessageBuffer& buf, CanMessageAccelerometerData& msg, unsigned int numSamples, unsigned int deltaWidth,
+									unsigned int firstSampleNumber, uint16_t dataRate, bool overflowed, bool lastPacket,
+									size_t timestampWords, uint32_t packetStartTime) noexcept
+{
+	if (timestampWords != 0)
+	{
+		SetTimestamp(msg, packetStartTime);
+	}
+	BitPacker packer(msg.data + timestampWords);
+	packer.Put(deltaWidth, CompressionWidthBits);
+	const uint32_t resolutionMask = (1u << resolution) - 1;
+	for (unsigned int channel = 0; channel < plan.numChannels; ++channel)
+	{
+		packer.Put((uint32_t)compressedSamples[0][plan.cartesianAxis[channel]] & resolutionMask, resolution);
+	}
+	if (deltaWidth != 0)
+	{
+		for (unsigned int i = 1; i < numSamples; ++i)
+		{
+			for (unsigned int channel = 0; channel < plan.numChannels; ++channel)
+			{
+				const unsigned int axis = plan.cartesianAxis[channel];
+				packer.Put(ZigZag((int32_t)compressedSamples[i][axis] - (int32_t)compressedSamples[i - 1][axis]), deltaWidth);
+			}
+		}
+	}
+	const size_t wordsUsed = packer.Flush() + timestampWords;
+
+	msg.firstSampleNumber = firstSampleNumber;
+	msg.numSamples = numSamples;
+	msg.actualSampleRate = dataRate;
+	msg.overflowed = overflowed;
+	msg.lastPacket = lastPacket;
+	msg.zero = 1;											// flag compressed data
+
+	buf.dataLength = GetDataLength(msg, wordsUsed);
+	CanInterface::SendBulk(&buf);
+}
+
+// Collect data continuously for the vibration monitor until monitoring is turned off or a capture is requested
+static void MonitorVibration() noexcept
+{
+	monitorActive = true;
+	SetupPackingPlan(0x07);
+	vibrationMonitor->Start();
+	if (!accelerometer->StartCollecting(TranslateAxes(0x07)))
+	{
+		accelerometer->StopCollecting();
+		monitoring = false;
+		monitorFailed = true;
+		monitorActive = false;
+		return;
+	}
+
+	bool discardedFirstSample = false;
+	while (monitoring && !running)
+	{
+		uint16_t dataRate;
+		const uint16_t *data;
+		bool overflowed;
+		unsigned int samplesRead = accelerometer->CollectData(&data, dataRate, overflowed);
+		if (!discardedFirstSample && samplesRead != 0)
+		{
+			// The first sample taken after waking up is inaccurate, so discard it
+			--samplesRead;
+			data += 3;
+			discardedFirstSample = true;
+		}
+#if SUPPORT_DRIVERS
+		const bool moving = (moveInstance->GetRingOccupancy() != 0);
+#else
+		const bool moving = true;								// we can't tell whether the machine is moving, so use all the samples
+#endif
+		while (samplesRead != 0)
+		{
+			int16_t sample[3];
+			GetSignedSample(data, sample);
+			vibrationMonitor->AddSample(sample, moving);
+			{
+				TaskCriticalSectionLocker lock;
+				memcpy(latestSample, sample, sizeof(latestSample));
+			}
+			data += 3;
+			--samplesRead;
+		}
+	}
+	accelerometer->StopCollecting();
+	monitorActive = false;
+}
+
 [[noreturn]] void AccelerometerTaskCode(void*) noexcept
 {
 	for (;;)
 	{
-		TaskBase::Take();
+		if (!running && !monitoring)
+		{
+			TaskBase::Take();
+		}
+		if (!running && monitoring)
+		{
+			MonitorVibration();
+		}
 		if (running)
 		{
 			// Collect and send the samples
@@ -65,17 +372,29 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 			CanMessageAccelerometerData& msg = *(buf.SetupStatusMessage<CanMessageAccelerometerData>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress()));
 			const unsigned int MaxSamplesInBuffer = msg.SetAxesAndResolution(axesRequested, resolution);
 
+			// If we are triggered then we reserve space for a timestamp at the start of each packet, which reduces the number of samples that fit
+			const size_t timestampWords = (triggerMode == TriggerMode::immediate) ? 0 : TimestampWords;
+			const unsigned int numAxes = __builtin_popcount(axesRequested);
+			const unsigned int maxPacketBits = MaxSamplesInBuffer * numAxes * resolution - 16 * timestampWords;
+			const unsigned int maxRawSamples = maxPacketBits/(numAxes * resolution);
+			const uint32_t ticksPerSample = StepTimer::StepClockRate/samplingRate;
+			const unsigned int fifoInterruptLevel = accelerometer->GetFifoInterruptLevel();
+
 			unsigned int samplesSent = 0;
 			unsigned int samplesInBuffer = 0;
 			unsigned int samplesWanted = numSamplesRequested;
-			size_t canDataIndex = 0;
-			unsigned int bitsUsed = 0;
-			uint16_t bitsPending = 0;
+			BitPacker rawPacker(msg.data + timestampWords);		// used only in raw mode
+			SetupPackingPlan(axesRequested);
+			const RawPackingFunction packRawSamples = RawPackingFunctions[numAxes - 1];
 			bool overflowed = false;
+			bool discardedFirstSample = false;
+			uint32_t packetStartTime = 0;							// the local step clock time of the first sample in the packet we are building
+			unsigned int deltaWidth = 0;							// used only in compressed mode
 
-#if TEST_PACKING
-			uint16_t pattern = 0;
-#endif
+			if (analyseData)
+			{
+				spectrum->Start(axesRequested);
+			}
 			if (accelerometer->StartCollecting(TranslateAxes(axesRequested)))
 			{
 				successfulStart = true;
@@ -84,88 +403,183 @@ static uint8_t TranslateAxes(uint8_t axes) noexcept
 					uint16_t dataRate;
 					const uint16_t *data;
 					unsigned int samplesRead = accelerometer->CollectData(&data, dataRate, overflowed);
-					if (samplesSent + samplesInBuffer == 0 && samplesRead != 0)
+
+					// Estimate the time at which a sample in this block was taken from the time of the watermark interrupt
+					const uint16_t * const blockStart = data;
+					const uint32_t blockTime = accelerometer->GetLastBlockTime();
+					auto sampleTime = [blockStart, blockTime, ticksPerSample, fifoInterruptLevel](const uint16_t *p) noexcept -> uint32_t
+										{
+											return blockTime + ((int32_t)((p - blockStart)/3) - (int32_t)(fifoInterruptLevel - 1)) * (int32_t)ticksPerSample;
+										};
+
+					if (!discardedFirstSample && samplesRead != 0)
 					{
 						// The first sample taken after waking up is inaccurate, so discard it
 						--samplesRead;
 						data += 3;
+						discardedFirstSample = true;
+					}
+
+					// If we are waiting for the trigger, discard the samples taken before it
+					if (waitingForTrigger)
+					{
+						uint32_t triggerTime;
+						if (GetTriggerTime(triggerTime))
+						{
+							while (samplesRead != 0 && (int32_t)(sampleTime(data) - triggerTime) < 0)
+							{
+								--samplesRead;
+								data += 3;
+							}
+							waitingForTrigger = (samplesRead == 0);
+						}
+						else if (millis() - triggerWaitStartedAt >= MaxTriggerWaitMillis)
+						{
+							waitingForTrigger = false;						// give up waiting, the timestamps will tell the main board when the samples were taken
+						}
+						else
+						{
+							samplesRead = 0;
+						}
+
+						if (waitingForTrigger)
+						{
+							overflowed = false;
+						}
 					}
 					if (samplesRead >= samplesWanted)
 					{
 						samplesRead = samplesWanted;
 					}
 
-					while (samplesRead != 0)
+					if (analyseData)
 					{
-						unsigned int samplesToCopy = min<unsigned int>(samplesRead, MaxSamplesInBuffer - samplesInBuffer);
-						while (samplesToCopy != 0)
+						// Analyse the data here and send just an empty packet at the end to tell the main board that we have finished. It fetches the results separately.
+						while (samplesRead != 0)
 						{
-							// Extract the required bits from the data and pack them into the CAN buffer
-							for (unsigned int axis = 0; axis < 3; ++axis)
+							if (samplesSent == 0)
+							{
+								packetStartTime = sampleTime(data);
+							}
+							int16_t sample[3];
+							GetSignedSample(data, sample);
+							spectrum->AddSample(sample);
+							data += 3;
+							--samplesRead;
+							++samplesSent;
+							--samplesWanted;
+						}
+						if (samplesWanted == 0)
+						{
+							msg.firstSampleNumber = samplesSent;
+							msg.numSamples = 0;
+							msg.actualSampleRate = dataRate;
+							msg.overflowed = overflowed;
+							msg.lastPacket = true;
+							msg.zero = 0;
+							if (timestampWords != 0)
+							{
+								SetTimestamp(msg, packetStartTime);			// the time of the first sample analysed
+								buf.dataLength = GetDataLength(msg, timestampWords);
+							}
+							else
+							{
+								buf.dataLength = msg.GetActualDataLength();
+							}
+							CanInterface::SendBulk(&buf);
+						}
+					}
+					else if (compressData)
+					{
+						while (samplesRead != 0)
+						{
+							// Get the next sample, sign-extended
+							int16_t sample[3];
+							GetSignedSample(data, sample);
+							data += 3;
+							--samplesRead;
+
+							// See whether adding it to the packet would make the packet too long. If so, send the packet first.
+							if (samplesInBuffer != 0)
 							{
-								if (axesRequested & (1u << axis))
+								uint32_t maxDelta = 0;
+								for (unsigned int axis = 0; axis < 3; ++axis)
 								{
-									uint16_t dataVal =
-#if TEST_PACKING
-														pattern++;
-#else
-														data[axisLookup[axis]];
-									if (axisInverted[axis])
-									{
-										dataVal = (dataVal == 0x8000) ? ~dataVal : ~dataVal + 1;
-									}
-									dataVal >>= (16u - resolution);								// data from LIS3DH is left justified
-#endif
-									// Copy data for this axis
-									if (resolution == 16u)
-									{
-										msg.data[canDataIndex++] = dataVal;
-									}
-									else
-									{
-										const uint16_t val = dataVal;
-										bitsPending |= val << bitsUsed;
-										bitsUsed += resolution;
-										if (bitsUsed >= 16u)
-										{
-											msg.data[canDataIndex++] = bitsPending;
-											bitsUsed -= 16u;
-											bitsPending = val >> (resolution - bitsUsed);
-										}
-									}
+									maxDelta = max<uint32_t>(maxDelta, ZigZag((int32_t)sample[axis] - (int32_t)compressedSamples[samplesInBuffer - 1][axis]));
+								}
+								const unsigned int newWidth = max<unsigned int>(deltaWidth, BitsNeeded(maxDelta));
+								if (   samplesInBuffer == MaxCompressedSamplesPerPacket
+									|| CompressionWidthBits + numAxes * (resolution + samplesInBuffer * newWidth) > maxPacketBits
+								   )
+								{
+									SendCompressedPacket(buf, msg, samplesInBuffer, deltaWidth, samplesSent, dataRate, overflowed, false, timestampWords, packetStartTime);
+									samplesSent += samplesInBuffer;
+									samplesInBuffer = 0;
+									deltaWidth = 0;
+									overflowed = false;
+								}
+								else
+								{
+									deltaWidth = newWidth;
 								}
 							}
-							data += 3;
 
+							if (samplesInBuffer == 0)
+							{
+								packetStartTime = sampleTime(data - 3);
+							}
+							memcpy(compressedSamples[samplesInBuffer], sample, sizeof(sample));
 							++samplesInBuffer;
-							--samplesToCopy;
 							--samplesWanted;
-							--samplesRead;
+							if (samplesWanted == 0)
+							{
+								SendCompressedPacket(buf, msg, samplesInBuffer, deltaWidth, samplesSent, dataRate, overflowed, true, timestampWords, packetStartTime);
+								samplesSent += samplesInBuffer;
+								samplesInBuffer = 0;
+								break;
+							}
 						}
-
-						if (samplesInBuffer == MaxSamplesInBuffer || samplesWanted == 0)
+					}
+					else
+					{
+						while (samplesRead != 0)
 						{
-							// Send the buffer
-							if (bitsUsed != 0)
+							const unsigned int samplesToCopy = min<unsigned int>(samplesRead, maxRawSamples - samplesInBuffer);
+							if (samplesInBuffer == 0)
 							{
-								msg.data[canDataIndex] = bitsPending;
+								packetStartTime = sampleTime(data);
 							}
-							msg.firstSampleNumber = samplesSent;
-							msg.numSamples = samplesInBuffer;
-							msg.actualSampleRate = dataRate;
-							msg.overflowed = overflowed;
-							msg.lastPacket = (samplesWanted == 0);
-							msg.zero = 0;
 
-							buf.dataLength = msg.GetActualDataLength();
-							CanInterface::Send(&buf);
+							// Extract the required bits from the data and pack them into the CAN buffer
+							packRawSamples(data, samplesToCopy, rawPacker);
+							data += 3 * samplesToCopy;
+							samplesInBuffer += samplesToCopy;
+							samplesWanted -= samplesToCopy;
+							samplesRead -= samplesToCopy;
 
-							samplesSent += samplesInBuffer;
-							samplesInBuffer = 0;
-							canDataIndex = 0;
-							overflowed = false;
-							bitsUsed = 0;
-							bitsPending = 0;
+							if (samplesInBuffer == maxRawSamples || samplesWanted == 0)
+							{
+								// Send the buffer
+								const size_t wordsUsed = rawPacker.Flush() + timestampWords;
+								if (timestampWords != 0)
+								{
+									SetTimestamp(msg, packetStartTime);
+								}
+								msg.firstSampleNumber = samplesSent;
+								msg.numSamples = samplesInBuffer;
+								msg.actualSampleRate = dataRate;
+								msg.overflowed = overflowed;
+								msg.lastPacket = (samplesWanted == 0);
+								msg.zero = 0;
+
+								buf.dataLength = (timestampWords != 0) ? GetDataLength(msg, wordsUsed) : msg.GetActualDataLength();
+								CanInterface::SendBulk(&buf);
+
+								samplesSent += samplesInBuffer;
+								samplesInBuffer = 0;
+								rawPacker.Reset();
+								overflowed = false;
+							}
 						}
 					}
 				} while (samplesWanted != 0);
@@ -215,21 +629,38 @@ static bool TranslateOrientation(uint8_t input) noexcept
 	return true;
 }
 
+// Return the accelerometer if it is present, else delete it and return nullptr
+static Accelerometer *CheckAccelerometer(Accelerometer *acc) noexcept
+{
+	if (acc->CheckPresent())
+	{
+		return acc;
+	}
+	delete acc;
+	return nullptr;
+}
+
 // Interface functions called by the main task
 void AccelerometerHandler::Init() noexcept
 {
-	LIS3DH *temp = new LIS3DH(Platform::GetSharedI2C(), Lis3dhInt1Pin);
-	if (temp->CheckPresent())
+	Accelerometer *temp = nullptr;
+#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+	temp = CheckAccelerometer(new LIS3DH(Platform::GetSharedI2C(), Lis3dhInt1Pin));
+#endif
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+	if (temp == nullptr)
+	{
+		temp = CheckAccelerometer(new ADXL345(Platform::GetSharedSpi(), Adxl345CsPin, Adxl345Int1Pin));
+	}
+#endif
+	if (temp != nullptr)
 	{
 		temp->Configure(samplingRate, resolution);
 		accelerometer = temp;
 		(void)TranslateOrientation(orientation);
 		accelerometerTask = new Task<AccelerometerTaskStackWords>;
 		accelerometerTask->Create(AccelerometerTaskCode, "ACCEL", nullptr, TaskPriority::Accelerometer);
-	}
-	else
-	{
-		delete temp;
+		PriorityProfiles::SetTaskRole(*accelerometerTask, PriorityProfiles::TaskRole::accelerometer);
 	}
 }
 
@@ -278,18 +709,89 @@ GCodeResult AccelerometerHandler::ProcessConfigRequest(const CanMessageGeneric&
 	if (parser.GetUintParam('S', samplingRate)) { seen = true; }
 	if (parser.GetUintParam('R', resolution))  { seen = true; }
 
+	uint8_t compress;
+	if (parser.GetUintParam('C', compress))
+	{
+		compressData = (compress != 0);
+		seen = true;
+	}
+
+	// T sets the trigger mode and W sets the master step clock time at which to start when T2 is used
+	uint8_t localTriggerMode;
+	if (parser.GetUintParam('T', localTriggerMode))
+	{
+		if (   localTriggerMode > (uint8_t)TriggerMode::masterTime
+#if !SUPPORT_DRIVERS
+			|| localTriggerMode == (uint8_t)TriggerMode::moveStart
+#endif
+		   )
+		{
+			reply.copy("Invalid trigger mode");
+			return GCodeResult::error;
+		}
+		triggerMode = (TriggerMode)localTriggerMode;
+		seen = true;
+	}
+	if (parser.GetUintParam('W', triggerMasterTime))
+	{
+		seen = true;
+	}
+
+	// F sets the maximum frequency for analysing the data on this board, or zero to send the raw data
+	uint16_t maxFrequency;
+	const bool seenFrequency = parser.GetUintParam('F', maxFrequency);
+	if (seenFrequency)
+	{
+		if (maxFrequency != 0)
+		{
+			if (maxFrequency >= samplingRate/2)
+			{
+				reply.copy("Analysis frequency must be less than half the sampling rate");
+				return GCodeResult::error;
+			}
+			if (spectrum == nullptr)
+			{
+				spectrum = new AccelerometerSpectrum;
+			}
+		}
+		analyseData = (maxFrequency != 0);
+		seen = true;
+	}
+
 	if (seen)
 	{
+		if (monitoring)
+		{
+			reply.printf("Accelerometer %u.%u is busy monitoring vibration", CanInterface::GetCanAddress(), deviceNumber);
+			return GCodeResult::error;
+		}
 		if (!accelerometer->Configure(samplingRate, resolution))
 		{
 			reply.copy("Failed to configure accelerometer");
 			return GCodeResult::error;
 		}
+		if (analyseData)
+		{
+			spectrum->Configure(samplingRate, (seenFrequency) ? maxFrequency : spectrum->GetMaxFrequency());
+		}
 	}
 	else
 	{
-		reply.printf("Accelerometer %u:%u type %s with orientation %u samples at %uHz with %u-bit resolution",
-						CanInterface::GetCanAddress(), deviceNumber, accelerometer->GetTypeName(), orientation, samplingRate, resolution);
+		reply.printf("Accelerometer %u:%u type %s with orientation %u samples at %uHz with %u-bit resolution%s",
+						CanInterface::GetCanAddress(), deviceNumber, accelerometer->GetTypeName(), orientation, samplingRate, resolution,
+						(compressData) ? ", compressed" : "");
+		if (analyseData)
+		{
+			reply.catf(", analysed up to %uHz", spectrum->GetMaxFrequency());
+		}
+		if (triggerMode == TriggerMode::moveStart)
+		{
+			reply.cat(", triggered by move start");
+		}
+		else if (triggerMode == TriggerMode::masterTime)
+		{
+			reply.catf(", triggered at time %" PRIu32, triggerMasterTime);
+		}
 	}
 	return GCodeResult::ok;
 }
@@ -310,6 +812,18 @@ GCodeResult AccelerometerHandler::ProcessStartRequest(const CanMessageStartAccel
 
 	axesRequested = msg.axes;
 	numSamplesRequested = msg.numSamples;
+	waitingForTrigger = (triggerMode != TriggerMode::immediate);
+	triggerWaitStartedAt = millis();
+	if (triggerMode == TriggerMode::masterTime)
+	{
+		triggerLocalTime = StepTimer::ConvertToLocalTime(triggerMasterTime);
+	}
+#if SUPPORT_DRIVERS
+	else if (triggerMode == TriggerMode::moveStart)
+	{
+		moveInstance->ArmMoveStartCapture();
+	}
+#endif
 	successfulStart = false;
 	failedStart = false;
 	running = true;
@@ -332,6 +846,125 @@ GCodeResult AccelerometerHandler::ProcessStartRequest(const CanMessageStartAccel
 	return GCodeResult::error;
 }
 
+// Append the results of the last spectrum analysis
+void AccelerometerHandler::AppendSpectrumPeaks(const StringRef& reply) noexcept
+{
+	if (spectrum == nullptr || !analyseData)
+	{
+		reply.copy("Accelerometer spectrum analysis is not enabled");
+	}
+	else if (running)
+	{
+		reply.copy("Accelerometer is busy collecting data");
+	}
+	else
+	{
+		spectrum->AppendPeaks(reply);
+	}
+}
+
+// Start or stop continuous vibration monitoring. A window length of zero stops it. The thresholds are in milli-g, zero means no threshold.
+// While monitoring, a capture requested by M956 takes priority and monitoring resumes when it has finished.
+GCodeResult AccelerometerHandler::SetVibrationMonitoring(uint32_t windowMillis, uint32_t rmsThreshold, uint32_t peakThreshold, const StringRef& reply) noexcept
+{
+	if (accelerometer == nullptr)
+	{
+		reply.copy("No accelerometer");
+		return GCodeResult::error;
+	}
+
+	if (windowMillis == 0)
+	{
+		monitoring = false;
+		reply.copy("Vibration monitoring stopped");
+		return GCodeResult::ok;
+	}
+
+	if (windowMillis < MinVibrationWindowMillis || windowMillis > MaxVibrationWindowMillis)
+	{
+		reply.printf("Window must be between %" PRIu32 " and %" PRIu32 "ms", MinVibrationWindowMillis, MaxVibrationWindowMillis);
+		return GCodeResult::error;
+	}
+
+	// Stop monitoring while we change the configuration, because the task uses it
+	monitoring = false;
+	const uint32_t startTime = millis();
+	while (monitorActive && millis() - startTime < 1000)
+	{
+		delay(2);
+	}
+	if (monitorActive)
+	{
+		reply.copy("Failed to stop vibration monitoring");
+		return GCodeResult::error;
+	}
+	if (vibrationMonitor == nullptr)
+	{
+		vibrationMonitor = new VibrationMonitor;
+	}
+	vibrationMonitor->Configure(samplingRate, resolution, windowMillis, rmsThreshold, peakThreshold);
+	monitorFailed = false;
+	monitoring = true;
+	accelerometerTask->Give();
+	reply.printf("Vibration monitoring with %" PRIu32 "ms window at %uHz", windowMillis, samplingRate);
+	return GCodeResult::ok;
+}
+
+// Enable or disable acceleration limiting with the specified target RMS vibration in milli-g, zero to disable it. Vibration monitoring must already be enabled.
+// The main board reads the recommended acceleration limit with the vibration statistics and scales the accelerations it plans with.
+GCodeResult AccelerometerHandler::SetAccelerationLimiting(uint32_t targetRms, const StringRef& reply) noexcept
+{
+	if (vibrationMonitor == nullptr || !monitoring)
+	{
+		reply.copy("Vibration monitoring is not enabled");
+		return GCodeResult::error;
+	}
+
+	vibrationMonitor->SetAccelerationLimiting(targetRms);
+	if (targetRms == 0)
+	{
+		reply.copy("Acceleration limiting disabled");
+	}
+	else
+	{
+		reply.printf("Acceleration limiting to %" PRIu32 "mg RMS vibration", targetRms);
+	}
+	return GCodeResult::ok;
+}
+
+// Append the vibration statistics from the last complete window
+void AccelerometerHandler::AppendVibrationStats(const StringRef& reply) noexcept
+{
+	if (vibrationMonitor == nullptr)
+	{
+		reply.copy("Vibration monitoring is not enabled");
+	}
+	else
+	{
+		vibrationMonitor->AppendResults(reply);
+	}
+}
+
+// Get the most recent sample that the vibration monitor collected, converted to g
+bool AccelerometerHandler::GetLatestSample(float xyz[3]) noexcept
+{
+	if (!monitorActive)
+	{
+		return false;
+	}
+	int16_t sample[3];
+	{
+		TaskCriticalSectionLocker lock;
+		memcpy(sample, latestSample, sizeof(sample));
+	}
+	const float gPerCount = 2.0/(float)(1u << (resolution - 1));
+	for (size_t axis = 0; axis < 3; ++axis)
+	{
+		xyz[axis] = (float)sample[axis] * gPerCount;
+	}
+	return true;
+}
+
 void AccelerometerHandler::Diagnostics(const StringRef& reply) noexcept
 {
 	reply.lcatf("Accelerometer: %s", (accelerometer != nullptr) ? accelerometer->GetTypeName() : "none");
@@ -342,6 +975,11 @@ void AccelerometerHandler::Diagnostics(const StringRef& reply) noexcept
 		{
 			reply.cat(", INT1 error!");
 		}
+		if (vibrationMonitor != nullptr)
+		{
+			vibrationMonitor->Diagnostics(reply);
+			reply.cat((monitoring) ? " (running)" : (monitorFailed) ? " (failed to start)" : " (stopped)");
+		}
 	}
 }
 
@@ -10,7 +10,7 @@
 
 #include <RepRapFirmware.h>
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 
 class CanMessageGeneric;
 class CanMessageStartAccelerometer;
@@ -22,6 +22,11 @@ namespace AccelerometerHandler
 	bool IsPresent() noexcept;
 	GCodeResult ProcessConfigRequest(const CanMessageGeneric& msg, const StringRef& reply) noexcept;
 	GCodeResult ProcessStartRequest(const CanMessageStartAccelerometer& msg, const StringRef& reply) noexcept;
+	void AppendSpectrumPeaks(const StringRef& reply) noexcept;
+	GCodeResult SetVibrationMonitoring(uint32_t windowMillis, uint32_t rmsThreshold, uint32_t peakThreshold, const StringRef& reply) noexcept;
+	GCodeResult SetAccelerationLimiting(uint32_t targetRms, const StringRef& reply) noexcept;
+	void AppendVibrationStats(const StringRef& reply) noexcept;
+	bool GetLatestSample(float xyz[3]) noexcept;				// get the most recent sample in g while the vibration monitor is running, returning false if there isn't one
 	void Diagnostics(const StringRef& reply) noexcept;
 };
 
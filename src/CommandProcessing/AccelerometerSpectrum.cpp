@@ -0,0 +1,157 @@
+/*
+ * AccelerometerSpectrum.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "AccelerometerSpectrum.h"
+
+#if SUPPORT_ACCELEROMETERS
+
+constexpr unsigned int CoefficientShift = 14;
+constexpr unsigned int DcShift = 6;						// time constant of the DC level filter in samples is 2^DcShift
+
+void AccelerometerSpectrum::Reset() noexcept
+{
+	memset(s1, 0, sizeof(s1));
+	memset(s2, 0, sizeof(s2));
+	memset(power, 0, sizeof(power));
+	samplesInBlock = 0;
+	blocksCompleted = 0;
+}
+
+void AccelerometerSpectrum::Configure(uint16_t p_samplingRate, uint16_t p_maxFrequency) noexcept
+{
+	samplingRate = p_samplingRate;
+	maxFrequency = p_maxFrequency;
+	for (size_t bin = 0; bin < NumBins; ++bin)
+	{
+		coefficients[bin] = lrintf(2.0 * cosf(TwoPi * BinFrequency((float)bin)/(float)samplingRate) * (float)(1u << CoefficientShift));
+	}
+	Reset();
+}
+
+void AccelerometerSpectrum::Start(uint8_t p_axes) noexcept
+{
+	axes = p_axes;
+	Reset();
+	dcLevel[0] = dcLevel[1] = dcLevel[2] = 0;
+}
+
+// Process one sample. The first sample is used to initialise the DC level so that the filter doesn't take long to settle.
+void AccelerometerSpectrum::AddSample(const int16_t sample[3]) noexcept
+{
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		if (axes & (1u << axis))
+		{
+			if (samplesInBlock == 0 && blocksCompleted == 0)
+			{
+				dcLevel[axis] = (int32_t)sample[axis] << 8;
+			}
+			dcLevel[axis] += (((int32_t)sample[axis] << 8) - dcLevel[axis]) >> DcShift;
+			const int32_t x = (int32_t)sample[axis] - (dcLevel[axis] >> 8);
+			int32_t * const axisS1 = s1[axis];
+			int32_t * const axisS2 = s2[axis];
+			for (size_t bin = 0; bin < NumBins; ++bin)
+			{
+				const int32_t s0 = x + (int32_t)(((int64_t)coefficients[bin] * axisS1[bin]) >> CoefficientShift) - axisS2[bin];
+				axisS2[bin] = axisS1[bin];
+				axisS1[bin] = s0;
+			}
+		}
+	}
+
+	if (++samplesInBlock == BlockLength)
+	{
+		EndBlock();
+	}
+}
+
+// Accumulate the power in each bin for the block just completed and reset the filters.
+// We scale the power so that it is the square of the amplitude of a sine wave at the bin frequency.
+void AccelerometerSpectrum::EndBlock() noexcept
+{
+	constexpr float PowerScale = 4.0/((float)BlockLength * (float)BlockLength);
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		if (axes & (1u << axis))
+		{
+			for (size_t bin = 0; bin < NumBins; ++bin)
+			{
+				const float f1 = (float)s1[axis][bin], f2 = (float)s2[axis][bin];
+				const float p = fsquare(f1) + fsquare(f2) - (float)coefficients[bin] * (1.0/(float)(1u << CoefficientShift)) * f1 * f2;
+				power[axis][bin] += max<float>(p, 0.0) * PowerScale;
+				s1[axis][bin] = s2[axis][bin] = 0;
+			}
+		}
+	}
+	samplesInBlock = 0;
+	++blocksCompleted;
+}
+
+// Append the largest peaks in the spectrum of each axis collected. The peak frequency is refined by fitting a parabola through the peak bin and its neighbours.
+void AccelerometerSpectrum::AppendPeaks(const StringRef& reply) const noexcept
+{
+	if (blocksCompleted == 0)
+	{
+		reply.lcatf("Accelerometer spectrum: no data, at least %u samples are needed", BlockLength);
+		return;
+	}
+
+	reply.lcatf("Accelerometer spectrum: %u blocks of %u samples at %uHz, bins up to %uHz", blocksCompleted, BlockLength, samplingRate, maxFrequency);
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		if (axes & (1u << axis))
+		{
+			const float *const p = power[axis];
+			size_t peakBins[NumPeaks];
+			size_t numPeaks = 0;
+			for (size_t bin = 0; bin < NumBins; ++bin)
+			{
+				if ((bin == 0 || p[bin] > p[bin - 1]) && (bin + 1 == NumBins || p[bin] >= p[bin + 1]))
+				{
+					// Insert this peak into the list, which is sorted in decreasing order of power
+					size_t i = numPeaks;
+					while (i != 0 && p[peakBins[i - 1]] < p[bin])
+					{
+						if (i < NumPeaks)
+						{
+							peakBins[i] = peakBins[i - 1];
+						}
+						--i;
+					}
+					if (i < NumPeaks)
+					{
+						peakBins[i] = bin;
+						if (numPeaks < NumPeaks)
+						{
+							++numPeaks;
+						}
+					}
+				}
+			}
+
+			reply.lcatf("%c:", "XYZ"[axis]);
+			for (size_t i = 0; i < numPeaks; ++i)
+			{
+				const size_t bin = peakBins[i];
+				float offset = 0.0;
+				if (bin != 0 && bin + 1 < NumBins)
+				{
+					const float denominator = p[bin - 1] - 2.0 * p[bin] + p[bin + 1];
+					if (denominator < 0.0)
+					{
+						offset = constrain<float>(0.5 * (p[bin - 1] - p[bin + 1])/denominator, -0.5, 0.5);
+					}
+				}
+				reply.catf(" %.1fHz %.1f", (double)BinFrequency((float)bin + offset), (double)sqrtf(p[bin]/(float)blocksCompleted));
+			}
+		}
+	}
+}
+
+#endif
+
+// End
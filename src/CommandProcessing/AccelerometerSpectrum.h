@@ -0,0 +1,54 @@
+/*
+ * AccelerometerSpectrum.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_COMMANDPROCESSING_ACCELEROMETERSPECTRUM_H_
+#define SRC_COMMANDPROCESSING_ACCELEROMETERSPECTRUM_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+// Class to analyse accelerometer data on this board using a bank of Goertzel filters, so that we only need to send the resonance peaks to the main board.
+// The samples are processed in blocks of BlockLength. The power in each frequency bin is averaged over all the blocks collected.
+// The filters use fixed point arithmetic because the SAMC21 has no FPU. Floating point is used only once per block.
+class AccelerometerSpectrum
+{
+public:
+	static constexpr size_t NumBins = 32;
+	static constexpr size_t NumPeaks = 3;
+	static constexpr unsigned int BlockLength = 256;
+
+	AccelerometerSpectrum() noexcept { Reset(); }
+
+	// Set up the filter bank. The bins are spaced evenly from maxFrequency/NumBins to maxFrequency.
+	void Configure(uint16_t p_samplingRate, uint16_t p_maxFrequency) noexcept;
+	void Start(uint8_t p_axes) noexcept;
+	void AddSample(const int16_t sample[3]) noexcept;
+	void AppendPeaks(const StringRef& reply) const noexcept;
+
+	uint16_t GetMaxFrequency() const noexcept { return maxFrequency; }
+
+private:
+	void Reset() noexcept;
+	void EndBlock() noexcept;
+	float BinFrequency(float bin) const noexcept { return (bin + 1.0) * (float)maxFrequency * (1.0/(float)NumBins); }
+
+	int32_t coefficients[NumBins];					// 2*cos(2*pi*f/fs) in Q14 format
+	int32_t s1[3][NumBins];							// Goertzel filter state
+	int32_t s2[3][NumBins];
+	float power[3][NumBins];						// accumulated power in each bin
+	int32_t dcLevel[3];								// estimated DC level of each axis in Q8 format, mostly due to gravity
+	unsigned int samplesInBlock;
+	unsigned int blocksCompleted;
+	uint16_t samplingRate;
+	uint16_t maxFrequency;
+	uint8_t axes;
+};
+
+#endif
+
+#endif /* SRC_COMMANDPROCESSING_ACCELEROMETERSPECTRUM_H_ */
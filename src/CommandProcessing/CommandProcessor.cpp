@@ -7,6 +7,8 @@
 
 #include "CommandProcessor.h"
 #include <CAN/CanInterface.h>
+#include <CAN/CanStatistics.h>
+#include <CAN/CanCapture.h>
 #include <CanMessageBuffer.h>
 #include <Heating/Heat.h>
 #include <Fans/FansManager.h>
@@ -18,6 +20,15 @@
 #include <Platform.h>
 #include <Movement/Move.h>
 #include <Tasks.h>
+#include <TaskPriorities.h>
+#include <LatencyHistograms.h>
+#include <IsrProfiler.h>
+#include <MemoryArenas.h>
+#include <DataCapture.h>
+#include <DeferredLog.h>
+#include <PriorityProfiles.h>
+#include "ScheduledSettings.h"
+#include <DiagnosticsRecord.h>
 #include <AnalogIn.h>
 #include <Hardware/NonVolatileMemory.h>
 #include <hpl_user_area.h>
@@ -35,10 +46,14 @@
 # endif
 #endif
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 # include "AccelerometerHandler.h"
 #endif
 
+#if defined(ATEIO) || defined(ATECM)
+# include "TestSequence.h"
+#endif
+
 #if HAS_VOLTAGE_MONITOR
 constexpr float MinVin = 11.0;
 constexpr float MaxVin = 32.0;
@@ -177,9 +192,9 @@ static GCodeResult SetMotorCurrents(const CanMessageMultipleDrivesRequest<float>
 								reply.lcatf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
 								rslt = GCodeResult::error;
 							}
-							else
+							else if (ScheduledSettings::Set(ScheduledSettings::Setting::motorCurrent, driver, msg.values[count], SettingTrigger::immediate, 0, reply) != GCodeResult::ok)
 							{
-								Platform::SetMotorCurrent(driver, msg.values[count]);
+								rslt = GCodeResult::error;
 							}
 						}
 				   );
@@ -208,9 +223,9 @@ static GCodeResult SetStandstillCurrentFactor(const CanMessageMultipleDrivesRequ
 								reply.lcatf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
 								rslt = GCodeResult::error;
 							}
-							else
+							else if (ScheduledSettings::Set(ScheduledSettings::Setting::standstillCurrent, driver, msg.values[count], SettingTrigger::immediate, 0, reply) != GCodeResult::ok)
 							{
-								SmartDrivers::SetStandstillCurrentPercent(driver, msg.values[count]);
+								rslt = GCodeResult::error;
 							}
 						}
 				   );
@@ -238,9 +253,9 @@ static GCodeResult HandlePressureAdvance(const CanMessageMultipleDrivesRequest<f
 								reply.lcatf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
 								rslt = GCodeResult::error;
 							}
-							else
+							else if (ScheduledSettings::Set(ScheduledSettings::Setting::pressureAdvance, driver, msg.values[count], SettingTrigger::immediate, 0, reply) != GCodeResult::ok)
 							{
-								Platform::SetPressureAdvance(driver, msg.values[count]);
+								rslt = GCodeResult::error;
 							}
 						}
 				   );
@@ -316,6 +331,18 @@ static GCodeResult ProcessM569(const CanMessageGeneric& msg, const StringRef& re
 		Platform::SetEnableValue(drive, rValue);
 	}
 
+	// Bind this driver to a local input monitor so that it stops as soon as the input triggers. A negative handle removes the binding.
+	int32_t inputHandle;
+	if (parser.GetIntParam('I', inputHandle))
+	{
+		seen = true;
+		const GCodeResult rslt = InputMonitor::SetLocalStopDriver((uint16_t)labs(inputHandle), drive, inputHandle >= 0, reply);
+		if (rslt != GCodeResult::ok)
+		{
+			return rslt;
+		}
+	}
+
 #if SUPPORT_SLOW_DRIVERS
 	float timings[4];
 	size_t numTimings = 4;
@@ -566,12 +593,25 @@ static GCodeResult ProcessM569Point2(const CanMessageGeneric& msg, const StringR
 #endif
 }
 
-static GCodeResult HandleSetDriverStates(const CanMessageMultipleDrivesRequest<DriverStateControl>& msg, const StringRef& reply)
+static GCodeResult HandleSetDriverStates(const CanMessageMultipleDrivesRequest<DriverStateControl>& msg, size_t dataLength, const StringRef& reply)
 {
-	//TODO check message is long enough for the number of drivers specified
 	const auto drivers = Bitmap<uint16_t>::MakeFromRaw(msg.driversToUpdate);
-	drivers.Iterate([&msg](unsigned int driver, unsigned int count) -> void
+	if (dataLength < msg.GetActualDataLength(drivers.CountSetBits()))
+	{
+		reply.copy("bad data length");
+		return GCodeResult::error;
+	}
+
+	GCodeResult rslt = GCodeResult::ok;
+	drivers.Iterate([&msg, &reply, &rslt](unsigned int driver, unsigned int count) -> void
 		{
+			if (driver >= NumDrivers)
+			{
+				reply.lcatf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
+				rslt = GCodeResult::error;
+				return;
+			}
+
 			switch (msg.values[count].mode)
 			{
 			case DriverStateControl::driverActive:
@@ -588,7 +628,7 @@ static GCodeResult HandleSetDriverStates(const CanMessageMultipleDrivesRequest<D
 				break;
 			}
 		});
-	return GCodeResult::ok;
+	return rslt;
 }
 
 static GCodeResult ProcessM915(const CanMessageGeneric& msg, const StringRef& reply)
@@ -632,12 +672,24 @@ static GCodeResult ProcessM915(const CanMessageGeneric& msg, const StringRef& re
 		}
 	}
 
+#if SUPPORT_TMC51xx || SUPPORT_TMC2160
+	{
+		uint8_t minCurrentPercent;
+		if (parser.GetUintParam('C', minCurrentPercent))
+		{
+			seen = true;
+			drivers.Iterate([minCurrentPercent](unsigned int drive, unsigned int) noexcept { SmartDrivers::SetLoadControlMinimumCurrent(drive, minCurrentPercent); });
+		}
+	}
+#endif
+
 	{
 		uint8_t rParam;
 		if (parser.GetUintParam('R', rParam))
 		{
 			seen = true;
 			Platform::SetOrResetEventOnStall(drivers, rParam != 0);
+			Platform::SetOrResetStopOnStall(drivers, rParam == Platform::StallActionStopMotor);
 		}
 	}
 
@@ -692,9 +744,77 @@ static GCodeResult InitiateReset(const CanMessageReset& msg, const StringRef& re
 	return GCodeResult::ok;
 }
 
+// Return info type to request the CAN statistics, with the parameter being the index of the first message type to report. This needs a matching typeCanStatistics in CANlib.
+constexpr uint8_t ReturnInfoTypeCanStatistics = 20;
+
+// Return info type to request the resonance peaks found by the last accelerometer run in spectrum analysis mode. This needs a matching typeAccelerometerSpectrum in CANlib.
+constexpr uint8_t ReturnInfoTypeAccelerometerSpectrum = 21;
+
+// Return info type to request the compact diagnostics record, which the main board can poll instead of fetching all the M122 parts. This needs a matching typeDiagnosticsRecord in CANlib.
+constexpr uint8_t ReturnInfoTypeDiagnosticsRecord = 22;
+
+// Return info type to request the telemetry record, which has the fields selected by diagnostic test 217 and doesn't reset any counters. This needs a matching typeTelemetry in CANlib.
+constexpr uint8_t ReturnInfoTypeTelemetry = 23;
+
+// Return info type to request the vibration statistics from the last complete monitoring window, see diagnostic test 219. This needs a matching typeVibrationStats in CANlib.
+constexpr uint8_t ReturnInfoTypeVibrationStats = 24;
+
+// Return info type to request the CAN bus error counters, which the main board uses when probing for the fastest reliable data phase rate. This needs a matching typeCanBusHealth in CANlib.
+constexpr uint8_t ReturnInfoTypeCanBusHealth = 25;
+
+#if defined(ATEIO) || defined(ATECM)
+// Return info type to run the ATE test sequence set up by diagnostic test 220 and return the results record. This needs a matching typeTestSequence in CANlib.
+constexpr uint8_t ReturnInfoTypeTestSequence = 26;
+#endif
+
+#if SUPPORT_CAN_CAPTURE
+// Return info type to dump the CAN messages captured by diagnostic test 222, with the parameter being the index of the first message to return. This needs a matching typeCanCapture in CANlib.
+constexpr uint8_t ReturnInfoTypeCanCapture = 27;
+#endif
+
+#if SUPPORT_CLOSED_LOOP
+// Return info type to return the closed loop frequency response measured by diagnostic test 223, with the parameter being the index of the first point to return.
+// This needs a matching typeFrequencyResponse in CANlib.
+constexpr uint8_t ReturnInfoTypeFrequencyResponse = 28;
+#endif
+
+#if SUPPORT_DRIVERS
+// Return info type to request the health statistics of the filament sensors, such as the image quality and shutter of laser sensors.
+// The statistics are rolling averages, so the main board can poll them at a low rate. This needs a matching typeFilamentSensorHealth in CANlib.
+constexpr uint8_t ReturnInfoTypeFilamentSensorHealth = 29;
+#endif
+
+#if SUPPORT_DRIVERS
+// Return info type to request the state of the move queue: the number of moves queued, the ring length, the master time at which a slot will be free
+// and the master time at which the queue will drain. The main board can use this to decide how far ahead to schedule moves. This needs a matching typeMoveQueueStatus in CANlib.
+constexpr uint8_t ReturnInfoTypeMoveQueueStatus = 30;
+#endif
+
+#if SUPPORT_DEFERRED_LOG
+// Return info type to fetch the oldest lines from the deferred log. The lines are removed when they are returned, so the main board polls until it gets an empty reply.
+// This needs a matching typeDeferredLog in CANlib.
+constexpr uint8_t ReturnInfoTypeDeferredLog = 31;
+#endif
+
+static void GetDiagnosticsRecord(const StringRef& reply, bool isTelemetry) noexcept
+{
+	DiagnosticsRecord rec(isTelemetry);
+#if SUPPORT_DRIVERS
+	moveInstance->GetDiagnosticsRecord(rec);
+# if SUPPORT_CLOSED_LOOP
+	ClosedLoop::GetDiagnosticsRecord(rec);
+# endif
+#endif
+	CanInterface::GetDiagnosticsRecord(rec);
+	StepTimer::GetDiagnosticsRecord(rec);
+	Heat::GetDiagnosticsRecord(rec);
+	Tasks::GetDiagnosticsRecord(rec);
+	rec.Encode(reply, (isTelemetry) ? DiagnosticsRecord::GetTelemetryFields() : ~(uint64_t)0);
+}
+
 static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& reply, uint8_t& extra)
 {
-	static constexpr uint8_t LastDiagnosticsPart = 7;				// the last diagnostics part is typeDiagnosticsPart0 + 7
+	static constexpr uint8_t LastDiagnosticsPart = 9;				// the last diagnostics part is typeDiagnosticsPart0 + 9
 
 	switch (msg.type)
 	{
@@ -738,6 +858,66 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		Platform::GetUniqueId().AppendCharsToString(reply);
 		break;
 
+	case ReturnInfoTypeCanStatistics:
+		CanStatistics::AppendMessageTypeStats(reply, msg.param);
+		break;
+
+	case ReturnInfoTypeDiagnosticsRecord:
+		GetDiagnosticsRecord(reply, false);
+		break;
+
+	case ReturnInfoTypeTelemetry:
+		GetDiagnosticsRecord(reply, true);
+		break;
+
+	case ReturnInfoTypeCanBusHealth:
+		CanInterface::AppendBusHealth(reply);
+		break;
+
+#if defined(ATEIO) || defined(ATECM)
+	case ReturnInfoTypeTestSequence:
+		TestSequence::Run(reply);
+		break;
+#endif
+
+#if SUPPORT_CAN_CAPTURE
+	case ReturnInfoTypeCanCapture:
+		CanCapture::AppendMessages(reply, msg.param);
+		break;
+#endif
+
+#if SUPPORT_CLOSED_LOOP
+	case ReturnInfoTypeFrequencyResponse:
+		ClosedLoop::AppendFrequencyResponse(reply, msg.param);
+		break;
+#endif
+
+#if SUPPORT_DRIVERS
+	case ReturnInfoTypeFilamentSensorHealth:
+		FilamentMonitor::AppendSensorHealth(reply);
+		break;
+
+	case ReturnInfoTypeMoveQueueStatus:
+		moveInstance->AppendQueueStatus(reply);
+		break;
+#endif
+
+#if SUPPORT_DEFERRED_LOG
+	case ReturnInfoTypeDeferredLog:
+		DeferredLog::AppendLines(reply);
+		break;
+#endif
+
+#if SUPPORT_ACCELEROMETERS
+	case ReturnInfoTypeAccelerometerSpectrum:
+		AccelerometerHandler::AppendSpectrumPeaks(reply);
+		break;
+
+	case ReturnInfoTypeVibrationStats:
+		AccelerometerHandler::AppendVibrationStats(reply);
+		break;
+#endif
+
 	case CanMessageReturnInfo::typeDiagnosticsPart0:
 		if (msg.param == 1)
 		{
@@ -785,6 +965,7 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 			if (srd != nullptr)
 			{
 				srd->PrintPart2(reply);
+				srd->PrintPerformanceContext(reply);
 			}
 		}
 		break;
@@ -809,6 +990,9 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 			{
 				SmartDrivers::AppendDriverStatus(driver, reply);
 			}
+			float deratingFactor;
+			const float estimatedTemperature = Platform::GetDriverTemperatureEstimate(driver, deratingFactor);
+			reply.catf(", est temp %.0fC current %u%%", (double)estimatedTemperature, (unsigned int)lrintf(deratingFactor * 100.0));
 # endif
 			reply.catf(", steps req %" PRIu32 " done %" PRIu32, DDA::stepsRequested[driver], DDA::stepsDone[driver]);
 			DDA::stepsRequested[driver] = DDA::stepsDone[driver] = 0;
@@ -854,6 +1038,7 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 		extra = LastDiagnosticsPart;
 		Heat::Diagnostics(reply);
 		CanInterface::Diagnostics(reply);
+		GpioPorts::Diagnostics(reply);
 #if 0
 		{
 			uint32_t nvmUserRow0 = *reinterpret_cast<const uint32_t*>(NVMCTRL_USER);
@@ -872,298 +1057,442 @@ static GCodeResult GetInfo(const CanMessageReturnInfo& msg, const StringRef& rep
 
 	case CanMessageReturnInfo::typeDiagnosticsPart0 + 7:
 		extra = LastDiagnosticsPart;
-#if SUPPORT_I2C_SENSORS
-# if SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 		AccelerometerHandler::Diagnostics(reply);
-# endif
+#endif
+#if SUPPORT_I2C_SENSORS
 		Platform::GetSharedI2C().Diagnostics(reply);
 #endif
+#if SUPPORT_SPI_SENSORS || defined(ATEIO)
+		Platform::GetSharedSpi().Diagnostics(reply);
+#endif
 
 #if SUPPORT_DRIVERS
 		FilamentMonitor::GetDiagnostics(reply);
 #endif
 		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 8:
+		extra = LastDiagnosticsPart;
+		LatencyHistograms::Diagnostics(reply);
+		PriorityProfiles::Diagnostics(reply);
+#if SUPPORT_SCHEDULED_SETTINGS
+		ScheduledSettings::Diagnostics(reply);
+#endif
+#if SUPPORT_COMMAND_WORKER
+		CommandProcessor::Diagnostics(reply);
+#endif
+#if SUPPORT_ISR_PROFILING
+		IsrProfiler::Diagnostics(reply);
+#endif
+#if SUPPORT_DATA_CAPTURE
+		DataCapture::Diagnostics(reply);
+#endif
+#if SUPPORT_DEFERRED_LOG
+		DeferredLog::Diagnostics(reply);
+#endif
+		break;
+
+	case CanMessageReturnInfo::typeDiagnosticsPart0 + 9:
+		extra = LastDiagnosticsPart;
+		MemoryArenas::Diagnostics(reply);
+		Tasks::StackDiagnostics(reply);
+		break;
 	}
 	return GCodeResult::ok;
 }
 
-void CommandProcessor::Spin()
+// Process a CAN command and send the reply. This is called by the main task, and by the command worker task for commands that may take a long time.
+static void ProcessCommand(CanMessageBuffer *buf) noexcept
 {
-	CanMessageBuffer *buf = CanInterface::GetCanCommand(0);
-	if (buf != nullptr)
+	String<StringLength500> reply;
+	const StringRef& replyRef = reply.GetRef();
+	const CanMessageType id = buf->id.MsgType();
+	GCodeResult rslt;
+	CanRequestId requestId;
+	uint8_t extra = 0;
+
+	switch (id)
 	{
-		Platform::OnProcessingCanMessage();
-		String<StringLength500> reply;
-		const StringRef& replyRef = reply.GetRef();
-		const CanMessageType id = buf->id.MsgType();
-		GCodeResult rslt;
-		CanRequestId requestId;
-		uint8_t extra = 0;
+	case CanMessageType::sensorTemperaturesReport:
+		Heat::ProcessRemoteSensorsReport(buf->id.Src(), buf->msg.sensorTemperaturesBroadcast);
+		break;
 
-		switch (id)
-		{
-		case CanMessageType::sensorTemperaturesReport:
-			Heat::ProcessRemoteSensorsReport(buf->id.Src(), buf->msg.sensorTemperaturesBroadcast);
-			break;
-
-		case CanMessageType::returnInfo:
-			requestId = buf->msg.getInfo.requestId;
-			rslt = GetInfo(buf->msg.getInfo, replyRef, extra);
-			break;
-
-		case CanMessageType::heaterModelNewNew:
-			requestId = buf->msg.heaterModelNewNew.requestId;
-			rslt = Heat::ProcessM307New(buf->msg.heaterModelNewNew, replyRef);
-			break;
-
-		case CanMessageType::setHeaterTemperature:
-			requestId = buf->msg.setTemp.requestId;
-			rslt = Heat::SetTemperature(buf->msg.setTemp, replyRef);
-			break;
-
-		case CanMessageType::heaterTuningCommand:
-			requestId = buf->msg.heaterTuningCommand.requestId;
-			rslt = Heat::TuningCommand(buf->msg.heaterTuningCommand, replyRef);
-			break;
-
-		case CanMessageType::m308New:
-			requestId = buf->msg.generic.requestId;
-			rslt = Heat::ProcessM308(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m950Fan:
-			requestId = buf->msg.generic.requestId;
-			rslt = FansManager::ConfigureFanPort(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m950Heater:
-			requestId = buf->msg.generic.requestId;
-			rslt = Heat::ConfigureHeater(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::heaterFeedForward:
-			requestId = buf->msg.heaterFeedForward.requestId;
-			rslt = Heat::FeedForward(buf->msg.heaterFeedForward, replyRef);
-			break;
-
-		case CanMessageType::m950Gpio:
-			requestId = buf->msg.generic.requestId;
-			rslt = GpioPorts::HandleM950Gpio(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::writeGpio:
-			requestId = buf->msg.writeGpio.requestId;
-			rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, replyRef);
-			break;
+	case CanMessageType::returnInfo:
+		requestId = buf->msg.getInfo.requestId;
+		rslt = GetInfo(buf->msg.getInfo, replyRef, extra);
+		break;
+
+	case CanMessageType::heaterModelNewNew:
+		requestId = buf->msg.heaterModelNewNew.requestId;
+		rslt = Heat::ProcessM307New(buf->msg.heaterModelNewNew, replyRef);
+		break;
+
+	case CanMessageType::setHeaterTemperature:
+		requestId = buf->msg.setTemp.requestId;
+		rslt = Heat::SetTemperature(buf->msg.setTemp, replyRef);
+		break;
+
+	case CanMessageType::heaterTuningCommand:
+		requestId = buf->msg.heaterTuningCommand.requestId;
+		rslt = Heat::TuningCommand(buf->msg.heaterTuningCommand, replyRef);
+		break;
+
+	case CanMessageType::m308New:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ProcessM308(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::m950Fan:
+		requestId = buf->msg.generic.requestId;
+		rslt = FansManager::ConfigureFanPort(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::m950Heater:
+		requestId = buf->msg.generic.requestId;
+		rslt = Heat::ConfigureHeater(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::heaterFeedForward:
+		requestId = buf->msg.heaterFeedForward.requestId;
+		rslt = Heat::FeedForward(buf->msg.heaterFeedForward, replyRef);
+		break;
+
+	case CanMessageType::m950Gpio:
+		requestId = buf->msg.generic.requestId;
+		rslt = GpioPorts::HandleM950Gpio(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::writeGpio:
+		requestId = buf->msg.writeGpio.requestId;
+		rslt = GpioPorts::HandleGpioWrite(buf->msg.writeGpio, replyRef);
+		break;
 
 #if SUPPORT_DRIVERS
-		case CanMessageType::setMotorCurrents:
-			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
-			rslt = SetMotorCurrents(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
-			break;
-
-		case CanMessageType::m569:
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM569(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::m569p1:
-			requestId = buf->msg.generic.requestId;
+	case CanMessageType::setMotorCurrents:
+		requestId = buf->msg.multipleDrivesRequestFloat.requestId;
+		rslt = SetMotorCurrents(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
+		break;
+
+	case CanMessageType::m569:
+		requestId = buf->msg.generic.requestId;
+		rslt = ProcessM569(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::m569p1:
+		requestId = buf->msg.generic.requestId;
 # if SUPPORT_CLOSED_LOOP
-			rslt = ClosedLoop::ProcessM569Point1(buf->msg.generic, replyRef);
+		rslt = ClosedLoop::ProcessM569Point1(buf->msg.generic, replyRef);
 # else
-			rslt = GCodeResult::errorNotSupported;
+		rslt = GCodeResult::errorNotSupported;
 # endif
-			break;
+		break;
 
-		case CanMessageType::m569p2:		// read/write smart driver register
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM569Point2(buf->msg.generic, replyRef);
-			break;
+	case CanMessageType::m569p2:		// read/write smart driver register
+		requestId = buf->msg.generic.requestId;
+		rslt = ProcessM569Point2(buf->msg.generic, replyRef);
+		break;
 
-		case CanMessageType::m569p6:
-			requestId = buf->msg.generic.requestId;
+	case CanMessageType::m569p6:
+		requestId = buf->msg.generic.requestId;
 # if SUPPORT_CLOSED_LOOP
-			rslt = ClosedLoop::ProcessM569Point6(buf->msg.generic, replyRef);
+		rslt = ClosedLoop::ProcessM569Point6(buf->msg.generic, replyRef);
 # else
-			rslt = GCodeResult::errorNotSupported;
+		rslt = GCodeResult::errorNotSupported;
 # endif
-			break;
-
-		case CanMessageType::m569p7:
-			requestId = buf->msg.generic.requestId;
-			rslt = Platform::ProcessM569Point7(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::setStandstillCurrentFactor:
-			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
-			rslt = SetStandstillCurrentFactor(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
-			break;
-
-		case CanMessageType::setStepsPerMmAndMicrostepping:
-			requestId = buf->msg.multipleDrivesStepsPerUnitAndMicrostepping.requestId;
-			rslt = SetStepsPerMmAndMicrostepping(buf->msg.multipleDrivesStepsPerUnitAndMicrostepping, buf->dataLength, replyRef);
-			break;
-
-		case CanMessageType::setDriverStates:
-			requestId = buf->msg.multipleDrivesRequestUint16.requestId;
-			rslt = HandleSetDriverStates(buf->msg.multipleDrivesRequestDriverState, replyRef);
-			break;
-
-		case CanMessageType::m915:
-			requestId = buf->msg.generic.requestId;
-			rslt = ProcessM915(buf->msg.generic, replyRef);
-			break;
-
-		case CanMessageType::setPressureAdvance:
-			requestId = buf->msg.multipleDrivesRequestFloat.requestId;
-			rslt = HandlePressureAdvance(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
-			break;
+		break;
+
+	case CanMessageType::m569p7:
+		requestId = buf->msg.generic.requestId;
+		rslt = Platform::ProcessM569Point7(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::setStandstillCurrentFactor:
+		requestId = buf->msg.multipleDrivesRequestFloat.requestId;
+		rslt = SetStandstillCurrentFactor(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
+		break;
+
+	case CanMessageType::setStepsPerMmAndMicrostepping:
+		requestId = buf->msg.multipleDrivesStepsPerUnitAndMicrostepping.requestId;
+		rslt = SetStepsPerMmAndMicrostepping(buf->msg.multipleDrivesStepsPerUnitAndMicrostepping, buf->dataLength, replyRef);
+		break;
+
+	case CanMessageType::setDriverStates:
+		requestId = buf->msg.multipleDrivesRequestUint16.requestId;
+		rslt = HandleSetDriverStates(buf->msg.multipleDrivesRequestDriverState, buf->dataLength, replyRef);
+		break;
+
+	case CanMessageType::m915:
+		requestId = buf->msg.generic.requestId;
+		rslt = ProcessM915(buf->msg.generic, replyRef);
+		break;
+
+	case CanMessageType::setPressureAdvance:
+		requestId = buf->msg.multipleDrivesRequestFloat.requestId;
+		rslt = HandlePressureAdvance(buf->msg.multipleDrivesRequestFloat, buf->dataLength, replyRef);
+		break;
 #endif
 
-		case CanMessageType::updateFirmware:
-			requestId = buf->msg.updateYourFirmware.requestId;
-			rslt = InitiateFirmwareUpdate(buf->msg.updateYourFirmware, replyRef);
-			break;
-
-		case CanMessageType::reset:
-			requestId = buf->msg.reset.requestId;
-			rslt = InitiateReset(buf->msg.reset, replyRef);
-			break;
-
-		case CanMessageType::fanParameters:
-			requestId = buf->msg.fanParameters.requestId;
-			rslt = FansManager::ConfigureFan(buf->msg.fanParameters, replyRef);
-			break;
-
-		case CanMessageType::setFanSpeed:
-			requestId = buf->msg.setFanSpeed.requestId;
-			rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, replyRef);
-			break;
-
-		case CanMessageType::setHeaterFaultDetection:
-			requestId = buf->msg.setHeaterFaultDetection.requestId;
-			rslt = Heat::SetFaultDetection(buf->msg.setHeaterFaultDetection, replyRef);
-			break;
-
-		case CanMessageType::setHeaterMonitors:
-			requestId = buf->msg.setHeaterMonitors.requestId;
-			rslt = Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, replyRef);
-			break;
-
-		case CanMessageType::createInputMonitor:
-			requestId = buf->msg.createInputMonitor.requestId;
-			rslt = InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, replyRef, extra);
-			break;
-
-		case CanMessageType::changeInputMonitor:
-			requestId = buf->msg.changeInputMonitor.requestId;
-			rslt = InputMonitor::Change(buf->msg.changeInputMonitor, replyRef, extra);
-			break;
-
-		case CanMessageType::readInputsRequest:
-			// This one has its own reply message type
-			InputMonitor::ReadInputs(buf);
-			CanInterface::SendAndFree(buf);
-			return;
+	case CanMessageType::updateFirmware:
+		requestId = buf->msg.updateYourFirmware.requestId;
+		rslt = InitiateFirmwareUpdate(buf->msg.updateYourFirmware, replyRef);
+		break;
+
+	case CanMessageType::reset:
+		requestId = buf->msg.reset.requestId;
+		rslt = InitiateReset(buf->msg.reset, replyRef);
+		break;
+
+	case CanMessageType::fanParameters:
+		requestId = buf->msg.fanParameters.requestId;
+		rslt = FansManager::ConfigureFan(buf->msg.fanParameters, replyRef);
+		break;
+
+	case CanMessageType::setFanSpeed:
+		requestId = buf->msg.setFanSpeed.requestId;
+		rslt = FansManager::SetFanSpeed(buf->msg.setFanSpeed, replyRef);
+		break;
+
+	case CanMessageType::setHeaterFaultDetection:
+		requestId = buf->msg.setHeaterFaultDetection.requestId;
+		rslt = Heat::SetFaultDetection(buf->msg.setHeaterFaultDetection, replyRef);
+		break;
+
+	case CanMessageType::setHeaterMonitors:
+		requestId = buf->msg.setHeaterMonitors.requestId;
+		rslt = Heat::SetHeaterMonitors(buf->msg.setHeaterMonitors, replyRef);
+		break;
+
+	case CanMessageType::createInputMonitor:
+		requestId = buf->msg.createInputMonitor.requestId;
+		rslt = InputMonitor::Create(buf->msg.createInputMonitor, buf->dataLength, replyRef, extra);
+		break;
+
+	case CanMessageType::changeInputMonitor:
+		requestId = buf->msg.changeInputMonitor.requestId;
+		rslt = InputMonitor::Change(buf->msg.changeInputMonitor, replyRef, extra);
+		break;
+
+	case CanMessageType::readInputsRequest:
+		// This one has its own reply message type
+		InputMonitor::ReadInputs(buf);
+		CanInterface::SendReplyAndFree(buf);
+		return;
 
-		case CanMessageType::setAddressAndNormalTiming:
-			requestId = buf->msg.setAddressAndNormalTiming.requestId;
-			rslt = CanInterface::ChangeAddressAndDataRate(buf->msg.setAddressAndNormalTiming, replyRef);
-			break;
+	case CanMessageType::setAddressAndNormalTiming:
+		requestId = buf->msg.setAddressAndNormalTiming.requestId;
+		rslt = CanInterface::ChangeAddressAndDataRate(buf->msg.setAddressAndNormalTiming, replyRef);
+		break;
 
 #if 0
-		case CanMessageType::setFastTiming:
-			requestId = buf->msg.setFastTiming.requestId;
-			rslt = CanInterface::SetFastTiming(buf->msg.setFastTiming, replyRef);
-			break;
+	case CanMessageType::setFastTiming:
+		requestId = buf->msg.setFastTiming.requestId;
+		rslt = CanInterface::SetFastTiming(buf->msg.setFastTiming, replyRef);
+		break;
 #endif
 
-		case CanMessageType::diagnosticTest:
-			requestId = buf->msg.diagnosticTest.requestId;
-			rslt = Platform::DoDiagnosticTest(buf->msg.diagnosticTest, replyRef);
-			break;
+	case CanMessageType::diagnosticTest:
+		requestId = buf->msg.diagnosticTest.requestId;
+		rslt = Platform::DoDiagnosticTest(buf->msg.diagnosticTest, replyRef);
+		break;
 
 #if SUPPORT_DRIVERS
-		case CanMessageType::createFilamentMonitor:
-			requestId = buf->msg.createFilamentMonitor.requestId;
-			rslt = FilamentMonitor::Create(buf->msg.createFilamentMonitor, replyRef);
-			break;
-
-		case CanMessageType::deleteFilamentMonitor:
-			requestId = buf->msg.deleteFilamentMonitor.requestId;
-			rslt = FilamentMonitor::Delete(buf->msg.deleteFilamentMonitor, replyRef);
-			break;
-
-		case CanMessageType::configureFilamentMonitor:
-			requestId = buf->msg.generic.requestId;
-			rslt = FilamentMonitor::Configure(buf->msg.generic, replyRef);
-			break;
+	case CanMessageType::createFilamentMonitor:
+		requestId = buf->msg.createFilamentMonitor.requestId;
+		rslt = FilamentMonitor::Create(buf->msg.createFilamentMonitor, replyRef);
+		break;
+
+	case CanMessageType::deleteFilamentMonitor:
+		requestId = buf->msg.deleteFilamentMonitor.requestId;
+		rslt = FilamentMonitor::Delete(buf->msg.deleteFilamentMonitor, replyRef);
+		break;
+
+	case CanMessageType::configureFilamentMonitor:
+		requestId = buf->msg.generic.requestId;
+		rslt = FilamentMonitor::Configure(buf->msg.generic, replyRef);
+		break;
 #endif
 
 #if SUPPORT_CLOSED_LOOP
-		case CanMessageType::startClosedLoopDataCollection:
-			requestId = buf->msg.startClosedLoopDataCollection.requestId;
-			rslt = ClosedLoop::ProcessM569Point5(buf->msg.startClosedLoopDataCollection, replyRef);
-			break;
+	case CanMessageType::startClosedLoopDataCollection:
+		requestId = buf->msg.startClosedLoopDataCollection.requestId;
+		rslt = ClosedLoop::ProcessM569Point5(buf->msg.startClosedLoopDataCollection, replyRef);
+		break;
 #endif
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
-		case CanMessageType::accelerometerConfig:
-			requestId = buf->msg.generic.requestId;
-			rslt = AccelerometerHandler::ProcessConfigRequest(buf->msg.generic, replyRef);
-			break;
+#if SUPPORT_ACCELEROMETERS
+	case CanMessageType::accelerometerConfig:
+		requestId = buf->msg.generic.requestId;
+		rslt = AccelerometerHandler::ProcessConfigRequest(buf->msg.generic, replyRef);
+		break;
 
-		case CanMessageType::startAccelerometer:
-			requestId = buf->msg.startAccelerometer.requestId;
-			rslt = AccelerometerHandler::ProcessStartRequest(buf->msg.startAccelerometer, replyRef);
-			break;
+	case CanMessageType::startAccelerometer:
+		requestId = buf->msg.startAccelerometer.requestId;
+		rslt = AccelerometerHandler::ProcessStartRequest(buf->msg.startAccelerometer, replyRef);
+		break;
 #endif
-		default:
-			// We received a message type that we don't recognise. If it's a broadcast, ignore it. If it's addressed to us, send a reply.
-			if (buf->id.Src() != CanInterface::GetCanAddress())
+	default:
+		// We received a message type that we don't recognise. If it's a broadcast, ignore it. If it's addressed to us, send a reply.
+		if (buf->id.Src() != CanInterface::GetCanAddress())
+		{
+			CanMessageBuffer::Free(buf);
+			return;
+		}
+		requestId = CanRequestIdAcceptAlways;
+		reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
+		rslt = GCodeResult::error;
+		break;
+	}
+
+	if (requestId == CanRequestIdNoReplyNeeded)
+	{
+		CanMessageBuffer::Free(buf);					// no reply wanted so discard the response and free the buffer
+	}
+	else
+	{
+		// Re-use the message buffer to send a standard reply
+		const CanAddress srcAddress = buf->id.Src();
+		CanMessageStandardReply *msg = buf->SetupResponseMessage<CanMessageStandardReply>(requestId, CanInterface::GetCanAddress(), srcAddress);
+		msg->resultCode = (uint16_t)rslt;
+		msg->extra = extra;
+		const size_t totalLength = reply.strlen();
+		size_t lengthDone = 0;
+		uint8_t fragmentNumber = 0;
+		for (;;)
+		{
+			const size_t fragmentLength = min<size_t>(totalLength - lengthDone, CanMessageStandardReply::MaxTextLength);
+			memcpy(msg->text, reply.c_str() + lengthDone, fragmentLength);
+			lengthDone += fragmentLength;
+			buf->dataLength = msg->GetActualDataLength(fragmentLength);
+			msg->fragmentNumber = fragmentNumber;
+			if (lengthDone == totalLength)
 			{
-				CanMessageBuffer::Free(buf);
-				return;
+				msg->moreFollows = false;
+				CanInterface::SendReplyAndFree(buf);
+				break;
 			}
-			requestId = CanRequestIdAcceptAlways;
-			reply.printf("Board %u received unknown msg type %u", CanInterface::GetCanAddress(), (unsigned int)buf->id.MsgType());
-			rslt = GCodeResult::error;
-			break;
+			msg->moreFollows = true;
+			CanInterface::SendReply(buf);
+			++fragmentNumber;
 		}
+	}
+}
+
+#if SUPPORT_COMMAND_WORKER
+
+// Commands that may take a long time are processed by the worker task, so that the commands behind them don't have to wait.
+// The main board waits for the reply to each request independently, so the worker just sends the normal reply when it has finished.
+// To keep the commands for each subsystem in order, the main task waits for the worker to finish before it processes another command in the same class.
+enum class CommandClass : uint8_t
+{
+	normal = 0,
+	closedLoop,
+	filamentMonitor,
+	accelerometer
+};
+
+constexpr uint32_t CommandWorkerTaskStackWords = 850;				// the same as the main task, because the worker runs the same command handlers
+static Task<CommandWorkerTaskStackWords> commandWorkerTask;
+
+static CanMessageBuffer * volatile workerBuffer = nullptr;			// the command that the worker is processing, or nullptr if it is idle
+static CommandClass workerCommandClass = CommandClass::normal;
+static unsigned int commandsOffloaded = 0;
+static uint32_t maxWorkerCommandTime = 0;							// in milliseconds
+
+static CommandClass GetCommandClass(CanMessageType id) noexcept
+{
+	switch (id)
+	{
+	case CanMessageType::m569p1:
+	case CanMessageType::m569p6:
+	case CanMessageType::startClosedLoopDataCollection:
+		return CommandClass::closedLoop;
+
+	case CanMessageType::createFilamentMonitor:
+	case CanMessageType::deleteFilamentMonitor:
+	case CanMessageType::configureFilamentMonitor:
+		return CommandClass::filamentMonitor;
+
+	case CanMessageType::accelerometerConfig:
+	case CanMessageType::startAccelerometer:
+		return CommandClass::accelerometer;
+
+	default:
+		return CommandClass::normal;
+	}
+}
+
+// Return true if a command may take long enough that we should process it on the worker task
+static bool IsLongRunning(CanMessageType id) noexcept
+{
+	return id == CanMessageType::m569p6							// closed loop tuning, which may also write the tuning results to NVM
+		|| id == CanMessageType::createFilamentMonitor
+		|| id == CanMessageType::accelerometerConfig;				// this configures the accelerometer over I2C or SPI
+}
 
-		if (requestId == CanRequestIdNoReplyNeeded)
+[[noreturn]] static void CommandWorkerTaskLoop(void *) noexcept
+{
+	for (;;)
+	{
+		TaskBase::Take();
+		CanMessageBuffer * const buf = workerBuffer;
+		if (buf != nullptr)
 		{
-			CanMessageBuffer::Free(buf);					// no reply wanted so discard the response and free the buffer
+			const uint32_t startTime = millis();
+			ProcessCommand(buf);
+			const uint32_t timeTaken = millis() - startTime;
+			if (timeTaken > maxWorkerCommandTime)
+			{
+				maxWorkerCommandTime = timeTaken;
+			}
+			workerBuffer = nullptr;
 		}
-		else
+	}
+}
+
+void CommandProcessor::Init() noexcept
+{
+	commandWorkerTask.Create(CommandWorkerTaskLoop, "CMDWORK", nullptr, TaskPriority::SpinPriority);
+}
+
+void CommandProcessor::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Commands offloaded %u, max time %" PRIu32 "ms", commandsOffloaded, maxWorkerCommandTime);
+	commandsOffloaded = 0;
+	maxWorkerCommandTime = 0;
+}
+
+#endif
+
+void CommandProcessor::Spin(uint32_t timeout)
+{
+	CanMessageBuffer *buf = CanInterface::GetCanCommand(timeout);
+	if (buf != nullptr)
+	{
+		Platform::OnProcessingCanMessage();
+#if SUPPORT_COMMAND_WORKER
+		const CanMessageType id = buf->id.MsgType();
+		const CommandClass cc = GetCommandClass(id);
+		if (cc != CommandClass::normal)
 		{
-			// Re-use the message buffer to send a standard reply
-			const CanAddress srcAddress = buf->id.Src();
-			CanMessageStandardReply *msg = buf->SetupResponseMessage<CanMessageStandardReply>(requestId, CanInterface::GetCanAddress(), srcAddress);
-			msg->resultCode = (uint16_t)rslt;
-			msg->extra = extra;
-			const size_t totalLength = reply.strlen();
-			size_t lengthDone = 0;
-			uint8_t fragmentNumber = 0;
-			for (;;)
+			if (cc == workerCommandClass)
 			{
-				const size_t fragmentLength = min<size_t>(totalLength - lengthDone, CanMessageStandardReply::MaxTextLength);
-				memcpy(msg->text, reply.c_str() + lengthDone, fragmentLength);
-				lengthDone += fragmentLength;
-				buf->dataLength = msg->GetActualDataLength(fragmentLength);
-				msg->fragmentNumber = fragmentNumber;
-				if (lengthDone == totalLength)
+				while (workerBuffer != nullptr)
 				{
-					msg->moreFollows = false;
-					CanInterface::SendAndFree(buf);
-					break;
+					delay(1);										// the worker is processing an earlier command for the same subsystem, so wait for it
 				}
-				msg->moreFollows = true;
-				CanInterface::Send(buf);
-				++fragmentNumber;
+			}
+			if (workerBuffer == nullptr && IsLongRunning(id))
+			{
+				workerCommandClass = cc;
+				++commandsOffloaded;
+				workerBuffer = buf;
+				commandWorkerTask.Give();
+				return;
 			}
 		}
+#endif
+		ProcessCommand(buf);
 	}
 }
 
@@ -12,7 +12,11 @@
 
 namespace CommandProcessor
 {
-	void Spin();
+	void Spin(uint32_t timeout);			// process a CAN command, waiting up to timeout milliseconds for one to arrive
+#if SUPPORT_COMMAND_WORKER
+	void Init() noexcept;					// create the task that processes long-running commands
+	void Diagnostics(const StringRef& reply) noexcept;
+#endif
 }
 
 #endif /* SRC_COMMANDPROCESSING_COMMANDPROCESSOR_H_ */
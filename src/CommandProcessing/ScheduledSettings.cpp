@@ -0,0 +1,246 @@
+/*
+ * ScheduledSettings.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "ScheduledSettings.h"
+#include <Platform.h>
+#include <Fans/FansManager.h>
+
+#if SUPPORT_DRIVERS
+# if SUPPORT_TMC22xx
+#  include "Movement/StepperDrivers/TMC22xx.h"
+# endif
+# if SUPPORT_TMC51xx || SUPPORT_TMC2160
+#  include "Movement/StepperDrivers/TMC51xx.h"
+# endif
+#endif
+
+#if SUPPORT_SCHEDULED_SETTINGS
+# include <Movement/StepTimer.h>
+# include <RTOSIface/RTOSIface.h>
+# include <TaskPriorities.h>
+#endif
+
+namespace ScheduledSettings
+{
+	static void Apply(Setting setting, unsigned int index, float value) noexcept
+	{
+		switch (setting)
+		{
+#if SUPPORT_DRIVERS
+# if HAS_SMART_DRIVERS
+		case Setting::motorCurrent:
+			Platform::SetMotorCurrent(index, value);
+			break;
+
+		case Setting::standstillCurrent:
+			SmartDrivers::SetStandstillCurrentPercent(index, value);
+			break;
+# endif
+
+		case Setting::pressureAdvance:
+			Platform::SetPressureAdvance(index, value);
+			break;
+#endif
+
+		case Setting::fanSpeed:
+			FansManager::SetFanValue(index, value);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+#if SUPPORT_SCHEDULED_SETTINGS
+
+	constexpr size_t MaxPendingSettings = 16;
+	constexpr size_t TaskStackWords = 150;							// the setters don't format any text, so they need little stack
+
+	struct PendingSetting
+	{
+		uint32_t whenToApply;										// local step clock time
+		float value;
+		Setting setting;
+		uint8_t index;
+	};
+
+	static PendingSetting pendingSettings[MaxPendingSettings];
+	static size_t numPending = 0;
+	static StepTimer settingsTimer;
+	static Task<TaskStackWords> settingsTask;
+	static uint32_t numScheduled = 0, numLate = 0, maxLatency = 0;
+
+	static void SettingsTimerCallback(CallbackParameter) noexcept
+	{
+		settingsTask.GiveFromISR();
+	}
+
+	// Find the pending setting that is due soonest, not counting pressure advance. Called with the scheduler locked.
+	static bool GetNextTimedSetting(size_t& slot) noexcept
+	{
+		bool found = false;
+		for (size_t i = 0; i < numPending; ++i)
+		{
+			if (   pendingSettings[i].setting != Setting::pressureAdvance
+				&& (!found || (int32_t)(pendingSettings[i].whenToApply - pendingSettings[slot].whenToApply) < 0)
+			   )
+			{
+				slot = i;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// Task to apply the settings that are due, in time order, then sleep until the next one is due or a new one is queued
+	[[noreturn]] static void SettingsTaskLoop(void *) noexcept
+	{
+		settingsTimer.SetCallback(SettingsTimerCallback, CallbackParameter(nullptr));
+		for (;;)
+		{
+			bool haveNext;
+			uint32_t whenNext = 0;
+			for (;;)
+			{
+				PendingSetting ps;
+				{
+					TaskCriticalSectionLocker lock;
+					size_t slot;
+					haveNext = GetNextTimedSetting(slot);
+					if (!haveNext)
+					{
+						break;
+					}
+					whenNext = pendingSettings[slot].whenToApply;
+					if ((int32_t)(whenNext - StepTimer::GetTimerTicks()) > 0)
+					{
+						break;
+					}
+					ps = pendingSettings[slot];
+					pendingSettings[slot] = pendingSettings[--numPending];
+				}
+
+				const uint32_t latency = StepTimer::GetTimerTicks() - ps.whenToApply;
+				if (latency > maxLatency)
+				{
+					maxLatency = latency;
+				}
+				Apply(ps.setting, ps.index, ps.value);
+			}
+
+			if (!haveNext || !settingsTimer.ScheduleCallback(whenNext))
+			{
+				(void)TaskBase::Take();
+			}
+		}
+	}
+
+# if SUPPORT_DRIVERS
+	// Apply the pressure advance changes that are due by the time the move starts, in time order
+	static void ApplyPressureAdvance(uint32_t moveStartTime) noexcept
+	{
+		for (;;)
+		{
+			PendingSetting ps;
+			{
+				TaskCriticalSectionLocker lock;
+				size_t slot = numPending;
+				for (size_t i = 0; i < numPending; ++i)
+				{
+					if (   pendingSettings[i].setting == Setting::pressureAdvance
+						&& (int32_t)(moveStartTime - pendingSettings[i].whenToApply) >= 0
+						&& (slot == numPending || (int32_t)(pendingSettings[i].whenToApply - pendingSettings[slot].whenToApply) < 0)
+					   )
+					{
+						slot = i;
+					}
+				}
+				if (slot == numPending)
+				{
+					return;
+				}
+				ps = pendingSettings[slot];
+				pendingSettings[slot] = pendingSettings[--numPending];
+			}
+			Apply(ps.setting, ps.index, ps.value);
+		}
+	}
+# endif
+
+#endif
+}
+
+#if SUPPORT_SCHEDULED_SETTINGS
+
+void ScheduledSettings::Init() noexcept
+{
+	settingsTask.Create(SettingsTaskLoop, "SETTINGS", nullptr, TaskPriority::ScheduledSettingsPriority);
+}
+
+#endif
+
+GCodeResult ScheduledSettings::Set(Setting setting, unsigned int index, float value, SettingTrigger trigger, uint32_t masterTime, const StringRef& reply) noexcept
+{
+	if (trigger == SettingTrigger::immediate)
+	{
+		Apply(setting, index, value);
+		return GCodeResult::ok;
+	}
+
+#if SUPPORT_SCHEDULED_SETTINGS
+	const uint32_t whenToApply = StepTimer::ConvertToLocalTime(masterTime);
+	{
+		TaskCriticalSectionLocker lock;
+		if (numPending == MaxPendingSettings)
+		{
+			reply.printf("Too many scheduled settings, maximum is %u", (unsigned int)MaxPendingSettings);
+			return GCodeResult::error;
+		}
+		pendingSettings[numPending++] = { whenToApply, value, setting, (uint8_t)index };
+		++numScheduled;
+	}
+
+	if (setting != Setting::pressureAdvance)
+	{
+		if ((int32_t)(whenToApply - StepTimer::GetTimerTicks()) <= 0)
+		{
+			++numLate;
+		}
+		settingsTask.Give();										// the task reschedules its timer to include the new setting
+	}
+	return GCodeResult::ok;
+#else
+	(void)masterTime;
+	reply.copy("Scheduled settings are not supported by this board");
+	return GCodeResult::error;
+#endif
+}
+
+#if SUPPORT_SCHEDULED_SETTINGS
+
+# if SUPPORT_DRIVERS
+
+// Called when a move is being prepared, before the pressure advance is read
+void ScheduledSettings::MovePreparing(uint32_t moveStartTime) noexcept
+{
+	if (numPending != 0)
+	{
+		ApplyPressureAdvance(moveStartTime);
+	}
+}
+
+# endif
+
+void ScheduledSettings::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Scheduled settings %" PRIu32 ", late %" PRIu32 ", max latency %" PRIu32 "us, %u pending",
+				numScheduled, numLate, StepTimer::TicksToIntegerMicroseconds(maxLatency), (unsigned int)numPending);
+}
+
+#endif
+
+// End
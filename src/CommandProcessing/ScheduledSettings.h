@@ -0,0 +1,47 @@
+/*
+ * ScheduledSettings.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_COMMANDPROCESSING_SCHEDULEDSETTINGS_H_
+#define SRC_COMMANDPROCESSING_SCHEDULEDSETTINGS_H_
+
+#include <RepRapFirmware.h>
+
+// Module to apply configuration changes at a master time instead of whenever the command happens to be processed, so that they line up with the motion.
+// Motor currents, standstill currents and fan speeds are applied by a small task that is woken by a step timer callback at the requested time,
+// because the functions that set them take locks and wake the drivers task, so they can't be called from the step timer interrupt.
+// A pressure advance change is applied when the first move that starts at or after the requested time is prepared, because pressure advance is
+// only used when a move is prepared, and moves are prepared before they start.
+// Immediate changes go through the same functions so that the command handlers don't need to know which settings can be scheduled.
+enum class SettingTrigger : uint8_t
+{
+	immediate = 0,
+	atMasterTime				// at the specified master time, or for moves starting at or after it in the case of pressure advance
+};
+
+namespace ScheduledSettings
+{
+	enum class Setting : uint8_t
+	{
+		motorCurrent = 0,		// index is the driver, value is in mA
+		standstillCurrent,		// index is the driver, value is the percentage of the motor current
+		pressureAdvance,		// index is the driver, value is in seconds
+		fanSpeed				// index is the fan number, value is the PWM from 0 to 1
+	};
+
+	// Apply a setting now, or queue it for the specified master time. The caller must already have checked that the driver or fan exists.
+	GCodeResult Set(Setting setting, unsigned int index, float value, SettingTrigger trigger, uint32_t masterTime, const StringRef& reply) noexcept;
+
+#if SUPPORT_SCHEDULED_SETTINGS
+	void Init() noexcept;
+# if SUPPORT_DRIVERS
+	void MovePreparing(uint32_t moveStartTime) noexcept;		// called from DDA::Prepare with the local start time of the move
+# endif
+	void Diagnostics(const StringRef& reply) noexcept;
+#endif
+}
+
+#endif /* SRC_COMMANDPROCESSING_SCHEDULEDSETTINGS_H_ */
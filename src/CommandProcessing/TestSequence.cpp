@@ -0,0 +1,290 @@
+/*
+ * TestSequence.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "TestSequence.h"
+
+#if defined(ATEIO) || defined(ATECM)
+
+#include <Hardware/IoPorts.h>
+#include <AnalogIn.h>
+
+#ifdef ATEIO
+# include <Hardware/ATEIO/ExtendedAnalog.h>
+#endif
+
+namespace TestSequence
+{
+	constexpr unsigned int RecordVersion = 1;				// increase this if the format of the results record changes
+	constexpr size_t MaxSteps = 48;
+#ifdef ATEIO
+	constexpr size_t MaxScanSteps = 2;
+	constexpr size_t MaxResults = MaxSteps + MaxScanSteps * (ExtendedAnalog::NumChannels - 1);	// scan steps return a reading for each extended analog channel
+#else
+	constexpr size_t MaxResults = MaxSteps;
+#endif
+	constexpr uint32_t MaxReadingsAveraged = 64;
+	constexpr uint32_t MaxTotalDelayMillis = 1000;			// keep the sequence short enough for the main board not to time out waiting for the results
+
+	struct TestStep
+	{
+		TestStepType type;
+		uint8_t pin;
+		uint16_t value;
+	};
+
+	static TestStep steps[MaxSteps];
+	static size_t numSteps = 0;
+	static uint32_t totalDelayMillis = 0;
+#ifdef ATEIO
+	static size_t numScanSteps = 0;
+#endif
+
+	static bool IsAnalogPin(Pin pin) noexcept
+	{
+		return PinTable[pin].adc != AdcInput::none;
+	}
+
+#ifdef ATEIO
+	static bool IsExtendedAnalogStep(const TestStep& step) noexcept
+	{
+		return step.type == TestStepType::readAnalog && IsExtendedAnalogPin(step.pin);
+	}
+
+	// Read a run of consecutive extended analog input steps, starting at steps[first], batching the readings of all the channels each time round.
+	// Return the number of steps read.
+	static size_t ReadExtendedAnalogSteps(size_t first, uint32_t *totals) noexcept
+	{
+		size_t count = 0;
+		uint16_t readingsWanted = 0;
+		while (first + count < numSteps && IsExtendedAnalogStep(steps[first + count]))
+		{
+			readingsWanted = max<uint16_t>(readingsWanted, steps[first + count].value);
+			totals[count] = 0;
+			++count;
+		}
+
+		uint8_t chans[MaxSteps];
+		uint16_t readings[MaxSteps];
+		size_t stepIndices[MaxSteps];
+		for (uint16_t reading = 0; reading < readingsWanted; ++reading)
+		{
+			// Build the list of channels that still need more readings
+			size_t numChans = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (steps[first + i].value > reading)
+				{
+					chans[numChans] = GetInputNumber(PinTable[steps[first + i].pin].adc);
+					stepIndices[numChans] = i;
+					++numChans;
+				}
+			}
+
+			(void)ExtendedAnalog::AnalogInMultiple(chans, numChans, readings);
+			for (size_t j = 0; j < numChans; ++j)
+			{
+				uint32_t& total = totals[stepIndices[j]];
+				if (readings[j] & 0x8000)
+				{
+					total = 0x80000000 | readings[j];				// remember the error code, it overrides the readings
+				}
+				else if ((total & 0x80000000) == 0)
+				{
+					total += readings[j];
+				}
+			}
+		}
+		return count;
+	}
+#endif
+}
+
+// Add a step to the sequence. The pin is the index of the pin in the pin table.
+GCodeResult TestSequence::AddStep(uint16_t type, uint32_t pin, uint32_t value, const StringRef& reply) noexcept
+{
+	if (type >= (uint16_t)TestStepType::numTypes)
+	{
+		reply.printf("Bad test step type %u", type);
+		return GCodeResult::error;
+	}
+
+	const TestStepType stepType = (TestStepType)type;
+	if (stepType == TestStepType::clear)
+	{
+		numSteps = 0;
+		totalDelayMillis = 0;
+#ifdef ATEIO
+		numScanSteps = 0;
+#endif
+		return GCodeResult::ok;
+	}
+
+	if (numSteps == MaxSteps)
+	{
+		reply.copy("Too many test steps");
+		return GCodeResult::error;
+	}
+
+	switch (stepType)
+	{
+	case TestStepType::delay:
+		if (totalDelayMillis + value > MaxTotalDelayMillis)
+		{
+			reply.printf("Total test sequence delay must not exceed %" PRIu32 "ms", MaxTotalDelayMillis);
+			return GCodeResult::error;
+		}
+		totalDelayMillis += value;
+		pin = 0;
+		break;
+
+	case TestStepType::readAnalog:
+		if (pin >= NumPins || PinTable[pin].pinNames == nullptr || !IsAnalogPin(pin))
+		{
+			reply.printf("Pin %" PRIu32 " is not an analog input", pin);
+			return GCodeResult::error;
+		}
+		if (value == 0 || value > MaxReadingsAveraged)
+		{
+			reply.printf("Number of readings must be 1 to %" PRIu32, MaxReadingsAveraged);
+			return GCodeResult::error;
+		}
+#ifdef ATEIO
+		if (!IsExtendedAnalogPin(pin))
+#endif
+		{
+			IoPort::SetPinMode(pin, AIN);
+			AnalogInEnableChannel(PinTable[pin].adc, true);
+		}
+		break;
+
+	case TestStepType::scanExtendedAnalog:
+#ifdef ATEIO
+		if (value == 0 || value > ExtendedAnalog::MaxScans)
+		{
+			reply.printf("Number of scans must be 1 to %u", ExtendedAnalog::MaxScans);
+			return GCodeResult::error;
+		}
+		if (numScanSteps == MaxScanSteps)
+		{
+			reply.printf("Too many scan steps, max %u", (unsigned int)MaxScanSteps);
+			return GCodeResult::error;
+		}
+		++numScanSteps;
+		pin = 0;
+		break;
+#else
+		reply.copy("This board has no extended analog inputs");
+		return GCodeResult::error;
+#endif
+
+	case TestStepType::writeOutput:
+	case TestStepType::readDigital:
+	default:
+#ifdef ATEIO
+		if (pin >= NumPhysicalPins || PinTable[pin].pinNames == nullptr)
+#else
+		if (pin >= NumPins || PinTable[pin].pinNames == nullptr)
+#endif
+		{
+			reply.printf("Pin %" PRIu32 " can't be used for digital I/O", pin);
+			return GCodeResult::error;
+		}
+		if (stepType == TestStepType::writeOutput)
+		{
+			value = (value != 0) ? 1 : 0;
+		}
+		break;
+	}
+
+	TestStep& step = steps[numSteps++];
+	step.type = stepType;
+	step.pin = (uint8_t)pin;
+	step.value = (uint16_t)value;
+	return GCodeResult::ok;
+}
+
+// Run the sequence. The results record is: version, colon, the time taken in milliseconds, colon, then the result of each read step in hex separated by commas.
+// Analog results are the sum of the readings taken, so that the main board doesn't lose the extra resolution from averaging.
+// A scan step gives the averaged reading of each extended analog channel in channel order.
+// An extended analog input that couldn't be read is reported as 80008000 if the SPI bus wasn't available or 80008001 if the ADC returned the wrong channel.
+void TestSequence::Run(const StringRef& reply) noexcept
+{
+	const uint32_t startTime = millis();
+	uint32_t results[MaxResults];
+	size_t numResults = 0;
+
+	for (size_t i = 0; i < numSteps; )
+	{
+		const TestStep& step = steps[i];
+		switch (step.type)
+		{
+		case TestStepType::writeOutput:
+			IoPort::SetPinMode(step.pin, (step.value != 0) ? OUTPUT_HIGH : OUTPUT_LOW);
+			break;
+
+		case TestStepType::readDigital:
+			results[numResults++] = (IoPort::ReadPin(step.pin)) ? 1 : 0;
+			break;
+
+		case TestStepType::readAnalog:
+#ifdef ATEIO
+			if (IsExtendedAnalogPin(step.pin))
+			{
+				const size_t count = ReadExtendedAnalogSteps(i, results + numResults);
+				numResults += count;
+				i += count;
+				continue;
+			}
+#endif
+			{
+				// The internal ADC converts the enabled channels continuously, so wait for a new conversion between readings
+				uint32_t total = 0;
+				for (uint16_t reading = 0; reading < step.value; ++reading)
+				{
+					if (reading != 0)
+					{
+						delay(1);
+					}
+					total += AnalogIn::ReadChannel(PinTable[step.pin].adc);
+				}
+				results[numResults++] = total;
+			}
+			break;
+
+		case TestStepType::delay:
+			delay(step.value);
+			break;
+
+#ifdef ATEIO
+		case TestStepType::scanExtendedAnalog:
+			{
+				ExtendedAnalog::ScanResults scan;
+				(void)ExtendedAnalog::Scan(step.value, scan);
+				for (uint16_t reading : scan.readings)
+				{
+					results[numResults++] = (reading & 0x8000) ? 0x80000000 | reading : reading;
+				}
+			}
+			break;
+#endif
+
+		default:
+			break;
+		}
+		++i;
+	}
+
+	reply.printf("%u:%" PRIu32 ":", RecordVersion, millis() - startTime);
+	for (size_t i = 0; i < numResults; ++i)
+	{
+		reply.catf((i == 0) ? "%" PRIx32 : ",%" PRIx32, results[i]);
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,38 @@
+/*
+ * TestSequence.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_COMMANDPROCESSING_TESTSEQUENCE_H_
+#define SRC_COMMANDPROCESSING_TESTSEQUENCE_H_
+
+#include <RepRapFirmware.h>
+
+#if defined(ATEIO) || defined(ATECM)
+
+// Types of test sequence step. The main board sends these as diagnostic test 220, so the values must not change.
+enum class TestStepType : uint8_t
+{
+	clear = 0,								// delete all the steps
+	writeOutput,							// set a digital output, value is 0 or 1
+	readDigital,							// read a digital input
+	readAnalog,								// read an analog input, value is the number of readings to average
+	delay,									// wait, value is the time in milliseconds
+	scanExtendedAnalog,						// read all the extended analog inputs (ATEIO only), value is the number of scans to average
+	numTypes
+};
+
+// Module to run a scripted sequence of I/O operations and measurements on the ATE, so that the main board can run a whole test with one request
+// instead of one CAN round trip per step. The main board sends the steps one at a time, then requests the results record which runs the sequence.
+// Consecutive readings of the extended analog inputs are batched into one SPI transaction.
+namespace TestSequence
+{
+	GCodeResult AddStep(uint16_t type, uint32_t pin, uint32_t value, const StringRef& reply) noexcept;
+	void Run(const StringRef& reply) noexcept;				// run the sequence and append the results record
+}
+
+#endif
+
+#endif /* SRC_COMMANDPROCESSING_TESTSEQUENCE_H_ */
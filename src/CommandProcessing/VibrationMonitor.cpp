@@ -0,0 +1,177 @@
+/*
+ * VibrationMonitor.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "VibrationMonitor.h"
+#include <RTOSIface/RTOSIface.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+// Set up the window length and thresholds. We assume the +/-2g range, which all the supported accelerometers use.
+void VibrationMonitor::Configure(uint16_t samplingRate, uint8_t resolution, uint32_t windowMillis, uint32_t p_rmsThreshold, uint32_t p_peakThreshold) noexcept
+{
+	windowSamples = max<uint32_t>(((uint32_t)samplingRate * windowMillis)/1000, 1);
+	milliGPerCount = 2000.0/(float)(1u << (resolution - 1));
+	rmsThreshold = p_rmsThreshold;
+	peakThreshold = p_peakThreshold;
+}
+
+// Enable or disable acceleration limiting. The limit starts at the full acceleration.
+void VibrationMonitor::SetAccelerationLimiting(uint32_t p_targetRms) noexcept
+{
+	TaskCriticalSectionLocker lock;
+	targetRms = p_targetRms;
+	accelLimit = 1.0;
+	lastResults.accelLimitPercent = (targetRms == 0) ? 0 : 100;
+}
+
+void VibrationMonitor::Start() noexcept
+{
+	memset(sum, 0, sizeof(sum));
+	memset(sumOfSquares, 0, sizeof(sumOfSquares));
+	memset(sumOfDifferenceSquares, 0, sizeof(sumOfDifferenceSquares));
+	memset(peakDeviation, 0, sizeof(peakDeviation));
+	samplesInWindow = movingSamplesInWindow = 0;
+	haveReference = false;
+}
+
+void VibrationMonitor::AddSample(const int16_t sample[3], bool moving) noexcept
+{
+	if (!haveReference)
+	{
+		// Use the first sample as the reference until we have the mean of a window
+		memcpy(reference, sample, sizeof(reference));
+		memcpy(previousSample, sample, sizeof(previousSample));
+		haveReference = true;
+	}
+
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		// The squares are calculated as unsigned values because the square of the difference between two 16-bit values may not fit in an int32_t
+		const int32_t deviation = (int32_t)sample[axis] - (int32_t)reference[axis];
+		sum[axis] += deviation;
+		const uint32_t absDeviation = (uint32_t)labs(deviation);
+		sumOfSquares[axis] += absDeviation * absDeviation;
+		if (absDeviation > peakDeviation[axis])
+		{
+			peakDeviation[axis] = absDeviation;
+		}
+		const uint32_t absDifference = (uint32_t)labs((int32_t)sample[axis] - (int32_t)previousSample[axis]);
+		sumOfDifferenceSquares[axis] += absDifference * absDifference;
+		previousSample[axis] = sample[axis];
+	}
+
+	if (moving)
+	{
+		++movingSamplesInWindow;
+	}
+	if (++samplesInWindow >= windowSamples)
+	{
+		EndWindow();
+	}
+}
+
+// Calculate the results for the window just completed and check the thresholds. Floating point is used only once per window.
+void VibrationMonitor::EndWindow() noexcept
+{
+	Results results;
+	bool exceeded = false;
+	uint32_t maxRms = 0;
+	for (unsigned int axis = 0; axis < 3; ++axis)
+	{
+		const float mean = (float)sum[axis]/(float)samplesInWindow;
+		const float variance = max<float>((float)sumOfSquares[axis]/(float)samplesInWindow - fsquare(mean), 0.0);
+		const uint32_t rms = lrintf(sqrtf(variance) * milliGPerCount);
+		const uint32_t peak = lrintf((float)peakDeviation[axis] * milliGPerCount);
+		results.rms[axis] = min<uint32_t>(rms, UINT16_MAX);
+		maxRms = max<uint32_t>(maxRms, rms);
+		results.peak[axis] = min<uint32_t>(peak, UINT16_MAX);
+		results.band[axis] = min<uint32_t>(lrintf(sqrtf((float)sumOfDifferenceSquares[axis]/(float)samplesInWindow) * milliGPerCount), UINT16_MAX);
+		if ((rmsThreshold != 0 && rms > rmsThreshold) || (peakThreshold != 0 && peak > peakThreshold))
+		{
+			exceeded = true;
+		}
+
+		// Measure the next window relative to the mean of this one
+		reference[axis] = (int16_t)((int32_t)reference[axis] + lrintf(mean));
+		sum[axis] = 0;
+		sumOfSquares[axis] = sumOfDifferenceSquares[axis] = 0;
+		peakDeviation[axis] = 0;
+	}
+
+	// Update the acceleration limit, but only from windows in which the machine was moving for most of the time, because the vibration at rest tells us nothing
+	const uint32_t target = targetRms;
+	bool limited = false;
+	if (target != 0 && 2 * movingSamplesInWindow >= samplesInWindow)
+	{
+		const float newLimit = (maxRms > target) ? max<float>(accelLimit * (float)target/(float)maxRms, MinAccelLimit) : 1.0;
+		if (newLimit < accelLimit)
+		{
+			accelLimit = newLimit;
+			limited = true;
+		}
+		else
+		{
+			accelLimit += (newLimit - accelLimit) * AccelLimitRecovery;
+		}
+	}
+	results.accelLimitPercent = (target == 0) ? 0 : (uint16_t)lrintf(accelLimit * 100.0);
+	samplesInWindow = movingSamplesInWindow = 0;
+
+	TaskCriticalSectionLocker lock;
+	lastResults = results;
+	++windowsCompleted;
+	if (limited)
+	{
+		++limitedWindows;
+	}
+	if (exceeded)
+	{
+		++thresholdCrossings;
+		thresholdExceeded = true;
+	}
+}
+
+// Append the results in a compact form: windows completed, threshold crossings, threshold exceeded flag, then the RMS, peak and band values for X, Y and Z in milli-g,
+// then the recommended acceleration limit in percent if acceleration limiting is enabled
+void VibrationMonitor::AppendResults(const StringRef& reply) noexcept
+{
+	Results results;
+	uint32_t windows, crossings;
+	bool exceeded;
+	{
+		TaskCriticalSectionLocker lock;
+		results = lastResults;
+		windows = windowsCompleted;
+		crossings = thresholdCrossings;
+		exceeded = thresholdExceeded;
+		thresholdExceeded = false;
+	}
+
+	reply.printf("%" PRIu32 ":%" PRIu32 ":%u", windows, crossings, (unsigned int)exceeded);
+	if (windows != 0)
+	{
+		reply.catf(":%u,%u,%u:%u,%u,%u:%u,%u,%u", results.rms[0], results.rms[1], results.rms[2], results.peak[0], results.peak[1], results.peak[2],
+					results.band[0], results.band[1], results.band[2]);
+		if (results.accelLimitPercent != 0)
+		{
+			reply.catf(":%u", results.accelLimitPercent);
+		}
+	}
+}
+
+void VibrationMonitor::Diagnostics(const StringRef& reply) const noexcept
+{
+	reply.catf(", vibration monitor %u samples/window, windows %" PRIu32 ", threshold crossings %" PRIu32, windowSamples, windowsCompleted, thresholdCrossings);
+	if (targetRms != 0)
+	{
+		reply.catf(", accel limit %u%% for %" PRIu32 "mg, reduced %" PRIu32 " times", lastResults.accelLimitPercent, targetRms, limitedWindows);
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,78 @@
+/*
+ * VibrationMonitor.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_COMMANDPROCESSING_VIBRATIONMONITOR_H_
+#define SRC_COMMANDPROCESSING_VIBRATIONMONITOR_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+// Class to compute vibration statistics from a continuous stream of accelerometer samples, so that the main board can watch for loose belts, worn bearings and crashes
+// without collecting the raw data. Each window gives the RMS and peak deviation from the mean of each axis, and the RMS of the sample-to-sample differences,
+// which is weighted towards high frequencies and so measures the energy in the band that bearing noise and impacts produce.
+// AddSample is called by the accelerometer task. The results of the last complete window are read by the main task, so they are copied in a critical section.
+// When acceleration limiting is enabled, each window in which the machine was mostly moving also updates a recommended acceleration limit, as a fraction of the acceleration
+// the main board is using. Vibration amplitude is roughly proportional to acceleration, so the limit is the fraction that would bring the highest axis RMS down to the target.
+// It falls immediately when a window is too rough and recovers gradually when the vibration is below the target.
+class VibrationMonitor
+{
+public:
+	VibrationMonitor() noexcept
+		: windowSamples(0), rmsThreshold(0), peakThreshold(0), targetRms(0), accelLimit(1.0), windowsCompleted(0), thresholdCrossings(0), limitedWindows(0), thresholdExceeded(false) { }
+
+	// Set up the window length and thresholds. The thresholds are in milli-g, zero means no threshold.
+	void Configure(uint16_t samplingRate, uint8_t resolution, uint32_t windowMillis, uint32_t p_rmsThreshold, uint32_t p_peakThreshold) noexcept;
+	void SetAccelerationLimiting(uint32_t p_targetRms) noexcept;					// set the target RMS vibration in milli-g, zero to disable acceleration limiting
+	uint32_t GetTargetRms() const noexcept { return targetRms; }
+	void Start() noexcept;
+	void AddSample(const int16_t sample[3], bool moving) noexcept;					// add a sample, saying whether a move was being executed when it was taken
+	void AppendResults(const StringRef& reply) noexcept;							// append the results of the last window and clear the threshold flag
+	void Diagnostics(const StringRef& reply) const noexcept;
+
+private:
+	void EndWindow() noexcept;
+
+	static constexpr float MinAccelLimit = 0.2;										// we never recommend less than this fraction of the acceleration
+	static constexpr float AccelLimitRecovery = 0.25;								// the fraction of the way to the new limit that we move in each quiet window
+
+	struct Results
+	{
+		uint16_t rms[3];															// all in milli-g
+		uint16_t peak[3];
+		uint16_t band[3];
+		uint16_t accelLimitPercent;													// the recommended acceleration limit in percent, or zero if acceleration limiting is disabled
+	};
+
+	// Accumulators for the current window. Deviations are measured from the mean of the previous window, to keep the sums of squares small.
+	int32_t sum[3];
+	uint64_t sumOfSquares[3];
+	uint64_t sumOfDifferenceSquares[3];
+	uint32_t peakDeviation[3];
+	int16_t reference[3];
+	int16_t previousSample[3];
+	unsigned int samplesInWindow;
+	unsigned int movingSamplesInWindow;
+	bool haveReference;
+
+	unsigned int windowSamples;
+	float milliGPerCount;
+	uint32_t rmsThreshold;
+	uint32_t peakThreshold;
+	uint32_t targetRms;
+	float accelLimit;																// the current recommended acceleration limit as a fraction, only used by the accelerometer task
+
+	Results lastResults;															// the results of the last complete window
+	uint32_t windowsCompleted;
+	uint32_t thresholdCrossings;
+	uint32_t limitedWindows;														// the number of windows in which we reduced the acceleration limit
+	bool thresholdExceeded;															// set when a window exceeds a threshold, cleared when the results are read
+};
+
+#endif
+
+#endif /* SRC_COMMANDPROCESSING_VIBRATIONMONITOR_H_ */
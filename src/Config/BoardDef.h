@@ -40,10 +40,136 @@
 # define USE_TC_FOR_STEP				0
 #endif
 
+#ifndef SUPPORT_STEP_TABLES
+# define SUPPORT_STEP_TABLES			0
+#endif
+
 #ifndef SUPPORT_CLOSED_LOOP
 # define SUPPORT_CLOSED_LOOP			0
 #endif
 
+// A closed loop board with the coil current sense amplifiers connected to ADC1 can measure the coil currents. The board configuration file must define
+// CurrentSensePins, CurrentSenseAdcInputs, CurrentSenseZeroReading, CurrentSenseMilliampsPerCount and CurrentSenseEventChannel.
+#ifndef SUPPORT_CL_CURRENT_SENSE
+# define SUPPORT_CL_CURRENT_SENSE		0
+#endif
+
+#if SUPPORT_CL_CURRENT_SENSE && !SUPPORT_CLOSED_LOOP
+# error SUPPORT_CL_CURRENT_SENSE requires SUPPORT_CLOSED_LOOP
+#endif
+
+#ifndef SUPPORT_MOVE_TRACE
+# define SUPPORT_MOVE_TRACE				0
+#endif
+
+#ifndef SUPPORT_BENCHMARKS
+# define SUPPORT_BENCHMARKS				0			// set to 1 in a board configuration file to include the on-target benchmarks, diagnostic test 109
+#endif
+
+#ifndef SUPPORT_STEP_TIMING_STATS
+# define SUPPORT_STEP_TIMING_STATS		(SUPPORT_DRIVERS && SAME5x)	// record step timing histograms, see diagnostic tests 203 and 204
+#endif
+
+#ifndef SUPPORT_POWER_FAIL_STOP
+# define SUPPORT_POWER_FAIL_STOP		(SUPPORT_DRIVERS && HAS_VOLTAGE_MONITOR)	// stop the motors and snapshot their positions when VIN collapses, see diagnostic test 209
+#endif
+
+#ifndef SUPPORT_SPEED_OVERRIDE
+# define SUPPORT_SPEED_OVERRIDE			(SUPPORT_DRIVERS && SAME5x)	// retime queued moves when the main board changes the speed, see diagnostic test 227; this costs RAM in every DDA
+#endif
+
+#ifndef SUPPORT_ISR_PROFILING
+# define SUPPORT_ISR_PROFILING			0			// set to 1 in a board configuration file to record the time used by each interrupt source
+#endif
+
+#ifndef SUPPORT_COMMAND_WORKER
+# define SUPPORT_COMMAND_WORKER			(SAME5x)	// process long-running CAN commands on a separate task so that they don't delay later commands; this costs a task stack
+#endif
+
+#ifndef SUPPORT_CAN_CAPTURE
+# define SUPPORT_CAN_CAPTURE			(SAME5x)	// capture received CAN messages and play them back, see diagnostic test 222; the ring takes about 9Kb of RAM when first used
+#endif
+
+#ifndef SUPPORT_DEFERRED_LOG
+# define SUPPORT_DEFERRED_LOG			(SAME5x)	// log through a ring that a low priority task formats, see return info type 31; this needs the exclusive access instructions of the Cortex-M4
+#endif
+
+#if SUPPORT_DEFERRED_LOG && !SAME5x
+# error SUPPORT_DEFERRED_LOG requires a SAME5x processor
+#endif
+
+#ifndef SUPPORT_SCHEDULED_SETTINGS
+# define SUPPORT_SCHEDULED_SETTINGS		(SUPPORT_DRIVERS && SAME5x)	// apply motor currents, pressure advance and fan speeds at a master time so they line up with the motion; this costs a task stack
+#endif
+
+#ifndef SUPPORT_DATA_CAPTURE
+# define SUPPORT_DATA_CAPTURE			(SAME5x)	// sample channels from several subsystems on the step clock and stream them over CAN, see diagnostic test 233; the buffer takes 8Kb of RAM when first used
+#endif
+
+#ifndef SUPPORT_ADXL345
+# define SUPPORT_ADXL345				0			// set to 1 in a board configuration file that defines Adxl345CsPin and Adxl345Int1Pin to support an ADXL345 on the shared SPI bus
+#endif
+
+#define SUPPORT_ACCELEROMETERS			((SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH) || (SUPPORT_SPI_SENSORS && SUPPORT_ADXL345))
+
+// Thermistor ADC sampling. A board whose ADC averages several conversions before delivering a result can use fewer software readings and fewer callbacks.
+#ifndef THERMISTOR_READINGS_AVERAGED
+# define THERMISTOR_READINGS_AVERAGED	64			// the number of readings averaged in software for each thermistor, must be a power of 2 and at least 16
+#endif
+
+#ifndef THERMISTOR_ADC_CALL_INTERVAL
+# define THERMISTOR_ADC_CALL_INTERVAL	1			// the number of ADC conversion cycles per thermistor filter callback
+#endif
+
+#ifndef NUM_CAN_BUFFERS
+# define NUM_CAN_BUFFERS				40			// the number of CAN message buffers in the pool used for received commands and asynchronous messages
+#endif
+
+// Memory budgets in bytes for the subsystems that MemoryArenas accounts. Set these in a board configuration file to have M122 flag a subsystem that uses more; zero means no budget.
+#ifndef MEMORY_BUDGET_MOVEMENT
+# define MEMORY_BUDGET_MOVEMENT			0
+#endif
+
+#ifndef MEMORY_BUDGET_CLOSED_LOOP
+# define MEMORY_BUDGET_CLOSED_LOOP		0
+#endif
+
+#ifndef MEMORY_BUDGET_HEAT
+# define MEMORY_BUDGET_HEAT				0
+#endif
+
+#ifndef MEMORY_BUDGET_CAN_BUFFERS
+# define MEMORY_BUDGET_CAN_BUFFERS		0
+#endif
+
+#ifndef MEMORY_BUDGET_SENSORS
+# define MEMORY_BUDGET_SENSORS			0
+#endif
+
+#ifndef MEMORY_BUDGET_DATA_CAPTURE
+# define MEMORY_BUDGET_DATA_CAPTURE		0
+#endif
+
+#ifndef SHARED_SPI_USES_DMA
+# define SHARED_SPI_USES_DMA			0
+#endif
+
+#ifndef SHARED_I2C_USES_DMA
+# define SHARED_I2C_USES_DMA			0
+#endif
+
+#ifndef SUPPORT_INPUT_SHAPING
+# define SUPPORT_INPUT_SHAPING			SUPPORT_DRIVERS
+#endif
+
+#ifndef SUPPORT_LOCAL_RETRACTION
+# define SUPPORT_LOCAL_RETRACTION		SUPPORT_DRIVERS	// execute firmware retraction of local extruders from precomputed profiles, see diagnostic tests 228 and 229
+#endif
+
+#ifndef SUPPORT_MOVE_SHAPE_CACHE
+# define SUPPORT_MOVE_SHAPE_CACHE		SUPPORT_DRIVERS	// reuse the constants calculated when preparing a move for later moves with the same timing and step counts
+#endif
+
 #if !SUPPORT_DRIVERS
 # define HAS_SMART_DRIVERS				0
 # define SUPPORT_TMC22xx				0
@@ -53,4 +179,8 @@
 constexpr size_t NumDrivers = 0;
 #endif
 
+#ifndef SUPPORT_AUTO_MICROSTEPPING
+# define SUPPORT_AUTO_MICROSTEPPING		HAS_SMART_DRIVERS	// switch smart drivers to coarser interpolated microstepping for fast moves, see diagnostic test 230
+#endif
+
 #endif /* SRC_CONFIG_BOARDDEF_H_ */
@@ -29,6 +29,7 @@
 #define SUPPORT_SLOW_DRIVERS	0
 #define SUPPORT_DELTA_MOVEMENT	1
 #define USE_EVEN_STEPS			1
+#define SUPPORT_MOVE_TRACE		1		// keep a trace of recent moves for diagnosing missed steps
 
 // The SAMC21 can sink more current than it can source, therefore we use active low signals to drive external drivers
 #define ACTIVE_HIGH_STEP		1		// 1 = active high, 0 = active low
@@ -41,7 +42,9 @@
 #define SUPPORT_CLOSED_LOOP		1
 
 constexpr size_t NumDrivers = 1;
+constexpr unsigned int DdaRingLength = 50;					// the number of DDAs in the movement ring
 constexpr size_t MaxSmartDrivers = 1;
+constexpr size_t NumClosedLoopDrivers = 1;				// the number of drivers that can run a closed loop controller
 constexpr float MaxTmc5160Current = 6300.0;					// the maximum current we allow the TMC5160/5161 drivers to be set to in open loop mode
 constexpr uint32_t DefaultStandstillCurrentPercent = 71;
 constexpr float Tmc5160SenseResistor = 0.050;
@@ -106,6 +109,7 @@ constexpr Pin ButtonPins[] = { PortAPin(20) };
 constexpr Pin EncoderCsPin = PortAPin(18);
 
 // Shared SPI (used for interface to encoders, not for temperature sensors)
+#define SHARED_SPI_USES_DMA		1		// the encoder is read in the background using DMA
 constexpr uint8_t SspiSercomNumber = 1;
 constexpr uint32_t SspiDataInPad = 3;
 constexpr Pin SSPIMosiPin = PortAPin(16);
@@ -207,12 +211,16 @@ constexpr unsigned int StepTcNumber = 0;
 constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
 constexpr DmaChannel DmacChanAdc0Rx = 2;
+constexpr DmaChannel DmacChanSspiTx = 3;
+constexpr DmaChannel DmacChanSspiRx = 4;
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 5;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioSspiTx = 0;
+constexpr DmaPriority DmacPrioSspiRx = 3;
 
 // Interrupt priorities, lower means higher priority. 0-2 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 3;				// step interrupt is next highest, it can preempt most other interrupts
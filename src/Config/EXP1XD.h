@@ -38,6 +38,7 @@
 #define SUPPORT_TMC22xx			0
 
 constexpr size_t NumDrivers = 1;
+constexpr unsigned int DdaRingLength = 50;					// the number of DDAs in the movement ring
 
 #if DIFFERENTIAL_STEPPER_OUTPUTS
 
@@ -28,6 +28,7 @@
 #define SUPPORT_SLOW_DRIVERS	0
 #define SUPPORT_DELTA_MOVEMENT	1
 #define USE_EVEN_STEPS			0
+#define SUPPORT_MOVE_TRACE		1		// keep a trace of recent moves for diagnosing missed steps
 
 #define ACTIVE_HIGH_STEP		1		// 1 = active high, 0 = active low
 #define ACTIVE_HIGH_DIR			1		// 1 = active high, 0 = active low
@@ -48,6 +49,7 @@
 constexpr bool UseAlternateCanPins = false;
 
 constexpr size_t NumDrivers = 3;
+constexpr unsigned int DdaRingLength = 50;					// the number of DDAs in the movement ring
 constexpr size_t MaxSmartDrivers = 3;
 constexpr float MaxTmc5160Current = 6300.0;									// the maximum current we allow the TMC5160/5161 drivers to be set to
 constexpr uint32_t DefaultStandstillCurrentPercent = 71;
@@ -102,6 +104,7 @@ constexpr Pin BoardAddressPins[4] = { PortCPin(11), PortCPin(12), PortCPin(14),
 constexpr Pin TempSensePins[NumThermistorInputs] = { PortCPin(3), PortBPin(8), PortBPin(7) };
 
 // Shared SPI
+#define SHARED_SPI_USES_DMA		1		// temperature sensor transfers use DMA so that other tasks can run while they are in progress
 constexpr uint8_t SspiSercomNumber = 6;
 constexpr uint32_t SspiDataInPad = 3;
 constexpr Pin SSPIMosiPin = PortCPin(16);
@@ -235,11 +238,15 @@ constexpr IRQn Serial1_IRQn = SERCOM5_0_IRQn;
 // DMA channel assignments. Channels 0-3 have individual interrupt vectors, channels 4-31 share an interrupt vector.
 constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
+constexpr DmaChannel DmacChanSspiTx = 2;
+constexpr DmaChannel DmacChanSspiRx = 3;
 
-constexpr unsigned int NumDmaChannelsUsed = 2;			// must be at least the number of channels used, may be larger. Max 32 on the SAME51.
+constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 32 on the SAME51.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
+constexpr DmaPriority DmacPrioSspiTx = 0;
+constexpr DmaPriority DmacPrioSspiRx = 3;
 
 // Interrupt priorities, lower means higher priority. 0-2 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 3;				// step interrupt is next highest, it can preempt most other interrupts
@@ -36,6 +36,7 @@
 #define SUPPORT_TMC22xx			0
 
 constexpr size_t NumDrivers = 1;
+constexpr unsigned int DdaRingLength = 50;					// the number of DDAs in the movement ring
 
 #define USE_CCL		0			// USE_CCL also requires DIFFERENTIAL_STEPPER_OUTPUTS
 
@@ -118,6 +119,7 @@ constexpr GpioPinFunction I2CSDAPinPeriphMode = GpioPinFunction::C;
 constexpr Pin I2CSCLPin = PortAPin(23);
 constexpr GpioPinFunction I2CSCLPinPeriphMode = GpioPinFunction::C;
 #define I2C_HANDLER		SERCOM3_Handler
+#define SHARED_I2C_USES_DMA		1		// the accelerometer FIFO is read using DMA
 
 #endif
 
@@ -210,12 +212,14 @@ constexpr IRQn Serial0_IRQn = SERCOM5_IRQn;
 constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
 constexpr DmaChannel DmacChanAdc0Rx = 2;
+constexpr DmaChannel DmacChanI2cRx = 3;
 
 constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioI2cRx = 1;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 1;				// step interrupt is next highest, it can preempt most other interrupts
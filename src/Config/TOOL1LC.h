@@ -29,6 +29,7 @@
 #define SUPPORT_SLOW_DRIVERS	0
 #define SUPPORT_DELTA_MOVEMENT	0
 #define USE_EVEN_STEPS			0
+#define SUPPORT_STEP_TABLES		1		// precompute the times of the fastest acceleration and deceleration steps
 
 #define ACTIVE_HIGH_STEP		1		// 1 = active high, 0 = active low
 #define ACTIVE_HIGH_DIR			0		// 1 = active high, 0 = active low
@@ -39,6 +40,7 @@
 #define SUPPORT_TMC22xx			1
 
 constexpr size_t NumDrivers = 1;
+constexpr unsigned int DdaRingLength = 50;					// the number of DDAs in the movement ring
 constexpr size_t MaxSmartDrivers = 1;
 
 #define TMC22xx_USES_SERCOM				1
@@ -131,6 +133,7 @@ constexpr GpioPinFunction I2CSDAPinPeriphMode = GpioPinFunction::C;
 constexpr Pin I2CSCLPin = PortAPin(17);
 constexpr GpioPinFunction I2CSCLPinPeriphMode = GpioPinFunction::C;
 #define I2C_HANDLER		SERCOM1_Handler
+#define SHARED_I2C_USES_DMA		1		// the accelerometer FIFO is read using DMA
 
 #endif
 
@@ -223,12 +226,14 @@ constexpr DmaChannel DmacChanTmcTx = 0;
 constexpr DmaChannel DmacChanTmcRx = 1;
 constexpr DmaChannel DmacChanAdc0Rx = 2;
 constexpr DmaChannel DmacChanSdadcRx = 3;
+constexpr DmaChannel DmacChanI2cRx = 4;
 
-constexpr unsigned int NumDmaChannelsUsed = 4;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
+constexpr unsigned int NumDmaChannelsUsed = 5;			// must be at least the number of channels used, may be larger. Max 12 on the SAMC21.
 
 constexpr DmaPriority DmacPrioTmcTx = 0;
 constexpr DmaPriority DmacPrioTmcRx = 3;
 constexpr DmaPriority DmacPrioAdcRx = 2;
+constexpr DmaPriority DmacPrioI2cRx = 1;
 
 // Interrupt priorities, lower means higher priority. 0 can't make RTOS calls.
 const NvicPriority NvicPriorityStep = 1;				// step interrupt is next highest, it can preempt most other interrupts
@@ -0,0 +1,342 @@
+/*
+ * DataCapture.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "DataCapture.h"
+
+#if SUPPORT_DATA_CAPTURE
+
+#include <RTOSIface/RTOSIface.h>
+#include <TaskPriorities.h>
+#include <MemoryArenas.h>
+#include <Platform.h>
+#include <Movement/StepTimer.h>
+#include <Heating/Heat.h>
+#include <CAN/CanInterface.h>
+#include <CanMessageBuffer.h>
+#include <CanMessageFormats.h>
+#include <atomic>
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+#endif
+#if SUPPORT_CLOSED_LOOP
+# include <ClosedLoop/ClosedLoop.h>
+#endif
+#if SUPPORT_ACCELEROMETERS
+# include <CommandProcessing/AccelerometerHandler.h>
+#endif
+
+namespace DataCapture
+{
+	constexpr size_t BufferFloats = 2048;							// the buffer shared by all the channels, allocated when we first start a capture
+	constexpr size_t TaskStackWords = 140;
+	constexpr uint32_t MaxSampleRate = 1000;
+
+	constexpr uint32_t ChannelBit(Channel ch) noexcept { return 1u << (unsigned int)ch; }
+
+	// The channels that this board can capture
+	constexpr uint32_t SupportedChannels =
+#if SUPPORT_DRIVERS
+				ChannelBit(Channel::drive0Position) |
+#endif
+#if SUPPORT_CLOSED_LOOP
+				ChannelBit(Channel::drive0PositionError) |
+#endif
+#if SUPPORT_ACCELEROMETERS
+				ChannelBit(Channel::accelerationX) | ChannelBit(Channel::accelerationY) | ChannelBit(Channel::accelerationZ) |
+#endif
+#if HAS_VOLTAGE_MONITOR
+				ChannelBit(Channel::vinVoltage) |
+#endif
+				ChannelBit(Channel::heater0Pwm) | ChannelBit(Channel::heater1Pwm) | ChannelBit(Channel::sensor0Temperature) | ChannelBit(Channel::sensor1Temperature);
+
+	constexpr uint32_t AccelerationChannels = ChannelBit(Channel::accelerationX) | ChannelBit(Channel::accelerationY) | ChannelBit(Channel::accelerationZ);
+
+	enum class CaptureState : uint8_t { idle = 0, sampling, flushing };
+
+	static float *buffer = nullptr;
+	static Task<TaskStackWords> *captureTask = nullptr;
+	static StepTimer sampleTimer;
+	static TaskBase * volatile taskWaitingForSample = nullptr;
+	static volatile CaptureState state = CaptureState::idle;
+
+	// These are set up by Start before the state is changed to sampling and are then used only by the capture task
+	static uint32_t channelsSelected;
+	static unsigned int valuesPerSample;							// including the timestamp
+	static unsigned int bufferCapacity;								// in samples
+	static uint32_t samplesRequested;								// 0 to stream until told to stop
+	static uint32_t intervalTicks;
+	static uint32_t startTicks;
+	static uint32_t nextSampleDue;
+	static uint32_t samplesCollected = 0, samplesSent = 0, samplesDropped = 0, samplesMissed = 0;
+	static bool overflowed;
+
+	static void SampleTimerCallback(CallbackParameter) noexcept
+	{
+		TaskBase * const waitingTask = taskWaitingForSample;
+		if (waitingTask != nullptr)
+		{
+			taskWaitingForSample = nullptr;
+			TaskBase::GiveFromISR(waitingTask);
+		}
+	}
+
+	static void WaitUntilSampleDue() noexcept
+	{
+		taskWaitingForSample = TaskBase::GetCallerTaskHandle();
+		if (sampleTimer.ScheduleCallback(nextSampleDue))
+		{
+			taskWaitingForSample = nullptr;							// already due
+		}
+		else
+		{
+			(void)TaskBase::Take(1000 * intervalTicks/StepTimer::StepClockRate + 2);	// the timeout is only a safeguard
+		}
+	}
+
+	// Read all the selected channels and store them in the buffer. The values are read in this task, not in the timer callback, because some of them need locks.
+	static void TakeSample() noexcept
+	{
+		const uint32_t now = StepTimer::GetTimerTicks();
+		if (samplesCollected - samplesSent >= bufferCapacity)
+		{
+			overflowed = true;
+			if (samplesRequested == 0)
+			{
+				++samplesDropped;									// the timestamps let the main board see where the gaps are
+			}
+			else
+			{
+				state = CaptureState::flushing;
+			}
+			return;
+		}
+
+		float *p = buffer + (samplesCollected % bufferCapacity) * valuesPerSample;
+		*p++ = (float)(now - startTicks) * StepTimer::StepClocksToMillis;
+
+		float acceleration[3] = { NAN, NAN, NAN };
+#if SUPPORT_ACCELEROMETERS
+		if ((channelsSelected & AccelerationChannels) != 0)
+		{
+			(void)AccelerometerHandler::GetLatestSample(acceleration);
+		}
+#endif
+		TemperatureError err;
+		for (unsigned int ch = 0; ch < (unsigned int)Channel::numChannels; ++ch)
+		{
+			if ((channelsSelected & (1u << ch)) != 0)
+			{
+				float val;
+				switch ((Channel)ch)
+				{
+#if SUPPORT_DRIVERS
+				case Channel::drive0Position:
+					{
+						int32_t positions[NumDrivers];
+						(void)moveInstance->GetPositionSnapshot(positions);
+						val = (float)positions[0];
+					}
+					break;
+#endif
+#if SUPPORT_CLOSED_LOOP
+				case Channel::drive0PositionError:	val = ClosedLoop::GetPositionError(0); break;
+#endif
+				case Channel::accelerationX:		val = acceleration[0]; break;
+				case Channel::accelerationY:		val = acceleration[1]; break;
+				case Channel::accelerationZ:		val = acceleration[2]; break;
+				case Channel::heater0Pwm:			val = Heat::GetAveragePWM(0); break;
+				case Channel::heater1Pwm:			val = (NumTotalHeaters > 1) ? Heat::GetAveragePWM(1) : 0.0; break;
+				case Channel::sensor0Temperature:	val = Heat::GetSensorTemperature(0, err); if (err != TemperatureError::ok) { val = NAN; } break;
+				case Channel::sensor1Temperature:	val = Heat::GetSensorTemperature(1, err); if (err != TemperatureError::ok) { val = NAN; } break;
+#if HAS_VOLTAGE_MONITOR
+				case Channel::vinVoltage:			val = Platform::GetCurrentVinVoltage(); break;
+#endif
+				default:							val = NAN; break;
+				}
+				*p++ = val;
+			}
+		}
+
+		++samplesCollected;
+		if (samplesCollected == samplesRequested)
+		{
+			state = CaptureState::flushing;
+		}
+	}
+
+	// Send the samples in full packets. If we have finished collecting, send what is left and a packet with the last packet flag set.
+	static void SendPackets() noexcept
+	{
+		const unsigned int samplesPerPacket = CanMessageClosedLoopData::MaxDataItems/valuesPerSample;
+		for (;;)
+		{
+			const bool finishing = (state != CaptureState::sampling);
+			const unsigned int samplesAvailable = samplesCollected - samplesSent;
+			if (samplesAvailable < samplesPerPacket && !finishing)
+			{
+				return;
+			}
+
+			CanMessageBuffer buf(nullptr);
+			CanMessageClosedLoopData& msg = *(buf.SetupStatusMessage<CanMessageClosedLoopData>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress()));
+			msg.firstSampleNumber = (uint16_t)samplesSent;			// this wraps round if we stream more than 65536 samples
+			msg.filter = (uint16_t)channelsSelected;
+			msg.zero = msg.zero2 = 0;
+
+			const unsigned int numSamples = min<unsigned int>(samplesAvailable, samplesPerPacket);
+			for (unsigned int i = 0; i < numSamples; ++i)
+			{
+				memcpy(msg.data + i * valuesPerSample, buffer + ((samplesSent + i) % bufferCapacity) * valuesPerSample, valuesPerSample * sizeof(float));
+			}
+			samplesSent += numSamples;
+			msg.numSamples = numSamples;
+			msg.lastPacket = finishing && samplesSent == samplesCollected;
+			msg.overflowed = overflowed;
+			buf.dataLength = msg.GetActualDataLength();
+			CanInterface::SendBulk(&buf);
+
+			if (msg.lastPacket)
+			{
+				state = CaptureState::idle;
+				return;
+			}
+		}
+	}
+
+	[[noreturn]] static void TaskLoop(void *) noexcept
+	{
+		for (;;)
+		{
+			if (state == CaptureState::idle)
+			{
+				TaskBase::Take();
+				continue;
+			}
+			std::atomic_signal_fence(std::memory_order_acquire);		// don't read the capture parameters until we have seen the new state
+
+			if (state == CaptureState::sampling)
+			{
+				WaitUntilSampleDue();
+				if (state == CaptureState::sampling)
+				{
+					TakeSample();
+					nextSampleDue += intervalTicks;
+
+					// If we fell behind, skip the samples we missed rather than taking them late, so that all samples stay on the same grid
+					const uint32_t now = StepTimer::GetTimerTicks();
+					while ((int32_t)(now - nextSampleDue) >= 0)
+					{
+						nextSampleDue += intervalTicks;
+						++samplesMissed;
+					}
+				}
+			}
+			SendPackets();
+		}
+	}
+
+	static void AppendStatus(const StringRef& reply) noexcept
+	{
+		reply.catf("%" PRIu32 " samples collected, %" PRIu32 " sent, %" PRIu32 " dropped, %" PRIu32 " missed", samplesCollected, samplesSent, samplesDropped, samplesMissed);
+	}
+}
+
+// Start or stop a capture. The channels are a bitmap of the Channel values. If the number of samples is zero, we stream data until we are asked to stop.
+GCodeResult DataCapture::Start(uint32_t sampleRate, uint32_t channels, uint32_t numSamples, const StringRef& reply) noexcept
+{
+	if (sampleRate == 0)
+	{
+		if (state != CaptureState::sampling)
+		{
+			reply.copy("No data capture in progress");
+			return GCodeResult::warning;
+		}
+		state = CaptureState::flushing;
+		sampleTimer.CancelCallback();
+		captureTask->Give();
+		reply.copy("Data capture stopped, ");
+		AppendStatus(reply);
+		return GCodeResult::ok;
+	}
+
+	if (state != CaptureState::idle)
+	{
+		reply.copy("A data capture is already in progress");
+		return GCodeResult::error;
+	}
+#if SUPPORT_CLOSED_LOOP
+	if (ClosedLoop::IsCollectingData())
+	{
+		reply.copy("Closed loop data collection is in progress");		// it uses the same CAN message to stream its data
+		return GCodeResult::error;
+	}
+#endif
+	if (sampleRate > MaxSampleRate)
+	{
+		reply.printf("Sample rate must not exceed %" PRIu32 "Hz", MaxSampleRate);
+		return GCodeResult::error;
+	}
+	const uint32_t channelsRequested = channels;
+	channels &= SupportedChannels;
+	if (channels == 0)
+	{
+		reply.copy("No supported channels selected");
+		return GCodeResult::error;
+	}
+#if SUPPORT_ACCELEROMETERS
+	float acceleration[3];
+	if ((channels & AccelerationChannels) != 0 && !AccelerometerHandler::GetLatestSample(acceleration))
+	{
+		reply.copy("Vibration monitoring must be running to capture acceleration");
+		return GCodeResult::error;
+	}
+#endif
+
+	if (captureTask == nullptr)
+	{
+		MemoryArenas::Scope scope(MemoryArena::dataCapture);
+		buffer = new float[BufferFloats];
+		sampleTimer.SetCallback(SampleTimerCallback, CallbackParameter(nullptr));
+		captureTask = new Task<TaskStackWords>;
+		captureTask->Create(TaskLoop, "CAPTURE", nullptr, TaskPriority::DataCapturePriority);
+	}
+
+	channelsSelected = channels;
+	valuesPerSample = __builtin_popcount(channels) + 1;
+	bufferCapacity = BufferFloats/valuesPerSample;
+	samplesRequested = numSamples;
+	samplesCollected = samplesSent = samplesDropped = samplesMissed = 0;
+	overflowed = false;
+	intervalTicks = StepTimer::StepClockRate/sampleRate;
+	startTicks = nextSampleDue = StepTimer::GetTimerTicks() + intervalTicks;	// give the task time to wake up before the first sample
+	std::atomic_signal_fence(std::memory_order_release);				// make sure the parameters are set up before the task can see the new state
+	state = CaptureState::sampling;
+	captureTask->Give();
+
+	reply.printf("Data capture of %u values at %" PRIu32 "Hz started at master time %" PRIu32, valuesPerSample - 1, sampleRate, StepTimer::ConvertToMasterTime(startTicks));
+	if (channels != channelsRequested)
+	{
+		reply.cat(", unsupported channels ignored");
+	}
+	return GCodeResult::ok;
+}
+
+bool DataCapture::IsRunning() noexcept
+{
+	return state != CaptureState::idle;
+}
+
+void DataCapture::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Data capture: %s, ", (state == CaptureState::sampling) ? "sampling" : (state == CaptureState::flushing) ? "sending" : "idle");
+	AppendStatus(reply);
+}
+
+#endif
+
+// End
@@ -0,0 +1,45 @@
+/*
+ * DataCapture.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_DATACAPTURE_H_
+#define SRC_DATACAPTURE_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_DATA_CAPTURE
+
+// Module to sample channels from several subsystems at the same instants, so that for example vibration can be lined up with following error without manual alignment.
+// One request selects the channels, all of them are sampled by one task on the step clock into one buffer, and the samples are streamed to the main board in the same
+// CAN message format as closed loop data collection. The filter field of each message holds the channel bitmap and the first value of each sample is its time in
+// milliseconds since the start of the capture, whose master clock time is given in the reply to the start request.
+// Captures are started and stopped by diagnostic test 233.
+namespace DataCapture
+{
+	// The channels that can be captured, in the order that their values appear in each sample
+	enum class Channel : uint8_t
+	{
+		drive0Position = 0,									// the number of microsteps that driver 0 has taken
+		drive0PositionError,								// the closed loop position error of driver 0 in full steps
+		accelerationX,										// acceleration in g from the vibration monitor
+		accelerationY,
+		accelerationZ,
+		heater0Pwm,											// average heater PWM as a fraction
+		heater1Pwm,
+		sensor0Temperature,									// temperature in degrees C
+		sensor1Temperature,
+		vinVoltage,
+		numChannels
+	};
+
+	GCodeResult Start(uint32_t sampleRate, uint32_t channels, uint32_t numSamples, const StringRef& reply) noexcept;	// a sample rate of zero stops the capture
+	bool IsRunning() noexcept;
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif
+
+#endif /* SRC_DATACAPTURE_H_ */
@@ -0,0 +1,167 @@
+/*
+ * DeferredLog.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "DeferredLog.h"
+
+#if SUPPORT_DEFERRED_LOG
+
+#include <RTOSIface/RTOSIface.h>
+#include <TaskPriorities.h>
+#include <Platform.h>
+#include <atomic>
+
+namespace DeferredLog
+{
+	constexpr size_t NumEntries = 32;								// must be a power of 2
+	constexpr size_t TextBufferSize = 1024;							// the formatted lines that the main board hasn't fetched yet
+	constexpr size_t MaxLineLength = 100;
+	constexpr size_t TaskStackWords = 200;							// formatting the entries calls vuprintf, which needs plenty of stack
+	constexpr uint32_t PollIntervalMillis = 20;						// the loggers don't wake the task, so that logging from an ISR costs as little as possible
+
+	static_assert((NumEntries & (NumEntries - 1)) == 0);
+
+	struct Entry
+	{
+		const char *fmt;
+		uint32_t whenLogged;										// in milliseconds
+		uint32_t args[MaxArgs];
+		volatile uint32_t sequence;									// set to the index of the entry plus one when the entry is complete
+	};
+
+	static Entry entries[NumEntries];
+	static std::atomic<uint32_t> writeIndex(0);						// the total number of entries reserved
+	static volatile uint32_t readIndex = 0;							// the total number of entries formatted, updated only by the log task
+	static std::atomic<uint32_t> entriesDropped(0);
+
+	static char textBuffer[TextBufferSize];							// ring of formatted lines, each terminated by newline
+	static size_t textStart = 0, textLength = 0;
+	static uint32_t linesOverwritten = 0;
+
+	static Task<TaskStackWords> logTask;
+
+	// Append a formatted line to the text ring, discarding the oldest lines if there isn't room. Called by the log task.
+	static void StoreLine(const char *line, size_t length) noexcept
+	{
+		TaskCriticalSectionLocker lock;
+		while (textLength + length + 1 > TextBufferSize && textLength != 0)
+		{
+			// Discard the oldest line
+			size_t discarded = 0;
+			char c;
+			do
+			{
+				c = textBuffer[(textStart + discarded) % TextBufferSize];
+				++discarded;
+			} while (c != '\n' && discarded < textLength);
+			textStart = (textStart + discarded) % TextBufferSize;
+			textLength -= discarded;
+			++linesOverwritten;
+		}
+
+		for (size_t i = 0; i < length; ++i)
+		{
+			textBuffer[(textStart + textLength++) % TextBufferSize] = line[i];
+		}
+		textBuffer[(textStart + textLength++) % TextBufferSize] = '\n';
+	}
+
+	[[noreturn]] static void LogTaskLoop(void *) noexcept
+	{
+		for (;;)
+		{
+			const uint32_t index = readIndex;
+			Entry& e = entries[index % NumEntries];
+			if (e.sequence != index + 1)
+			{
+				(void)TaskBase::Take(PollIntervalMillis);
+				continue;
+			}
+			std::atomic_signal_fence(std::memory_order_acquire);		// don't read the entry until we have seen that it is complete
+
+			String<MaxLineLength> line;
+			line.printf("%" PRIu32 " ", e.whenLogged);
+			line.catf(e.fmt, e.args[0], e.args[1], e.args[2], e.args[3]);	// unused arguments are ignored
+			std::atomic_signal_fence(std::memory_order_release);		// finish reading the entry before we let the loggers reuse it
+			readIndex = index + 1;
+
+			size_t length = line.strlen();
+			while (length != 0 && line.c_str()[length - 1] == '\n')
+			{
+				--length;
+			}
+			line.Truncate(length);
+			StoreLine(line.c_str(), length);
+			debugPrintf("%s\n", line.c_str());
+		}
+	}
+}
+
+void DeferredLog::Init() noexcept
+{
+	logTask.Create(LogTaskLoop, "LOG", nullptr, TaskPriority::DeferredLogPriority);
+}
+
+// Record a log entry. This may be called from any task or ISR, and before Init has been called.
+void DeferredLog::Record(const char *fmt, const uint32_t args[], size_t numArgs) noexcept
+{
+	// Reserve an entry
+	uint32_t index = writeIndex.load(std::memory_order_relaxed);
+	do
+	{
+		if (index - readIndex >= NumEntries)
+		{
+			entriesDropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	} while (!writeIndex.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+	Entry& e = entries[index % NumEntries];
+	e.fmt = fmt;
+	e.whenLogged = millis();
+	for (size_t i = 0; i < MaxArgs; ++i)
+	{
+		e.args[i] = (i < numArgs) ? args[i] : 0;
+	}
+	std::atomic_signal_fence(std::memory_order_release);			// make sure the entry is complete before the log task can see it
+	e.sequence = index + 1;
+}
+
+// Append the oldest whole lines that fit in the reply and remove them from the ring
+void DeferredLog::AppendLines(const StringRef& reply) noexcept
+{
+	TaskCriticalSectionLocker lock;
+	size_t taken = 0;
+	while (taken < textLength)
+	{
+		size_t lineLength = 0;
+		while (taken + lineLength < textLength && textBuffer[(textStart + taken + lineLength) % TextBufferSize] != '\n')
+		{
+			++lineLength;
+		}
+		if (reply.strlen() + lineLength + 1 > reply.Capacity())
+		{
+			break;
+		}
+		for (size_t i = 0; i <= lineLength; ++i)
+		{
+			reply.cat(textBuffer[(textStart + taken + i) % TextBufferSize]);
+		}
+		taken += lineLength + 1;
+	}
+	textStart = (textStart + taken) % TextBufferSize;
+	textLength -= taken;
+}
+
+void DeferredLog::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Log: %" PRIu32 " entries, %" PRIu32 " dropped, %" PRIu32 " lines overwritten, %u chars waiting",
+					writeIndex.load(std::memory_order_relaxed), entriesDropped.load(std::memory_order_relaxed), linesOverwritten, (unsigned int)textLength);
+}
+
+#endif
+
+// End
@@ -0,0 +1,53 @@
+/*
+ * DeferredLog.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_DEFERREDLOG_H_
+#define SRC_DEFERREDLOG_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_DEFERRED_LOG
+
+#include <type_traits>
+
+// Module to log messages without formatting them in the caller, so that logging can stay enabled in production builds without changing the timing of the code that logs.
+// logPrintf records the format string pointer, the time and the raw arguments in a lock-free ring, so it may be called from any task or interrupt.
+// A low priority task formats the entries later, sends them to the debug output in debug builds and keeps the most recent lines for the main board to fetch.
+// Because the arguments are formatted later, they must each fit in 32 bits: integers, characters and pointers to strings that never change, such as string literals.
+// Floating point values can't be logged this way, so log them as scaled integers instead.
+namespace DeferredLog
+{
+	constexpr size_t MaxArgs = 4;
+
+	void Init() noexcept;
+	void Record(const char *fmt, const uint32_t args[], size_t numArgs) noexcept;
+	void AppendLines(const StringRef& reply) noexcept;			// append and remove as many of the oldest formatted lines as fit in the reply
+	void Diagnostics(const StringRef& reply) noexcept;
+
+	inline uint32_t ToWord(const char *s) noexcept { return reinterpret_cast<uint32_t>(s); }
+
+	template<class T> inline uint32_t ToWord(T arg) noexcept
+	{
+		static_assert(std::is_integral<T>::value && sizeof(T) <= sizeof(uint32_t), "logPrintf arguments must be 32-bit integers or pointers to constant strings");
+		return (uint32_t)arg;
+	}
+}
+
+template<class... Args> inline void logPrintf(const char *fmt, Args... args) noexcept
+{
+	static_assert(sizeof...(Args) <= DeferredLog::MaxArgs, "too many arguments to logPrintf");
+	const uint32_t words[] = { DeferredLog::ToWord(args)..., 0 };
+	DeferredLog::Record(fmt, words, sizeof...(Args));
+}
+
+#else
+
+# define logPrintf	debugPrintf
+
+#endif
+
+#endif /* SRC_DEFERREDLOG_H_ */
@@ -0,0 +1,36 @@
+/*
+ * DiagnosticsRecord.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "DiagnosticsRecord.h"
+
+uint64_t DiagnosticsRecord::telemetryFields = DiagnosticsRecord::AllFields;
+
+// Encode the record as: version number, colon, bitmap of the fields present, colon, then the values of the fields present in field number order
+void DiagnosticsRecord::Encode(const StringRef& reply, uint64_t fieldsWanted) const noexcept
+{
+	const uint64_t fieldsToSend = fieldsPresent & fieldsWanted;
+	reply.printf("%u:%" PRIx32 "%08" PRIx32 ":", Version, (uint32_t)(fieldsToSend >> 32), (uint32_t)fieldsToSend);
+	bool first = true;
+	for (size_t i = 0; i < (size_t)DiagnosticsField::numFields; ++i)
+	{
+		if (fieldsToSend & ((uint64_t)1 << i))
+		{
+			reply.catf((first) ? "%" PRIx32 : ",%" PRIx32, values[i]);
+			first = false;
+		}
+	}
+}
+
+// Choose which fields the telemetry record includes, so that the main board can poll a small subset of the counters frequently
+GCodeResult DiagnosticsRecord::SetTelemetryFields(uint64_t fields, const StringRef& reply) noexcept
+{
+	telemetryFields = fields & AllFields;
+	reply.printf("Telemetry fields %" PRIx32 "%08" PRIx32, (uint32_t)(telemetryFields >> 32), (uint32_t)telemetryFields);
+	return GCodeResult::ok;
+}
+
+// End
@@ -0,0 +1,127 @@
+/*
+ * DiagnosticsRecord.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_DIAGNOSTICSRECORD_H_
+#define SRC_DIAGNOSTICSRECORD_H_
+
+#include <RepRapFirmware.h>
+
+// The counters in the compact diagnostics record. The main board decodes the record using these field numbers, so new fields must only be added at the end.
+// Fields that don't apply to this board or configuration are left out of the record, and the bitmap at the start of the record says which ones are present.
+enum class DiagnosticsField : uint8_t
+{
+	// Move
+	movesScheduled = 0,
+	movesCompleted,
+	hiccups,
+	stepErrors,
+	maxPrepareTime,
+	maxTicksOverdue,
+	maxOverdueIncrement,
+	maxRingOccupancy,
+	underrunStops,
+	latePrepares,
+
+	// CanInterface
+	canMessagesQueued,
+	canSendTimeouts,
+	canMessagesReceived,
+	canMessagesLost,
+	canFreeBuffers,
+	canMinFreeBuffers,
+	canErrorRegister,
+	canBufferWaits,
+	canMaxBufferWait,
+	canDuplicateMotion,
+	canOutOfSequence,
+	canBadMoves,
+	canMaxMotionDelay,
+
+	// StepTimer
+	syncPeakNegJitter,
+	syncPeakPosJitter,
+	syncDriftPpb,
+	syncPeakReceiveDelay,
+	syncTimeoutResyncs,
+	syncJitterResyncs,
+
+	// ClosedLoop
+	clMaxLoopRuntime,
+	clLoopOverruns,
+	clPredictedStalls,
+
+	// Heat
+	heatSensorOrderingErrors,
+	heatTaskLoopTime,
+	heatRemoteSensorCacheMisses,
+
+	// Tasks
+	upTime,
+	neverUsedRam,
+	freeSystemStack,
+	numTasks,
+	minTaskStackNeverUsed,
+
+	// CanInterface bus recovery, cumulative totals
+	canBusOffs,
+	canErrorPassives,
+	canMaxBusOffRecovery,
+	canReceiveErrors,
+
+	// Move first step timing, in step clocks except that the mean is in 1/16 step clocks
+	firstStepMoves,
+	firstStepMinError,
+	firstStepMaxError,
+	firstStepMeanError,
+
+	// Move queue state for flow control, as reported by Move::GetQueueStatus. The times are master step clock times.
+	moveQueued,
+	moveEarliestFreeSlotTime,
+	moveDrainTime,
+
+	numFields
+};
+
+// Class to collect the counters from each subsystem and encode them in a single reply.
+// The CAN reply is sent as a NUL-terminated string, so each value is encoded as hex without leading zeros and the values are separated by commas.
+// This keeps the record short and avoids the cost of formatting floats, so the main board can poll all the counters in one request.
+// A telemetry record doesn't reset any counters, so that periodic polling doesn't interfere with M122. Counters that can't be read without resetting them are left out,
+// and cumulative totals are reported instead of the counts since the last M122 where we have them.
+class DiagnosticsRecord
+{
+public:
+	static constexpr unsigned int Version = 1;								// increase this if the meaning of an existing field changes
+
+	explicit DiagnosticsRecord(bool p_isTelemetry) noexcept : fieldsPresent(0), isTelemetry(p_isTelemetry) { }
+
+	bool IsTelemetry() const noexcept { return isTelemetry; }
+	bool ResetCounters() const noexcept { return !isTelemetry; }
+
+	// Set a field. Signed values are stored as their two's complement representation.
+	void Set(DiagnosticsField field, uint32_t val) noexcept
+	{
+		values[(size_t)field] = val;
+		fieldsPresent |= (uint64_t)1 << (unsigned int)field;
+	}
+
+	void Encode(const StringRef& reply, uint64_t fieldsWanted) const noexcept;
+
+	static uint64_t GetTelemetryFields() noexcept { return telemetryFields; }
+	static GCodeResult SetTelemetryFields(uint64_t fields, const StringRef& reply) noexcept;
+
+private:
+	static_assert((size_t)DiagnosticsField::numFields <= 64, "fieldsPresent is too small");
+	static constexpr uint64_t AllFields = ((uint64_t)1 << (unsigned int)DiagnosticsField::numFields) - 1;
+
+	static uint64_t telemetryFields;										// which fields the telemetry record includes
+
+	uint64_t fieldsPresent;
+	uint32_t values[(size_t)DiagnosticsField::numFields];
+	bool isTelemetry;
+};
+
+#endif /* SRC_DIAGNOSTICSRECORD_H_ */
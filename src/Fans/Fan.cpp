@@ -34,10 +34,14 @@ GCodeResult Fan::Configure(const CanMessageFanParameters& msg, const StringRef&
 }
 
 // Set the PWM. 'speed' is in the interval 0.0..1.0.
+// The main board resends the fan speed often, e.g. at every layer change, so if it hasn't changed we leave it to the periodic refresh.
 void Fan::SetPwm(float speed)
 {
-	val = speed;
-	Refresh(true);
+	if (speed != val)
+	{
+		val = speed;
+		Refresh(true);
+	}
 }
 
 // End
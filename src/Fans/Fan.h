@@ -24,6 +24,7 @@ public:
 	virtual bool IsEnabled() const = 0;
 	virtual int32_t GetRPM() = 0;
 	virtual void ReportPortDetails(const StringRef& str) const = 0;
+	virtual GCodeResult SetFullSpeedRpm(uint32_t rpm, const StringRef& reply) = 0;	// set the RPM at full speed for closed loop control, or 0 for open loop
 	virtual ~Fan() { }
 
 	unsigned int GetNumber() const { return fanNumber; }
@@ -38,6 +39,7 @@ public:
 
 	void SetPwm(float speed);
 	bool HasMonitoredSensors() const { return !sensorsMonitored.IsEmpty(); }
+	SensorsBitmap GetMonitoredSensors() const { return sensorsMonitored; }
 
 protected:
 	virtual void Refresh(bool checkSensors) = 0;
@@ -12,6 +12,7 @@
 #include <CanMessageGenericParser.h>
 #include <CanMessageGenericTables.h>
 #include <CAN/CanInterface.h>
+#include <Heating/Heat.h>
 
 #include <utility>
 
@@ -39,14 +40,33 @@ static LocalFan *CreateLocalFan(uint32_t fanNum, const char *pinNames, PwmFreque
 	return newFan;
 }
 
+// Tell Heat which sensors the thermostatic fans follow, so that it records when they have new readings
+static void UpdateSensorListeners()
+{
+	SensorsBitmap sensors;
+	{
+		ReadLocker lock(fansLock);
+		for (const Fan* fan : fans)
+		{
+			if (fan != nullptr)
+			{
+				sensors |= fan->GetMonitoredSensors();
+			}
+		}
+	}
+	Heat::SetSensorListeners(sensors);
+}
+
 // Check and if necessary update all fans. Return true if a thermostatic fan is running.
+// A thermostatic fan only re-reads its sensors when one of them has a new reading, or when 'checkSensors' is true so that we notice sensors that have stopped reporting.
 bool FansManager::CheckFans(bool checkSensors)
 {
+	const SensorsBitmap newReadings = Heat::TakeNewSensorReadings();
 	ReadLocker lock(fansLock);
 	bool thermostaticFanRunning = false;
 	for (Fan* fan : fans)
 	{
-		if (fan != nullptr && fan->Check(checkSensors))
+		if (fan != nullptr && fan->Check(checkSensors || fan->GetMonitoredSensors().Intersects(newReadings)))
 		{
 			thermostaticFanRunning = true;
 		}
@@ -73,6 +93,8 @@ GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const St
 
 	PwmFrequency freq = DefaultFanPwmFreq;
 	const bool seenFreq = parser.GetUintParam('Q', freq);
+	uint16_t fullSpeedRpm;
+	const bool seenRpm = parser.GetUintParam('R', fullSpeedRpm);
 
 	String<StringLength50> pinNames;
 	if (parser.GetStringParam('C', pinNames.GetRef()))
@@ -84,7 +106,11 @@ GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const St
 		delete oldFan;
 
 		fans[fanNum] = CreateLocalFan(fanNum, pinNames.c_str(), freq, reply);
-		return (fans[fanNum] == nullptr) ? GCodeResult::error : GCodeResult::ok;
+		if (fans[fanNum] == nullptr)
+		{
+			return GCodeResult::error;
+		}
+		return (seenRpm) ? fans[fanNum]->SetFullSpeedRpm(fullSpeedRpm, reply) : GCodeResult::ok;
 	}
 
 	const auto fan = FindFan(fanNum);
@@ -98,7 +124,11 @@ GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const St
 	{
 		fan->SetPwmFrequency(freq);
 	}
-	else
+	if (seenRpm)
+	{
+		return fan->SetFullSpeedRpm(fullSpeedRpm, reply);
+	}
+	if (!seenFreq)
 	{
 		fan->ReportPortDetails(reply);
 	}
@@ -112,14 +142,18 @@ GCodeResult FansManager::ConfigureFanPort(const CanMessageGeneric& msg, const St
 // If no relevant parameters are found, print the existing ones to 'reply' and return false.
 GCodeResult FansManager::ConfigureFan(const CanMessageFanParameters& msg, const StringRef& reply)
 {
-	auto fan = FindFan(msg.fanNumber);
-	if (fan.IsNull())
+	GCodeResult rslt;
 	{
-		reply.printf("Board %u doesn't have fan %u", CanInterface::GetCanAddress(), msg.fanNumber);
-		return GCodeResult::error;
+		auto fan = FindFan(msg.fanNumber);
+		if (fan.IsNull())
+		{
+			reply.printf("Board %u doesn't have fan %u", CanInterface::GetCanAddress(), msg.fanNumber);
+			return GCodeResult::error;
+		}
+		rslt = fan->Configure(msg, reply);
 	}
-
-	return fan->Configure(msg, reply);
+	UpdateSensorListeners();								// the fan may now follow different sensors
+	return rslt;
 }
 
 GCodeResult FansManager::SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply)
@@ -135,8 +169,7 @@ GCodeResult FansManager::SetFanSpeed(const CanMessageSetFanSpeed& msg, const Str
 	return GCodeResult::ok;
 }
 
-#if 0
-
+// Set the speed of a fan if it exists. Used to apply scheduled fan speed changes; the fan may have been deleted since the change was scheduled.
 void FansManager::SetFanValue(uint32_t fanNum, float speed)
 {
 	auto fan = FindFan(fanNum);
@@ -146,8 +179,6 @@ void FansManager::SetFanValue(uint32_t fanNum, float speed)
 	}
 }
 
-#endif
-
 // Initialise fans. Call this only once, and only during initialisation.
 void FansManager::Init()
 {
@@ -25,9 +25,7 @@ namespace FansManager
 	GCodeResult ConfigureFan(const CanMessageFanParameters& gb, const StringRef& reply);
 	GCodeResult SetFanSpeed(const CanMessageSetFanSpeed& msg, const StringRef& reply);
 	unsigned int PopulateFansReport(CanMessageFansReport& msg);
-#if 0
 	void SetFanValue(uint32_t fanNum, float speed);
-#endif
 };
 
 #endif /* SRC_FANS_FANSMANAGER_H_ */
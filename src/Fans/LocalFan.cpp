@@ -11,16 +11,20 @@
 #include "Platform.h"
 #include "Heating/Heat.h"
 #include "Heating/Sensors/TemperatureSensor.h"
+#include <IsrProfiler.h>
 
 void FanInterrupt(CallbackParameter cb) noexcept
 {
+	ISR_PROFILE_ENTER();
 	static_cast<LocalFan *>(cb.vp)->Interrupt();
+	ISR_PROFILE_EXIT(pinInterrupt);
 }
 
 LocalFan::LocalFan(unsigned int fanNum)
 	: Fan(fanNum),
-	  fanInterruptCount(0), fanLastResetTime(0), fanInterval(0),
-	  blipping(false)
+	  fanInterruptCount(0), fanFirstEdgeTime(0), fanLastResetTime(0), fanInterval(0), fanIntervalPeriods(0), tachoArmed(false),
+	  fullSpeedRpm(0), lastRpmReadingTime(0), rpmProportionalTerm(0.0), rpmIntegralTerm(0.0),
+	  lastPwm(-1.0), blipping(false)
 {
 }
 
@@ -39,18 +43,68 @@ void LocalFan::ReportPortDetails(const StringRef& str) const
 	{
 		str.cat(" tacho");
 		tachoPort.AppendBasicDetails(str);
+		if (fullSpeedRpm != 0)
+		{
+			str.catf(" closed loop, %" PRIu32 "RPM at full speed", fullSpeedRpm);
+		}
+	}
+}
+
+// Set the RPM at full speed. If it is nonzero then we use closed loop control to make the fan run at the requested fraction of it.
+GCodeResult LocalFan::SetFullSpeedRpm(uint32_t rpm, const StringRef& reply)
+{
+	if (rpm != 0 && !tachoPort.IsValid())
+	{
+		reply.printf("Fan %u has no tacho so it can't use closed loop control", fanNumber);
+		return GCodeResult::error;
+	}
+	fullSpeedRpm = rpm;
+	rpmProportionalTerm = rpmIntegralTerm = 0.0;
+	lastRpmReadingTime = fanLastResetTime;
+	Refresh(false);
+	return GCodeResult::ok;
+}
+
+// Return the PWM to use for closed loop control. 'reqVal' is the requested fraction of full speed.
+// The loop uses reqVal as the feedforward term and is updated only when there is a new tacho reading.
+float LocalFan::GetClosedLoopPwm(float reqVal)
+{
+	if (reqVal <= 0.0)
+	{
+		rpmProportionalTerm = rpmIntegralTerm = 0.0;
+		return 0.0;
+	}
+
+	const uint32_t readingTime = fanLastResetTime;
+	if (readingTime != lastRpmReadingTime)
+	{
+		const uint32_t ticksSinceLastReading = readingTime - lastRpmReadingTime;
+		lastRpmReadingTime = readingTime;
+		const float error = reqVal - (float)GetRPM()/(float)fullSpeedRpm;
+		rpmProportionalTerm = RpmControlKp * error;
+		if (ticksSinceLastReading < RpmControlMaxSampleTicks)
+		{
+			rpmIntegralTerm = constrain<float>(rpmIntegralTerm + RpmControlKi * error * (float)ticksSinceLastReading * (1.0/(float)StepTimer::StepClockRate),
+												-RpmControlMaxCorrection, RpmControlMaxCorrection);
+		}
 	}
+	return constrain<float>(reqVal + rpmProportionalTerm + rpmIntegralTerm, minVal, 1.0);
 }
 
 // Set the hardware PWM
 // If you want make sure that the PWM is definitely updated, set lastPWM negative before calling this
+// Write the PWM to the port, unless it is unchanged
 void LocalFan::SetHardwarePwm(float pwmVal)
 {
-	port.WriteAnalog(pwmVal);
+	if (pwmVal != lastPwm)
+	{
+		lastPwm = pwmVal;
+		port.WriteAnalog(pwmVal);
+	}
 }
 
 // Refresh the fan PWM
-// If you want make sure that the PWM is definitely updated, set lastPWM negative before calling this
+// If you want make sure that the PWM is definitely updated, set lastPwm negative before calling this
 void LocalFan::Refresh(bool checkSensors)
 {
 	float reqVal;
@@ -77,12 +131,11 @@ void LocalFan::Refresh(bool checkSensors)
 #endif
 		 ](unsigned int sensorNum, unsigned int) noexcept
 			{
-				const auto sensor = Heat::FindSensor(sensorNum);
-				if (sensor.IsNotNull())
+				TemperatureError err;
+				const float ht = Heat::GetSensorTemperature(sensorNum, err);
+				if (err != TemperatureError::unknownSensor)
 				{
 					//TODO we used to turn the fan on if the associated heater was being tuned
-					float ht;
-					const TemperatureError err = sensor->GetLatestTemperature(ht);
 					if (err != TemperatureError::success || ht < BadLowTemperature || ht >= triggerTemperatures[1])
 					{
 						reqVal = maxVal;
@@ -151,7 +204,7 @@ void LocalFan::Refresh(bool checkSensors)
 	}
 
 	lastVal = reqVal;
-	SetHardwarePwm((blipping) ? 1.0 : reqVal);
+	SetHardwarePwm((blipping) ? 1.0 : (fullSpeedRpm != 0) ? GetClosedLoopPwm(reqVal) : reqVal);
 }
 
 bool LocalFan::UpdateFanConfiguration(const StringRef& reply)
@@ -163,6 +216,10 @@ bool LocalFan::UpdateFanConfiguration(const StringRef& reply)
 // Update the fan if necessary. Return true if it is a thermostatic fan and is running.
 bool LocalFan::Check(bool checkSensors)
 {
+	if (!tachoArmed && tachoPort.IsValid() && StepTimer::GetTimerTicks() - fanLastResetTime >= TachoSampleIntervalTicks)
+	{
+		ArmTacho();
+	}
 	Refresh(checkSensors);
 	return !sensorsMonitored.IsEmpty() && lastVal != 0.0;
 }
@@ -183,7 +240,8 @@ bool LocalFan::AssignPorts(const char *pinNames, const StringRef& reply)
 	// Tacho initialisation
 	if (tachoPort.IsValid())
 	{
-		tachoPort.AttachInterrupt(FanInterrupt, InterruptMode::falling, CallbackParameter(this));
+		fanLastResetTime = StepTimer::GetTimerTicks();
+		ArmTacho();
 	}
 
 	Refresh(true);
@@ -191,28 +249,62 @@ bool LocalFan::AssignPorts(const char *pinNames, const StringRef& reply)
 }
 
 // Tacho support
+// Start a new tacho measurement. The interrupt is detached when we are not measuring, so it is safe to reset the count here.
+void LocalFan::ArmTacho()
+{
+	fanInterruptCount = 0;
+	tachoArmed = true;
+	if (!tachoPort.AttachInterrupt(FanInterrupt, InterruptMode::falling, CallbackParameter(this)))
+	{
+		tachoArmed = false;
+	}
+}
+
 int32_t LocalFan::GetRPM()
 {
-	// The ISR sets fanInterval to the number of step interrupt clocks it took to get fanMaxInterruptCount interrupts.
+	// The ISR sets fanInterval to the number of step interrupt clocks between the first and last edges of a measurement, and fanIntervalPeriods to the number of tacho periods in between.
 	// We get 2 tacho pulses per revolution, hence 2 interrupts per revolution.
 	// When the fan stops, we get no interrupts and fanInterval stops getting updated. We must recognise this and return zero.
-	return (!tachoPort.IsValid())
-			? -1																			// we return -1 if there is no tacho configured
-			: (fanInterval != 0 && StepTimer::GetTimerTicks() - fanLastResetTime < 3 * StepTimer::StepClockRate)	// if we have a reading and it is less than 3 seconds old
-			  ? (StepTimer::StepClockRate * fanMaxInterruptCount * (60/2))/fanInterval		// then calculate RPM assuming 2 interrupts per rev
-			  : 0;																			// else assume fan is off or tacho not connected
+	if (!tachoPort.IsValid())
+	{
+		return -1;																		// we return -1 if there is no tacho configured
+	}
+
+	uint32_t interval, periods, lastResetTime;
+	{
+		AtomicCriticalSectionLocker lock;
+		interval = fanInterval;
+		periods = fanIntervalPeriods;
+		lastResetTime = fanLastResetTime;
+	}
+	return (interval != 0 && StepTimer::GetTimerTicks() - lastResetTime < 3 * StepTimer::StepClockRate)	// if we have a reading and it is less than 3 seconds old
+			? (StepTimer::StepClockRate * periods * (60/2))/interval						// then calculate RPM assuming 2 interrupts per rev
+			: 0;																			// else assume fan is off or tacho not connected
 }
 
+// Tacho interrupt. We time whole tacho periods from the first edge, which gives good resolution at low speeds.
+// When we have enough periods we detach the interrupt until Check() starts the next measurement.
 void LocalFan::Interrupt()
 {
-	++fanInterruptCount;
-	if (fanInterruptCount == fanMaxInterruptCount)
+	const uint32_t now = StepTimer::GetTimerTicks();
+	if (fanInterruptCount == 0)
 	{
-		const uint32_t now = StepTimer::GetTimerTicks();
-		fanInterval = now - fanLastResetTime;
-		fanLastResetTime = now;
-		fanInterruptCount = 0;
+		fanFirstEdgeTime = now;
 	}
+	else
+	{
+		const uint32_t elapsed = now - fanFirstEdgeTime;
+		if (fanInterruptCount == fanMaxInterruptCount || elapsed >= TachoMaxMeasurementTicks)
+		{
+			fanInterval = elapsed;
+			fanIntervalPeriods = fanInterruptCount;
+			fanLastResetTime = now;
+			tachoPort.DetachInterrupt();
+			tachoArmed = false;
+			return;
+		}
+	}
+	++fanInterruptCount;
 }
 
 // End
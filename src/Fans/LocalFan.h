@@ -9,6 +9,7 @@
 #define SRC_FANS_LOCALFAN_H_
 
 #include "Fan.h"
+#include <Movement/StepTimer.h>
 
 class LocalFan : public Fan
 {
@@ -21,6 +22,7 @@ public:
 	void SetPwmFrequency(PwmFrequency freq) override { port.SetFrequency(freq); }
 	int32_t GetRPM() override;
 	void ReportPortDetails(const StringRef& str) const override;
+	GCodeResult SetFullSpeedRpm(uint32_t rpm, const StringRef& reply) override;
 
 	bool AssignPorts(const char *pinNames, const StringRef& reply);
 
@@ -36,12 +38,31 @@ private:
 	PwmPort port;											// port used to control the fan
 	IoPort tachoPort;										// port used to read the tacho
 
-	// Variables used to read the tacho
-	static constexpr uint32_t fanMaxInterruptCount = 16;	// number of fan interrupts that we average over
-	uint32_t fanInterruptCount;								// accessed only in ISR, so no need to declare it volatile
-	volatile uint32_t fanLastResetTime;						// time (in step clocks) at which we last reset the interrupt count, accessed inside and outside ISR
+	void ArmTacho();
+	float GetClosedLoopPwm(float reqVal);
+
+	// Variables used to read the tacho. To limit the interrupt load from fast fans we measure the tacho period in bursts, with the interrupt detached between them.
+	static constexpr uint32_t fanMaxInterruptCount = 16;	// maximum number of tacho periods that we average over
+	static constexpr uint32_t TachoMaxMeasurementTicks = StepTimer::StepClockRate/2;	// we end a measurement early after this long so that slow fans are measured in reasonable time
+	static constexpr uint32_t TachoSampleIntervalTicks = StepTimer::StepClockRate/2;	// how long we wait after a measurement before starting another
+	uint32_t fanInterruptCount;								// accessed only in ISR while the tacho is armed, so no need to declare it volatile
+	uint32_t fanFirstEdgeTime;								// time (in step clocks) of the first edge in the current measurement, accessed only in ISR
+	volatile uint32_t fanLastResetTime;						// time (in step clocks) at which we last completed a measurement, accessed inside and outside ISR
 	volatile uint32_t fanInterval;							// written by ISR, read outside the ISR
+	volatile uint32_t fanIntervalPeriods;					// the number of tacho periods that fanInterval covers, written by ISR
+	volatile bool tachoArmed;								// true if the tacho interrupt is attached
+
+	// Variables used for closed loop RPM control. The requested speed is treated as a fraction of fullSpeedRpm and the loop trims the PWM to achieve it.
+	static constexpr float RpmControlKp = 0.3;				// proportional gain, PWM fraction per unit of normalised RPM error
+	static constexpr float RpmControlKi = 0.5;				// integral gain, PWM fraction per second per unit of normalised RPM error
+	static constexpr float RpmControlMaxCorrection = 0.5;	// limit on the integral term, to prevent windup when the fan can't reach the target
+	static constexpr uint32_t RpmControlMaxSampleTicks = 2 * StepTimer::StepClockRate;	// readings further apart than this are not used to update the integral term
+	uint32_t fullSpeedRpm;									// 0 for open loop control
+	uint32_t lastRpmReadingTime;							// the value of fanLastResetTime when we last updated the loop
+	float rpmProportionalTerm;
+	float rpmIntegralTerm;
 
+	float lastPwm;											// the PWM we last wrote to the port, or negative to force the next write
 	uint32_t blipStartTime;
 	bool blipping;
 };
@@ -42,9 +42,10 @@ void Duet3DFilamentMonitor::InitReceiveBuffer() noexcept
 }
 
 // ISR for when the pin state changes. It should return true if the ISR wants the commanded extrusion to be fetched and stored because we have seen a potential start bit.
-bool Duet3DFilamentMonitor::Interrupt() noexcept
+// 'isrStartTime' is the step timer value when the ISR was entered, which saves us another synchronised read of the timer.
+bool Duet3DFilamentMonitor::Interrupt(uint32_t isrStartTime) noexcept
 {
-	uint32_t now = StepTimer::GetTimerTicks();
+	uint32_t now = isrStartTime;
 	bool wantReading = false;
 	const size_t writePointer = edgeCaptureWritePointer;			// capture volatile variable
 	if ((writePointer + 1) % EdgeCaptureBufferSize != edgeCaptureReadPointer)	// if buffer is not full
@@ -19,7 +19,7 @@ class Duet3DFilamentMonitor : public FilamentMonitor
 public:
 	Duet3DFilamentMonitor(unsigned int extruder, unsigned int pType) noexcept;
 
-	bool Interrupt() noexcept override;
+	bool Interrupt(uint32_t isrStartTime) noexcept override;
 
 protected:
 	void InitReceiveBuffer() noexcept;
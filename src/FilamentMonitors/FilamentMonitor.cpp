@@ -14,6 +14,7 @@
 #include "LaserFilamentMonitor.h"
 #include "PulsedFilamentMonitor.h"
 #include <Platform.h>
+#include <IsrProfiler.h>
 #include <Movement/Move.h>
 #include <CAN/CanInterface.h>
 #include <CanMessageFormats.h>
@@ -26,11 +27,13 @@ ReadWriteLock FilamentMonitor::filamentMonitorsLock;
 FilamentMonitor *FilamentMonitor::filamentSensors[NumDrivers] = { 0 };
 uint32_t FilamentMonitor::whenStatusLastSent = 0;
 uint32_t FilamentMonitor::minInterruptTime = 0xFFFFFFFF, FilamentMonitor::maxInterruptTime = 0;
+uint8_t FilamentMonitor::interruptTimingCounter = 0;
 uint32_t FilamentMonitor::minPollTime = 0xFFFFFFFF, FilamentMonitor::maxPollTime = 0;
 
 // Constructor
 FilamentMonitor::FilamentMonitor(uint8_t p_driver, unsigned int t) noexcept
-	: type(t), driver(p_driver), lastStatus(FilamentSensorStatus::noDataReceived)
+	: isrMeasurement(0), sampleMeasurement(0), numIsrSamplesDeferred(0), whenLastChecked(millis()), numChecks(0), numChecksSkipped(0), type(t), driver(p_driver),
+	  isrSampleWriteIndex(0), isrSampleReadIndex(0), lastStatus(FilamentSensorStatus::noDataReceived)
 {
 }
 
@@ -60,7 +63,7 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 			return GCodeResult::error;
 		}
 
-		haveIsrStepsCommanded = false;
+		isrSampleReadIndex = isrSampleWriteIndex;
 		if (interruptMode != InterruptMode::none && !port.AttachInterrupt(InterruptEntry, interruptMode, CallbackParameter(this)))
 		{
 			reply.copy("unsuitable pin");
@@ -190,25 +193,45 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 // ISR
 /*static*/ void FilamentMonitor::InterruptEntry(CallbackParameter param) noexcept
 {
+	ISR_PROFILE_ENTER();
 	const uint32_t startTime = StepTimer::GetTimerTicks();
 	FilamentMonitor * const fm = static_cast<FilamentMonitor*>(param.vp);
-	if (fm->Interrupt())
+	if (fm->Interrupt(startTime))
 	{
-		fm->isrExtruderStepsCommanded = moveInstance->GetAccumulatedExtrusion(fm->driver, fm->isrWasPrinting);
-		fm->haveIsrStepsCommanded = true;
-		fm->lastIsrMillis = millis();
-	}
-	const uint32_t elapsedTime = StepTimer::GetTimerTicks() - startTime;
-	if (elapsedTime > maxInterruptTime)
-	{
-		maxInterruptTime = elapsedTime;
+		// Record the extrusion commanded at this instant along with the measurement. If the queue is full then we leave the extrusion in the accumulator for the next sample.
+		const size_t writeIndex = fm->isrSampleWriteIndex;
+		const size_t nextWriteIndex = (writeIndex + 1) & (IsrSampleQueueLength - 1);
+		if (nextWriteIndex != fm->isrSampleReadIndex)
+		{
+			IsrSample& sample = fm->isrSamples[writeIndex];
+			sample.extruderStepsCommanded = moveInstance->GetAccumulatedExtrusion(fm->driver, sample.wasPrinting);
+			sample.millis = millis();
+			sample.measurement = fm->isrMeasurement;
+			fm->isrSampleWriteIndex = nextWriteIndex;
+		}
+		else
+		{
+			++fm->numIsrSamplesDeferred;
+		}
 	}
-	if (elapsedTime < minInterruptTime)
+	if (++interruptTimingCounter == InterruptTimingInterval)
 	{
-		minInterruptTime = elapsedTime;
+		interruptTimingCounter = 0;
+		const uint32_t elapsedTime = StepTimer::GetTimerTicks() - startTime;
+		if (elapsedTime > maxInterruptTime)
+		{
+			maxInterruptTime = elapsedTime;
+		}
+		if (elapsedTime < minInterruptTime)
+		{
+			minInterruptTime = elapsedTime;
+		}
 	}
+	ISR_PROFILE_EXIT(pinInterrupt);
 }
 
+// Check the filament monitors. A monitor is checked when the ISR has recorded a sample, when the extrusion commanded since the last check reaches a fraction of its
+// minimum check length, or when MaxCheckInterval has passed. So when the extruder isn't moving we only check at MaxCheckInterval.
 /*static*/ void FilamentMonitor::Spin() noexcept
 {
 	CanMessageBuffer buf(nullptr);
@@ -224,35 +247,63 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 			FilamentSensorStatus fst(FilamentSensorStatus::noMonitor);
 			if (filamentSensors[drv] != nullptr)
 			{
-				const uint32_t startTime = StepTimer::GetTimerTicks();
 				haveMonitor = true;
 				FilamentMonitor& fs = *filamentSensors[drv];
-				bool isPrinting;
-				bool fromIsr;
-				int32_t extruderStepsCommanded;
-				uint32_t locIsrMillis;
-				IrqDisable();
-				if (fs.haveIsrStepsCommanded)
+				const uint32_t now = millis();
+				if (   !fs.HaveIsrStepsCommanded()
+					&& now - fs.whenLastChecked < MaxCheckInterval
+					&& (float)abs(moveInstance->GetPendingExtrusion(drv)) < max<float>(fs.GetMinimumCheckLength() * CheckLengthFraction * Platform::DriveStepsPerUnit(drv), 1.0)
+				   )
 				{
-					extruderStepsCommanded = fs.isrExtruderStepsCommanded;
-					isPrinting = fs.isrWasPrinting;
-					locIsrMillis = fs.lastIsrMillis;
-					fs.haveIsrStepsCommanded = false;
-					IrqEnable();
-					fromIsr = true;
+					++fs.numChecksSkipped;
+					msg->data[drv].Set(fs.lastStatus.ToBaseType());
+					continue;
 				}
-				else
+
+				const uint32_t startTime = StepTimer::GetTimerTicks();
+				fs.whenLastChecked = now;
+				++fs.numChecks;
+				const bool printing = Platform::IsPrinting();
+
+				// Pass the samples recorded by the ISR to Check in the order they were taken, so that each measurement is paired with the extrusion commanded at the same instant.
+				// Then fetch the extrusion commanded since the last sample, making sure that the ISR didn't record another sample first.
+				fst = FilamentSensorStatus::ok;
+				bool isPrinting;
+				int32_t extruderStepsCommanded;
+				for (;;)
 				{
-					extruderStepsCommanded = moveInstance->GetAccumulatedExtrusion(drv, isPrinting);		// get and clear the net extrusion commanded
+					while (fs.isrSampleReadIndex != fs.isrSampleWriteIndex)
+					{
+						const IsrSample& sample = fs.isrSamples[fs.isrSampleReadIndex];
+						if (printing)
+						{
+							fs.sampleMeasurement = sample.measurement;
+							const FilamentSensorStatus sampleStatus = fs.Check(sample.wasPrinting, true, sample.millis, (float)sample.extruderStepsCommanded/Platform::DriveStepsPerUnit(drv));
+							if (sampleStatus != FilamentSensorStatus::ok)
+							{
+								fst = sampleStatus;
+							}
+						}
+						fs.isrSampleReadIndex = (fs.isrSampleReadIndex + 1) & (IsrSampleQueueLength - 1);
+					}
+
+					IrqDisable();
+					if (fs.isrSampleReadIndex == fs.isrSampleWriteIndex)
+					{
+						extruderStepsCommanded = moveInstance->GetAccumulatedExtrusion(drv, isPrinting);		// get and clear the net extrusion commanded
+						IrqEnable();
+						break;
+					}
 					IrqEnable();
-					fromIsr = false;
-					locIsrMillis = 0;
 				}
 
-				if (Platform::IsPrinting())
+				if (printing)
 				{
-					const float extrusionCommanded = (float)extruderStepsCommanded/Platform::DriveStepsPerUnit(drv);
-					fst = fs.Check(isPrinting, fromIsr, locIsrMillis, extrusionCommanded);
+					const FilamentSensorStatus pollStatus = fs.Check(isPrinting, false, 0, (float)extruderStepsCommanded/Platform::DriveStepsPerUnit(drv));
+					if (fst == FilamentSensorStatus::ok)
+					{
+						fst = pollStatus;
+					}
 				}
 				else
 				{
@@ -329,6 +380,39 @@ GCodeResult FilamentMonitor::CommonConfigure(const CanMessageGenericParser& pars
 				first = false;
 			}
 			fs->Diagnostics(reply);
+			reply.catf(", checks %" PRIu32 " skipped %" PRIu32, fs->numChecks, fs->numChecksSkipped);
+			fs->numChecks = fs->numChecksSkipped = 0;
+			if (fs->numIsrSamplesDeferred != 0)
+			{
+				reply.catf(", ISR samples deferred %" PRIu32, fs->numIsrSamplesDeferred);
+				fs->numIsrSamplesDeferred = 0;
+			}
+		}
+	}
+}
+
+// Append the sensor health statistics. The format is the number of monitors, then for each one a semicolon, the driver number, colon, the monitor type, colon, and its health values.
+/*static*/ void FilamentMonitor::AppendSensorHealth(const StringRef& reply) noexcept
+{
+	ReadLocker lock(filamentMonitorsLock);
+
+	unsigned int numMonitors = 0;
+	for (const FilamentMonitor *fs : filamentSensors)
+	{
+		if (fs != nullptr)
+		{
+			++numMonitors;
+		}
+	}
+
+	reply.printf("%u", numMonitors);
+	for (size_t i = 0; i < NumDrivers; ++i)
+	{
+		const FilamentMonitor * const fs = filamentSensors[i];
+		if (fs != nullptr)
+		{
+			reply.catf(";%u:%u:", (unsigned int)i, fs->GetType());
+			fs->AppendHealth(reply);
 		}
 	}
 }
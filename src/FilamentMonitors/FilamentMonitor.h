@@ -33,8 +33,12 @@ public:
 	// Print diagnostic info for this sensor
 	virtual void Diagnostics(const StringRef& reply) noexcept = 0;
 
+	// Append the values that the sensor reports about its own health, if it reports any
+	virtual void AppendHealth(const StringRef& reply) const noexcept { }
+
 	// ISR for when the pin state changes. It should return true if the ISR wants the commanded extrusion to be fetched.
-	virtual bool Interrupt() noexcept = 0;
+	// 'isrStartTime' is the step timer value read on entry to the ISR, so that edge timing doesn't need another read of the timer.
+	virtual bool Interrupt(uint32_t isrStartTime) noexcept = 0;
 
 	// Call this to disable the interrupt before deleting a filament monitor
 	virtual void Disable() noexcept;
@@ -69,6 +73,9 @@ public:
 	// Generate diagnostics info
 	static void GetDiagnostics(const StringRef& reply) noexcept;
 
+	// Append the sensor health statistics of all the filament monitors, for the main board to poll
+	static void AppendSensorHealth(const StringRef& reply) noexcept;
+
 	// This must be public so that the array descriptor in class RepRap can lock it
 	static ReadWriteLock filamentMonitorsLock;
 
@@ -85,11 +92,20 @@ protected:
 	// Clear the measurement state - called when we are not printing a file. Return the present/not present status if available.
 	virtual FilamentSensorStatus Clear() noexcept = 0;
 
+	// Return the extrusion length over which this monitor compares the commanded and measured extrusion, or 0 if it doesn't measure extrusion
+	virtual float GetMinimumCheckLength() const noexcept { return 0.0; }
+
 	GCodeResult CommonConfigure(const CanMessageGenericParser& parser, const StringRef& reply, InterruptMode interruptMode, bool& seen) noexcept;
 
 	uint8_t GetDriver() const noexcept { return driver; }
 	const IoPort& GetPort() const noexcept { return port; }
-	bool HaveIsrStepsCommanded() const noexcept { return haveIsrStepsCommanded; }
+	bool HaveIsrStepsCommanded() const noexcept { return isrSampleWriteIndex != isrSampleReadIndex; }
+
+	// A derived class whose Interrupt function counts or measures something should store the running value here, so that it is recorded along with the extrusion commanded
+	void SetIsrMeasurement(uint32_t val) noexcept { isrMeasurement = val; }
+
+	// Get the measurement recorded with the ISR sample that is being passed to Check. Only valid when Check is called with fromIsr true.
+	uint32_t GetSampleMeasurement() const noexcept { return sampleMeasurement; }
 
 	static int32_t ConvertToPercent(float f)
 	{
@@ -102,18 +118,36 @@ private:
 	static FilamentMonitor *filamentSensors[NumDrivers];
 	static uint32_t whenStatusLastSent;
 	static uint32_t minInterruptTime, maxInterruptTime;
+	static uint8_t interruptTimingCounter;
 	static uint32_t minPollTime, maxPollTime;
 
 	static constexpr uint32_t StatusUpdateInterval = 2000;				// how often we send status reports when there isn't a change
+	static constexpr uint8_t InterruptTimingInterval = 8;				// we time one in this many interrupts, because on the SAMC21 each read of the step timer needs a slow synchronisation
+	static constexpr size_t IsrSampleQueueLength = 4;					// must be a power of 2
+	static constexpr uint32_t MaxCheckInterval = 20;					// the longest we go without calling Check or Clear, so that the Duet3D sensor edge buffers can't overflow
+	static constexpr float CheckLengthFraction = 0.25;					// we call Check when the extrusion commanded reaches this fraction of the minimum check length
 
-	int32_t isrExtruderStepsCommanded;
-	uint32_t lastIsrMillis;
+	// A sample recorded by the ISR. The extrusion commanded is the amount since the previous sample, so no extrusion is lost however many samples are queued.
+	struct IsrSample
+	{
+		int32_t extruderStepsCommanded;
+		uint32_t millis;
+		uint32_t measurement;
+		bool wasPrinting;
+	};
+
+	IsrSample isrSamples[IsrSampleQueueLength];
+	volatile uint32_t isrMeasurement;
+	uint32_t sampleMeasurement;
+	uint32_t numIsrSamplesDeferred;										// how many times the ISR found the queue full, so the extrusion was left for the next sample
+	uint32_t whenLastChecked;											// the millis() time at which we last called Check or Clear
+	uint32_t numChecks, numChecksSkipped;								// for diagnostics
 	unsigned int type;
 	IoPort port;
 	uint8_t driver;
 
-	bool isrWasPrinting;
-	bool haveIsrStepsCommanded;
+	volatile uint8_t isrSampleWriteIndex;
+	uint8_t isrSampleReadIndex;
 	FilamentSensorStatus lastStatus;
 };
 
@@ -0,0 +1,109 @@
+/*
+ * FilamentRatioStatistics.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_FILAMENTMONITORS_FILAMENTRATIOSTATISTICS_H_
+#define SRC_FILAMENTMONITORS_FILAMENTRATIOSTATISTICS_H_
+
+#include <RepRapFirmware.h>
+#include <Duet3Common.h>
+
+// Class to keep a rolling mean and variance of the ratio of measured to commanded extrusion, and to decide whether a comparison is anomalous.
+// The first few samples are averaged equally, then older samples are given exponentially decreasing weight so that we follow slow changes in the sensor.
+// A comparison outside the fixed limits is only reported if it is also significant or we don't have enough data yet, which avoids false positives from a sensor that is normally close to a limit.
+// A run of significant deviations in the same direction is reported even if it is within the fixed limits, so that we detect partial clogs earlier.
+class FilamentRatioStatistics
+{
+public:
+	static constexpr unsigned int WindowLength = 32;			// the approximate number of recent comparisons that the statistics cover
+	static constexpr unsigned int MinSamples = 8;				// how many comparisons we need before we trust the statistics
+	static constexpr float SignificanceThreshold = 3.0;			// how many standard deviations from the mean makes a comparison significant
+	static constexpr float MinStandardDeviation = 0.05;			// floor on the standard deviation, so that a very steady sensor doesn't make us over-sensitive
+	static constexpr unsigned int AnomaliesToReport = 3;		// how many consecutive significant deviations in the same direction we report even if they are within the limits
+
+	FilamentRatioStatistics() noexcept { Reset(); }
+
+	void Reset() noexcept
+	{
+		mean = variance = 0.0;
+		numSamples = numAnomalies = numLimitViolationsIgnored = 0;
+		consecutiveLow = consecutiveHigh = 0;
+	}
+
+	// Add the ratio from a comparison and return the status that it indicates
+	FilamentSensorStatus Check(float ratio, float minAllowed, float maxAllowed) noexcept
+	{
+		FilamentSensorStatus ret = FilamentSensorStatus::ok;
+		const bool established = (numSamples >= MinSamples);
+		const float deviation = ratio - mean;
+		const bool significant = established && fabsf(deviation) >= SignificanceThreshold * max<float>(sqrtf(variance), MinStandardDeviation);
+		if (significant)
+		{
+			++numAnomalies;
+			if (deviation < 0.0)
+			{
+				++consecutiveLow;
+				consecutiveHigh = 0;
+			}
+			else
+			{
+				++consecutiveHigh;
+				consecutiveLow = 0;
+			}
+		}
+		else
+		{
+			consecutiveLow = consecutiveHigh = 0;
+		}
+
+		if (ratio < minAllowed || ratio > maxAllowed)
+		{
+			if (!established || significant)
+			{
+				ret = (ratio < minAllowed) ? FilamentSensorStatus::tooLittleMovement : FilamentSensorStatus::tooMuchMovement;
+			}
+			else
+			{
+				++numLimitViolationsIgnored;
+			}
+		}
+		else if (consecutiveLow >= AnomaliesToReport)
+		{
+			ret = FilamentSensorStatus::tooLittleMovement;
+		}
+		else if (consecutiveHigh >= AnomaliesToReport)
+		{
+			ret = FilamentSensorStatus::tooMuchMovement;
+		}
+
+		// Update the statistics using Welford's method with the weight limited to 1/WindowLength
+		if (numSamples < WindowLength)
+		{
+			++numSamples;
+		}
+		const float weight = 1.0/(float)numSamples;
+		mean += weight * deviation;
+		variance = (1.0 - weight) * (variance + weight * fsquare(deviation));
+		return ret;
+	}
+
+	void Diagnostics(const StringRef& reply) const noexcept
+	{
+		reply.catf(", ratio mean %.1f%% sd %.1f%% n %u, anomalies %u, limit violations ignored %u",
+					(double)(mean * 100.0), (double)(sqrtf(variance) * 100.0), numSamples, numAnomalies, numLimitViolationsIgnored);
+	}
+
+private:
+	float mean;
+	float variance;
+	unsigned int numSamples;
+	unsigned int numAnomalies;
+	unsigned int numLimitViolationsIgnored;
+	unsigned int consecutiveLow;
+	unsigned int consecutiveHigh;
+};
+
+#endif /* SRC_FILAMENTMONITORS_FILAMENTRATIOSTATISTICS_H_ */
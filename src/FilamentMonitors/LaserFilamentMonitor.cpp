@@ -13,12 +13,22 @@
 #include "Movement/Move.h"
 #include <CanMessageFormats.h>
 #include <CanMessageGenericParser.h>
+#include <CAN/CanInterface.h>
 
 // Unless we set the option to compare filament on all type of move, we reject readings if the last retract or reprime move wasn't completed
 // well before the start bit was received. This is because those moves have high accelerations and decelerations, so the measurement delay
 // is more likely to cause errors. This constant sets the delay required after a retract or reprime move before we accept the measurement.
 const int32_t SyncDelayMillis = 10;
 
+// Raise a driver warning event with some text
+static void RaiseHealthWarning(unsigned int driver, const char *format, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(EventType::driver_warning, 0, driver, format, vargs);
+	va_end(vargs);
+}
+
 LaserFilamentMonitor::LaserFilamentMonitor(unsigned int extruder, unsigned int monitorType) noexcept
 	: Duet3DFilamentMonitor(extruder, monitorType),
 	  calibrationFactor(1.0),
@@ -39,6 +49,11 @@ void LaserFilamentMonitor::Init() noexcept
 	version = 1;
 	backwards = false;
 	sensorError = false;
+	ratioStatistics.Reset();
+	qualityStats.Reset();
+	brightnessStats.Reset();
+	shutterStats.Reset();
+	healthWarningRaised = false;
 	InitReceiveBuffer();
 	Reset();
 }
@@ -184,6 +199,7 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 {
 	uint16_t val;
 	PollResult res;
+	bool receivedHealthReport = false;
 	while ((res = PollReceiveBuffer(val)) != PollResult::incomplete)
 	{
 		// We have either received a report or there has been a framing error
@@ -217,6 +233,9 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 				case TypeLaserMessageTypeQuality:
 					brightness = val & 0x00FF;
 					shutter = (val >> 8) & 0x1F;
+					brightnessStats.Add(brightness);
+					shutterStats.Add(shutter);
+					receivedHealthReport = true;
 					break;
 
 				case TypeLaserMessageTypeInfo:
@@ -228,14 +247,19 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 
 					case TypeLaserInfoTypeImageQuality:
 						imageQuality = val & 0x00FF;
+						qualityStats.Add(imageQuality);
+						receivedHealthReport = true;
 						break;
 
 					case TypeLaserInfoTypeBrightness:
 						brightness = val & 0x00FF;
+						brightnessStats.Add(brightness);
 						break;
 
 					case TypeLaserInfoTypeShutter:
 						shutter = val & 0x00FF;
+						shutterStats.Add(shutter);
+						receivedHealthReport = true;
 						break;
 					}
 					break;
@@ -278,6 +302,23 @@ void LaserFilamentMonitor::HandleIncomingData() noexcept
 		}
 		haveStartBitData = false;
 	}
+
+	if (receivedHealthReport)
+	{
+		CheckSensorHealth();
+	}
+}
+
+// Warn the main board once when the sensor health values have drifted far enough from their baselines to suggest dirty or failing optics
+void LaserFilamentMonitor::CheckSensorHealth() noexcept
+{
+	const bool degraded = IsSensorDegraded();
+	if (degraded && !healthWarningRaised)
+	{
+		RaiseHealthWarning(GetDriver(), "laser filament sensor degrading, quality %.0f (was %.0f), shutter %.0f (was %.0f)",
+							(double)qualityStats.GetMean(), (double)qualityStats.GetBaseline(), (double)shutterStats.GetMean(), (double)shutterStats.GetBaseline());
+	}
+	healthWarningRaised = degraded;
 }
 
 // Call the following at intervals to check the status. This is only called when printing is in progress.
@@ -391,16 +432,10 @@ FilamentSensorStatus LaserFilamentMonitor::CheckFilament(float amountCommanded,
 			{
 				minMovementRatio = ratio;
 			}
+			const FilamentSensorStatus stat = ratioStatistics.Check(ratio, minMovementAllowed, maxMovementAllowed);
 			if (comparisonEnabled)
 			{
-				if (ratio < minMovementAllowed)
-				{
-					ret = FilamentSensorStatus::tooLittleMovement;
-				}
-				else if (ratio > maxMovementAllowed)
-				{
-					ret = FilamentSensorStatus::tooMuchMovement;
-				}
+				ret = stat;
 			}
 		}
 		break;
@@ -436,6 +471,25 @@ void LaserFilamentMonitor::Diagnostics(const StringRef& reply) noexcept
 	}
 	reply.catf(", errs: frame %" PRIu32 " parity %" PRIu32 " ovrun %" PRIu32 " pol %" PRIu32 " ovdue %" PRIu32,
 				framingErrorCount, parityErrorCount, overrunErrorCount, polarityErrorCount, overdueCount);
+	ratioStatistics.Diagnostics(reply);
+	if (qualityStats.HaveBaseline() || shutterStats.HaveBaseline())
+	{
+		reply.catf(", quality %.1f base %.1f, shutter %.1f base %.1f%s",
+					(double)qualityStats.GetMean(), (double)qualityStats.GetBaseline(), (double)shutterStats.GetMean(), (double)shutterStats.GetBaseline(),
+					(IsSensorDegraded()) ? ", degraded" : "");
+	}
+}
+
+// Append the sensor health statistics. Each one is given as mean/min/max/baseline, or empty if we have had no reports of it.
+void LaserFilamentMonitor::AppendHealth(const StringRef& reply) const noexcept
+{
+	reply.catf("%u:", version);
+	qualityStats.Append(reply);
+	reply.cat(':');
+	brightnessStats.Append(reply);
+	reply.cat(':');
+	shutterStats.Append(reply);
+	reply.catf(":%u", (IsSensorDegraded()) ? 1u : 0u);
 }
 
 #endif	// SUPPORT_DRIVERS
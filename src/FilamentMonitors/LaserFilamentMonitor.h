@@ -9,6 +9,8 @@
 #define SRC_FILAMENTSENSORS_LASERFILAMENTMONITOR_H_
 
 #include "Duet3DFilamentMonitor.h"
+#include "FilamentRatioStatistics.h"
+#include "SensorQualityStatistics.h"
 
 #if SUPPORT_DRIVERS
 
@@ -20,12 +22,16 @@ public:
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) noexcept override;
 	FilamentSensorStatus Check(bool isPrinting, bool fromIsr, uint32_t isrMillis, float filamentConsumed) noexcept override;
 	FilamentSensorStatus Clear() noexcept override;
+	float GetMinimumCheckLength() const noexcept override { return minimumExtrusionCheckLength; }
 	void Diagnostics(const StringRef& reply) noexcept override;
+	void AppendHealth(const StringRef& reply) const noexcept override;
 
 private:
 	static constexpr float DefaultMinMovementAllowed = 0.6;
 	static constexpr float DefaultMaxMovementAllowed = 1.6;
 	static constexpr float DefaultMinimumExtrusionCheckLength = 3.0;
+	static constexpr float QualityDegradedFraction = 0.25;			// we warn if the image quality falls by this fraction from its baseline
+	static constexpr float ShutterDegradedFraction = 0.5;			// we warn if the shutter rises by this fraction from its baseline, because the sensor is compensating for less light
 
 	// This is the received data format:
 	//  v1 Data word:			P00S 00pp pppp pppp		S = switch open, pppppppppp = 10-bit filament position (50 counts/mm)
@@ -68,6 +74,8 @@ private:
 	void HandleIncomingData() noexcept;
 	float GetCurrentPosition() const noexcept;
 	FilamentSensorStatus CheckFilament(float amountCommanded, float amountMeasured, bool overdue) noexcept;
+	void CheckSensorHealth() noexcept;
+	bool IsSensorDegraded() const noexcept { return qualityStats.HasFallen(QualityDegradedFraction) || shutterStats.HasRisen(ShutterDegradedFraction); }
 
 	bool HaveCalibrationData() const noexcept;
 	float MeasuredSensitivity() const noexcept;
@@ -110,9 +118,14 @@ private:
 
 	// Values measured for calibration
 	float minMovementRatio, maxMovementRatio;
+	FilamentRatioStatistics ratioStatistics;
 	float totalExtrusionCommanded;
 	float totalMovementMeasured;
 
+	// Rolling statistics of the sensor health values
+	SensorQualityStatistic qualityStats, brightnessStats, shutterStats;
+	bool healthWarningRaised;								// true if we have warned that the sensor is degraded and it hasn't recovered since
+
 	bool dataReceived;
 	bool backwards;
 
@@ -30,7 +30,12 @@ PulsedFilamentMonitor::PulsedFilamentMonitor(unsigned int extruder, unsigned int
 
 void PulsedFilamentMonitor::Init() noexcept
 {
-	sensorValue = 0;
+	sensorValue = pulsesAtInterrupt = pulsesAtLastSync = 0;
+	lastPulseTime = lastPeriod = lastPulseStepInterval = 0;
+	havePeriodCapture = false;
+	numPeriodsLost = numPeriodChecks = 0;
+	lastPeriodRatio = 0.0;
+	SetIsrMeasurement(0);
 	calibrationStarted = false;
 	samplesReceived = 0;
 	lastMeasurementTime = 0;
@@ -42,6 +47,8 @@ void PulsedFilamentMonitor::Reset() noexcept
 	extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = movementMeasuredSinceLastSync = 0.0;
 	comparisonStarted = false;
 	haveInterruptData = false;
+	pulsesAtLastSync = sensorValue;
+	periodExtrusionCommanded = periodMovementMeasured = 0.0;
 	wasPrintingAtInterrupt = false;			// force a resync
 }
 
@@ -135,9 +142,32 @@ GCodeResult PulsedFilamentMonitor::Configure(const CanMessageGenericParser& pars
 }
 
 // ISR for when the pin state changes. It should return true if the ISR wants the commanded extrusion to be fetched.
-bool PulsedFilamentMonitor::Interrupt() noexcept
+bool PulsedFilamentMonitor::Interrupt(uint32_t isrStartTime) noexcept
 {
 	++sensorValue;
+	SetIsrMeasurement(sensorValue);
+
+	// Capture the time since the previous pulse along with the extruder step interval from the step ISR, so that we can compare the filament velocity with the commanded velocity.
+	// We only use the period if the extruder was moving at a similar speed at both ends of it and the period is similar to the previous one, which rejects periods that include a pause in extrusion.
+	const uint32_t period = isrStartTime - lastPulseTime;
+	const uint32_t stepInterval = moveInstance->GetStepInterval(GetDriver(), 0);
+	if (   period >= MinPeriodClocks
+		&& period < 2 * lastPeriod && lastPeriod < 2 * period
+		&& stepInterval != 0 && lastPulseStepInterval != 0
+		&& stepInterval < 2 * lastPulseStepInterval && lastPulseStepInterval < 2 * stepInterval
+	   )
+	{
+		if (havePeriodCapture)
+		{
+			++numPeriodsLost;
+		}
+		capturedPeriod = period;
+		capturedStepInterval = (stepInterval + lastPulseStepInterval)/2;
+		havePeriodCapture = true;
+	}
+	lastPulseTime = isrStartTime;
+	lastPeriod = period;
+	lastPulseStepInterval = stepInterval;
 	if (samplesReceived < 100)
 	{
 		++samplesReceived;
@@ -157,26 +187,59 @@ bool PulsedFilamentMonitor::Interrupt() noexcept
 // Call the following regularly to keep the status up to date
 void PulsedFilamentMonitor::Poll() noexcept
 {
-	IrqDisable();
-	const uint32_t locSensorVal = sensorValue;
-	sensorValue = 0;
-	IrqEnable();
-	movementMeasuredSinceLastSync += (float)locSensorVal;
-
 	if (haveInterruptData)					// if we have a synchronised value for the amount of extrusion commanded
 	{
+		// Use the pulse count recorded by the ISR at the same time as the extrusion commanded, not the count now, so that the two are aligned even during fast moves
 		if (wasPrintingAtInterrupt && (int32_t)(lastSyncTime - moveInstance->ExtruderPrintingSince()) > SyncDelayMillis)
 		{
 			// We can use this measurement
 			extrusionCommandedThisSegment += extrusionCommandedAtInterrupt;
-			movementMeasuredThisSegment += movementMeasuredSinceLastSync;
+			movementMeasuredThisSegment += (float)(pulsesAtInterrupt - pulsesAtLastSync);
 		}
 		lastSyncTime = lastIsrTime;
 		extrusionCommandedSinceLastSync -= extrusionCommandedAtInterrupt;
-		movementMeasuredSinceLastSync = 0.0;
+		pulsesAtLastSync = pulsesAtInterrupt;
 
 		haveInterruptData = false;
 	}
+	movementMeasuredSinceLastSync = (float)(sensorValue - pulsesAtLastSync);
+
+	if (havePeriodCapture)
+	{
+		IrqDisable();
+		const uint32_t period = capturedPeriod;
+		const uint32_t stepInterval = capturedStepInterval;
+		havePeriodCapture = false;
+		IrqEnable();
+
+		// During the period we measured one pulse of filament movement, and the extruder took period/stepInterval steps
+		periodExtrusionCommanded += (float)period/((float)stepInterval * Platform::DriveStepsPerUnit(GetDriver()));
+		periodMovementMeasured += mmPerPulse;
+	}
+}
+
+// Compare the filament velocity measured from the pulse periods with the commanded velocity. This gives better resolution than counting pulses when the extrusion rate is low.
+FilamentSensorStatus PulsedFilamentMonitor::CheckPeriods() noexcept
+{
+	FilamentSensorStatus ret = FilamentSensorStatus::ok;
+	if (periodExtrusionCommanded >= minimumExtrusionCheckLength * PeriodCheckFraction)
+	{
+		lastPeriodRatio = periodMovementMeasured/periodExtrusionCommanded;
+		++numPeriodChecks;
+		if (comparisonStarted && comparisonEnabled)
+		{
+			if (lastPeriodRatio < minMovementAllowed)
+			{
+				ret = FilamentSensorStatus::tooLittleMovement;
+			}
+			else if (lastPeriodRatio > maxMovementAllowed)
+			{
+				ret = FilamentSensorStatus::tooMuchMovement;
+			}
+		}
+		periodExtrusionCommanded = periodMovementMeasured = 0.0;
+	}
+	return ret;
 }
 
 // Call the following at intervals to check the status. This is only called when extrusion is in progress or imminent.
@@ -194,6 +257,7 @@ FilamentSensorStatus PulsedFilamentMonitor::Check(bool isPrinting, bool fromIsr,
 		extrusionCommandedAtInterrupt = extrusionCommandedSinceLastSync;
 		wasPrintingAtInterrupt = isPrinting;
 		lastIsrTime = isrMillis;
+		pulsesAtInterrupt = GetSampleMeasurement();
 		haveInterruptData = true;
 	}
 
@@ -201,16 +265,25 @@ FilamentSensorStatus PulsedFilamentMonitor::Check(bool isPrinting, bool fromIsr,
 	Poll();														// this may update movementMeasured
 
 	// 4. Decide whether it is time to do a comparison, and return the status
-	FilamentSensorStatus ret = FilamentSensorStatus::ok;
+	FilamentSensorStatus ret = CheckPeriods();
 	if (extrusionCommandedThisSegment >= minimumExtrusionCheckLength)
 	{
-		ret = CheckFilament(extrusionCommandedThisSegment, movementMeasuredThisSegment, false);
+		const FilamentSensorStatus countStatus = CheckFilament(extrusionCommandedThisSegment, movementMeasuredThisSegment, false);
+		if (countStatus != FilamentSensorStatus::ok)
+		{
+			ret = countStatus;
+		}
 		extrusionCommandedThisSegment = movementMeasuredThisSegment = 0.0;
 	}
 	else if (extrusionCommandedThisSegment + extrusionCommandedSinceLastSync >= minimumExtrusionCheckLength * 2 && millis() - lastMeasurementTime > 220)
 	{
 		// A sync is overdue
-		ret = CheckFilament(extrusionCommandedThisSegment + extrusionCommandedSinceLastSync, movementMeasuredThisSegment + movementMeasuredSinceLastSync, true);
+		const FilamentSensorStatus countStatus = CheckFilament(extrusionCommandedThisSegment + extrusionCommandedSinceLastSync, movementMeasuredThisSegment + movementMeasuredSinceLastSync, true);
+		if (countStatus != FilamentSensorStatus::ok)
+		{
+			ret = countStatus;
+		}
+		pulsesAtLastSync += (uint32_t)movementMeasuredSinceLastSync;
 		extrusionCommandedThisSegment = extrusionCommandedSinceLastSync = movementMeasuredThisSegment = movementMeasuredSinceLastSync = 0.0;
 	}
 
@@ -296,7 +369,7 @@ void PulsedFilamentMonitor::Diagnostics(const StringRef& reply) noexcept
 {
 	Poll();
 	const char* const statusText = (samplesReceived < 2) ? "no data received" : "ok";
-	reply.lcatf("Driver %u: %s", GetDriver(), statusText);
+	reply.lcatf("Driver %u: %s, period checks %" PRIu32 " last %d%% lost %" PRIu32, GetDriver(), statusText, numPeriodChecks, (int)ConvertToPercent(lastPeriodRatio), numPeriodsLost);
 }
 
 #endif	// SUPPORT_DRIVERS
@@ -9,6 +9,7 @@
 #define SRC_FILAMENTSENSORS_PULSEDFILAMENTMONITOR_H_
 
 #include "FilamentMonitor.h"
+#include <Movement/StepTimer.h>
 
 #if SUPPORT_DRIVERS
 
@@ -20,8 +21,9 @@ public:
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) noexcept override;
 	FilamentSensorStatus Check(bool isPrinting, bool fromIsr, uint32_t isrMillis, float filamentConsumed) noexcept override;
 	FilamentSensorStatus Clear() noexcept override;
+	float GetMinimumCheckLength() const noexcept override { return minimumExtrusionCheckLength; }
 	void Diagnostics(const StringRef& reply) noexcept override;
-	bool Interrupt() noexcept override;
+	bool Interrupt(uint32_t isrStartTime) noexcept override;
 
 private:
 	static constexpr float DefaultMmPerPulse = 1.0;
@@ -29,10 +31,15 @@ private:
 	static constexpr float DefaultMaxMovementAllowed = 1.6;
 	static constexpr float DefaultMinimumExtrusionCheckLength = 5.0;
 
+	// Period measurement, used to check the extrusion at low extrusion rates when counting pulses gives poor resolution
+	static constexpr uint32_t MinPeriodClocks = StepTimer::StepClockRate/10;		// we only use the period of pulses that arrive at less than 10Hz
+	static constexpr float PeriodCheckFraction = 0.25;						// we do a period check after this fraction of the minimum extrusion check length
+
 	void Init() noexcept;
 	void Reset() noexcept;
 	void Poll() noexcept;
 	FilamentSensorStatus CheckFilament(float amountCommanded, float amountMeasured, bool overdue) noexcept;
+	FilamentSensorStatus CheckPeriods() noexcept;
 
 	bool DataReceived() const noexcept;
 	bool HaveCalibrationData() const noexcept;
@@ -45,11 +52,25 @@ private:
 	bool comparisonEnabled;
 
 	// Other data
-	uint32_t sensorValue;									// how many pulses received
+	uint32_t sensorValue;									// how many pulses received, this is never reset so that the ISR can record it with the extrusion commanded
+	uint32_t pulsesAtInterrupt;								// the value of sensorValue when the ISR recorded the extrusion commanded
+	uint32_t pulsesAtLastSync;								// the value of sensorValue at the last sync
 	uint32_t lastIsrTime;									// the time we recorded an interrupt
 	uint32_t lastSyncTime;									// the last time we synced a measurement
 	uint32_t lastMeasurementTime;							// the last time we received a value
 
+	uint32_t lastPulseTime;									// the step timer value when we received the last pulse
+	uint32_t lastPeriod;									// the time between the last two pulses
+	uint32_t lastPulseStepInterval;							// the extruder microstep interval when we received the last pulse, or 0 if it wasn't moving
+	volatile uint32_t capturedPeriod;						// the period between two pulses that we can use to measure the filament velocity
+	volatile uint32_t capturedStepInterval;					// the mean extruder microstep interval during that period
+	volatile bool havePeriodCapture;
+	uint32_t numPeriodsLost;								// how many captured periods were overwritten before we processed them
+	uint32_t numPeriodChecks;
+	float periodExtrusionCommanded;							// the extrusion commanded (mm) during the periods we have captured since the last period check
+	float periodMovementMeasured;							// the filament movement (mm) during those periods
+	float lastPeriodRatio;
+
 	float extrusionCommandedAtInterrupt;					// the amount of extrusion commanded (mm) when we received the interrupt since the last sync
 	float extrusionCommandedSinceLastSync;					// the amount of extrusion commanded (mm) since the last sync
 	float movementMeasuredSinceLastSync;					// the amount of movement in complete rotations of the wheel since the last sync
@@ -41,6 +41,7 @@ void RotatingMagnetFilamentMonitor::Init() noexcept
 	agc = 0;
 	backwards = false;
 	sensorError = false;
+	ratioStatistics.Reset();
 	InitReceiveBuffer();
 	Reset();
 }
@@ -437,17 +438,10 @@ FilamentSensorStatus RotatingMagnetFilamentMonitor::CheckFilament(float amountCo
 				minMovementRatio = ratio;
 			}
 
+			const FilamentSensorStatus stat = ratioStatistics.Check(ratio * mmPerRev, minMovementAllowed, maxMovementAllowed);
 			if (comparisonEnabled)
 			{
-				ratio *= mmPerRev;
-				if (ratio < minMovementAllowed)
-				{
-					ret = FilamentSensorStatus::tooLittleMovement;
-				}
-				else if (ratio > maxMovementAllowed)
-				{
-					ret = FilamentSensorStatus::tooMuchMovement;
-				}
+				ret = stat;
 			}
 		}
 		break;
@@ -483,6 +477,7 @@ void RotatingMagnetFilamentMonitor::Diagnostics(const StringRef& reply) noexcept
 	}
 	reply.catf(", errs: frame %" PRIu32 " parity %" PRIu32 " ovrun %" PRIu32 " pol %" PRIu32 " ovdue %" PRIu32,
 				framingErrorCount, parityErrorCount, overrunErrorCount, polarityErrorCount, overdueCount);
+	ratioStatistics.Diagnostics(reply);
 }
 
 #endif	// SUPPORT_DRIVERS
@@ -9,6 +9,7 @@
 #define SRC_FILAMENTSENSORS_ROTATINGMAGNETFILAMENTMONITOR_H_
 
 #include "Duet3DFilamentMonitor.h"
+#include "FilamentRatioStatistics.h"
 
 #if SUPPORT_DRIVERS
 
@@ -20,6 +21,7 @@ public:
 	GCodeResult Configure(const CanMessageGenericParser& parser, const StringRef& reply) noexcept override;
 	FilamentSensorStatus Check(bool isPrinting, bool fromIsr, uint32_t isrMillis, float filamentConsumed) noexcept override;
 	FilamentSensorStatus Clear() noexcept override;
+	float GetMinimumCheckLength() const noexcept override { return minimumExtrusionCheckLength; }
 	void Diagnostics(const StringRef& reply) noexcept override;
 
 private:
@@ -98,6 +100,7 @@ private:
 
 	// Values measured for calibration
 	float minMovementRatio, maxMovementRatio;
+	FilamentRatioStatistics ratioStatistics;
 	float totalExtrusionCommanded;
 	float totalMovementMeasured;
 
@@ -0,0 +1,75 @@
+/*
+ * SensorQualityStatistics.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_FILAMENTMONITORS_SENSORQUALITYSTATISTICS_H_
+#define SRC_FILAMENTMONITORS_SENSORQUALITYSTATISTICS_H_
+
+#include <RepRapFirmware.h>
+
+// Class to keep a rolling mean of a value that a filament sensor reports about its own health, such as the image quality of an optical sensor.
+// The first few samples are averaged equally, then older samples are given exponentially decreasing weight. When we have enough samples we save the mean
+// as the baseline, so that a sensor whose readings drift away from where they started can be flagged before it causes false filament errors.
+class SensorQualityStatistic
+{
+public:
+	static constexpr unsigned int WindowLength = 32;			// the approximate number of recent samples that the mean covers
+	static constexpr unsigned int BaselineSamples = 16;			// how many samples we average to get the baseline
+
+	SensorQualityStatistic() noexcept { Reset(); }
+
+	void Reset() noexcept
+	{
+		mean = baseline = 0.0;
+		numSamples = 0;
+		minimum = 255;
+		maximum = 0;
+		haveBaseline = false;
+	}
+
+	void Add(uint8_t val) noexcept
+	{
+		if (numSamples < WindowLength)
+		{
+			++numSamples;
+		}
+		mean += ((float)val - mean)/(float)numSamples;
+		minimum = min<uint8_t>(minimum, val);
+		maximum = max<uint8_t>(maximum, val);
+		if (!haveBaseline && numSamples >= BaselineSamples)
+		{
+			baseline = mean;
+			haveBaseline = true;
+		}
+	}
+
+	bool HaveBaseline() const noexcept { return haveBaseline; }
+	float GetMean() const noexcept { return mean; }
+	float GetBaseline() const noexcept { return baseline; }
+
+	// Return true if the mean has moved from the baseline by more than the specified fraction of the baseline in the direction that indicates a problem
+	bool HasFallen(float fraction) const noexcept { return haveBaseline && mean < baseline * (1.0 - fraction); }
+	bool HasRisen(float fraction) const noexcept { return haveBaseline && mean > baseline * (1.0 + fraction); }
+
+	// Append the statistics as mean/min/max/baseline, or nothing if we have no samples
+	void Append(const StringRef& reply) const noexcept
+	{
+		if (numSamples != 0)
+		{
+			reply.catf("%.1f/%u/%u/%.1f", (double)mean, minimum, maximum, (double)baseline);
+		}
+	}
+
+private:
+	float mean;
+	float baseline;
+	unsigned int numSamples;
+	uint8_t minimum;
+	uint8_t maximum;
+	bool haveBaseline;
+};
+
+#endif /* SRC_FILAMENTMONITORS_SENSORQUALITYSTATISTICS_H_ */
@@ -51,7 +51,7 @@ GCodeResult SimpleFilamentMonitor::Configure(const CanMessageGenericParser& pars
 }
 
 // ISR for when the pin state changes
-bool SimpleFilamentMonitor::Interrupt() noexcept
+bool SimpleFilamentMonitor::Interrupt(uint32_t isrStartTime) noexcept
 {
 	// Nothing needed here
 	GetPort().DetachInterrupt();
@@ -21,7 +21,7 @@ public:
 	FilamentSensorStatus Check(bool isPrinting, bool fromIsr, uint32_t isrMillis, float filamentConsumed) noexcept override;
 	FilamentSensorStatus Clear() noexcept override;
 	void Diagnostics(const StringRef& reply) noexcept override;
-	bool Interrupt() noexcept override;
+	bool Interrupt(uint32_t isrStartTime) noexcept override;
 
 private:
 	void Poll() noexcept;
@@ -9,9 +9,74 @@
 #include <CAN/CanInterface.h>
 #include <CanMessageGenericParser.h>
 #include <CanMessageGenericTables.h>
+#include <Movement/StepTimer.h>
 
 static PwmPort ports[MaxGpOutPorts];
 
+// Batch of port writes waiting to be executed by the step timer callback
+struct PendingGpioWrite
+{
+	uint8_t portNumber;
+	float pwm;
+};
+
+static PendingGpioWrite pendingWrites[MaxGpOutPorts];
+static size_t numPendingWrites = 0;
+static volatile bool batchPending = false;
+#if SUPPORT_DRIVERS
+static volatile bool batchWaitingForMove = false;			// true if the pending batch will be scheduled when the next move starts
+static int32_t moveStartOffset = 0;							// step clocks after the move start time that the batch should be executed
+static uint32_t numBatchesOnMoveStart = 0;
+#endif
+static StepTimer batchTimer;
+static uint32_t numBatchesScheduled = 0, numBatchesLate = 0, maxBatchLatency = 0;
+
+// Write all the ports in a batch. Called with interrupts disabled so that the outputs change as near simultaneously as possible.
+static void ExecuteBatch(size_t numPorts, const uint8_t portNumbers[], const float pwms[]) noexcept
+{
+	for (size_t i = 0; i < numPorts; ++i)
+	{
+		ports[portNumbers[i]].WriteAnalog(pwms[i]);
+	}
+}
+
+// Step timer callback to execute a scheduled batch
+static void BatchTimerCallback(CallbackParameter) noexcept
+{
+	uint8_t portNumbers[MaxGpOutPorts];
+	float pwms[MaxGpOutPorts];
+	for (size_t i = 0; i < numPendingWrites; ++i)
+	{
+		portNumbers[i] = pendingWrites[i].portNumber;
+		pwms[i] = pendingWrites[i].pwm;
+	}
+	{
+		AtomicCriticalSectionLocker lock;
+		ExecuteBatch(numPendingWrites, portNumbers, pwms);
+	}
+	batchPending = false;
+}
+
+// Schedule the pending batch to execute at the specified local time, or execute it now if the time has passed or is imminent.
+// 'fromIsr' must be true if the base priority is at least the step interrupt priority.
+static void ScheduleBatch(uint32_t when, bool fromIsr) noexcept
+{
+	batchTimer.SetCallback(BatchTimerCallback, CallbackParameter(nullptr));
+	if ((fromIsr) ? batchTimer.ScheduleCallbackFromIsr(when) : batchTimer.ScheduleCallback(when))
+	{
+		const uint32_t latency = StepTimer::GetTimerTicks() - when;
+		if ((int32_t)latency > 0)
+		{
+			++numBatchesLate;
+			if (latency > maxBatchLatency)
+			{
+				maxBatchLatency = latency;
+			}
+		}
+		BatchTimerCallback(CallbackParameter(nullptr));
+	}
+}
+
 GCodeResult GpioPorts::HandleM950Gpio(const CanMessageGeneric &msg, const StringRef &reply)
 {
 	// Get and validate the port number
@@ -83,8 +148,96 @@ GCodeResult GpioPorts::HandleGpioWrite(const CanMessageWriteGpio &msg, const Str
 		return GCodeResult::error;
 	}
 
-	ports[msg.portNumber].WriteAnalog(msg.pwm);
+	const uint8_t portNumber = msg.portNumber;
+	const float pwm = msg.pwm;
+	return WriteMultiple(1, &portNumber, &pwm, GpioWriteTrigger::immediate, 0, reply);
+}
+
+// Write several ports together. Unless the trigger is 'immediate', the writes are done by a step timer callback at the time specified by the trigger and timeParam.
+// Only one scheduled batch may be pending at a time.
+GCodeResult GpioPorts::WriteMultiple(size_t numPorts, const uint8_t portNumbers[], const float pwms[], GpioWriteTrigger trigger, uint32_t timeParam, const StringRef& reply) noexcept
+{
+	if (numPorts > MaxGpOutPorts)
+	{
+		reply.printf("Too many GPIO ports in one write, maximum is %u", MaxGpOutPorts);
+		return GCodeResult::error;
+	}
+	for (size_t i = 0; i < numPorts; ++i)
+	{
+		if (portNumbers[i] >= MaxGpOutPorts)
+		{
+			reply.printf("GPIO port# %u is too high for this expansion board", portNumbers[i]);
+			return GCodeResult::error;
+		}
+	}
+
+	if (trigger == GpioWriteTrigger::immediate)
+	{
+		AtomicCriticalSectionLocker lock;
+		ExecuteBatch(numPorts, portNumbers, pwms);
+		return GCodeResult::ok;
+	}
+
+#if !SUPPORT_DRIVERS
+	if (trigger == GpioWriteTrigger::atNextMoveStart)
+	{
+		reply.copy("This board does not execute moves");
+		return GCodeResult::error;
+	}
+#endif
+
+	if (batchPending)
+	{
+		reply.copy("A scheduled GPIO write is already pending");
+		return GCodeResult::error;
+	}
+	for (size_t i = 0; i < numPorts; ++i)
+	{
+		pendingWrites[i].portNumber = portNumbers[i];
+		pendingWrites[i].pwm = pwms[i];
+	}
+	numPendingWrites = numPorts;
+	++numBatchesScheduled;
+
+#if SUPPORT_DRIVERS
+	if (trigger == GpioWriteTrigger::atNextMoveStart)
+	{
+		// The batch will be scheduled by MoveStarting, which is called from the step ISR or with the step interrupt disabled
+		moveStartOffset = (int32_t)timeParam;
+		++numBatchesOnMoveStart;
+		AtomicCriticalSectionLocker lock;
+		batchPending = true;
+		batchWaitingForMove = true;
+		return GCodeResult::ok;
+	}
+#endif
+
+	batchPending = true;
+	ScheduleBatch(StepTimer::ConvertToLocalTime(timeParam), false);
 	return GCodeResult::ok;
 }
 
+#if SUPPORT_DRIVERS
+
+// Called by Move when it starts a move. If a batch is waiting for a move to start then schedule it relative to the start time of the move.
+void GpioPorts::MoveStarting(uint32_t moveStartTime) noexcept
+{
+	if (batchWaitingForMove)
+	{
+		batchWaitingForMove = false;
+		ScheduleBatch(moveStartTime + (uint32_t)moveStartOffset, true);
+	}
+}
+
+#endif
+
+void GpioPorts::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("GPIO batches scheduled %" PRIu32 ", late %" PRIu32 ", max latency %" PRIu32 "us",
+				numBatchesScheduled, numBatchesLate, StepTimer::TicksToIntegerMicroseconds(maxBatchLatency));
+#if SUPPORT_DRIVERS
+	reply.catf(", on move start %" PRIu32 "%s", numBatchesOnMoveStart, (batchWaitingForMove) ? " (waiting)" : "");
+#endif
+}
+
 // End
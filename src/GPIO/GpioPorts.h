@@ -12,10 +12,26 @@
 #include <Hardware/IoPorts.h>
 #include <CanMessageFormats.h>
 
+// When a batch of GPIO writes should be executed
+enum class GpioWriteTrigger : uint8_t
+{
+	immediate = 0,
+	atMasterTime,				// at the specified master time
+	atNextMoveStart				// when the next move starts, offset by the specified number of step clocks which may be negative
+};
+
 namespace GpioPorts
 {
 	GCodeResult HandleM950Gpio(const CanMessageGeneric& msg, const StringRef& reply);
 	GCodeResult HandleGpioWrite(const CanMessageWriteGpio& msg, const StringRef& reply);
+
+	// Write several ports together. 'timeParam' is the master time or the offset from the move start time, depending on the trigger.
+	GCodeResult WriteMultiple(size_t numPorts, const uint8_t portNumbers[], const float pwms[], GpioWriteTrigger trigger, uint32_t timeParam, const StringRef& reply) noexcept;
+	void Diagnostics(const StringRef& reply) noexcept;
+
+#if SUPPORT_DRIVERS
+	void MoveStarting(uint32_t moveStartTime) noexcept SPEED_CRITICAL;			// called by Move with base priority >= step interrupt when it starts a move
+#endif
 }
 
 #endif /* SRC_GPIO_GPODEVICE_H_ */
@@ -0,0 +1,209 @@
+/*
+ * ADXL345.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "ADXL345.h"
+
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+
+#include <Hardware/IoPorts.h>
+#include <Movement/StepTimer.h>
+
+constexpr uint32_t AdxlSpiFrequency = 5000000;						// the maximum SPI clock frequency
+constexpr SpiMode AdxlSpiMode = SpiMode::mode3;
+constexpr uint32_t AdxlSpiTimeout = 10;
+
+constexpr uint8_t DevIdValue = 0xE5;
+constexpr uint8_t ReadBit = 0x80;
+constexpr uint8_t MultiByteBit = 0x40;
+
+constexpr uint8_t PowerCtlMeasure = 1u << 3;
+constexpr uint8_t IntWatermark = 1u << 1;
+constexpr uint8_t IntOverrun = 1u << 0;
+constexpr uint8_t DataFormatFullRes = 1u << 3;						// +/-2g range with full resolution gives 10 bits at 3.9mg/LSB, the same scaling as the LIS3DH default
+constexpr uint8_t FifoModeStream = 2u << 6;
+constexpr unsigned int DataBits = 10;
+
+ADXL345::ADXL345(SharedSpiDevice& dev, Pin p_csPin, Pin p_int1Pin) noexcept
+	: spi(dev, AdxlSpiFrequency, AdxlSpiMode, false), taskWaiting(nullptr), totalNumRead(0), interruptError(false), bwRate(0x0F), int1Pin(p_int1Pin)
+{
+	spi.SetCsPin(p_csPin);
+	spi.InitMaster();
+}
+
+// Do a quick test to check whether the accelerometer is present, returning true if it is
+bool ADXL345::CheckPresent() noexcept
+{
+	uint8_t val;
+	return ReadRegister(AdxlRegister::DevId, val) && val == DevIdValue;
+}
+
+uint8_t ADXL345::ReadStatus() noexcept
+{
+	uint8_t val;
+	return (ReadRegister(AdxlRegister::IntSource, val)) ? val : 0xFF;
+}
+
+// Configure the accelerometer. The resolution is always 10 bits because we use the +/-2g range.
+bool ADXL345::Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept
+{
+	resolution = DataBits;
+	if (samplingRate == 0 || samplingRate >= 2400)
+	{
+		samplingRate = 3200;											// select 3200Hz if we asked for the default, or for 2400 or higher
+		bwRate = 0x0F;
+	}
+	else if (samplingRate >= 1200)
+	{
+		samplingRate = 1600;
+		bwRate = 0x0E;
+	}
+	else if (samplingRate >= 600)
+	{
+		samplingRate = 800;
+		bwRate = 0x0D;
+	}
+	else
+	{
+		samplingRate = 400;												// select 400Hz, lower is not useful
+		bwRate = 0x0C;
+	}
+
+	return WriteRegister(AdxlRegister::PowerCtl, 0)						// standby while we configure it
+		&& WriteRegister(AdxlRegister::BwRate, bwRate)
+		&& WriteRegister(AdxlRegister::DataFormat, DataFormatFullRes)	// 4-wire SPI, active high interrupts, right justified
+		&& WriteRegister(AdxlRegister::IntMap, 0)						// all interrupts on INT1
+		&& WriteRegister(AdxlRegister::IntEnable, IntWatermark);
+}
+
+static void AdxlInt1Interrupt(CallbackParameter p) noexcept
+{
+	static_cast<ADXL345*>(p.vp)->Int1Isr();
+}
+
+// Start collecting data. The ADXL345 always collects all 3 axes.
+bool ADXL345::StartCollecting(uint8_t axes) noexcept
+{
+	// Clear the FIFO by selecting bypass mode, then select stream mode with the watermark level
+	if (!WriteRegister(AdxlRegister::FifoCtl, 0) || !WriteRegister(AdxlRegister::FifoCtl, FifoModeStream | FifoInterruptLevel))
+	{
+		return false;
+	}
+
+	// Pulling up the interrupt pin allows us to check for a disconnected pin
+	pinMode(int1Pin, INPUT_PULLUP);
+	totalNumRead = 0;
+
+	// Before we enable data collection, check that the interrupt line is low
+	delayMicroseconds(5);
+	interruptError = digitalRead(int1Pin);
+	if (interruptError)
+	{
+		return false;
+	}
+
+	return attachInterrupt(int1Pin, AdxlInt1Interrupt, InterruptMode::rising, CallbackParameter(this))
+		&& WriteRegister(AdxlRegister::PowerCtl, PowerCtlMeasure);
+}
+
+// Collect some data from the FIFO, suspending until the data is available
+unsigned int ADXL345::CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept
+{
+	// Wait until we have some data
+	taskWaiting = TaskBase::GetCallerTaskHandle();
+	while (!digitalRead(int1Pin))
+	{
+		TaskBase::Take();
+	}
+	taskWaiting = nullptr;
+
+	// Read the overrun flag before we read the data, because reading the data clears it
+	uint8_t intSource, fifoStatus;
+	if (!ReadRegister(AdxlRegister::IntSource, intSource) || !ReadRegister(AdxlRegister::FifoStatus, fifoStatus))
+	{
+		return 0;
+	}
+
+	const unsigned int numToRead = min<unsigned int>(fifoStatus & 0x3F, FifoSize);
+	for (unsigned int i = 0; i < numToRead; ++i)
+	{
+		// Each multi-byte read of the data registers pops one sample from the FIFO. Deselecting the device between reads gives the 5us gap that the FIFO needs.
+		uint8_t raw[6];
+		if (!ReadRegisters(AdxlRegister::DataX0, raw, sizeof(raw)))
+		{
+			return 0;
+		}
+		for (unsigned int axis = 0; axis < 3; ++axis)
+		{
+			// Convert the right-justified sign-extended values to left-justified like the LIS3DH
+			const uint16_t val = (uint16_t)raw[2 * axis] | ((uint16_t)raw[2 * axis + 1] << 8);
+			dataBuffer[3 * i + axis] = val << (16u - DataBits);
+		}
+	}
+
+	*collectedData = dataBuffer;
+	lastBlockTime = lastInterruptTime;
+	overflowed = (intSource & IntOverrun) != 0;
+	dataRate = (totalNumRead == 0) ? 0 : (totalNumRead * (uint64_t)StepTimer::StepClockRate)/(lastInterruptTime - firstInterruptTime);
+	totalNumRead += numToRead;
+	return numToRead;
+}
+
+// Stop collecting data
+void ADXL345::StopCollecting() noexcept
+{
+	detachInterrupt(int1Pin);
+	WriteRegister(AdxlRegister::PowerCtl, 0);
+	WriteRegister(AdxlRegister::FifoCtl, 0);
+}
+
+bool ADXL345::ReadRegisters(AdxlRegister reg, uint8_t *data, size_t numToRead) noexcept
+{
+	uint8_t txBuffer[7] = { 0 };
+	uint8_t rxBuffer[7];
+	if (numToRead + 1 > sizeof(txBuffer) || !spi.Select(AdxlSpiTimeout))
+	{
+		return false;
+	}
+	txBuffer[0] = (uint8_t)reg | ReadBit | ((numToRead > 1) ? MultiByteBit : 0);
+	const bool ok = spi.TransceivePacket(txBuffer, rxBuffer, numToRead + 1);
+	spi.Deselect();
+	delayMicroseconds(5);
+	if (ok)
+	{
+		memcpy(data, rxBuffer + 1, numToRead);
+	}
+	return ok;
+}
+
+bool ADXL345::WriteRegister(AdxlRegister reg, uint8_t val) noexcept
+{
+	if (!spi.Select(AdxlSpiTimeout))
+	{
+		return false;
+	}
+	const uint8_t txBuffer[2] = { (uint8_t)reg, val };
+	uint8_t rxBuffer[2];
+	const bool ok = spi.TransceivePacket(txBuffer, rxBuffer, sizeof(txBuffer));
+	spi.Deselect();
+	return ok;
+}
+
+void ADXL345::Int1Isr() noexcept
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	if (totalNumRead == 0)
+	{
+		firstInterruptTime = now;
+	}
+	lastInterruptTime = now;
+	TaskBase::GiveFromISR(taskWaiting);
+	taskWaiting = nullptr;
+}
+
+#endif
+
+// End
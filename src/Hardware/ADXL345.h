@@ -0,0 +1,75 @@
+/*
+ * ADXL345.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_HARDWARE_ADXL345_H_
+#define SRC_HARDWARE_ADXL345_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_SPI_SENSORS && SUPPORT_ADXL345
+
+#include "SharedSpiClient.h"
+#include "Accelerometer.h"
+
+// Driver for the ADXL345 accelerometer on the shared SPI bus. It samples at up to 3200Hz, which is twice the useful rate of the LIS3DH in 10-bit mode.
+class ADXL345 : public Accelerometer
+{
+public:
+	ADXL345(SharedSpiDevice& dev, Pin p_csPin, Pin p_int1Pin) noexcept;
+
+	bool CheckPresent() noexcept override;
+	const char *GetTypeName() const noexcept override { return "ADXL345"; }
+	bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept override;
+	bool StartCollecting(uint8_t axes) noexcept override;
+	unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept override;
+	uint32_t GetLastBlockTime() const noexcept override { return lastBlockTime; }
+	unsigned int GetFifoInterruptLevel() const noexcept override { return FifoInterruptLevel; }
+	void StopCollecting() noexcept override;
+	uint8_t ReadStatus() noexcept override;
+	bool HasInterruptError() const noexcept override { return interruptError; }
+
+	// Used by the ISR
+	void Int1Isr() noexcept;
+
+	static constexpr uint8_t FifoInterruptLevel = 24;					// how full the FIFO must get before we want an interrupt
+
+private:
+	enum class AdxlRegister : uint8_t
+	{
+		DevId = 0x00,
+		BwRate = 0x2C,
+		PowerCtl = 0x2D,
+		IntEnable = 0x2E,
+		IntMap = 0x2F,
+		IntSource = 0x30,
+		DataFormat = 0x31,
+		DataX0 = 0x32,
+		FifoCtl = 0x38,
+		FifoStatus = 0x39
+	};
+
+	static constexpr size_t FifoSize = 32;
+
+	bool ReadRegisters(AdxlRegister reg, uint8_t *data, size_t numToRead) noexcept;
+	bool ReadRegister(AdxlRegister reg, uint8_t& val) noexcept { return ReadRegisters(reg, &val, 1); }
+	bool WriteRegister(AdxlRegister reg, uint8_t val) noexcept;
+
+	SharedSpiClient spi;
+	volatile TaskHandle taskWaiting;
+	uint32_t firstInterruptTime;
+	uint32_t lastInterruptTime;
+	uint32_t lastBlockTime;
+	uint32_t totalNumRead;
+	bool interruptError;
+	uint8_t bwRate;
+	Pin int1Pin;
+	uint16_t dataBuffer[3 * FifoSize];
+};
+
+#endif
+
+#endif /* SRC_HARDWARE_ADXL345_H_ */
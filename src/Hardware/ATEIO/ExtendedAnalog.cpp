@@ -12,6 +12,7 @@
 
 #include <Platform.h>
 #include <Hardware/SharedSpiClient.h>
+#include <Movement/StepTimer.h>
 
 // AD7327 latches the data in the falling edge of SCLK. Max clock frequency 10MHz, minimum 50kHz. It expects SCLK to be high when /CS changes state. This is SPI mode 2.
 constexpr uint32_t AdcClockFrequency = 4000000;
@@ -37,6 +38,26 @@ static uint16_t AdcTransfer(uint16_t dataOut) noexcept
 	return ((uint16_t)rb[0] << 8) | rb[1];
 }
 
+// Pulse CS high and low again, which makes the ADC convert the channel selected by the last control register write
+static void StartConversion() noexcept
+{
+	digitalWrite(ExtendedAdcCsPin, true);
+	delayMicroseconds(1);
+	digitalWrite(ExtendedAdcCsPin, false);
+	delayMicroseconds(1);
+}
+
+// Convert the data read from the ADC to a reading, checking that it is for the channel we asked for
+static uint16_t ConvertResult(uint16_t rslt, unsigned int chan) noexcept
+{
+	if ((rslt >> 13) == chan)											// if the result is for the channel we asked for
+	{
+		static_assert(AnalogIn::AdcBits >= 14);
+		return (rslt & 8191) << (AnalogIn::AdcBits - 13 - 1);			// extend 13-bit result to the required number of bits, leaving the top bit clear
+	}
+	return 0x8001;														// indicate channel reading error
+}
+
 void ExtendedAnalog::Init(SharedSpiDevice& sharedSpi) noexcept
 {
 	pinMode(ExtendedAdcCsPin, PinMode::OUTPUT_HIGH);
@@ -80,23 +101,101 @@ uint16_t ExtendedAnalog::AnalogIn(unsigned int chan) noexcept
 		(void)AdcTransfer(ControlRegisterValue | ((chan & 7) << 10));	// set channel to sample next
 
 		// We need to pulse CS low and high again to get the ADC to convert the channel we just selected
-		digitalWrite(ExtendedAdcCsPin, true);
-		delayMicroseconds(1);
-		digitalWrite(ExtendedAdcCsPin, false);
-		delayMicroseconds(1);
+		StartConversion();
 
 		const uint16_t rslt = AdcTransfer(0);
 		device->Deselect();
 		delayMicroseconds(1);
-		if ((rslt >> 13) == chan)										// if the result is for the channel we asked for
+		return ConvertResult(rslt, chan);
+	}
+
+	return 0x8000;														// indicate select error
+}
+
+// Read several ADC channels in one SPI transaction. Each transfer reads the conversion that the CS pulse started and also selects the channel to convert next,
+// so we need just one transfer per channel plus one to select the first channel, instead of two transfers and a separate transaction for each channel.
+// Return false if we couldn't get the SPI bus, in which case the results are set to the select error value.
+bool ExtendedAnalog::AnalogInMultiple(const uint8_t *chans, size_t numChans, uint16_t *results) noexcept
+{
+	if (numChans == 0)
+	{
+		return true;
+	}
+
+	if (!device->Select(200))
+	{
+		for (size_t i = 0; i < numChans; ++i)
 		{
-			static_assert(AnalogIn::AdcBits >= 14);
-			return (rslt & 8191) << (AnalogIn::AdcBits - 13 - 1);		// extend 13-bit result to the required number of bits, leaving the top bit clear
+			results[i] = 0x8000;										// indicate select error
 		}
-		return 0x8001;													// indicate channel reading error
+		return false;
 	}
 
-	return 0x8000;														// indicate select error
+	delayMicroseconds(1);
+	(void)AdcTransfer(ControlRegisterValue | ((chans[0] & 7) << 10));	// set the first channel to sample
+	for (size_t i = 0; i < numChans; ++i)
+	{
+		StartConversion();
+		const uint16_t nextControl = (i + 1 < numChans) ? ControlRegisterValue | ((chans[i + 1] & 7) << 10) : 0;
+		results[i] = ConvertResult(AdcTransfer(nextControl), chans[i] & 7);
+	}
+	device->Deselect();
+	delayMicroseconds(1);
+	return true;
+}
+
+// Scan all the channels numScans times in a single SPI transaction and average the readings.
+// The channel selection is pipelined across the whole burst in the same way as in AnalogInMultiple, including from the last channel of one scan to the first of the next.
+// A channel that gives any bad reading is reported with the error code instead of the average, because a partial average would look like a valid reading.
+bool ExtendedAnalog::Scan(unsigned int numScans, ScanResults& results) noexcept
+{
+	numScans = constrain<unsigned int>(numScans, 1, MaxScans);
+	results.numScans = numScans;
+	if (!device->Select(200))
+	{
+		for (uint16_t& r : results.readings)
+		{
+			r = 0x8000;													// indicate select error
+		}
+		results.whenTaken = StepTimer::GetTimerTicks();
+		results.durationTicks = 0;
+		return false;
+	}
+
+	uint32_t totals[NumChannels] = { 0 };
+	uint16_t errors[NumChannels] = { 0 };
+	const uint32_t startTicks = StepTimer::GetTimerTicks();
+	delayMicroseconds(1);
+	(void)AdcTransfer(ControlRegisterValue);							// select channel 0 to sample first
+	for (unsigned int scan = 0; scan < numScans; ++scan)
+	{
+		for (unsigned int chan = 0; chan < NumChannels; ++chan)
+		{
+			StartConversion();
+			const bool last = (scan + 1 == numScans && chan + 1 == NumChannels);
+			const uint16_t nextControl = (last) ? 0 : ControlRegisterValue | (((chan + 1) & 7) << 10);
+			const uint16_t reading = ConvertResult(AdcTransfer(nextControl), chan);
+			if (reading & 0x8000)
+			{
+				errors[chan] = reading;
+			}
+			else
+			{
+				totals[chan] += reading;
+			}
+		}
+	}
+	const uint32_t endTicks = StepTimer::GetTimerTicks();
+	device->Deselect();
+	delayMicroseconds(1);
+
+	results.durationTicks = endTicks - startTicks;
+	results.whenTaken = startTicks + results.durationTicks/2;
+	for (size_t chan = 0; chan < NumChannels; ++chan)
+	{
+		results.readings[chan] = (errors[chan] != 0) ? errors[chan] : (uint16_t)((totals[chan] + numScans/2)/numScans);
+	}
+	return true;
 }
 
 #endif
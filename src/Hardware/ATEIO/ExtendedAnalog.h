@@ -16,8 +16,22 @@ class SharedSpiDevice;
 
 namespace ExtendedAnalog
 {
+	constexpr size_t NumChannels = 8;
+	constexpr unsigned int MaxScans = 256;
+
+	// Results of scanning all the channels
+	struct ScanResults
+	{
+		uint32_t whenTaken;							// step clock ticks at the middle of the scan
+		uint32_t durationTicks;						// how long the scan took, in step clock ticks
+		uint16_t numScans;
+		uint16_t readings[NumChannels];				// the averaged readings, or an error code if reading a channel failed
+	};
+
 	void Init(SharedSpiDevice& sharedSpi) noexcept;
 	uint16_t AnalogIn(unsigned int chan) noexcept;
+	bool AnalogInMultiple(const uint8_t *chans, size_t numChans, uint16_t *results) noexcept;
+	bool Scan(unsigned int numScans, ScanResults& results) noexcept;
 }
 
 #endif
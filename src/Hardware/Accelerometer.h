@@ -0,0 +1,57 @@
+/*
+ * Accelerometer.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_HARDWARE_ACCELEROMETER_H_
+#define SRC_HARDWARE_ACCELEROMETER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ACCELEROMETERS
+
+// Interface to an accelerometer that collects samples into a FIFO and signals when the FIFO reaches a watermark level.
+// The samples are returned as 3 16-bit values per sample, in accelerometer axis order, left justified, so that AccelerometerHandler doesn't need to know which device it has.
+class Accelerometer
+{
+public:
+	virtual ~Accelerometer() noexcept { }
+
+	// Do a quick test to check whether the accelerometer is present, returning true if it is
+	virtual bool CheckPresent() noexcept = 0;
+
+	// Return the type name of the accelerometer. Only valid after checkPresent returns true.
+	virtual const char *GetTypeName() const noexcept = 0;
+
+	// Configure the accelerometer to collect at or near the requested sampling rate and the requested resolution in bits.
+	// Update the sampling rate and resolution to the actual values used.
+	virtual bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept = 0;
+
+	// Start collecting data. Devices that can't disable individual axes collect all of them.
+	virtual bool StartCollecting(uint8_t axes) noexcept = 0;
+
+	// Collect some data from the FIFO, suspending until the data is available
+	virtual unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept = 0;
+
+	// Get the step clock time of the watermark interrupt for the data returned by the last call to CollectData.
+	// This is approximately the time at which the sample with index GetFifoInterruptLevel() - 1 was taken.
+	virtual uint32_t GetLastBlockTime() const noexcept = 0;
+
+	// Return how full the FIFO gets before we get an interrupt
+	virtual unsigned int GetFifoInterruptLevel() const noexcept = 0;
+
+	// Stop collecting data
+	virtual void StopCollecting() noexcept = 0;
+
+	// Get a status byte
+	virtual uint8_t ReadStatus() noexcept = 0;
+
+	// Used by diagnostics
+	virtual bool HasInterruptError() const noexcept = 0;
+};
+
+#endif
+
+#endif /* SRC_HARDWARE_ACCELEROMETER_H_ */
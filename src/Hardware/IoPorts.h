@@ -122,6 +122,7 @@ public:
 	void AppendFullDetails(const StringRef& str) const;
 	void AppendFrequency(const StringRef& str) const;		// append the frequency if the port is valid
 	void SetFrequency(PwmFrequency freq) { frequency = freq; }
+	PwmFrequency GetFrequency() const { return frequency; }
 	void WriteAnalog(float pwm) const;
 
 private:
@@ -21,7 +21,9 @@ constexpr uint16_t LisAddresses[] =
 };
 
 constexpr uint32_t Lis3dI2CTimeout = 25;
-constexpr uint8_t FifoInterruptLevel = 24;							// how full the FIFO must get before we want an interrupt
+#if SHARED_I2C_USES_DMA
+constexpr uint32_t FifoReadTimeout = 200;							// how long we wait for the FIFO to be read before giving up
+#endif
 
 static constexpr uint8_t WhoAmIValue_3DH = 0x33;
 static constexpr uint8_t WhoAmIValue_3DSH = 0x3F;
@@ -202,10 +204,139 @@ bool LIS3DH:: StartCollecting(uint8_t axes) noexcept
 		return false;
 	}
 
+#if SHARED_I2C_USES_DMA
+	// Keep ownership of the bus until we stop collecting, because the FIFO is read from the interrupt
+	if (!TakeBus(Lis3dI2CTimeout))
+	{
+		return false;
+	}
+	numFifoBuffersFull = 0;
+	fifoBufferBeingFilled = fifoBufferBeingRead = 0;
+	fifoReadInProgress = fifoReadDeferred = fifoOverrunPossible = fifoReadFailed = taskHasFifoBuffer = false;
+	fifoReadsEnabled = true;
+#endif
+
 	const bool ok = WriteRegister(LisRegister::Ctrl_0x20, ctrlReg_0x20 | (axes & 7));
 	return ok && attachInterrupt(int1Pin, Int1Interrupt, InterruptMode::rising, CallbackParameter(this));
 }
 
+#if SHARED_I2C_USES_DMA
+
+// Collect some data from the FIFO, suspending until the data is available. The data was read by DMA, so all we need to do here is wait for a buffer to be filled.
+unsigned int LIS3DH::CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept
+{
+	// Release the buffer we returned last time and start reading the FIFO again if we had to hold off because both buffers were full
+	if (taskHasFifoBuffer)
+	{
+		AtomicCriticalSectionLocker lock;
+		taskHasFifoBuffer = false;
+		fifoBufferBeingRead = (fifoBufferBeingRead + 1) % NumFifoBuffers;
+		--numFifoBuffersFull;
+		if (fifoReadDeferred || digitalRead(int1Pin))
+		{
+			StartFifoRead(StepTimer::GetTimerTicks());
+		}
+	}
+
+	// Wait until we have some data
+	taskWaiting = TaskBase::GetCallerTaskHandle();
+	while (numFifoBuffersFull == 0 && !fifoReadFailed)
+	{
+		if (!TaskBase::Take(FifoReadTimeout))
+		{
+			fifoReadsEnabled = false;
+			AbortDmaRead();
+			fifoReadFailed = true;
+		}
+	}
+	taskWaiting = nullptr;
+
+	if (fifoReadFailed)
+	{
+		// Try again next time
+		AtomicCriticalSectionLocker lock;
+		fifoReadFailed = false;
+		fifoReadsEnabled = true;
+		if (digitalRead(int1Pin))
+		{
+			StartFifoRead(StepTimer::GetTimerTicks());
+		}
+		return 0;
+	}
+
+	// If we had to defer reading the FIFO then it may have overflowed. We can't tell for sure without reading the FIFO status, which would slow things down.
+	overflowed = fifoOverrunPossible;
+	fifoOverrunPossible = false;
+	const uint32_t blockTime = fifoBufferTimes[fifoBufferBeingRead];
+	lastBlockTime = blockTime;
+	taskHasFifoBuffer = true;
+	*collectedData = reinterpret_cast<const uint16_t*>(fifoBuffers[fifoBufferBeingRead]);
+	if (totalNumRead == 0)
+	{
+		firstInterruptTime = blockTime;
+		dataRate = 0;
+	}
+	else
+	{
+		dataRate = (totalNumRead * (uint64_t)StepTimer::StepClockRate)/(blockTime - firstInterruptTime);
+	}
+	totalNumRead += FifoInterruptLevel;
+	return FifoInterruptLevel;
+}
+
+// Start reading the FIFO into the next free buffer if there is one. Called from the watermark interrupt, from the DMA complete callback and from the task with interrupts disabled.
+void LIS3DH::StartFifoRead(uint32_t now) noexcept
+{
+	AtomicCriticalSectionLocker lock;								// the watermark interrupt has higher priority than the DMA and I2C interrupts
+	if (!fifoReadsEnabled || fifoReadInProgress)
+	{
+		return;
+	}
+	if (numFifoBuffersFull == NumFifoBuffers)
+	{
+		fifoReadDeferred = fifoOverrunPossible = true;
+		return;
+	}
+
+	fifoBufferTimes[fifoBufferBeingFilled] = now;
+	fifoReadInProgress = StartDmaRead(GetReadAddress(LisRegister::OutXL, sizeof(fifoBuffers[0])), fifoBuffers[fifoBufferBeingFilled], sizeof(fifoBuffers[0]),
+										FifoReadCallback, CallbackParameter(this));
+	fifoReadDeferred = !fifoReadInProgress;
+}
+
+/*static*/ void LIS3DH::FifoReadCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept
+{
+	static_cast<LIS3DH*>(cb.vp)->FifoReadDone(reason);
+}
+
+void LIS3DH::FifoReadDone(DmaCallbackReason reason) noexcept
+{
+	if (reason == DmaCallbackReason::complete)
+	{
+		{
+			AtomicCriticalSectionLocker lock;
+			fifoBufferBeingFilled = (fifoBufferBeingFilled + 1) % NumFifoBuffers;
+			++numFifoBuffersFull;
+			fifoReadInProgress = false;
+		}
+
+		// If the FIFO still contains at least the watermark level of data then we won't get another rising edge on INT1, so read it again now
+		if (digitalRead(int1Pin))
+		{
+			StartFifoRead(StepTimer::GetTimerTicks());
+		}
+	}
+	else
+	{
+		fifoReadsEnabled = false;
+		fifoReadFailed = true;
+		fifoReadInProgress = false;
+	}
+	TaskBase::GiveFromISR(taskWaiting);
+}
+
+#else
+
 // Collect some 8-bit data from the FIFO, suspending until the data is available
 unsigned int LIS3DH::CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept
 {
@@ -241,6 +372,7 @@ unsigned int LIS3DH::CollectData(const uint16_t **collectedData, uint16_t &dataR
 		}
 
 		*collectedData = reinterpret_cast<const uint16_t*>(dataBuffer);
+		lastBlockTime = lastInterruptTime;
 		overflowed = (fifoStatus & 0x40) != 0;
 		dataRate = (totalNumRead == 0) ? 0 : (totalNumRead * (uint64_t)StepTimer::StepClockRate)/(lastInterruptTime - firstInterruptTime);
 		totalNumRead += numToRead;
@@ -248,19 +380,46 @@ unsigned int LIS3DH::CollectData(const uint16_t **collectedData, uint16_t &dataR
 	return numToRead;
 }
 
+#endif
+
 // Stop collecting data
 void LIS3DH::StopCollecting() noexcept
 {
+#if SHARED_I2C_USES_DMA
+	fifoReadsEnabled = false;
+	if (fifoReadInProgress)
+	{
+		// Wait for the current read to finish, so that we don't start the write below while the bus is busy
+		const uint32_t startTime = millis();
+		while (fifoReadInProgress && millis() - startTime < Lis3dI2CTimeout)
+		{
+			delay(1);
+		}
+		if (fifoReadInProgress)
+		{
+			AbortDmaRead();
+			fifoReadInProgress = false;
+		}
+	}
+	WriteRegister(LisRegister::Ctrl_0x20, 0);
+	ReleaseBus();
+#else
 	WriteRegister(LisRegister::Ctrl_0x20, 0);
+#endif
 }
 
-bool LIS3DH::ReadRegisters(LisRegister reg, size_t numToRead) noexcept
+// Get the register address to send when reading registers
+uint8_t LIS3DH::GetReadAddress(LisRegister reg, size_t numToRead) const noexcept
 {
 	// On the LIS3DH, bit 6 of the first byte must be set to 1 to auto-increment the address when doing reading multiple registers
 	// On the LIS3DSH, bit 6 is an extra register address bit, so we must not set it.
 	// So that we can read the WHO_AM_I register of both chips before we know which chip we have, only set bit 6 if we have a LIS3DH and we are reading multiple registers.
-	const uint8_t regAddr = (numToRead < 2 || is3DSH) ? (uint8_t)reg : (uint8_t)reg | 0x80;
-	return Transfer(regAddr, dataBuffer, 1, numToRead, Lis3dI2CTimeout);
+	return (numToRead < 2 || is3DSH) ? (uint8_t)reg : (uint8_t)reg | 0x80;
+}
+
+bool LIS3DH::ReadRegisters(LisRegister reg, size_t numToRead) noexcept
+{
+	return Transfer(GetReadAddress(reg, numToRead), dataBuffer, 1, numToRead, Lis3dI2CTimeout);
 }
 
 bool LIS3DH::WriteRegisters(LisRegister reg, size_t numToWrite) noexcept
@@ -295,8 +454,12 @@ void LIS3DH::Int1Isr() noexcept
 		firstInterruptTime = now;
 	}
 	lastInterruptTime = now;
+#if SHARED_I2C_USES_DMA
+	StartFifoRead(now);
+#else
 	TaskBase::GiveFromISR(taskWaiting);
 	taskWaiting = nullptr;
+#endif
 }
 
 void Int1Interrupt(CallbackParameter p) noexcept
@@ -13,38 +13,48 @@
 #if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
 
 #include "SharedI2CClient.h"
+#include "Accelerometer.h"
 
-class LIS3DH : public SharedI2CClient
+class LIS3DH : public Accelerometer, public SharedI2CClient
 {
 public:
 	LIS3DH(SharedI2CMaster& dev, Pin p_int1Pin) noexcept;
 
 	// Do a quick test to check whether the accelerometer is present, returning true if it is
-	bool CheckPresent() noexcept;
+	bool CheckPresent() noexcept override;
 
 	// Return the type name of the accelerometer. Only valid after checkPresent returns true.
-	const char *GetTypeName() const noexcept;
+	const char *GetTypeName() const noexcept override;
 
 	// Configure the accelerometer to collect at or near the requested sampling rate and the requested resolution in bits.
-	bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept;
+	bool Configure(uint16_t& samplingRate, uint8_t& resolution) noexcept override;
 
 	// Start collecting data
-	bool StartCollecting(uint8_t axes) noexcept;
+	bool StartCollecting(uint8_t axes) noexcept override;
 
 	// Collect some data from the FIFO, suspending until the data is available
-	unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept;
+	unsigned int CollectData(const uint16_t **collectedData, uint16_t &dataRate, bool &overflowed) noexcept override;
+
+	// Get the step clock time of the watermark interrupt for the data returned by the last call to CollectData.
+	// This is approximately the time at which the sample with index FifoInterruptLevel - 1 was taken.
+	uint32_t GetLastBlockTime() const noexcept override { return lastBlockTime; }
+
+	// Return how full the FIFO gets before we get an interrupt
+	unsigned int GetFifoInterruptLevel() const noexcept override { return FifoInterruptLevel; }
 
 	// Stop collecting data
-	void StopCollecting() noexcept;
+	void StopCollecting() noexcept override;
 
 	// Get a status byte
-	uint8_t ReadStatus() noexcept;
+	uint8_t ReadStatus() noexcept override;
 
 	// Used by the ISR
 	void Int1Isr() noexcept;
 
 	// Used by diagnostics
-	bool HasInterruptError() const noexcept { return interruptError; }
+	bool HasInterruptError() const noexcept override { return interruptError; }
+
+	static constexpr uint8_t FifoInterruptLevel = 24;					// how full the FIFO must get before we want an interrupt
 
 private:
 	enum class LisRegister : uint8_t
@@ -62,10 +72,34 @@ private:
 	bool WriteRegisters(LisRegister reg, size_t numToWrite) noexcept;
 	bool ReadRegister(LisRegister reg, uint8_t& val) noexcept;
 	bool WriteRegister(LisRegister reg, uint8_t val) noexcept;
+	uint8_t GetReadAddress(LisRegister reg, size_t numToRead) const noexcept;
+
+#if SHARED_I2C_USES_DMA
+	// When using DMA, each time the watermark interrupt occurs we read FifoInterruptLevel samples from the FIFO into the next free buffer.
+	// The accelerometer task owns the I2C bus while collecting data and only has to pack and send the data.
+	static constexpr size_t NumFifoBuffers = 2;
+
+	static void FifoReadCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept;
+	void FifoReadDone(DmaCallbackReason reason) noexcept;
+	void StartFifoRead(uint32_t now) noexcept;
+
+	alignas(2) uint8_t fifoBuffers[NumFifoBuffers][6 * FifoInterruptLevel];
+	uint32_t fifoBufferTimes[NumFifoBuffers];						// the time of the watermark interrupt that caused each buffer to be filled
+	volatile uint8_t numFifoBuffersFull;							// includes the one the task is using, if any
+	uint8_t fifoBufferBeingFilled;
+	uint8_t fifoBufferBeingRead;
+	volatile bool fifoReadInProgress;
+	volatile bool fifoReadsEnabled;
+	volatile bool fifoReadDeferred;									// true if we got a watermark interrupt but had no free buffer
+	volatile bool fifoOverrunPossible;								// true if we deferred reading the FIFO since we last returned data
+	volatile bool fifoReadFailed;
+	bool taskHasFifoBuffer;
+#endif
 
 	volatile TaskHandle taskWaiting;
 	uint32_t firstInterruptTime;
 	uint32_t lastInterruptTime;
+	uint32_t lastBlockTime;
 	uint32_t totalNumRead;
 	bool is3DSH;
 	bool interruptError;
@@ -46,7 +46,7 @@ private:
 	// In the following structs, the magic value must always be the first 2 bytes
 	struct CommonPage
 	{
-		static constexpr unsigned int NumberOfResetDataSlots = 3;
+		static constexpr unsigned int NumberOfResetDataSlots = 2;
 		static constexpr unsigned int MaxCalibratedThermistors = 8;
 
 		uint16_t magic;
@@ -54,7 +54,8 @@ private:
 		uint8_t thermistorHighCalibration[MaxCalibratedThermistors];
 		uint8_t spare[38];
 		// 56 bytes up to here
-		SoftwareResetData resetData[NumberOfResetDataSlots];			// 3 slots of 152 bytes each
+		SoftwareResetData resetData[NumberOfResetDataSlots];			// 2 slots of 216 bytes each
+		uint8_t spare2[24];
 	};
 
 	struct ClosedLoopPage
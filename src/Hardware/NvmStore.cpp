@@ -0,0 +1,286 @@
+/*
+ * NvmStore.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "NvmStore.h"
+#include <RTOSIface/RTOSIface.h>
+
+#if SAMC21
+# include <Flash.h>
+#endif
+
+namespace NvmStore
+{
+	// The store starts after the two 512-byte pages used by NonVolatileMemory. Both the SAME5x and the SAMC21 are configured to have 4K of EEPROM.
+	// We divide the rest into two banks so that we can compact the records of one into the other.
+	constexpr uint32_t StoreOffset = 1024;
+	constexpr uint32_t BankSize = 1536;
+	constexpr uint32_t BankMagic = 0x3153564E;						// "NVS1"
+	constexpr uint16_t FreeKey = 0xFFFF;
+
+#if SAMC21
+	constexpr uint32_t StoreAddress = FLASH_ADDR + 0x00400000 + StoreOffset;		// the RWW EEPROM area
+	constexpr uint32_t FlashPageSize = 64;
+	static_assert(BankSize % 256 == 0);								// the bank must be a whole number of erase rows
+#elif SAME5x
+	constexpr uint32_t StoreAddress = SEEPROM_ADDR + StoreOffset;	// the SmartEEPROM area
+#else
+# error Unsupported processor
+#endif
+
+	struct BankHeader
+	{
+		uint32_t magic;
+		uint32_t sequence;											// incremented each time we compact into the other bank, so the bank with the higher number is the active one
+	};
+
+	// Each record is a header followed by the data, padded to a multiple of 4 bytes
+	struct RecordHeader
+	{
+		uint16_t key;
+		uint8_t length;
+		uint8_t checksum;
+	};
+
+	static Mutex storeMutex;
+	static unsigned int activeBank = 0;
+	static uint32_t activeSequence = 0;
+	static uint32_t writeOffset = 0;								// offset of the first free byte in the active bank
+	static unsigned int numWrites = 0, numUnchanged = 0, numCompactions = 0;
+
+	static inline uint32_t BankAddress(unsigned int bank) noexcept { return StoreAddress + bank * BankSize; }
+	static inline uint32_t RecordSize(size_t length) noexcept { return sizeof(RecordHeader) + ((length + 3) & ~3u); }
+
+	static uint8_t ComputeChecksum(uint16_t key, size_t length, const uint8_t *data) noexcept
+	{
+		uint8_t c = (uint8_t)key ^ (uint8_t)(key >> 8) ^ (uint8_t)length;
+		for (size_t i = 0; i < length; ++i)
+		{
+			c = (uint8_t)((c << 1) | (c >> 7)) ^ data[i];
+		}
+		return c;
+	}
+
+	// Write bytes to the store. On the SAMC21 we can only write whole flash pages, so we merge the new data with what is already in each page.
+	// Flash bits that are already programmed are rewritten with the same values, which is allowed without an erase.
+	static void Program(uint32_t address, const void *data, size_t length) noexcept
+	{
+		const uint8_t *src = reinterpret_cast<const uint8_t*>(data);
+#if SAMC21
+		while (length != 0)
+		{
+			const uint32_t pageAddress = address & ~(FlashPageSize - 1);
+			const size_t offsetInPage = address - pageAddress;
+			const size_t bytesThisPage = min<size_t>(length, FlashPageSize - offsetInPage);
+			alignas(4) uint8_t page[FlashPageSize];
+			memcpyu32(reinterpret_cast<uint32_t*>(page), reinterpret_cast<const uint32_t*>(pageAddress), FlashPageSize/sizeof(uint32_t));
+			memcpy(page + offsetInPage, src, bytesThisPage);
+			Flash::RwwWrite(pageAddress, FlashPageSize, page);
+			address += bytesThisPage;
+			src += bytesThisPage;
+			length -= bytesThisPage;
+		}
+#else
+		uint8_t * const dst = reinterpret_cast<uint8_t*>(address);
+		while (NVMCTRL->SEESTAT.bit.BUSY) { }
+		for (size_t i = 0; i < length; ++i)
+		{
+			dst[i] = src[i];
+		}
+		while (NVMCTRL->SEESTAT.bit.BUSY) { }
+#endif
+	}
+
+	static void EraseBank(unsigned int bank) noexcept
+	{
+#if SAMC21
+		Flash::RwwErase(BankAddress(bank), BankSize);
+#else
+		uint32_t * const dst = reinterpret_cast<uint32_t*>(BankAddress(bank));
+		while (NVMCTRL->SEESTAT.bit.BUSY) { }
+		for (size_t i = 0; i < BankSize/sizeof(uint32_t); ++i)
+		{
+			dst[i] = 0xFFFFFFFF;
+		}
+		while (NVMCTRL->SEESTAT.bit.BUSY) { }
+#endif
+	}
+
+	static const BankHeader& GetBankHeader(unsigned int bank) noexcept
+	{
+		return *reinterpret_cast<const BankHeader*>(BankAddress(bank));
+	}
+
+	static const RecordHeader& GetRecordHeader(unsigned int bank, uint32_t offset) noexcept
+	{
+		return *reinterpret_cast<const RecordHeader*>(BankAddress(bank) + offset);
+	}
+
+	static const uint8_t *GetRecordData(unsigned int bank, uint32_t offset) noexcept
+	{
+		return reinterpret_cast<const uint8_t*>(BankAddress(bank) + offset + sizeof(RecordHeader));
+	}
+
+	// Scan the records in a bank. Return the offset of the first free byte and set recordOffset to the offset of the latest valid record with the specified key, or zero if there isn't one.
+	// If we find a record that overruns the bank then the bank is corrupt, so we return the bank size to force it to be compacted.
+	static uint32_t ScanBank(unsigned int bank, uint16_t key, uint32_t& recordOffset) noexcept
+	{
+		recordOffset = 0;
+		uint32_t offset = sizeof(BankHeader);
+		while (offset + sizeof(RecordHeader) <= BankSize)
+		{
+			const RecordHeader& hdr = GetRecordHeader(bank, offset);
+			if (hdr.key == FreeKey)
+			{
+				break;
+			}
+			const uint32_t size = RecordSize(hdr.length);
+			if (offset + size > BankSize)
+			{
+				return BankSize;
+			}
+			if (hdr.key == key && hdr.checksum == ComputeChecksum(hdr.key, hdr.length, GetRecordData(bank, offset)))
+			{
+				recordOffset = offset;
+			}
+			offset += size;
+		}
+		return offset;
+	}
+
+	// Append a record to the active bank. The caller has checked that there is room. We write the header last so that a partly-written record isn't seen as valid.
+	static void AppendRecord(uint16_t key, const uint8_t *data, size_t length) noexcept
+	{
+		const RecordHeader hdr = { key, (uint8_t)length, ComputeChecksum(key, length, data) };
+		const uint32_t recordAddress = BankAddress(activeBank) + writeOffset;
+		Program(recordAddress + sizeof(RecordHeader), data, length);
+		Program(recordAddress, &hdr, sizeof(hdr));
+		writeOffset += RecordSize(length);
+	}
+
+	// Copy the latest record for each key except the one we are about to write into the other bank, then make that bank the active one
+	static void Compact(uint16_t excludedKey) noexcept
+	{
+		const unsigned int oldBank = activeBank;
+		const unsigned int newBank = activeBank ^ 1u;
+		EraseBank(newBank);
+
+		uint32_t newOffset = sizeof(BankHeader);
+		uint32_t offset = sizeof(BankHeader);
+		while (offset + sizeof(RecordHeader) <= BankSize)
+		{
+			const RecordHeader& hdr = GetRecordHeader(oldBank, offset);
+			if (hdr.key == FreeKey)
+			{
+				break;
+			}
+			const uint32_t size = RecordSize(hdr.length);
+			if (offset + size > BankSize)
+			{
+				break;
+			}
+			if (hdr.key != excludedKey)
+			{
+				uint32_t latestOffset;
+				(void)ScanBank(oldBank, hdr.key, latestOffset);
+				if (latestOffset == offset)
+				{
+					const RecordHeader newHdr = hdr;
+					Program(BankAddress(newBank) + newOffset + sizeof(RecordHeader), GetRecordData(oldBank, offset), hdr.length);
+					Program(BankAddress(newBank) + newOffset, &newHdr, sizeof(newHdr));
+					newOffset += size;
+				}
+			}
+			offset += size;
+		}
+
+		// Write the bank header last, so that if we lose power during compaction the old bank is still the active one
+		const BankHeader newHeader = { BankMagic, activeSequence + 1 };
+		Program(BankAddress(newBank), &newHeader, sizeof(newHeader));
+		activeBank = newBank;
+		activeSequence = newHeader.sequence;
+		writeOffset = newOffset;
+		++numCompactions;
+	}
+}
+
+void NvmStore::Init() noexcept
+{
+	storeMutex.Create("NvmStore");
+
+	// The active bank is the valid one with the higher sequence number
+	const bool valid0 = GetBankHeader(0).magic == BankMagic;
+	const bool valid1 = GetBankHeader(1).magic == BankMagic;
+	if (valid0 || valid1)
+	{
+		activeBank = (valid1 && (!valid0 || (int32_t)(GetBankHeader(1).sequence - GetBankHeader(0).sequence) > 0)) ? 1 : 0;
+		activeSequence = GetBankHeader(activeBank).sequence;
+	}
+	else
+	{
+		activeBank = 0;
+		activeSequence = 0;
+		EraseBank(0);
+		const BankHeader header = { BankMagic, activeSequence };
+		Program(BankAddress(0), &header, sizeof(header));
+	}
+
+	uint32_t dummy;
+	writeOffset = ScanBank(activeBank, FreeKey, dummy);
+}
+
+bool NvmStore::Read(uint16_t key, void *data, size_t length) noexcept
+{
+	MutexLocker lock(storeMutex);
+
+	uint32_t recordOffset;
+	(void)ScanBank(activeBank, key, recordOffset);
+	if (recordOffset == 0 || GetRecordHeader(activeBank, recordOffset).length != length)
+	{
+		return false;
+	}
+	memcpy(data, GetRecordData(activeBank, recordOffset), length);
+	return true;
+}
+
+bool NvmStore::Write(uint16_t key, const void *data, size_t length) noexcept
+{
+	if (key == FreeKey || length > MaxRecordLength)
+	{
+		return false;
+	}
+
+	MutexLocker lock(storeMutex);
+
+	uint32_t recordOffset;
+	(void)ScanBank(activeBank, key, recordOffset);
+	if (recordOffset != 0 && GetRecordHeader(activeBank, recordOffset).length == length && memcmp(GetRecordData(activeBank, recordOffset), data, length) == 0)
+	{
+		++numUnchanged;
+		return true;
+	}
+
+	if (writeOffset + RecordSize(length) > BankSize)
+	{
+		Compact(key);
+		if (writeOffset + RecordSize(length) > BankSize)
+		{
+			return false;
+		}
+	}
+
+	AppendRecord(key, reinterpret_cast<const uint8_t*>(data), length);
+	++numWrites;
+	return true;
+}
+
+void NvmStore::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("NVM store bank %u seq %" PRIu32 " used %" PRIu32 "/%" PRIu32 ", writes %u, unchanged %u, compactions %u",
+					activeBank, activeSequence, writeOffset, BankSize, numWrites, numUnchanged, numCompactions);
+}
+
+// End
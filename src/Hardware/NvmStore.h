@@ -0,0 +1,31 @@
+/*
+ * NvmStore.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_HARDWARE_NVMSTORE_H_
+#define SRC_HARDWARE_NVMSTORE_H_
+
+#include <RepRapFirmware.h>
+
+// Log-structured key/value store in the EEPROM area that follows the pages used by NonVolatileMemory.
+// A changed value is appended as a new record, so most writes don't need an erase. When the active bank is full we copy the latest record for each key into the other bank.
+// This spreads the wear over the whole area and means that a page erase is needed only once per bank-full of changes.
+namespace NvmStore
+{
+	// Record keys. The values of these must never change, because the records persist across firmware updates.
+	constexpr uint16_t KeyThermistorLowCalibration = 0x0100;		// add the ADC filter channel number
+	constexpr uint16_t KeyThermistorHighCalibration = 0x0200;		// add the ADC filter channel number
+	constexpr uint16_t KeyClosedLoopBasicTuning = 0x0300;			// add the closed loop driver number
+
+	constexpr size_t MaxRecordLength = 252;
+
+	void Init() noexcept;
+	bool Read(uint16_t key, void *data, size_t length) noexcept;			// read the latest value for a key, returning false if there isn't one or it has a different length
+	bool Write(uint16_t key, const void *data, size_t length) noexcept;		// store a value for a key if it has changed, returning false if there isn't room
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif /* SRC_HARDWARE_NVMSTORE_H_ */
@@ -21,6 +21,17 @@ public:
 	void SetAddress(uint16_t addr) noexcept { address = addr; }
 	bool Transfer(uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead, uint32_t timeout) noexcept;
 
+#if SHARED_I2C_USES_DMA
+	// Functions for clients that read data in the background. The client must own the bus while the transfer is in progress.
+	bool TakeBus(uint32_t timeout) noexcept { return device.Take(timeout); }
+	void ReleaseBus() noexcept { device.Release(); }
+	bool StartDmaRead(uint8_t firstByte, uint8_t *buffer, size_t numToRead, DmaCallbackFunction callback, CallbackParameter cbParam) noexcept
+	{
+		return device.StartDmaRead(address, firstByte, buffer, numToRead, callback, cbParam);
+	}
+	void AbortDmaRead() noexcept { device.AbortDmaRead(); }
+#endif
+
 private:
 	SharedI2CMaster& device;
 	uint16_t address;
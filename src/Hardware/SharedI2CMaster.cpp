@@ -11,6 +11,10 @@
 
 #include "Serial.h"
 
+#if SHARED_I2C_USES_DMA
+# include <DmacManager.h>
+#endif
+
 #if SAME5x
 # include <hri_sercom_e54.h>
 #elif SAMC21
@@ -20,8 +24,16 @@
 constexpr uint32_t DefaultSharedI2CClockFrequency = 400000;
 constexpr uint32_t I2CTimeoutTicks = 100;
 
+#if SHARED_I2C_USES_DMA
+constexpr size_t MinDmaReadLength = 4;				// blocking reads of at least this many bytes use DMA, to avoid taking an interrupt per byte
+#endif
+
 SharedI2CMaster::SharedI2CMaster(uint8_t sercomNum) noexcept
-	: hardware(Serial::Sercoms[sercomNum]), taskWaiting(nullptr), busErrors(0), naks(0), otherErrors(0), state(I2cState::idle)
+	: hardware(Serial::Sercoms[sercomNum]), sercomNumber(sercomNum), taskWaiting(nullptr), busErrors(0), naks(0), otherErrors(0),
+#if SHARED_I2C_USES_DMA
+	  dmaReadsDone(0), dmaReadErrors(0), dmaRead(false),
+#endif
+	  state(I2cState::idle)
 {
 	Serial::EnableSercomClock(sercomNum);
 
@@ -48,22 +60,14 @@ SharedI2CMaster::SharedI2CMaster(uint8_t sercomNum) noexcept
 	hri_sercomi2cm_write_BAUD_reg(hardware, SERCOM_I2CM_BAUD_BAUD(Serial::SercomFastGclkFreq/(2 * DefaultSharedI2CClockFrequency) - 1));
 	hri_sercomi2cm_write_DBGCTRL_reg(hardware, SERCOM_I2CM_DBGCTRL_DBGSTOP);			// baud rate generator is stopped when CPU halted by debugger
 
-#if 0	// if using DMA
-	// Set up the DMA descriptors
-	// We use separate write-back descriptors, so we only need to set this up once, but it must be in SRAM
-	DmacSetBtctrl(I2CRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+#if SHARED_I2C_USES_DMA
+	// Set up the DMA descriptor for receiving. We only use DMA for reading, because the writes we do are short and a DMA write would need another DMA channel.
+	// We use separate write-back descriptors, so we only need to set up the parts that don't change once.
+	DmacManager::SetBtctrl(DmacChanI2cRx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(I2CRxDmaChannel, &(hardware->I2CM.DATA.reg));
-	DmacSetDestinationAddress(I2CRxDmaChannel, rcvData);
-	DmacSetDataLength(I2CRxDmaChannel, ARRAY_SIZE(rcvData));
-
-	DmacSetBtctrl(I2CTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
-								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(I2CTxDmaChannel, sendData);
-	DmacSetDestinationAddress(I2CTxDmaChannel, &(hardware->I2CM.DATA.reg));
-	DmacSetDataLength(I2CTxDmaChannel, ARRAY_SIZE(sendData));
-
-	DmacSetInterruptCallbacks(I2CRxDmaChannel, RxDmaCompleteCallback, nullptr, 0U);
+	DmacManager::SetSourceAddress(DmacChanI2cRx, &(hardware->I2CM.DATA.reg));
+	DmacManager::SetTriggerSourceSercomRx(DmacChanI2cRx, sercomNum);
+	DmacManager::SetInterruptCallback(DmacChanI2cRx, DmaCompleteCallback, CallbackParameter(this));
 #endif
 
 	const IRQn irqn = Serial::GetSercomIRQn(sercomNum);
@@ -131,10 +135,33 @@ void SharedI2CMaster::Diagnostics(const StringRef& reply) noexcept
 {
 	reply.lcatf("I2C bus errors %u, naks %u, other errors %u", busErrors, naks, otherErrors);
 	busErrors = naks = otherErrors = 0;
+#if SHARED_I2C_USES_DMA
+	reply.catf(", DMA reads %u, errors %u", dmaReadsDone, dmaReadErrors);
+	dmaReadsDone = dmaReadErrors = 0;
+#endif
 }
 
 bool SharedI2CMaster::InternalTransfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept
 {
+#if SHARED_I2C_USES_DMA
+	// If we are writing just the register address and then reading several bytes, use DMA for the read and wait for the callback
+	if (numToWrite == 1 && numToRead >= MinDmaReadLength && numToRead <= 255)
+	{
+		TaskBase::ClearNotifyCount();
+		const TaskHandle caller = TaskBase::GetCallerTaskHandle();
+		if (!StartDmaRead(address, firstByte, buffer, numToRead, BlockingDmaReadCallback, CallbackParameter(caller)))
+		{
+			return false;
+		}
+		if (!TaskBase::Take(I2CTimeoutTicks))
+		{
+			AbortDmaRead();
+			return false;
+		}
+		return state == I2cState::idle;
+	}
+#endif
+
 	currentAddress = address << 1;											// SERCOM uses the bottom bit as the Read flag
 	firstByteToWrite = firstByte;
 	transferBuffer = buffer;
@@ -164,10 +191,7 @@ bool SharedI2CMaster::InternalTransfer(uint16_t address, uint8_t firstByte, uint
 	}
 	else
 	{
-		state = I2cState::sendingAddressForRead;
-		hardware->I2CM.ADDR.reg = currentAddress | 0x0001;
-		while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
-		hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+		StartRead(currentAddress | 0x0001);
 	}
 
 	TaskBase::Take(I2CTimeoutTicks);
@@ -198,6 +222,17 @@ void SharedI2CMaster::ProtocolError() noexcept
 	}
 	hardware->I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN | SERCOM_I2CM_CTRLB_CMD(0x03);			// send stop command, get off bus
 	state = I2cState::protocolError;
+#if SHARED_I2C_USES_DMA
+	if (dmaRead)
+	{
+		DmacManager::DisableCompletedInterrupt(DmacChanI2cRx);
+		DmacManager::DisableChannel(DmacChanI2cRx);
+		dmaRead = false;
+		++dmaReadErrors;
+		dmaClientCallback(dmaClientCallbackParam, DmaCallbackReason::error);
+		return;
+	}
+#endif
 	TaskBase::GiveFromISR(taskWaiting);
 	taskWaiting = nullptr;
 }
@@ -246,17 +281,11 @@ void SharedI2CMaster::Interrupt() noexcept
 			}
 			else if (currentAddress >= 0x100)
 			{
-				hardware->I2CM.ADDR.reg = (currentAddress >> 8) | 0b1111001;
-				state = I2cState::sendingAddressForRead;
-				while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
-				hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+				StartRead((currentAddress >> 8) | 0b1111001);
 			}
 			else
 			{
-				hardware->I2CM.ADDR.reg = currentAddress | 0x0001;
-				state = I2cState::sendingAddressForRead;
-				while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
-				hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+				StartRead(currentAddress | 0x0001);
 			}
 		}
 		else
@@ -268,10 +297,7 @@ void SharedI2CMaster::Interrupt() noexcept
 	case I2cState::sendingTenBitAddressForRead:
 		if (flags == SERCOM_I2CM_INTFLAG_MB)
 		{
-			hardware->I2CM.ADDR.reg = (currentAddress >> 8) | 0b1111001;
-			state = I2cState::sendingAddressForRead;
-			while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
-			hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+			StartRead((currentAddress >> 8) | 0b1111001);
 		}
 		else
 		{
@@ -307,9 +333,118 @@ void SharedI2CMaster::Interrupt() noexcept
 			ProtocolError();
 		}
 		break;
+
+	case I2cState::readingDma:
+		// The DMA controller reads the data, so we only get an interrupt here if something went wrong
+		ProtocolError();
+		break;
 	}
 }
 
+// Send the address for reading. If we are doing a DMA read then the SERCOM counts the bytes, NAKs the last one and sends the stop condition.
+void SharedI2CMaster::StartRead(uint32_t addressReg) noexcept
+{
+#if SHARED_I2C_USES_DMA
+	if (dmaRead)
+	{
+		state = I2cState::readingDma;
+		hardware->I2CM.ADDR.reg = addressReg | SERCOM_I2CM_ADDR_LENEN | SERCOM_I2CM_ADDR_LEN(numLeftToRead);
+		while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
+		hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_ERROR;
+		return;
+	}
+#endif
+	state = I2cState::sendingAddressForRead;
+	hardware->I2CM.ADDR.reg = addressReg;
+	while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
+	hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB | SERCOM_I2CM_INTFLAG_SB;
+}
+
+#if SHARED_I2C_USES_DMA
+
+// Start writing the first byte and then reading data using DMA, returning without waiting for the transfer to complete.
+// The callback is called from an interrupt when the transfer has completed or failed. The caller must own the bus for as long as the transfer is in progress.
+// This may be called from an ISR, including from the callback. Returns false if a transfer is already in progress.
+// The number of bytes to read must be between 1 and 255.
+bool SharedI2CMaster::StartDmaRead(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToRead, DmaCallbackFunction callback, CallbackParameter cbParam) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	if (state != I2cState::idle && state != I2cState::protocolError)
+	{
+		return false;
+	}
+
+	currentAddress = address << 1;
+	firstByteToWrite = firstByte;
+	numLeftToWrite = 1;
+	numLeftToRead = numToRead;
+	dmaClientCallback = callback;
+	dmaClientCallbackParam = cbParam;
+	dmaRead = true;
+	taskWaiting = nullptr;
+
+	DmacManager::DisableChannel(DmacChanI2cRx);
+	DmacManager::SetDestinationAddress(DmacChanI2cRx, buffer);
+	DmacManager::SetDataLength(DmacChanI2cRx, numToRead);
+	DmacManager::EnableCompletedInterrupt(DmacChanI2cRx);
+	DmacManager::EnableChannel(DmacChanI2cRx, DmacPrioI2cRx);
+
+	hardware->I2CM.INTFLAG.reg = 0xFF;
+	hardware->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSERR | SERCOM_I2CM_STATUS_RXNACK | SERCOM_I2CM_STATUS_ARBLOST;
+	hardware->I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN;
+	state = I2cState::sendingAddressForWrite;
+	hardware->I2CM.ADDR.reg = (currentAddress >= 0x100) ? currentAddress | SERCOM_I2CM_ADDR_TENBITEN : currentAddress;
+	while (hardware->I2CM.SYNCBUSY.bit.SYSOP) { }
+	hardware->I2CM.INTENSET.reg = SERCOM_I2CM_INTFLAG_MB;
+	return true;
+}
+
+// Abandon a DMA read, for example because it has timed out. The client callback is not called.
+void SharedI2CMaster::AbortDmaRead() noexcept
+{
+	{
+		AtomicCriticalSectionLocker lock;
+		hardware->I2CM.INTENCLR.reg = 0xFF;
+		DmacManager::DisableCompletedInterrupt(DmacChanI2cRx);
+		DmacManager::DisableChannel(DmacChanI2cRx);
+		dmaRead = false;
+		state = I2cState::idle;
+	}
+	++dmaReadErrors;
+	Disable();
+	Enable();
+}
+
+// Callback used when we do a blocking read using DMA. The parameter is the handle of the waiting task.
+/*static*/ void SharedI2CMaster::BlockingDmaReadCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept
+{
+	TaskBase::GiveFromISR(static_cast<TaskHandle>(cb.vp));
+}
+
+/*static*/ void SharedI2CMaster::DmaCompleteCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept
+{
+	static_cast<SharedI2CMaster*>(cb.vp)->DmaComplete(reason);
+}
+
+void SharedI2CMaster::DmaComplete(DmaCallbackReason reason) noexcept
+{
+	hardware->I2CM.INTENCLR.reg = 0xFF;
+	DmacManager::DisableCompletedInterrupt(DmacChanI2cRx);
+	dmaRead = false;
+	state = I2cState::idle;
+	if (reason == DmaCallbackReason::complete)
+	{
+		++dmaReadsDone;
+	}
+	else
+	{
+		++dmaReadErrors;
+	}
+	dmaClientCallback(dmaClientCallbackParam, reason);			// this may start another transfer
+}
+
+#endif
+
 #endif
 
 // End
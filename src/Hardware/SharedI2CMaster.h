@@ -14,6 +14,10 @@
 
 #include <RTOSIface/RTOSIface.h>
 
+#if SHARED_I2C_USES_DMA
+# include <DmacManager.h>
+#endif
+
 class SharedI2CMaster
 {
 public:
@@ -29,18 +33,36 @@ public:
 
 	void Interrupt() noexcept;
 
+#if SHARED_I2C_USES_DMA
+	bool StartDmaRead(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToRead, DmaCallbackFunction callback, CallbackParameter cbParam) noexcept;
+	void AbortDmaRead() noexcept;
+#endif
+
 private:
 	enum class I2cState : uint8_t
 	{
-		idle = 0, sendingAddressForWrite, writing, sendingTenBitAddressForRead, sendingAddressForRead, reading, protocolError
+		idle = 0, sendingAddressForWrite, writing, sendingTenBitAddressForRead, sendingAddressForRead, reading, readingDma, protocolError
 	};
 
 	void Enable() const noexcept;
 	void Disable() const noexcept;
 	bool InternalTransfer(uint16_t address, uint8_t firstByte, uint8_t *buffer, size_t numToWrite, size_t numToRead) noexcept;
 	void ProtocolError()  noexcept;
+	void StartRead(uint32_t addressReg) noexcept;
+
+#if SHARED_I2C_USES_DMA
+	static void DmaCompleteCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept;
+	static void BlockingDmaReadCallback(CallbackParameter cb, DmaCallbackReason reason) noexcept;
+	void DmaComplete(DmaCallbackReason reason) noexcept;
+
+	DmaCallbackFunction dmaClientCallback;
+	CallbackParameter dmaClientCallbackParam;
+	unsigned int dmaReadsDone, dmaReadErrors;
+	bool dmaRead;
+#endif
 
 	Sercom * const hardware;
+	const uint8_t sercomNumber;
 	TaskHandle taskWaiting;
 	Mutex mutex;
 
@@ -25,6 +25,14 @@ public:
 	bool TransceivePacket(const uint8_t *tx_data, uint8_t *rx_data, size_t len) const;
 	void SetCsPin(Pin p) { csPin = p; }
 
+#if SHARED_SPI_USES_DMA
+	void StartDmaTransfer(const volatile uint8_t *tx_data, volatile uint8_t *rx_data, size_t len, DmaCallbackFunction callback, CallbackParameter cbParam) const noexcept
+	{
+		device.StartDmaTransfer(tx_data, rx_data, len, callback, cbParam);
+	}
+	void AbortDmaTransfer() const noexcept { device.AbortDmaTransfer(); }
+#endif
+
 private:
 	SharedSpiDevice& device;
 	uint32_t clockFrequency;
@@ -55,22 +55,18 @@ SharedSpiDevice::SharedSpiDevice(uint8_t sercomNum, uint32_t dataInPad) noexcept
 	hri_sercomspi_write_BAUD_reg(hardware, SERCOM_SPI_BAUD_BAUD(Serial::SercomFastGclkFreq/(2 * DefaultSharedSpiClockFrequency) - 1));
 	hri_sercomspi_write_DBGCTRL_reg(hardware, SERCOM_I2CM_DBGCTRL_DBGSTOP);		// baud rate generator is stopped when CPU halted by debugger
 
-#if 0	// if using DMA
+#if SHARED_SPI_USES_DMA
 	// Set up the DMA descriptors
-	// We use separate write-back descriptors, so we only need to set this up once, but it must be in SRAM
-	DmacSetBtctrl(SspiRxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+	// We use separate write-back descriptors, so we only need to set up the parts that don't change once
+	DmacManager::SetBtctrl(DmacChanSspiRx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_STEPSEL_DST | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(SspiRxDmaChannel, &(hardware->SPI.DATA.reg));
-	DmacSetDestinationAddress(SspiRxDmaChannel, rcvData);
-	DmacSetDataLength(SspiRxDmaChannel, ARRAY_SIZE(rcvData));
+	DmacManager::SetSourceAddress(DmacChanSspiRx, &(hardware->SPI.DATA.reg));
+	DmacManager::SetTriggerSourceSercomRx(DmacChanSspiRx, sercomNum);
 
-	DmacSetBtctrl(SspiTxDmaChannel, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
+	DmacManager::SetBtctrl(DmacChanSspiTx, DMAC_BTCTRL_VALID | DMAC_BTCTRL_EVOSEL_DISABLE | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_BYTE
 								| DMAC_BTCTRL_SRCINC | DMAC_BTCTRL_STEPSEL_SRC | DMAC_BTCTRL_STEPSIZE_X1);
-	DmacSetSourceAddress(SspiTxDmaChannel, sendData);
-	DmacSetDestinationAddress(SspiTxDmaChannel, &(hardware->SPI.DATA.reg));
-	DmacSetDataLength(SspiTxDmaChannel, ARRAY_SIZE(sendData));
-
-	DmacSetInterruptCallbacks(SspiRxDmaChannel, RxDmaCompleteCallback, nullptr, 0U);
+	DmacManager::SetDestinationAddress(DmacChanSspiTx, &(hardware->SPI.DATA.reg));
+	DmacManager::SetTriggerSourceSercomTx(DmacChanSspiTx, sercomNum);
 #endif
 
 	hardware->SPI.CTRLB.bit.RXEN = 1;
@@ -132,8 +128,17 @@ inline bool SharedSpiDevice::waitForRxReady() const noexcept
 	return false;
 }
 
+// Set the clock frequency and mode and enable the device.
+// Most of the time the same client or clients with the same settings use the device repeatedly, so we only reprogram the SERCOM if the settings have changed.
 void SharedSpiDevice::SetClockFrequencyAndMode(uint32_t freq, SpiMode mode) const noexcept
 {
+	if (freq == currentFrequency && mode == currentMode)
+	{
+		Enable();
+		++numReconfigurationsAvoided;
+		return;
+	}
+
 	// We have to disable SPI device in order to change the baud rate and mode
 	Disable();
 	hri_sercomspi_write_BAUD_reg(hardware, SERCOM_SPI_BAUD_BAUD(Serial::SercomFastGclkFreq/(2 * freq) - 1));
@@ -149,6 +154,15 @@ void SharedSpiDevice::SetClockFrequencyAndMode(uint32_t freq, SpiMode mode) cons
 	}
 	hri_sercomspi_write_CTRLA_reg(hardware, regCtrlA);
 	Enable();
+	currentFrequency = freq;
+	currentMode = mode;
+	++numReconfigurations;
+}
+
+void SharedSpiDevice::Diagnostics(const StringRef& reply) const noexcept
+{
+	reply.lcatf("Shared SPI reconfigurations %" PRIu32 ", avoided %" PRIu32, numReconfigurations, numReconfigurationsAvoided);
+	numReconfigurations = numReconfigurationsAvoided = 0;
 }
 
 bool SharedSpiDevice::TransceivePacket(const uint8_t* tx_data, uint8_t* rx_data, size_t len) const noexcept
@@ -194,6 +208,44 @@ bool SharedSpiDevice::TransceivePacket(const uint8_t* tx_data, uint8_t* rx_data,
 	return true;	// success
 }
 
+#if SHARED_SPI_USES_DMA
+
+// Start a DMA transfer and return without waiting for it to complete. The caller must own the device and must already have selected the client.
+// The callback is called from the DMA interrupt when the transfer has finished or failed. The buffers must remain valid until then.
+// This may be called from within the callback to start another transfer.
+void SharedSpiDevice::StartDmaTransfer(const volatile uint8_t *tx_data, volatile uint8_t *rx_data, size_t len, DmaCallbackFunction callback, CallbackParameter cbParam) const noexcept
+{
+	DmacManager::DisableChannel(DmacChanSspiRx);
+	DmacManager::DisableChannel(DmacChanSspiTx);
+	DmacManager::SetSourceAddress(DmacChanSspiTx, tx_data);
+	DmacManager::SetDataLength(DmacChanSspiTx, len);
+	DmacManager::SetDestinationAddress(DmacChanSspiRx, rx_data);
+	DmacManager::SetDataLength(DmacChanSspiRx, len);
+	DmacManager::SetInterruptCallback(DmacChanSspiRx, callback, cbParam);
+
+	// As in the TMC51xx driver, disable SPI, enable DMA and then enable SPI. Enabling SPI before DMA sometimes results in transfers not completing.
+	AtomicCriticalSectionLocker lock;
+	Disable();
+	while (hardware->SPI.INTFLAG.bit.RXC)
+	{
+		(void)hardware->SPI.DATA.reg;							// discard any stale received data
+	}
+	DmacManager::EnableCompletedInterrupt(DmacChanSspiRx);
+	DmacManager::EnableChannel(DmacChanSspiRx, DmacPrioSspiRx);
+	DmacManager::EnableChannel(DmacChanSspiTx, DmacPrioSspiTx);
+	Enable();
+}
+
+// Abandon a DMA transfer, for example because it has timed out
+void SharedSpiDevice::AbortDmaTransfer() const noexcept
+{
+	DmacManager::DisableCompletedInterrupt(DmacChanSspiRx);
+	DmacManager::DisableChannel(DmacChanSspiTx);
+	DmacManager::DisableChannel(DmacChanSspiRx);
+}
+
+#endif
+
 #endif
 
 // End
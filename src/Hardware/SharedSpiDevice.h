@@ -17,6 +17,10 @@
 
 #include <RTOSIface/RTOSIface.h>
 
+#if SHARED_SPI_USES_DMA
+# include <DmacManager.h>
+#endif
+
 enum class SpiMode : uint8_t
 {
 	mode0 = 0, mode1, mode2, mode3
@@ -32,6 +36,12 @@ public:
 	bool TransceivePacket(const uint8_t *tx_data, uint8_t *rx_data, size_t len) const noexcept;
 	bool Take(uint32_t timeout) noexcept { return mutex.Take(timeout); }					// get ownership of this SPI, return true if successful
 	void Release() noexcept { mutex.Release(); }
+	void Diagnostics(const StringRef& reply) const noexcept;
+
+#if SHARED_SPI_USES_DMA
+	void StartDmaTransfer(const volatile uint8_t *tx_data, volatile uint8_t *rx_data, size_t len, DmaCallbackFunction callback, CallbackParameter cbParam) const noexcept;
+	void AbortDmaTransfer() const noexcept;
+#endif
 
 private:
 	void Enable() const;
@@ -41,6 +51,9 @@ private:
 
 	Sercom * const hardware;
 	Mutex mutex;
+	mutable uint32_t currentFrequency = 0;									// the clock frequency that the SERCOM is programmed for, or 0 if not known
+	mutable SpiMode currentMode = SpiMode::mode0;
+	mutable uint32_t numReconfigurations = 0, numReconfigurationsAvoided = 0;
 };
 
 #endif
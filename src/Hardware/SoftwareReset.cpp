@@ -8,6 +8,9 @@
 #include "SoftwareReset.h"
 #include <Tasks.h>
 #include <Platform.h>
+#include <LatencyHistograms.h>
+#include <Movement/Move.h>
+#include <CanMessageBuffer.h>
 #include <General/Portability.h>
 #include <ctime>
 
@@ -106,6 +109,37 @@ void SoftwareResetData::Populate(uint16_t reason, const uint32_t *stk) noexcept
 			stval = (stk < &_estack) ? *stk++ : 0xFFFFFFFF;
 		}
 	}
+
+	PopulatePerformanceContext();
+}
+
+// Record the performance context. Most resets in the field follow overload conditions, so this helps us to reconstruct what was happening.
+void SoftwareResetData::PopulatePerformanceContext() noexcept
+{
+	static_assert(NumHiccupCounts <= Move::HiccupHistoryLength);
+	static_assert(NumLatencyMaxima == (size_t)LatencyProbe::numProbes);
+
+	for (size_t i = 0; i < NumHiccupCounts; ++i)
+	{
+		hiccups[i] = (moveInstance == nullptr) ? 0 : moveInstance->GetHiccupHistory(i);
+	}
+	ringOccupancy = (moveInstance == nullptr) ? 0 : (uint8_t)min<uint32_t>(moveInstance->GetRingOccupancy(), 0xFF);
+	maxRingOccupancy = (moveInstance == nullptr) ? 0 : (uint8_t)min<uint32_t>(moveInstance->GetMaxRingOccupancy(), 0xFF);
+	canBuffersFree = (uint8_t)min<unsigned int>(CanMessageBuffer::GetFreeBuffers(), 0xFF);
+	for (size_t i = 0; i < NumLatencyMaxima; ++i)
+	{
+		maxLatencyMicros[i] = (uint16_t)min<uint32_t>(LatencyHistograms::GetMaxMicroseconds((LatencyProbe)i), 0xFFFF);
+	}
+	spare2 = 0;
+	for (uint32_t& name : taskNames)
+	{
+		name = 0;
+	}
+	for (uint8_t& percent : taskCpuPercent)
+	{
+		percent = 0;
+	}
+	numTasksRecorded = (uint8_t)Tasks::GetCpuUsage(taskNames, taskCpuPercent, MaxTasksRecorded);
 }
 
 void SoftwareResetData::PrintPart1(unsigned int slot, const StringRef& reply) const noexcept
@@ -186,4 +220,25 @@ void SoftwareResetData::PrintPart2(const StringRef& reply) const noexcept
 	}
 }
 
+void SoftwareResetData::PrintPerformanceContext(const StringRef& reply) const noexcept
+{
+	reply.lcat("Context: hiccups");
+	for (uint16_t h : hiccups)
+	{
+		reply.catf(" %u", h);
+	}
+	reply.catf(", ring %u max %u, CAN buffers free %u, max us", ringOccupancy, maxRingOccupancy, canBuffersFree);
+	for (uint16_t t : maxLatencyMicros)
+	{
+		reply.catf(" %u", t);
+	}
+	reply.cat(", cpu");
+	for (size_t i = 0; i < numTasksRecorded && i < MaxTasksRecorded; ++i)
+	{
+		// The task name may include nulls at the end, so print it as a string
+		const uint32_t taskNameWords[2] = { taskNames[i], 0u };
+		reply.catf(" %s %u%%", (const char *)taskNameWords, taskCpuPercent[i]);
+	}
+}
+
 // End
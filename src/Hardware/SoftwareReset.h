@@ -68,14 +68,30 @@ struct SoftwareResetData
 	// The stack length is set to 27 words because that is the most we can print in a single message using our 256-byte format buffer
 	uint32_t stack[27];							// stack when the exception occurred, with the link register and program counter at the bottom
 
+	// Performance context at the time of the reset, so that we can see whether the board was overloaded
+	static constexpr size_t NumHiccupCounts = 4;
+	static constexpr size_t NumLatencyMaxima = 5;
+	static constexpr size_t MaxTasksRecorded = 8;
+	uint16_t hiccups[NumHiccupCounts];			// hiccups in the current and previous move hiccup sample intervals, most recent first
+	uint8_t ringOccupancy;						// moves in the DDA ring
+	uint8_t maxRingOccupancy;					// the most moves there have been in the DDA ring since power up
+	uint8_t canBuffersFree;						// free CAN message buffers
+	uint8_t numTasksRecorded;
+	uint16_t maxLatencyMicros[NumLatencyMaxima];	// longest durations of the latency probes since the last diagnostics
+	uint16_t spare2;
+	uint32_t taskNames[MaxTasksRecorded];		// first 4 bytes of each task name
+	uint8_t taskCpuPercent[MaxTasksRecorded];	// CPU usage of each task since the last diagnostics
+
 	bool IsVacant() const noexcept;				// return true if this struct can be written without erasing it first
 	bool IsValid() const noexcept { return magic == magicValue; }
 	void Clear() noexcept;
 	void Populate(uint16_t reason, const uint32_t *stk) noexcept;
+	void PopulatePerformanceContext() noexcept;
 	void PrintPart1(unsigned int slot, const StringRef& reply) const noexcept;
 	void PrintPart2(const StringRef& reply) const noexcept;
+	void PrintPerformanceContext(const StringRef& reply) const noexcept;
 
-	static constexpr uint16_t versionValue = 9;		// increment this whenever this struct changes
+	static constexpr uint16_t versionValue = 10;		// increment this whenever this struct changes
 	static constexpr uint16_t magicValue = 0x7D00 | versionValue;	// value we use to recognise that all the flash data has been written
 
 	static const char *const ReasonText[];
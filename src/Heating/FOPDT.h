@@ -46,6 +46,7 @@ public:
 	void SetDefaultBedOrChamberParameters() noexcept;
 
 	// Stored parameters
+	float GetHeatingRate() const noexcept { return heatingRate; }
 	float GetDeadTime() const noexcept { return deadTime; }
 	float GetMaxPwm() const noexcept { return maxPwm; }
 	bool UsePid() const noexcept { return usePid; }
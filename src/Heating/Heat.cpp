@@ -22,13 +22,19 @@ Licence: GPL
 #include "Heater.h"
 #include <Platform.h>
 #include <TaskPriorities.h>
+#include <PriorityProfiles.h>
 #include "Sensors/TemperatureSensor.h"
 #include "Sensors/RemoteSensor.h"
 #include <CanMessageGenericParser.h>
 #include <CanMessageBuffer.h>
 #include <CanMessageGenericTables.h>
 #include <CAN/CanInterface.h>
+#include <CAN/StatusReport.h>
 #include <Fans/FansManager.h>
+#include <Movement/StepTimer.h>
+#include <LatencyHistograms.h>
+#include <MemoryArenas.h>
+#include <DiagnosticsRecord.h>
 
 #if SUPPORT_DHT_SENSOR
 # include "Sensors/DhtSensor.h"
@@ -42,7 +48,7 @@ Licence: GPL
 # include <Movement/StepperDrivers/TMC51xx.h>
 #endif
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 # include <CommandProcessing/AccelerometerHandler.h>
 #endif
 
@@ -60,87 +66,399 @@ constexpr uint32_t HeaterTaskStackWords = 200;					// task stack size in dwords
 
 static Task<HeaterTaskStackWords> *heaterTask;
 
+// The publish task sends the status reports, so that the Heat task never has to wait for the CAN bus
+constexpr uint32_t PublishTaskStackWords = 160;					// task stack size in dwords
+static Task<PublishTaskStackWords> *publishTask;
+
+#if SUPPORT_SPI_SENSORS
+// Sensors that are slow to read are polled by a separate task, so that they don't delay the heater control loops
+constexpr uint32_t SensorPollTaskStackWords = 120;				// task stack size in dwords
+static Task<SensorPollTaskStackWords> *sensorPollTask;
+#endif
+
+// The safety monitor task checks the heaters for sensor faults, over-temperature and thermal runaway independently of the Heat task
+constexpr uint32_t SafetyMonitorTaskStackWords = 120;			// task stack size in dwords
+constexpr uint32_t SafetyMonitorIntervalMillis = 50;			// how often the safety monitor checks the heaters
+constexpr uint32_t HeatTaskStallMillis = 3000;					// how long the Heat task may go without running before the safety monitor turns the heaters off
+static Task<SafetyMonitorTaskStackWords> *safetyMonitorTask;
+
+// Emergency stop requests are handled by the safety monitor task, because it has a higher priority than the Heat task and can be woken from an ISR
+static volatile bool emergencyStopRequested = false;
+static volatile bool emergencyStopDone = false;
+static uint32_t whenEmergencyStopTriggered;						// step clock time of the trigger
+static uint32_t emergencyStopHeaterTicks;						// how long it took from the trigger to turning the heaters off
+
 namespace Heat
 {
 	// Private members
 	static Heater* heaters[MaxHeaters];							// A PID controller for each heater
 
 	static TemperatureSensor * volatile sensorsRoot = nullptr;	// The sensor list, which must be maintained in sensor number order because the Heat task assumes that
+	static TemperatureSensor *sensorsByNumber[MaxSensors];		// Index of the sensors in the list by sensor number, so that lookups don't need to walk the list. Protected by sensorsLock.
 
 	static float extrusionMinTemp;								// Minimum temperature to allow regular extrusion
 	static float retractionMinTemp;								// Minimum temperature to allow regular retraction
 	static bool coldExtrude;									// Is cold extrusion allowed?
-	static int8_t heaterBeingTuned;								// which PID is currently being tuned
 
 	static ReadWriteLock heatersLock;
 	static ReadWriteLock sensorsLock;
 
+	// Cache of the sensors on other boards that we have received readings for, so that we can process sensor broadcasts and read remote temperatures without walking the sensor list.
+	// remoteSensorSlots maps the sensor number to one more than the index of its entry in remoteSensors, or zero if it isn't cached. Both are protected by sensorsLock.
+#if SAMC21
+	constexpr size_t MaxCachedRemoteSensors = 8;
+#else
+	constexpr size_t MaxCachedRemoteSensors = 16;
+#endif
+
+	struct CachedRemoteSensor
+	{
+		RemoteSensor *sensor;
+		CanAddress boardAddress;
+	};
+
+	static uint8_t remoteSensorSlots[MaxSensors];
+	static CachedRemoteSensor remoteSensors[MaxCachedRemoteSensors];
+	static size_t numCachedRemoteSensors = 0;
+	static unsigned int remoteSensorCacheMisses = 0;			// for diagnostics
+
+	static volatile uint64_t sensorListeners = 0;				// sensors that thermostatic fans follow
+	static volatile uint64_t sensorsWithNewReadings = 0;		// sensors in sensorListeners that have had a new reading since the fans last looked
+	static volatile uint64_t heaterEventSensors = 0;			// sensors of the heaters that spin on new readings
+	static volatile uint64_t heaterSensorsWithNewData = 0;		// sensors in heaterEventSensors that have had new data since the Heat task last looked
+	static uint32_t eventDrivenSpins = 0;						// for diagnostics
+
+	static float heaterPowerBudget = 0.0;						// the total power in watts that the heaters on this board may draw, or 0 for no limit
+	static float heaterPowerAllocated = 0.0;					// the power allocated the last time we shared out the budget, for diagnostics
+	static uint32_t powerBudgetLimitedCount = 0;				// how many times we have had to limit a heater, for diagnostics
+
 	static uint64_t lastSensorsBroadcastWhich = 0;				// for diagnostics
 	static uint32_t lastSensorsBroadcastWhen = 0;				// for diagnostics
 	static unsigned int lastSensorsFound = 0;					// for diagnostics
 	static uint32_t heatTaskLoopTime = 0;						// for diagnostics
+	static uint32_t publishTaskLoopTime = 0;					// for diagnostics
+#if SUPPORT_SPI_SENSORS
+	static uint32_t sensorPollTaskLoopTime = 0;					// for diagnostics
+#endif
+	static uint32_t safetyMonitorLoopTime = 0;					// for diagnostics
+	static unsigned int safetyTrips = 0;						// for diagnostics
+	static unsigned int heatTaskStalls = 0;						// for diagnostics
 	static unsigned int sensorOrderingErrors = 0;				// for diagnostics
 
 	static uint8_t newDriverFaultState = 0;
 	static uint8_t newHeaterFaultState = 0;
 
+	// Periodic status reports. Each class of report is sent only when its content has changed by more than the deadband and its minimum interval has elapsed,
+	// or when its maximum interval has elapsed. The maximum intervals must be less than the timeouts that the main board applies to the data.
+	enum StatusReportClass : unsigned int { sensorsReport = 0, heatersReport, fansReport, driversReport, boardStatusReport, NumStatusReportClasses };
+	static StatusReport statusReports[NumStatusReportClasses] =
+	{
+		StatusReport(HeatSampleIntervalMillis, 500),			// sensor temperatures
+		StatusReport(HeatSampleIntervalMillis, 500),			// heater status
+		StatusReport(HeatSampleIntervalMillis, 1000),			// fan RPMs
+		StatusReport(HeatSampleIntervalMillis, 1000),			// driver status
+		StatusReport(1000, 1000),								// board health, which always changes so it is sent at the minimum interval
+	};
+	static const char * const StatusReportNames[NumStatusReportClasses] = { "sensors", "heaters", "fans", "drivers", "board" };
+
+	constexpr float TemperatureReportDeadband = 0.1;			// the change in temperature in C that we consider significant
+	constexpr unsigned int HeaterPwmReportDeadband = 2;			// the change in average heater PWM that we consider significant, out of 255
+	constexpr int32_t FanRpmReportDeadband = 30;				// the change in fan RPM that we consider significant
+
+	constexpr size_t MaxSensorsReported = sizeof(CanMessageSensorTemperatures::temperatureReports)/sizeof(CanMessageSensorTemperatures::temperatureReports[0]);
+
+	// Snapshot of our sensor readings, taken by the Heat task after it polls the sensors and broadcast by the publish task. Accessed only in a critical section.
+	struct SensorsSnapshot
+	{
+		uint64_t whichSensors;
+		unsigned int numSensors;
+		float temperatures[MaxSensorsReported];
+		uint8_t errorCodes[MaxSensorsReported];
+	};
+	static SensorsSnapshot sensorsSnapshot;
+	static volatile bool publishDue = false;					// set by the Heat task when the publish task should send the regular reports
+	static float lastSentSensorTemperatures[MaxSensorsReported];
+	static uint8_t lastSentSensorErrors[MaxSensorsReported];
+	static uint64_t lastSentSensorsWhich = 0;
+
+	static float lastSentHeaterTemperatures[MaxHeaters];
+	static uint8_t lastSentHeaterModes[MaxHeaters];
+	static uint8_t lastSentHeaterPwms[MaxHeaters];
+	static uint64_t lastSentHeatersWhich = 0;
+
+	static CanMessageFansReport lastSentFansReport;
+	static unsigned int lastSentFansReported = 0;
+
 	static ReadLockedPointer<Heater> FindHeater(int heater)
 	{
 		ReadLocker locker(heatersLock);
 		return ReadLockedPointer<Heater>(locker, (heater < 0 || heater >= (int)MaxHeaters) ? nullptr : heaters[heater]);
 	}
 
+	// Remove a sensor from the remote sensor cache, if it is there. Must write-lock the sensors lock before calling this.
+	static void UncacheRemoteSensor(unsigned int sn) noexcept
+	{
+		const unsigned int slot = remoteSensorSlots[sn];
+		if (slot != 0)
+		{
+			// Move the last entry into the vacated one so that the entries stay contiguous
+			remoteSensorSlots[sn] = 0;
+			--numCachedRemoteSensors;
+			if (slot - 1 != numCachedRemoteSensors)
+			{
+				remoteSensors[slot - 1] = remoteSensors[numCachedRemoteSensors];
+				remoteSensorSlots[remoteSensors[slot - 1].sensor->GetSensorNumber()] = slot;
+			}
+		}
+	}
+
+	// Add a remote sensor to the cache if there is room. Must write-lock the sensors lock before calling this.
+	static void CacheRemoteSensor(RemoteSensor *rs) noexcept
+	{
+		if (numCachedRemoteSensors < MaxCachedRemoteSensors)
+		{
+			remoteSensors[numCachedRemoteSensors].sensor = rs;
+			remoteSensors[numCachedRemoteSensors].boardAddress = rs->GetBoardAddress();
+			remoteSensorSlots[rs->GetSensorNumber()] = ++numCachedRemoteSensors;
+		}
+	}
+
+	// Return the sensor in the list before the position of sensor number 'sn', or nullptr if it belongs at the start. Must lock the sensors lock before calling this.
+	static TemperatureSensor *FindPreviousSensor(unsigned int sn) noexcept
+	{
+		while (sn != 0)
+		{
+			--sn;
+			if (sensorsByNumber[sn] != nullptr)
+			{
+				return sensorsByNumber[sn];
+			}
+		}
+		return nullptr;
+	}
+
 	// Delete a sensor, if there is one. Must write-lock the sensors lock before calling this.
 	static void DeleteSensor(unsigned int sn)
 	{
-		TemperatureSensor *currentSensor = sensorsRoot;
-		TemperatureSensor *lastSensor = nullptr;
+		TemperatureSensor * const sensorToDelete = sensorsByNumber[sn];
+		if (sensorToDelete != nullptr)
+		{
+			UncacheRemoteSensor(sn);
+			TemperatureSensor * const prev = FindPreviousSensor(sn);
+			if (prev == nullptr)
+			{
+				sensorsRoot = sensorToDelete->GetNext();
+			}
+			else
+			{
+				prev->SetNext(sensorToDelete->GetNext());
+			}
+			sensorsByNumber[sn] = nullptr;
+			delete sensorToDelete;
+		}
+	}
 
-		while (currentSensor != nullptr)
+	// Insert a sensor. There must not already be a sensor with the same number. Must write-lock the sensors lock before calling this.
+	static void InsertSensor(TemperatureSensor *newSensor)
+	{
+		const unsigned int sn = newSensor->GetSensorNumber();
+		TemperatureSensor * const prev = FindPreviousSensor(sn);
+		if (prev == nullptr)
+		{
+			newSensor->SetNext(sensorsRoot);
+			sensorsRoot = newSensor;
+		}
+		else
+		{
+			newSensor->SetNext(prev->GetNext());
+			prev->SetNext(newSensor);
+		}
+		sensorsByNumber[sn] = newSensor;
+	}
+
+	// Get the time at which we next need to spin a heater, or the specified time if that is earlier
+	static uint32_t GetNextHeaterSpinTime(uint32_t nextWakeTime) noexcept
+	{
+		ReadLocker lock(heatersLock);
+		for (const Heater *h : heaters)
 		{
-			if (currentSensor->GetSensorNumber() == sn)
+			if (h != nullptr && (int32_t)(h->WhenSpinDue() - nextWakeTime) < 0)
 			{
-				TemperatureSensor *sensorToDelete = currentSensor;
-				currentSensor = currentSensor->GetNext();
-				if (lastSensor == nullptr)
+				nextWakeTime = h->WhenSpinDue();
+			}
+			if (h != nullptr && h->IsDithering() && (int32_t)(h->WhenDitherDue() - nextWakeTime) < 0)
+			{
+				nextWakeTime = h->WhenDitherDue();
+			}
+		}
+		return nextWakeTime;
+	}
+
+	// Spin the heaters that are due, including those that spin on new readings whose sensors have fresh data.
+	// If we haven't just polled all the sensors then poll the sensor of each heater before spinning it.
+	static void SpinDueHeaters(uint32_t now, bool pollSensors) noexcept
+	{
+		uint64_t sensorsWithNewData;
+		{
+			AtomicCriticalSectionLocker lock;
+			sensorsWithNewData = heaterSensorsWithNewData;
+			heaterSensorsWithNewData = 0;
+		}
+
+		ReadLocker lock(heatersLock);
+		for (Heater *h : heaters)
+		{
+			if (h == nullptr)
+			{
+				continue;
+			}
+			const int sn = h->GetSensorNumber();
+			const bool haveNewData = sn >= 0 && sn < (int)MaxSensors && (sensorsWithNewData & ((uint64_t)1 << sn)) != 0;
+			if (h->IsSpinDue(now) || (haveNewData && h->IsSpinDueOnNewReading(now)))
+			{
+				if (!h->IsSpinDue(now))
 				{
-					sensorsRoot = currentSensor;
+					++eventDrivenSpins;
 				}
-				else
+				if (pollSensors)
 				{
-					lastSensor->SetNext(currentSensor);
+					const auto sensor = FindSensor(h->GetSensorNumber());
+					if (sensor.IsNotNull() && !sensor->IsSlowToPoll())
+					{
+						sensor->Poll();
+					}
 				}
-				delete sensorToDelete;
-				break;
+				h->Spin();
+				h->ScheduleNextSpin(now);
 			}
+		}
+	}
 
-			lastSensor = currentSensor;
-			currentSensor = currentSensor->GetNext();
+	// Recalculate which sensors the heaters that spin on new readings use. Call this with heatersLock held.
+	static void UpdateHeaterEventSensors() noexcept
+	{
+		uint64_t sensors = 0;
+		for (const Heater *h : heaters)
+		{
+			if (h != nullptr && h->GetSpinOnNewReading() && h->GetSensorNumber() >= 0 && h->GetSensorNumber() < (int)MaxSensors)
+			{
+				sensors |= (uint64_t)1 << h->GetSensorNumber();
+			}
 		}
+		heaterEventSensors = sensors;
 	}
 
-	// Insert a sensor. Must write-lock the sensors lock before calling this.
-	static void InsertSensor(TemperatureSensor *newSensor)
+	// Share the power budget among the heaters, highest priority first. First in priority order we give each heater up to the power that its model says
+	// it needs to hold its target temperature, so that heaters that are already at temperature stay there. Then in priority order we give out what is left
+	// to heaters that want more, e.g. because they are warming up. Heaters of equal priority share the power in proportion to what they ask for.
+	// Heaters that are not in the budget, including those being tuned, are not limited but the power they want is taken off the budget first.
+	static void AllocatePowerBudget() noexcept
 	{
-		TemperatureSensor *prev = nullptr;
-		TemperatureSensor *ts = sensorsRoot;
-		for (;;)
+		ReadLocker lock(heatersLock);
+		if (heaterPowerBudget <= 0.0)
 		{
-			if (ts == nullptr || ts->GetSensorNumber() > newSensor->GetSensorNumber())
+			for (Heater *h : heaters)
 			{
-				newSensor->SetNext(ts);
-				if (prev == nullptr)
+				if (h != nullptr)
 				{
-					sensorsRoot = newSensor;
+					h->SetPwmLimit(1.0);
+				}
+			}
+			return;
+		}
+
+		float granted[MaxHeaters];
+		float available = heaterPowerBudget;
+		for (size_t i = 0; i < MaxHeaters; ++i)
+		{
+			granted[i] = 0.0;
+			const Heater * const h = heaters[i];
+			if (h != nullptr && !h->IsPowerLimited())
+			{
+				available -= h->GetRequestedPwm() * h->GetRatedPower();
+			}
+		}
+
+		for (unsigned int pass = 0; pass < 2; ++pass)
+		{
+			// Work through the priorities from the highest down
+			int priority = 255;
+			while (priority >= 0 && available > 0.0)
+			{
+				float wanted = 0.0;
+				int nextPriority = -1;
+				for (size_t i = 0; i < MaxHeaters; ++i)
+				{
+					const Heater * const h = heaters[i];
+					if (h != nullptr && h->IsPowerLimited())
+					{
+						if (h->GetPowerPriority() == priority)
+						{
+							const float pwm = (pass == 0) ? h->GetHoldingPwm() : h->GetRequestedPwm();
+							wanted += max<float>(pwm * h->GetRatedPower() - granted[i], 0.0);
+						}
+						else if (h->GetPowerPriority() < priority && h->GetPowerPriority() > nextPriority)
+						{
+							nextPriority = h->GetPowerPriority();
+						}
+					}
+				}
+
+				if (wanted > 0.0)
+				{
+					const float fraction = min<float>(available/wanted, 1.0);
+					for (size_t i = 0; i < MaxHeaters; ++i)
+					{
+						const Heater * const h = heaters[i];
+						if (h != nullptr && h->IsPowerLimited() && h->GetPowerPriority() == priority)
+						{
+							const float pwm = (pass == 0) ? h->GetHoldingPwm() : h->GetRequestedPwm();
+							granted[i] += max<float>(pwm * h->GetRatedPower() - granted[i], 0.0) * fraction;
+						}
+					}
+					available -= wanted * fraction;
+				}
+				priority = nextPriority;
+			}
+		}
+
+		float allocated = 0.0;
+		for (size_t i = 0; i < MaxHeaters; ++i)
+		{
+			Heater * const h = heaters[i];
+			if (h != nullptr)
+			{
+				if (h->IsPowerLimited())
+				{
+					const float limit = granted[i]/h->GetRatedPower();
+					if (limit < h->GetRequestedPwm())
+					{
+						++powerBudgetLimitedCount;
+					}
+					h->SetPwmLimit(limit);
+					h->ApplyPwmLimit();
+					allocated += granted[i];
 				}
 				else
 				{
-					prev->SetNext(newSensor);
+					h->SetPwmLimit(1.0);
 				}
-				break;
 			}
-			prev = ts;
-			ts = ts->GetNext();
+		}
+		heaterPowerAllocated = allocated;
+	}
+
+	// Output the next PWM value of the heaters that dither their PWM and are due
+	static void DitherDueHeaters(uint32_t now) noexcept
+	{
+		ReadLocker lock(heatersLock);
+		for (Heater *h : heaters)
+		{
+			if (h != nullptr && h->IsDithering() && h->IsDitherDue(now))
+			{
+				h->DitherPwm();
+				h->ScheduleNextDither(now);
+			}
 		}
 	}
 
@@ -150,12 +468,14 @@ namespace Heat
 		return GCodeResult::error;
 	}
 
-	// Broadcast our heater statuses
-	static void SendHeatersStatus(CanMessageBuffer& buf)
+	// Broadcast our heater statuses. If 'urgent' is false then we send them only if the report schedule says they are due.
+	static void SendHeatersStatus(CanMessageBuffer& buf, bool urgent)
 	{
 		CanMessageHeatersStatus * const msg = buf.SetupStatusMessage<CanMessageHeatersStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
 		msg->whichHeaters = 0;
 		unsigned int heatersFound = 0;
+		float temperatures[MaxHeaters];
+		bool changed = false;
 
 		{
 			ReadLocker lock(heatersLock);
@@ -168,7 +488,12 @@ namespace Heat
 					msg->whichHeaters |= (uint64_t)1u << heater;
 					msg->reports[heatersFound].mode = h->GetModeByte();
 					msg->reports[heatersFound].averagePwm = (uint8_t)(h->GetAveragePWM() * 255.0);
-					msg->reports[heatersFound].SetTemperature(h->GetTemperature());
+					temperatures[heatersFound] = h->GetTemperature();
+					msg->reports[heatersFound].SetTemperature(temperatures[heatersFound]);
+					changed = changed
+							|| msg->reports[heatersFound].mode != lastSentHeaterModes[heatersFound]
+							|| (unsigned int)abs((int)msg->reports[heatersFound].averagePwm - (int)lastSentHeaterPwms[heatersFound]) >= HeaterPwmReportDeadband
+							|| fabsf(temperatures[heatersFound] - lastSentHeaterTemperatures[heatersFound]) >= TemperatureReportDeadband;
 					++heatersFound;
 				}
 			}
@@ -176,8 +501,52 @@ namespace Heat
 
 		if (heatersFound != 0)
 		{
+			const uint32_t now = millis();
+			if (!urgent && !statusReports[heatersReport].IsDue(now, changed || msg->whichHeaters != lastSentHeatersWhich))
+			{
+				statusReports[heatersReport].ReportSuppressed();
+				return;
+			}
+
+			lastSentHeatersWhich = msg->whichHeaters;
+			for (size_t i = 0; i < heatersFound; ++i)
+			{
+				lastSentHeaterModes[i] = msg->reports[i].mode;
+				lastSentHeaterPwms[i] = msg->reports[i].averagePwm;
+				lastSentHeaterTemperatures[i] = temperatures[i];
+			}
 			buf.dataLength = msg->GetActualDataLength(heatersFound);
 			CanInterface::Send(&buf);
+			statusReports[heatersReport].ReportSent(now);
+		}
+	}
+
+	// Broadcast our fan RPMs if the report schedule says they are due
+	static void SendFansReport(CanMessageBuffer& buf)
+	{
+		CanMessageFansReport * const msg = buf.SetupStatusMessage<CanMessageFansReport>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
+		const unsigned int numReported = FansManager::PopulateFansReport(*msg);
+		if (numReported != 0)
+		{
+			bool changed = numReported != lastSentFansReported || msg->whichFans != lastSentFansReport.whichFans;
+			for (size_t i = 0; i < numReported && !changed; ++i)
+			{
+				changed = msg->fanReports[i].actualPwm != lastSentFansReport.fanReports[i].actualPwm
+						|| abs((int32_t)msg->fanReports[i].rpm - (int32_t)lastSentFansReport.fanReports[i].rpm) >= FanRpmReportDeadband;
+			}
+
+			const uint32_t now = millis();
+			if (!statusReports[fansReport].IsDue(now, changed))
+			{
+				statusReports[fansReport].ReportSuppressed();
+				return;
+			}
+
+			lastSentFansReport = *msg;
+			lastSentFansReported = numReported;
+			buf.dataLength = msg->GetActualDataLength(numReported);
+			CanInterface::Send(&buf);
+			statusReports[fansReport].ReportSent(now);
 		}
 	}
 }
@@ -192,7 +561,6 @@ bool Heat::IsHeaterEnabled(size_t heater)
 void Heat::Init()
 {
 	coldExtrude = false;
-	heaterBeingTuned = -1;
 
 	for (Heater *& h : heaters)
 	{
@@ -201,6 +569,9 @@ void Heat::Init()
 
 	// Set up the temperature (and other) sensors
 	sensorsRoot = nullptr;
+	memset(sensorsByNumber, 0, sizeof(sensorsByNumber));
+	memset(remoteSensorSlots, 0, sizeof(remoteSensorSlots));
+	numCachedRemoteSensors = 0;
 
 #if SUPPORT_DHT_SENSOR
 	// Initialise static fields of the DHT sensor
@@ -213,6 +584,18 @@ void Heat::Init()
 
 	heaterTask = new Task<HeaterTaskStackWords>;
 	heaterTask->Create(Heat::TaskLoop, "HEAT", nullptr, TaskPriority::HeatPriority);
+	PriorityProfiles::SetTaskRole(*heaterTask, PriorityProfiles::TaskRole::heat);
+	publishTask = new Task<PublishTaskStackWords>;
+	publishTask->Create(Heat::PublishTaskLoop, "PUBLISH", nullptr, TaskPriority::PublishPriority);
+
+#if SUPPORT_SPI_SENSORS
+	sensorPollTask = new Task<SensorPollTaskStackWords>;
+	sensorPollTask->Create(Heat::SensorPollTaskLoop, "SENSORS", nullptr, TaskPriority::SensorPollPriority);
+	PriorityProfiles::SetTaskRole(*sensorPollTask, PriorityProfiles::TaskRole::sensorPoll);
+#endif
+	safetyMonitorTask = new Task<SafetyMonitorTaskStackWords>;
+	safetyMonitorTask->Create(Heat::SafetyMonitorTaskLoop, "SAFETY", nullptr, TaskPriority::HeaterSafetyPriority);
+	PriorityProfiles::SetTaskRole(*safetyMonitorTask, PriorityProfiles::TaskRole::heaterSafety);
 }
 
 void Heat::Exit()
@@ -225,71 +608,64 @@ void Heat::Exit()
 		}
 	}
 
+	safetyMonitorTask->Suspend();
 	heaterTask->Suspend();
+	publishTask->Suspend();
 }
 
 // This is the task loop executed by the Heat task. This task performs the following functions:
+// - Poll the sensors and take a snapshot of their readings for the publish task
 // - Spin the PIDs every 250ms. They must be spun at regular intervals for the I and D terms to work consistently.
-// - Broadcast the sensor temperatures
-// - Broadcast the status of our heaters
-// - Broadcast the status of our fans
-// - Broadcast the status of our motor drivers
+// - Wake up the publish task to broadcast the status reports
+// It never sends CAN messages itself, so a congested CAN bus can't delay heater control.
 [[noreturn]] void Heat::TaskLoop(void *)
 {
-	uint32_t nextWakeTime = millis();
+	uint32_t nextWakeTime = millis() + HeatSampleIntervalMillis;
 	for (;;)
 	{
-		// Wait until we are woken or it's time to send another regular broadcast. If we are really unlucky, we could end up waiting for one tick too long.
-		nextWakeTime += HeatSampleIntervalMillis;
-		int32_t delayTime = (int32_t)(nextWakeTime - millis());
+		// Wait until it's time to poll the sensors, or it's time to spin a heater that needs spinning more often than that.
+		// If we are really unlucky, we could end up waiting for one tick too long.
+		const int32_t delayTime = (int32_t)(GetNextHeaterSpinTime(nextWakeTime) - millis());
 		if (delayTime > 0)
 		{
 			TaskBase::Take((uint32_t)delayTime);
 		}
 
-		CanMessageBuffer buf(nullptr);
-
-#if SUPPORT_DRIVERS
-		// Check whether we have any urgent messages to send
-		if (newDriverFaultState == 1)
+		// Check whether it is time to poll sensors and PIDs and send regular messages
+		const uint32_t startTime = millis();
+		const LatencyHistograms::Timestamp probeStartTime = LatencyHistograms::GetTimestamp();
+		DitherDueHeaters(startTime);
+		if ((int32_t)(startTime - nextWakeTime) < 0)
 		{
-			newDriverFaultState = 2;
-			Platform::SendDriversStatus(buf);
+			SpinDueHeaters(startTime, true);
 		}
-#endif
-
-		// Check whether we have new heater fault status messages to send
-		if (newHeaterFaultState == 1)
+		else
 		{
-			newHeaterFaultState = 2;
-			SendHeatersStatus(buf);
-		}
+			nextWakeTime += HeatSampleIntervalMillis;
 
-		// Check whether it is time to poll sensors and PIDs and send regular messages
-		const uint32_t startTime = millis();
-		if ((int32_t)(startTime - nextWakeTime) >= 0)
-		{
+			// Walk the sensor list and poll all sensors except those that are slow to read, which are polled by the sensor task.
+			// Also take a snapshot of our sensor temperatures for the publish task to broadcast.
 			{
-				// Walk the sensor list and poll all sensors
-				// Also prepare to broadcast our sensor temperatures
-				CanMessageSensorTemperatures * const sensorTempsMsg = buf.SetupBroadcastMessage<CanMessageSensorTemperatures>(CanInterface::GetCanAddress());
-				sensorTempsMsg->whichSensors = 0;
+				uint64_t whichSensors = 0;
 				unsigned int sensorsFound = 0;
+				float temperatures[MaxSensorsReported];
+				uint8_t errorCodes[MaxSensorsReported];
 				{
 					unsigned int nextUnreportedSensor = 0;
 					ReadLocker lock(sensorsLock);
 					for (TemperatureSensor *currentSensor = sensorsRoot; currentSensor != nullptr; currentSensor = currentSensor->GetNext())
 					{
-						currentSensor->Poll();
-						if (currentSensor->GetBoardAddress() == CanInterface::GetCanAddress() && sensorsFound < ARRAY_SIZE(sensorTempsMsg->temperatureReports))
+						if (!currentSensor->IsSlowToPoll())
+						{
+							currentSensor->Poll();
+						}
+						if (currentSensor->GetBoardAddress() == CanInterface::GetCanAddress() && sensorsFound < MaxSensorsReported)
 						{
 							const unsigned int sn = currentSensor->GetSensorNumber();
 							if (sn >= nextUnreportedSensor && sn < 64)
 							{
-								sensorTempsMsg->whichSensors |= (uint64_t)1u << sn;
-								float temperature;
-								sensorTempsMsg->temperatureReports[sensorsFound].errorCode = (uint8_t)(currentSensor->GetLatestTemperature(temperature));
-								sensorTempsMsg->temperatureReports[sensorsFound].SetTemperature(temperature);
+								whichSensors |= (uint64_t)1u << sn;
+								errorCodes[sensorsFound] = (uint8_t)(currentSensor->GetLatestTemperature(temperatures[sensorsFound]));
 								++sensorsFound;
 								nextUnreportedSensor = sn + 1;
 							}
@@ -303,112 +679,279 @@ void Heat::Exit()
 					}
 				}
 
-				// Spin the heaters
-				{
-					ReadLocker lock(heatersLock);
-					for (Heater *h : heaters)
-					{
-						if (h != nullptr)
-						{
-							h->Spin();
-						}
-					}
-				}
+				TaskCriticalSectionLocker lock;
+				sensorsSnapshot.whichSensors = whichSensors;
+				sensorsSnapshot.numSensors = sensorsFound;
+				memcpy(sensorsSnapshot.temperatures, temperatures, sensorsFound * sizeof(temperatures[0]));
+				memcpy(sensorsSnapshot.errorCodes, errorCodes, sensorsFound * sizeof(errorCodes[0]));
+			}
 
-				// Broadcast our sensor temperatures
-				lastSensorsBroadcastWhich = sensorTempsMsg->whichSensors;	// for diagnostics
-				lastSensorsBroadcastWhen = millis();						// for diagnostics
-				lastSensorsFound = sensorsFound;
-				if (sensorsFound != 0)
+			// Spin the heaters that are due. Heaters that respond slowly are not spun every time. Then share out the power budget using the new PWM requests.
+			SpinDueHeaters(startTime, false);
+			AllocatePowerBudget();
+
+			publishDue = true;
+			publishTask->Give();
+
+			Platform::KickHeatTaskWatchdog();				// tell Platform that we are alive
+			heatTaskLoopTime = millis() - startTime;
+			LatencyHistograms::Record(LatencyProbe::heatTaskLoop, probeStartTime);
+		}
+	}
+}
+
+// This is the task loop executed by the publish task. It is woken by the Heat task after each sample interval, and when there is a new fault to report. It performs the following functions:
+// - Broadcast the sensor temperatures from the snapshot taken by the Heat task
+// - Broadcast the status of our heaters
+// - Broadcast the status of our fans
+// - Broadcast the status of our motor drivers
+// - Send tuning reports, announcements and board health messages
+// Sending these may block if the CAN bus is busy, which is why they are not sent by the Heat task.
+[[noreturn]] void Heat::PublishTaskLoop(void *)
+{
+	for (;;)
+	{
+		TaskBase::Take();
+
+		CanMessageBuffer buf(nullptr);
+
+#if SUPPORT_DRIVERS
+		// Check whether we have any urgent messages to send
+		if (newDriverFaultState == 1)
+		{
+			newDriverFaultState = 2;
+			Platform::SendDriversStatus(buf, nullptr);
+		}
+#endif
+
+		// Check whether we have new heater fault status messages to send
+		if (newHeaterFaultState == 1)
+		{
+			newHeaterFaultState = 2;
+			SendHeatersStatus(buf, true);
+		}
+
+		if (!publishDue)
+		{
+			continue;
+		}
+		publishDue = false;
+		const uint32_t startTime = millis();
+
+		// Broadcast our sensor temperatures if they have changed or it is time to send them anyway
+		{
+			CanMessageSensorTemperatures * const sensorTempsMsg = buf.SetupBroadcastMessage<CanMessageSensorTemperatures>(CanInterface::GetCanAddress());
+			float temperatures[MaxSensorsReported];
+			unsigned int sensorsFound;
+			{
+				TaskCriticalSectionLocker lock;
+				sensorTempsMsg->whichSensors = sensorsSnapshot.whichSensors;
+				sensorsFound = sensorsSnapshot.numSensors;
+				memcpy(temperatures, sensorsSnapshot.temperatures, sensorsFound * sizeof(temperatures[0]));
+				for (size_t i = 0; i < sensorsFound; ++i)
 				{
-					buf.dataLength = sensorTempsMsg->GetActualDataLength(sensorsFound);
-					CanInterface::Send(&buf);
+					sensorTempsMsg->temperatureReports[i].errorCode = sensorsSnapshot.errorCodes[i];
 				}
 			}
 
-			// See if we are tuning a heater, or have finished tuning one
-			if (heaterBeingTuned != -1)
+			if (sensorsFound != 0)
 			{
-				const auto h = FindHeater(heaterBeingTuned);
-				if (h.IsNotNull() && h->IsTuning())
+				bool sensorsChanged = sensorTempsMsg->whichSensors != lastSentSensorsWhich;
+				for (size_t i = 0; i < sensorsFound; ++i)
 				{
-					auto msg = buf.SetupStatusMessage<CanMessageHeaterTuningReport>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
-					if (LocalHeater::GetTuningCycleData(*msg))
+					sensorTempsMsg->temperatureReports[i].SetTemperature(temperatures[i]);
+					sensorsChanged = sensorsChanged
+									|| sensorTempsMsg->temperatureReports[i].errorCode != lastSentSensorErrors[i]
+									|| fabsf(temperatures[i] - lastSentSensorTemperatures[i]) >= TemperatureReportDeadband;
+				}
+
+				const uint32_t now = millis();
+				if (statusReports[sensorsReport].IsDue(now, sensorsChanged))
+				{
+					lastSensorsBroadcastWhich = lastSentSensorsWhich = sensorTempsMsg->whichSensors;
+					lastSensorsBroadcastWhen = now;						// for diagnostics
+					lastSensorsFound = sensorsFound;
+					for (size_t i = 0; i < sensorsFound; ++i)
 					{
-						msg->SetStandardFields(heaterBeingTuned);
-						CanInterface::Send(&buf);
+						lastSentSensorErrors[i] = sensorTempsMsg->temperatureReports[i].errorCode;
+						lastSentSensorTemperatures[i] = temperatures[i];
 					}
+					buf.dataLength = sensorTempsMsg->GetActualDataLength(sensorsFound);
+					CanInterface::Send(&buf);
+					statusReports[sensorsReport].ReportSent(now);
 				}
 				else
 				{
-					heaterBeingTuned = -1;
+					statusReports[sensorsReport].ReportSuppressed();
 				}
 			}
+		}
 
-			if (newHeaterFaultState == 0)
-			{
-				SendHeatersStatus(buf);						// send the status of our heaters
-			}
-			else
-			{
-				newHeaterFaultState = 0;					// we recently sent it, so send it again next time
-			}
-
-			// Broadcast our fan RPMs
+		// Send a report for each heater that is being tuned and has completed a tuning cycle. Several heaters may be tuned at the same time.
+		{
+			ReadLocker lock(heatersLock);
+			for (size_t heater = 0; heater < MaxHeaters; ++heater)
 			{
-				CanMessageFansReport * const msg = buf.SetupStatusMessage<CanMessageFansReport>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
-				const unsigned int numReported = FansManager::PopulateFansReport(*msg);
-				if (numReported != 0)
+				Heater * const h = heaters[heater];
+				if (h != nullptr && h->IsTuning())
 				{
-					buf.dataLength = msg->GetActualDataLength(numReported);
-					CanInterface::Send(&buf);
+					auto msg = buf.SetupStatusMessage<CanMessageHeaterTuningReport>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
+					if (h->GetTuningCycleData(*msg))
+					{
+						msg->SetStandardFields(heater);
+						CanInterface::Send(&buf);
+					}
 				}
 			}
+		}
+
+		if (newHeaterFaultState == 0)
+		{
+			SendHeatersStatus(buf, false);				// send the status of our heaters
+		}
+		else
+		{
+			newHeaterFaultState = 0;					// we recently sent it, so send it again next time
+		}
+
+		SendFansReport(buf);							// broadcast our fan RPMs
 
 #if SUPPORT_DRIVERS
-			if (newDriverFaultState == 0)
-			{
-				Platform::SendDriversStatus(buf);			// send the status of our drivers
-			}
-			else
-			{
-				newDriverFaultState = 0;					// we recently sent it, so send it again next time
-			}
+		if (newDriverFaultState == 0)
+		{
+			Platform::SendDriversStatus(buf, &statusReports[driversReport]);	// send the status of our drivers
+		}
+		else
+		{
+			newDriverFaultState = 0;					// we recently sent it, so send it again next time
+		}
 #endif
 
-			// Announce ourselves to the main board, if it hasn't acknowledged us already
-			if (!CanInterface::SendAnnounce(&buf))
-			{
-				// We didn't need to send an announcement so send a board health message instead
-				CanMessageBoardStatus * const boardStatusMsg = buf.SetupStatusMessage<CanMessageBoardStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
-				boardStatusMsg->Clear();
+		// Announce ourselves to the main board, if it hasn't acknowledged us already
+		if (CanInterface::SendAnnounce(&buf))
+		{
+			// We sent an announcement instead of a board health message
+		}
+		else if (!statusReports[boardStatusReport].IsDue(millis(), true))
+		{
+			statusReports[boardStatusReport].ReportSuppressed();
+		}
+		else
+		{
+			// We didn't need to send an announcement so send a board health message instead
+			CanMessageBoardStatus * const boardStatusMsg = buf.SetupStatusMessage<CanMessageBoardStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
+			boardStatusMsg->Clear();
 
-				// We must add fields in the following order: VIN, V12, MCU temperature
-				size_t index = 0;
+			// We must add fields in the following order: VIN, V12, MCU temperature
+			size_t index = 0;
 #if HAS_VOLTAGE_MONITOR
-				boardStatusMsg->values[index++] = Platform::GetPowerVoltages(false);
-				boardStatusMsg->hasVin = true;
+			boardStatusMsg->values[index++] = Platform::GetPowerVoltages(false);
+			boardStatusMsg->hasVin = true;
 #endif
 #if HAS_12V_MONITOR
-				boardStatusMsg->values[index++] = Platform::GetV12Voltages(false);
-				boardStatusMsg->hasV12 = true;
+			boardStatusMsg->values[index++] = Platform::GetV12Voltages(false);
+			boardStatusMsg->hasV12 = true;
 #endif
 #if HAS_CPU_TEMP_SENSOR
-				boardStatusMsg->values[index++] = Platform::GetMcuTemperatures();
-				boardStatusMsg->hasMcuTemp = true;
+			boardStatusMsg->values[index++] = Platform::GetMcuTemperatures();
+			boardStatusMsg->hasMcuTemp = true;
 #endif
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
-				boardStatusMsg->hasAccelerometer = AccelerometerHandler::IsPresent();
+#if SUPPORT_ACCELEROMETERS
+			boardStatusMsg->hasAccelerometer = AccelerometerHandler::IsPresent();
 #endif
 #if SUPPORT_CLOSED_LOOP
-				boardStatusMsg->hasClosedLoop = true;
+			boardStatusMsg->hasClosedLoop = true;
 #endif
-				buf.dataLength = boardStatusMsg->GetActualDataLength();
-				CanInterface::Send(&buf);
+			buf.dataLength = boardStatusMsg->GetActualDataLength();
+			CanInterface::Send(&buf);
+			statusReports[boardStatusReport].ReportSent(millis());
+		}
+
+		publishTaskLoopTime = millis() - startTime;
+	}
+}
+
+#if SUPPORT_SPI_SENSORS
+
+// This is the task loop executed by the sensor task. It polls the sensors that are slow to read, for example because they need SPI transactions.
+// The Heat task and the heaters only read the cached temperatures from these sensors, so slow sensors no longer add to the Heat task loop time.
+[[noreturn]] void Heat::SensorPollTaskLoop(void *)
+{
+	uint32_t nextWakeTime = millis();
+	for (;;)
+	{
+		const uint32_t startTime = millis();
+		{
+			ReadLocker lock(sensorsLock);
+			for (TemperatureSensor *currentSensor = sensorsRoot; currentSensor != nullptr; currentSensor = currentSensor->GetNext())
+			{
+				if (currentSensor->IsSlowToPoll())
+				{
+					currentSensor->Poll();
+				}
 			}
+		}
+		sensorPollTaskLoopTime = millis() - startTime;
 
-			Platform::KickHeatTaskWatchdog();				// tell Platform that we are alive
-			heatTaskLoopTime = millis() - startTime;
+		nextWakeTime += HeatSampleIntervalMillis;
+		const int32_t delayTime = (int32_t)(nextWakeTime - millis());
+		if (delayTime > 0)
+		{
+			delay((uint32_t)delayTime);
+		}
+		else
+		{
+			nextWakeTime = millis();				// we have fallen behind, so don't try to catch up
+		}
+	}
+}
+
+#endif
+
+// This is the task loop executed by the safety monitor task. It runs much more often than the heater control loops and checks each active heater
+// for sensor faults, over-temperature and thermal runaway using the fastest reading available from its sensor. It also turns the heaters off
+// if the Heat task stops running, because then nothing else will. A heater that trips is switched off at once and the Heat task raises the fault.
+[[noreturn]] void Heat::SafetyMonitorTaskLoop(void *)
+{
+	uint32_t nextWakeTime = millis();
+	bool wasStalled = false;
+	for (;;)
+	{
+		if (emergencyStopRequested && !emergencyStopDone)
+		{
+			SwitchOffAll();
+			emergencyStopHeaterTicks = StepTimer::GetTimerTicks() - whenEmergencyStopTriggered;
+			emergencyStopDone = true;
+		}
+
+		const uint32_t startTime = millis();
+		const bool heatTaskStalled = Platform::GetHeatTaskIdleTicks() >= HeatTaskStallMillis;
+		if (heatTaskStalled && !wasStalled)
+		{
+			++heatTaskStalls;
+		}
+		wasStalled = heatTaskStalled;
+		{
+			ReadLocker lock(heatersLock);
+			for (Heater *h : heaters)
+			{
+				if (h != nullptr && h->SafetyCheck(startTime, heatTaskStalled))
+				{
+					++safetyTrips;
+				}
+			}
+		}
+		safetyMonitorLoopTime = millis() - startTime;
+
+		nextWakeTime += SafetyMonitorIntervalMillis;
+		const int32_t delayTime = (int32_t)(nextWakeTime - millis());
+		if (delayTime > 0)
+		{
+			(void)TaskBase::Take((uint32_t)delayTime);		// an emergency stop wakes us early
+		}
+		else
+		{
+			nextWakeTime = millis();				// we have fallen behind, so don't try to catch up
 		}
 	}
 }
@@ -446,7 +989,9 @@ GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef&
 		Heater *oldHeater = nullptr;
 		std::swap(oldHeater, heaters[heater]);
 		delete oldHeater;
+		UpdateHeaterEventSensors();						// the new heater doesn't spin on new readings until it is told to
 
+		MemoryArenas::Scope scope(MemoryArena::heat);
 		Heater *newHeater = new LocalHeater(heater);
 		const GCodeResult rslt = newHeater->ConfigurePortAndSensor(pinName.c_str(), freq, sensorNumber, reply);
 		if (Succeeded(rslt))
@@ -466,12 +1011,38 @@ GCodeResult Heat::ConfigureHeater(const CanMessageGeneric& msg, const StringRef&
 		return UnknownHeater(heater, reply);
 	}
 
+	GCodeResult rslt = GCodeResult::ok;
+	bool seen = false;
+	uint8_t controlMode;
+	if (parser.GetUintParam('M', controlMode))
+	{
+		// M0 = use the model type specified by M307, M1 = model predictive control
+		rslt = h->SetPredictiveControl(controlMode == 1, reply);
+		if (!Succeeded(rslt))
+		{
+			return rslt;
+		}
+		seen = true;
+	}
+
+	uint16_t ditherSteps;
+	if (parser.GetUintParam('D', ditherSteps))
+	{
+		// D0 = no dithering, D<n> = dither the PWM to a resolution of 1/n over successive PWM periods
+		rslt = h->SetPwmDither(ditherSteps, reply);
+		if (!Succeeded(rslt))
+		{
+			return rslt;
+		}
+		seen = true;
+	}
+
 	if (seenFreq)
 	{
 		return h->SetPwmFrequency(freq, reply);
 	}
 
-	return h->ReportDetails(reply);
+	return (seen) ? rslt : h->ReportDetails(reply);
 }
 
 GCodeResult Heat::ProcessM307New(const CanMessageHeaterModelNewNew& msg, const StringRef& reply)
@@ -503,6 +1074,7 @@ GCodeResult Heat::ProcessM308(const CanMessageGeneric& msg, const StringRef& rep
 
 				DeleteSensor(sensorNum);
 
+				MemoryArenas::Scope scope(MemoryArena::sensors);
 				TemperatureSensor * const newSensor = TemperatureSensor::Create(sensorNum, sensorTypeName.c_str(), reply);
 				if (newSensor == nullptr)
 				{
@@ -569,6 +1141,24 @@ float Heat::GetLowestTemperatureLimit(int heater) noexcept
 // Get the temperature of a sensor
 float Heat::GetSensorTemperature(int sensorNum, TemperatureError& err) noexcept
 {
+	if (sensorNum >= 0 && sensorNum < (int)MaxSensors)
+	{
+		// Remote sensors are the common case for thermostatic fans, so look in the cache first
+		ReadLocker lock(sensorsLock);
+		const unsigned int slot = remoteSensorSlots[sensorNum];
+		if (slot != 0)
+		{
+			const RemoteSensor * const rs = remoteSensors[slot - 1].sensor;
+			if (rs->GetReadingAge() > RemoteSensor::RemoteTemperatureTimeoutMillis)
+			{
+				err = TemperatureError::timeout;
+				return BadErrorTemperature;
+			}
+			err = rs->GetLastResult();
+			return rs->GetStoredReading();
+		}
+	}
+
 	const auto sensor = FindSensor(sensorNum);
 	if (sensor.IsNotNull())
 	{
@@ -581,30 +1171,179 @@ float Heat::GetSensorTemperature(int sensorNum, TemperatureError& err) noexcept
 	return BadErrorTemperature;
 }
 
+// Get the estimated time since the last reading of a sensor was measured. This is only significant for remote sensors, because of the delay in receiving their readings.
+uint32_t Heat::GetSensorLatency(int sensorNum) noexcept
+{
+	if (sensorNum >= 0 && sensorNum < (int)MaxSensors)
+	{
+		ReadLocker lock(sensorsLock);
+		const unsigned int slot = remoteSensorSlots[sensorNum];
+		if (slot != 0)
+		{
+			return remoteSensors[slot - 1].sensor->GetReadingLatency();
+		}
+	}
+
+	const auto sensor = FindSensor(sensorNum);
+	return (sensor.IsNotNull()) ? sensor->GetReadingLatency() : 0;
+}
+
+// Get the temperature of a sensor for the safety monitor. Sensors that can be read quickly return a new reading, the others return their stored reading.
+TemperatureError Heat::GetFastSensorTemperature(int sensorNum, float& t) noexcept
+{
+	const auto sensor = FindSensor(sensorNum);
+	if (sensor.IsNull())
+	{
+		t = BadErrorTemperature;
+		return TemperatureError::unknownSensor;
+	}
+	return sensor->GetFastReading(t);
+}
+
+// Set which sensors have listeners. Only new readings from these sensors are recorded.
+void Heat::SetSensorListeners(SensorsBitmap sensors) noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	sensorListeners = sensors.GetRaw();
+	sensorsWithNewReadings = sensors.GetRaw();					// make the listeners evaluate their sensors once, in case they changed
+}
+
+// Record that a sensor has a new reading. Called from TemperatureSensor::SetResult, which may be running in the heater task or the CAN receiving task.
+void Heat::NewSensorReading(unsigned int sensorNum) noexcept
+{
+	const uint64_t bit = (uint64_t)1 << sensorNum;
+	if (sensorNum < MaxSensors && (sensorListeners & bit) != 0)
+	{
+		AtomicCriticalSectionLocker lock;
+		sensorsWithNewReadings |= bit;
+	}
+	SensorDataReady(sensorNum);
+}
+
+// Record that a sensor has new data. If a heater that spins on new readings uses the sensor then wake up the Heat task.
+// This is called from TemperatureSensor::SetResult and from the completion of an ADC filter window, which may be in an ISR.
+void Heat::SensorDataReady(unsigned int sensorNum) noexcept
+{
+	const uint64_t bit = (uint64_t)1 << sensorNum;
+	if (sensorNum < MaxSensors && (heaterEventSensors & bit) != 0 && heaterTask != nullptr)
+	{
+		{
+			AtomicCriticalSectionLocker lock;
+			heaterSensorsWithNewData |= bit;
+		}
+		if (__get_IPSR() != 0)
+		{
+			TaskBase::GiveFromISR(heaterTask);
+		}
+		else if (TaskBase::GetCallerTaskHandle() != heaterTask)		// the Heat task only sets results when it polls the sensors itself
+		{
+			heaterTask->Give();
+		}
+	}
+}
+
+// Return the sensors with listeners that have had new readings since the last call, and clear the record
+SensorsBitmap Heat::TakeNewSensorReadings() noexcept
+{
+	uint64_t sensors;
+	{
+		AtomicCriticalSectionLocker lock;
+		sensors = sensorsWithNewReadings;
+		sensorsWithNewReadings = 0;
+	}
+	return SensorsBitmap::MakeFromRaw(sensors);
+}
+
+// Process a sensor temperatures broadcast from another board.
+// Sensors we already know about are looked up in the cache, so we only need to write-lock the sensors when a board reports a sensor we haven't seen before.
 void Heat::ProcessRemoteSensorsReport(CanAddress src, const CanMessageSensorTemperatures& msg) noexcept
 {
-	Bitmap<uint64_t> sensorsReported(msg.whichSensors);
-	sensorsReported.Iterate([src, &msg](unsigned int sensor, unsigned int index)
-								{
-									if (index < ARRAY_SIZE(msg.temperatureReports) && src != CanInterface::GetCanAddress())
+	if (src == CanInterface::GetCanAddress())
+	{
+		return;
+	}
+
+	uint64_t newSensors = 0;
+	{
+		ReadLocker lock(sensorsLock);
+		Bitmap<uint64_t> sensorsReported(msg.whichSensors);
+		sensorsReported.Iterate([src, &msg, &newSensors](unsigned int sensor, unsigned int index)
 									{
-										const CanSensorReport& sr = msg.temperatureReports[index];
-										auto ts = FindSensor(sensor);
-										if (ts.IsNotNull())
+										if (index < ARRAY_SIZE(msg.temperatureReports) && sensor < MaxSensors)
 										{
-											ts->UpdateRemoteTemperature(src, sr);
+											const unsigned int slot = remoteSensorSlots[sensor];
+											if (slot == 0)
+											{
+												newSensors |= (uint64_t)1 << sensor;
+											}
+											else if (remoteSensors[slot - 1].boardAddress == src)
+											{
+												remoteSensors[slot - 1].sensor->UpdateRemoteTemperature(src, msg.temperatureReports[index]);
+											}
 										}
-										else
+									}
+								);
+	}
+
+	if (newSensors != 0)
+	{
+		// Some sensors are not in the cache, either because we haven't seen them before or because they are local or the cache is full
+		Bitmap<uint64_t> sensorsReported(msg.whichSensors);
+		sensorsReported.Iterate([src, &msg, newSensors](unsigned int sensor, unsigned int index)
+									{
+										if (newSensors & ((uint64_t)1 << sensor))
 										{
-											// Create a new RemoteSensor
-											ts.Release();
-											RemoteSensor * const rs = new RemoteSensor(sensor, src);
-											rs->UpdateRemoteTemperature(src, sr);
-											InsertSensor(rs);
+											const CanSensorReport& sr = msg.temperatureReports[index];
+											WriteLocker lock(sensorsLock);
+											TemperatureSensor * const ts = sensorsByNumber[sensor];
+											if (ts != nullptr)
+											{
+												ts->UpdateRemoteTemperature(src, sr);
+												++remoteSensorCacheMisses;
+											}
+											else
+											{
+												// Create a new RemoteSensor
+												RemoteSensor * const rs = new RemoteSensor(sensor, src);
+												rs->UpdateRemoteTemperature(src, sr);
+												InsertSensor(rs);
+												CacheRemoteSensor(rs);
+											}
 										}
 									}
-								}
-							);
+								);
+	}
+}
+
+// Request that the safety monitor task turns all the heaters off. This may be called from an ISR, so we can't switch the heaters off here.
+void Heat::EmergencyStop(uint32_t whenTriggered) noexcept
+{
+	if (!emergencyStopRequested)
+	{
+		whenEmergencyStopTriggered = whenTriggered;
+		emergencyStopRequested = true;
+		if (safetyMonitorTask != nullptr)
+		{
+			if (__get_IPSR() != 0)
+			{
+				TaskBase::GiveFromISR(safetyMonitorTask);
+			}
+			else
+			{
+				safetyMonitorTask->Give();
+			}
+		}
+	}
+}
+
+bool Heat::GetEmergencyStopLatency(uint32_t& ticks) noexcept
+{
+	if (!emergencyStopDone)
+	{
+		return false;
+	}
+	ticks = emergencyStopHeaterTicks;
+	return true;
 }
 
 void Heat::SwitchOffAll()
@@ -620,6 +1359,20 @@ void Heat::SwitchOffAll()
 	}
 }
 
+bool Heat::AnyHeaterActive()
+{
+	ReadLocker lock(heatersLock);
+
+	for (const Heater * const h : heaters)
+	{
+		if (h != nullptr && h->GetMode() != HeaterMode::off)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void Heat::ResetFault(int heater)
 {
 	const auto h = FindHeater(heater);
@@ -637,24 +1390,25 @@ GCodeResult Heat::SetTemperature(const CanMessageSetHeaterTemperature& msg, cons
 
 GCodeResult Heat::TuningCommand(const CanMessageHeaterTuningCommand& msg, const StringRef& reply)
 {
-	if (heaterBeingTuned != -1 && heaterBeingTuned != (int)msg.heaterNumber)
-	{
-		reply.printf("Heater %d is already being tuned", heaterBeingTuned);
-		return GCodeResult::error;
-	}
 	const auto h = FindHeater(msg.heaterNumber);
 	if (h.IsNull())
 	{
 		return UnknownHeater(msg.heaterNumber, reply);
 	}
-	heaterBeingTuned = (int)msg.heaterNumber;			// setting this is OK even if we are stopping or fail to start tuning, because we check it in the heater task loop
 	return h->TuningCommand(msg, reply);
 }
 
+// The heaterFeedForward message doesn't say when the change happens, so we treat it as happening now
 GCodeResult Heat::FeedForward(const CanMessageHeaterFeedForward& msg, const StringRef& reply)
 {
-	const auto h = FindHeater(msg.heaterNumber);
-	return (h.IsNull()) ? UnknownHeater(msg.heaterNumber, reply) : h->FeedForwardAdjustment(msg.fanPwmAdjustment, msg.extrusionAdjustment);
+	return FeedForward(msg.heaterNumber, msg.fanPwmAdjustment, msg.extrusionAdjustment, StepTimer::GetMasterTime(), reply);
+}
+
+// Adjust the heater power for a fan PWM or extrusion rate change that happens at the specified master time
+GCodeResult Heat::FeedForward(unsigned int heater, float fanPwmChange, float extrusionChange, uint32_t whenEffective, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	return (h.IsNull()) ? UnknownHeater(heater, reply) : h->FeedForwardAdjustment(fanPwmChange, extrusionChange, whenEffective);
 }
 
 float Heat::GetAveragePWM(size_t heater)
@@ -667,15 +1421,7 @@ float Heat::GetAveragePWM(size_t heater)
 ReadLockedPointer<TemperatureSensor> Heat::FindSensor(int sn)
 {
 	ReadLocker locker(sensorsLock);
-
-	for (TemperatureSensor *sensor = sensorsRoot; sensor != nullptr; sensor = sensor->GetNext())
-	{
-		if ((int)sensor->GetSensorNumber() == sn)
-		{
-			return ReadLockedPointer<TemperatureSensor>(locker, sensor);
-		}
-	}
-	return ReadLockedPointer<TemperatureSensor>(locker, nullptr);
+	return ReadLockedPointer<TemperatureSensor>(locker, (sn >= 0 && sn < (int)MaxSensors) ? sensorsByNumber[sn] : nullptr);
 }
 
 // Get a pointer to the first temperature sensor with the specified or higher number
@@ -683,11 +1429,11 @@ ReadLockedPointer<TemperatureSensor> Heat::FindSensorAtOrAbove(unsigned int sn)
 {
 	ReadLocker locker(sensorsLock);
 
-	for (TemperatureSensor *sensor = sensorsRoot; sensor != nullptr; sensor = sensor->GetNext())
+	for (; sn < MaxSensors; ++sn)
 	{
-		if (sensor->GetSensorNumber() >= sn)
+		if (sensorsByNumber[sn] != nullptr)
 		{
-			return ReadLockedPointer<TemperatureSensor>(locker, sensor);
+			return ReadLockedPointer<TemperatureSensor>(locker, sensorsByNumber[sn]);
 		}
 	}
 	return ReadLockedPointer<TemperatureSensor>(locker, nullptr);
@@ -707,9 +1453,27 @@ void Heat::SuspendHeaters(bool sus)
 
 void Heat::Diagnostics(const StringRef& reply)
 {
-	reply.lcatf("Last sensors broadcast 0x%08" PRIx64 " found %u %" PRIu32 " ticks ago, %u ordering errs, loop time %" PRIu32,
-					lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen, sensorOrderingErrors, heatTaskLoopTime);
+	reply.lcatf("Last sensors broadcast 0x%08" PRIx64 " found %u %" PRIu32 " ticks ago, %u ordering errs, loop time %" PRIu32 ", publish time %" PRIu32,
+					lastSensorsBroadcastWhich, lastSensorsFound, millis() - lastSensorsBroadcastWhen, sensorOrderingErrors, heatTaskLoopTime, publishTaskLoopTime);
 	sensorOrderingErrors = 0;
+#if SUPPORT_SPI_SENSORS
+	reply.catf(", sensor task loop time %" PRIu32, sensorPollTaskLoopTime);
+#endif
+	reply.lcatf("Safety monitor loop time %" PRIu32 ", trips %u, heat task stalls %u", safetyMonitorLoopTime, safetyTrips, heatTaskStalls);
+	reply.lcatf("Heater spins on new sensor data %" PRIu32, eventDrivenSpins);
+	eventDrivenSpins = 0;
+	reply.lcatf("Remote sensors cached %u, cache misses %u", numCachedRemoteSensors, remoteSensorCacheMisses);
+	remoteSensorCacheMisses = 0;
+	if (heaterPowerBudget > 0.0)
+	{
+		reply.lcatf("Heater power budget %.0fW, allocated %.0fW, times limited %" PRIu32, (double)heaterPowerBudget, (double)heaterPowerAllocated, powerBudgetLimitedCount);
+		powerBudgetLimitedCount = 0;
+	}
+	reply.lcatf("Status reports (min/max interval, sent, suppressed):");
+	for (size_t i = 0; i < NumStatusReportClasses; ++i)
+	{
+		statusReports[i].Report(reply, StatusReportNames[i]);
+	}
 #if 0	// temporary to debug a board that reports bad Vssa
 	reply.catf(", Vref %u Vssa %u",
 		(unsigned int)(Platform::GetVrefFilter(0)->GetSum()/ThermistorAveragingFilter::NumAveraged()),
@@ -717,16 +1481,90 @@ void Heat::Diagnostics(const StringRef& reply)
 #endif
 }
 
+// Report the heat task counters for the compact diagnostics record, resetting them in the same way as Diagnostics does unless it is a telemetry record
+void Heat::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
+{
+	rec.Set(DiagnosticsField::heatSensorOrderingErrors, sensorOrderingErrors);
+	rec.Set(DiagnosticsField::heatTaskLoopTime, heatTaskLoopTime);
+	rec.Set(DiagnosticsField::heatRemoteSensorCacheMisses, remoteSensorCacheMisses);
+	if (rec.ResetCounters())
+	{
+		sensorOrderingErrors = 0;
+		remoteSensorCacheMisses = 0;
+	}
+}
+
+// Set the total power that the heaters on this board may draw, in watts, or 0 for no limit
+GCodeResult Heat::SetPowerBudget(uint32_t watts, const StringRef& reply) noexcept
+{
+	heaterPowerBudget = (float)watts;
+	if (watts == 0)
+	{
+		reply.copy("Heater power budget disabled");
+	}
+	else
+	{
+		reply.printf("Heater power budget %" PRIu32 "W", watts);
+	}
+	return GCodeResult::ok;
+}
+
+// Set the power that a heater draws at full PWM and its priority for the power budget. A power of 0 leaves the heater out of the budget.
+GCodeResult Heat::SetHeaterPower(unsigned int heater, uint32_t watts, uint32_t priority, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	if (h.IsNull())
+	{
+		return UnknownHeater(heater, reply);
+	}
+	if (priority > 255)
+	{
+		reply.copy("Priority must be 0 to 255");
+		return GCodeResult::error;
+	}
+	h->SetRatedPower((float)watts, (uint8_t)priority);
+	reply.printf("Heater %u power %" PRIu32 "W, priority %" PRIu32, heater, watts, priority);
+	return GCodeResult::ok;
+}
+
+// Set whether a heater is spun when its sensor has new data, instead of on a fixed schedule. The sensor broadcasts keep their own schedule.
+GCodeResult Heat::SetHeaterSpinOnNewReading(unsigned int heater, bool enable, const StringRef& reply) noexcept
+{
+	const auto h = FindHeater(heater);
+	if (h.IsNull())
+	{
+		return UnknownHeater(heater, reply);
+	}
+	h->SetSpinOnNewReading(enable);
+	UpdateHeaterEventSensors();
+	reply.printf("Heater %u spins %s", heater, (enable) ? "when its sensor has new data" : "at fixed intervals");
+	return GCodeResult::ok;
+}
+
+// Set the minimum interval between one class of status reports
+GCodeResult Heat::SetStatusReportInterval(unsigned int reportClass, uint32_t interval, const StringRef& reply) noexcept
+{
+	if (reportClass >= NumStatusReportClasses)
+	{
+		reply.copy("Bad status report class");
+		return GCodeResult::error;
+	}
+	statusReports[reportClass].SetMinInterval(interval);
+	statusReports[reportClass].ForceNextReport();
+	reply.printf("Minimum %s report interval %" PRIu32 "ms", StatusReportNames[reportClass], statusReports[reportClass].GetMinInterval());
+	return GCodeResult::ok;
+}
+
 void Heat::NewDriverFault()
 {
 	newDriverFaultState = 1;
-	heaterTask->Give();
+	publishTask->Give();
 }
 
 void Heat::NewHeaterFault()
 {
 	newHeaterFaultState = 1;
-	heaterTask->Give();
+	publishTask->Give();
 }
 
 // End
@@ -24,6 +24,11 @@ namespace Heat
 {
 	// Methods that don't relate to a particular heater
 	[[noreturn]] void TaskLoop(void *);
+	[[noreturn]] void PublishTaskLoop(void *);
+#if SUPPORT_SPI_SENSORS
+	[[noreturn]] void SensorPollTaskLoop(void *);
+#endif
+	[[noreturn]] void SafetyMonitorTaskLoop(void *);
 	void Init();												// Set everything up
 	void Exit();												// Shut everything down
 
@@ -34,11 +39,20 @@ namespace Heat
 	GCodeResult SetHeaterMonitors(const CanMessageSetHeaterMonitors& msg, const StringRef& reply);
 
 	void SwitchOffAll();										// Turn all heaters off
+	void EmergencyStop(uint32_t whenTriggered) noexcept;		// Get the safety monitor to turn all heaters off now, may be called from an ISR
+	bool GetEmergencyStopLatency(uint32_t& ticks) noexcept;		// If the heaters have been turned off by an emergency stop, get how long it took in step clocks and return true
+	bool AnyHeaterActive();										// Return true if any heater is on or being tuned
 	void ResetFault(int heater);								// Reset a heater fault - only call this if you know what you are doing
 
 	// Methods that relate to sensors
 	float GetSensorTemperature(int sensorNum, TemperatureError& err) noexcept;	// Result is in degrees Celsius
+	uint32_t GetSensorLatency(int sensorNum) noexcept;							// Get the estimated age in milliseconds of the last reading, which is significant for sensors on other boards
+	TemperatureError GetFastSensorTemperature(int sensorNum, float& t) noexcept;	// Get the temperature for the safety monitor, bypassing the Heat task if the sensor supports it
 	void ProcessRemoteSensorsReport(CanAddress src, const CanMessageSensorTemperatures& msg) noexcept;
+	void SetSensorListeners(SensorsBitmap sensors) noexcept;	// set which sensors thermostatic fans follow
+	void NewSensorReading(unsigned int sensorNum) noexcept;		// called when a sensor has a new reading
+	void SensorDataReady(unsigned int sensorNum) noexcept;		// called when a sensor has new data, possibly from an ISR
+	SensorsBitmap TakeNewSensorReadings() noexcept;				// return and clear the followed sensors that have new readings
 
 	// Methods that relate to a particular heater
 	float GetHighestTemperatureLimit(int heater) noexcept;
@@ -46,6 +60,7 @@ namespace Heat
 	GCodeResult SetTemperature(const CanMessageSetHeaterTemperature& msg, const StringRef& reply);
 	GCodeResult TuningCommand(const CanMessageHeaterTuningCommand& msg, const StringRef& reply);
 	GCodeResult FeedForward(const CanMessageHeaterFeedForward& msg, const StringRef& reply);
+	GCodeResult FeedForward(unsigned int heater, float fanPwmChange, float extrusionChange, uint32_t whenEffective, const StringRef& reply) noexcept;	// whenEffective is in master step clocks
 
 	float GetAveragePWM(size_t heater)							// Return the running average PWM to the heater as a fraction in [0, 1].
 	pre(heater < NumTotalHeaters);
@@ -65,6 +80,11 @@ namespace Heat
 	inline bool IsBedOrChamberHeater(int heater) { return false; }
 
 	void Diagnostics(const StringRef& reply);
+	void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;
+	GCodeResult SetStatusReportInterval(unsigned int reportClass, uint32_t interval, const StringRef& reply) noexcept;
+	GCodeResult SetPowerBudget(uint32_t watts, const StringRef& reply) noexcept;
+	GCodeResult SetHeaterPower(unsigned int heater, uint32_t watts, uint32_t priority, const StringRef& reply) noexcept;
+	GCodeResult SetHeaterSpinOnNewReading(unsigned int heater, bool enable, const StringRef& reply) noexcept;
 
 	void NewDriverFault();
 	void NewHeaterFault();
@@ -10,11 +10,23 @@
 #include "Heat.h"
 #include "Sensors/TemperatureSensor.h"
 
+// We aim to take this many temperature samples during the dead time, within the following limits
+constexpr float SamplesPerDeadTime = 20.0;
+constexpr uint32_t MinHeaterSampleInterval = 100;
+constexpr uint32_t MaxHeaterSampleInterval = 1000;
+
 Heater::Heater(unsigned int num)
 	: heaterNumber(num), sensorNumber(-1), requestedTemperature(0.0),
 	  maxTempExcursion(DefaultMaxTempExcursion), maxHeatingFaultTime(DefaultMaxHeatingFaultTime),
-	  isBedOrChamber(false)
+	  whenSpinDue(0), sampleInterval(HeatSampleIntervalMillis), ratedPower(0.0), pwmLimit(1.0), powerPriority(0), whenDitherDue(0), ditherInterval(0), isBedOrChamber(false), spinOnNewReading(false)
+{
+}
+
+// Set the time at which the heater should next be spun. If we have fallen more than one interval behind then resynchronise instead of trying to catch up.
+void Heater::ScheduleNextSpin(uint32_t now) noexcept
 {
+	const uint32_t interval = GetSampleInterval();
+	whenSpinDue = (now - whenSpinDue >= interval) ? now + interval : whenSpinDue + interval;
 }
 
 Heater::~Heater()
@@ -43,6 +55,7 @@ GCodeResult Heater::SetModel(unsigned int heater, const CanMessageHeaterModelNew
 	const bool rslt = model.SetParameters(msg, temperatureLimit);
 	if (rslt)
 	{
+		sampleInterval = constrain<uint32_t>(lrintf(model.GetDeadTime() * SecondsToMillis/SamplesPerDeadTime), MinHeaterSampleInterval, MaxHeaterSampleInterval);
 		if (model.IsEnabled())
 		{
 			return UpdateModel(reply);
@@ -20,6 +20,7 @@ class CanMessageSetHeaterTemperature;
 class CanMessageHeaterModelNewNew;
 class CanMessageSetHeaterMonitors;
 class CanMessageHeaterTuningCommand;
+class CanMessageHeaterTuningReport;
 
 class Heater
 {
@@ -40,7 +41,17 @@ public:
 	virtual void Suspend(bool sus) = 0;							// Suspend the heater to conserve power or while doing Z probing
 	virtual float GetAccumulator() const = 0;					// get the inertial term accumulator
 	virtual GCodeResult TuningCommand(const CanMessageHeaterTuningCommand& msg, const StringRef& reply) = 0;
-	virtual GCodeResult FeedForwardAdjustment(float fanPwmChange, float extrusionChange) = 0;
+	virtual GCodeResult FeedForwardAdjustment(float fanPwmChange, float extrusionChange, uint32_t whenEffective) = 0;	// whenEffective is the master step clock time at which the change happens
+	virtual GCodeResult SetPredictiveControl(bool on, const StringRef& reply) noexcept = 0;	// Select model predictive control instead of PID
+	virtual bool GetTuningCycleData(CanMessageHeaterTuningReport& msg) noexcept = 0;			// Get a heater tuning cycle report, if we have one
+	virtual bool HasTuningConverged() const noexcept = 0;										// Return true if more tuning cycles would not improve the model
+	virtual GCodeResult SetPwmDither(unsigned int steps, const StringRef& reply) noexcept = 0;	// Dither the PWM to a resolution of 1/steps over successive PWM periods, 0 to disable
+	virtual void DitherPwm() noexcept = 0;														// Output the next dithered PWM value
+	virtual float GetRequestedPwm() const noexcept = 0;											// Get the PWM that the controller wants, before applying the power limit
+	virtual float GetHoldingPwm() const noexcept = 0;											// Get the PWM that the model says we need to hold the target temperature
+	virtual bool IsPowerLimited() const noexcept = 0;											// Return true if the power budget applies to this heater
+	virtual void ApplyPwmLimit() noexcept = 0;													// Reduce the PWM now if it exceeds the limit
+	virtual bool SafetyCheck(uint32_t now, bool heatTaskStalled) noexcept = 0;					// Called by the safety monitor task, returns true if it has just tripped the heater
 
 	GCodeResult SetTemperature(const CanMessageSetHeaterTemperature& msg, const StringRef& reply);
 
@@ -64,6 +75,31 @@ public:
 
 	bool IsTuning() const { return GetMode() >= HeaterMode::firstTuningMode; }
 	uint8_t GetModeByte() const { return (uint8_t)GetMode(); }
+	int GetSensorNumber() const noexcept { return sensorNumber; }
+
+	// Scheduling. Each heater is spun at an interval that depends on how quickly it responds, except that we use the standard interval while tuning.
+	// A heater that spins on new readings is spun when its sensor has fresh data within a quarter of an interval either side of when it is due,
+	// so that the PID acts on data that is as recent as possible. If no fresh data arrives in that window then it is spun at the end of the window.
+	uint32_t GetSampleInterval() const noexcept { return (IsTuning()) ? HeatSampleIntervalMillis : sampleInterval; }
+	bool IsSpinDue(uint32_t now) const noexcept { return (int32_t)(now - WhenSpinDue()) >= 0; }
+	bool IsSpinDueOnNewReading(uint32_t now) const noexcept { return spinOnNewReading && (int32_t)(now - (whenSpinDue - GetSampleInterval()/4)) >= 0; }
+	uint32_t WhenSpinDue() const noexcept { return (spinOnNewReading) ? whenSpinDue + GetSampleInterval()/4 : whenSpinDue; }
+	void ScheduleNextSpin(uint32_t now) noexcept;
+	bool GetSpinOnNewReading() const noexcept { return spinOnNewReading; }
+	void SetSpinOnNewReading(bool b) noexcept { spinOnNewReading = b; }
+
+	// Power budgeting. The heat task shares the board power budget among the heaters by setting a PWM limit for each one.
+	float GetRatedPower() const noexcept { return ratedPower; }
+	uint8_t GetPowerPriority() const noexcept { return powerPriority; }
+	void SetRatedPower(float watts, uint8_t priority) noexcept { ratedPower = watts; powerPriority = priority; }
+	float GetPwmLimit() const noexcept { return pwmLimit; }
+	void SetPwmLimit(float limit) noexcept { pwmLimit = limit; }
+
+	// Dither scheduling. A heater that dithers its PWM updates it once per PWM period.
+	bool IsDithering() const noexcept { return ditherInterval != 0; }
+	bool IsDitherDue(uint32_t now) const noexcept { return (int32_t)(now - whenDitherDue) >= 0; }
+	uint32_t WhenDitherDue() const noexcept { return whenDitherDue; }
+	void ScheduleNextDither(uint32_t now) noexcept { whenDitherDue = (now - whenDitherDue >= ditherInterval) ? now + ditherInterval : whenDitherDue + ditherInterval; }
 
 protected:
 	virtual void ResetHeater() noexcept = 0;
@@ -71,12 +107,12 @@ protected:
 	virtual GCodeResult SwitchOn(const StringRef& reply) noexcept = 0;
 	virtual GCodeResult UpdateModel(const StringRef& reply) noexcept = 0;
 
-	int GetSensorNumber() const noexcept { return sensorNumber; }
 	void SetSensorNumber(int sn) noexcept { sensorNumber = sn; }
 	float GetMaxTemperatureExcursion() const noexcept { return maxTempExcursion; }
 	float GetMaxHeatingFaultTime() const noexcept { return maxHeatingFaultTime; }
 	float GetTargetTemperature() const noexcept { return requestedTemperature; }
 	bool IsBedOrChamber() const noexcept { return isBedOrChamber; }
+	void SetDitherInterval(uint16_t interval) noexcept { ditherInterval = interval; }
 
 	HeaterMonitor monitors[MaxMonitorsPerHeater];	// embedding them in the Heater uses less memory than dynamic allocation
 
@@ -88,7 +124,15 @@ private:
 	float requestedTemperature;						// the required temperature
 	float maxTempExcursion;							// the maximum temperature excursion permitted while maintaining the setpoint
 	float maxHeatingFaultTime;						// how long a heater fault is permitted to persist before a heater fault is raised
+	uint32_t whenSpinDue;							// the millis() time at which Spin should next be called
+	uint16_t sampleInterval;						// the interval in milliseconds between calls to Spin, derived from the dead time
+	float ratedPower;								// the power in watts that the heater draws at full PWM, or 0 if it is not included in the power budget
+	float pwmLimit;									// the highest PWM that the power budget allows
+	uint8_t powerPriority;							// heaters with higher priority get their share of the power budget first
+	uint32_t whenDitherDue;							// the millis() time at which DitherPwm should next be called
+	uint16_t ditherInterval;						// the interval in milliseconds between calls to DitherPwm, or 0 if the PWM is not dithered
 	bool isBedOrChamber;							// true if this was a bed or chamber heater when it was switched on
+	bool spinOnNewReading;							// true if the Heat task should spin this heater when its sensor has new data instead of on a fixed schedule
 };
 
 #endif /* SRC_HEATING_HEATER_H_ */
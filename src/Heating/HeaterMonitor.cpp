@@ -8,6 +8,7 @@
 #include "HeaterMonitor.h"
 
 #include <Platform.h>
+#include <DeferredLog.h>
 #include "Heat.h"
 
 HeaterMonitor::HeaterMonitor() noexcept
@@ -28,7 +29,7 @@ bool HeaterMonitor::Check() noexcept
 			badTemperatureCount++;
 			if (badTemperatureCount > MaxBadTemperatureCount)
 			{
-				debugPrintf("Temperature reading error on sensor %d\n", sensorNumber);
+				logPrintf("Temperature reading error on sensor %d\n", sensorNumber);
 				return false;
 			}
 		}
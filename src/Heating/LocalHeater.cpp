@@ -11,39 +11,106 @@
 #include <CanMessageBuffer.h>
 #include <CanMessageGenericParser.h>
 #include <CAN/CanInterface.h>
+#include <Movement/StepTimer.h>
 #include <General/SafeVsnprintf.h>
 
 // Private constants
 const uint32_t InitialTuningReadingInterval = 250;	// the initial reading interval in milliseconds
 const uint32_t TempSettleTimeout = 20000;	// how long we allow the initial temperature to settle
+const float PredictiveHorizonDeadTimes = 1.5;		// the model predictive control horizon in units of the dead time
+const float LoadEstimateTimeConstantDeadTimes = 4.0;	// the time constant of the load estimator in units of the dead time
+const float ResidualBiasTimeConstantDeadTimes = 10.0;	// how quickly the model residual detector adapts to steady errors in the model
+const float ResidualVarianceTimeConstant = 30.0;		// the time constant in seconds of the model residual noise estimate
+const float MinResidualSigma = 0.05;					// the minimum residual noise level we assume, in degC
+const float ResidualAllowanceSigmas = 3.0;				// residuals smaller than this many standard deviations are treated as noise
+const float ResidualOutlierSigmas = 5.0;				// residuals larger than this are not used to update the noise estimate
+const float ResidualFaultExcursionFraction = 0.5;		// the accumulated residual that raises a fault, as a fraction of the permitted temperature excursion
+const float MinResidualFaultThreshold = 2.0;			// the minimum accumulated residual that raises a fault, in degC
+const uint32_t MaxCompensatedLatencyMillis = 1000;	// the largest sensor reading age that we compensate for, in milliseconds
+const float MaxFeedForwardLeadMillis = 10000.0;		// the furthest ahead that we accept a timed feedforward adjustment, in milliseconds
+const uint32_t SafetyBadReadingMillis = 1000;			// how long the safety monitor allows the sensor to give bad readings before it switches the heater off
+const unsigned int SafetyOverTemperatureReadings = 2;	// how many successive readings above the temperature limit switch the heater off
+const float SafetyRunawayPwmFraction = 0.9;			// the safety monitor checks for thermal runaway when the PWM is at least this fraction of the maximum
+const float MinSafetyRunawayCheckTime = 10.0;			// the minimum time in seconds over which the safety monitor checks the temperature rise
 
-// Variables used during heater tuning
-static float tuningPwm;									// the PWM to use, 0..1
-static float tuningHighTemp;							// the target upper temperature
-static float tuningLowTemp;								// the target lower temperature
-static float tuningPeakTempDrop;						// must be well below TuningHysteresis
-
-static uint32_t dHigh;
-static uint32_t dLow;
-static uint32_t tOn;
-static uint32_t tOff;
-static float heatingRate;
-static float coolingRate;
-static uint32_t lastOffTime;
-static uint32_t lastOnTime;
-static float peakTemp;									// max or min temperature
-static uint32_t peakTime;								// the time at which we recorded peakTemp
-static float afterPeakTemp;								// temperature after max from which we start timing the cooling rate
-static uint32_t afterPeakTime;							// the time at which we recorded afterPeakTemp
-static float tuningVoltage;								// the VIN voltage with the heater on
-
-static uint16_t cyclesDone;
-static bool tuningCycleComplete;
+const unsigned int MinTuningCyclesForConvergence = 3;	// the minimum number of tuning cycles before we consider that the estimates have converged
+const float TuningConvergedRelativeError = 0.03;		// the estimates have converged when their 95% confidence intervals are within this fraction of their means
+
+// Class to accumulate the mean and variance of a parameter measured once per tuning cycle, using Welford's algorithm
+class TuningStatistic
+{
+public:
+	void Reset() noexcept { count = 0; mean = m2 = 0.0; }
+
+	void Add(float x) noexcept
+	{
+		++count;
+		const float delta = x - mean;
+		mean += delta/(float)count;
+		m2 += delta * (x - mean);
+	}
+
+	float GetMean() const noexcept { return mean; }
+
+	// Return the half width of the 95% confidence interval for the mean, using Student's t distribution
+	float GetConfidenceHalfWidth() const noexcept
+	{
+		static constexpr float TValues[] = { 12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36, 2.31, 2.26 };	// two-tailed 95% values for 1 to 9 degrees of freedom
+		if (count < 2)
+		{
+			return INFINITY;
+		}
+		const float t = (count - 1 <= ARRAY_SIZE(TValues)) ? TValues[count - 2] : 2.0;
+		return t * sqrtf(m2/((float)(count - 1) * (float)count));
+	}
+
+	bool HasConverged() const noexcept
+	{
+		return count >= MinTuningCyclesForConvergence && GetConfidenceHalfWidth() <= fabsf(mean) * TuningConvergedRelativeError;
+	}
+
+	unsigned int GetCount() const noexcept { return count; }
+
+private:
+	unsigned int count;
+	float mean;
+	float m2;											// sum of squares of differences from the mean
+};
+
+// Data used during heater tuning. This is allocated the first time a heater is tuned, so that several heaters can be tuned at the same time.
+struct LocalHeater::TuningData
+{
+	float pwm;											// the PWM to use, 0..1
+	float highTemp;										// the target upper temperature
+	float lowTemp;										// the target lower temperature
+	float peakTempDrop;									// must be well below TuningHysteresis
+
+	uint32_t dHigh;
+	uint32_t dLow;
+	uint32_t tOn;
+	uint32_t tOff;
+	float heatingRate;
+	float coolingRate;
+	uint32_t lastOffTime;
+	uint32_t lastOnTime;
+	float peakTemp;										// max or min temperature
+	uint32_t peakTime;									// the time at which we recorded peakTemp
+	float afterPeakTemp;								// temperature after max from which we start timing the cooling rate
+	uint32_t afterPeakTime;								// the time at which we recorded afterPeakTemp
+	float voltage;										// the VIN voltage with the heater on
+
+	// Statistics of the parameters measured in each cycle, so that we can tell when more cycles won't improve the model
+	TuningStatistic heatingRateStats, coolingRateStats, deadTimeStats;
+
+	uint16_t cyclesDone;
+	bool cycleComplete;
+};
 
 // Member functions and constructors
 
-LocalHeater::LocalHeater(unsigned int heaterNum) : Heater(heaterNum), mode(HeaterMode::off)
+LocalHeater::LocalHeater(unsigned int heaterNum) : Heater(heaterNum), tuning(nullptr), ditherPower(0.0), ditherError(0.0), ditherSteps(0), usePredictiveControl(false), mode(HeaterMode::off)
 {
+	sensorLatency = 0;
 	LocalHeater::ResetHeater();
 	SetHeater(0.0);							// set up the pin even if the heater is not enabled (for PCCB)
 
@@ -59,6 +126,7 @@ LocalHeater::~LocalHeater()
 	{
 		port.Release();
 	}
+	delete tuning;
 }
 
 float LocalHeater::GetTemperature() const
@@ -71,7 +139,24 @@ float LocalHeater::GetAccumulator() const
 	return iAccumulator;
 }
 
-void LocalHeater::SetHeater(float power) const
+void LocalHeater::SetHeater(float power)
+{
+	if (safetyTrip != SafetyTrip::none)
+	{
+		power = 0.0;								// the safety monitor has switched the heater off
+	}
+	ditherPower = power;
+	if (ditherSteps == 0)
+	{
+		SetPorts(power);
+	}
+	else
+	{
+		DitherPwm();								// output the new value straight away, in particular so that turning the heater off takes effect at once
+	}
+}
+
+void LocalHeater::SetPorts(float power) const
 {
 	for (auto& port : ports)
 	{
@@ -79,6 +164,62 @@ void LocalHeater::SetHeater(float power) const
 	}
 }
 
+// Output the next dithered PWM value. This is first order sigma-delta modulation: we output the whole number of dither steps nearest to the requested PWM
+// plus the accumulated error, so successive PWM periods alternate between the two steps either side of the requested value and the average is correct.
+void LocalHeater::DitherPwm() noexcept
+{
+	const float power = (safetyTrip == SafetyTrip::none) ? ditherPower : 0.0;
+	if (power <= 0.0 || power >= 1.0)
+	{
+		ditherError = 0.0;
+		SetPorts(constrain<float>(power, 0.0, 1.0));
+	}
+	else
+	{
+		const float wanted = power * (float)ditherSteps + ditherError;
+		const float level = constrain<float>(floorf(wanted + 0.5), 0.0, (float)ditherSteps);
+		ditherError = wanted - level;
+		SetPorts(level/(float)ditherSteps);
+	}
+}
+
+// Get the PWM that the model says we need to hold the target temperature, for the power budget
+float LocalHeater::GetHoldingPwm() const noexcept
+{
+	return (mode <= HeaterMode::suspended) ? 0.0
+			: min<float>(GetModel().EstimateRequiredPwm(max<float>(GetTargetTemperature() - NormalAmbientTemperature, 0.0), fanPwm), requestedPwm);
+}
+
+// Reduce the PWM straight away if the power budget has cut our limit, instead of waiting for the next call to Spin
+void LocalHeater::ApplyPwmLimit() noexcept
+{
+	if (IsPowerLimited() && lastPwm > GetPwmLimit())
+	{
+		lastPwm = GetPwmLimit();
+		SetHeater(lastPwm);
+	}
+}
+
+// Set the dither interval to the PWM period, rounded up to a whole number of milliseconds
+void LocalHeater::UpdateDitherInterval() noexcept
+{
+	const PwmFrequency freq = ports[0].GetFrequency();
+	SetDitherInterval((ditherSteps == 0) ? 0 : (freq == 0) ? 1000 : max<uint16_t>((1000 + freq - 1)/freq, 1));
+}
+
+GCodeResult LocalHeater::SetPwmDither(unsigned int steps, const StringRef& reply) noexcept
+{
+	if (steps == 1 || steps > MaxPwmDitherSteps)
+	{
+		reply.printf("Dither resolution must be 0 or 2 to %u", MaxPwmDitherSteps);
+		return GCodeResult::error;
+	}
+	ditherError = 0.0;
+	ditherSteps = steps;
+	UpdateDitherInterval();
+	return GCodeResult::ok;
+}
+
 void LocalHeater::ResetHeater()
 {
 	mode = HeaterMode::off;
@@ -86,9 +227,26 @@ void LocalHeater::ResetHeater()
 	previousTemperatureIndex = 0;
 	iAccumulator = 0.0;
 	badTemperatureCount = 0;
-	averagePWM = lastPwm = 0.0;
+	averagePWM = lastPwm = requestedPwm = 0.0;
 	heatingFaultCount = 0;
 	temperature = BadErrorTemperature;
+	fanPwm = extrusionRate = 0.0;
+	extrusionLoadCoefficient = 0.0;
+	numPendingFeedForwards = 0;
+	memset(pwmHistory, 0, sizeof(pwmHistory));
+	pwmHistoryIndex = 0;
+	ResetPredictor();
+	safetyTrip = SafetyTrip::none;
+	ResetSafetyMonitor();
+}
+
+void LocalHeater::ResetPredictor() noexcept
+{
+	loadEstimate = 0.0;
+	predictorPrimed = false;
+	residualBias = residualLowSum = residualHighSum = 0.0;
+	residualVariance = fsquare(MinResidualSigma);
+	residualPrimed = false;
 }
 
 // Configure the heater port and the sensor number
@@ -121,6 +279,7 @@ GCodeResult LocalHeater::ConfigurePortAndSensor(const char *portName, PwmFrequen
 	{
 		port.SetFrequency(freq);
 	}
+	UpdateDitherInterval();
 	SetSensorNumber(sn);
 	if (Heat::FindSensor(sn).IsNull())
 	{
@@ -142,6 +301,7 @@ GCodeResult LocalHeater::SetPwmFrequency(PwmFrequency freq, const StringRef& rep
 	{
 		port.SetFrequency(freq);
 	}
+	UpdateDitherInterval();
 	return GCodeResult::ok;
 }
 
@@ -159,6 +319,10 @@ GCodeResult LocalHeater::ReportDetails(const StringRef& reply) const
 	}
 
 	ports[0].AppendFrequency(reply);
+	if (ditherSteps != 0)
+	{
+		reply.catf(", PWM dithered to 1/%u", ditherSteps);
+	}
 
 	if (GetSensorNumber() >= 0)
 	{
@@ -168,6 +332,41 @@ GCodeResult LocalHeater::ReportDetails(const StringRef& reply) const
 	{
 		reply.cat(", no sensor");
 	}
+	reply.catf(", sample interval %" PRIu32 "ms", GetSampleInterval());
+	if (sensorLatency != 0)
+	{
+		reply.catf(", compensating for %" PRIu32 "ms sensor latency", sensorLatency);
+	}
+	if (GetSpinOnNewReading())
+	{
+		reply.cat(" on new sensor data");
+	}
+	if (usePredictiveControl)
+	{
+		reply.catf(", predictive control, load %.2f" DEGREE_SYMBOL "C/sec + %.3f per unit extrusion", (double)loadEstimate, (double)extrusionLoadCoefficient);
+	}
+	if (tuning != nullptr && tuning->heatingRateStats.GetCount() != 0)
+	{
+		// Report the tuning estimates with their 95% confidence intervals
+		reply.catf(", tuning cycles %u heating rate %.3f+/-%.3f cooling rate %.3f+/-%.3f dead time %.2f+/-%.2f%s",
+					tuning->cyclesDone,
+					(double)tuning->heatingRateStats.GetMean(), (double)tuning->heatingRateStats.GetConfidenceHalfWidth(),
+					(double)tuning->coolingRateStats.GetMean(), (double)tuning->coolingRateStats.GetConfidenceHalfWidth(),
+					(double)tuning->deadTimeStats.GetMean(), (double)tuning->deadTimeStats.GetConfidenceHalfWidth(),
+					(HasTuningConverged()) ? " (converged)" : "");
+	}
+	reply.catf(", model residual noise %.2f" DEGREE_SYMBOL "C bias %.2f" DEGREE_SYMBOL "C/sec", (double)sqrtf(residualVariance), (double)residualBias);
+	return GCodeResult::ok;
+}
+
+GCodeResult LocalHeater::SetPredictiveControl(bool on, const StringRef& reply) noexcept
+{
+	if (on != usePredictiveControl)
+	{
+		TaskCriticalSectionLocker lock;
+		ResetPredictor();
+		usePredictiveControl = on;
+	}
 	return GCodeResult::ok;
 }
 
@@ -176,6 +375,7 @@ TemperatureError LocalHeater::ReadTemperature()
 {
 	TemperatureError err;
 	temperature = Heat::GetSensorTemperature(GetSensorNumber(), err);		// in the event of an error, err is set and BAD_ERROR_TEMPERATURE is returned
+	sensorLatency = (err == TemperatureError::success) ? min<uint32_t>(Heat::GetSensorLatency(GetSensorNumber()), MaxCompensatedLatencyMillis) : 0;
 	return err;
 }
 
@@ -216,7 +416,7 @@ GCodeResult LocalHeater::SwitchOn(const StringRef& reply) noexcept
 // Switch off the specified heater. If in tuning mode, delete the array used to store tuning temperature readings.
 void LocalHeater::SwitchOff()
 {
-	lastPwm = 0.0;
+	lastPwm = requestedPwm = 0.0;
 	if (GetModel().IsEnabled())
 	{
 		SetHeater(0.0);
@@ -230,14 +430,22 @@ void LocalHeater::SwitchOff()
 // This is called when the heater model has been updated. Returns true if successful.
 GCodeResult LocalHeater::UpdateModel(const StringRef& reply)
 {
+	ResetPredictor();
 	return GCodeResult::ok;
 }
 
 // This is the main heater control loop function
 void LocalHeater::Spin()
 {
+	if (safetyTrip != SafetyTrip::none && mode != HeaterMode::fault)
+	{
+		RaiseSafetyFault();
+	}
+
 	// Read the temperature even if the heater is suspended or the model is not enabled
 	const TemperatureError err = ReadTemperature();
+	const uint32_t sampleInterval = GetSampleInterval();
+	ApplyDueFeedForwards(millis());
 
 	// Handle any temperature reading error and calculate the temperature rate of change, if possible
 	if (err != TemperatureError::success)
@@ -262,7 +470,7 @@ void LocalHeater::Spin()
 		badTemperatureCount = 0;
 		if ((previousTemperaturesGood & (1u << (NumPreviousTemperatures - 1))) != 0)
 		{
-			const float tentativeDerivative = ((float)SecondsToMillis/HeatSampleIntervalMillis) * (temperature - previousTemperatures[previousTemperatureIndex])
+			const float tentativeDerivative = ((float)SecondsToMillis/(float)sampleInterval) * (temperature - previousTemperatures[previousTemperatureIndex])
 							/ (float)(NumPreviousTemperatures);
 			// Some sensors give occasional temperature spikes. We don't expect the temperature to increase by more than 10C/second.
 			if (fabsf(tentativeDerivative) <= 10.0)
@@ -281,6 +489,10 @@ void LocalHeater::Spin()
 			const float targetTemperature = GetTargetTemperature();
 			const float error = targetTemperature - temperature;
 
+			// A reading from a sensor on another board was taken some time before we received it, which adds to the dead time of the control loop.
+			// The PID controller uses the reading extrapolated to the present, and the predictive controller adds the age to the dead time instead.
+			const float controlError = (gotDerivative) ? error - derivative * (float)sensorLatency * MillisToSeconds : error;
+
 			// Do the heating checks
 			switch(mode)
 			{
@@ -313,7 +525,7 @@ void LocalHeater::Spin()
 							if (actualTemperatureRise < expectedTemperatureRise * ((IsBedOrChamber()) ? MinBedTemperatureRiseFactor : MinToolTemperatureRiseFactor))
 							{
 								++heatingFaultCount;
-								if (heatingFaultCount * HeatSampleIntervalMillis > GetMaxHeatingFaultTime() * SecondsToMillis)
+								if (heatingFaultCount * sampleInterval > GetMaxHeatingFaultTime() * SecondsToMillis)
 								{
 									RaiseHeaterFault(HeaterFaultType::temperatureRisingTooSlowly,
 														"expected %.2f" DEGREE_SYMBOL "C/sec measured %.2f" DEGREE_SYMBOL "C/sec",
@@ -338,7 +550,7 @@ void LocalHeater::Spin()
 				if (fabsf(error) > GetMaxTemperatureExcursion() && temperature > MaxAmbientTemperature)
 				{
 					++heatingFaultCount;
-					if (heatingFaultCount * HeatSampleIntervalMillis > GetMaxHeatingFaultTime() * SecondsToMillis)
+					if (heatingFaultCount * sampleInterval > GetMaxHeatingFaultTime() * SecondsToMillis)
 					{
 						RaiseHeaterFault(HeaterFaultType::exceededAllowedExcursion,
 											"target %.1f" DEGREE_SYMBOL "C actual %.1f" DEGREE_SYMBOL "C",
@@ -369,24 +581,46 @@ void LocalHeater::Spin()
 				break;
 			}
 
+			// Check that the temperature is following the model. This detects a sensor that has fallen out much sooner than the heating checks above.
+			if (mode > HeaterMode::suspended && mode < HeaterMode::firstTuningMode && !GetModel().IsInverted())
+			{
+				CheckModelResidual(sampleInterval);
+			}
+			else
+			{
+				residualPrimed = false;
+			}
+
 			// Calculate the PWM
 			if (mode <= HeaterMode::suspended)
 			{
 				lastPwm = 0.0;
+				predictorPrimed = false;
 			}
 			else if (mode < HeaterMode::firstTuningMode)
 			{
 				// Performing normal temperature control
-				if (GetModel().UsePid())
+				if (usePredictiveControl && !GetModel().IsInverted())
+				{
+					lastPwm = CalcPredictivePwm(targetTemperature, sampleInterval);
+					iAccumulator = lastPwm;						// so that we have a sensible I term if we switch back to PID
+#if HAS_VOLTAGE_MONITOR
+					if (!Heat::IsBedOrChamberHeater(GetHeaterNumber()))
+					{
+						lastPwm = GetModel().CorrectPwmForVoltage(lastPwm, Platform::GetCurrentVinVoltage());
+					}
+#endif
+				}
+				else if (GetModel().UsePid())
 				{
 					// Using PID mode. Determine the PID parameters to use.
 					const bool inLoadMode = (mode == HeaterMode::stable) || (fabsf(error) < 3.0);		// use standard PID when maintaining temperature
 					const PidParameters& params = GetModel().GetPidParameters(inLoadMode);
 
 					// If the P and D terms together demand that the heater is full on or full off, disregard the I term to reduce integral windup
-					const float errorMinusDterm = error - (params.tD * derivative);
+					const float errorMinusDterm = controlError - (params.tD * derivative);
 					const float pPlusD = params.kP * errorMinusDterm;
-					const float expectedPwm = GetModel().EstimateRequiredPwm(temperature - NormalAmbientTemperature, 0.0);
+					const float expectedPwm = GetModel().EstimateRequiredPwm(targetTemperature - controlError - NormalAmbientTemperature, 0.0);
 					if (pPlusD + expectedPwm > GetModel().GetMaxPwm())
 					{
 						lastPwm = GetModel().GetMaxPwm();
@@ -403,7 +637,7 @@ void LocalHeater::Spin()
 					else
 					{
 						iAccumulator = constrain<float>
-										(iAccumulator + (error * params.kP * params.recipTi * HeatSampleIntervalMillis * MillisToSeconds),
+										(iAccumulator + (controlError * params.kP * params.recipTi * sampleInterval * MillisToSeconds),
 											0.0, GetModel().GetMaxPwm());
 						lastPwm = constrain<float>(pPlusD + iAccumulator, 0.0, GetModel().GetMaxPwm());
 					}
@@ -419,7 +653,7 @@ void LocalHeater::Spin()
 				else
 				{
 					// Using bang-bang mode
-					lastPwm = (error > 0.0) ? GetModel().GetMaxPwm() : 0.0;
+					lastPwm = (controlError > 0.0) ? GetModel().GetMaxPwm() : 0.0;
 				}
 
 				// Check if the generated PWM signal needs to be inverted for inverse temperature control
@@ -455,6 +689,7 @@ void LocalHeater::Spin()
 			else
 			{
 				DoTuningStep();
+				predictorPrimed = false;
 			}
 		}
 		else
@@ -462,9 +697,17 @@ void LocalHeater::Spin()
 			lastPwm = 0.0;
 		}
 
-		// Set the heater power and update the average PWM
+		// Apply the limit from the power budget, then set the heater power and update the average PWM.
+		// We limit lastPwm rather than the output so that the fault detection and the predictor know what PWM was really applied.
+		requestedPwm = lastPwm;
+		if (IsPowerLimited())
+		{
+			lastPwm = min<float>(lastPwm, GetPwmLimit());
+		}
 		SetHeater(lastPwm);
-		constexpr float avgFactor = HeatSampleIntervalMillis/(HeatPwmAverageTime * SecondsToMillis);
+		pwmHistory[pwmHistoryIndex] = (uint8_t)lrintf(constrain<float>(lastPwm, 0.0, 1.0) * 255.0);
+		pwmHistoryIndex = (pwmHistoryIndex + 1) % PwmHistoryLength;
+		const float avgFactor = (float)sampleInterval/(HeatPwmAverageTime * SecondsToMillis);
 		averagePWM = (averagePWM * (1.0 - avgFactor)) + (lastPwm * avgFactor);
 
 		// For temperature sensors which do not require frequent sampling and averaging,
@@ -482,6 +725,8 @@ void LocalHeater::Spin()
 void LocalHeater::ResetFault()
 {
 	badTemperatureCount = 0;
+	safetyTrip = SafetyTrip::none;
+	ResetSafetyMonitor();
 	if (mode == HeaterMode::fault)
 	{
 		mode = HeaterMode::off;
@@ -494,6 +739,99 @@ float LocalHeater::GetAveragePWM() const
 	return averagePWM;
 }
 
+// Calculate the PWM using model predictive control. The effect of each PWM value we output is delayed by the dead time, so we use the model
+// to predict the temperature one dead time ahead from the PWM values we have already output. Then we choose the PWM that will take the predicted
+// temperature to the target over the control horizon. The load estimate corrects for errors in the model and acts like the integral term of a PID
+// controller. It is made up of a constant part and a part proportional to the extrusion rate, so that when the main board tells us that
+// the extrusion rate is about to change we can adjust the PWM immediately instead of waiting for the temperature to fall.
+float LocalHeater::CalcPredictivePwm(float targetTemperature, uint32_t sampleInterval) noexcept
+{
+	const FopDt& model = GetModel();
+	const float interval = (float)sampleInterval * MillisToSeconds;
+	const float deadTime = GetEffectiveDeadTime();
+	const size_t delaySamples = constrain<long>(lrintf(deadTime/interval), 1, PwmHistoryLength - 1);
+
+	float currentFanPwm, currentExtrusionRate;
+	{
+		TaskCriticalSectionLocker lock;
+		currentFanPwm = fanPwm;
+		currentExtrusionRate = extrusionRate;
+	}
+
+	// Update the load estimate from the difference between the measured temperature and the temperature predicted from the last sample.
+	// We use a normalised least mean squares update so that the extrusion coefficient is only changed when we are extruding.
+	if (predictorPrimed)
+	{
+		const float expectedTemperature = predictedTemperature
+					+ interval * (model.GetNetHeatingRate(predictedTemperature - NormalAmbientTemperature, currentFanPwm, GetHistoricPwm(delaySamples))
+									- loadEstimate - extrusionLoadCoefficient * currentExtrusionRate);
+		const float loadError = (expectedTemperature - temperature)/interval;		// positive if we are losing more heat than expected
+		const float gain = interval/(LoadEstimateTimeConstantDeadTimes * model.GetDeadTime() * (1.0 + fsquare(currentExtrusionRate)));
+		const float maxLoad = model.GetHeatingRate() * model.GetMaxPwm();
+		loadEstimate = constrain<float>(loadEstimate + loadError * gain, -maxLoad, maxLoad);
+		extrusionLoadCoefficient = max<float>(extrusionLoadCoefficient + loadError * currentExtrusionRate * gain, 0.0);
+	}
+	predictedTemperature = temperature;
+	predictorPrimed = true;
+
+	// Predict the temperature one dead time ahead. The horizon is short, so we assume the cooling rate stays constant.
+	const float load = loadEstimate + extrusionLoadCoefficient * currentExtrusionRate;
+	const float coolingRate = load - model.GetNetHeatingRate(temperature - NormalAmbientTemperature, currentFanPwm, 0.0);
+	float pendingPwm = 0.0;
+	for (size_t i = 0; i < delaySamples; ++i)
+	{
+		pendingPwm += GetHistoricPwm(i);
+	}
+	const float temperatureAfterDeadTime = temperature + interval * (model.GetHeatingRate() * pendingPwm - coolingRate * (float)delaySamples);
+
+	// Choose the PWM that will reach the target at the end of the horizon and then hold it there
+	const float requiredHeatingRate = (targetTemperature - temperatureAfterDeadTime)/(PredictiveHorizonDeadTimes * deadTime)
+									+ load - model.GetNetHeatingRate(targetTemperature - NormalAmbientTemperature, currentFanPwm, 0.0);
+	return constrain<float>(requiredHeatingRate/model.GetHeatingRate(), 0.0, model.GetMaxPwm());
+}
+
+// Compare the measured temperature with the temperature predicted by the model from the previous sample and the PWM applied one dead time ago.
+// Steady errors in the model (for example, extrusion or fan cooling that the model doesn't know about) are tracked by a slowly-adapting bias term.
+// We apply a CUSUM test to the remaining residual, so that a large or sustained divergence in either direction raises a fault.
+// If the sensor falls out of the heater block then the temperature falls while the PWM rises, which makes the residual strongly negative.
+// If the heater is stuck on then the temperature rises faster than the PWM can account for, which makes it strongly positive.
+void LocalHeater::CheckModelResidual(uint32_t sampleInterval) noexcept
+{
+	const FopDt& model = GetModel();
+	if (residualPrimed)
+	{
+		const float interval = (float)sampleInterval * MillisToSeconds;
+		const size_t delaySamples = constrain<long>(lrintf(GetEffectiveDeadTime()/interval), 1, PwmHistoryLength - 1);
+		const float currentFanPwm = fanPwm;
+		const float expectedTemperature = residualLastTemperature
+			+ interval * (model.GetNetHeatingRate(residualLastTemperature - NormalAmbientTemperature, currentFanPwm, GetHistoricPwm(delaySamples)) + residualBias);
+		const float residual = temperature - expectedTemperature;
+		residualBias += residual/(ResidualBiasTimeConstantDeadTimes * model.GetDeadTime());		// residual/interval is the rate error, filtered with time constant T
+
+		// Update the noise estimate, ignoring outliers so that a fault doesn't get absorbed into it
+		const float sigma = max<float>(sqrtf(residualVariance), MinResidualSigma);
+		if (fabsf(residual) < ResidualOutlierSigmas * sigma)
+		{
+			residualVariance += (fsquare(residual) - residualVariance) * interval/ResidualVarianceTimeConstant;
+		}
+
+		const float allowance = ResidualAllowanceSigmas * sigma;
+		residualLowSum = max<float>(residualLowSum - residual - allowance, 0.0);
+		residualHighSum = max<float>(residualHighSum + residual - allowance, 0.0);
+		const float threshold = max<float>(GetMaxTemperatureExcursion() * ResidualFaultExcursionFraction, MinResidualFaultThreshold);
+		if (residualLowSum > threshold || residualHighSum > threshold)
+		{
+			const bool tooLow = residualLowSum > threshold;
+			residualLowSum = residualHighSum = 0.0;
+			RaiseHeaterFault((tooLow && mode == HeaterMode::heating) ? HeaterFaultType::temperatureRisingTooSlowly : HeaterFaultType::exceededAllowedExcursion,
+								"temperature %s model prediction by more than %.1f" DEGREE_SYMBOL "C, check the sensor",
+									(tooLow) ? "below" : "above", (double)threshold);
+		}
+	}
+	residualLastTemperature = temperature;
+	residualPrimed = true;
+}
+
 // Get a conservative estimate of the expected heating rate at the current temperature and average PWM. The result may be negative.
 float LocalHeater::GetExpectedHeatingRate() const
 {
@@ -513,14 +851,22 @@ GCodeResult LocalHeater::TuningCommand(const CanMessageHeaterTuningCommand& msg,
 			return GCodeResult::error;
 		}
 
+		if (tuning == nullptr)
+		{
+			tuning = new TuningData;
+		}
+
 		// We could do some more checks here but the main board should have done all the checks needed already
-		tuningHighTemp = msg.highTemp;
-		tuningLowTemp = msg.lowTemp;
-		tuningPwm = msg.pwm;
-		tuningPeakTempDrop = msg.peakTempDrop;
+		tuning->highTemp = msg.highTemp;
+		tuning->lowTemp = msg.lowTemp;
+		tuning->pwm = msg.pwm;
+		tuning->peakTempDrop = msg.peakTempDrop;
 		timeSetHeating = millis();
-		tuningCycleComplete = false;
-		cyclesDone = 0;
+		tuning->cycleComplete = false;
+		tuning->cyclesDone = 0;
+		tuning->heatingRateStats.Reset();
+		tuning->coolingRateStats.Reset();
+		tuning->deadTimeStats.Reset();
 		mode = HeaterMode::tuning1;
 	}
 	else
@@ -530,16 +876,88 @@ GCodeResult LocalHeater::TuningCommand(const CanMessageHeaterTuningCommand& msg,
 	return GCodeResult::ok;
 }
 
-// Adjust heater power for fan PWM or extrusion change
-GCodeResult LocalHeater::FeedForwardAdjustment(float fanPwmChange, float extrusionChange) noexcept
+// Adjust heater power for fan PWM or extrusion change at the specified master time.
+// The heater power takes the model dead time to affect the temperature, so we apply the adjustment that much earlier than the change it is for.
+GCodeResult LocalHeater::FeedForwardAdjustment(float fanPwmChange, float extrusionChange, uint32_t whenEffective) noexcept
 {
-	if (mode == HeaterMode::stable)
+	const int32_t clocksToGo = (int32_t)(StepTimer::ConvertToLocalTime(whenEffective) - StepTimer::GetTimerTicks());
+	const float millisToGo = min<float>((float)clocksToGo * StepTimer::StepClocksToMillis, MaxFeedForwardLeadMillis) - GetModel().GetDeadTime() * SecondsToMillis;
+	if (millisToGo <= 0.0)
+	{
+		ApplyFeedForward(fanPwmChange, extrusionChange);
+		return GCodeResult::ok;
+	}
+
+	// Queue the adjustment in time order. The adjustments are changes, so if the queue is full we apply the earliest one now rather than lose it.
+	PendingFeedForward earliest;
+	bool queueWasFull = false;
+	{
+		TaskCriticalSectionLocker lock;
+		if (numPendingFeedForwards == MaxPendingFeedForwards)
+		{
+			earliest = pendingFeedForwards[0];
+			--numPendingFeedForwards;
+			memmove(pendingFeedForwards, pendingFeedForwards + 1, numPendingFeedForwards * sizeof(pendingFeedForwards[0]));
+			queueWasFull = true;
+		}
+
+		const uint32_t whenDue = millis() + (uint32_t)lrintf(millisToGo);
+		size_t slot = numPendingFeedForwards;
+		while (slot != 0 && (int32_t)(pendingFeedForwards[slot - 1].whenDue - whenDue) > 0)
+		{
+			pendingFeedForwards[slot] = pendingFeedForwards[slot - 1];
+			--slot;
+		}
+		pendingFeedForwards[slot].whenDue = whenDue;
+		pendingFeedForwards[slot].fanPwmChange = fanPwmChange;
+		pendingFeedForwards[slot].extrusionChange = extrusionChange;
+		++numPendingFeedForwards;
+	}
+
+	if (queueWasFull)
+	{
+		ApplyFeedForward(earliest.fanPwmChange, earliest.extrusionChange);
+	}
+	return GCodeResult::ok;
+}
+
+// Apply the queued feedforward adjustments that are due. The controller only sees them at a sample, so we apply each one at the sample nearest to when it is due.
+void LocalHeater::ApplyDueFeedForwards(uint32_t now) noexcept
+{
+	const uint32_t deadline = now + GetSampleInterval()/2;
+	for (;;)
+	{
+		PendingFeedForward ff;
+		{
+			TaskCriticalSectionLocker lock;
+			if (numPendingFeedForwards == 0 || (int32_t)(deadline - pendingFeedForwards[0].whenDue) < 0)
+			{
+				return;
+			}
+			ff = pendingFeedForwards[0];
+			--numPendingFeedForwards;
+			memmove(pendingFeedForwards, pendingFeedForwards + 1, numPendingFeedForwards * sizeof(pendingFeedForwards[0]));
+		}
+		ApplyFeedForward(ff.fanPwmChange, ff.extrusionChange);
+	}
+}
+
+// Adjust heater power for fan PWM or extrusion change now
+void LocalHeater::ApplyFeedForward(float fanPwmChange, float extrusionChange) noexcept
+{
+	{
+		// Keep track of the fan PWM and extrusion rate for model predictive control
+		TaskCriticalSectionLocker lock;
+		fanPwm = constrain<float>(fanPwm + fanPwmChange, 0.0, 1.0);
+		extrusionRate = max<float>(extrusionRate + extrusionChange, 0.0);
+	}
+
+	if (mode == HeaterMode::stable && !usePredictiveControl)
 	{
 		const float boost = GetModel().GetPwmCorrectionForFan(GetTargetTemperature() - NormalAmbientTemperature, fanPwmChange) * FanFeedForwardMultiplier;
 		TaskCriticalSectionLocker lock;
 		iAccumulator += boost;
 	}
-	return GCodeResult::ok;
 }
 
 // This is called on each temperature sample when auto tuning
@@ -550,77 +968,85 @@ void LocalHeater::DoTuningStep()
 	switch (mode)
 	{
 	case HeaterMode::tuning1:		// Heating up
-		if (temperature >= tuningHighTemp)							// if reached target
+		if (temperature >= tuning->highTemp)							// if reached target
 		{
 			// Move on to next phase
 			lastPwm = 0.0;
 			SetHeater(0.0);
-			peakTemp = afterPeakTemp = temperature;
-			lastOffTime = peakTime = afterPeakTime = now;
+			tuning->peakTemp = tuning->afterPeakTemp = temperature;
+			tuning->lastOffTime = tuning->peakTime = tuning->afterPeakTime = now;
 			mode = HeaterMode::tuning2;
 		}
 		else
 		{
-			lastPwm = tuningPwm;
+			lastPwm = tuning->pwm;
 		}
 		return;
 
 	case HeaterMode::tuning2:		// Heater is off, record the peak temperature and time
-		if (temperature >= peakTemp)
+		if (temperature >= tuning->peakTemp)
 		{
-			peakTemp = afterPeakTemp = temperature;
-			peakTime = afterPeakTime = now;
+			tuning->peakTemp = tuning->afterPeakTemp = temperature;
+			tuning->peakTime = tuning->afterPeakTime = now;
 		}
-		else if (temperature < tuningLowTemp)
+		else if (temperature < tuning->lowTemp)
 		{
 			// Temperature has dropped below the low limit.
 			// If we have been doing idle cycles, see whether we can switch to collecting data, and turn the heater on.
 			// If we have been collecting data, see if we have enough, and either turn the heater on to start another cycle or finish tuning.
 
 			// Save the data (don't know whether we need it yet)
-			dHigh = peakTime - lastOffTime;
-			tOff = now - lastOffTime;
-			coolingRate = (afterPeakTemp - temperature) * SecondsToMillis/(now - afterPeakTime);
-			lastOnTime = peakTime = afterPeakTime = now;
-			peakTemp = afterPeakTemp = temperature;
-			lastPwm = tuningPwm;						// turn on heater at specified power
+			tuning->dHigh = tuning->peakTime - tuning->lastOffTime;
+			tuning->tOff = now - tuning->lastOffTime;
+			tuning->coolingRate = (tuning->afterPeakTemp - temperature) * SecondsToMillis/(now - tuning->afterPeakTime);
+			tuning->lastOnTime = tuning->peakTime = tuning->afterPeakTime = now;
+			tuning->peakTemp = tuning->afterPeakTemp = temperature;
+			lastPwm = tuning->pwm;						// turn on heater at specified power
 			mode = HeaterMode::tuning3;
 		}
-		else if (afterPeakTime == peakTime && tuningHighTemp - temperature >= tuningPeakTempDrop)
+		else if (tuning->afterPeakTime == tuning->peakTime && tuning->highTemp - temperature >= tuning->peakTempDrop)
 		{
-			afterPeakTime = now;
-			afterPeakTemp = temperature;
+			tuning->afterPeakTime = now;
+			tuning->afterPeakTemp = temperature;
 		}
 		return;
 
 	case HeaterMode::tuning3:	// Heater is turned on, record the lowest temperature and time
-		if (temperature <= peakTemp)
+		if (temperature <= tuning->peakTemp)
 		{
-			peakTemp = afterPeakTemp = temperature;
-			peakTime = afterPeakTime = now;
+			tuning->peakTemp = tuning->afterPeakTemp = temperature;
+			tuning->peakTime = tuning->afterPeakTime = now;
 		}
-		else if (temperature >= tuningHighTemp)
+		else if (temperature >= tuning->highTemp)
 		{
 			// We have reached the target temperature, so record a data point and turn the heater off
 #if HAS_VOLTAGE_MONITOR
-			tuningVoltage = Platform::GetCurrentVinVoltage();	// save this while the heater is on
+			tuning->voltage = Platform::GetCurrentVinVoltage();	// save this while the heater is on
 #else
-			tuningVoltage = 0.0;
+			tuning->voltage = 0.0;
 #endif
-			dLow = peakTime - lastOnTime;
-			tOn = now - lastOnTime;
-			heatingRate = (temperature - afterPeakTemp) * SecondsToMillis/(now - afterPeakTime);
-			lastOffTime = peakTime = afterPeakTime = now;
-			peakTemp = afterPeakTemp = temperature;
+			tuning->dLow = tuning->peakTime - tuning->lastOnTime;
+			tuning->tOn = now - tuning->lastOnTime;
+			tuning->heatingRate = (temperature - tuning->afterPeakTemp) * SecondsToMillis/(now - tuning->afterPeakTime);
+			tuning->lastOffTime = tuning->peakTime = tuning->afterPeakTime = now;
+			tuning->peakTemp = tuning->afterPeakTemp = temperature;
 			lastPwm = 0.0;										// turn heater off
 			mode = HeaterMode::tuning2;
-			++cyclesDone;
-			tuningCycleComplete = true;
+			++tuning->cyclesDone;
+			tuning->cycleComplete = true;
+
+			// Update the estimates. The first cycle starts from cold so we don't include it.
+			if (tuning->cyclesDone > 1)
+			{
+				tuning->heatingRateStats.Add(tuning->heatingRate);
+				tuning->coolingRateStats.Add(tuning->coolingRate);
+				tuning->deadTimeStats.Add((float)(tuning->dHigh + tuning->dLow) * (0.5 * MillisToSeconds));
+			}
 		}
-		else if (afterPeakTime == peakTime && temperature - tuningLowTemp >= tuningPeakTempDrop)
+		else if (tuning->afterPeakTime == tuning->peakTime && temperature - tuning->lowTemp >= tuning->peakTempDrop)
 		{
-			afterPeakTime = now;
-			afterPeakTemp = temperature;
+			tuning->afterPeakTime = now;
+			tuning->afterPeakTemp = temperature;
 		}
 		return;
 
@@ -652,20 +1078,27 @@ void LocalHeater::Suspend(bool sus)
 	}
 }
 
+// Return true if the estimates from the tuning cycles have converged, so that more cycles would not improve the model significantly
+bool LocalHeater::HasTuningConverged() const noexcept
+{
+	return tuning != nullptr
+		&& tuning->heatingRateStats.HasConverged() && tuning->coolingRateStats.HasConverged() && tuning->deadTimeStats.HasConverged();
+}
+
 // Get a heater tuning cycle report, if we have one. Caller must fill in the heater number.
-/*static*/ bool LocalHeater::GetTuningCycleData(CanMessageHeaterTuningReport& msg)
-{
-	if (tuningCycleComplete)
-	{
-		msg.cyclesDone = cyclesDone;
-		msg.dhigh = dHigh;
-		msg.dlow = dLow;
-		msg.ton = tOn;
-		msg.toff = tOff;
-		msg.heatingRate = heatingRate;
-		msg.coolingRate = coolingRate;
-		msg.voltage = tuningVoltage;
-		tuningCycleComplete = false;
+bool LocalHeater::GetTuningCycleData(CanMessageHeaterTuningReport& msg) noexcept
+{
+	if (tuning != nullptr && tuning->cycleComplete)
+	{
+		msg.cyclesDone = tuning->cyclesDone;
+		msg.dhigh = tuning->dHigh;
+		msg.dlow = tuning->dLow;
+		msg.ton = tuning->tOn;
+		msg.toff = tuning->tOff;
+		msg.heatingRate = tuning->heatingRate;
+		msg.coolingRate = tuning->coolingRate;
+		msg.voltage = tuning->voltage;
+		tuning->cycleComplete = false;
 		return true;
 	}
 
@@ -676,7 +1109,7 @@ void LocalHeater::Suspend(bool sus)
 // The length of text to be included must not exceed 55 characters + terminator, else it will be truncated.
 void LocalHeater::RaiseHeaterFault(HeaterFaultType type, const char *format, ...) noexcept
 {
-	lastPwm = 0.0;
+	lastPwm = requestedPwm = 0.0;
 	SetHeater(0.0);
 	if (mode != HeaterMode::fault)
 	{
@@ -688,4 +1121,132 @@ void LocalHeater::RaiseHeaterFault(HeaterFaultType type, const char *format, ...
 	}
 }
 
+// Check the heater for the safety monitor task, which calls this every few tens of milliseconds while holding the heaters lock.
+// This is a backstop to the checks in Spin so the limits are a little more generous, but it doesn't depend on the Heat task running.
+// If we trip, we switch the heater off straight away and leave it to the Heat task to raise the fault.
+bool LocalHeater::SafetyCheck(uint32_t now, bool heatTaskStalled) noexcept
+{
+	if (safetyTrip != SafetyTrip::none)
+	{
+		SetPorts(0.0);								// in case the Heat task was part way through setting the PWM when we tripped
+		return false;
+	}
+	if (mode <= HeaterMode::suspended)
+	{
+		ResetSafetyMonitor();
+		return false;
+	}
+	if (heatTaskStalled)
+	{
+		TripSafety(SafetyTrip::heatTaskStalled);
+		return true;
+	}
+
+	float t;
+	if (Heat::GetFastSensorTemperature(GetSensorNumber(), t) != TemperatureError::success)
+	{
+		if (!safetyReadingBad)
+		{
+			safetyReadingBad = true;
+			safetyBadReadingStartMillis = now;
+		}
+		else if (now - safetyBadReadingStartMillis >= SafetyBadReadingMillis)
+		{
+			TripSafety(SafetyTrip::sensorFault);
+			return true;
+		}
+		return false;
+	}
+	safetyReadingBad = false;
+	safetyLastTemperature = t;
+
+	if (t > GetHighestTemperatureLimit())
+	{
+		++safetyOverTemperatureReadings;
+		if (safetyOverTemperatureReadings >= SafetyOverTemperatureReadings)
+		{
+			TripSafety(SafetyTrip::overTemperature);
+			return true;
+		}
+	}
+	else
+	{
+		safetyOverTemperatureReadings = 0;
+	}
+
+	// While heating up at close to full power, the temperature must rise by a reasonable fraction of what the model predicts
+	const FopDt& model = GetModel();
+	if (   mode == HeaterMode::heating && !model.IsInverted() && lastPwm >= SafetyRunawayPwmFraction * model.GetMaxPwm()
+		&& (float)(now - timeSetHeating) >= model.GetDeadTime() * SecondsToMillis * 2
+	   )
+	{
+		if (!safetyWindowRunning)
+		{
+			safetyWindowStartMillis = now;
+			safetyWindowStartTemperature = t;
+			safetyExpectedRate = GetExpectedHeatingRate();
+			safetyWindowRunning = true;
+		}
+		else
+		{
+			const float elapsed = (float)(now - safetyWindowStartMillis) * MillisToSeconds;
+			if (elapsed >= max<float>(model.GetDeadTime() * 2 + GetMaxHeatingFaultTime(), MinSafetyRunawayCheckTime))
+			{
+				const float minRise = safetyExpectedRate * elapsed * ((IsBedOrChamber()) ? MinBedTemperatureRiseFactor : MinToolTemperatureRiseFactor);
+				if (t - safetyWindowStartTemperature < minRise)
+				{
+					TripSafety(SafetyTrip::runaway);
+					return true;
+				}
+				safetyWindowRunning = false;		// the heater is heating normally, so start another check
+			}
+		}
+	}
+	else
+	{
+		safetyWindowRunning = false;
+	}
+	return false;
+}
+
+// Switch the heater off from the safety monitor task. We set safetyTrip first so that if the Heat task sets the PWM after this, it sets it to zero.
+void LocalHeater::TripSafety(SafetyTrip reason) noexcept
+{
+	safetyTrip = reason;
+	SetPorts(0.0);
+}
+
+// Raise the heater fault for a safety monitor trip. This is called by the Heat task, because raising a fault involves sending a CAN message.
+void LocalHeater::RaiseSafetyFault() noexcept
+{
+	switch (safetyTrip)
+	{
+	case SafetyTrip::sensorFault:
+		RaiseHeaterFault(HeaterFaultType::failedToReadSensor, "safety monitor: sensor fault");
+		break;
+
+	case SafetyTrip::overTemperature:
+		RaiseHeaterFault(HeaterFaultType::exceededAllowedExcursion, "safety monitor: temperature %.1f" DEGREE_SYMBOL "C exceeds limit", (double)safetyLastTemperature);
+		break;
+
+	case SafetyTrip::runaway:
+		RaiseHeaterFault(HeaterFaultType::temperatureRisingTooSlowly, "safety monitor: expected %.2f" DEGREE_SYMBOL "C/sec", (double)safetyExpectedRate);
+		break;
+
+	case SafetyTrip::heatTaskStalled:
+		RaiseHeaterFault(HeaterFaultType::monitorTriggered, "safety monitor: heat task stalled");
+		break;
+
+	default:
+		break;
+	}
+}
+
+void LocalHeater::ResetSafetyMonitor() noexcept
+{
+	safetyReadingBad = false;
+	safetyOverTemperatureReadings = 0;
+	safetyWindowRunning = false;
+}
+
 // End
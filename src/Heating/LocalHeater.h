@@ -22,6 +22,9 @@ class CanMessageHeaterTuningReport;
 class LocalHeater : public Heater
 {
 	static const size_t NumPreviousTemperatures = 4; // How many samples we average the temperature derivative over
+	static const size_t PwmHistoryLength = 32;		// How many previous PWM values we keep for model predictive control, must be more than the dead time in samples
+	static const unsigned int MaxPwmDitherSteps = 65535;	// The highest PWM resolution we can dither to
+	static const size_t MaxPendingFeedForwards = 4;	// How many timed feedforward adjustments we can queue
 
 public:
 	LocalHeater(unsigned int heaterNum);
@@ -39,9 +42,18 @@ public:
 	float GetAccumulator() const override;			// Return the integral accumulator
 	void Suspend(bool sus) override;				// Suspend the heater to conserve power or while doing Z probing
 	GCodeResult TuningCommand(const CanMessageHeaterTuningCommand& msg, const StringRef& reply) override;
-	GCodeResult FeedForwardAdjustment(float fanPwmChange, float extrusionChange) noexcept override;
-
-	static bool GetTuningCycleData(CanMessageHeaterTuningReport& msg);	// get a heater tuning cycle report, if we have one
+	GCodeResult FeedForwardAdjustment(float fanPwmChange, float extrusionChange, uint32_t whenEffective) noexcept override;
+	GCodeResult SetPredictiveControl(bool on, const StringRef& reply) noexcept override;
+
+	bool GetTuningCycleData(CanMessageHeaterTuningReport& msg) noexcept override;	// get a heater tuning cycle report, if we have one
+	bool HasTuningConverged() const noexcept override;
+	GCodeResult SetPwmDither(unsigned int steps, const StringRef& reply) noexcept override;
+	void DitherPwm() noexcept override;
+	float GetRequestedPwm() const noexcept override { return requestedPwm; }
+	float GetHoldingPwm() const noexcept override;
+	bool IsPowerLimited() const noexcept override { return GetRatedPower() > 0.0 && !IsTuning() && !GetModel().IsInverted(); }
+	void ApplyPwmLimit() noexcept override;
+	bool SafetyCheck(uint32_t now, bool heatTaskStalled) noexcept override;
 
 protected:
 	void ResetHeater() noexcept override;
@@ -50,24 +62,95 @@ protected:
 	GCodeResult UpdateModel(const StringRef& reply) noexcept override;	// Called when the heater model has been changed
 
 private:
-	void SetHeater(float power) const;				// Power is a fraction in [0,1]
+	struct TuningData;
+
+	// Reasons why the safety monitor has switched the heater off
+	enum class SafetyTrip : uint8_t
+	{
+		none = 0,
+		sensorFault,
+		overTemperature,
+		runaway,
+		heatTaskStalled
+	};
+
+	struct PendingFeedForward
+	{
+		uint32_t whenDue;							// the millis() time at which to apply the adjustment
+		float fanPwmChange;
+		float extrusionChange;
+	};
+
+	void SetHeater(float power);					// Power is a fraction in [0,1]
+	void SetPorts(float power) const;				// Write the PWM to the ports
+	void UpdateDitherInterval() noexcept;			// Set the dither interval to the PWM period
 	TemperatureError ReadTemperature();				// Read and store the temperature of this heater
 	void DoTuningStep();							// Called on each temperature sample when auto tuning
 	float GetExpectedHeatingRate() const;			// Get the minimum heating rate we expect
+	float CalcPredictivePwm(float targetTemperature, uint32_t sampleInterval) noexcept;	// Calculate the PWM using model predictive control
+	float GetEffectiveDeadTime() const noexcept { return GetModel().GetDeadTime() + (float)sensorLatency * MillisToSeconds; }	// the model dead time plus the age of the sensor reading
+	float GetHistoricPwm(size_t samplesAgo) const noexcept { return (float)pwmHistory[(pwmHistoryIndex + PwmHistoryLength - 1 - samplesAgo) % PwmHistoryLength] * (1.0/255.0); }
+	void ResetPredictor() noexcept;
+	void ApplyFeedForward(float fanPwmChange, float extrusionChange) noexcept;	// Adjust the heater power for a fan PWM or extrusion change now
+	void ApplyDueFeedForwards(uint32_t now) noexcept;	// Apply the queued feedforward adjustments that are due at this sample
+	void CheckModelResidual(uint32_t sampleInterval) noexcept;		// Check that the temperature is following the model, raise a fault if not
 	void RaiseHeaterFault(HeaterFaultType type, const char *format, ...) noexcept;
+	void TripSafety(SafetyTrip reason) noexcept;	// Switch the heater off from the safety monitor task
+	void RaiseSafetyFault() noexcept;				// Raise the fault for a safety monitor trip, called by the Heat task
+	void ResetSafetyMonitor() noexcept;
 
 	PwmPort ports[MaxPortsPerHeater];				// The port(s) that drive the heater
+	TuningData *tuning;								// The tuning data, allocated the first time we tune this heater
 	float temperature;								// The current temperature
+	uint32_t sensorLatency;							// The estimated age of the temperature reading in milliseconds when we read it, significant for remote sensors
 	float previousTemperatures[NumPreviousTemperatures]; // The temperatures of the previous NumDerivativeSamples measurements, used for calculating the derivative
 	size_t previousTemperatureIndex;				// Which slot in previousTemperature we fill in next
 	float iAccumulator;								// The integral LocalHeater component
 	float lastPwm;									// The last PWM value we output, before scaling by kS
+	float requestedPwm;								// The last PWM value that the controller wanted, before applying the power limit
 	float averagePWM;								// The running average of the PWM, after scaling.
 	float lastTemperatureValue;								// the last temperature we recorded while heating up
 	uint32_t lastTemperatureMillis;							// when we recorded the last temperature
 	uint32_t timeSetHeating;						// When we turned on the heater
 	uint32_t lastSampleTime;						// Time when the temperature was last sampled by Spin()
 
+	// Model predictive control
+	float loadEstimate;								// The estimated additional cooling rate not accounted for by the model, in degC/sec
+	float extrusionLoadCoefficient;					// The estimated additional cooling rate per unit extrusion rate
+	float predictedTemperature;						// The temperature at the last sample, used to check the model prediction
+	float fanPwm;									// The print cooling fan PWM, tracked from the feedforward messages
+	float extrusionRate;							// The extrusion rate, tracked from the feedforward messages
+	uint8_t pwmHistory[PwmHistoryLength];			// Previous PWM values scaled to 0..255, because the effect of each one is delayed by the dead time
+	uint8_t pwmHistoryIndex;						// Which slot in pwmHistory we fill in next
+	bool usePredictiveControl;						// True to use model predictive control instead of PID
+	bool predictorPrimed;							// True if predictedTemperature is valid
+
+	PendingFeedForward pendingFeedForwards[MaxPendingFeedForwards];	// Timed feedforward adjustments waiting to be applied, earliest first
+	size_t numPendingFeedForwards;
+
+	// Model residual fault detection
+	float residualBias;								// The slowly-varying part of the difference between the measured and modelled heating rate, in degC/sec
+	float residualVariance;							// The variance of the residual when it is behaving normally, in degC^2
+	float residualLowSum, residualHighSum;			// CUSUM statistics for the temperature being below or above what the model predicts, in degC
+	float residualLastTemperature;					// The temperature at the last sample
+	bool residualPrimed;							// True if residualLastTemperature is valid
+
+	// PWM dithering
+	float ditherPower;								// The PWM requested by the last call to SetHeater
+	float ditherError;								// The sigma-delta error accumulator, in dither steps
+	uint16_t ditherSteps;							// The PWM resolution that we dither to, or 0 if not dithering
+
+	// Safety monitor. Apart from safetyTrip, these are only accessed by the safety monitor task.
+	float safetyWindowStartTemperature;				// The temperature at the start of the current runaway check
+	float safetyLastTemperature;					// The last temperature that the safety monitor read
+	float safetyExpectedRate;						// The heating rate we expected at the start of the current runaway check
+	uint32_t safetyWindowStartMillis;				// When the current runaway check started
+	uint32_t safetyBadReadingStartMillis;			// When the current run of dud readings seen by the safety monitor started
+	uint8_t safetyOverTemperatureReadings;			// Count of sequential readings above the temperature limit
+	bool safetyReadingBad;							// True if the last reading that the safety monitor took was a dud
+	bool safetyWindowRunning;						// True if a runaway check is in progress
+	volatile SafetyTrip safetyTrip;					// Set by the safety monitor task when it switches the heater off, cleared when the fault is reset
+
 	uint16_t heatingFaultCount;						// Count of questionable heating behaviours
 
 	uint8_t previousTemperaturesGood;				// Bitmap indicating which previous temperature were good readings
@@ -19,6 +19,8 @@ constexpr uint32_t MinimumReadInterval = 2000;		// ms
 constexpr uint32_t MaximumReadTime = 20;			// ms
 constexpr uint32_t MinimumOneBitLength = 50;		// microseconds
 constexpr uint32_t MinimumOneBitStepClocks = (StepTimer::StepClockRate * MinimumOneBitLength)/1000000;
+constexpr uint32_t MinimumResponseTime = 10;		// microseconds, the sensor takes at least 20us to respond so any edge before this is caused by us releasing the line
+constexpr uint32_t MinimumResponseStepClocks = (StepTimer::StepClockRate * MinimumResponseTime)/1000000;
 
 # include "Tasks.h"
 
@@ -140,17 +142,10 @@ DhtSensorHardwareInterface *DhtSensorHardwareInterface::Create(unsigned int rela
 
 void DhtSensorHardwareInterface::Interrupt()
 {
-	if (numPulses < ARRAY_SIZE(pulses))
+	const uint32_t now = StepTimer::GetTimerTicks();
+	if (numEdges < NumEdges && now - startTime >= MinimumResponseStepClocks)
 	{
-		const uint32_t now = StepTimer::GetInterruptClocks();
-		if (IoPort::ReadPin(sensorPin))
-		{
-			lastPulseTime = now;
-		}
-		else if (lastPulseTime != 0)
-		{
-			pulses[numPulses++] = now - lastPulseTime;
-		}
+		edgeTimes[numEdges++] = now;
 	}
 }
 
@@ -174,11 +169,11 @@ void DhtSensorHardwareInterface::TakeReading()
 			IoPort::SetPinMode(sensorPin, INPUT_PULLUP);
 
 			// It appears that switching the pin to an output disables the interrupt, so we need to call attachInterrupt here
-			// We are likely to get an immediate interrupt at this point corresponding to the low-to-high transition. We must ignore this.
-			numPulses = ARRAY_SIZE(pulses);		// tell the ISR not to collect data yet
+			// We are likely to get an immediate interrupt at this point corresponding to the low-to-high transition. The ISR ignores it because it is too soon after startTime.
+			numEdges = NumEdges;				// tell the ISR not to collect data yet
+			startTime = StepTimer::GetTimerTicks();
 			AttachInterrupt(sensorPin, DhtDataTransition, InterruptMode::change, this);
-			lastPulseTime = 0;
-			numPulses = 0;						// tell the ISR to collect data
+			numEdges = 0;						// tell the ISR to collect data
 		}
 
 		// Wait for the incoming signal to be read by the ISR (1 start bit + 40 data bits), or until timeout.
@@ -233,21 +228,21 @@ void DhtSensorHardwareInterface::TakeReading()
 // Else return the TemperatureError code but do not update the readings.
 TemperatureError DhtSensorHardwareInterface::ProcessReadings()
 {
-	// Check enough bits received and check start bit
-	if (numPulses != ARRAY_SIZE(pulses) || pulses[0] < MinimumOneBitStepClocks)
+	// Check enough edges received and check the length of the high part of the start bit
+	if (numEdges != NumEdges || edgeTimes[2] - edgeTimes[1] < MinimumOneBitStepClocks)
 	{
-//		debugPrintf("pulses %u p0 %u\n", numPulses, (unsigned int)pulses[0]);
+//		debugPrintf("edges %u\n", numEdges);
 		return TemperatureError::ioError;
 	}
 
 	// Reset 40 bits of received data to zero
 	uint8_t data[5] = { 0, 0, 0, 0, 0 };
 
-	// Inspect each high pulse and determine which ones are 0 (less than 50us) or 1 (more than 50us). Ignore the start bit.
+	// Inspect each high pulse and determine which ones are 0 (less than 50us) or 1 (more than 50us). The high part of bit i starts at edge 3 + 2*i.
 	for (size_t i = 0; i < 40; ++i)
 	{
 		data[i / 8] <<= 1;
-		if (pulses[i + 1] >= MinimumOneBitStepClocks)
+		if (edgeTimes[4 + 2 * i] - edgeTimes[3 + 2 * i] >= MinimumOneBitStepClocks)
 		{
 			data[i / 8] |= 1;
 		}
@@ -58,9 +58,12 @@ private:
 	float lastTemperature, lastHumidity;
 	size_t badTemperatureCount;
 
-	volatile uint32_t lastPulseTime;
-	volatile size_t numPulses;
-	uint16_t pulses[41];			// 1 start bit + 40 data bits
+	// The ISR just records the time of each edge and the data is decoded afterwards, so that the ISR is as short as possible and a late ISR can't get the pin level wrong.
+	// The edges are: sensor response falling, start bit rising and falling, then rising and falling for each of the 40 data bits.
+	static constexpr size_t NumEdges = 3 + 2 * 40;
+	volatile uint32_t startTime;	// when we released the data line
+	volatile size_t numEdges;
+	uint32_t edgeTimes[NumEdges];
 };
 
 // This class represents a DHT temperature sensor
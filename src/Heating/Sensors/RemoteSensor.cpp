@@ -11,8 +11,6 @@
 #include <CanMessageFormats.h>
 #include <General/Portability.h>
 
-constexpr uint32_t RemoteTemperatureTimeoutMillis = 1000;
-
 RemoteSensor::RemoteSensor(unsigned int sensorNum, CanAddress pBoardAddress) noexcept
 	: TemperatureSensor(sensorNum, "remote"), boardAddress(pBoardAddress)
 {
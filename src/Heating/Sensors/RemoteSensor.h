@@ -15,6 +15,9 @@ struct CanTemperatureReport;
 class RemoteSensor : public TemperatureSensor
 {
 public:
+	static constexpr uint32_t RemoteTemperatureTimeoutMillis = 1000;		// readings from other boards older than this are considered stale
+	static constexpr uint32_t AssumedSendDelayMillis = HeatSampleIntervalMillis/2;	// the other board samples its sensors at this interval, so the reading was on average this old when it was sent
+
 	RemoteSensor(unsigned int sensorNum, CanAddress pBoardAddress) noexcept;
 	~RemoteSensor() { }
 
@@ -22,6 +25,7 @@ public:
 	CanAddress GetBoardAddress() const noexcept override { return boardAddress; }
 	void Poll() noexcept override { }				// nothing to do here because reception of CAN messages update the reading
 	void UpdateRemoteTemperature(CanAddress src, const CanSensorReport& report) noexcept override;
+	uint32_t GetReadingLatency() const noexcept override { return GetReadingAge() + AssumedSendDelayMillis; }
 
 private:
 	CanAddress boardAddress;
@@ -11,6 +11,17 @@
 
 #include "Tasks.h"
 
+#if SHARED_SPI_USES_DMA
+
+constexpr uint32_t SpiDmaTimeoutMillis = 2;
+
+volatile uint8_t SpiTemperatureSensor::dmaTxBuffer[8];
+volatile uint8_t SpiTemperatureSensor::dmaRxBuffer[8];
+volatile TaskHandle SpiTemperatureSensor::dmaWaitingTask = nullptr;
+volatile bool SpiTemperatureSensor::dmaSucceeded = false;
+
+#endif
+
 SpiTemperatureSensor::SpiTemperatureSensor(unsigned int sensorNum, const char *name, SpiMode spiMode, uint32_t clockFreq)
 	: SensorWithPort(sensorNum, name), device(Platform::GetSharedSpi(), clockFreq, spiMode, false)
 {
@@ -37,8 +48,28 @@ TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[],
 	}
 
 	delayMicroseconds(1);
+#if SHARED_SPI_USES_DMA
+	// Do the transfer using DMA so that other tasks can run while we wait for it to complete
+	for (size_t i = 0; i < nbytes; ++i)
+	{
+		dmaTxBuffer[i] = dataOut[i];
+	}
+	dmaSucceeded = false;
+	TaskBase::ClearNotifyCount();
+	dmaWaitingTask = TaskBase::GetCallerTaskHandle();
+	device.StartDmaTransfer(dmaTxBuffer, dmaRxBuffer, nbytes, DmaCallback, CallbackParameter(nullptr));
+	TaskBase::Take(SpiDmaTimeoutMillis);
+	if (!dmaSucceeded)
+	{
+		device.AbortDmaTransfer();
+	}
+	dmaWaitingTask = nullptr;
+	const bool ok = dmaSucceeded;
+	const volatile uint8_t * const rawBytes = dmaRxBuffer;
+#else
 	uint8_t rawBytes[8];
 	const bool ok = device.TransceivePacket(dataOut, rawBytes, nbytes);
+#endif
 	delayMicroseconds(1);
 
 	device.Deselect();
@@ -59,6 +90,20 @@ TemperatureError SpiTemperatureSensor::DoSpiTransaction(const uint8_t dataOut[],
 	return TemperatureError::success;
 }
 
+#if SHARED_SPI_USES_DMA
+
+// This is called from the DMA interrupt when a transfer has completed or failed
+/*static*/ void SpiTemperatureSensor::DmaCallback(CallbackParameter cp, DmaCallbackReason reason) noexcept
+{
+	dmaSucceeded = (reason == DmaCallbackReason::complete);
+	if (dmaWaitingTask != nullptr)						// if we timed out then the task is no longer waiting
+	{
+		TaskBase::GiveFromISR(dmaWaitingTask);
+	}
+}
+
+#endif
+
 #endif
 
 // End
@@ -17,6 +17,9 @@
 
 class SpiTemperatureSensor : public SensorWithPort
 {
+public:
+	bool IsSlowToPoll() const noexcept override { return true; }
+
 protected:
 	SpiTemperatureSensor(unsigned int sensorNum, const char *name, SpiMode spiMode, uint32_t clockFrequency);
 	bool ConfigurePort(const CanMessageGenericParser& parser, const StringRef& reply, bool& seen);
@@ -25,6 +28,17 @@ protected:
 		pre(nbytes <= 8);
 
 	SharedSpiClient device;
+
+#if SHARED_SPI_USES_DMA
+private:
+	static void DmaCallback(CallbackParameter cp, DmaCallbackReason reason) noexcept;
+
+	// These are shared by all SPI sensors, which is OK because only one can own the SPI bus at a time
+	static volatile uint8_t dmaTxBuffer[8];
+	static volatile uint8_t dmaRxBuffer[8];
+	static volatile TaskHandle dmaWaitingTask;
+	static volatile bool dmaSucceeded;
+#endif
 };
 
 #endif
@@ -20,6 +20,8 @@
 #endif
 
 #include "CAN/CanInterface.h"
+#include "Heating/Heat.h"
+#include <DeferredLog.h>
 
 // Constructor
 TemperatureSensor::TemperatureSensor(unsigned int sensorNum, const char *t)
@@ -40,7 +42,7 @@ TemperatureError TemperatureSensor::GetLatestTemperature(float& t)
 	{
 		lastTemperature = BadErrorTemperature;
 		lastResult = TemperatureError::timeout;
-		debugPrintf("temp timeout on sensor %u\n", sensorNumber);
+		logPrintf("temp timeout on sensor %u\n", sensorNumber);
 	}
 	t = lastTemperature;
 	return lastResult;
@@ -71,6 +73,7 @@ void TemperatureSensor::SetResult(float t, TemperatureError rslt)
 	{
 		lastRealError = rslt;
 	}
+	Heat::NewSensorReading(sensorNumber);
 }
 
 // This version is used for unsuccessful readings only
@@ -79,6 +82,20 @@ void TemperatureSensor::SetResult(TemperatureError rslt)
 	lastResult = lastRealError = rslt;
 	lastTemperature = BadErrorTemperature;
 	whenLastRead = millis();
+	Heat::NewSensorReading(sensorNumber);
+}
+
+// Get a reading for the heater safety monitor. This version returns the stored reading, or a timeout error if it is too old.
+TemperatureError TemperatureSensor::GetFastReading(float& t) const noexcept
+{
+	const uint32_t wlr = whenLastRead;							// read this before we call millis(), see GetLatestTemperature
+	if (millis() - wlr > TemperatureReadingTimeout)
+	{
+		t = BadErrorTemperature;
+		return TemperatureError::timeout;
+	}
+	t = lastTemperature;
+	return lastResult;
 }
 
 // Get the expansion board address. Overridden for remote sensors.
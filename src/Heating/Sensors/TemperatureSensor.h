@@ -28,21 +28,36 @@ public:
 	// Try to get a temperature reading
 	virtual void Poll() = 0;
 
+	// Return true if this sensor takes a long time to read, so that it should be polled by the sensor task instead of the Heat task
+	virtual bool IsSlowToPoll() const noexcept { return false; }
+
 	// Update the temperature, if it is a remote sensor. Overridden in class RemoteSensor.
 	virtual void UpdateRemoteTemperature(CanAddress src, const CanSensorReport& report) noexcept;
 
 	// Get the latest temperature reading
 	TemperatureError GetLatestTemperature(float& t);
 
+	// Get the number of milliseconds since we last got a reading
+	uint32_t GetReadingAge() const noexcept { const uint32_t wlr = whenLastRead; return millis() - wlr; }
+
+	// Get the estimated time in milliseconds since the stored reading was measured, including any delay before we received it. Overridden in class RemoteSensor.
+	virtual uint32_t GetReadingLatency() const noexcept { return 0; }
+
 	// Get the most recent reading without checking for timeout
 	float GetStoredReading() const noexcept { return lastTemperature; }
 
+	// Get a reading for the heater safety monitor without storing it. Sensors that can be read quickly override this, the others return the stored reading.
+	virtual TemperatureError GetFastReading(float& t) const noexcept;
+
 	// Return the sensor type
 	const char *GetSensorType() const { return sensorType; }
 
 	// Return the sensor number
 	unsigned int GetSensorNumber() const { return sensorNumber; }
 
+	// Return the result of the most recent reading without checking for timeout
+	TemperatureError GetLastResult() const noexcept { return lastResult; }
+
 	// Return the code for the most recent error
 	TemperatureError GetLastError() const { return lastRealError; }
 
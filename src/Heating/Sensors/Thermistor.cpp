@@ -12,9 +12,11 @@
 
 #include "Platform.h"
 #include "CanMessageGenericParser.h"
+#include <Heating/Heat.h>
 
 #if HAS_VREF_MONITOR
 # include <Hardware/NonVolatileMemory.h>
+# include <Hardware/NvmStore.h>
 #endif
 
 // The Steinhart-Hart equation for thermistor resistance is:
@@ -41,8 +43,9 @@ int32_t Thermistor::GetRawReading(bool& valid) const noexcept
 	{
 		// Filtered ADC channel
 		const volatile ThermistorAveragingFilter * const tempFilter = Platform::GetAdcFilter(adcFilterChannel);
-		valid = tempFilter->IsValid();
-		return tempFilter->GetSum()/(tempFilter->NumAveraged() >> AdcOversampleBits);
+		uint32_t sum;
+		valid = tempFilter->GetValidSum(sum);
+		return sum/(tempFilter->NumAveraged() >> AdcOversampleBits);
 	}
 
 	// Raw ADC channel
@@ -64,15 +67,26 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 		// We changed the port, so clear the ADC corrections and set up the ADC filter if there is one
 		adcLowOffset = adcHighOffset = 0;
 
+		if (adcFilterChannel >= 0)
+		{
+			Platform::GetAdcFilter(adcFilterChannel)->SetWindowCallback(nullptr, CallbackParameter(nullptr));
+		}
 		adcFilterChannel = Platform::GetAveragingFilterIndex(port);
 		if (adcFilterChannel >= 0)
 		{
 			Platform::GetAdcFilter(adcFilterChannel)->Init((1u << AnalogIn::AdcBits) - 1);
+			Platform::GetAdcFilter(adcFilterChannel)->SetWindowCallback(FilterWindowCallback, CallbackParameter((uint32_t)GetSensorNumber()));	// so that a heater can spin on new readings
 #if HAS_VREF_MONITOR
-			// Default the H and L parameters to the values from nonvolatile memory
+			// Default the H and L parameters to the values from nonvolatile memory. Older firmware stored them in the common NVM page, so use those if the store doesn't have them.
 			NonVolatileMemory mem(NvmPage::common);
-			adcLowOffset = mem.GetThermistorLowCalibration(adcFilterChannel);
-			adcHighOffset = mem.GetThermistorHighCalibration(adcFilterChannel);
+			if (!NvmStore::Read(NvmStore::KeyThermistorLowCalibration + adcFilterChannel, &adcLowOffset, sizeof(adcLowOffset)))
+			{
+				adcLowOffset = mem.GetThermistorLowCalibration(adcFilterChannel);
+			}
+			if (!NvmStore::Read(NvmStore::KeyThermistorHighCalibration + adcFilterChannel, &adcHighOffset, sizeof(adcHighOffset)))
+			{
+				adcHighOffset = mem.GetThermistorHighCalibration(adcFilterChannel);
+			}
 #endif
 		}
 	}
@@ -124,9 +138,7 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 						// Store the value in NVM
 //						if (!reprap.GetGCodes().IsRunningConfigFile())
 						{
-							NonVolatileMemory mem(NvmPage::common);
-							mem.SetThermistorLowCalibration(adcFilterChannel, adcLowOffset);
-							mem.EnsureWritten();
+							(void)NvmStore::Write(NvmStore::KeyThermistorLowCalibration + adcFilterChannel, &adcLowOffset, sizeof(adcLowOffset));
 						}
 					}
 					else
@@ -177,9 +189,7 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 					// Store the value in NVM
 //					if (!reprap.GetGCodes().IsRunningConfigFile())
 					{
-						NonVolatileMemory mem(NvmPage::common);
-						mem.SetThermistorHighCalibration(adcFilterChannel, adcHighOffset);
-						mem.EnsureWritten();
+						(void)NvmStore::Write(NvmStore::KeyThermistorHighCalibration + adcFilterChannel, &adcHighOffset, sizeof(adcHighOffset));
 					}
 				}
 				else
@@ -216,6 +226,11 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 		else
 		{
 			reply.catf(", T:%.1f B:%.1f C:%.2e R:%.1f", (double)r25, (double)beta, (double)shC, (double)seriesR);
+			if (tableValid)
+			{
+				reply.catf(", table %.0f-%.0fC max error %.2fC",
+							(double)TableMinTemperature, (double)(TableMinTemperature + TableTemperatureStep * (TableLength - 1)), (double)tableMaxError);
+			}
 		}
 		reply.catf(" L:%d H:%d", adcLowOffset, adcHighOffset);
 	}
@@ -225,6 +240,20 @@ GCodeResult Thermistor::Configure(const CanMessageGenericParser& parser, const S
 
 // Get the temperature
 void Thermistor::Poll()
+{
+	float t;
+	const TemperatureError rslt = Convert(t);
+	SetResult(t, rslt);
+}
+
+// Tell the Heat task that the sensor has new data. This is called by the ADC filter, so it may be in an ISR.
+/*static*/ void Thermistor::FilterWindowCallback(CallbackParameter cp) noexcept
+{
+	Heat::SensorDataReady(cp.u32);
+}
+
+// Convert the filtered ADC reading to a temperature without storing it, so that the heater safety monitor can also use this
+TemperatureError Thermistor::Convert(float& t) const noexcept
 {
 	bool tempFilterValid;
 	const int32_t averagedTempReading = GetRawReading(tempFilterValid);
@@ -249,13 +278,15 @@ void Thermistor::Poll()
 # if SAME5x		// SAMC21 uses 3.3V to feed VRef but we don't have it available to use a a reference voltage, so we use 5V instead
 		if (averagedVrefReading < OversampledAdcRange - maxDrop)
 		{
-			SetResult(TemperatureError::badVref);
+			t = BadErrorTemperature;
+			return TemperatureError::badVref;
 		}
 		else
 # endif
 			if (averagedVssaReading > maxDrop)
 		{
-			SetResult(TemperatureError::badVssa);
+			t = BadErrorTemperature;
+			return TemperatureError::badVssa;
 		}
 		else
 		{
@@ -268,52 +299,62 @@ void Thermistor::Poll()
 #if HAS_VREF_MONITOR
 			if (averagedVrefReading <= averagedTempReading)
 			{
-				SetResult((isPT1000) ? BadErrorTemperature : ABS_ZERO, TemperatureError::openCircuit);
+				t = (isPT1000) ? BadErrorTemperature : ABS_ZERO;
+				return TemperatureError::openCircuit;
 			}
 			else if (averagedTempReading <= averagedVssaReading)
 			{
-				SetResult(BadErrorTemperature, TemperatureError::shortCircuit);
+				t = BadErrorTemperature;
+				return TemperatureError::shortCircuit;
 			}
 			else
 			{
-				const float resistance = seriesR * (float)(averagedTempReading - averagedVssaReading)/(float)(averagedVrefReading - averagedTempReading);
+				const uint32_t adcRatio = ((uint32_t)(averagedTempReading - averagedVssaReading) << AdcRatioBits)/(uint32_t)(averagedVrefReading - averagedVssaReading);
 #else
 			const int32_t averagedVrefReading = OversampledAdcRange + adcHighOffset;
 			if (averagedVrefReading <= averagedTempReading)
 			{
-				SetResult((isPT1000) ? BadErrorTemperature : ABS_ZERO, TemperatureError::openCircuit);
+				t = (isPT1000) ? BadErrorTemperature : ABS_ZERO;
+				return TemperatureError::openCircuit;
 			}
 			else
 			{
-				const float denom = (float)(averagedVrefReading - averagedTempReading) - 0.5;
+				// Allow for the reading being rounded down
 				const int32_t averagedVssaReading = adcLowOffset;
-				float resistance = seriesR * ((float)(averagedTempReading - averagedVssaReading) + 0.5)/denom;
+				const uint32_t adcRatio = ((uint32_t)max<int32_t>(2 * (averagedTempReading - averagedVssaReading) + 1, 0) << (AdcRatioBits - 1))
+											/(uint32_t)(averagedVrefReading - averagedVssaReading);
 #endif
+				float temp;
 				if (isPT1000)
 				{
 					// We want 100 * the equivalent PT100 resistance, which is 10 * the actual PT1000 resistance
+					const float resistance = seriesR * (float)adcRatio/(float)((1u << AdcRatioBits) - adcRatio);
 					const uint16_t ohmsx100 = (uint16_t)lrintf(constrain<float>(resistance * 10, 0.0, 65535.0));
-					float t;
-					const TemperatureError sts = GetPT100Temperature(t, ohmsx100);
-					SetResult(t, sts);
+					return GetPT100Temperature(t, ohmsx100);
+				}
+				else if (LookupTemperature(adcRatio, temp))
+				{
+					t = temp;
+					return TemperatureError::success;
 				}
 				else
 				{
-					// Else it's a thermistor
-					const float logResistance = logf(resistance);
-					const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
-					const float temp = (recipT > 0.0) ? (1.0/recipT) + ABS_ZERO : BadErrorTemperature;
+					// Else it's a thermistor and the reading is outside the range of the lookup table
+					const float resistance = seriesR * (float)adcRatio/(float)((1u << AdcRatioBits) - adcRatio);
+					temp = CalcTemperature(resistance);
 
 					// It's hard to distinguish between an open circuit and a cold high-resistance thermistor.
 					// So we treat a temperature below -5C as an open circuit, unless we are using a low-resistance thermistor. The E3D thermistor has a resistance of about 470k @ -5C.
 					if (temp < MinimumConnectedTemperature && resistance > seriesR * 100)
 					{
 						// Assume thermistor is disconnected
-						SetResult(ABS_ZERO, TemperatureError::openCircuit);
+						t = ABS_ZERO;
+						return TemperatureError::openCircuit;
 					}
 					else
 					{
-						SetResult(temp, TemperatureError::success);
+						t = temp;
+						return TemperatureError::success;
 					}
 				}
 			}
@@ -322,16 +363,95 @@ void Thermistor::Poll()
 	else
 	{
 		// Filter is not ready yet
-		SetResult(TemperatureError::notReady);
+		t = BadErrorTemperature;
+		return TemperatureError::notReady;
+	}
+}
+
+// Convert a thermistor resistance to a temperature using the Steinhart-Hart equation
+float Thermistor::CalcTemperature(float resistance) const noexcept
+{
+	const float logResistance = logf(resistance);
+	const float recipT = shA + shB * logResistance + shC * logResistance * logResistance * logResistance;
+	return (recipT > 0.0) ? (1.0/recipT) + ABS_ZERO : BadErrorTemperature;
+}
+
+// Convert a temperature to a thermistor resistance. We need to solve the cubic equation for ln(R), which we do using Newton-Raphson iteration
+// starting from the solution with C=0. Only called when the parameters are changed, so speed doesn't matter.
+float Thermistor::CalcResistance(float temperature) const noexcept
+{
+	const float k = shA - 1.0/(temperature - ABS_ZERO);
+	float logResistance = -k/shB;
+	for (unsigned int i = 0; i < 4; ++i)
+	{
+		const float f = k + shB * logResistance + shC * logResistance * logResistance * logResistance;
+		logResistance -= f/(shB + 3.0 * shC * logResistance * logResistance);
 	}
+	return expf(logResistance);
 }
 
-// Calculate shA and shB from the other parameters
+// If the ADC ratio is within the range of the lookup table, use linear interpolation to convert it to a temperature and return true
+bool Thermistor::LookupTemperature(uint32_t adcRatio, float& temperature) const noexcept
+{
+	if (!tableValid || adcRatio > adcRatioTable[0] || adcRatio <= adcRatioTable[TableLength - 1])
+	{
+		return false;
+	}
+
+	// Binary search for the table entries either side of the reading, such that adcRatioTable[low] >= adcRatio > adcRatioTable[high]
+	size_t low = 0, high = TableLength - 1;
+	while (high - low > 1)
+	{
+		const size_t mid = (low + high)/2;
+		if (adcRatioTable[mid] >= adcRatio)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	const float fraction = (float)(adcRatioTable[low] - adcRatio)/(float)(adcRatioTable[low] - adcRatioTable[high]);
+	temperature = TableMinTemperature + TableTemperatureStep * ((float)low + fraction);
+	return true;
+}
+
+// Calculate shA and shB from the other parameters, then build the lookup table and check its accuracy
 void Thermistor::CalcDerivedParameters()
 {
 	shB = 1.0/beta;
 	const float lnR25 = logf(r25);
 	shA = 1.0/(25.0 - ABS_ZERO) - shB * lnR25 - shC * lnR25 * lnR25 * lnR25;
+
+	tableValid = false;
+	tableMaxError = 0.0;
+	if (isPT1000)
+	{
+		return;
+	}
+
+	constexpr float FullScale = (float)(1u << AdcRatioBits);
+	for (size_t i = 0; i < TableLength; ++i)
+	{
+		const float resistance = CalcResistance(TableMinTemperature + TableTemperatureStep * (float)i);
+		const float ratio = resistance/(resistance + seriesR);
+		adcRatioTable[i] = (uint16_t)constrain<long>(lrintf(ratio * FullScale), 0, (1u << AdcRatioBits) - 1);
+		if (i != 0 && adcRatioTable[i] >= adcRatioTable[i - 1])
+		{
+			return;														// the table must be strictly decreasing, so we can't use it with these parameters
+		}
+	}
+
+	// Check the error at the midpoint of each interval, where it is likely to be greatest
+	for (size_t i = 0; i + 1 < TableLength; ++i)
+	{
+		const float midRatio = 0.5 * ((float)adcRatioTable[i] + (float)adcRatioTable[i + 1]);
+		const float exactTemperature = CalcTemperature(seriesR * midRatio/(FullScale - midRatio));
+		const float tableTemperature = TableMinTemperature + TableTemperatureStep * ((float)i + 0.5);
+		tableMaxError = max<float>(tableMaxError, fabsf(exactTemperature - tableTemperature));
+	}
+	tableValid = true;
 }
 
 #endif	//SUPPORT_THERMISTORS
@@ -31,13 +31,26 @@ public:
 	static constexpr const char *TypeNamePT1000 = "pt1000";
 
 	void Poll() override;
+	TemperatureError GetFastReading(float& t) const noexcept override { return Convert(t); }
 
 private:
 	// For the theory behind ADC oversampling, see http://www.atmel.com/Images/doc8003.pdf
 	static constexpr unsigned int AdcOversampleBits = 2;					// we use 2-bit oversampling
 
-	void CalcDerivedParameters();											// calculate shA and shB
+	// The lookup table gives the ADC reading ratio at regular temperature intervals, so the table entries decrease as the temperature increases.
+	// Readings outside the range of the table are converted using the Steinhart-Hart equation.
+	static constexpr float TableMinTemperature = 0.0;
+	static constexpr float TableTemperatureStep = 5.0;
+	static constexpr size_t TableLength = 81;								// covers 0C to 400C
+	static constexpr unsigned int AdcRatioBits = 16;						// the ADC ratio is the thermistor voltage as a fraction of the reference voltage in this many bits
+
+	static void FilterWindowCallback(CallbackParameter cp) noexcept;		// called when our ADC filter has a completely new average
+	TemperatureError Convert(float& t) const noexcept;						// convert the ADC reading to a temperature
+	void CalcDerivedParameters();											// calculate shA and shB and build the lookup table
 	int32_t GetRawReading(bool& valid) const noexcept;						// get the ADC reading
+	float CalcTemperature(float resistance) const noexcept;					// convert a thermistor resistance to a temperature using the Steinhart-Hart equation
+	float CalcResistance(float temperature) const noexcept;					// convert a temperature to a thermistor resistance
+	bool LookupTemperature(uint32_t adcRatio, float& temperature) const noexcept;
 
 	// The following are configurable parameters
 	int adcFilterChannel;
@@ -47,6 +60,9 @@ private:
 
 	// The following are derived from the configurable parameters
 	float shA, shB;															// derived parameters
+	float tableMaxError;													// the largest interpolation error that we found when we built the table
+	uint16_t adcRatioTable[TableLength];									// the ADC ratio at each table temperature
+	bool tableValid;
 
 	static constexpr int32_t OversampledAdcRange = 1u << (AnalogIn::AdcBits + AdcOversampleBits);	// The readings we pass in should be in range 0..(AdcRange - 1)
 };
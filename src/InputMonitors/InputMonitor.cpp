@@ -8,9 +8,15 @@
 #include "InputMonitor.h"
 
 #include <CanMessageFormats.h>
+#include <IsrProfiler.h>
 #include <Hardware/IoPorts.h>
 #include <CAN/CanInterface.h>
 #include <CanMessageBuffer.h>
+#include <Platform.h>
+
+#if SUPPORT_DRIVERS
+# include <Movement/Move.h>
+#endif
 
 InputMonitor * volatile InputMonitor::monitorsList = nullptr;
 InputMonitor * volatile InputMonitor::freeList = nullptr;
@@ -32,7 +38,9 @@ bool InputMonitor::Activate() noexcept
 		else
 		{
 			// Analog port
-			state = port.ReadAnalog() >= threshold;
+			const uint16_t reading = port.ReadAnalog();
+			analogFilterAccumulator = (uint32_t)reading << analogFilterShift;
+			state = reading >= threshold;
 #ifdef ATEIO
 			// We can't set an interrupt on the extended analog channels
 			if (IsExtendedAnalogPin(port.GetPin()))
@@ -69,31 +77,107 @@ uint16_t InputMonitor::GetAnalogValue() const noexcept
 				: 0;
 }
 
+// Record a state change. Called from the ISR.
+void InputMonitor::RecordChange(bool newState) noexcept
+{
+	state = newState;
+	if (active)
+	{
+		// Do an emergency stop first, because its latency is what matters most
+		if (newState && emergencyStop)
+		{
+			Platform::EmergencyStopFromInput(StepTimer::GetTimerTicks());
+		}
+
+#if SUPPORT_DRIVERS
+		// If the input has triggered and it is bound to local drivers, stop them now instead of waiting for the main board to tell us to
+		if (newState && !localStopDrivers.IsEmpty())
+		{
+			DriversBitmap stopped;
+			localStopDrivers.Iterate([this, &stopped](unsigned int driver, unsigned int) noexcept
+										{
+											if (moveInstance->StopDriverLocally(driver, stopSteps[driver]))
+											{
+												stopped.SetBit(driver);
+											}
+										}
+									);
+			stoppedDrivers = stopped;
+		}
+#endif
+		const size_t writeIndex = changeLogWriteIndex;
+		const size_t nextWriteIndex = (writeIndex + 1) & (ChangeLogLength - 1);
+		if (nextWriteIndex != changeLogReadIndex)
+		{
+			changeLog[writeIndex].when = StepTimer::GetTimerTicks();
+			changeLog[writeIndex].state = newState;
+			changeLogWriteIndex = nextWriteIndex;
+		}
+		else
+		{
+			// The log is full, so update the newest entry so that we still end up reporting the latest state
+			changeLog[(writeIndex - 1) & (ChangeLogLength - 1)].state = newState;
+			++numLogOverflows;
+		}
+		sendDue = true;
+		CanInterface::WakeAsyncSenderFromIsr();
+	}
+}
+
+// Get the next state change to report, discarding pairs of changes caused by contact bounce. Return true if there is another change after it.
+// Called by the async sender task when sendDue is set. Clears sendDue unless there are more changes to report.
+bool InputMonitor::GetNextChange(bool& newState) noexcept
+{
+	InterruptCriticalSectionLocker ilock;
+	for (;;)
+	{
+		const size_t numChanges = (changeLogWriteIndex - changeLogReadIndex) & (ChangeLogLength - 1);
+		if (numChanges == 0)
+		{
+			newState = state;
+			sendDue = false;
+			return false;
+		}
+
+		const StateChange& change = changeLog[changeLogReadIndex];
+		const size_t nextIndex = (changeLogReadIndex + 1) & (ChangeLogLength - 1);
+		if (numChanges >= 2 && changeLog[nextIndex].when - change.when < BounceTicks && changeLog[nextIndex].state != change.state)
+		{
+			changeLogReadIndex = (nextIndex + 1) & (ChangeLogLength - 1);
+			++numBouncesFiltered;
+			continue;
+		}
+
+		newState = change.state;
+		changeLogReadIndex = nextIndex;
+		sendDue = (numChanges >= 2);
+		return numChanges >= 2;
+	}
+}
+
 void InputMonitor::DigitalInterrupt() noexcept
 {
 	const bool newState = port.ReadDigital();
 	if (newState != state)
 	{
-		state = newState;
-		if (active)
-		{
-			sendDue = true;
-			CanInterface::WakeAsyncSenderFromIsr();
-		}
+		RecordChange(newState);
 	}
 }
 
+// Called from the ADC callback with each new reading. We apply hysteresis so that noise on a slowly changing signal such as an IR probe doesn't generate a burst of changes.
+// An analog Z probe can also use a short IIR filter instead of relying on a large hysteresis. This responds within a few readings, so it doesn't limit the probing speed
+// the way averaging a block of readings would, and a trigger still stops any bound local drivers from this callback.
 void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 {
-	const bool newState = reading >= threshold;
+	if (analogFilterShift != 0)
+	{
+		analogFilterAccumulator += reading - (analogFilterAccumulator >> analogFilterShift);
+		reading = (uint16_t)(analogFilterAccumulator >> analogFilterShift);
+	}
+	const bool newState = (state) ? reading + hysteresis >= threshold : reading >= threshold;
 	if (newState != state)
 	{
-		state = newState;
-		if (active)
-		{
-			sendDue = true;
-			CanInterface::WakeAsyncSenderFromIsr();
-		}
+		RecordChange(newState);
 	}
 }
 
@@ -104,12 +188,16 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 
 /*static*/ void InputMonitor::CommonDigitalPortInterrupt(CallbackParameter cbp) noexcept
 {
+	ISR_PROFILE_ENTER();
 	static_cast<InputMonitor*>(cbp.vp)->DigitalInterrupt();
+	ISR_PROFILE_EXIT(pinInterrupt);
 }
 
 /*static*/ void InputMonitor::CommonAnalogPortInterrupt(CallbackParameter cbp, uint16_t reading) noexcept
 {
+	ISR_PROFILE_ENTER();
 	static_cast<InputMonitor*>(cbp.vp)->AnalogInterrupt(reading);
+	ISR_PROFILE_EXIT(adcCallback);
 }
 
 /*static*/ ReadLockedPointer<InputMonitor> InputMonitor::Find(uint16_t hndl) noexcept
@@ -175,7 +263,17 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	newMonitor->state = false;
 	newMonitor->minInterval = msg.minInterval;
 	newMonitor->threshold = msg.threshold;
+	newMonitor->hysteresis = msg.threshold >> AnalogHysteresisShift;
+	newMonitor->analogFilterShift = 0;
+	newMonitor->analogFilterAccumulator = 0;
 	newMonitor->sendDue = false;
+	newMonitor->changeLogWriteIndex = newMonitor->changeLogReadIndex = 0;
+	newMonitor->numBouncesFiltered = newMonitor->numLogOverflows = 0;
+	newMonitor->emergencyStop = false;
+#if SUPPORT_DRIVERS
+	newMonitor->localStopDrivers.Clear();
+	newMonitor->stoppedDrivers.Clear();
+#endif
 	String<StringLength50> pinName;
 	pinName.copy(msg.pinName, msg.GetMaxPinNameLength(dataLength));
 	if (newMonitor->port.AssignPort(pinName.c_str(), reply, PinUsedBy::endstop, (msg.threshold == 0) ? PinAccess::read : PinAccess::readAnalog))
@@ -233,12 +331,24 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 
 	case CanMessageChangeInputMonitor::actionReturnPinName:
 		m->port.AppendPinName(reply);
-		reply.catf(", min interval %ums", m->minInterval);
+		reply.catf(", min interval %ums, bounces filtered %" PRIu32 ", log overflows %" PRIu32, m->minInterval, m->numBouncesFiltered, m->numLogOverflows);
+		if (m->threshold != 0)
+		{
+			reply.catf(", threshold %u hysteresis %u filter %u", m->threshold, m->hysteresis, 1u << m->analogFilterShift);
+		}
+#if SUPPORT_DRIVERS
+		m->stoppedDrivers.Iterate([&m, &reply](unsigned int driver, unsigned int) noexcept
+									{
+										reply.catf(", driver %u stopped after %" PRIi32 " steps", driver, m->stopSteps[driver]);
+									}
+								 );
+#endif
 		rslt = GCodeResult::ok;
 		break;
 
 	case CanMessageChangeInputMonitor::actionChangeThreshold:
 		m->threshold = msg.param;
+		m->hysteresis = msg.param >> AnalogHysteresisShift;
 		rslt = GCodeResult::ok;
 		break;
 
@@ -257,6 +367,83 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 	return rslt;
 }
 
+#if SUPPORT_DRIVERS
+
+// Bind or unbind a local driver to an input monitor, so that the driver is stopped in the ISR as soon as the input triggers.
+// This is for endstops and Z probes connected to the same board as the motors, where the CAN round trip would otherwise limit the accuracy.
+/*static*/ GCodeResult InputMonitor::SetLocalStopDriver(uint16_t hndl, size_t driver, bool enable, const StringRef& reply) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+
+	InterruptCriticalSectionLocker ilock;
+	if (enable)
+	{
+		m->localStopDrivers.SetBit(driver);
+	}
+	else
+	{
+		m->localStopDrivers.ClearBit(driver);
+	}
+	return GCodeResult::ok;
+}
+
+#endif
+
+// Bind an input monitor to emergency stop, so that when it triggers we disable the drivers from the ISR without waiting for the main board
+/*static*/ GCodeResult InputMonitor::SetEmergencyStop(uint16_t hndl, bool enable, const StringRef& reply) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+
+	m->emergencyStop = enable;
+	if (enable && m->active && m->state)
+	{
+		// The input is already triggered, so stop now instead of waiting for it to change
+		Platform::EmergencyStopFromInput(StepTimer::GetTimerTicks());
+		reply.copy("Emergency stop input is already triggered");
+		return GCodeResult::warning;
+	}
+	return GCodeResult::ok;
+}
+
+// Set the IIR filter time constant of an analog input monitor to 2^shift readings
+/*static*/ GCodeResult InputMonitor::SetAnalogFilter(uint16_t hndl, unsigned int shift, const StringRef& reply) noexcept
+{
+	auto m = Find(hndl);
+	if (m.IsNull())
+	{
+		reply.printf("Board %u does not have input handle %04x", CanInterface::GetCanAddress(), hndl);
+		return GCodeResult::error;
+	}
+	if (m->threshold == 0)
+	{
+		reply.copy("Input is not analog");
+		return GCodeResult::error;
+	}
+	if (shift > MaxAnalogFilterShift)
+	{
+		reply.printf("Filter shift must be 0 to %u", MaxAnalogFilterShift);
+		return GCodeResult::error;
+	}
+
+	{
+		InterruptCriticalSectionLocker ilock;
+		m->analogFilterAccumulator = (m->analogFilterAccumulator >> m->analogFilterShift) << shift;
+		m->analogFilterShift = shift;
+	}
+	reply.printf("Input %04x filter time constant %u readings", hndl, 1u << shift);
+	return GCodeResult::ok;
+}
+
 // Check the input monitors and add any pending ones to the message
 // Return the number of ticks before we should be woken again, or TaskBase::TimeoutUnlimited if we shouldn't be work until an input changes state
 /*static*/ uint32_t InputMonitor::AddStateChanges(CanMessageInputChanged *msg) noexcept
@@ -272,19 +459,21 @@ void InputMonitor::AnalogInterrupt(uint16_t reading) noexcept
 			const uint32_t age = now - p->whenLastSent;
 			if (age >= p->minInterval)
 			{
+				// Report the changes in the order they happened, one per message, so that a short pulse isn't lost
+				const uint8_t savedReadIndex = p->changeLogReadIndex;
 				bool monitorState;
-				{
-					InterruptCriticalSectionLocker ilock;
-					p->sendDue = false;
-					monitorState = p->state;
-				}
-
+				const bool moreChanges = p->GetNextChange(monitorState);
 				if (msg->AddEntry(p->handle, monitorState))
 				{
 					p->whenLastSent = now;
+					if (moreChanges && p->minInterval < timeToWait)
+					{
+						timeToWait = max<uint32_t>(p->minInterval, 1);
+					}
 				}
 				else
 				{
+					p->changeLogReadIndex = savedReadIndex;
 					p->sendDue = true;
 					return 1;
 				}
@@ -11,6 +11,7 @@
 #include <RepRapFirmware.h>
 #include <Hardware/IoPorts.h>
 #include <RTOSIface/RTOSIface.h>
+#include <Movement/StepTimer.h>
 
 struct CanMessageCreateInputMonitor;
 struct CanMessageChangeInputMonitor;
@@ -30,6 +31,12 @@ public:
 	static uint32_t AddStateChanges(CanMessageInputChanged *msg) noexcept;
 	static void ReadInputs(CanMessageBuffer *buf) noexcept;
 
+#if SUPPORT_DRIVERS
+	static GCodeResult SetLocalStopDriver(uint16_t hndl, size_t driver, bool enable, const StringRef& reply) noexcept;
+#endif
+	static GCodeResult SetAnalogFilter(uint16_t hndl, unsigned int shift, const StringRef& reply) noexcept;
+	static GCodeResult SetEmergencyStop(uint16_t hndl, bool enable, const StringRef& reply) noexcept;
+
 	static void CommonDigitalPortInterrupt(CallbackParameter cbp) noexcept;
 	static void CommonAnalogPortInterrupt(CallbackParameter cbp, uint16_t reading) noexcept;
 
@@ -38,20 +45,48 @@ private:
 	void Deactivate() noexcept;
 	void DigitalInterrupt() noexcept;
 	void AnalogInterrupt(uint16_t reading) noexcept;
+	void RecordChange(bool newState) noexcept;
+	bool GetNextChange(bool& newState) noexcept;
 	uint16_t GetAnalogValue() const noexcept;
 
 	static bool Delete(uint16_t hndl) noexcept;
 	static ReadLockedPointer<InputMonitor> Find(uint16_t hndl) noexcept;
 
+	// Each state change is logged with the step timer value in the ISR, so that rapid transitions are reported in order instead of just the latest state
+	struct StateChange
+	{
+		uint32_t when;
+		bool state;
+	};
+
+	static constexpr unsigned int AnalogHysteresisShift = 5;			// the default hysteresis of an analog input is 1/32 of its threshold
+	static constexpr unsigned int MaxAnalogFilterShift = 6;				// the longest IIR filter time constant is 64 readings
+	static constexpr size_t ChangeLogLength = 8;						// must be a power of 2
+	static constexpr uint32_t BounceTicks = StepTimer::StepClockRate/2000;	// a pair of changes closer together than this (0.5ms) that restores the previous state is treated as contact bounce
+
 	InputMonitor *next;
 	IoPort port;
+	StateChange changeLog[ChangeLogLength];
 	uint32_t whenLastSent;
+	uint32_t numBouncesFiltered;
+	uint32_t numLogOverflows;
+#if SUPPORT_DRIVERS
+	DriversBitmap localStopDrivers;										// local drivers that we stop as soon as this input triggers, without waiting for the main board
+	DriversBitmap stoppedDrivers;										// the local drivers that we stopped at the last trigger
+	int32_t stopSteps[NumDrivers];										// how many steps each of those drivers had taken in the move when we stopped it
+#endif
 	uint16_t handle;
 	uint16_t minInterval;
+	uint32_t analogFilterAccumulator;									// the IIR filtered analog reading scaled by 2^analogFilterShift
 	uint16_t threshold;
+	uint16_t hysteresis;												// an analog input must fall this far below the threshold before we report it as off
+	uint8_t analogFilterShift;											// the IIR filter time constant is 2^analogFilterShift readings, zero means no filtering
 	bool active;
+	bool emergencyStop;													// true if this input triggering stops the drivers and heaters and resets the board
 	volatile bool state;
 	volatile bool sendDue;
+	volatile uint8_t changeLogWriteIndex;
+	uint8_t changeLogReadIndex;
 
 	static InputMonitor * volatile monitorsList;
 	static InputMonitor * volatile freeList;
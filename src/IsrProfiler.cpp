@@ -0,0 +1,69 @@
+/*
+ * IsrProfiler.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "IsrProfiler.h"
+
+#if SUPPORT_ISR_PROFILING
+
+namespace IsrProfiler
+{
+#if SAME5x
+	constexpr uint32_t TimestampRate = SystemCoreClockFreq;
+#else
+	constexpr uint32_t TimestampRate = StepTimer::StepClockRate;
+#endif
+
+	struct IsrStats
+	{
+		uint64_t totalTime;								// in timestamp units, 64 bits because the cycle counter would overflow 32 bits in about 36 seconds
+		uint32_t maxTime;
+		uint32_t count;
+	};
+
+	static IsrStats stats[(size_t)IsrSource::numSources];
+	static uint32_t whenLastReset = 0;					// millis
+	static const char * const SourceNames[(size_t)IsrSource::numSources] = { "step", "TMC DMA", "pin", "ADC" };
+}
+
+// Record the time spent in an interrupt. A higher priority interrupt may update the stats for a different source while we are updating these.
+void IsrProfiler::Record(IsrSource source, LatencyHistograms::Timestamp startTime) noexcept
+{
+	const uint32_t elapsed = LatencyHistograms::GetTimestamp() - startTime;
+	IsrStats& s = stats[(size_t)source];
+	s.totalTime += elapsed;
+	++s.count;
+	if (elapsed > s.maxTime)
+	{
+		s.maxTime = elapsed;
+	}
+}
+
+void IsrProfiler::Diagnostics(const StringRef& reply) noexcept
+{
+	const uint32_t now = millis();
+	const uint32_t window = now - whenLastReset;
+	whenLastReset = now;
+	reply.lcatf("ISR time in last %.1fs (us total/max/count, %% cpu):", (double)((float)window * 0.001));
+	for (size_t i = 0; i < (size_t)IsrSource::numSources; ++i)
+	{
+		IsrStats s;
+		{
+			AtomicCriticalSectionLocker lock;
+			s = stats[i];
+			stats[i].totalTime = 0;
+			stats[i].maxTime = stats[i].count = 0;
+		}
+		const float totalMicroseconds = (float)s.totalTime * (1.0e6/(float)TimestampRate);
+		reply.catf("%s %s %.0f/%.1f/%" PRIu32 " %.2f%%", (i == 0) ? "" : ",",
+					SourceNames[i], (double)totalMicroseconds, (double)((float)s.maxTime * (1.0e6/(float)TimestampRate)), s.count,
+					(double)((window == 0) ? 0.0 : totalMicroseconds * 0.1/(float)window));
+	}
+}
+
+#endif
+
+// End
@@ -0,0 +1,44 @@
+/*
+ * IsrProfiler.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_ISRPROFILER_H_
+#define SRC_ISRPROFILER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_ISR_PROFILING
+
+#include <LatencyHistograms.h>
+
+// The interrupt sources that we profile. The CAN and ADC interrupt handlers are in CoreN2G, so we can only time the callbacks that they make to us.
+enum class IsrSource : uint8_t
+{
+	stepTimer = 0,
+	tmcDma,
+	pinInterrupt,										// EIC callbacks from input monitors, filament monitors and fan tachos
+	adcCallback,
+	numSources
+};
+
+// Module to record how much time each interrupt source uses. The times include any time spent in higher priority interrupts that preempt the one being timed.
+namespace IsrProfiler
+{
+	void Record(IsrSource source, LatencyHistograms::Timestamp startTime) noexcept SPEED_CRITICAL;
+	void Diagnostics(const StringRef& reply) noexcept;					// append the statistics since the last call and reset them
+}
+
+# define ISR_PROFILE_ENTER()		const LatencyHistograms::Timestamp isrProfileStartTime = LatencyHistograms::GetTimestamp()
+# define ISR_PROFILE_EXIT(_src)		IsrProfiler::Record(IsrSource::_src, isrProfileStartTime)
+
+#else
+
+# define ISR_PROFILE_ENTER()		(void)0
+# define ISR_PROFILE_EXIT(_src)		(void)0
+
+#endif
+
+#endif /* SRC_ISRPROFILER_H_ */
@@ -0,0 +1,98 @@
+/*
+ * LatencyHistograms.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "LatencyHistograms.h"
+
+namespace LatencyHistograms
+{
+	constexpr size_t NumBuckets = 16;
+#if SAME5x
+	constexpr unsigned int TimestampShift = 7;										// we bucket the cycle count in units of 128 cycles, about 1.07us at 120MHz
+	constexpr uint32_t NanosecondsPerUnit = (1000000000ull << TimestampShift)/SystemCoreClockFreq;
+#else
+	constexpr unsigned int TimestampShift = 0;										// we bucket the step timer ticks directly, 1.33us each
+	constexpr uint32_t NanosecondsPerUnit = 1000000000ull/StepTimer::StepClockRate;
+#endif
+
+	struct Histogram
+	{
+		uint32_t counts[NumBuckets];
+		uint32_t maxDuration;														// in units of 2^TimestampShift timestamp counts
+	};
+
+	static Histogram histograms[(size_t)LatencyProbe::numProbes];
+	static const char * const ProbeNames[(size_t)LatencyProbe::numProbes] = { "Move ISR", "Control loop", "Heat task", "CAN receive", "TMC transfer" };
+
+	// Convert a number of units to microseconds rounded up, for reporting the bucket limits
+	static uint32_t UnitsToMicroseconds(uint32_t units) noexcept
+	{
+		return (units * NanosecondsPerUnit + 999)/1000;
+	}
+}
+
+void LatencyHistograms::Init() noexcept
+{
+#if SAME5x
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;									// enable the trace and debug blocks, including the cycle counter
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	memset(histograms, 0, sizeof(histograms));
+}
+
+void LatencyHistograms::Record(LatencyProbe probe, Timestamp startTime) noexcept
+{
+	const uint32_t duration = (GetTimestamp() - startTime) >> TimestampShift;
+	Histogram& h = histograms[(size_t)probe];
+	const size_t bucket = (duration == 0) ? 0 : min<size_t>(32 - __builtin_clz(duration), NumBuckets - 1);
+	++h.counts[bucket];
+	if (duration > h.maxDuration)
+	{
+		h.maxDuration = duration;
+	}
+}
+
+uint32_t LatencyHistograms::GetMaxMicroseconds(LatencyProbe probe) noexcept
+{
+	return UnitsToMicroseconds(histograms[(size_t)probe].maxDuration);
+}
+
+// Append the histograms that have any data. We only report the nonzero buckets, giving the upper limit of each one, to keep the reply short.
+void LatencyHistograms::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Latency histograms (bucket upper limit us: count):");
+	for (size_t i = 0; i < (size_t)LatencyProbe::numProbes; ++i)
+	{
+		Histogram h = histograms[i];
+		memset(&histograms[i], 0, sizeof(histograms[i]));
+		uint32_t total = 0;
+		for (uint32_t c : h.counts)
+		{
+			total += c;
+		}
+		if (total != 0)
+		{
+			reply.lcatf("%s n=%" PRIu32 " max %" PRIu32 "us:", ProbeNames[i], total, UnitsToMicroseconds(h.maxDuration));
+			for (size_t bucket = 0; bucket < NumBuckets; ++bucket)
+			{
+				if (h.counts[bucket] != 0)
+				{
+					if (bucket + 1 == NumBuckets)
+					{
+						reply.catf(" more %" PRIu32, h.counts[bucket]);
+					}
+					else
+					{
+						reply.catf(" %" PRIu32 ":%" PRIu32, UnitsToMicroseconds(1u << bucket), h.counts[bucket]);
+					}
+				}
+			}
+		}
+	}
+}
+
+// End
@@ -0,0 +1,47 @@
+/*
+ * LatencyHistograms.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_LATENCYHISTOGRAMS_H_
+#define SRC_LATENCYHISTOGRAMS_H_
+
+#include <RepRapFirmware.h>
+#include <Movement/StepTimer.h>
+
+// Named probes. Each probe must only be recorded from one task or ISR, so that we don't need a critical section to update it.
+enum class LatencyProbe : uint8_t
+{
+	moveInterrupt = 0,
+	controlLoop,
+	heatTaskLoop,
+	canReceiver,
+	tmcTransfer,
+	numProbes
+};
+
+// Module to collect histograms of how long sections of code take to run, so that we can see the tail behaviour and not just the maximum.
+// Bucket 0 counts zero durations and bucket n counts durations from 2^(n-1) to 2^n - 1 time units. The last bucket also counts all longer durations.
+namespace LatencyHistograms
+{
+	typedef uint32_t Timestamp;
+
+	void Init() noexcept;
+	void Record(LatencyProbe probe, Timestamp startTime) noexcept;			// record the time since startTime, safe to call from an ISR
+	void Diagnostics(const StringRef& reply) noexcept;						// append the histograms and reset them
+	uint32_t GetMaxMicroseconds(LatencyProbe probe) noexcept;				// return the longest duration recorded since the last Diagnostics call
+
+	// Get a timestamp to pass to Record. On the SAME5x we use the cycle counter. The SAMC21 doesn't have one, so we use the step timer.
+	inline Timestamp GetTimestamp() noexcept
+	{
+#if SAME5x
+		return DWT->CYCCNT;
+#else
+		return StepTimer::GetTimerTicks();
+#endif
+	}
+}
+
+#endif /* SRC_LATENCYHISTOGRAMS_H_ */
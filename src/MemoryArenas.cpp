@@ -0,0 +1,64 @@
+/*
+ * MemoryArenas.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "MemoryArenas.h"
+#include <Tasks.h>
+
+namespace MemoryArenas
+{
+	static size_t bytesUsed[(size_t)MemoryArena::numArenas] = { 0 };
+	static Scope *currentScope = nullptr;
+
+	static const char * const ArenaNames[(size_t)MemoryArena::numArenas] = { "move", "closed loop", "heat", "CAN buffers", "sensors", "data capture" };
+
+	// The budgets from the board configuration file, zero means no budget
+	static constexpr size_t Budgets[(size_t)MemoryArena::numArenas] =
+	{
+		MEMORY_BUDGET_MOVEMENT, MEMORY_BUDGET_CLOSED_LOOP, MEMORY_BUDGET_HEAT, MEMORY_BUDGET_CAN_BUFFERS, MEMORY_BUDGET_SENSORS, MEMORY_BUDGET_DATA_CAPTURE
+	};
+}
+
+MemoryArenas::Scope::Scope(MemoryArena p_arena) noexcept
+	: parent(currentScope), neverUsedAtStart(Tasks::GetNeverUsedRam()), childBytes(0), arena(p_arena)
+{
+	currentScope = this;
+}
+
+MemoryArenas::Scope::~Scope() noexcept
+{
+	const ptrdiff_t used = neverUsedAtStart - Tasks::GetNeverUsedRam();
+	if (used > 0)
+	{
+		if ((size_t)used > childBytes)
+		{
+			bytesUsed[(size_t)arena] += (size_t)used - childBytes;
+		}
+		if (parent != nullptr)
+		{
+			parent->childBytes += (size_t)used;
+		}
+	}
+	currentScope = parent;
+}
+
+void MemoryArenas::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("RAM used by:");
+	size_t total = 0;
+	for (size_t i = 0; i < (size_t)MemoryArena::numArenas; ++i)
+	{
+		reply.catf("%s %s %u", (i == 0) ? "" : ",", ArenaNames[i], bytesUsed[i]);
+		if (Budgets[i] != 0)
+		{
+			reply.catf("/%u%s", Budgets[i], (bytesUsed[i] > Budgets[i]) ? " OVER BUDGET" : "");
+		}
+		total += bytesUsed[i];
+	}
+	reply.catf(", total %u, never used %d", total, Tasks::GetNeverUsedRam());
+}
+
+// End
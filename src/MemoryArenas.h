@@ -0,0 +1,50 @@
+/*
+ * MemoryArenas.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MEMORYARENAS_H_
+#define SRC_MEMORYARENAS_H_
+
+#include <RepRapFirmware.h>
+
+// The subsystems that we account memory usage to
+enum class MemoryArena : uint8_t
+{
+	movement = 0,
+	closedLoop,
+	heat,
+	canBuffers,
+	sensors,
+	dataCapture,
+	numArenas
+};
+
+// Module to record how much RAM each subsystem takes from the heap, so that we can see which features fit on the boards with less RAM.
+// We measure how much the never-used RAM decreases while a scope is active, so both malloc and Tasks::AllocPermanent allocations are counted.
+// Memory that malloc reuses from its free list is not counted. Scopes may be nested, in which case memory is charged to the innermost one only.
+// Scopes must only be created by the main task, which is the only task that creates objects after initialisation.
+namespace MemoryArenas
+{
+	class Scope
+	{
+	public:
+		explicit Scope(MemoryArena p_arena) noexcept;
+		~Scope() noexcept;
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		Scope *parent;
+		ptrdiff_t neverUsedAtStart;
+		size_t childBytes;
+		MemoryArena arena;
+	};
+
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif /* SRC_MEMORYARENAS_H_ */
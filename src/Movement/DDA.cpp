@@ -14,6 +14,10 @@
 #include "Kinematics/LinearDeltaKinematics.h"		// for DELTA_AXES
 #include "CanMessageFormats.h"
 #include <CAN/CanInterface.h>
+#include <LatencyHistograms.h>
+#include "FirstStepStats.h"
+#include "MoveShapeCache.h"
+#include <CommandProcessing/ScheduledSettings.h>
 #include <limits>
 
 #ifdef DUET_NG
@@ -88,6 +92,15 @@ unsigned int DDA::stepErrors = 0;
 uint32_t DDA::maxTicksOverdue = 0;
 uint32_t DDA::maxOverdueIncrement = 0;
 
+#if !SINGLE_DRIVER
+uint32_t DDA::stepCoalesceClocks = StepTimer::MinInterruptInterval;
+uint32_t DDA::stepsCoalesced = 0;
+uint32_t DDA::maxCoalesceError = 0;
+#endif
+
+float DDA::stopDecelerations[NumDrivers] = { 0.0 };
+uint32_t DDA::numControlledStops = 0;
+
 uint32_t DDA::stepsRequested[NumDrivers];
 uint32_t DDA::stepsDone[NumDrivers];
 
@@ -96,8 +109,14 @@ DDA::DDA(DDA* n) : next(n), prev(nullptr), state(empty)
 	for (size_t i = 0; i < NumDrivers; ++i)
 	{
 		endPoint[i] = 0;
+#if SUPPORT_AUTO_MICROSTEPPING
+		stepShifts[i] = 0;
+#endif
 		ddms[i].state = DMState::idle;
 		ddms[i].drive = i;
+#if !SINGLE_DRIVER
+		dmNextStepTimes[i] = DriveMovement::NoStepTime;
+#endif
 	}
 }
 
@@ -111,41 +130,6 @@ pre(state == executing || state == frozen || state == completed)
 			: (int32_t)clocksNeeded;
 }
 
-#if !SINGLE_DRIVER
-
-// Insert the specified drive into the step list, in step time order.
-// We insert the drive before any existing entries with the same step time for best performance. Now that we generate step pulses
-// for multiple motors simultaneously, there is no need to preserve round-robin order.
-inline void DDA::InsertDM(DriveMovement *dm)
-{
-	DriveMovement **dmp = &activeDMs;
-	while (*dmp != nullptr && (*dmp)->nextStepTime < dm->nextStepTime)
-	{
-		dmp = &((*dmp)->nextDM);
-	}
-	dm->nextDM = *dmp;
-	*dmp = dm;
-}
-
-// Remove this drive from the list of drives with steps due
-// Called from the step ISR only.
-void DDA::RemoveDM(size_t drive)
-{
-	DriveMovement **dmp = &activeDMs;
-	while (*dmp != nullptr)
-	{
-		DriveMovement * const dm = *dmp;
-		if (dm->drive == drive)
-		{
-			(*dmp) = dm->nextDM;
-			break;
-		}
-		dmp = &(dm->nextDM);
-	}
-}
-
-#endif
-
 void DDA::DebugPrintVector(const char *name, const float *vec, size_t len) const
 {
 	debugPrintf("%s=", name);
@@ -183,11 +167,74 @@ void DDA::Init()
 	{
 		ddm.state = DMState::idle;
 	}
+#if !SINGLE_DRIVER
+	for (uint32_t& t : dmNextStepTimes)
+	{
+		t = DriveMovement::NoStepTime;
+	}
+#endif
 }
 
 // Set up a real move. Return true if it represents real movement, else false.
+// If extraSteps is not null, it holds the babystepping to add to the steps of each drive in the message. It must be zero for drives beyond msg.numDrivers.
 // Return true if it is a real move
-bool DDA::Init(const CanMessageMovementLinear& msg)
+bool DDA::Init(const CanMessageMovementLinear& msg, const int32_t *extraSteps)
+{
+	if (!Prepare(msg, extraSteps))
+	{
+		return false;
+	}
+
+	state = frozen;					// must do this last so that the ISR doesn't start executing it before we have finished setting it up
+	return true;
+}
+
+// Calculate the normalised speeds, accelerations and distances of a move, and the values derived from them that don't depend on the number of steps
+/*static*/ void DDA::CalcShape(const CanMessageMovementLinear& msg, MoveShape& shape) noexcept
+{
+	const uint32_t clocksNeeded = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+	const float topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
+	shape.topSpeed = topSpeed;
+	shape.startSpeed = topSpeed * msg.initialSpeedFraction;
+	shape.endSpeed = topSpeed * msg.finalSpeedFraction;
+
+	shape.acceleration = (msg.accelerationClocks == 0) ? 1.0 : (topSpeed * (1.0 - msg.initialSpeedFraction))/msg.accelerationClocks;
+	shape.deceleration = (msg.decelClocks == 0) ? 1.0 : (topSpeed * (1.0 - msg.finalSpeedFraction))/msg.decelClocks;
+
+	shape.accelDistance = (msg.accelerationClocks == 0) ? 0.0
+							: (msg.accelerationClocks == clocksNeeded) ? 1.0
+								: topSpeed * (1.0 + msg.initialSpeedFraction) * msg.accelerationClocks * 0.5;
+	shape.decelDistance = (msg.decelClocks == 0) ? 0.0
+							: (msg.decelClocks == clocksNeeded) ? 1.0
+								: topSpeed * (1.0 + msg.finalSpeedFraction) * msg.decelClocks * 0.5;
+
+	// We must avoid getting negative distance in the following calculation because it messes up the calculation of twoDistanceToStopTimesCsquaredDivD in DriveMovement:Prepare
+	// The conditional code in calculating decelDistance should achieve that
+	shape.decelStartDistance = 1.0 - shape.decelDistance;
+	shape.startSpeedTimesCdivA = (uint32_t)roundU32(shape.startSpeed/shape.acceleration);
+#if DM_USE_FPU
+	shape.fTopSpeedTimesCdivD = topSpeed/shape.deceleration;
+	shape.fTwoDistanceToStopTimesCsquaredDivD = fsquare(shape.fTopSpeedTimesCdivD) + (shape.decelStartDistance * 2)/shape.deceleration;
+	shape.topSpeedTimesCdivDPlusDecelStartClocks = (uint32_t)shape.fTopSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
+#else
+	shape.topSpeedTimesCdivD = (uint32_t)roundU32(topSpeed/shape.deceleration);
+	shape.twoDistanceToStopTimesCsquaredDivD = isquare64(shape.topSpeedTimesCdivD) + roundU64((shape.decelStartDistance * 2)/shape.deceleration);
+	shape.topSpeedTimesCdivDPlusDecelStartClocks = shape.topSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
+#endif
+	shape.extraAccelerationClocks = msg.accelerationClocks - roundS32(shape.accelDistance/topSpeed);
+#if !DM_USE_FPU
+	// Calculate these using double precision so that when we divide them by the number of steps we get the same results that we would by doing the whole calculation in double precision
+	shape.twoCsquaredDivA = roundU64((double)2.0/(double)shape.acceleration);
+	shape.twoCsquaredDivD = roundU64((double)2.0/(double)shape.deceleration);
+	shape.kDivTopSpeed = roundU64((double)DriveMovement::K1/(double)topSpeed);
+	shape.accelDistanceQ31 = (uint32_t)(shape.accelDistance * (float)(1u << 31));
+	shape.decelDistanceQ31 = (uint32_t)(shape.decelDistance * (float)(1u << 31));
+	shape.decelStartDistanceQ31 = (uint32_t)(shape.decelStartDistance * (float)(1u << 31));
+#endif
+}
+
+// Set up the move from a message but don't freeze it. Return true if it is a real move.
+bool DDA::Prepare(const CanMessageMovementLinear& msg, const int32_t *extraSteps) noexcept
 {
 	// 0. Initialise the endpoints, which are used for diagnostic purposes, and set up the DriveMovement objects
 	bool realMove = false;
@@ -199,9 +246,12 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 		DriveMovement& dm = ddms[drive];
 
 #if !SINGLE_DRIVER
-		dm.nextDM = nullptr;
+		dmNextStepTimes[drive] = DriveMovement::NoStepTime;
+#endif
+		const int32_t delta = ((drive < numDrivers) ? msg.perDrive[drive].steps : 0) + ((extraSteps != nullptr) ? extraSteps[drive] : 0);
+#if SUPPORT_SPEED_OVERRIDE
+		savedMsg.steps[drive] = delta;
 #endif
-		const int32_t delta = (drive < numDrivers) ? msg.perDrive[drive].steps : 0;
 		if (delta != 0)
 		{
 			realMove = true;
@@ -228,42 +278,66 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 
 	// 3. Store some values
 	afterPrepare.moveStartTime = msg.whenToExecute;
+	scheduledMasterStartTime = StepTimer::ConvertToMasterTime(msg.whenToExecute);
 	clocksNeeded = msg.accelerationClocks + msg.steadyClocks + msg.decelClocks;
+#if SUPPORT_STEP_TIMING_STATS
+	accelEndClocks = msg.accelerationClocks;
+	decelStartClocks = msg.accelerationClocks + msg.steadyClocks;
+#endif
+#if SUPPORT_SPEED_OVERRIDE
+	savedMsg.accelerationClocks = msg.accelerationClocks;
+	savedMsg.steadyClocks = msg.steadyClocks;
+	savedMsg.decelClocks = msg.decelClocks;
+	savedMsg.initialSpeedFraction = msg.initialSpeedFraction;
+	savedMsg.finalSpeedFraction = msg.finalSpeedFraction;
+	savedMsg.pressureAdvanceDrives = msg.pressureAdvanceDrives;
+#endif
 	flags.isPrintingMove = (msg.pressureAdvanceDrives != 0);
 	flags.hadHiccup = false;
+	flags.controlledStop = false;
 	flags.goingSlow = false;
+	flags.firstStepRecorded = false;
 
-	topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
-	startSpeed = topSpeed * msg.initialSpeedFraction;
-	endSpeed = topSpeed * msg.finalSpeedFraction;
-
-	acceleration = (msg.accelerationClocks == 0) ? 1.0 : (topSpeed * (1.0 - msg.initialSpeedFraction))/msg.accelerationClocks;
-	deceleration = (msg.decelClocks == 0) ? 1.0 : (topSpeed * (1.0 - msg.finalSpeedFraction))/msg.decelClocks;
-
-	accelDistance = (msg.accelerationClocks == 0) ? 0.0
-						: (msg.accelerationClocks == clocksNeeded) ? 1.0
-							: topSpeed * (1.0 + msg.initialSpeedFraction) * msg.accelerationClocks * 0.5;
-	decelDistance = (msg.decelClocks == 0) ? 0.0
-						: (msg.decelClocks == clocksNeeded) ? 1.0
-							: topSpeed * (1.0 + msg.finalSpeedFraction) * msg.decelClocks * 0.5;
+#if SUPPORT_SCHEDULED_SETTINGS
+	ScheduledSettings::MovePreparing(afterPrepare.moveStartTime);	// apply any pressure advance changes scheduled for moves starting at this time or earlier
+#endif
 
 	PrepParams params;
-	// We must avoid getting negative distance in the following calculation because it messes up the calculation of twoDistanceToStopTimesCsquaredDivD in DriveMovement:Prepare
-	// The conditional code in calculating decelDistance should achieve that
-	params.decelStartDistance = 1.0 - decelDistance;
-	afterPrepare.startSpeedTimesCdivA = (uint32_t)roundU32(startSpeed/acceleration);
-#if DM_USE_FPU
-	params.fTopSpeedTimesCdivD = topSpeed/deceleration;
-	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = (uint32_t)params.fTopSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
+#if SUPPORT_MOVE_SHAPE_CACHE
+	// Moves with the same timing have the same shape, so see whether we have already calculated it
+	size_t shapeIndex = MoveShapeCache::FindShape(msg);
+	if (shapeIndex == MoveShapeCache::NoShape)
+	{
+		shapeIndex = MoveShapeCache::AddShape(msg);
+		CalcShape(msg, MoveShapeCache::GetShape(shapeIndex));
+	}
+	const MoveShape& shape = MoveShapeCache::GetShape(shapeIndex);
+	params.shapeIndex = shapeIndex;
 #else
-	params.topSpeedTimesCdivD = (uint32_t)roundU32(topSpeed/deceleration);
-	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = params.topSpeedTimesCdivD + msg.accelerationClocks + msg.steadyClocks;
+	MoveShape shape;
+	CalcShape(msg, shape);
 #endif
-	afterPrepare.extraAccelerationClocks = msg.accelerationClocks - roundS32(accelDistance/topSpeed);
+	params.shape = &shape;
 
-#if !SINGLE_DRIVER
-	activeDMs = nullptr;
+	topSpeed = shape.topSpeed;
+	startSpeed = shape.startSpeed;
+	endSpeed = shape.endSpeed;
+	acceleration = shape.acceleration;
+	deceleration = shape.deceleration;
+	accelDistance = shape.accelDistance;
+	decelDistance = shape.decelDistance;
+
+	params.decelStartDistance = shape.decelStartDistance;
+#if DM_USE_FPU
+	params.fTopSpeedTimesCdivD = shape.fTopSpeedTimesCdivD;
+	params.fTwoDistanceToStopTimesCsquaredDivD = shape.fTwoDistanceToStopTimesCsquaredDivD;
+#else
+	params.topSpeedTimesCdivD = shape.topSpeedTimesCdivD;
+	params.twoDistanceToStopTimesCsquaredDivD = shape.twoDistanceToStopTimesCsquaredDivD;
 #endif
+	afterPrepare.startSpeedTimesCdivA = shape.startSpeedTimesCdivA;
+	afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks = shape.topSpeedTimesCdivDPlusDecelStartClocks;
+	afterPrepare.extraAccelerationClocks = shape.extraAccelerationClocks;
 
 	for (size_t drive = 0; drive < numDrivers; ++drive)
 	{
@@ -306,7 +380,15 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 				}
 			}
 
+#if SUPPORT_STEP_TABLES
+			dm.PrepareStepTables(*this);
+#endif
+
+#if SUPPORT_AUTO_MICROSTEPPING
+			const uint32_t netSteps = ((dm.reverseStartStep < dm.totalSteps) ? (2 * dm.reverseStartStep) - dm.totalSteps : dm.totalSteps) << stepShifts[drive];	// the end point is in microsteps
+#else
 			const uint32_t netSteps = (dm.reverseStartStep < dm.totalSteps) ? (2 * dm.reverseStartStep) - dm.totalSteps : dm.totalSteps;
+#endif
 			if (dm.direction)
 			{
 				endPoint[drive] += netSteps;
@@ -321,13 +403,14 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 			dm.nextStepTime = 0;
 			dm.stepInterval = 999999;							// initialise to a large value so that we will calculate the time for just one step
 			dm.stepsTillRecalc = 0;							// so that we don't skip the calculation
+			dm.isStopping = false;
 
 			const bool stepsToDo = dm.CalcNextStepTime(*this);
 			if (stepsToDo)
 			{
 				dm.directionChanged = false;
 #if !SINGLE_DRIVER
-				InsertDM(&dm);
+				dmNextStepTimes[drive] = dm.nextStepTime;
 #endif
 			}
 			else
@@ -347,11 +430,173 @@ bool DDA::Init(const CanMessageMovementLinear& msg)
 	{
 		DebugPrintAll();
 	}
-
-	state = frozen;					// must do this last so that the ISR doesn't start executing it before we have finished setting it up
 	return true;
 }
 
+#if SUPPORT_SPEED_OVERRIDE
+
+// Set up this move again from the saved message data, to start at a new time with its durations divided by factor. The speed fractions and steps are unchanged.
+// The caller must have made the move provisional so that the step ISR doesn't start it, and must freeze it again afterwards.
+// We restore the requested step counts afterwards because the steps were counted when the move was first set up.
+void DDA::Retime(uint32_t newStartTime, float factor) noexcept
+pre(state == provisional)
+{
+	CanMessageMovementLinear msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.whenToExecute = newStartTime;
+	msg.accelerationClocks = savedMsg.accelerationClocks;
+	msg.steadyClocks = savedMsg.steadyClocks;
+	msg.decelClocks = savedMsg.decelClocks;
+	msg.initialSpeedFraction = savedMsg.initialSpeedFraction;
+	msg.finalSpeedFraction = savedMsg.finalSpeedFraction;
+	msg.pressureAdvanceDrives = savedMsg.pressureAdvanceDrives;
+	msg.numDrivers = NumDrivers;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		msg.perDrive[drive].steps = savedMsg.steps[drive];
+	}
+	ScaleMoveTiming(msg, factor);
+
+	uint32_t savedStepsRequested[NumDrivers];
+	memcpy(savedStepsRequested, stepsRequested, sizeof(stepsRequested));
+	(void)Prepare(msg, nullptr);
+	memcpy(stepsRequested, savedStepsRequested, sizeof(stepsRequested));
+}
+
+// Divide the durations of a move message by factor, keeping at least one clock so that the move still has a duration
+/*static*/ void DDA::ScaleMoveTiming(CanMessageMovementLinear& msg, float factor) noexcept
+{
+	msg.accelerationClocks = roundU32((float)msg.accelerationClocks/factor);
+	msg.steadyClocks = roundU32((float)msg.steadyClocks/factor);
+	msg.decelClocks = roundU32((float)msg.decelClocks/factor);
+	if (msg.accelerationClocks + msg.steadyClocks + msg.decelClocks == 0)
+	{
+		msg.steadyClocks = 1;
+	}
+}
+
+#endif
+
+#if !DM_USE_FPU
+
+// Compare the per-drive constants and step numbers that DriveMovement calculates using integer arithmetic with the floating point calculations that they replace, over a range of move shapes and step counts
+/*static*/ void DDA::CheckFixedPointPrepare(const StringRef& reply) noexcept
+{
+	static constexpr uint32_t TestClocks[] = { 0, 1, 37, 1500, 48000, 750000 };
+	static constexpr float TestFractions[] = { 0.0, 0.3, 0.99 };
+	static constexpr uint32_t TestSteps[] = { 1, 3, 80, 1234, 40000, 1000000 };
+
+	unsigned int numCases = 0, numStepMismatches = 0;
+	float maxAccelError = 0.0, maxDecelError = 0.0, maxSpeedError = 0.0;
+	const auto relativeError = [](uint64_t actual, uint64_t expected) noexcept -> float
+								{
+									return (expected == 0) ? (float)actual : fabsf((float)((int64_t)(actual - expected))/(float)expected);
+								};
+
+	CanMessageMovementLinear msg;
+	memset(&msg, 0, sizeof(msg));
+	for (uint32_t accelClocks : TestClocks)
+	{
+		for (uint32_t steadyClocks : TestClocks)
+		{
+			for (uint32_t decelClocks : TestClocks)
+			{
+				if (accelClocks + steadyClocks + decelClocks == 0)
+				{
+					continue;
+				}
+				for (float fraction : TestFractions)
+				{
+					msg.accelerationClocks = accelClocks;
+					msg.steadyClocks = steadyClocks;
+					msg.decelClocks = decelClocks;
+					msg.initialSpeedFraction = fraction;
+					msg.finalSpeedFraction = fraction * 0.5;
+					MoveShape shape;
+					CalcShape(msg, shape);
+					for (uint32_t steps : TestSteps)
+					{
+						++numCases;
+						StepConstants sc;
+						DriveMovement::CalcStepConstants(shape, steps, sc);
+						maxAccelError = max<float>(maxAccelError, relativeError(sc.twoCsquaredTimesMmPerStepDivA, roundU64((double)2.0/((double)steps * (double)shape.acceleration))));
+						maxDecelError = max<float>(maxDecelError, relativeError(sc.twoCsquaredTimesMmPerStepDivD, roundU64((double)2.0/((double)steps * (double)shape.deceleration))));
+						maxSpeedError = max<float>(maxSpeedError, relativeError(sc.mmPerStepTimesCKdivtopSpeed, roundU32(((float)DriveMovement::K1)/(steps * shape.topSpeed))));
+						if (   DriveMovement::StepsBefore(shape.accelDistanceQ31, steps) != (uint32_t)(shape.accelDistance * steps)
+							|| ((uint64_t)shape.decelDistanceQ31 * steps < (1ull << 30)) != (shape.decelDistance * steps < 0.5)
+							|| DriveMovement::StepsBefore(shape.decelStartDistanceQ31, steps) != (uint32_t)(shape.decelStartDistance * steps)
+						   )
+						{
+							++numStepMismatches;
+						}
+					}
+				}
+			}
+		}
+	}
+	reply.printf("%u cases, max errors accel %.2fppm decel %.2fppm speed %.2fppm, step number mismatches %u",
+					numCases, (double)(maxAccelError * 1.0e6), (double)(maxDecelError * 1.0e6), (double)(maxSpeedError * 1.0e6), numStepMismatches);
+}
+
+#endif
+
+// Set up a move message that continues from the end of this move at the same speed and decelerates to rest. Return the stopping time in step clocks.
+// We use the deceleration of this move if it has a deceleration phase, else its acceleration, because we don't know the machine limits. Distances are in units of the distance of this move.
+uint32_t DDA::MakeStoppingMove(CanMessageMovementLinear& msg) const noexcept
+{
+	const float rate = (decelDistance != 0.0) ? deceleration : (accelDistance != 0.0) ? acceleration : 0.0;
+	const uint32_t stopClocks = (rate > 0.0) ? constrain<uint32_t>((uint32_t)(endSpeed/rate), MinUnderrunStopClocks, MaxUnderrunStopClocks) : MaxUnderrunStopClocks;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.whenToExecute = GetMoveFinishTime();
+	msg.decelClocks = stopClocks;
+	msg.initialSpeedFraction = 1.0;
+	msg.finalSpeedFraction = 0.0;
+	msg.numDrivers = NumDrivers;
+
+	// Each drive starts at its end speed in this move and stops in stopClocks, so it covers half the distance it would have done at constant speed
+	const float stopDistance = endSpeed * (float)stopClocks * 0.5;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		msg.perDrive[drive].steps = lrintf((float)(endPoint[drive] - prev->endPoint[drive]) * stopDistance);
+	}
+	return stopClocks;
+}
+
+#if SUPPORT_BENCHMARKS
+
+// Time setting up this DDA from a move message and then calculating all the step times without generating any steps. Used only for benchmarking.
+// Return the number of steps calculated and set initTime and stepTime in units of LatencyHistograms timestamps.
+// We restore the requested step counts afterwards so that the benchmark doesn't show up as step errors in the diagnostics.
+uint32_t DDA::Benchmark(const CanMessageMovementLinear& msg, uint32_t& initTime, uint32_t& stepTime) noexcept
+{
+	uint32_t savedStepsRequested[NumDrivers];
+	memcpy(savedStepsRequested, stepsRequested, sizeof(stepsRequested));
+
+	const LatencyHistograms::Timestamp startTime = LatencyHistograms::GetTimestamp();
+	const bool realMove = Init(msg);
+	const LatencyHistograms::Timestamp initDoneTime = LatencyHistograms::GetTimestamp();
+	uint32_t numSteps = 0;
+	if (realMove)
+	{
+		for (DriveMovement& dm : ddms)
+		{
+			while (dm.state == DMState::moving && dm.CalcNextStepTime(*this))
+			{
+				++numSteps;
+			}
+		}
+	}
+	stepTime = LatencyHistograms::GetTimestamp() - initDoneTime;
+	initTime = initDoneTime - startTime;
+
+	memcpy(stepsRequested, savedStepsRequested, sizeof(stepsRequested));
+	Free();
+	return numSteps;
+}
+
+#endif
+
 // Start executing this move. Must be called with interrupts disabled, to avoid a race condition.
 // startTime is the earliest that we can start the move, but we must not start it before its planned time
 // After calling this, the first interrupt must be scheduled
@@ -384,26 +629,37 @@ void DDA::Start(uint32_t tim)
 		Platform::SetDirection(ddms[0].direction);
 	}
 #else
-	if (activeDMs != nullptr)
+	for (size_t i = 0; i < NumDrivers; ++i)
 	{
-		for (size_t i = 0; i < NumDrivers; ++i)
+		DriveMovement& dm = ddms[i];
+		if (dm.state == DMState::moving)
 		{
-			DriveMovement& dm = ddms[i];
-			if (dm.state == DMState::moving)
-			{
-				Platform::SetDirection(dm.drive, dm.direction);
-			}
+			Platform::SetDirection(dm.drive, dm.direction);
 		}
 	}
 #endif
 }
 
-#if USE_TC_FOR_STEP
+#if SINGLE_DRIVER
+# if USE_TC_FOR_STEP
 uint32_t DDA::lastStepHighTime = 0;
-#else
+# else
 uint32_t DDA::lastStepLowTime = 0;
-#endif
+# endif
 uint32_t DDA::lastDirChangeTime = 0;
+#else
+uint32_t DDA::lastStepLowTimes[NumDrivers] = { 0 };
+uint32_t DDA::lastDirChangeTimes[NumDrivers] = { 0 };
+uint32_t DDA::numSlowDriverWaits = 0;
+#endif
+
+// Record how late the first step of this move was, relative to when the main board scheduled it. Called from the step ISR.
+// We work in master time so that a change in the clock sync offset between receiving the move and starting it shows up as an error.
+void DDA::RecordFirstStep(uint32_t now, uint32_t stepTime) noexcept
+{
+	flags.firstStepRecorded = true;
+	FirstStepStats::Record((int32_t)(StepTimer::ConvertToMasterTime(now) - (scheduledMasterStartTime + stepTime)));
+}
 
 #if SINGLE_DRIVER
 
@@ -416,6 +672,19 @@ void DDA::StepDrivers(uint32_t now)
 	// Determine whether the driver is due for stepping, overdue, or will be due very shortly
 	if (ddms[0].state == DMState::moving && (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval >= ddms[0].nextStepTime)	// if the next step is due
 	{
+		if (!flags.firstStepRecorded)
+		{
+			RecordFirstStep(now, ddms[0].nextStepTime);
+		}
+
+# if SUPPORT_STEP_TIMING_STATS
+		if (StepTimingStats::IsEnabled())
+		{
+			// We only record the first step of a burst, because the others are generated as fast as we can
+			StepTimingStats::Record(0, GetPhase(ddms[0].nextStepTime), (int32_t)((now - afterPrepare.moveStartTime) - ddms[0].nextStepTime));
+		}
+# endif
+
 		// Step the driver
 		bool hasMoreSteps;
 
@@ -455,17 +724,31 @@ void DDA::StepDrivers(uint32_t now)
 			hasMoreSteps = ddms[0].CalcNextStepTime(*this);
 # else
 #  if SUPPORT_CLOSED_LOOP
-			ClosedLoop::TakeStep();											//TODO remove this when in closed loop mode and ClosedLoop calls GetCurrentMotion instead of relying on TakeStep
-			if (ClosedLoop::GetClosedLoopEnabled())
+			ClosedLoop::TakeStep(0);										// this only triggers data collection now, the closed loop target comes from GetCurrentMotion
+			if (ClosedLoop::GetClosedLoopEnabled(0))
 			{
 				hasMoreSteps = ddms[0].CalcNextStepTime(*this);				//TODO remove this when we refactor the code to not generate step interrupts when in closed loop mode
 			}
 			else
 #  endif
 			{
-				Platform::StepDriverHigh();									// generate the step
-				hasMoreSteps = ddms[0].CalcNextStepTime(*this);
-				Platform::StepDriverLow();									// set the step pin low
+				// If the following steps are already due then generate them as a burst, to save rescheduling the step interrupt for each one
+				unsigned int stepsLeftInBurst = MaxStepsPerBurst;
+				for (;;)
+				{
+					Platform::StepDriverHigh();								// generate the step
+					hasMoreSteps = ddms[0].CalcNextStepTime(*this);
+					Platform::StepDriverLow();								// set the step pin low
+					if (   !hasMoreSteps
+						|| ddms[0].directionChanged
+						|| --stepsLeftInBurst == 0
+						|| (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval < ddms[0].nextStepTime
+					   )
+					{
+						break;
+					}
+					++stepsDone[0];
+				}
 			}
 # endif
 		}
@@ -479,7 +762,7 @@ void DDA::StepDrivers(uint32_t now)
 	}
 
 	// If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
-	if (ddms[0].state != DMState::moving && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
+	if (ddms[0].state != DMState::moving && (flags.controlledStop || StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded))
 	{
 		state = completed;
 	}
@@ -495,67 +778,128 @@ void DDA::StepDrivers(uint32_t now)
 {
 	// 1. There is no step 1.
 	// 2. Determine which drivers are due for stepping, overdue, or will be due very shortly
-	uint32_t driversStepping = 0;
-	DriveMovement* dm = activeDMs;
-	const uint32_t elapsedTime = (now - afterPrepare.moveStartTime) + StepTimer::MinInterruptInterval;
-	while (dm != nullptr && elapsedTime >= dm->nextStepTime)		// if the next step is due
+	// Steps that are due within the coalescing window are generated now on the same pulse edge, so that we don't need another interrupt for them.
+	uint32_t drivesDue = 0;
+	const uint32_t timeNow = now - afterPrepare.moveStartTime;
+	const uint32_t elapsedTime = timeNow + stepCoalesceClocks;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		if (elapsedTime >= dmNextStepTimes[drive])					// if the next step is due
+		{
+			drivesDue |= 1u << drive;
+			++stepsDone[drive];
+			if (dmNextStepTimes[drive] > timeNow + StepTimer::MinInterruptInterval)
+			{
+				// We would have needed another interrupt for this step if we weren't coalescing
+				++stepsCoalesced;
+				const uint32_t error = dmNextStepTimes[drive] - timeNow;
+				if (error > maxCoalesceError)
+				{
+					maxCoalesceError = error;
+				}
+			}
+		}
+	}
+	if (drivesDue != 0 && !flags.firstStepRecorded)
 	{
-		driversStepping |= Platform::GetDriversBitmap(dm->drive);
-		++stepsDone[dm->drive];
-		dm = dm->nextDM;
+		RecordFirstStep(now, EarliestStepTime());
 	}
+	const uint32_t driversStepping = Platform::GetStepPinsMask(drivesDue);
 
 # if SUPPORT_SLOW_DRIVERS
-	if ((driversStepping & Platform::GetSlowDriversBitmap().GetRaw()) != 0)	// if using any slow drivers
+	const uint32_t slowDrivesDue = drivesDue & Platform::GetSlowDriversBitmap().GetRaw();
+	if (slowDrivesDue != 0)											// if any slow drivers are due
 	{
-		uint32_t lastStepPulseTime = lastStepLowTime;
-		while (now - lastStepPulseTime < Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTime < Platform::GetSlowDriverDirSetupClocks())
+		// Start the step pulses for the fast drivers now, so that only the slow drivers are delayed by the slow driver timing
+		const uint32_t slowDriversStepping = Platform::GetStepPinsMask(slowDrivesDue);
+		Platform::StepDriversHigh(driversStepping & ~slowDriversStepping);
+
+		// Wait until each slow driver that is due has had its minimum step low time and direction setup time
+		bool waited = false;
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (slowDrivesDue & (1u << drive))
+			{
+				while (now - lastStepLowTimes[drive] < Platform::GetSlowDriverStepLowClocks() || now - lastDirChangeTimes[drive] < Platform::GetSlowDriverDirSetupClocks())
+				{
+					now = StepTimer::GetTimerTicks();
+					waited = true;
+				}
+			}
+		}
+		if (waited)
 		{
-			now = StepTimer::GetTimerTicks();
+			++numSlowDriverWaits;
 		}
-		Platform::StepDriversHigh(driversStepping);					// set the step pins high
-		lastStepPulseTime = StepTimer::GetTimerTicks();
+		Platform::StepDriversHigh(slowDriversStepping);				// set the slow step pins high
+		const uint32_t lastStepPulseTime = StepTimer::GetTimerTicks();
 
-		for (DriveMovement *dm2 = activeDMs; dm2 != dm; dm2 = dm2->nextDM)
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
 		{
-			(void)dm2->CalcNextStepTime(*this);						// calculate next step times
+			if (drivesDue & (1u << drive))
+			{
+				(void)ddms[drive].CalcNextStepTime(*this);			// calculate next step times
+			}
 		}
 
 		while (StepTimer::GetTimerTicks() - lastStepPulseTime < Platform::GetSlowDriverStepHighClocks()) {}
 		Platform::StepDriversLow();									// set all step pins low
-		lastStepLowTime = StepTimer::GetTimerTicks();
+		const uint32_t stepLowTime = StepTimer::GetTimerTicks();
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
+		{
+			if (slowDrivesDue & (1u << drive))
+			{
+				lastStepLowTimes[drive] = stepLowTime;
+			}
+		}
 	}
 	else
 # endif
 	{
 		Platform::StepDriversHigh(driversStepping);					// set the step pins high
-		for (DriveMovement *dm2 = activeDMs; dm2 != dm; dm2 = dm2->nextDM)
+		for (size_t drive = 0; drive < NumDrivers; ++drive)
 		{
-			(void)dm2->CalcNextStepTime(*this);						// calculate next step times
+			if (drivesDue & (1u << drive))
+			{
+				(void)ddms[drive].CalcNextStepTime(*this);			// calculate next step times
+			}
 		}
 		Platform::StepDriversLow();									// set all step pins low
 	}
 
-	// Remove those drives from the list, update the direction pins where necessary, and re-insert them so as to keep the list in step-time order.
-	DriveMovement *dmToInsert = activeDMs;							// head of the chain we need to re-insert
-	activeDMs = dm;													// remove the chain from the list
-	while (dmToInsert != dm)										// note that both of these may be nullptr
+	// Update the step times of the drives we stepped, and update the direction pins where necessary
+# if SUPPORT_STEP_TIMING_STATS
+	const bool recordTiming = StepTimingStats::IsEnabled();
+# endif
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
 	{
-		DriveMovement * const nextToInsert = dmToInsert->nextDM;
-		if (dmToInsert->state == DMState::moving)
+		if (drivesDue & (1u << drive))
 		{
-			InsertDM(dmToInsert);
-			if (dmToInsert->directionChanged)
+# if SUPPORT_STEP_TIMING_STATS
+			if (recordTiming)
+			{
+				StepTimingStats::Record(drive, GetPhase(dmNextStepTimes[drive]), (int32_t)((now - afterPrepare.moveStartTime) - dmNextStepTimes[drive]));
+			}
+# endif
+			DriveMovement& dm = ddms[drive];
+			if (dm.state == DMState::moving)
 			{
-				dmToInsert->directionChanged = false;
-				Platform::SetDirection(dmToInsert->drive, dmToInsert->direction);
+				dmNextStepTimes[drive] = dm.nextStepTime;
+				if (dm.directionChanged)
+				{
+					dm.directionChanged = false;
+					Platform::SetDirection(drive, dm.direction);
+				}
+			}
+			else
+			{
+				dmNextStepTimes[drive] = DriveMovement::NoStepTime;
 			}
 		}
-		dmToInsert = nextToInsert;
 	}
 
 	// 6. If there are no more steps to do and the time for the move has nearly expired, flag the move as complete
-	if (activeDMs == nullptr && StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded)
+	if (EarliestStepTime() == DriveMovement::NoStepTime && (flags.controlledStop || StepTimer::GetTimerTicks() - afterPrepare.moveStartTime + WakeupTime >= clocksNeeded))
 	{
 		state = completed;
 	}
@@ -574,8 +918,8 @@ void DDA::StopDrive(size_t drive)
 #if SINGLE_DRIVER
 		state = completed;
 #else
-		RemoveDM(drive);
-		if (activeDMs == nullptr)
+		dmNextStepTimes[drive] = DriveMovement::NoStepTime;
+		if (EarliestStepTime() == DriveMovement::NoStepTime)
 		{
 			state = completed;
 		}
@@ -583,7 +927,9 @@ void DDA::StopDrive(size_t drive)
 	}
 }
 
-void DDA::StopDrivers(uint16_t whichDrives)
+// Stop some drives. If decelerate is true then drives that have a stopping deceleration configured decelerate to rest instead of stopping dead.
+// The endpoints are not changed, the steps actually taken are accounted for when the move completes.
+void DDA::StopDrivers(uint16_t whichDrives, bool decelerate)
 {
 	if (state == executing)
 	{
@@ -591,12 +937,62 @@ void DDA::StopDrivers(uint16_t whichDrives)
 		{
 			if (whichDrives & (1u << drive))
 			{
-				StopDrive(drive);
+				if (!decelerate || !StartControlledStop(drive))
+				{
+					StopDrive(drive);
+				}
 			}
 		}
 	}
 }
 
+// Start decelerating a drive to rest, returning true if it is already stopping or we have started it stopping
+bool DDA::StartControlledStop(size_t drive) noexcept
+{
+	DriveMovement& dm = ddms[drive];
+	if (dm.state != DMState::moving)
+	{
+		return false;
+	}
+	if (dm.isStopping)
+	{
+		return true;
+	}
+	if (!dm.StartControlledStop(stopDecelerations[drive]))
+	{
+		return false;
+	}
+#if !SINGLE_DRIVER
+	dmNextStepTimes[drive] = dm.nextStepTime;
+#endif
+	flags.controlledStop = true;
+	++numControlledStops;
+	return true;
+}
+
+// Set the deceleration used when a drive is told to stop, in steps per second squared. Zero means stop immediately.
+GCodeResult DDA::SetStopDeceleration(size_t drive, uint32_t stepsPerSecondSquared, const StringRef& reply) noexcept
+{
+	if (drive >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+	if (stepsPerSecondSquared != 0 && stepsPerSecondSquared < MinStopDeceleration)
+	{
+		reply.printf("Stopping deceleration must be zero or at least %" PRIu32 " steps/sec^2", MinStopDeceleration);
+		return GCodeResult::error;
+	}
+	stopDecelerations[drive] = (float)stepsPerSecondSquared/(float)StepTimer::StepClockRateSquared;
+	return GCodeResult::ok;
+}
+
+void DDA::AppendControlledStopDiagnostics(const StringRef& reply) noexcept
+{
+	reply.catf(", controlled stops %" PRIu32, numControlledStops);
+	numControlledStops = 0;
+}
+
 bool DDA::HasStepError() const
 {
 #if 0	//debug
@@ -637,6 +1033,37 @@ uint32_t DDA::GetAndClearMaxOverdueIncrement() noexcept
 	return ret;
 }
 
+#if !SINGLE_DRIVER
+
+GCodeResult DDA::SetStepCoalesceWindow(uint32_t clocks, const StringRef& reply) noexcept
+{
+	if (clocks > MaxStepCoalesceClocks)
+	{
+		reply.printf("Step coalescing window must not exceed %" PRIu32 " step clocks", MaxStepCoalesceClocks);
+		return GCodeResult::error;
+	}
+	stepCoalesceClocks = max<uint32_t>(clocks, StepTimer::MinInterruptInterval);
+	return GCodeResult::ok;
+}
+
+void DDA::AppendStepCoalesceDiagnostics(const StringRef& reply) noexcept
+{
+	uint32_t coalesced, maxError;
+	{
+		AtomicCriticalSectionLocker lock;
+		coalesced = stepsCoalesced;
+		maxError = maxCoalesceError;
+		stepsCoalesced = maxCoalesceError = 0;
+	}
+	reply.catf(", coalesce window %" PRIu32 " steps early %" PRIu32 " max %" PRIu32, stepCoalesceClocks, coalesced, maxError);
+# if SUPPORT_SLOW_DRIVERS
+	reply.catf(", slow driver waits %" PRIu32, numSlowDriverWaits);
+	numSlowDriverWaits = 0;
+# endif
+}
+
+#endif
+
 #endif	// SUPPORT_DRIVERS
 
 // End
@@ -14,6 +14,7 @@
 #if SUPPORT_DRIVERS
 
 #include "DriveMovement.h"
+#include "StepTimingStats.h"
 #include "StepTimer.h"
 
 struct CanMessageMovementLinear;
@@ -43,14 +44,27 @@ public:
 	void operator delete(void* ptr, std::align_val_t align) noexcept {}
 
 	void Init() noexcept;														// Set up initial positions for machine startup
-	bool Init(const CanMessageMovementLinear& msg) noexcept SPEED_CRITICAL;		// Set up a move from a CAN message
+	bool Init(const CanMessageMovementLinear& msg, const int32_t *extraSteps = nullptr) noexcept SPEED_CRITICAL;	// Set up a move from a CAN message, optionally adding babystepping
 	void Start(uint32_t tim) noexcept SPEED_CRITICAL;							// Start executing the DDA, i.e. move the move.
 	void StepDrivers(uint32_t now) noexcept SPEED_CRITICAL;						// Take one step of the DDA, called by timed interrupt.
 	bool ScheduleNextStepInterrupt(StepTimer& timer) const noexcept SPEED_CRITICAL;		// Schedule the next interrupt, returning true if we can't because it is already due
 
+#if SUPPORT_AUTO_MICROSTEPPING
+	void SetStepShifts(const uint8_t *shifts) noexcept;							// set how much the steps of each drive in the next move must be shifted left to get microsteps, or null for no shift
+	bool IsDriveMoving(size_t drive) const noexcept { return ddms[drive].state == DMState::moving; }
+#endif
 	void SetNext(DDA *n) noexcept { next = n; }
 	void SetPrevious(DDA *p) noexcept { prev = p; }
 	void Complete() noexcept { state = completed; }
+#if SUPPORT_SPEED_OVERRIDE
+	void MakeProvisional() noexcept { state = provisional; }					// stop the step ISR starting this move while we retime it
+	void Freeze() noexcept { state = frozen; }
+	void Retime(uint32_t newStartTime, float factor) noexcept;					// set up this provisional move again to start at a new time with its durations divided by factor
+	static void ScaleMoveTiming(CanMessageMovementLinear& msg, float factor) noexcept;	// divide the durations of a move message by factor
+#endif
+#if !DM_USE_FPU
+	static void CheckFixedPointPrepare(const StringRef& reply) noexcept;		// compare the integer per-drive calculations with the floating point ones they replace
+#endif
 	void Free() noexcept;
 	bool HasStepError() const noexcept;
 	bool IsPrintingMove() const noexcept { return flags.isPrintingMove; }
@@ -64,19 +78,28 @@ public:
 	// Filament monitor support
 	int32_t GetStepsTaken(size_t drive) const noexcept;
 
-	void StopDrivers(uint16_t whichDrives) noexcept;
+	void StopDrivers(uint16_t whichDrives, bool decelerate = false) noexcept;
 
 	uint32_t GetClocksNeeded() const noexcept { return clocksNeeded; }
+	uint32_t GetMoveStartTime() const noexcept { return afterPrepare.moveStartTime; }
 	uint32_t GetMoveFinishTime() const noexcept { return afterPrepare.moveStartTime + clocksNeeded; }
 
 	int32_t GetPosition(size_t driver) const noexcept { return endPoint[driver]; }
 
+	// Underrun support
+	bool EndsAtRest() const noexcept { return endSpeed <= 0.0; }
+	uint32_t MakeStoppingMove(CanMessageMovementLinear& msg) const noexcept;		// set up a move that decelerates from our end speed to rest, returning its duration in step clocks
+
 #if HAS_SMART_DRIVERS
-	uint32_t GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept;	// Get the current full step interval for this axis or extruder
+	uint32_t GetMicrostepInterval(size_t axis) const noexcept;						// Get the current microstep interval for this axis or extruder
 #endif
 
 #if SUPPORT_CLOSED_LOOP
-	void GetCurrentMotion(MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept;
+	void GetCurrentMotion(size_t drive, MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept;
+#endif
+
+#if SUPPORT_BENCHMARKS
+	uint32_t Benchmark(const CanMessageMovementLinear& msg, uint32_t& initTime, uint32_t& stepTime) noexcept;	// time Init and the step calculations for a move
 #endif
 
 	void DebugPrint() const noexcept;												// print the DDA only
@@ -88,6 +111,19 @@ public:
 
 	static void RecordStepError() noexcept { ++stepErrors; }
 
+	// Controlled stops. Drives with a stopping deceleration configured decelerate to rest when the main board stops them, instead of stopping dead.
+	static constexpr uint32_t MinStopDeceleration = 1000;				// the lowest stopping deceleration in steps/sec^2, which keeps 2/deceleration within 32 bits
+	static constexpr uint32_t MaxControlledStopClocks = 2 * StepTimer::StepClockRate;	// if it would take longer than this to stop, we stop immediately
+	static GCodeResult SetStopDeceleration(size_t drive, uint32_t stepsPerSecondSquared, const StringRef& reply) noexcept;
+	static void AppendControlledStopDiagnostics(const StringRef& reply) noexcept;
+
+#if !SINGLE_DRIVER
+	// Steps that are due within the coalescing window of the first one are generated on the same pulse edge, so that drives stepping at similar rates share interrupts
+	static constexpr uint32_t MaxStepCoalesceClocks = 20;					// about 27us, this bounds the timing error that coalescing introduces
+	static GCodeResult SetStepCoalesceWindow(uint32_t clocks, const StringRef& reply) noexcept;
+	static void AppendStepCoalesceDiagnostics(const StringRef& reply) noexcept;	// report the number of steps generated early and the maximum error, and reset them
+#endif
+
 	// Note on the following constant:
 	// If we calculate the step interval on every clock, we reach a point where the calculation time exceeds the step interval.
 	// The worst case is pure Z movement on a delta. On a Mini Kossel with 80 steps/mm with this firmware running on a Duet (84MHx SAM3X8 processor),
@@ -107,26 +143,41 @@ public:
 	static constexpr uint32_t MaxStepInterruptTime = (80 * StepTimer::StepClockRate)/1000000;		// the maximum time we spend looping in the ISR in step clocks
 #endif
 	static constexpr uint32_t WakeupTime = (100 * StepTimer::StepClockRate)/1000000;				// stop resting 100us before the move is due to end
+	static constexpr uint32_t MinUnderrunStopClocks = StepTimer::StepClockRate/1000;				// the shortest time we take to stop when the next move doesn't arrive in time
+	static constexpr uint32_t MaxUnderrunStopClocks = StepTimer::StepClockRate/10;					// the longest time we take to stop, also used if the move had no acceleration or deceleration
+#if SINGLE_DRIVER
+	static constexpr unsigned int MaxStepsPerBurst = 8;											// the maximum number of steps we generate in one call to StepDrivers
+#endif
 
 	static void PrintMoves();											// print saved moves for debugging
 
-#if USE_TC_FOR_STEP
+#if SINGLE_DRIVER
+# if USE_TC_FOR_STEP
 	static uint32_t lastStepHighTime;									// when we last started a step pulse to a slow driver
-#else
+# else
 	static uint32_t lastStepLowTime;									// when we last completed a step pulse to a slow driver
-#endif
+# endif
 	static uint32_t lastDirChangeTime;									// when we last change the DIR signal to a slow driver
+#else
+	// We keep the slow driver timing per driver, so that stepping one slow driver doesn't delay another one or any fast driver
+	static uint32_t lastStepLowTimes[NumDrivers];						// when we last completed a step pulse to each slow driver
+	static uint32_t lastDirChangeTimes[NumDrivers];						// when we last changed the DIR signal to each slow driver
+	static uint32_t numSlowDriverWaits;									// how many times we had to wait before stepping a slow driver
+#endif
 
 	static uint32_t stepsRequested[NumDrivers], stepsDone[NumDrivers];
 
 private:
+	bool Prepare(const CanMessageMovementLinear& msg, const int32_t *extraSteps) noexcept SPEED_CRITICAL;	// Set up the move without freezing it, returning true if it is a real move
+	static void CalcShape(const CanMessageMovementLinear& msg, MoveShape& shape) noexcept SPEED_CRITICAL;	// Calculate the values that depend only on the timing of the move
 	void StopDrive(size_t drive) noexcept;								// stop movement of a drive and recalculate the endpoint
+	bool StartControlledStop(size_t drive) noexcept;					// start decelerating a drive to rest
 	uint32_t WhenNextInterruptDue() const noexcept;						// return when the next interrupt is due relative to the move start time
 
 #if !SINGLE_DRIVER
-	void InsertDM(DriveMovement *dm) noexcept SPEED_CRITICAL;
-	void RemoveDM(size_t drive) noexcept;
+	uint32_t EarliestStepTime() const noexcept SPEED_CRITICAL;			// return when the next step of any drive is due, or NoStepTime if none
 #endif
+	void RecordFirstStep(uint32_t now, uint32_t stepTime) noexcept SPEED_CRITICAL;
 
 	void DebugPrintVector(const char *name, const float *vec, size_t len) const noexcept;
 
@@ -141,12 +192,17 @@ private:
 		{
 			uint16_t isPrintingMove : 1,	// True if this is a printing move and any of our extruders is moving
 					 goingSlow : 1,			// True if we have slowed the movement because the Z probe is approaching its threshold
-					 hadHiccup : 1;			// True if we had a hiccup while executing this move
+					 hadHiccup : 1,			// True if we had a hiccup while executing this move
+					 controlledStop : 1,	// True if any drive is decelerating to a controlled stop, so the move is complete as soon as all drives have finished
+					 firstStepRecorded : 1;	// True if we have recorded the timing of the first step
 		} flags;
 		uint16_t all;						// so that we can print all the flags at once for debugging
 	};
 
 	int32_t endPoint[NumDrivers];  			// Machine coordinates in steps of the endpoint
+#if SUPPORT_AUTO_MICROSTEPPING
+	uint8_t stepShifts[NumDrivers];			// the steps of each drive are in units of 2^stepShifts microsteps as set by the main board
+#endif
 
 	float acceleration;						// The acceleration to use
 	float deceleration;						// The deceleration to use
@@ -159,6 +215,30 @@ private:
 	float decelDistance;
 
 	uint32_t clocksNeeded;
+	uint32_t scheduledMasterStartTime;		// the master time at which the main board wanted the move to start, before any adjustment for lateness or hiccups
+
+#if SUPPORT_SPEED_OVERRIDE
+	// The parts of the move message that we need to set the move up again with different timing
+	struct
+	{
+		uint32_t accelerationClocks;
+		uint32_t steadyClocks;
+		uint32_t decelClocks;
+		float initialSpeedFraction;
+		float finalSpeedFraction;
+		uint16_t pressureAdvanceDrives;
+		int32_t steps[NumDrivers];			// the steps requested for each drive including any babystepping
+	} savedMsg;
+#endif
+
+#if SUPPORT_STEP_TIMING_STATS
+	uint32_t accelEndClocks;				// when the acceleration phase ends relative to the move start
+	uint32_t decelStartClocks;				// when the deceleration phase starts relative to the move start
+	MovePhase GetPhase(uint32_t stepTime) const noexcept
+	{
+		return (stepTime < accelEndClocks) ? MovePhase::accelerating : (stepTime < decelStartClocks) ? MovePhase::steady : MovePhase::decelerating;
+	}
+#endif
 
 	// Values that are not set or accessed before Prepare is called
 	struct
@@ -178,27 +258,57 @@ private:
 	} afterPrepare;
 
 #if !SINGLE_DRIVER
-    DriveMovement* activeDMs;				// list of contained DMs that need steps, in step time order
+	// Copy of the next step times of the DMs, kept together so that the ISR can find the drives that are due without walking the DMs.
+	// Entries for drives that have no more steps to do are set to DriveMovement::NoStepTime.
+	uint32_t dmNextStepTimes[NumDrivers];
 #endif
 
     DriveMovement ddms[NumDrivers];			// These describe the state of each drive movement
 
 	static unsigned int stepErrors;
+	static float stopDecelerations[NumDrivers];					// the stopping deceleration of each drive in steps per step clock squared, or 0 to stop immediately
+	static uint32_t numControlledStops;
 	static uint32_t maxTicksOverdue;
 	static uint32_t maxOverdueIncrement;
+
+#if !SINGLE_DRIVER
+	static uint32_t stepCoalesceClocks;
+	static uint32_t stepsCoalesced;								// how many steps we generated early because they were within the coalescing window
+	static uint32_t maxCoalesceError;							// the most step clocks early that we generated a step
+#endif
 };
 
+#if !SINGLE_DRIVER
+
+// Return when the next step of any drive is due relative to the move start time, or NoStepTime if no drive has any steps left to do
+inline uint32_t DDA::EarliestStepTime() const noexcept
+{
+	uint32_t earliest = dmNextStepTimes[0];
+	for (size_t drive = 1; drive < NumDrivers; ++drive)
+	{
+		earliest = min<uint32_t>(earliest, dmNextStepTimes[drive]);
+	}
+	return earliest;
+}
+
+#endif
+
 // Return when the next interrupt is due relative to the move start time
 inline uint32_t DDA::WhenNextInterruptDue() const noexcept
 {
-	return
 #if SINGLE_DRIVER
-			(ddms[0].state == DMState::moving) ? ddms[0].nextStepTime
+	if (ddms[0].state == DMState::moving)
+	{
+		return ddms[0].nextStepTime;
+	}
 #else
-			(activeDMs != nullptr) ? activeDMs->nextStepTime
+	const uint32_t earliestStepTime = EarliestStepTime();
+	if (earliestStepTime != DriveMovement::NoStepTime)
+	{
+		return earliestStepTime;
+	}
 #endif
-				: (clocksNeeded > DDA::WakeupTime) ? clocksNeeded - DDA::WakeupTime
-					: 0;
+	return (clocksNeeded > DDA::WakeupTime) ? clocksNeeded - DDA::WakeupTime : 0;
 }
 
 // Schedule the next interrupt, returning true if we can't because it is already due
@@ -215,23 +325,31 @@ inline bool DDA::ScheduleNextStepInterrupt(StepTimer& timer) const noexcept
 // Insert a hiccup long enough to guarantee that we will exit the ISR
 inline void DDA::InsertHiccup(uint32_t now) noexcept
 {
-	const uint32_t ticksDueAfterStart =
-#if SINGLE_DRIVER
-		(ddms[0].state == DMState::moving) ? ddms[0].nextStepTime
-#else
-									(activeDMs != nullptr) ? activeDMs->nextStepTime
-#endif
-										: (clocksNeeded > DDA::WakeupTime) ? clocksNeeded - DDA::WakeupTime
-											: 0;
-	afterPrepare.moveStartTime = now + DDA::HiccupTime - ticksDueAfterStart;
+	afterPrepare.moveStartTime = now + DDA::HiccupTime - WhenNextInterruptDue();
 }
 
 // Return the number of net steps already taken in this move by a particular drive
 inline int32_t DDA::GetStepsTaken(size_t drive) const
 {
+#if SUPPORT_AUTO_MICROSTEPPING
+	return ddms[drive].GetNetStepsTaken() * (1 << stepShifts[drive]);
+#else
 	return ddms[drive].GetNetStepsTaken();
+#endif
+}
+
+#if SUPPORT_AUTO_MICROSTEPPING
+
+inline void DDA::SetStepShifts(const uint8_t *shifts) noexcept
+{
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		stepShifts[drive] = (shifts == nullptr) ? 0 : shifts[drive];
+	}
 }
 
+#endif
+
 // Free up this DDA
 inline void DDA::Free()
 {
@@ -240,11 +358,11 @@ inline void DDA::Free()
 
 #if HAS_SMART_DRIVERS
 
-// Get the current full step interval for this axis or extruder
-inline uint32_t DDA::GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept
+// Get the current microstep interval for this axis or extruder, or 0 if it is not moving
+inline uint32_t DDA::GetMicrostepInterval(size_t axis) const noexcept
 {
 	const DriveMovement& dm = ddms[axis];
-	return dm.state == DMState::moving ? dm.GetStepInterval(microstepShift) : 0;
+	return dm.state == DMState::moving ? dm.GetMicrostepInterval() : 0;
 }
 
 #endif
@@ -252,9 +370,57 @@ inline uint32_t DDA::GetStepInterval(size_t axis, uint32_t microstepShift) const
 #if SUPPORT_CLOSED_LOOP
 
 // Get the current position, speed and acceleration
-inline void DDA::GetCurrentMotion(MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept
+// The speed and acceleration are in full steps per second and per second squared in the direction of motion of this move, so they are never negative except during deceleration
+// The position is calculated from the elapsed time rather than from the steps taken, so it has sub-microstep resolution and doesn't depend on when the step interrupts run.
+// We can only do that if steps are proportional to distance along the move, so for pressure advance and delta moves we use the steps taken instead.
+inline void DDA::GetCurrentMotion(size_t drive, MotionParameters& mParams, int32_t netMicrostepsTaken, int microstepShift) const noexcept
 {
-	return ddms[0].GetCurrentMotion(mParams, netMicrostepsTaken, microstepShift);
+	const DriveMovement& dm = ddms[drive];
+	dm.GetCurrentMotion(mParams, netMicrostepsTaken, microstepShift);
+	if (state != executing || dm.state != DMState::moving)
+	{
+		return;
+	}
+
+	// Our speeds and accelerations are in fractions of the move per step clock, so convert them using the number of full steps in the move
+	const float fullSteps = ldexp((float)dm.totalSteps, microstepShift);
+	const float elapsedClocks = (float)max<int32_t>((int32_t)(StepTimer::GetTimerTicks() - afterPrepare.moveStartTime), 0);	// the start time may be in the future after a hiccup
+	const float accelStopClocks = (topSpeed - startSpeed)/acceleration;
+	const float decelStartClocks = (float)clocksNeeded - (topSpeed - endSpeed)/deceleration;
+	float speed, accel, distance;
+	if (elapsedClocks < accelStopClocks)
+	{
+		speed = startSpeed + acceleration * elapsedClocks;
+		accel = acceleration;
+		distance = (startSpeed + 0.5 * acceleration * elapsedClocks) * elapsedClocks;
+	}
+	else if (elapsedClocks < decelStartClocks)
+	{
+		speed = topSpeed;
+		accel = 0.0;
+		distance = accelDistance + topSpeed * (elapsedClocks - accelStopClocks);
+	}
+	else if (elapsedClocks < (float)clocksNeeded)
+	{
+		const float decelClocks = elapsedClocks - decelStartClocks;
+		speed = topSpeed - deceleration * decelClocks;
+		accel = -deceleration;
+		distance = (1.0 - decelDistance) + (topSpeed - 0.5 * deceleration * decelClocks) * decelClocks;
+	}
+	else
+	{
+		speed = endSpeed;
+		accel = 0.0;
+		distance = 1.0;
+	}
+	mParams.speed = speed * fullSteps * (float)StepTimer::StepClockRate;
+	mParams.acceleration = accel * fullSteps * (float)StepTimer::StepClockRateSquared;
+
+	if (!dm.IsDeltaMovement() && dm.mp.cart.compensationClocks == 0 && dm.reverseStartStep > dm.totalSteps)
+	{
+		const float netMicrosteps = constrain<float>(distance, 0.0, 1.0) * (float)dm.totalSteps;
+		mParams.position = ldexp((float)netMicrostepsTaken + ((dm.direction) ? netMicrosteps : -netMicrosteps), microstepShift);
+	}
 }
 
 #endif
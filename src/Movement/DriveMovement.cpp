@@ -12,6 +12,7 @@
 #include "DDA.h"
 #include "Move.h"
 #include "Math/Isqrt.h"
+#include "MoveShapeCache.h"
 
 #if SUPPORT_DELTA_MOVEMENT
 # include "Kinematics/LinearDeltaKinematics.h"
@@ -20,33 +21,72 @@
 #include "StepTimer.h"
 #include "Platform.h"
 
-// Prepare this DM for a Cartesian axis move
-void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& params)
+float DriveMovement::appliedAdvanceSteps[NumDrivers] = { 0.0 };
+float DriveMovement::nonlinearExtrusionRemainders[NumDrivers] = { 0.0 };
+
+// Calculate the constants that depend on the shape of the move and the number of steps. Without an FPU we use integer division only.
+/*static*/ void DriveMovement::CalcStepConstants(const MoveShape& shape, uint32_t steps, StepConstants& sc) noexcept
 {
-	isDeltaMovement = false;
+#if DM_USE_FPU
+	sc.fTwoCsquaredTimesMmPerStepDivA = (float)((double)2.0/((double)steps * (double)shape.acceleration));
+	sc.fTwoCsquaredTimesMmPerStepDivD = (float)((double)2.0/((double)steps * (double)shape.deceleration));
+	sc.fMmPerStepTimesCdivtopSpeed = 1.0/(steps * shape.topSpeed);
+#else
+	sc.twoCsquaredTimesMmPerStepDivA = divideU64(shape.twoCsquaredDivA, steps);
+	sc.twoCsquaredTimesMmPerStepDivD = divideU64(shape.twoCsquaredDivD, steps);
+	sc.mmPerStepTimesCKdivtopSpeed = (uint32_t)divideU64(shape.kDivTopSpeed, steps);
+#endif
+}
+
+// Set up the acceleration, deceleration and constant speed constants, taking them from the move shape cache if a move of the same shape had the same number of steps
+void DriveMovement::SetStepConstants(const DDA& dda, const PrepParams& params) noexcept
+{
+#if SUPPORT_MOVE_SHAPE_CACHE
+	const StepConstants *sc = MoveShapeCache::FindStepConstants(params.shapeIndex, totalSteps);
+	if (sc == nullptr)
+	{
+		StepConstants& newConstants = MoveShapeCache::AddStepConstants(params.shapeIndex, totalSteps);
+		CalcStepConstants(*params.shape, totalSteps, newConstants);
+		sc = &newConstants;
+	}
+#else
+	StepConstants constants;
+	CalcStepConstants(*params.shape, totalSteps, constants);
+	const StepConstants *const sc = &constants;
+#endif
 
 #if DM_USE_FPU
-	fTwoCsquaredTimesMmPerStepDivA = (float)((double)2.0/((double)totalSteps * (double)dda.acceleration));
-	fTwoCsquaredTimesMmPerStepDivD = (float)((double)2.0/((double)totalSteps * (double)dda.deceleration));
+	fTwoCsquaredTimesMmPerStepDivA = sc->fTwoCsquaredTimesMmPerStepDivA;
+	fTwoCsquaredTimesMmPerStepDivD = sc->fTwoCsquaredTimesMmPerStepDivD;
+	fMmPerStepTimesCdivtopSpeed = sc->fMmPerStepTimesCdivtopSpeed;
 #else
-	twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)totalSteps * (double)dda.acceleration));
-	twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)totalSteps * (double)dda.deceleration));
+	twoCsquaredTimesMmPerStepDivA = sc->twoCsquaredTimesMmPerStepDivA;
+	twoCsquaredTimesMmPerStepDivD = sc->twoCsquaredTimesMmPerStepDivD;
+	mmPerStepTimesCKdivtopSpeed = sc->mmPerStepTimesCKdivtopSpeed;
 #endif
+}
 
-	// Acceleration phase parameters
-	mp.cart.accelStopStep = (uint32_t)(dda.accelDistance * totalSteps) + 1;
-	mp.cart.compensationClocks = mp.cart.accelCompensationClocks = 0;
+// Prepare this DM for a Cartesian axis move
+void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& params)
+{
+	isDeltaMovement = false;
+	SetStepConstants(dda, params);
 
-	// Constant speed phase parameters
+	// Acceleration phase parameters
 #if DM_USE_FPU
-	fMmPerStepTimesCdivtopSpeed = 1.0/(totalSteps * dda.topSpeed);
+	mp.cart.accelStopStep = (uint32_t)(dda.accelDistance * totalSteps) + 1;
 #else
-	mmPerStepTimesCKdivtopSpeed = roundU32(((float)K1)/(totalSteps * dda.topSpeed));
+	mp.cart.accelStopStep = StepsBefore(params.shape->accelDistanceQ31, totalSteps) + 1;
 #endif
+	mp.cart.compensationClocks = mp.cart.accelCompensationClocks = 0;
 
 	// Deceleration phase parameters
 	// First check whether there is any deceleration at all, otherwise we may get strange results because of rounding errors
+#if DM_USE_FPU
 	if (dda.decelDistance * totalSteps < 0.5)
+#else
+	if ((uint64_t)params.shape->decelDistanceQ31 * totalSteps < (1ull << 30))		// if decelDistance * totalSteps < 0.5
+#endif
 	{
 		mp.cart.decelStartStep = totalSteps + 1;
 #if DM_USE_FPU
@@ -57,11 +97,12 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 	}
 	else
 	{
-		mp.cart.decelStartStep = (uint32_t)(params.decelStartDistance * totalSteps) + 1;
 #if DM_USE_FPU
-		fTwoDistanceToStopTimesCsquaredDivD = fsquare(params.fTopSpeedTimesCdivD) + (params.decelStartDistance * 2)/dda.deceleration;
+		mp.cart.decelStartStep = (uint32_t)(params.decelStartDistance * totalSteps) + 1;
+		fTwoDistanceToStopTimesCsquaredDivD = params.fTwoDistanceToStopTimesCsquaredDivD;
 #else
-		twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
+		mp.cart.decelStartStep = StepsBefore(params.shape->decelStartDistanceQ31, totalSteps) + 1;
+		twoDistanceToStopTimesCsquaredDivD = params.twoDistanceToStopTimesCsquaredDivD;
 #endif
 	}
 
@@ -76,13 +117,15 @@ void DriveMovement::PrepareCartesianAxis(const DDA& dda, const PrepParams& param
 
 #if SUPPORT_DELTA_MOVEMENT
 
-// Prepare this DM for a Delta axis move
-//TODO convert this to normalised coordinates like we did for Cartesian drives
+// Prepare this DM for a Delta axis move.
+// The geometry is in mm, but the DDA speeds, accelerations and distances are normalised to the move length, so we scale them by params.totalDistance.
+// This lets a board generate the tower steps for a whole Cartesian move directly from the closed form, so the main board doesn't need to segment it.
 void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 {
 	isDeltaMovement = true;
 
 	const float stepsPerMm = Platform::DriveStepsPerUnit(drive);
+	const float stepsPerMoveLength = stepsPerMm * params.totalDistance;		// converts normalised distances along the move to steps
 	const float A = params.initialX - params.dparams->GetTowerX(drive);
 	const float B = params.initialY - params.dparams->GetTowerY(drive);
 	const float aAplusbB = A * params.dvecX + B * params.dvecY;
@@ -92,14 +135,16 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 	mp.delta.fHmz0s = h0MinusZ0 * stepsPerMm;
 	mp.delta.fMinusAaPlusBbTimesS = -(aAplusbB * stepsPerMm);
 	mp.delta.fDSquaredMinusAsquaredMinusBsquaredTimesSsquared = dSquaredMinusAsquaredMinusBsquared * fsquare(stepsPerMm);
-	fTwoCsquaredTimesMmPerStepDivA = (float)((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.acceleration));
-	fTwoCsquaredTimesMmPerStepDivD = (float)((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.deceleration));
+	mp.delta.fInvT2 = 0.0;										// the first step needs a full calculation
+	mp.delta.calcsTillResync = 0;
+	fTwoCsquaredTimesMmPerStepDivA = (float)((double)2.0/((double)stepsPerMoveLength * (double)dda.acceleration));
+	fTwoCsquaredTimesMmPerStepDivD = (float)((double)2.0/((double)stepsPerMoveLength * (double)dda.deceleration));
 #else
 	mp.delta.hmz0sK = roundS32(h0MinusZ0 * stepsPerMm * DriveMovement::K2);
 	mp.delta.minusAaPlusBbTimesKs = -roundS32(aAplusbB * stepsPerMm * DriveMovement::K2);
 	mp.delta.dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared = roundS64(dSquaredMinusAsquaredMinusBsquared * fsquare(stepsPerMm * DriveMovement::K2));
-	twoCsquaredTimesMmPerStepDivA = roundU64((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.acceleration));
-	twoCsquaredTimesMmPerStepDivD = roundU64((double)(2 * StepTimer::StepClockRateSquared)/((double)stepsPerMm * (double)dda.deceleration));
+	twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)stepsPerMoveLength * (double)dda.acceleration));
+	twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)stepsPerMoveLength * (double)dda.deceleration));
 #endif
 
 	// Calculate the distance at which we need to reverse direction.
@@ -152,21 +197,21 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 
 	// Acceleration phase parameters
 #if DM_USE_FPU
-	mp.delta.fAccelStopDs = dda.accelDistance * stepsPerMm;
+	mp.delta.fAccelStopDs = dda.accelDistance * stepsPerMoveLength;
 #else
-	mp.delta.accelStopDsK = roundU32(dda.accelDistance * stepsPerMm * K2);
+	mp.delta.accelStopDsK = roundU32(dda.accelDistance * stepsPerMoveLength * K2);
 #endif
 
 	// Constant speed phase parameters
 #if DM_USE_FPU
-	fMmPerStepTimesCdivtopSpeed = 1.0/(stepsPerMm * dda.topSpeed);
+	fMmPerStepTimesCdivtopSpeed = 1.0/(stepsPerMoveLength * dda.topSpeed);
 #else
-	mmPerStepTimesCKdivtopSpeed = roundU32((float)K1/(stepsPerMm * dda.topSpeed));
+	mmPerStepTimesCKdivtopSpeed = roundU32((float)K1/(stepsPerMoveLength * dda.topSpeed));
 #endif
 
 	// Deceleration phase parameters
 	// First check whether there is any deceleration at all, otherwise we may get strange results because of rounding errors
-	if (dda.decelDistance * stepsPerMm < 0.5)
+	if (dda.decelDistance * stepsPerMoveLength < 0.5)
 	{
 #if DM_USE_FPU
 		mp.delta.fDecelStartDs = std::numeric_limits<float>::max();
@@ -179,10 +224,10 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 	else
 	{
 #if DM_USE_FPU
-		mp.delta.fDecelStartDs = params.decelStartDistance * stepsPerMm;
+		mp.delta.fDecelStartDs = params.decelStartDistance * stepsPerMoveLength;
 		fTwoDistanceToStopTimesCsquaredDivD = fsquare(params.fTopSpeedTimesCdivD) + (params.decelStartDistance * 2)/dda.deceleration;
 #else
-		mp.delta.decelStartDsK = roundU32(params.decelStartDistance * stepsPerMm * K2);
+		mp.delta.decelStartDsK = roundU32(params.decelStartDistance * stepsPerMoveLength * K2);
 		twoDistanceToStopTimesCsquaredDivD = isquare64(params.topSpeedTimesCdivD) + roundU64((params.decelStartDistance * 2)/dda.deceleration);
 #endif
 	}
@@ -190,11 +235,64 @@ void DriveMovement::PrepareDeltaAxis(const DDA& dda, const PrepParams& params)
 
 #endif
 
+// Increase the number of steps in a forward extruder move to compensate for under-extrusion at high flow rates.
+// The extra steps are real steps, so they are included in the extrusion that Move::GetAccumulatedExtrusion reports to the filament monitors.
+void DriveMovement::ApplyNonlinearExtrusion(const DDA& dda) noexcept
+{
+	const NonlinearExtrusion& nl = Platform::GetExtrusionCoefficients(drive);
+	if (direction && (nl.A > 0.0 || nl.B > 0.0) && nl.limit > 0.0)
+	{
+		const float speed = dda.topSpeed * totalSteps * (float)StepTimer::StepClockRate/Platform::DriveStepsPerUnit(drive);	// top extrusion speed in mm/sec
+		const float factor = constrain<float>(nl.A * speed + nl.B * fsquare(speed), 0.0, nl.limit);
+		const float extraSteps = (float)totalSteps * factor + nonlinearExtrusionRemainders[drive];
+		const uint32_t wholeExtraSteps = (uint32_t)extraSteps;
+		nonlinearExtrusionRemainders[drive] = extraSteps - (float)wholeExtraSteps;
+		totalSteps += wholeExtraSteps;
+		DDA::stepsRequested[drive] += wholeExtraSteps;
+	}
+}
+
+// Return the compensation to use for this move when pressure advance smoothing is enabled.
+// The advance we want at the start of this move is K * startSpeed, but if the speed changed at the move boundary then the advance that we actually have is different,
+// and changing it instantly would need infinite extruder acceleration. So we keep track of the advance we have, and adjust the compensation for this move so as to
+// close the gap gradually, taking about the smoothing time to do so. This keeps the advance continuous across moves, and it is all calculated here on the expansion board.
+float DriveMovement::GetSmoothedCompensationClocks(const DDA& dda, float compensationClocks, float smoothingClocks) noexcept
+{
+	const float sign = (direction) ? 1.0 : -1.0;
+	const float applied = appliedAdvanceSteps[drive] * sign;						// the advance we have at the start of this move, in steps in the direction of this move
+	const float speedChange = (dda.endSpeed - dda.startSpeed) * totalSteps;			// the change in extruder speed during this move, in steps per clock
+	float newCompensationClocks = compensationClocks;
+	if (fabsf(speedChange) * compensationClocks >= 1.0)								// if this move would change the advance by at least one step
+	{
+		const float error = compensationClocks * dda.startSpeed * totalSteps - applied;
+		const float fraction = min<float>((float)dda.clocksNeeded/smoothingClocks, 1.0);
+		newCompensationClocks = constrain<float>(compensationClocks + (fraction * error)/speedChange, 0.0, MaxSmoothedCompensationFactor * compensationClocks);
+		if (newCompensationClocks < 1.0)
+		{
+			newCompensationClocks = 0.0;											// the caller will not apply any compensation to this move
+		}
+	}
+	appliedAdvanceSteps[drive] = (applied + newCompensationClocks * speedChange) * sign;
+	return newCompensationClocks;
+}
+
 // Prepare this DM for an extruder move. The caller has already checked that pressure advance is enabled.
 void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange)
 {
+	ApplyNonlinearExtrusion(dda);
+
 	// Calculate the pressure advance parameters
-	const float compensationClocks = Platform::GetPressureAdvanceClocks(drive);
+	float compensationClocks = Platform::GetPressureAdvanceClocks(drive);
+	const float smoothingClocks = Platform::GetPressureAdvanceSmoothingClocks(drive);
+	if (smoothingClocks > 0.0 && compensationClocks >= 1.0)
+	{
+		compensationClocks = GetSmoothedCompensationClocks(dda, compensationClocks, smoothingClocks);
+	}
+	else
+	{
+		appliedAdvanceSteps[drive] = compensationClocks * dda.endSpeed * totalSteps * ((direction) ? 1.0 : -1.0);
+	}
+
 	if (compensationClocks < 1.0)
 	{
 		return PrepareCartesianAxis(dda, params);			// no compensation active, so use the simpler calculation
@@ -213,19 +311,9 @@ void DriveMovement::PrepareExtruder(const DDA& dda, const PrepParams& params, fl
 	mp.cart.accelCompensationClocks = roundU32(accelCompensationDistance/dda.topSpeed);
 	mp.cart.accelStopStep = (uint32_t)((dda.accelDistance + accelCompensationDistance) * totalSteps) + 1;
 
-#if DM_USE_FPU
-	fTwoCsquaredTimesMmPerStepDivA = (double)2.0/((double)totalSteps * (double)dda.acceleration);
-	fTwoCsquaredTimesMmPerStepDivD = (double)2.0/((double)totalSteps * (double)dda.deceleration);
-#else
-	twoCsquaredTimesMmPerStepDivA = roundU64((double)2.0/((double)totalSteps * (double)dda.acceleration));
-	twoCsquaredTimesMmPerStepDivD = roundU64((double)2.0/((double)totalSteps * (double)dda.deceleration));
-#endif
-
-	// Constant speed phase parameters
-#if DM_USE_FPU
-	fMmPerStepTimesCdivtopSpeed = 1.0/(totalSteps * dda.topSpeed);
-#else
-	mmPerStepTimesCKdivtopSpeed = (uint32_t)((float)K1/(totalSteps * dda.topSpeed));
+	SetStepConstants(dda, params);
+#if !DM_USE_FPU
+	mmPerStepTimesCKdivtopSpeed = (uint32_t)((float)K1/(totalSteps * dda.topSpeed));		// extruders truncate this rather than rounding it
 #endif
 
 	uint32_t newTotalSteps;
@@ -356,16 +444,83 @@ void DriveMovement::DebugPrint(char c) const
 	}
 }
 
+// Calculate the time since the start of the move at which the specified step in the acceleration phase of a Cartesian or extruder move is due
+inline uint32_t DriveMovement::CalcAccelStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+#if DM_USE_FPU
+	const float adjustedStartSpeedTimesCdivA = (float)(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks);
+	return (uint32_t)(fastSqrtf(fsquare(adjustedStartSpeedTimesCdivA) + (fTwoCsquaredTimesMmPerStepDivA * stepNumber)) - adjustedStartSpeedTimesCdivA);
+#else
+	const uint32_t adjustedStartSpeedTimesCdivA = dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks;
+	return isqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (twoCsquaredTimesMmPerStepDivA * stepNumber)) - adjustedStartSpeedTimesCdivA;
+#endif
+}
+
+// Calculate the time since the start of the move at which the specified step in the deceleration phase of a Cartesian or extruder move is due, before any reversal
+inline uint32_t DriveMovement::CalcDecelStepTime(const DDA &dda, uint32_t stepNumber) const
+{
+	const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
+#if DM_USE_FPU
+	const float temp = fTwoCsquaredTimesMmPerStepDivD * stepNumber;
+	// Allow for possible rounding error when the end speed is zero or very small
+	return (temp < fTwoDistanceToStopTimesCsquaredDivD)
+			? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - (uint32_t)(fastSqrtf(fTwoDistanceToStopTimesCsquaredDivD - temp))
+			: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+#else
+	const uint64_t temp = twoCsquaredTimesMmPerStepDivD * stepNumber;
+	// Allow for possible rounding error when the end speed is zero or very small
+	return (temp < twoDistanceToStopTimesCsquaredDivD)
+			? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - isqrt64(twoDistanceToStopTimesCsquaredDivD - temp)
+			: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
+#endif
+}
+
+#if SUPPORT_STEP_TABLES
+
+// Precompute the times of the last few steps of the acceleration phase and the first few steps of the deceleration phase.
+// These are the steps with the shortest intervals, so they are the ones most likely to make the step ISR overrun.
+// Called from DDA::Init after the Prepare function, while the move is not yet executing.
+void DriveMovement::PrepareStepTables(const DDA& dda)
+{
+	accelTableEndStep = min<uint32_t>(mp.cart.accelStopStep, totalSteps + 1);
+	accelTableStartStep = (accelTableEndStep > StepTableLength + 1) ? accelTableEndStep - StepTableLength : 1;
+	for (uint32_t step = accelTableStartStep; step < accelTableEndStep; ++step)
+	{
+		accelStepTimes[step - accelTableStartStep] = CalcAccelStepTime(dda, step);
+	}
+
+	decelTableEndStep = min<uint32_t>(min<uint32_t>(mp.cart.decelStartStep + StepTableLength, reverseStartStep), totalSteps + 1);
+	for (uint32_t step = mp.cart.decelStartStep; step < decelTableEndStep; ++step)
+	{
+		decelStepTimes[step - mp.cart.decelStartStep] = CalcDecelStepTime(dda, step);
+	}
+}
+
+#endif
+
 // Calculate and store the time since the start of the move when the next step for the specified DriveMovement is due.
 // Return true if there are more steps to do.
 // This is also used for extruders on delta machines.
 bool DriveMovement::CalcNextStepTimeCartesianFull(const DDA &dda)
 pre(nextStep < totalSteps; stepsTillRecalc == 0)
 {
+	if (isStopping)
+	{
+		// We always single step during a controlled stop, because the steps are getting further apart
+		const uint32_t nextCalcStepTime = CalcStoppingStepTime(nextStep - mp.stop.startStep);
+		stepInterval = nextCalcStepTime - nextStepTime;
+		nextStepTime = nextCalcStepTime;
+		return true;
+	}
+
 	// Work out how many steps to calculate at a time.
 	// The last step before reverseStartStep must be single stepped to make sure that we don't reverse the direction too soon.
 	uint32_t shiftFactor = 0;		// assume single stepping
-	if (stepInterval < DDA::MinCalcIntervalCartesian)
+	if (   stepInterval < DDA::MinCalcIntervalCartesian
+#if SUPPORT_STEP_TABLES
+		&& !IsTabulatedStep(nextStep)	// looking up a step time is cheap, so single step for best accuracy
+#endif
+	   )
 	{
 		const uint32_t stepsToLimit = ((nextStep <= reverseStartStep && reverseStartStep <= totalSteps)
 										? reverseStartStep
@@ -389,16 +544,23 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 
 	const uint32_t nextCalcStep = nextStep + stepsTillRecalc;
 	uint32_t nextCalcStepTime;
+#if SUPPORT_STEP_TABLES
+	if (nextCalcStep >= accelTableStartStep && nextCalcStep < accelTableEndStep)
+	{
+		// acceleration phase, step time already calculated
+		nextCalcStepTime = accelStepTimes[nextCalcStep - accelTableStartStep];
+	}
+	else if (nextCalcStep >= mp.cart.decelStartStep && nextCalcStep < decelTableEndStep)
+	{
+		// deceleration phase, step time already calculated
+		nextCalcStepTime = decelStepTimes[nextCalcStep - mp.cart.decelStartStep];
+	}
+	else
+#endif
 	if (nextCalcStep < mp.cart.accelStopStep)
 	{
 		// acceleration phase
-#if DM_USE_FPU
-		const float adjustedStartSpeedTimesCdivA = (float)(dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks);
-		nextCalcStepTime = (uint32_t)(fastSqrtf(fsquare(adjustedStartSpeedTimesCdivA) + (fTwoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA);
-#else
-		const uint32_t adjustedStartSpeedTimesCdivA = dda.afterPrepare.startSpeedTimesCdivA + mp.cart.compensationClocks;
-		nextCalcStepTime = isqrt64(isquare64(adjustedStartSpeedTimesCdivA) + (twoCsquaredTimesMmPerStepDivA * nextCalcStep)) - adjustedStartSpeedTimesCdivA;
-#endif
+		nextCalcStepTime = CalcAccelStepTime(dda, nextCalcStep);
 	}
 	else if (nextCalcStep < mp.cart.decelStartStep)
 	{
@@ -419,20 +581,7 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	else if (nextCalcStep < reverseStartStep)
 	{
 		// deceleration phase, not reversed yet
-		const uint32_t adjustedTopSpeedTimesCdivDPlusDecelStartClocks = dda.afterPrepare.topSpeedTimesCdivDPlusDecelStartClocks - mp.cart.compensationClocks;
-#if DM_USE_FPU
-		const float temp = fTwoCsquaredTimesMmPerStepDivD * nextCalcStep;
-		// Allow for possible rounding error when the end speed is zero or very small
-		nextCalcStepTime = (temp < fTwoDistanceToStopTimesCsquaredDivD)
-						? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - (uint32_t)(fastSqrtf(fTwoDistanceToStopTimesCsquaredDivD - temp))
-						: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
-#else
-		const uint64_t temp = twoCsquaredTimesMmPerStepDivD * nextCalcStep;
-		// Allow for possible rounding error when the end speed is zero or very small
-		nextCalcStepTime = (temp < twoDistanceToStopTimesCsquaredDivD)
-						? adjustedTopSpeedTimesCdivDPlusDecelStartClocks - isqrt64(twoDistanceToStopTimesCsquaredDivD - temp)
-						: adjustedTopSpeedTimesCdivDPlusDecelStartClocks;
-#endif
+		nextCalcStepTime = CalcDecelStepTime(dda, nextCalcStep);
 	}
 	else
 	{
@@ -483,6 +632,54 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	return true;
 }
 
+// Calculate when a step of a controlled stop is due. The drive was moving at speed v0 = deceleration * clocksToStop at the last step before the stop,
+// so after t clocks it has moved v0 * t - deceleration * t^2/2 steps. Solving for t when it has moved stepNumber steps gives the following.
+inline uint32_t DriveMovement::CalcStoppingStepTime(uint32_t stepNumber) const
+{
+	return mp.stop.startTime + mp.stop.clocksToStop - isqrt64(mp.stop.clocksToStopSquared - (uint64_t)stepNumber * mp.stop.twoDivDecel);
+}
+
+// Change this drive from its planned motion to decelerating to rest at the specified rate in steps per step clock squared from the speed of its last step.
+// We only do this for Cartesian and extruder moves that are not reversing and have taken at least one step, and we never take more steps than are left in the current direction.
+// Return false if we can't, in which case the caller should stop the drive immediately. Called with interrupts disabled or base priority >= step priority.
+bool DriveMovement::StartControlledStop(float deceleration) noexcept
+{
+	if (deceleration <= 0.0 || nextStep <= 1 || isDeltaMovement || (reverseStartStep <= totalSteps && nextStep >= reverseStartStep))
+	{
+		return false;
+	}
+
+	const float fClocksToStop = 1.0/((float)stepInterval * deceleration);
+	const float fTwoDivDecel = 2.0/deceleration;
+	if (fClocksToStop > (float)DDA::MaxControlledStopClocks || fTwoDivDecel > (float)std::numeric_limits<uint32_t>::max())
+	{
+		return false;
+	}
+
+	const uint32_t stepsLeft = ((reverseStartStep <= totalSteps) ? reverseStartStep - 1 : totalSteps) + 1 - nextStep;
+	mp.stop.clocksToStop = (uint32_t)fClocksToStop;
+	mp.stop.clocksToStopSquared = (uint64_t)mp.stop.clocksToStop * mp.stop.clocksToStop;
+	mp.stop.twoDivDecel = max<uint32_t>((uint32_t)fTwoDivDecel, 1);
+	const uint32_t stopSteps = (uint32_t)min<uint64_t>(mp.stop.clocksToStopSquared/mp.stop.twoDivDecel, stepsLeft);
+	if (stopSteps == 0)
+	{
+		return false;
+	}
+
+	mp.stop.startStep = nextStep - 1;
+	mp.stop.startTime = nextStepTime - stepInterval;
+	totalSteps = mp.stop.startStep + stopSteps;
+	reverseStartStep = totalSteps + 1;
+	stepsTillRecalc = 0;
+	isStopping = true;
+	const uint32_t firstStepTime = CalcStoppingStepTime(1);
+	if (firstStepTime > nextStepTime)
+	{
+		nextStepTime = firstStepTime;
+	}
+	return true;
+}
+
 #if SUPPORT_DELTA_MOVEMENT
 
 // Calculate the time since the start of the move when the next step for the specified DriveMovement is due
@@ -550,7 +747,33 @@ pre(nextStep < totalSteps; stepsTillRecalc == 0)
 	const float t1 = mp.delta.fMinusAaPlusBbTimesS + hmz0sc;
 	// Due to rounding error we can end up trying to take the square root of a negative number if we do not take precautions here
 	const float t2a = mp.delta.fDSquaredMinusAsquaredMinusBsquaredTimesSsquared - fsquare(mp.delta.fHmz0s) + fsquare(t1);
-	const float t2 = (t2a > 0.0) ? fastSqrtf(t2a) : 0.0;
+	float t2;
+	if (t2a > 0.0)
+	{
+		// t2a changes only slightly between calculations, so we normally refine the reciprocal square root from the previous calculation
+		// using a single Newton-Raphson iteration, which needs neither a division nor a square root.
+		// We do the full calculation periodically, and whenever the previous result is not a good enough starting point.
+		float invT2 = mp.delta.fInvT2;
+		const float err = 1.0 - t2a * fsquare(invT2);
+		if (mp.delta.calcsTillResync != 0 && fabsf(err) < MaxDeltaNewtonError)
+		{
+			invT2 *= 1.0 + 0.5 * err;
+			t2 = t2a * invT2;
+			--mp.delta.calcsTillResync;
+		}
+		else
+		{
+			t2 = fastSqrtf(t2a);
+			invT2 = 1.0/t2;
+			mp.delta.calcsTillResync = DeltaResyncInterval;
+		}
+		mp.delta.fInvT2 = invT2;
+	}
+	else
+	{
+		t2 = 0.0;
+		mp.delta.fInvT2 = 0.0;									// force a full calculation next time
+	}
 	const float ds = (direction) ? t1 - t2 : t1 + t2;
 #else
 	const int32_t hmz0scK = (int32_t)(((int64_t)mp.delta.hmz0sK * dda.afterPrepare.cKc)/Kc);
@@ -103,6 +103,62 @@ inline int64_t roundS64(double d)
 #endif
 }
 
+// Divide a value calculated for the whole move by the number of steps, rounding in the same way as the functions above
+inline uint64_t divideU64(uint64_t n, uint32_t d)
+{
+#if ROUND_TO_NEAREST
+	return (n + (d >> 1))/d;
+#else
+	return n/d;
+#endif
+}
+
+// Struct to hold the values that DDA::Prepare derives from the timing fields of a movement message. They don't depend on the steps, so moves with the same shape can share them.
+struct MoveShape
+{
+	float topSpeed;
+	float startSpeed;
+	float endSpeed;
+	float acceleration;
+	float deceleration;
+	float accelDistance;
+	float decelDistance;
+	float decelStartDistance;
+#if DM_USE_FPU
+	float fTopSpeedTimesCdivD;
+	float fTwoDistanceToStopTimesCsquaredDivD;		// the value for a Cartesian axis, excluding pressure advance
+#else
+	uint32_t topSpeedTimesCdivD;
+	uint64_t twoDistanceToStopTimesCsquaredDivD;	// the value for a Cartesian axis, excluding pressure advance
+#endif
+	uint32_t startSpeedTimesCdivA;
+	uint32_t topSpeedTimesCdivDPlusDecelStartClocks;
+	int32_t extraAccelerationClocks;
+#if !DM_USE_FPU
+	// Values that let us calculate the per-drive constants for a Cartesian axis using integer arithmetic only
+	uint64_t twoCsquaredDivA;						// 2/acceleration, which divided by the number of steps gives twoCsquaredTimesMmPerStepDivA
+	uint64_t twoCsquaredDivD;						// 2/deceleration
+	uint64_t kDivTopSpeed;							// K1/topSpeed
+	uint32_t accelDistanceQ31;						// accelDistance as a binary fraction with 31 bits after the point
+	uint32_t decelDistanceQ31;
+	uint32_t decelStartDistanceQ31;
+#endif
+};
+
+// Struct to hold the per-drive constants that depend only on the move shape and the number of steps
+struct StepConstants
+{
+#if DM_USE_FPU
+	float fTwoCsquaredTimesMmPerStepDivA;
+	float fTwoCsquaredTimesMmPerStepDivD;
+	float fMmPerStepTimesCdivtopSpeed;
+#else
+	uint64_t twoCsquaredTimesMmPerStepDivA;
+	uint64_t twoCsquaredTimesMmPerStepDivD;
+	uint32_t mmPerStepTimesCKdivtopSpeed;
+#endif
+};
+
 // Struct for passing parameters to the DriveMovement Prepare methods
 struct PrepParams
 {
@@ -113,8 +169,14 @@ struct PrepParams
 	float decelStartDistance;
 #if DM_USE_FPU
 	float fTopSpeedTimesCdivD;
+	float fTwoDistanceToStopTimesCsquaredDivD;
 #else
 	uint32_t topSpeedTimesCdivD;
+	uint64_t twoDistanceToStopTimesCsquaredDivD;
+#endif
+	const MoveShape *shape;
+#if SUPPORT_MOVE_SHAPE_CACHE
+	size_t shapeIndex;							// the entry in the move shape cache that holds the shape of this move
 #endif
 
 	// Parameters used only for delta moves
@@ -144,13 +206,19 @@ public:
 	void PrepareCartesianAxis(const DDA& dda, const PrepParams& params) SPEED_CRITICAL;
 	void PrepareDeltaAxis(const DDA& dda, const PrepParams& params) SPEED_CRITICAL;
 	void PrepareExtruder(const DDA& dda, const PrepParams& params, float speedChange) SPEED_CRITICAL;
+	float GetSmoothedCompensationClocks(const DDA& dda, float compensationClocks, float smoothingClocks) noexcept;
+	void ApplyNonlinearExtrusion(const DDA& dda) noexcept;
+#if SUPPORT_STEP_TABLES
+	void PrepareStepTables(const DDA& dda) SPEED_CRITICAL;
+#endif
 	void DebugPrint(char c) const;
 	int32_t GetNetStepsLeft() const;
 	int32_t GetNetStepsTaken() const;
 	bool IsDeltaMovement() const { return isDeltaMovement; }
+	bool StartControlledStop(float deceleration) noexcept;	// decelerate to rest instead of stopping dead, returning false if we can't
 
 #if HAS_SMART_DRIVERS
-	uint32_t GetStepInterval(uint32_t msShift) const;	// Get the current full step interval for this axis or extruder
+	uint32_t GetMicrostepInterval() const;				// Get the current microstep interval for this axis or extruder
 #endif
 
 #if SUPPORT_CLOSED_LOOP
@@ -158,7 +226,21 @@ public:
 #endif
 
 private:
+	void SetStepConstants(const DDA& dda, const PrepParams& params) noexcept SPEED_CRITICAL;
+	static void CalcStepConstants(const MoveShape& shape, uint32_t steps, StepConstants& sc) noexcept SPEED_CRITICAL;
+#if !DM_USE_FPU
+	static uint32_t StepsBefore(uint32_t distanceQ31, uint32_t steps) noexcept { return (uint32_t)(((uint64_t)distanceQ31 * steps) >> 31); }
+#endif
 	bool CalcNextStepTimeCartesianFull(const DDA &dda) SPEED_CRITICAL;
+	uint32_t CalcStoppingStepTime(uint32_t stepNumber) const SPEED_CRITICAL;
+	uint32_t CalcAccelStepTime(const DDA &dda, uint32_t stepNumber) const SPEED_CRITICAL;
+	uint32_t CalcDecelStepTime(const DDA &dda, uint32_t stepNumber) const SPEED_CRITICAL;
+#if SUPPORT_STEP_TABLES
+	bool IsTabulatedStep(uint32_t stepNumber) const
+	{
+		return (stepNumber >= accelTableStartStep && stepNumber < accelTableEndStep) || (stepNumber >= mp.cart.decelStartStep && stepNumber < decelTableEndStep);
+	}
+#endif
 #if SUPPORT_DELTA_MOVEMENT
 	bool CalcNextStepTimeDeltaFull(const DDA &dda) SPEED_CRITICAL;
 #endif
@@ -167,17 +249,19 @@ private:
 	static int numFree;
 	static int minFree;
 
-	// Parameters common to Cartesian, delta and extruder moves
+	// Smoothed pressure advance
+	static constexpr float MaxSmoothedCompensationFactor = 2.0;		// the most we will increase the compensation for a move when catching up with the advance we want
+	static float appliedAdvanceSteps[NumDrivers];					// the pressure advance at the end of the last extruder move, in steps
+	static float nonlinearExtrusionRemainders[NumDrivers];			// fractions of a step left over from nonlinear extrusion compensation
 
-#if !SINGLE_DRIVER
-	DriveMovement *nextDM;								// link to next DM that needs a step
-#endif
+	// Parameters common to Cartesian, delta and extruder moves
 
 	DMState state;										// whether this is active or not
 	uint8_t drive;										// the drive that this DM controls
 	uint8_t direction : 1,								// true=forwards, false=backwards
 			directionChanged : 1,						// set by CalcNextStepTime if the direction is changed
-			isDeltaMovement : 1;						// true if this motor is executing a delta tower move
+			isDeltaMovement : 1,						// true if this motor is executing a delta tower move
+			isStopping : 1;								// true if we are decelerating to a controlled stop, in which case the parameters in mp.stop apply
 	uint8_t stepsTillRecalc;							// how soon we need to recalculate
 
 	uint32_t totalSteps;								// total number of steps for this move
@@ -227,6 +311,15 @@ private:
 			uint32_t accelCompensationClocks;			// compensationClocks * (1 - startSpeed/topSpeed)
 		} cart;
 
+		struct StoppingParameters						// Parameters for a controlled stop of a Cartesian or extruder drive, which replace the Cartesian ones
+		{
+			uint64_t clocksToStopSquared;
+			uint32_t clocksToStop;						// how long it takes to stop from the speed at the last step
+			uint32_t twoDivDecel;						// 2/deceleration in clocks^2 per step
+			uint32_t startTime;							// the time of the last step before the stop, relative to the move start
+			uint32_t startStep;							// the number of the last step before the stop
+		} stop;
+
 #if SUPPORT_DELTA_MOVEMENT
 		struct DeltaParameters							// Parameters for delta movement
 		{
@@ -239,6 +332,10 @@ private:
 			// The following depend on how the move is executed, so they must be set up in Prepare()
 			float fAccelStopDs;
 			float fDecelStartDs;
+
+			// The following are used to avoid a full square root calculation on most steps
+			float fInvT2;								// the reciprocal of the square root term from the previous calculation, or 0 if we need to do a full calculation
+			uint32_t calcsTillResync;					// how many more calculations we can do incrementally before we do a full one
 # else
 			// The following don't depend on how the move is executed, so they could be set up in Init() if we use fixed acceleration/deceleration
 			int64_t dSquaredMinusAsquaredMinusBsquaredTimesKsquaredSsquared;
@@ -253,8 +350,25 @@ private:
 #endif
 	} mp;
 
+#if SUPPORT_STEP_TABLES
+	// Precomputed step times for the fastest part of the acceleration phase and the fastest part of the deceleration phase of a Cartesian or extruder move.
+	// These are filled in by PrepareStepTables while the DDA is frozen, so that the step ISR can look them up instead of calculating square roots.
+	static constexpr size_t StepTableLength = 8;
+
+	uint32_t accelTableStartStep;						// the first step number whose time is in accelStepTimes
+	uint32_t accelTableEndStep;							// one more than the last step number whose time is in accelStepTimes
+	uint32_t decelTableEndStep;							// one more than the last step number whose time is in decelStepTimes, which starts at mp.cart.decelStartStep
+	uint32_t accelStepTimes[StepTableLength];
+	uint32_t decelStepTimes[StepTableLength];
+#endif
+
 	static constexpr uint32_t NoStepTime = 0xFFFFFFFF;	// value to indicate that no further steps are needed when calculating the next step time
 
+#if SUPPORT_DELTA_MOVEMENT && DM_USE_FPU
+	static constexpr uint32_t DeltaResyncInterval = 32;		// the maximum number of incremental square root calculations between full calculations
+	static constexpr float MaxDeltaNewtonError = 0.002;		// if the previous result is further out than this fraction we do a full calculation
+#endif
+
 #if !DM_USE_FPU
 	static constexpr uint32_t K1 = 1024;				// a power of 2 used to multiply the value mmPerStepTimesCdivtopSpeed to reduce rounding errors
 	static constexpr uint32_t K2 = 512;					// a power of 2 used in delta calculations to reduce rounding errors (but too large makes things worse)
@@ -329,12 +443,10 @@ inline int32_t DriveMovement::GetNetStepsTaken() const
 
 #if HAS_SMART_DRIVERS
 
-// Get the current full step interval for this axis or extruder
-inline uint32_t DriveMovement::GetStepInterval(uint32_t microstepShift) const
+// Get the current microstep interval for this axis or extruder, or 0 if we haven't taken a step yet
+inline uint32_t DriveMovement::GetMicrostepInterval() const
 {
-	return ((nextStep >> microstepShift) != 0)		// if at least 1 full step done
-		? stepInterval << microstepShift			// return the interval between steps converted to full steps
-			: 0;
+	return (nextStep > 1) ? stepInterval : 0;
 }
 
 #endif
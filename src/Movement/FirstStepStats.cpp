@@ -0,0 +1,114 @@
+/*
+ * FirstStepStats.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "FirstStepStats.h"
+
+#if SUPPORT_DRIVERS
+
+#include "StepTimer.h"
+#include <DiagnosticsRecord.h>
+
+namespace FirstStepStats
+{
+	uint32_t earlyCounts[NumBuckets];
+	uint32_t lateCounts[NumBuckets];
+	int32_t minError = std::numeric_limits<int32_t>::max();
+	int32_t maxError = std::numeric_limits<int32_t>::min();
+	int64_t totalError = 0;
+	uint32_t numMoves = 0;
+
+	// Must be called with interrupts disabled
+	static void Reset() noexcept
+	{
+		memset(earlyCounts, 0, sizeof(earlyCounts));
+		memset(lateCounts, 0, sizeof(lateCounts));
+		minError = std::numeric_limits<int32_t>::max();
+		maxError = std::numeric_limits<int32_t>::min();
+		totalError = 0;
+		numMoves = 0;
+	}
+
+	static void AppendBuckets(const StringRef& reply, const char *name, const uint32_t *counts) noexcept
+	{
+		for (size_t bucket = 0; bucket < NumBuckets; ++bucket)
+		{
+			if (counts[bucket] != 0)
+			{
+				if (bucket == 0)
+				{
+					reply.catf(" %s 0:%" PRIu32, name, counts[bucket]);
+				}
+				else if (bucket + 1 == NumBuckets)
+				{
+					reply.catf(" %s more:%" PRIu32, name, counts[bucket]);
+				}
+				else
+				{
+					reply.catf(" %s <%u:%" PRIu32, name, 1u << bucket, counts[bucket]);
+				}
+			}
+		}
+	}
+}
+
+// Report the statistics. We only report the nonzero buckets, giving the upper limit of each one in step clocks.
+void FirstStepStats::Diagnostics(const StringRef& reply) noexcept
+{
+	uint32_t early[NumBuckets], late[NumBuckets];
+	int32_t minErr, maxErr;
+	int64_t totalErr;
+	uint32_t moves;
+	{
+		AtomicCriticalSectionLocker lock;
+		memcpy(early, earlyCounts, sizeof(early));
+		memcpy(late, lateCounts, sizeof(late));
+		minErr = minError;
+		maxErr = maxError;
+		totalErr = totalError;
+		moves = numMoves;
+		Reset();
+	}
+
+	reply.lcatf("First step error (step clocks): moves %" PRIu32, moves);
+	if (moves != 0)
+	{
+		reply.catf(", min %" PRIi32 ", mean %.1f, max %" PRIi32 ",", minErr, (double)((float)totalErr/(float)moves), maxErr);
+		AppendBuckets(reply, "early", early);
+		AppendBuckets(reply, "late", late);
+	}
+}
+
+// Report the statistics for the compact diagnostics record. The mean is in units of 1/16 step clock.
+void FirstStepStats::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
+{
+	int32_t minErr, maxErr;
+	int64_t totalErr;
+	uint32_t moves;
+	{
+		AtomicCriticalSectionLocker lock;
+		minErr = minError;
+		maxErr = maxError;
+		totalErr = totalError;
+		moves = numMoves;
+		if (rec.ResetCounters())
+		{
+			Reset();
+		}
+	}
+
+	rec.Set(DiagnosticsField::firstStepMoves, moves);
+	if (moves != 0)
+	{
+		rec.Set(DiagnosticsField::firstStepMinError, (uint32_t)minErr);
+		rec.Set(DiagnosticsField::firstStepMaxError, (uint32_t)maxErr);
+		rec.Set(DiagnosticsField::firstStepMeanError, (uint32_t)(int32_t)((totalErr * 16)/(int64_t)moves));
+	}
+}
+
+#endif
+
+// End
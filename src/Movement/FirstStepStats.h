@@ -0,0 +1,63 @@
+/*
+ * FirstStepStats.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MOVEMENT_FIRSTSTEPSTATS_H_
+#define SRC_MOVEMENT_FIRSTSTEPSTATS_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_DRIVERS
+
+class DiagnosticsRecord;
+
+// Module to record how accurately the first step of each move lands compared to the time that the main board scheduled it for, measured in master time.
+// Each board that takes part in a move lands its first step with this error plus its clock sync error, so comparing the results and the sync jitter from each board
+// shows how well coordinated axes on different boards are synchronised. The statistics are updated only by the step ISR, once per move.
+namespace FirstStepStats
+{
+	constexpr size_t NumBuckets = 10;			// bucket 0 is on time, bucket n is 2^(n-1) to 2^n - 1 step clocks early or late, the last bucket includes all larger errors
+
+	extern uint32_t earlyCounts[NumBuckets];
+	extern uint32_t lateCounts[NumBuckets];
+	extern int32_t minError, maxError;
+	extern int64_t totalError;
+	extern uint32_t numMoves;
+
+	void Diagnostics(const StringRef& reply) noexcept;					// append the statistics and reset them
+	void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;
+
+	// Record the first step of a move. Called only by the step ISR. 'error' is in step clocks and is negative if the step was early.
+	inline void Record(int32_t error) noexcept;
+}
+
+inline void FirstStepStats::Record(int32_t error) noexcept
+{
+	const uint32_t magnitude = (error < 0) ? (uint32_t)(-error) : (uint32_t)error;
+	const size_t bucket = (magnitude == 0) ? 0 : min<size_t>((size_t)(32 - __builtin_clz(magnitude)), NumBuckets - 1);
+	if (error < 0)
+	{
+		++earlyCounts[bucket];
+	}
+	else
+	{
+		++lateCounts[bucket];
+	}
+	if (error < minError)
+	{
+		minError = error;
+	}
+	if (error > maxError)
+	{
+		maxError = error;
+	}
+	totalError += error;
+	++numMoves;
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_FIRSTSTEPSTATS_H_ */
@@ -0,0 +1,131 @@
+/*
+ * InputShaper.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "InputShaper.h"
+
+#if SUPPORT_INPUT_SHAPING
+
+#include "StepTimer.h"
+
+// Set the ringing frequency to suppress, or 0 to disable shaping
+void InputShaper::SetFrequency(float freq) noexcept
+{
+	halfPeriodClocks = (freq > 0.0) ? lrintf((float)StepTimer::StepClockRate/(2.0 * freq)) : 0;
+}
+
+float InputShaper::GetFrequency() const noexcept
+{
+	const uint32_t hp = halfPeriodClocks;			// capture volatile variable
+	return (hp == 0) ? 0.0 : (float)StepTimer::StepClockRate/(float)(2 * hp);
+}
+
+void InputShaper::AddSegment(uint32_t startClocks, uint32_t accelClocks, uint32_t steadyClocks, uint32_t decelClocks, float startSpeed, float topSpeed, float endSpeed) noexcept
+{
+	Segment& seg = segments[numSegments++];
+	seg.startClocks = startClocks;
+	seg.accelClocks = accelClocks;
+	seg.steadyClocks = steadyClocks;
+	seg.decelClocks = decelClocks;
+	seg.startSpeed = startSpeed;
+	seg.topSpeed = topSpeed;
+	seg.endSpeed = endSpeed;
+	distanceDone += (startSpeed + topSpeed) * 0.5 * accelClocks + topSpeed * steadyClocks + (topSpeed + endSpeed) * 0.5 * decelClocks;
+	seg.endDistance = distanceDone;
+}
+
+// Work out how to split a move into shaped segments. Return the number of segments, or 0 if the move should be executed unchanged.
+unsigned int InputShaper::Plan(const CanMessageMovementLinear& msg) noexcept
+{
+	numSegments = 0;
+	const uint32_t halfPeriod = halfPeriodClocks;	// capture volatile variable
+	if (halfPeriod == 0)
+	{
+		return 0;
+	}
+
+	const bool shapeAccel = (msg.accelerationClocks >= 2 * MinPeriodsShaped * halfPeriod);
+	const bool shapeDecel = (msg.decelClocks >= 2 * MinPeriodsShaped * halfPeriod);
+	if (!shapeAccel && !shapeDecel)
+	{
+		return 0;
+	}
+
+	// Calculate the speeds in fractions of the move distance per step clock, in the same way as DDA::Init does
+	const float topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
+	const float startSpeed = topSpeed * msg.initialSpeedFraction;
+	const float endSpeed = topSpeed * msg.finalSpeedFraction;
+
+	distanceDone = 0.0;
+	uint32_t clocksDone = 0;
+
+	// The shaped acceleration is A'/2 for half a period, then A' until half a period before the end of the phase, then A'/2 again; where A' = A * Ta/(Ta - halfPeriod)
+	float middleStartSpeed = startSpeed;
+	uint32_t middleAccelClocks = msg.accelerationClocks;
+	if (shapeAccel)
+	{
+		const float shapedAccel = (topSpeed - startSpeed)/(float)(msg.accelerationClocks - halfPeriod);
+		const uint32_t fullAccelClocks = msg.accelerationClocks - 2 * halfPeriod;
+		const float speed1 = startSpeed + shapedAccel * 0.5 * halfPeriod;
+		const float speed2 = speed1 + shapedAccel * fullAccelClocks;
+		AddSegment(clocksDone, halfPeriod, 0, 0, startSpeed, speed1, speed1);
+		clocksDone += halfPeriod;
+		AddSegment(clocksDone, fullAccelClocks, 0, 0, speed1, speed2, speed2);
+		clocksDone += fullAccelClocks;
+		middleStartSpeed = speed2;
+		middleAccelClocks = halfPeriod;
+	}
+
+	// The middle segment comprises the last part of the acceleration, the steady speed phase and the first part of the deceleration
+	if (shapeDecel)
+	{
+		const float shapedDecel = (topSpeed - endSpeed)/(float)(msg.decelClocks - halfPeriod);
+		const uint32_t fullDecelClocks = msg.decelClocks - 2 * halfPeriod;
+		const float speed1 = topSpeed - shapedDecel * 0.5 * halfPeriod;
+		const float speed2 = speed1 - shapedDecel * fullDecelClocks;
+		AddSegment(clocksDone, middleAccelClocks, msg.steadyClocks, halfPeriod, middleStartSpeed, topSpeed, speed1);
+		clocksDone += middleAccelClocks + msg.steadyClocks + halfPeriod;
+		AddSegment(clocksDone, 0, 0, fullDecelClocks, speed1, speed1, speed2);
+		clocksDone += fullDecelClocks;
+		AddSegment(clocksDone, 0, 0, halfPeriod, speed2, speed2, endSpeed);
+	}
+	else
+	{
+		AddSegment(clocksDone, middleAccelClocks, msg.steadyClocks, msg.decelClocks, middleStartSpeed, topSpeed, endSpeed);
+	}
+
+	return numSegments;
+}
+
+// Return the move message for one of the segments that Plan split the move into
+const CanMessageMovementLinear& InputShaper::GetSegment(const CanMessageMovementLinear& msg, unsigned int segmentNumber) noexcept
+{
+	const Segment& seg = segments[segmentNumber];
+	segmentMsg = msg;
+	segmentMsg.whenToExecute = msg.whenToExecute + seg.startClocks;
+	segmentMsg.accelerationClocks = seg.accelClocks;
+	segmentMsg.steadyClocks = seg.steadyClocks;
+	segmentMsg.decelClocks = seg.decelClocks;
+	segmentMsg.initialSpeedFraction = seg.startSpeed/seg.topSpeed;
+	segmentMsg.finalSpeedFraction = seg.endSpeed/seg.topSpeed;
+
+	// Share out the steps in proportion to distance, making sure that the total is unchanged
+	const float startDistance = (segmentNumber == 0) ? 0.0 : segments[segmentNumber - 1].endDistance;
+	const bool isLastSegment = (segmentNumber + 1 == numSegments);
+	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		const int32_t steps = msg.perDrive[drive].steps;
+		const int32_t stepsBefore = lrintf((float)steps * startDistance);
+		const int32_t stepsAfter = (isLastSegment) ? steps : lrintf((float)steps * seg.endDistance);
+		segmentMsg.perDrive[drive].steps = stepsAfter - stepsBefore;
+	}
+	return segmentMsg;
+}
+
+#endif
+
+// End
@@ -0,0 +1,61 @@
+/*
+ * InputShaper.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MOVEMENT_INPUTSHAPER_H_
+#define SRC_MOVEMENT_INPUTSHAPER_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_INPUT_SHAPING
+
+#include <CanMessageFormats.h>
+
+// Class to apply a ZV input shaper to the acceleration and deceleration phases of moves received from the main board.
+// Each shaped phase is replaced by a sequence of constant-acceleration segments that has the same duration, speed change and distance as the original phase.
+// The phase acceleration is convolved with two equal impulses half a ringing period apart, so the shaped move ends at the same time and position as the original.
+// Shaped segments are executed as separate DDAs, so a shaped move uses up to 5 slots in the DDA ring.
+class InputShaper
+{
+public:
+	InputShaper() noexcept : halfPeriodClocks(0), numSegments(0) { }
+
+	void SetFrequency(float freq) noexcept;							// set the ringing frequency to suppress, or 0 to disable shaping
+	float GetFrequency() const noexcept;
+
+	unsigned int Plan(const CanMessageMovementLinear& msg) noexcept SPEED_CRITICAL;							// work out how to split a move, returning the number of segments
+	const CanMessageMovementLinear& GetSegment(const CanMessageMovementLinear& msg, unsigned int segmentNumber) noexcept SPEED_CRITICAL;	// get a segment after calling Plan
+
+	static constexpr unsigned int MaxSegments = 5;
+
+private:
+	struct Segment
+	{
+		uint32_t startClocks;						// when this segment starts relative to the start of the original move
+		uint32_t accelClocks;
+		uint32_t steadyClocks;
+		uint32_t decelClocks;
+		float startSpeed;							// speeds are in fractions of the move distance per step clock
+		float topSpeed;
+		float endSpeed;
+		float endDistance;							// fraction of the move distance completed at the end of this segment
+	};
+
+	void AddSegment(uint32_t startClocks, uint32_t accelClocks, uint32_t steadyClocks, uint32_t decelClocks, float startSpeed, float topSpeed, float endSpeed) noexcept;
+
+	// We only shape a phase if it lasts for at least this number of ringing periods. This limits the increase in peak acceleration to one third.
+	static constexpr uint32_t MinPeriodsShaped = 2;
+
+	volatile uint32_t halfPeriodClocks;				// half the ringing period in step clocks, or 0 if shaping is disabled
+	unsigned int numSegments;
+	float distanceDone;								// used while planning
+	Segment segments[MaxSegments];
+	CanMessageMovementLinear segmentMsg;			// the message for the last segment fetched
+};
+
+#endif
+
+#endif /* SRC_MOVEMENT_INPUTSHAPER_H_ */
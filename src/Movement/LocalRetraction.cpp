@@ -0,0 +1,174 @@
+/*
+ * LocalRetraction.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "LocalRetraction.h"
+
+#if SUPPORT_LOCAL_RETRACTION
+
+#include "StepTimer.h"
+#include <atomic>
+
+LocalRetraction::LocalRetraction() noexcept
+	: requestTime(0), requestDrivers(0), requestRetract(false), requestPending(false), numRetractions(0), numUnretractions(0)
+{
+	for (DriverRetraction& dr : drivers)
+	{
+		dr.configured = dr.retracted = false;
+	}
+}
+
+// Calculate a profile that accelerates to the speed, moves at that speed and decelerates to rest, or accelerates and decelerates if the distance is too short to reach the speed
+/*static*/ void LocalRetraction::CalcProfile(Profile& profile, int32_t steps, float stepsPerSecond, float stepsPerSecondSquared) noexcept
+{
+	const float distance = (float)labs(steps);
+	float accelTime = stepsPerSecond/stepsPerSecondSquared;
+	float steadyTime;
+	if (stepsPerSecond * accelTime >= distance)
+	{
+		accelTime = sqrtf(distance/stepsPerSecondSquared);
+		steadyTime = 0.0;
+	}
+	else
+	{
+		steadyTime = (distance - stepsPerSecond * accelTime)/stepsPerSecond;
+	}
+	profile.accelClocks = lrintf(accelTime * (float)StepTimer::StepClockRate);
+	profile.steadyClocks = max<uint32_t>(lrintf(steadyTime * (float)StepTimer::StepClockRate), (profile.accelClocks == 0) ? 1 : 0);
+	profile.steps = steps;
+}
+
+// Configure retraction for a driver. A retraction length of zero disables local retraction for that driver.
+GCodeResult LocalRetraction::Configure(size_t driver, uint32_t retractSteps, int32_t extraUnretractSteps, uint32_t stepsPerSecond, uint32_t stepsPerSecondSquared, const StringRef& reply) noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.printf("Driver %u does not exist", (unsigned int)driver);
+		return GCodeResult::error;
+	}
+	if (requestPending)
+	{
+		reply.copy("Can't configure retraction while a retraction is pending");
+		return GCodeResult::error;
+	}
+
+	DriverRetraction& dr = drivers[driver];
+	if (retractSteps == 0)
+	{
+		dr.configured = dr.retracted = false;
+		reply.printf("Driver %u local retraction disabled", (unsigned int)driver);
+		return GCodeResult::ok;
+	}
+	if (stepsPerSecond == 0 || stepsPerSecondSquared == 0 || (int32_t)retractSteps + extraUnretractSteps < 0)
+	{
+		reply.copy("Bad retraction parameters");
+		return GCodeResult::error;
+	}
+
+	CalcProfile(dr.retract, -(int32_t)retractSteps, (float)stepsPerSecond, (float)stepsPerSecondSquared);
+	CalcProfile(dr.unretract, (int32_t)retractSteps + extraUnretractSteps, (float)stepsPerSecond, (float)stepsPerSecondSquared);
+	dr.configured = true;
+	dr.retracted = false;
+	reply.printf("Driver %u retract %" PRIu32 " steps in %.1fms, unretract %" PRIi32 " steps in %.1fms", (unsigned int)driver,
+					retractSteps, (double)((float)(2 * dr.retract.accelClocks + dr.retract.steadyClocks) * StepTimer::StepClocksToMillis),
+					dr.unretract.steps, (double)((float)(2 * dr.unretract.accelClocks + dr.unretract.steadyClocks) * StepTimer::StepClocksToMillis));
+	return GCodeResult::ok;
+}
+
+// Ask for a retraction or unretraction of some drivers to start at a local step clock time. Called by the command processor task.
+GCodeResult LocalRetraction::Request(bool retract, uint16_t whichDrivers, uint32_t whenToExecute, const StringRef& reply) noexcept
+{
+	if (requestPending)
+	{
+		reply.copy("Previous retraction not yet executed");
+		return GCodeResult::error;
+	}
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		if ((whichDrivers & (1u << driver)) != 0 && !drivers[driver].configured)
+		{
+			reply.printf("Driver %u has no local retraction configured", (unsigned int)driver);
+			return GCodeResult::error;
+		}
+	}
+
+	requestTime = whenToExecute;
+	requestDrivers = whichDrivers;
+	requestRetract = retract;
+	std::atomic_signal_fence(std::memory_order_release);		// make sure the request is set up before the Move task can see it
+	requestPending = true;
+	return GCodeResult::ok;
+}
+
+bool LocalRetraction::GetPendingTime(uint32_t& whenToExecute) const noexcept
+{
+	if (requestPending)
+	{
+		whenToExecute = requestTime;
+		return true;
+	}
+	return false;
+}
+
+// Build the move for the pending request and clear it. The move starts at the requested time, or at earliestStartTime if that is later.
+// Drives that are already in the requested state don't move. If more than one drive moves, they all use the profile that takes longest.
+bool LocalRetraction::MakeMove(CanMessageMovementLinear& msg, uint32_t earliestStartTime) noexcept
+{
+	if (!requestPending)
+	{
+		return false;
+	}
+	std::atomic_signal_fence(std::memory_order_acquire);		// don't read the request until we have seen that it is pending
+
+	memset(&msg, 0, sizeof(msg));
+	msg.numDrivers = NumDrivers;
+	const Profile *longest = nullptr;
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		DriverRetraction& dr = drivers[driver];
+		if ((requestDrivers & (1u << driver)) != 0 && dr.configured && dr.retracted != requestRetract)
+		{
+			const Profile& profile = (requestRetract) ? dr.retract : dr.unretract;
+			msg.perDrive[driver].steps = profile.steps;
+			dr.retracted = requestRetract;
+			if (longest == nullptr || 2 * profile.accelClocks + profile.steadyClocks > 2 * longest->accelClocks + longest->steadyClocks)
+			{
+				longest = &profile;
+			}
+		}
+	}
+
+	const bool retract = requestRetract;
+	msg.whenToExecute = ((int32_t)(earliestStartTime - requestTime) > 0) ? earliestStartTime : requestTime;
+	requestPending = false;
+	if (longest == nullptr)
+	{
+		return false;
+	}
+
+	msg.accelerationClocks = msg.decelClocks = longest->accelClocks;
+	msg.steadyClocks = longest->steadyClocks;
+	msg.initialSpeedFraction = msg.finalSpeedFraction = 0.0;
+	msg.pressureAdvanceDrives = 0;
+	if (retract)
+	{
+		++numRetractions;
+	}
+	else
+	{
+		++numUnretractions;
+	}
+	return true;
+}
+
+void LocalRetraction::Diagnostics(const StringRef& reply) const noexcept
+{
+	reply.catf(", retractions %" PRIu32 "/%" PRIu32, numRetractions, numUnretractions);
+}
+
+#endif
+
+// End
@@ -0,0 +1,65 @@
+/*
+ * LocalRetraction.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MOVEMENT_LOCALRETRACTION_H_
+#define SRC_MOVEMENT_LOCALRETRACTION_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_LOCAL_RETRACTION
+
+#include <CanMessageFormats.h>
+
+// Class to execute firmware retraction and unretraction of the extruders on this board, so that the main board doesn't need to send extruder-only moves for them.
+// The retract and unretract profiles of each driver are calculated when retraction is configured. The main board asks for a retraction to start at a move boundary,
+// and the Move task adds it to the ring as a local move when the first move at or after that time arrives, or shortly before the time if no move arrives.
+// A retraction is not a printing move, so the filament monitors ignore it in the same way as an extruder-only move from the main board.
+class LocalRetraction
+{
+public:
+	LocalRetraction() noexcept;
+
+	GCodeResult Configure(size_t driver, uint32_t retractSteps, int32_t extraUnretractSteps, uint32_t stepsPerSecond, uint32_t stepsPerSecondSquared, const StringRef& reply) noexcept;
+	GCodeResult Request(bool retract, uint16_t whichDrivers, uint32_t whenToExecute, const StringRef& reply) noexcept;	// ask for a retraction to start at a local step clock time
+
+	// Functions called by the Move task
+	bool GetPendingTime(uint32_t& whenToExecute) const noexcept;	// if a retraction is waiting to be added to the ring, return true with the time it is due
+	bool MakeMove(CanMessageMovementLinear& msg, uint32_t earliestStartTime) noexcept;	// build the move for the pending retraction and clear the request, returning false if no drive needs to move
+
+	void Diagnostics(const StringRef& reply) const noexcept;
+
+private:
+	struct Profile
+	{
+		uint32_t accelClocks;							// the deceleration phase is the same length
+		uint32_t steadyClocks;
+		int32_t steps;									// negative for a retraction
+	};
+
+	struct DriverRetraction
+	{
+		Profile retract;
+		Profile unretract;
+		bool configured;
+		bool retracted;
+	};
+
+	static void CalcProfile(Profile& profile, int32_t steps, float stepsPerSecond, float stepsPerSecondSquared) noexcept;
+
+	DriverRetraction drivers[NumDrivers];
+	uint32_t requestTime;
+	uint16_t requestDrivers;
+	bool requestRetract;
+	volatile bool requestPending;						// set by the command task after it has set up the request, cleared by the Move task when it takes it
+
+	uint32_t numRetractions;
+	uint32_t numUnretractions;
+};
+
+#endif
+
+#endif /* SRC_MOVEMENT_LOCALRETRACTION_H_ */
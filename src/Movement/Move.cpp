@@ -38,11 +38,18 @@
 #if SUPPORT_DRIVERS
 
 #include "StepTimer.h"
+#include "FirstStepStats.h"
+#include "MoveShapeCache.h"
 #include "Platform.h"
 #include <CAN/CanInterface.h>
+#include <GPIO/GpioPorts.h>
+#include <LatencyHistograms.h>
+#include <DiagnosticsRecord.h>
 #include <CanMessageFormats.h>
 #include <CanMessageBuffer.h>
 #include <TaskPriorities.h>
+#include <PriorityProfiles.h>
+#include <limits>
 
 #if HAS_SMART_DRIVERS
 # include "StepperDrivers/TMC51xx.h"
@@ -51,10 +58,13 @@
 
 #if 1	//debug
 unsigned int moveCompleteTimeoutErrs;
-unsigned int getCanMoveTimeoutErrs;
 #endif
 
+#if SUPPORT_SPEED_OVERRIDE
+constexpr size_t MoveTaskStackWords = 220;								// AddMove needs a copy of the message when it retimes a move that was in flight
+#else
 constexpr size_t MoveTaskStackWords = 200;
+#endif
 static Task<MoveTaskStackWords> *moveTask;
 
 extern "C" [[noreturn]] void MoveLoop(void * param) noexcept
@@ -63,12 +73,27 @@ extern "C" [[noreturn]] void MoveLoop(void * param) noexcept
 }
 
 Move::Move()
-	: currentDda(nullptr), extrudersPrinting(false), taskWaitingForMoveToComplete(nullptr), scheduledMoves(0), completedMoves(0), numHiccups(0)
-#if SUPPORT_CLOSED_LOOP
-	, netMicrostepsTaken(0), driver0MicrostepShift(-4)					// default to x16 microstepping
+	: currentDda(nullptr), extrudersPrinting(false), taskWaitingForMoveToComplete(nullptr), moveStartCaptureArmed(false), moveStartCaptured(false),
+	  scheduledMoves(0), completedMoves(0), numHiccups(0), totalHiccups(0), hiccupsAtLastSample(0), hiccupHistoryIndex(0), maxRingOccupancy(0),
+	  numUnderrunStops(0), lastUnderrunSlackClocks(0), lastUnderrunStopClocks(0), underrunStopToReport(false)
+#if SUPPORT_AUTO_MICROSTEPPING
+	, numMicrosteppingSwitches(0)
+#endif
+#if SUPPORT_SPEED_OVERRIDE
+	, speedOverrideFactor(1.0), speedOverrideBoundary(0), speedOverrideEnd(0), speedOverrideInFlight(false), numSpeedOverrides(0), numMovesRetimed(0), numInFlightMovesRetimed(0)
+#endif
+#if SUPPORT_POWER_FAIL_STOP
+	, powerFailed(false), havePowerFailSnapshot(false)
+#endif
+#if SUPPORT_MOVE_TRACE
+	, moveTraceNextIndex(0), numMovesTraced(0), currentMoveHiccups(0)
 #endif
 {
 	kinematics = Kinematics::Create(KinematicsType::cartesian);			// default to Cartesian
+	for (uint16_t& h : hiccupHistory)
+	{
+		h = 0;
+	}
 
 	// Build the DDA ring
 	DDA *dda = new DDA(nullptr);
@@ -83,10 +108,33 @@ Move::Move()
 	dda->SetPrevious(ddaRingAddPointer);
 
 	timer.SetCallback(Move::TimerCallback, CallbackParameter(this));
+	maxBabyStepsPerClock = (float)DefaultMaxBabySteppingRate/(float)StepTimer::StepClockRate;
+
+#if SUPPORT_CLOSED_LOOP
+	for (size_t i = 0; i < NumClosedLoopDrivers; ++i)
+	{
+		netMicrostepsTaken[i] = 0;
+		microstepShifts[i] = -4;										// default to x16 microstepping
+	}
+#endif
 
 	for (size_t i = 0; i < NumDrivers; ++i)
 	{
 		movementAccumulators[i] = 0;
+		positionAfterCompletedMoves[i] = 0;
+		pendingBabySteps[i] = 0;
+#if HAS_SMART_DRIVERS
+		stepIntervals[i] = 0;
+#endif
+#if SUPPORT_AUTO_MICROSTEPPING
+		AutoMicrostepping& am = autoMicrostepping[i];
+		am.thresholdStepsPerClock = 0.0;
+		am.fineMicrosteps = am.coarseMicrosteps = 16;
+		am.shift = 0;
+		am.fineInterpolate = true;
+		am.enabled = am.coarseActive = false;
+		am.pendingSteps = 0;
+#endif
 	}
 }
 
@@ -103,9 +151,14 @@ void Move::Init()
 
 	currentDda = nullptr;
 	maxPrepareTime = 0;
+	ResetPrepareStats();
+#if SUPPORT_SPEED_OVERRIDE
+	speedOverrideMutex.Create("SpeedOverride");
+#endif
 
 	moveTask = new Task<MoveTaskStackWords>;
 	moveTask->Create(MoveLoop, "Move", this, TaskPriority::MovePriority);
+	PriorityProfiles::SetTaskRole(*moveTask, PriorityProfiles::TaskRole::move);
 
 # if HAS_SMART_DRIVERS
 	for (size_t i = 0; i < NumDrivers; ++i)
@@ -150,111 +203,472 @@ inline void Move::StartNextMove(DDA *cdda, uint32_t startTime)
 		extrudersPrinting = true;
 		extrudersPrintingSince = millis();
 	}
+#if SUPPORT_MOVE_TRACE
+	MoveTraceEntry& entry = moveTrace[moveTraceNextIndex];
+	entry.plannedStartTime = cdda->GetMoveStartTime();
+	entry.startLateness = (int32_t)(startTime - entry.plannedStartTime);
+	currentMoveHiccups = 0;
+#endif
 	currentDda = cdda;
 	cdda->Start(startTime);
+	if (moveStartCaptureArmed)
+	{
+		capturedMoveStartTime = cdda->GetMoveStartTime();
+		moveStartCaptured = true;
+		moveStartCaptureArmed = false;
+	}
+	GpioPorts::MoveStarting(cdda->GetMoveStartTime());
 }
 
-[[noreturn]] void Move::TaskLoop() noexcept
+bool Move::GetCapturedMoveStartTime(uint32_t& startTime) const noexcept
 {
-	while (true)
+	if (moveStartCaptured)
+	{
+		startTime = capturedMoveStartTime;
+		return true;
+	}
+	return false;
+}
+
+// Wait until the DDA at the add pointer is free, recycling any DDAs for completed moves
+void Move::WaitForFreeDda() noexcept
+{
+	for (;;)
 	{
-		for (;;)
+		// Recycle the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled
+		while (ddaRingCheckPointer->GetState() == DDA::completed)
 		{
-			// Recycle the DDAs for completed moves, checking for DDA errors to print if Move debug is enabled
-			while (ddaRingCheckPointer->GetState() == DDA::completed)
+			// Check for step errors and record/print them if we have any, before we lose the DMs
+			if (ddaRingCheckPointer->HasStepError())
 			{
-				// Check for step errors and record/print them if we have any, before we lose the DMs
-				if (ddaRingCheckPointer->HasStepError())
+				if (Platform::Debug(moduleMove))
 				{
-					if (Platform::Debug(moduleMove))
-					{
-						ddaRingCheckPointer->DebugPrintAll();
-					}
-					Platform::LogError(ErrorCode::BadMove);
+					ddaRingCheckPointer->DebugPrintAll();
 				}
-
-				// Now release the DMs and check for underrun
-				ddaRingCheckPointer->Free();
-				ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
+				Platform::LogError(ErrorCode::BadMove);
 			}
 
-			// If we have a free slot for a new move, quit this loop
-			if (ddaRingAddPointer->GetState() == DDA::empty)
-			{
-				break;
-			}
+			// Now release the DMs and check for underrun
+			ddaRingCheckPointer->Free();
+			ddaRingCheckPointer = ddaRingCheckPointer->GetNext();
+		}
 
-			// Wait for a move to complete
-			{
-				AtomicCriticalSectionLocker lock;
+		// If we have a free slot for a new move, quit this loop
+		if (ddaRingAddPointer->GetState() == DDA::empty)
+		{
+			break;
+		}
 
-				if (ddaRingCheckPointer->GetState() == DDA::completed)
-				{
-					continue;
-				}
-				taskWaitingForMoveToComplete = TaskBase::GetCallerTaskHandle();
+		// Wait for a move to complete
+		{
+			AtomicCriticalSectionLocker lock;
+
+			if (ddaRingCheckPointer->GetState() == DDA::completed)
+			{
+				continue;
 			}
+			taskWaitingForMoveToComplete = TaskBase::GetCallerTaskHandle();
+		}
 #if 1	//debug
-			if (!TaskBase::Take(2000) && ddaRingCheckPointer->GetState() == DDA::completed)
+		if (!TaskBase::Take(2000) && ddaRingCheckPointer->GetState() == DDA::completed)
+		{
+			++moveCompleteTimeoutErrs;
+		}
+#else
+		TaskBase::Take();
+#endif
+	}
+}
+
+// Set up the DDA at the add pointer from a move message and add it to the ring, then start it if nothing is executing
+// If the move was sent before a speed override and starts after its boundary then we retime it the same way as the moves that were already in the ring.
+void Move::AddMove(const CanMessageMovementLinear& msg) noexcept
+{
+#if SUPPORT_SPEED_OVERRIDE
+	MutexLocker lock(speedOverrideMutex);
+	if (speedOverrideInFlight)
+	{
+		const uint32_t startTime = msg.whenToExecute;
+		if ((int32_t)(startTime - speedOverrideEnd) >= 0)
+		{
+			speedOverrideInFlight = false;											// this move was planned after the override
+		}
+		else if ((int32_t)(startTime - speedOverrideBoundary) >= 0)
+		{
+			if ((int32_t)(startTime + msg.accelerationClocks + msg.steadyClocks + msg.decelClocks - speedOverrideEnd) >= -MaxSpeedOverrideEndError)
 			{
-				++moveCompleteTimeoutErrs;
+				speedOverrideInFlight = false;										// this is the last move that was sent before the override
 			}
+			CanMessageMovementLinear retimedMsg = msg;
+			retimedMsg.whenToExecute = MapSpeedOverrideTime(startTime);
+			DDA::ScaleMoveTiming(retimedMsg, speedOverrideFactor);
+			++numInFlightMovesRetimed;
+			AddMoveToRing(retimedMsg);
+			return;
+		}
+	}
+#endif
+	AddMoveToRing(msg);
+}
+
+// Set up the DDA at the add pointer from a move message and add it to the ring, then start it if nothing is executing
+void Move::AddMoveToRing(const CanMessageMovementLinear& msg) noexcept
+{
+	MicrosecondsTimer prepareTimer;
+	int32_t babySteps[NumDrivers];
+	const bool haveBabySteps = TakeBabySteps(msg, babySteps);
+#if SUPPORT_AUTO_MICROSTEPPING
+	uint8_t stepShifts[NumDrivers];
+	const bool adjustedSteps = SelectMicrostepping(msg, babySteps, stepShifts);
+	ddaRingAddPointer->SetStepShifts((adjustedSteps) ? stepShifts : nullptr);
+	if (ddaRingAddPointer->Init(msg, (haveBabySteps || adjustedSteps) ? babySteps : nullptr))
 #else
-			TaskBase::Take();
+	if (ddaRingAddPointer->Init(msg, (haveBabySteps) ? babySteps : nullptr))
+#endif
+	{
+		ddaRingAddPointer = ddaRingAddPointer->GetNext();
+		scheduledMoves++;
+		RecordPrepareStats(prepareTimer.Read(), msg.whenToExecute);
+		const uint32_t occupancy = scheduledMoves - completedMoves;
+		if (occupancy > maxRingOccupancy)
+		{
+			maxRingOccupancy = occupancy;
+		}
+	}
+
+	StartMoveIfIdle();
+}
+
+// See whether we need to kick off a move
+void Move::StartMoveIfIdle() noexcept
+{
+	if (currentDda == nullptr
+#if SUPPORT_POWER_FAIL_STOP
+		&& !powerFailed
 #endif
-		};
+	   )
+	{
+		// No DDA is executing, so start executing a new one if possible
+		DDA * const cdda = ddaRingGetPointer;										// capture volatile variable
+		if (cdda->GetState() == DDA::frozen)
+		{
+			IrqDisable();
+			StartNextMove(cdda, StepTimer::GetTimerTicks());
+			if (cdda->ScheduleNextStepInterrupt(timer))
+			{
+				Interrupt();
+			}
+			IrqEnable();
+		}
+	}
+}
+
+[[noreturn]] void Move::TaskLoop() noexcept
+{
+	while (true)
+	{
+		WaitForFreeDda();
 
 		// Get another move and add it to the ring
-#if 1	//debug
-		CanMessageBuffer *buf;
-		for (;;)
+		// The message is processed in place in the move queue
+		const CanMessageMovementLinear * const msg = CanInterface::GetCanMove(GetMoveWaitTimeout());
+#if SUPPORT_LOCAL_RETRACTION
+		if (AddRetractionIfDue(msg) && msg != nullptr)
+		{
+			WaitForFreeDda();														// the retraction used the free slot
+		}
+#endif
+		if (msg == nullptr)
 		{
-			buf = CanInterface::GetCanMove(2000);
-			if (buf != nullptr)
+			if (GetUnderrunTimeout() == 0)
 			{
-				break;
+				AddUnderrunStopMove();												// the next move didn't arrive in time
 			}
-			buf = CanInterface::GetCanMove(0);
-			if (buf != nullptr)
+			continue;
+		}
+#if SUPPORT_INPUT_SHAPING
+		// If the move is to be shaped then it is executed as several DDAs, each of which needs a free slot in the ring
+		const unsigned int numSegments = shaper.Plan(*msg);
+		if (numSegments != 0)
+		{
+			for (unsigned int i = 0; i < numSegments; ++i)
 			{
-				++getCanMoveTimeoutErrs;
-				break;
+				if (i != 0)
+				{
+					WaitForFreeDda();
+				}
+				AddMove(shaper.GetSegment(*msg, i));
 			}
 		}
-#else
-		CanMessageBuffer *buf = CanInterface::GetCanMove(TaskBase::TimeoutUnlimited);
+		else
 #endif
-		MicrosecondsTimer prepareTimer;
-		if (ddaRingAddPointer->Init(buf->msg.moveLinear))
 		{
-			ddaRingAddPointer = ddaRingAddPointer->GetNext();
-			scheduledMoves++;
+			AddMove(*msg);
 		}
-		const uint32_t elapsedTime = prepareTimer.Read();
-		if (elapsedTime > Move::maxPrepareTime)
+
+		CanInterface::FinishedWithCanMove();
+	}
+}
+
+#if SUPPORT_SPEED_OVERRIDE
+
+// Apply a speed override from the main board. The times are master times. The boundary time is the start of the first move to be retimed, and the end time is
+// when the last move that the main board sent before the override ends using the old timing. Each move that starts at or after the boundary is moved so that
+// its start time is the same fraction of the way from the boundary, and its durations are divided by the factor. Every board that has the moves does the same
+// calculation, so the boards stay in step. The main board is responsible for the speed change at the boundary being within the machine limits.
+GCodeResult Move::ApplySpeedOverride(float factor, uint32_t masterBoundaryTime, uint32_t masterEndTime, const StringRef& reply) noexcept
+{
+	if (!(factor >= MinSpeedOverrideFactor && factor <= MaxSpeedOverrideFactor))
+	{
+		reply.printf("Speed override factor %.3f out of range", (double)factor);
+		return GCodeResult::error;
+	}
+
+	const uint32_t boundary = StepTimer::ConvertToLocalTime(masterBoundaryTime);
+	const uint32_t end = StepTimer::ConvertToLocalTime(masterEndTime);
+	if ((int32_t)(end - boundary) < 0)
+	{
+		reply.copy("Speed override ends before it starts");
+		return GCodeResult::error;
+	}
+
+	MutexLocker lock(speedOverrideMutex);
+	if ((int32_t)(boundary - StepTimer::GetTimerTicks()) < (int32_t)SpeedOverrideLeadClocks)
+	{
+		reply.copy("Speed override received too late");
+		return GCodeResult::error;
+	}
+	if (speedOverrideInFlight && (int32_t)(StepTimer::GetTimerTicks() - speedOverrideEnd) < 0)
+	{
+		reply.copy("Previous speed override still in progress");
+		return GCodeResult::error;
+	}
+
+	// Stop the step ISR starting any of the moves that we are going to retime. None of them can have started because they all start after the lead time.
+	DDA *firstDda = nullptr;
+	{
+		AtomicCriticalSectionLocker interruptLock;
+		for (DDA *dda = ddaRingGetPointer; dda != ddaRingAddPointer; dda = dda->GetNext())
 		{
-			Move::maxPrepareTime = elapsedTime;
+			if (dda->GetState() == DDA::frozen && (int32_t)(dda->GetMoveStartTime() - boundary) >= 0)
+			{
+				if (firstDda == nullptr)
+				{
+					firstDda = dda;
+				}
+				dda->MakeProvisional();
+			}
 		}
+	}
 
-		CanMessageBuffer::Free(buf);
+	speedOverrideFactor = factor;
+	speedOverrideBoundary = boundary;
+	speedOverrideEnd = end;
+	speedOverrideInFlight = (end != boundary);
+	++numSpeedOverrides;
+
+	// Retime the moves in ring order, because each one starts from the end point of the previous one
+	unsigned int numRetimed = 0;
+	if (firstDda != nullptr)
+	{
+		for (DDA *dda = firstDda; dda != ddaRingAddPointer; dda = dda->GetNext())
+		{
+			if (dda->GetState() == DDA::provisional)
+			{
+				dda->Retime(MapSpeedOverrideTime(dda->GetMoveStartTime()), factor);
+				++numRetimed;
+			}
+		}
 
-		// See whether we need to kick off a move
-		if (currentDda == nullptr)
+		// Freeze them all together, so that the ISR can't run out of frozen moves part way through the sequence
 		{
-			// No DDA is executing, so start executing a new one if possible
-			DDA * const cdda = ddaRingGetPointer;										// capture volatile variable
-			if (cdda->GetState() == DDA::frozen)
+			AtomicCriticalSectionLocker interruptLock;
+			for (DDA *dda = firstDda; dda != ddaRingAddPointer; dda = dda->GetNext())
 			{
-				IrqDisable();
-				StartNextMove(cdda, StepTimer::GetTimerTicks());
-				if (cdda->ScheduleNextStepInterrupt(timer))
+				if (dda->GetState() == DDA::provisional)
 				{
-					Interrupt();
+					dda->Freeze();
 				}
-				IrqEnable();
 			}
 		}
+
+		// If the move before the first one we retimed finished while we were working, the ISR will have stopped
+		StartMoveIfIdle();
+	}
+
+	numMovesRetimed += numRetimed;
+	reply.printf("Speed factor %.3f, %u queued moves retimed", (double)factor, numRetimed);
+	return GCodeResult::ok;
+}
+
+#endif
+
+// Get how long the Move task can wait for another move. If the last move in the ring ends at speed then we must add a stopping move before it ends.
+uint32_t Move::GetUnderrunTimeout() const noexcept
+{
+	const DDA * const lastDda = ddaRingAddPointer->GetPrevious();
+	const DDA::DDAState st = lastDda->GetState();
+	if ((st != DDA::frozen && st != DDA::executing)
+#if SUPPORT_POWER_FAIL_STOP
+		|| powerFailed
+#endif
+		|| lastDda->EndsAtRest())
+	{
+		return TaskBase::TimeoutUnlimited;
+	}
+	const int32_t slack = (int32_t)(lastDda->GetMoveFinishTime() - UnderrunLeadClocks - StepTimer::GetTimerTicks());
+	return (slack <= 0) ? 0 : (uint32_t)slack/(StepTimer::StepClockRate/1000);
+}
+
+// Get how long the Move task can wait for another move before it must add an underrun stopping move or a pending retraction
+uint32_t Move::GetMoveWaitTimeout() const noexcept
+{
+	const uint32_t timeout = GetUnderrunTimeout();
+#if SUPPORT_LOCAL_RETRACTION
+	uint32_t retractionTime;
+	if (retraction.GetPendingTime(retractionTime))
+	{
+		const int32_t slack = (int32_t)(retractionTime - RetractionLeadClocks - StepTimer::GetTimerTicks());
+		return min<uint32_t>(timeout, (slack <= 0) ? 0 : (uint32_t)slack/(StepTimer::StepClockRate/1000));
+	}
+#endif
+	return timeout;
+}
+
+#if SUPPORT_LOCAL_RETRACTION
+
+// Ask for a local retraction or unretraction. The main board schedules it for the boundary between two moves, normally the start of a travel move.
+GCodeResult Move::RequestRetraction(bool retract, uint16_t whichDrivers, uint32_t masterStartTime, const StringRef& reply) noexcept
+{
+	const uint32_t startTime = (masterStartTime == 0) ? StepTimer::GetTimerTicks() + RetractionLeadClocks : StepTimer::ConvertToLocalTime(masterStartTime);
+	const GCodeResult rslt = retraction.Request(retract, whichDrivers, startTime, reply);
+	if (rslt == GCodeResult::ok)
+	{
+		CanInterface::InterruptCanMoveWait();										// the Move task may be waiting for a move that won't come until after the retraction
+	}
+	return rslt;
+}
+
+// Add the pending retraction to the ring if the next move starts at or after its time, or if it is nearly due. Called by the Move task when it has a free DDA.
+// The retraction starts at its scheduled time or when the last move in the ring ends, whichever is later. Return true if we added a move.
+bool Move::AddRetractionIfDue(const CanMessageMovementLinear *nextMsg) noexcept
+{
+	uint32_t retractionTime;
+	if (!retraction.GetPendingTime(retractionTime))
+	{
+		return false;
+	}
+	if (   (nextMsg == nullptr || (int32_t)(nextMsg->whenToExecute - retractionTime) < 0)
+		&& (int32_t)(retractionTime - RetractionLeadClocks - StepTimer::GetTimerTicks()) > 0
+	   )
+	{
+		return false;																// not due yet, and moves before it may still arrive
+	}
+
+	const DDA * const lastDda = ddaRingAddPointer->GetPrevious();
+	const DDA::DDAState st = lastDda->GetState();
+	const uint32_t earliestStartTime = (st == DDA::frozen || st == DDA::executing) ? lastDda->GetMoveFinishTime() : StepTimer::GetTimerTicks();
+	CanMessageMovementLinear msg;
+	if (!retraction.MakeMove(msg, earliestStartTime))
+	{
+		return false;																// the drives were already in the requested state
+	}
+# if SUPPORT_SPEED_OVERRIDE
+	MutexLocker lock(speedOverrideMutex);
+# endif
+	AddMoveToRing(msg);
+	return true;
+}
+
+#endif
+
+// Add a move to bring the drives to rest at the end of the last move in the ring. It starts at the end of that move so there is no speed discontinuity.
+// The main board will be told about the underrun. If the next move arrives later, it is executed after the stopping move.
+void Move::AddUnderrunStopMove() noexcept
+{
+#if SUPPORT_SPEED_OVERRIDE
+	MutexLocker lock(speedOverrideMutex);										// a speed override may retime the last move
+#endif
+	DDA * const lastDda = ddaRingAddPointer->GetPrevious();
+	const DDA::DDAState st = lastDda->GetState();
+	if ((st == DDA::frozen || st == DDA::executing) && !lastDda->EndsAtRest())
+	{
+		CanMessageMovementLinear msg;
+		const uint32_t stopClocks = lastDda->MakeStoppingMove(msg);
+		const int32_t slack = (int32_t)(msg.whenToExecute - StepTimer::GetTimerTicks());
+		AddMoveToRing(msg);													// the stopping move already follows on from the last move, so it mustn't be retimed again
+		++numUnderrunStops;
+		lastUnderrunSlackClocks = slack;
+		lastUnderrunStopClocks = stopClocks;
+		underrunStopToReport = true;
+	}
+}
+
+bool Move::GetNewUnderrunStop(int32_t& slackClocks, uint32_t& stopClocks) noexcept
+{
+	if (underrunStopToReport)
+	{
+		underrunStopToReport = false;
+		slackClocks = lastUnderrunSlackClocks;
+		stopClocks = lastUnderrunStopClocks;
+		return true;
+	}
+	return false;
+}
+
+// Update the move preparation statistics. Called by the Move task after it has prepared a move.
+void Move::RecordPrepareStats(uint32_t prepareTime, uint32_t whenToExecute) noexcept
+{
+	if (prepareTime > maxPrepareTime)
+	{
+		maxPrepareTime = prepareTime;
+	}
+
+	size_t bucket = 0;
+	for (uint32_t limit = FirstPrepareTimeBucketLimit; bucket + 1 < NumPrepareTimeBuckets && prepareTime >= limit; limit <<= 1)
+	{
+		++bucket;
+	}
+	++prepareTimeHistogram[bucket];
+
+	const int32_t lead = (int32_t)(whenToExecute - StepTimer::GetTimerTicks());
+	if (lead < minPrepareLead)
+	{
+		minPrepareLead = lead;
+	}
+	if (lead < 0)
+	{
+		++numLatePrepares;
+	}
+}
+
+void Move::ResetPrepareStats() noexcept
+{
+	maxPrepareTime = 0;
+	for (uint32_t& count : prepareTimeHistogram)
+	{
+		count = 0;
+	}
+	minPrepareLead = std::numeric_limits<int32_t>::max();
+	numLatePrepares = 0;
+}
+
+// Close the current hiccup history interval and start a new one
+void Move::SampleHiccups() noexcept
+{
+	const uint32_t total = totalHiccups;
+	hiccupHistory[hiccupHistoryIndex] = (uint16_t)min<uint32_t>(total - hiccupsAtLastSample, 0xFFFF);
+	hiccupsAtLastSample = total;
+	hiccupHistoryIndex = (hiccupHistoryIndex + 1) % HiccupHistoryLength;
+}
+
+uint16_t Move::GetHiccupHistory(size_t n) const noexcept
+{
+	if (n == 0)
+	{
+		return (uint16_t)min<uint32_t>(totalHiccups - hiccupsAtLastSample, 0xFFFF);
 	}
+	return (n < HiccupHistoryLength) ? hiccupHistory[(hiccupHistoryIndex + HiccupHistoryLength - n) % HiccupHistoryLength] : 0;
 }
 
 void Move::Diagnostics(const StringRef& reply)
@@ -262,20 +676,290 @@ void Move::Diagnostics(const StringRef& reply)
 	reply.catf("Moves scheduled %" PRIu32 ", completed %" PRIu32 ", in progress %d, hiccups %" PRIu32 ", step errors %u, maxPrep %" PRIu32 ", maxOverdue %" PRIu32 ", maxInc %" PRIu32,
 					scheduledMoves, completedMoves, (int)(currentDda != nullptr), numHiccups, DDA::GetAndClearStepErrors(), maxPrepareTime, DDA::GetAndClearMaxTicksOverdue(), DDA::GetAndClearMaxOverdueIncrement());
 	numHiccups = 0;
-	maxPrepareTime = 0;
+#if !SINGLE_DRIVER
+	DDA::AppendStepCoalesceDiagnostics(reply);
+#endif
+	DDA::AppendControlledStopDiagnostics(reply);
 #if 1	//debug
-	reply.catf(", mcErrs %u, gcmErrs %u", moveCompleteTimeoutErrs, getCanMoveTimeoutErrs);
+	reply.catf(", mcErrs %u", moveCompleteTimeoutErrs);
+#endif
+	reply.lcatf("DDA ring length %u, max occupancy %" PRIu32 ", underrun stops %" PRIu32, DdaRingLength, maxRingOccupancy, numUnderrunStops);
+	maxRingOccupancy = 0;
+#if SUPPORT_INPUT_SHAPING
+	reply.catf(", input shaping %.1fHz", (double)shaper.GetFrequency());
+#endif
+#if SUPPORT_LOCAL_RETRACTION
+	retraction.Diagnostics(reply);
+#endif
+#if SUPPORT_AUTO_MICROSTEPPING
+	reply.catf(", microstepping switches %" PRIu32, numMicrosteppingSwitches);
+#endif
+#if SUPPORT_SPEED_OVERRIDE
+	reply.catf(", speed overrides %" PRIu32 " retimed %" PRIu32 "/%" PRIu32, numSpeedOverrides, numMovesRetimed, numInFlightMovesRetimed);
+#endif
+#if SUPPORT_MOVE_SHAPE_CACHE
+	MoveShapeCache::Diagnostics(reply);
 #endif
+
+	reply.lcat("Prepare times (us):");
+	uint32_t limit = FirstPrepareTimeBucketLimit;
+	for (size_t i = 0; i < NumPrepareTimeBuckets; ++i)
+	{
+		if (i + 1 < NumPrepareTimeBuckets)
+		{
+			reply.catf(" <%" PRIu32 ":%" PRIu32, limit, prepareTimeHistogram[i]);
+			limit <<= 1;
+		}
+		else
+		{
+			reply.catf(" more:%" PRIu32, prepareTimeHistogram[i]);
+		}
+	}
+	if (minPrepareLead != std::numeric_limits<int32_t>::max())
+	{
+		reply.catf(", min lead %.1fms", (double)((float)minPrepareLead * StepTimer::StepClocksToMillis));
+	}
+	reply.catf(", late %" PRIu32, numLatePrepares);
+	ResetPrepareStats();
+	FirstStepStats::Diagnostics(reply);
 }
 
-# if 0
-// Try to push some babystepping through the lookahead queue
-float Move::PushBabyStepping(float amount)
+// Report the movement counters for the compact diagnostics record, resetting them in the same way as Diagnostics does unless it is a telemetry record
+void Move::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
 {
-	return ddaRingAddPointer->AdvanceBabyStepping(amount);
+	rec.Set(DiagnosticsField::movesScheduled, scheduledMoves);
+	rec.Set(DiagnosticsField::movesCompleted, completedMoves);
+	rec.Set(DiagnosticsField::hiccups, (rec.IsTelemetry()) ? totalHiccups : numHiccups);
+	rec.Set(DiagnosticsField::maxPrepareTime, maxPrepareTime);
+	rec.Set(DiagnosticsField::maxRingOccupancy, maxRingOccupancy);
+	rec.Set(DiagnosticsField::underrunStops, numUnderrunStops);
+	rec.Set(DiagnosticsField::latePrepares, numLatePrepares);
+
+	QueueStatus status;
+	GetQueueStatus(status);
+	rec.Set(DiagnosticsField::moveQueued, status.numQueued);
+	rec.Set(DiagnosticsField::moveEarliestFreeSlotTime, status.earliestFreeSlotTime);
+	rec.Set(DiagnosticsField::moveDrainTime, status.drainTime);
+	if (rec.ResetCounters())
+	{
+		rec.Set(DiagnosticsField::stepErrors, DDA::GetAndClearStepErrors());
+		rec.Set(DiagnosticsField::maxTicksOverdue, DDA::GetAndClearMaxTicksOverdue());
+		rec.Set(DiagnosticsField::maxOverdueIncrement, DDA::GetAndClearMaxOverdueIncrement());
+		numHiccups = 0;
+		maxRingOccupancy = 0;
+		ResetPrepareStats();
+	}
+	FirstStepStats::GetDiagnosticsRecord(rec);
 }
+
+// Get the state of the DDA ring. A DDA becomes free when the Move task has released the move that used it, so if the ring is full, the first one to be free will be the oldest one.
+void Move::GetQueueStatus(QueueStatus& status) const noexcept
+{
+	const uint32_t now = StepTimer::GetTimerTicks();
+	uint32_t freeTime, drainTime;
+	{
+		AtomicCriticalSectionLocker lock;
+		status.numQueued = scheduledMoves - completedMoves;
+		if (ddaRingAddPointer->GetState() == DDA::empty || ddaRingCheckPointer->GetState() == DDA::completed)
+		{
+			freeTime = now;
+		}
+		else
+		{
+			freeTime = ddaRingCheckPointer->GetMoveStartTime() + ddaRingCheckPointer->GetClocksNeeded();
+		}
+
+		const DDA * const lastDda = ddaRingAddPointer->GetPrevious();
+		drainTime = (status.numQueued == 0) ? now : lastDda->GetMoveStartTime() + lastDda->GetClocksNeeded();
+	}
+
+	// A move can overrun its scheduled end if it had hiccups, so don't report a time in the past
+	status.earliestFreeSlotTime = StepTimer::ConvertToMasterTime(((int32_t)(freeTime - now) > 0) ? freeTime : now);
+	status.drainTime = StepTimer::ConvertToMasterTime(((int32_t)(drainTime - now) > 0) ? drainTime : now);
+}
+
+// Append the queue status as the number of moves queued, the ring length, the earliest free slot time and the drain time, in hex separated by commas like the diagnostics record
+void Move::AppendQueueStatus(const StringRef& reply) const noexcept
+{
+	QueueStatus status;
+	GetQueueStatus(status);
+	reply.catf("%" PRIx32 ",%x,%" PRIx32 ",%" PRIx32, status.numQueued, (unsigned int)DdaRingLength, status.earliestFreeSlotTime, status.drainTime);
+}
+
+// Add some babystepping for a driver and optionally change the maximum babystepping rate
+GCodeResult Move::PushBabyStepping(size_t driver, int32_t steps, uint32_t maxStepsPerSecond, const StringRef& reply) noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.copy("Driver number out of range");
+		return GCodeResult::error;
+	}
+	if (maxStepsPerSecond != 0)
+	{
+		maxBabyStepsPerClock = (float)maxStepsPerSecond/(float)StepTimer::StepClockRate;
+	}
+	int32_t pending;
+	{
+		AtomicCriticalSectionLocker lock;
+		pending = (pendingBabySteps[driver] += steps);
+	}
+	reply.printf("Driver %u babystepping pending %" PRIi32 " steps, max rate %.0f steps/sec", driver, pending, (double)(maxBabyStepsPerClock * (float)StepTimer::StepClockRate));
+	return GCodeResult::ok;
+}
+
+// Work out how much babystepping to add to a move and remove it from the pending amounts. We only add it to moves that already move some drive,
+// so that Init will still treat them as real moves, and we limit it so that the average extra step rate over the move doesn't exceed the maximum.
+bool Move::TakeBabySteps(const CanMessageMovementLinear& msg, int32_t babySteps[NumDrivers]) noexcept
+{
+	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+	bool isRealMove = false;
+	for (size_t drive = 0; drive < numDrivers; ++drive)
+	{
+		if (msg.perDrive[drive].steps != 0)
+		{
+			isRealMove = true;
+			break;
+		}
+	}
+
+	bool haveBabySteps = false;
+	const int32_t maxSteps = (int32_t)(maxBabyStepsPerClock * (float)(msg.accelerationClocks + msg.steadyClocks + msg.decelClocks));
+	AtomicCriticalSectionLocker lock;
+	for (size_t drive = 0; drive < NumDrivers; ++drive)
+	{
+		int32_t steps = 0;
+		if (isRealMove && drive < numDrivers && (msg.pressureAdvanceDrives & (1u << drive)) == 0)
+		{
+			steps = constrain<int32_t>(pendingBabySteps[drive], -maxSteps, maxSteps);
+			if (steps != 0)
+			{
+				pendingBabySteps[drive] -= steps;
+				haveBabySteps = true;
+			}
+		}
+		babySteps[drive] = steps;
+	}
+	return haveBabySteps;
+}
+
+#if SUPPORT_AUTO_MICROSTEPPING
+
+// Choose the microstepping of each driver that has automatic microstepping enabled, switching it if the move needs a different one and the driver is at rest until the move starts.
+// For drivers using coarse microstepping, convert the steps to coarse steps by adjusting extraSteps and set stepShifts, carrying the remainder forward.
+// On entry extraSteps holds the babystepping. Return true if any driver has automatic microstepping enabled, in which case extraSteps and stepShifts must be used.
+bool Move::SelectMicrostepping(const CanMessageMovementLinear& msg, int32_t extraSteps[NumDrivers], uint8_t stepShifts[NumDrivers]) noexcept
+{
+	bool anyEnabled = false;
+	const size_t numDrivers = min<size_t>(msg.numDrivers, NumDrivers);
+	const float topSpeed = 2.0/(2 * msg.steadyClocks + (msg.initialSpeedFraction + 1.0) * msg.accelerationClocks + (msg.finalSpeedFraction + 1.0) * msg.decelClocks);
+	const bool canSwitch = (int32_t)(msg.whenToExecute - StepTimer::GetTimerTicks()) >= (int32_t)MicrosteppingSwitchLeadClocks;
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		stepShifts[driver] = 0;
+		AutoMicrostepping& am = autoMicrostepping[driver];
+		if (!am.enabled)
+		{
+			continue;
+		}
+
+		anyEnabled = true;
+		const int32_t steps = ((driver < numDrivers) ? msg.perDrive[driver].steps : 0) + extraSteps[driver];
+		if (steps != 0)
+		{
+			// Nonlinear extrusion and pressure advance use microsteps, so moves that do pressure advance always want fine microstepping
+			const float stepRate = topSpeed * (float)labs(steps);
+			const bool wantCoarse = (msg.pressureAdvanceDrives & (1u << driver)) == 0
+									&& stepRate > ((am.coarseActive) ? am.thresholdStepsPerClock * MicrosteppingHysteresis : am.thresholdStepsPerClock);
+			if (wantCoarse != am.coarseActive && canSwitch && IsDriveIdleInRing(driver)
+				&& SmartDrivers::SetMicrostepping(driver, (wantCoarse) ? am.coarseMicrosteps : am.fineMicrosteps, wantCoarse || am.fineInterpolate))
+			{
+				am.coarseActive = wantCoarse;
+				++numMicrosteppingSwitches;
+			}
+		}
+
+		if (am.coarseActive)
+		{
+			const int32_t total = steps + am.pendingSteps;
+			const int32_t coarseSteps = total/(1 << am.shift);
+			am.pendingSteps = total - coarseSteps * (1 << am.shift);
+			extraSteps[driver] += coarseSteps - steps;
+			stepShifts[driver] = am.shift;
+		}
+		else if (steps != 0 && am.pendingSteps != 0)
+		{
+			extraSteps[driver] += am.pendingSteps;			// take the microsteps left over from when we were using coarse microstepping
+			am.pendingSteps = 0;
+		}
+	}
+	return anyEnabled;
+}
+
+// Return true if none of the moves in the ring that are executing or waiting to execute moves this driver, so the motor is at rest until the next move that we add
+bool Move::IsDriveIdleInRing(size_t driver) const noexcept
+{
+	for (const DDA *dda = ddaRingGetPointer; dda != ddaRingAddPointer; dda = dda->GetNext())
+	{
+		const DDA::DDAState st = dda->GetState();
+		if (st != DDA::completed && st != DDA::empty && dda->IsDriveMoving(driver))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Set up automatic microstepping for a driver. A coarse microstepping of 0 disables it.
+GCodeResult Move::SetAutoMicrostepping(size_t driver, unsigned int coarseMicrosteps, uint32_t thresholdStepsPerSecond, const StringRef& reply) noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.printf("Driver %u does not exist", (unsigned int)driver);
+		return GCodeResult::error;
+	}
+# if SUPPORT_CLOSED_LOOP
+	if (driver < NumClosedLoopDrivers)
+	{
+		reply.copy("Automatic microstepping is not supported on closed loop drivers");
+		return GCodeResult::error;
+	}
 # endif
 
+	TaskCriticalSectionLocker lock;													// stop the Move task using the settings while we change them
+	AutoMicrostepping& am = autoMicrostepping[driver];
+	if (am.coarseActive)
+	{
+		if (!IsDriveIdleInRing(driver) || !SmartDrivers::SetMicrostepping(driver, am.fineMicrosteps, am.fineInterpolate))
+		{
+			reply.copy("Can't change automatic microstepping while the driver is moving");
+			return GCodeResult::error;
+		}
+		am.coarseActive = false;
+		am.pendingSteps = 0;														// this is less than one coarse step
+	}
+
+	if (coarseMicrosteps == 0)
+	{
+		am.enabled = false;
+		reply.printf("Driver %u automatic microstepping disabled", (unsigned int)driver);
+		return GCodeResult::ok;
+	}
+	if ((coarseMicrosteps & (coarseMicrosteps - 1)) != 0 || coarseMicrosteps >= am.fineMicrosteps || thresholdStepsPerSecond == 0)
+	{
+		reply.printf("Coarse microstepping must be a power of 2 less than x%u", am.fineMicrosteps);
+		return GCodeResult::error;
+	}
+
+	am.coarseMicrosteps = coarseMicrosteps;
+	am.shift = __builtin_ctz(am.fineMicrosteps) - __builtin_ctz(coarseMicrosteps);
+	am.thresholdStepsPerClock = (float)thresholdStepsPerSecond/(float)StepTimer::StepClockRate;
+	am.enabled = true;
+	reply.printf("Driver %u uses x%u microstepping above %" PRIu32 " microsteps/sec", (unsigned int)driver, coarseMicrosteps, thresholdStepsPerSecond);
+	return GCodeResult::ok;
+}
+
+#endif
+
 #if SUPPORT_DELTA_MOVEMENT
 
 // Change the kinematics to the specified type if it isn't already
@@ -310,8 +994,9 @@ void Move::CurrentMoveCompleted()
 		const int32_t stepsTaken = cdda->GetStepsTaken(0);
 		movementAccumulators[0] += stepsTaken;
 		lastMoveStepsTaken[0] = stepsTaken;
+		positionAfterCompletedMoves[0] += stepsTaken;
 # if SUPPORT_CLOSED_LOOP
-		netMicrostepsTaken += stepsTaken;
+		netMicrostepsTaken[0] += stepsTaken;
 # endif
 #else
 		for (size_t driver = 0; driver < NumDrivers; ++driver)
@@ -319,9 +1004,30 @@ void Move::CurrentMoveCompleted()
 			const int32_t stepsTaken = cdda->GetStepsTaken(driver);
 			lastMoveStepsTaken[driver] = stepsTaken;
 			movementAccumulators[driver] += stepsTaken;
+			positionAfterCompletedMoves[driver] += stepsTaken;
+# if SUPPORT_CLOSED_LOOP
+			if (driver < NumClosedLoopDrivers)
+			{
+				netMicrostepsTaken[driver] += stepsTaken;
+			}
+# endif
+		}
+#endif
+#if SUPPORT_MOVE_TRACE
+		MoveTraceEntry& entry = moveTrace[moveTraceNextIndex];
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			entry.stepsTaken[driver] = lastMoveStepsTaken[driver];
 		}
+		entry.hiccups = currentMoveHiccups;
+		entry.hadStepError = cdda->HasStepError();
+		moveTraceNextIndex = (moveTraceNextIndex + 1) % MoveTraceLength;
+		++numMovesTraced;
 #endif
 		currentDda = nullptr;
+#if HAS_SMART_DRIVERS
+		PublishStepIntervals(nullptr);
+#endif
 	}
 	ddaRingGetPointer = ddaRingGetPointer->GetNext();
 	completedMoves++;
@@ -334,11 +1040,139 @@ void Move::CurrentMoveCompleted()
 	}
 }
 
+#if SUPPORT_MOVE_TRACE
+
+// Report the most recent moves, newest first, skipping the most recent 'skip' of them. We stop when the reply is nearly full.
+void Move::AppendMoveTrace(const StringRef& reply, unsigned int skip) const noexcept
+{
+	constexpr size_t MaxTraceLineLength = 80;
+	const uint32_t numAvailable = min<uint32_t>(numMovesTraced, MoveTraceLength);
+	reply.printf("Moves traced %" PRIu32 ", newest first:", numMovesTraced);
+	for (uint32_t i = skip; i < numAvailable; ++i)
+	{
+		if (reply.strlen() + MaxTraceLineLength > reply.Capacity())
+		{
+			reply.lcatf("%" PRIu32 " more", numAvailable - i);
+			break;
+		}
+		const MoveTraceEntry& entry = moveTrace[(moveTraceNextIndex + MoveTraceLength - 1 - i) % MoveTraceLength];
+		reply.lcatf("%" PRIu32 ": start %" PRIu32 " late %.2fms hiccups %u steps",
+						i, entry.plannedStartTime, (double)((float)entry.startLateness * StepTimer::StepClocksToMillis), entry.hiccups);
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			reply.catf(" %" PRIi32, entry.stepsTaken[driver]);
+		}
+		if (entry.hadStepError)
+		{
+			reply.cat(" step error");
+		}
+	}
+}
+
+#endif
+
 int32_t Move::GetPosition(size_t driver) const
 {
 	return ddaRingAddPointer->GetPrevious()->GetPosition(driver);
 }
 
+// Get the position of each driver in steps, which is the sum of the steps actually taken in completed moves plus the steps taken so far in the current one.
+// Unlike GetPosition this doesn't include steps that were planned but not taken because a move was stopped.
+// We hold off the step interrupt while we do this, so that all the positions correspond to the same instant.
+uint32_t Move::GetPositionSnapshot(int32_t positions[NumDrivers]) const noexcept
+{
+#if SAME5x
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif SAMC21
+	const irqflags_t flags = IrqSave();
+#else
+# error Unsupported processor
+#endif
+	const uint32_t now = StepTimer::GetTimerTicks();
+	const DDA * const cdda = currentDda;							// capture volatile
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		positions[driver] = positionAfterCompletedMoves[driver] + ((cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver));
+	}
+#if SAME5x
+	RestoreBasePriority(oldPrio);
+#elif SAMC21
+	IrqRestore(flags);
+#else
+# error Unsupported processor
+#endif
+	return StepTimer::ConvertToMasterTime(now);
+}
+
+#if SUPPORT_POWER_FAIL_STOP
+
+// Stop all motion because VIN has collapsed. We take the snapshot and stop the current move in the same critical section, so that the snapshot is exactly where the motors stopped.
+// The move is stopped, not completed normally, so we count it in the snapshot as not completed. Queued moves are held until power is restored.
+void Move::PowerFailStop() noexcept
+{
+#if SAME5x
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif SAMC21
+	const irqflags_t flags = IrqSave();
+#else
+# error Unsupported processor
+#endif
+	if (!powerFailed)
+	{
+		powerFailed = true;
+		const uint32_t now = StepTimer::GetTimerTicks();
+		DDA * const cdda = currentDda;							// capture volatile
+		powerFailSnapshot.movesCompleted = completedMoves;
+		powerFailSnapshot.moveWasExecuting = (cdda != nullptr);
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			powerFailSnapshot.positions[driver] = positionAfterCompletedMoves[driver] + ((cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver));
+		}
+		powerFailSnapshot.whenTaken = StepTimer::ConvertToMasterTime(now);
+		havePowerFailSnapshot = true;
+		if (cdda != nullptr)
+		{
+			cdda->StopDrivers((1u << NumDrivers) - 1);
+			if (cdda->GetState() == DDA::completed)
+			{
+				CurrentMoveCompleted();
+			}
+		}
+	}
+#if SAME5x
+	RestoreBasePriority(oldPrio);
+#elif SAMC21
+	IrqRestore(flags);
+#else
+# error Unsupported processor
+#endif
+}
+
+// Power has been restored. The main board will have lost track of the queued moves, so we discard them before allowing motion again.
+void Move::PowerRestored() noexcept
+{
+	if (powerFailed)
+	{
+		AtomicCriticalSectionLocker lock;
+		while (ddaRingGetPointer != ddaRingAddPointer && ddaRingGetPointer->GetState() == DDA::frozen)
+		{
+			ddaRingGetPointer->Complete();
+			ddaRingGetPointer = ddaRingGetPointer->GetNext();
+			++completedMoves;
+		}
+		powerFailed = false;
+	}
+}
+
+bool Move::GetPowerFailSnapshot(PowerFailSnapshot& snapshot) const noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	snapshot = powerFailSnapshot;
+	return havePowerFailSnapshot;
+}
+
+#endif
+
 // Stop some or all of the moving drivers
 void Move::StopDrivers(uint16_t whichDrives)
 {
@@ -352,11 +1186,17 @@ void Move::StopDrivers(uint16_t whichDrives)
 	DDA *cdda = currentDda;							// capture volatile
 	if (cdda != nullptr)
 	{
-		cdda->StopDrivers(whichDrives);
+		cdda->StopDrivers(whichDrives, true);		// drives with a stopping deceleration configured decelerate to rest
 		if (cdda->GetState() == DDA::completed)
 		{
 			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
 		}
+#if HAS_SMART_DRIVERS
+		else
+		{
+			PublishStepIntervals(cdda);
+		}
+#endif
 	}
 #if SAME5x
 	RestoreBasePriority(oldPrio);
@@ -367,6 +1207,45 @@ void Move::StopDrivers(uint16_t whichDrives)
 #endif
 }
 
+// Stop a driver because it has stalled or a local endstop or probe input has triggered. If a move was executing, return true with the number of steps the driver had taken in it.
+// The main board will stop the move too when it receives the event or input change, but this is quicker, which makes homing and probing more consistent.
+bool Move::StopDriverLocally(size_t driver, int32_t& stepsTaken) noexcept
+{
+	bool stopped = false;
+#if SAME5x
+	const uint32_t oldPrio = ChangeBasePriority(NvicPriorityStep);
+#elif SAMC21
+	const irqflags_t flags = IrqSave();
+#else
+# error Unsupported processor
+#endif
+	DDA *cdda = currentDda;							// capture volatile
+	if (cdda != nullptr && cdda->GetState() == DDA::executing)
+	{
+		cdda->StopDrivers(1u << driver);
+		stepsTaken = cdda->GetStepsTaken(driver);
+		stopped = true;
+		if (cdda->GetState() == DDA::completed)
+		{
+			CurrentMoveCompleted();					// tell the DDA ring that the current move is complete
+		}
+#if HAS_SMART_DRIVERS
+		else
+		{
+			PublishStepIntervals(cdda);
+		}
+#endif
+	}
+#if SAME5x
+	RestoreBasePriority(oldPrio);
+#elif SAMC21
+	IrqRestore(flags);
+#else
+# error Unsupported processor
+#endif
+	return stopped;
+}
+
 // Filament monitor support
 // Get the accumulated extruder motor steps taken by an extruder since the last call. Used by the filament monitoring code.
 // Returns the number of motor steps moves since the last call, and isPrinting is true unless we are currently executing an extruding but non-printing move
@@ -381,6 +1260,29 @@ int32_t Move::GetAccumulatedExtrusion(size_t driver, bool& isPrinting) noexcept
 	return ret + adjustment;
 }
 
+// Get the extruder motor steps taken by an extruder since the last call to GetAccumulatedExtrusion, without resetting them.
+// Used by the filament monitoring code to decide whether it is time to do a check.
+int32_t Move::GetPendingExtrusion(size_t driver) const noexcept
+{
+	AtomicCriticalSectionLocker lock;
+	const DDA * const cdda = currentDda;						// capture volatile variable
+	return movementAccumulators[driver] + ((cdda == nullptr) ? 0 : cdda->GetStepsTaken(driver));
+}
+
+#if HAS_SMART_DRIVERS
+
+// Publish the current microstep interval of each driver, so that the smart driver code can read it with a single load instead of walking the current move.
+// Called with interrupts disabled or from the step ISR. If cdda is null then no move is executing, so all the intervals are zero.
+void Move::PublishStepIntervals(const DDA *cdda) noexcept
+{
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		stepIntervals[driver] = (cdda != nullptr) ? cdda->GetMicrostepInterval(driver) : 0;
+	}
+}
+
+#endif
+
 // For debugging
 void Move::PrintCurrentDda() const
 {
@@ -394,7 +1296,9 @@ void Move::PrintCurrentDda() const
 // This may occasionally get called prematurely.
 void Move::Interrupt()
 {
-	const uint32_t isrStartTime = StepTimer::GetTimerTicks();
+	const LatencyHistograms::Timestamp probeStartTime = LatencyHistograms::GetTimestamp();
+	const IsrTickReader ticks;										// on the SAME5x this lets us get the time again cheaply
+	const uint32_t isrStartTime = ticks.GetStartTicks();
 	uint32_t now = isrStartTime;
 	for (;;)
 	{
@@ -402,10 +1306,13 @@ void Move::Interrupt()
 		DDA* cdda = currentDda;										// capture volatile variable
 		if (cdda == nullptr)
 		{
-			return;													// no current  move, so no steps needed
+			break;													// no current  move, so no steps needed
 		}
 
 		cdda->StepDrivers(now);
+#if HAS_SMART_DRIVERS
+		PublishStepIntervals(cdda);
+#endif
 		if (cdda->GetState() == DDA::completed)
 		{
 			const uint32_t finishTime = cdda->GetMoveFinishTime();	// calculate when this move should finish
@@ -413,9 +1320,13 @@ void Move::Interrupt()
 
 			// Start the next move, if one is ready
 			cdda = ddaRingGetPointer;
-			if (cdda->GetState() != DDA::frozen)
+			if (cdda->GetState() != DDA::frozen
+#if SUPPORT_POWER_FAIL_STOP
+				|| powerFailed
+#endif
+			   )
 			{
-				return;
+				break;
 			}
 
 			StartNextMove(cdda, finishTime);
@@ -424,26 +1335,30 @@ void Move::Interrupt()
 		// Schedule a callback at the time when the next step is due, and quit unless it is due immediately
 		if (!cdda->ScheduleNextStepInterrupt(timer))
 		{
-			return;
+			break;
 		}
 
 		// The next step is due immediately. Check whether we have been in this ISR for too long already and need to take a break
-		//TODO avoid the next read of the step timer, the last one read by ScheduleNextStepInterrupt will do
-		now = StepTimer::GetTimerTicks();
+		now = ticks.Read();
 		if (now - isrStartTime >= DDA::MaxStepInterruptTime)
 		{
 			// Force a break by updating the move start time.
 			// If the inserted hiccup is too short then it won't help. So we double the hiccup time on each iteration.
 			++numHiccups;
+			++totalHiccups;
+#if SUPPORT_MOVE_TRACE
+			++currentMoveHiccups;
+#endif
 			cdda->InsertHiccup(now);
 
 			// Reschedule the next step interrupt. This time it should succeed if the hiccup time was long enough.
 			if (!cdda->ScheduleNextStepInterrupt(timer))
 			{
-				return;
+				break;
 			}
 		}
 	}
+	LatencyHistograms::Record(LatencyProbe::moveInterrupt, probeStartTime);
 }
 
 // For debugging
@@ -461,10 +1376,37 @@ void Move::DebugPrintCdda() const noexcept
 bool Move::SetMicrostepping(size_t driver, unsigned int microsteps, bool interpolate) noexcept
 {
 	const bool ret = SmartDrivers::SetMicrostepping(driver, microsteps, interpolate);
+# if SUPPORT_AUTO_MICROSTEPPING
+	if (ret && driver < NumDrivers)
+	{
+		// The main board has changed the microstepping, so its positions are now in the new units and we have gone back to fine microstepping
+		AtomicCriticalSectionLocker lock;
+		AutoMicrostepping& am = autoMicrostepping[driver];
+		am.fineMicrosteps = microsteps;
+		am.fineInterpolate = interpolate;
+		am.coarseActive = false;
+		am.pendingSteps = 0;
+		if (am.enabled)
+		{
+			if (am.coarseMicrosteps < microsteps)
+			{
+				am.shift = __builtin_ctz(microsteps) - __builtin_ctz(am.coarseMicrosteps);
+			}
+			else
+			{
+				am.enabled = false;													// the coarse setting is no longer coarser
+			}
+		}
+	}
+# endif
 # if SUPPORT_CLOSED_LOOP
-	if (ret && driver == 0)
+	if (ret && driver < NumClosedLoopDrivers)
 	{
-		driver0MicrostepShift = -(int)SmartDrivers::GetMicrostepShift(0);
+		// Rescale the net microsteps so that the position in full steps doesn't change, otherwise the closed loop target would jump
+		AtomicCriticalSectionLocker lock;
+		const int newShift = -(int)SmartDrivers::GetMicrostepShift(driver);
+		netMicrostepsTaken[driver] = lrintf(ldexp((float)netMicrostepsTaken[driver], microstepShifts[driver] - newShift));
+		microstepShifts[driver] = newShift;
 	}
 # endif
 	return ret;
@@ -15,8 +15,16 @@
 #include "DDA.h"								// needed because of our inline functions
 #include "Kinematics/Kinematics.h"
 
-// Define the number of DDAs
-const unsigned int DdaRingLength = 50;
+#if SUPPORT_INPUT_SHAPING
+# include "InputShaper.h"
+#endif
+
+#if SUPPORT_LOCAL_RETRACTION
+# include "LocalRetraction.h"
+#endif
+
+// The number of DDAs in the ring (DdaRingLength) is defined in the board configuration file
+static_assert(DdaRingLength >= 3);
 
 struct CanMessageStopMovement;
 
@@ -30,9 +38,11 @@ public:
 	void Init() noexcept;															// Start me up
 	void Exit() noexcept;															// Shut down
 	void Diagnostics(const StringRef& reply) noexcept;								// Report useful stuff
+	void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;						// Report the same counters in compact form
 
 	void Interrupt() noexcept SPEED_CRITICAL;										// Timer callback for step generation
 	void StopDrivers(uint16_t whichDrives) noexcept;
+	bool StopDriverLocally(size_t driver, int32_t& stepsTaken) noexcept;			// Stop a driver that has stalled or hit a local endstop and get the steps it took in the current move
 	void CurrentMoveCompleted() noexcept SPEED_CRITICAL;							// Signal that the current move has just been completed
 
 #if SUPPORT_DELTA_MOVEMENT
@@ -50,30 +60,132 @@ public:
 
 	void ResetMoveCounters() noexcept { scheduledMoves = completedMoves = 0; }
 
+	// Performance history for the software reset data
+	static constexpr size_t HiccupHistoryLength = 4;
+	void SampleHiccups() noexcept;													// start a new hiccup history interval, called periodically
+	uint16_t GetHiccupHistory(size_t n) const noexcept;								// get the hiccups in the nth most recent interval, where 0 is the current one
+	uint32_t GetRingOccupancy() const noexcept { return scheduledMoves - completedMoves; }
+	uint32_t GetMaxRingOccupancy() const noexcept { return maxRingOccupancy; }
+
+	// Flow control. The main board can use this to decide how far ahead to schedule moves for this board instead of relying on timing alone.
+	struct QueueStatus
+	{
+		uint32_t earliestFreeSlotTime;												// the master time at which a DDA will be free for a new move, or the current time if one is free already
+		uint32_t drainTime;															// the master time at which the last move in the ring ends, or the current time if the ring is empty
+		uint32_t numQueued;															// the number of moves in the ring, including the one being executed
+	};
+	void GetQueueStatus(QueueStatus& status) const noexcept;
+	void AppendQueueStatus(const StringRef& reply) const noexcept;					// append the queue status in compact form
+
 	int32_t GetPosition(size_t driver) const noexcept;
+	uint32_t GetPositionSnapshot(int32_t positions[NumDrivers]) const noexcept;		// get the exact current positions of all drivers and return the master time they apply to
+
+#if SUPPORT_POWER_FAIL_STOP
+	// Power fail support. The snapshot records where the drivers were when we stopped them and how many moves had been completed, so that the main board can resume.
+	struct PowerFailSnapshot
+	{
+		uint32_t whenTaken;															// the master clock time when we stopped the drivers
+		uint32_t movesCompleted;													// the number of moves completed since the move counters were reset
+		bool moveWasExecuting;														// true if we stopped part way through the next move
+		int32_t positions[NumDrivers];												// the exact position of each driver in steps
+	};
+
+	void PowerFailStop() noexcept;													// stop all motion immediately and take a snapshot, safe to call from an ISR with priority no higher than the step ISR
+	void PowerRestored() noexcept;													// discard the moves that were queued when power failed and allow motion again
+	bool IsPowerFailed() const noexcept { return powerFailed; }
+	bool GetPowerFailSnapshot(PowerFailSnapshot& snapshot) const noexcept;			// get the snapshot from the most recent power failure, returning false if there hasn't been one
+#endif
+
+	// Babystepping. The requested steps are added to subsequent moves that are already moving some other drive, at no more than the maximum babystepping rate,
+	// so that we don't need extra moves or pauses. Drives that are doing pressure advance in a move don't get babystepping in that move.
+	GCodeResult PushBabyStepping(size_t driver, int32_t steps, uint32_t maxStepsPerSecond, const StringRef& reply) noexcept;
+
+#if SUPPORT_SPEED_OVERRIDE
+	// Speed overrides. The main board tells us to divide the durations of the moves that start at or after a move boundary by a factor, so that a feed rate override
+	// or an adaptive slowdown takes effect without waiting for the queued moves to drain. Moves already in the ring are retimed, and moves that were sent before the
+	// override and end by the end time are retimed when they arrive. The main board must plan later moves with the new timing.
+	static constexpr float MinSpeedOverrideFactor = 0.25;
+	static constexpr float MaxSpeedOverrideFactor = 4.0;
+	GCodeResult ApplySpeedOverride(float factor, uint32_t masterBoundaryTime, uint32_t masterEndTime, const StringRef& reply) noexcept;
+#endif
+
+#if SUPPORT_LOCAL_RETRACTION
+	// Local firmware retraction. The retraction is added to the ring at the move boundary it is scheduled for, see class LocalRetraction.
+	GCodeResult ConfigureRetraction(size_t driver, uint32_t retractSteps, int32_t extraUnretractSteps, uint32_t stepsPerSecond, uint32_t stepsPerSecondSquared, const StringRef& reply) noexcept
+	{
+		return retraction.Configure(driver, retractSteps, extraUnretractSteps, stepsPerSecond, stepsPerSecondSquared, reply);
+	}
+	GCodeResult RequestRetraction(bool retract, uint16_t whichDrivers, uint32_t masterStartTime, const StringRef& reply) noexcept;	// a start time of 0 means as soon as possible
+#endif
+
+	// Underrun support. If the next move hasn't arrived shortly before the last queued one ends at speed, we decelerate to a stop instead of stopping dead.
+	bool GetNewUnderrunStop(int32_t& slackClocks, uint32_t& stopClocks) noexcept;	// if we have stopped because of an underrun since the last call, return true with the details
 
 	// Filament monitor support
 	int32_t GetAccumulatedExtrusion(size_t driver, bool& isPrinting) noexcept;		// Return and reset the accumulated commanded extrusion amount
+	int32_t GetPendingExtrusion(size_t driver) const noexcept;						// Return the accumulated commanded extrusion amount without resetting it
 	uint32_t ExtruderPrintingSince() const noexcept { return extrudersPrintingSince; }	// When we started doing normal moves after the most recent extruder-only move
 
 #if HAS_SMART_DRIVERS
 	uint32_t GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept;	// Get the current step interval for this axis or extruder
+	bool HasExecutingMove() const noexcept { return currentDda != nullptr; }			// Return true if a move is being executed
 	bool SetMicrostepping(size_t driver, unsigned int microsteps, bool interpolate) noexcept;
 #endif
 
+#if SUPPORT_AUTO_MICROSTEPPING
+	// Automatic microstepping. Moves in which a driver steps faster than the threshold are executed with coarser microstepping and interpolation, so that the step ISR
+	// doesn't have to generate the full microstepping rate. We only switch when a move begins that the driver isn't already moving in, so that the driver register
+	// can be updated while the motor is at rest. Positions are still reported in the microsteps that the main board set.
+	GCodeResult SetAutoMicrostepping(size_t driver, unsigned int coarseMicrosteps, uint32_t thresholdStepsPerSecond, const StringRef& reply) noexcept;
+#endif
+
 	void DebugPrintCdda() const noexcept;											// for debugging
 
 	[[noreturn]] void TaskLoop() noexcept;
 
 #if SUPPORT_CLOSED_LOOP
-	void GetCurrentMotion(MotionParameters& mParams) const noexcept;				// get the net full steps taken, including in the current move so far, also speed and acceleration
+	void GetCurrentMotion(size_t driver, MotionParameters& mParams) const noexcept;	// get the net full steps taken, including in the current move so far, also speed and acceleration
 #endif
 
 	const volatile int32_t *GetLastMoveStepsTaken() const noexcept { return lastMoveStepsTaken; }
+
+#if SUPPORT_INPUT_SHAPING
+	void SetInputShapingFrequency(float freq) noexcept { shaper.SetFrequency(freq); }	// set the ringing frequency to suppress, or 0 to disable input shaping
+	float GetInputShapingFrequency() const noexcept { return shaper.GetFrequency(); }
+#endif
+
+	// Support for synchronising data collection to the start of a move
+	void ArmMoveStartCapture() noexcept { moveStartCaptured = false; moveStartCaptureArmed = true; }
+	bool GetCapturedMoveStartTime(uint32_t& startTime) const noexcept;				// if a move has started since we armed the capture, get its start time and return true
+
+#if SUPPORT_MOVE_TRACE
+	void AppendMoveTrace(const StringRef& reply, unsigned int skip) const noexcept;	// Report the most recent moves, skipping the most recent 'skip' of them
+#endif
+
 private:
 	bool DDARingAdd() noexcept;														// Add a processed look-ahead entry to the DDA ring
 	DDA* DDARingGet() noexcept;														// Get the next DDA ring entry to be run
 	void StartNextMove(DDA *cdda, uint32_t startTime) noexcept;						// Start a move
+	void WaitForFreeDda() noexcept;													// Wait until there is a free DDA at the add pointer
+	void AddMove(const CanMessageMovementLinear& msg) noexcept;						// Set up a DDA from a move message and add it to the ring
+	void AddMoveToRing(const CanMessageMovementLinear& msg) noexcept;				// Set up a DDA from a move message without any speed override and add it to the ring
+	void StartMoveIfIdle() noexcept;												// If no move is executing, start the next one if it is ready
+	bool TakeBabySteps(const CanMessageMovementLinear& msg, int32_t babySteps[NumDrivers]) noexcept;	// Take the babystepping to add to a move, returning true if there is any
+#if SUPPORT_AUTO_MICROSTEPPING
+	bool SelectMicrostepping(const CanMessageMovementLinear& msg, int32_t extraSteps[NumDrivers], uint8_t stepShifts[NumDrivers]) noexcept;	// Choose the microstepping for a move and adjust its steps to suit
+	bool IsDriveIdleInRing(size_t driver) const noexcept;							// Return true if none of the moves in the ring moves this driver
+#endif
+	uint32_t GetUnderrunTimeout() const noexcept;									// Get how many milliseconds we can wait for the next move before we must prepare to stop
+	uint32_t GetMoveWaitTimeout() const noexcept;									// Get how many milliseconds we can wait for the next move before we must do some local work
+#if SUPPORT_LOCAL_RETRACTION
+	bool AddRetractionIfDue(const CanMessageMovementLinear *nextMsg) noexcept;		// Add the pending retraction to the ring if it is due before the next move or soon, returning true if we added it
+#endif
+	void AddUnderrunStopMove() noexcept;											// Add a move to decelerate to rest from the end of the last queued move
+	void RecordPrepareStats(uint32_t prepareTime, uint32_t whenToExecute) noexcept;	// Update the move preparation statistics
+	void ResetPrepareStats() noexcept;
+#if HAS_SMART_DRIVERS
+	void PublishStepIntervals(const DDA *cdda) noexcept SPEED_CRITICAL;			// Update the step intervals read by the smart drivers
+#endif
 
 	// Variables that are in the DDARing class in RepRapFirmware (we have only one DDARing so they are here)
 	DDA* volatile currentDda;
@@ -83,26 +195,121 @@ private:
 
 	StepTimer timer;
 	volatile int32_t lastMoveStepsTaken[NumDrivers];								// how many steps were taken in the last move we did
+	volatile int32_t positionAfterCompletedMoves[NumDrivers];						// the net steps actually taken by all completed moves
 	volatile int32_t movementAccumulators[NumDrivers]; 								// Accumulated motor steps
+#if HAS_SMART_DRIVERS
+	volatile uint32_t stepIntervals[NumDrivers];									// the current microstep interval of each driver, or 0 if it is not moving
+#endif
 	volatile uint32_t extrudersPrintingSince;										// The milliseconds clock time when extrudersPrinting was set to true
 	volatile bool extrudersPrinting;												// Set whenever an extruder starts a printing move, cleared by a non-printing extruder move
 	TaskBase * volatile taskWaitingForMoveToComplete;
 	// End DDARing variables
 
+	volatile uint32_t capturedMoveStartTime;										// the start time of the first move started after the capture was armed
+	volatile bool moveStartCaptureArmed;
+	volatile bool moveStartCaptured;
+
 	Kinematics *kinematics;															// What kinematics we are using
 
 	uint32_t scheduledMoves;														// Move counters for the code queue
 	volatile uint32_t completedMoves;												// This one is modified by an ISR, hence volatile
 	uint32_t numHiccups;															// How many times we delayed an interrupt to avoid using too much CPU time in interrupts
+	uint32_t totalHiccups;															// Like numHiccups but not cleared by Diagnostics
+	uint32_t hiccupsAtLastSample;
+	uint16_t hiccupHistory[HiccupHistoryLength];									// hiccups in recent completed sample intervals
+	size_t hiccupHistoryIndex;														// where the next completed interval will be stored
+	uint32_t maxRingOccupancy;														// The largest number of moves that were in the DDA ring at once
 	uint32_t maxPrepareTime;
 
+	// Babystepping
+	static constexpr uint32_t DefaultMaxBabySteppingRate = 200;						// the default maximum babystepping rate in steps per second
+	int32_t pendingBabySteps[NumDrivers];											// the babystepping not yet added to moves
+	float maxBabyStepsPerClock;
+
+	// Underrun statistics
+	static constexpr uint32_t UnderrunLeadClocks = StepTimer::StepClockRate/200;	// if the next move hasn't arrived 5ms before the last one ends, we add a stopping move
+	uint32_t numUnderrunStops;														// how many times we have added a stopping move
+	int32_t lastUnderrunSlackClocks;												// how long before the end of the last move we added the most recent stopping move
+	uint32_t lastUnderrunStopClocks;												// how long the most recent stopping move took
+	volatile bool underrunStopToReport;
+
+#if SUPPORT_SPEED_OVERRIDE
+	static constexpr uint32_t SpeedOverrideLeadClocks = StepTimer::StepClockRate/200;	// we need the override 5ms before the boundary so that we have time to retime the moves
+	static constexpr int32_t MaxSpeedOverrideEndError = 100;						// how many step clocks an in-flight move may end before the end time and still be the last one
+	uint32_t MapSpeedOverrideTime(uint32_t t) const noexcept { return speedOverrideBoundary + roundU32((float)(t - speedOverrideBoundary)/speedOverrideFactor); }
+
+	Mutex speedOverrideMutex;														// stops the Move task adding moves while we retime the ring
+	float speedOverrideFactor;
+	uint32_t speedOverrideBoundary;													// the local time of the move boundary the most recent override applies from
+	uint32_t speedOverrideEnd;														// the local time at which the last move sent before the override ends, using the old timing
+	bool speedOverrideInFlight;														// true if some moves sent before the override may not have arrived yet
+	uint32_t numSpeedOverrides;
+	uint32_t numMovesRetimed;
+	uint32_t numInFlightMovesRetimed;
+#endif
+
+#if SUPPORT_POWER_FAIL_STOP
+	PowerFailSnapshot powerFailSnapshot;
+	volatile bool powerFailed;														// true if power failed and it hasn't been restored yet, we don't start new moves while this is set
+	bool havePowerFailSnapshot;
+#endif
+
+	// Move preparation statistics
+	static constexpr size_t NumPrepareTimeBuckets = 6;
+	static constexpr uint32_t FirstPrepareTimeBucketLimit = 25;						// upper limit in microseconds of the first bucket, the limit doubles for each subsequent bucket
+	uint32_t prepareTimeHistogram[NumPrepareTimeBuckets];							// how many moves took each range of times to prepare
+	int32_t minPrepareLead;															// the smallest number of step clocks between a move being prepared and its scheduled start time
+	uint32_t numLatePrepares;														// how many moves we finished preparing after they were due to start
+
+#if SUPPORT_INPUT_SHAPING
+	InputShaper shaper;
+#endif
+
+#if SUPPORT_AUTO_MICROSTEPPING
+	struct AutoMicrostepping
+	{
+		float thresholdStepsPerClock;												// the microstep rate above which we use the coarse microstepping
+		uint16_t fineMicrosteps;													// the microstepping that the main board set
+		uint16_t coarseMicrosteps;
+		uint8_t shift;																// log2 of fineMicrosteps/coarseMicrosteps
+		bool fineInterpolate;
+		bool enabled;
+		bool coarseActive;
+		int32_t pendingSteps;														// microsteps not yet taken because they were less than a coarse step
+	};
+
+	static constexpr float MicrosteppingHysteresis = 0.8;							// we go back to fine microstepping below this fraction of the threshold
+	static constexpr uint32_t MicrosteppingSwitchLeadClocks = StepTimer::StepClockRate/200;	// we need this long before the move starts to update the driver register
+	AutoMicrostepping autoMicrostepping[NumDrivers];
+	uint32_t numMicrosteppingSwitches;
+#endif
+
+#if SUPPORT_LOCAL_RETRACTION
+	static constexpr uint32_t RetractionLeadClocks = StepTimer::StepClockRate/200;	// if no move at or after the retraction time has arrived 5ms before it, we add the retraction anyway
+	LocalRetraction retraction;
+#endif
+
+#if SUPPORT_MOVE_TRACE
+	// Trace of recently executed moves
+	struct MoveTraceEntry
+	{
+		uint32_t plannedStartTime;													// when the move was scheduled to start
+		int32_t startLateness;														// how many step clocks late the move was started
+		uint16_t hiccups;															// how many hiccups we inserted while executing this move
+		uint16_t hadStepError;														// true if any drive had a step error
+		int32_t stepsTaken[NumDrivers];												// the net steps taken by each driver
+	};
+
+	static constexpr size_t MoveTraceLength = 32;
+	MoveTraceEntry moveTrace[MoveTraceLength];
+	size_t moveTraceNextIndex;														// the index of the entry that the current or next move will be recorded in
+	uint32_t numMovesTraced;
+	uint16_t currentMoveHiccups;
+#endif
+
 #if SUPPORT_CLOSED_LOOP
-# if SINGLE_DRIVER
-	int32_t netMicrostepsTaken;														// the net microsteps taken not counting any move that is in progress
-	int driver0MicrostepShift;														// the microstepping set for driver 0 as a negative shift factor
-# else
-#  error Only one closed loop driver supported by this code
-# endif
+	int32_t netMicrostepsTaken[NumClosedLoopDrivers];								// the net microsteps taken not counting any move that is in progress
+	int microstepShifts[NumClosedLoopDrivers];										// the microstepping set for each closed loop driver as a negative shift factor
 #endif
 };
 
@@ -110,12 +317,11 @@ private:
 
 #if HAS_SMART_DRIVERS
 
-// Get the current step interval for this axis or extruder, or 0 if it is not moving
-// This is called from the stepper drivers SPI interface ISR
+// Get the current full step interval for this axis or extruder, or 0 if it is not moving
+// This is called from the stepper drivers SPI interface ISR, so it just reads the interval that the step ISR published instead of walking the current move
 inline uint32_t Move::GetStepInterval(size_t axis, uint32_t microstepShift) const noexcept
 {
-	const DDA * const cdda = currentDda;		// capture volatile variable
-	return (cdda != nullptr) ? cdda->GetStepInterval(axis, microstepShift) : 0;
+	return stepIntervals[axis] << microstepShift;
 }
 
 #endif
@@ -123,17 +329,17 @@ inline uint32_t Move::GetStepInterval(size_t axis, uint32_t microstepShift) cons
 #if SUPPORT_CLOSED_LOOP
 
 // Get the net full steps taken, including in the current move so far, also speed and acceleration
-inline void Move::GetCurrentMotion(MotionParameters& mParams) const noexcept
+inline void Move::GetCurrentMotion(size_t driver, MotionParameters& mParams) const noexcept
 {
 	AtomicCriticalSectionLocker lock;
 	const DDA * const cdda = currentDda;			// capture volatile variable
 	if (cdda != nullptr)
 	{
-		cdda->GetCurrentMotion(mParams, netMicrostepsTaken, driver0MicrostepShift);
+		cdda->GetCurrentMotion(driver, mParams, netMicrostepsTaken[driver], microstepShifts[driver]);
 	}
 	else
 	{
-		mParams.position = ldexp((float)netMicrostepsTaken, driver0MicrostepShift);
+		mParams.position = ldexp((float)netMicrostepsTaken[driver], microstepShifts[driver]);
 		mParams.speed = mParams.acceleration = 0.0;
 	}
 }
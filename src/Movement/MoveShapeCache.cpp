@@ -0,0 +1,91 @@
+/*
+ * MoveShapeCache.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "MoveShapeCache.h"
+
+#if SUPPORT_MOVE_SHAPE_CACHE
+
+MoveShapeCache::Entry MoveShapeCache::entries[NumShapes] = { };
+size_t MoveShapeCache::nextEntry = 0;
+
+uint32_t MoveShapeCache::numShapeHits = 0;
+uint32_t MoveShapeCache::numShapeMisses = 0;
+uint32_t MoveShapeCache::numStepHits = 0;
+uint32_t MoveShapeCache::numStepMisses = 0;
+
+/*static*/ size_t MoveShapeCache::FindShape(const CanMessageMovementLinear& msg) noexcept
+{
+	for (size_t i = 0; i < NumShapes; ++i)
+	{
+		const Entry& e = entries[i];
+		if (   e.valid
+			&& e.accelerationClocks == msg.accelerationClocks && e.steadyClocks == msg.steadyClocks && e.decelClocks == msg.decelClocks
+			&& e.initialSpeedFraction == msg.initialSpeedFraction && e.finalSpeedFraction == msg.finalSpeedFraction
+		   )
+		{
+			++numShapeHits;
+			return i;
+		}
+	}
+	++numShapeMisses;
+	return NoShape;
+}
+
+/*static*/ size_t MoveShapeCache::AddShape(const CanMessageMovementLinear& msg) noexcept
+{
+	const size_t index = nextEntry;
+	nextEntry = (nextEntry + 1) % NumShapes;
+
+	Entry& e = entries[index];
+	e.accelerationClocks = msg.accelerationClocks;
+	e.steadyClocks = msg.steadyClocks;
+	e.decelClocks = msg.decelClocks;
+	e.initialSpeedFraction = msg.initialSpeedFraction;
+	e.finalSpeedFraction = msg.finalSpeedFraction;
+	e.numStepSlotsUsed = e.nextStepSlot = 0;
+	e.valid = true;
+	return index;
+}
+
+/*static*/ const StepConstants *MoveShapeCache::FindStepConstants(size_t shapeIndex, uint32_t steps) noexcept
+{
+	const Entry& e = entries[shapeIndex];
+	for (size_t i = 0; i < e.numStepSlotsUsed; ++i)
+	{
+		if (e.stepSlots[i].steps == steps)
+		{
+			++numStepHits;
+			return &e.stepSlots[i].constants;
+		}
+	}
+	++numStepMisses;
+	return nullptr;
+}
+
+/*static*/ StepConstants& MoveShapeCache::AddStepConstants(size_t shapeIndex, uint32_t steps) noexcept
+{
+	Entry& e = entries[shapeIndex];
+	StepSlot& slot = e.stepSlots[e.nextStepSlot];
+	e.nextStepSlot = (e.nextStepSlot + 1) % NumStepSlots;
+	if (e.numStepSlotsUsed < NumStepSlots)
+	{
+		++e.numStepSlotsUsed;
+	}
+	slot.steps = steps;
+	return slot.constants;
+}
+
+/*static*/ void MoveShapeCache::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.catf(", shape cache hits %" PRIu32 "/%" PRIu32 ", step cache hits %" PRIu32 "/%" PRIu32,
+				numShapeHits, numShapeHits + numShapeMisses, numStepHits, numStepHits + numStepMisses);
+	numShapeHits = numShapeMisses = numStepHits = numStepMisses = 0;
+}
+
+#endif
+
+// End
@@ -0,0 +1,73 @@
+/*
+ * MoveShapeCache.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MOVEMENT_MOVESHAPECACHE_H_
+#define SRC_MOVEMENT_MOVESHAPECACHE_H_
+
+#include "DriveMovement.h"
+
+#if SUPPORT_MOVE_SHAPE_CACHE
+
+#include <CanMessageFormats.h>
+
+// Cache of move shapes and the per-drive step constants derived from them, so that a run of moves with the same timing (e.g. infill lines) doesn't repeat
+// the floating point divisions in DDA::Prepare and DriveMovement::PrepareCartesianAxis. This matters most on boards without a double precision FPU.
+// A shape is identified by the timing fields of the movement message and the step constants of each drive by the number of steps, so a hit gives exactly the values
+// that would have been calculated. Entries are replaced in rotation.
+// Moves are prepared only by the Move task, or by the command task when it retimes them for a speed override while holding the mutex that the Move task
+// holds while adding moves, so the cache doesn't need any further locking.
+class MoveShapeCache
+{
+public:
+	static constexpr size_t NumShapes = 4;
+	static constexpr size_t NumStepSlots = 4;					// the number of different step counts we remember for each shape
+	static constexpr size_t NoShape = NumShapes;
+
+	static size_t FindShape(const CanMessageMovementLinear& msg) noexcept;		// return the index of the shape of this move, or NoShape if we don't have it
+	static size_t AddShape(const CanMessageMovementLinear& msg) noexcept;		// allocate an entry for the shape of this move and return its index; the caller must fill in the shape
+	static MoveShape& GetShape(size_t index) noexcept { return entries[index].shape; }
+
+	static const StepConstants *FindStepConstants(size_t shapeIndex, uint32_t steps) noexcept;
+	static StepConstants& AddStepConstants(size_t shapeIndex, uint32_t steps) noexcept;		// the caller must fill in the constants
+
+	static void Diagnostics(const StringRef& reply) noexcept;
+
+private:
+	struct StepSlot
+	{
+		uint32_t steps;
+		StepConstants constants;
+	};
+
+	struct Entry
+	{
+		// The key
+		uint32_t accelerationClocks;
+		uint32_t steadyClocks;
+		uint32_t decelClocks;
+		float initialSpeedFraction;
+		float finalSpeedFraction;
+
+		MoveShape shape;
+		StepSlot stepSlots[NumStepSlots];
+		uint8_t numStepSlotsUsed;
+		uint8_t nextStepSlot;
+		bool valid;
+	};
+
+	static Entry entries[NumShapes];
+	static size_t nextEntry;
+
+	static uint32_t numShapeHits;
+	static uint32_t numShapeMisses;
+	static uint32_t numStepHits;
+	static uint32_t numStepMisses;
+};
+
+#endif
+
+#endif /* SRC_MOVEMENT_MOVESHAPECACHE_H_ */
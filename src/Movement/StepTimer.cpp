@@ -10,6 +10,8 @@
 #include <RTOSIface/RTOSIface.h>
 #include <CanMessageFormats.h>
 #include <CAN/CanInterface.h>
+#include <IsrProfiler.h>
+#include <DiagnosticsRecord.h>
 
 #if SAME5x
 # include <hri_tc_e54.h>
@@ -18,7 +20,14 @@
 #endif
 
 StepTimer * volatile StepTimer::pendingList = nullptr;
-volatile uint32_t StepTimer::localTimeOffset = 0;
+uint32_t StepTimer::localTimeOffset = 0;
+uint32_t StepTimer::offsetBaseTime = 0;
+int32_t StepTimer::offsetFractionQ32 = 0;
+int32_t StepTimer::offsetDriftQ32 = 0;
+float StepTimer::offsetFraction = 0.0;
+float StepTimer::clockDrift = 0.0;
+float StepTimer::sumSquaredJitter = 0.0;
+unsigned int StepTimer::numJitterSamples = 0;
 volatile uint32_t StepTimer::whenLastSynced;
 uint32_t StepTimer::prevMasterTime;												// the previous master time received
 uint32_t StepTimer::prevLocalTime;												// the previous local time when the master time was received, corrected for receive processing delay
@@ -49,7 +58,11 @@ void StepTimer::Init()
 
 	hri_tc_write_CTRLA_reg(StepTc, TC_CTRLA_MODE_COUNT32 | TC_CTRLA_PRESCALER_DIV64);
 	hri_tc_write_DBGCTRL_reg(StepTc, 0);
+#if SUPPORT_CL_CURRENT_SENSE
+	hri_tc_write_EVCTRL_reg(StepTc, TC_EVCTRL_MCEO1);				// compare channel 1 starts the closed loop current sense conversions
+#else
 	hri_tc_write_EVCTRL_reg(StepTc, 0);
+#endif
 	hri_tc_write_WAVE_reg(StepTc, TC_WAVE_WAVEGEN_NFRQ);
 
 	hri_tc_set_CTRLA_ENABLE_bit(StepTc);
@@ -109,14 +122,22 @@ void StepTimer::Init()
 	{
 		// We have the previous message details and now we have the transmit delay for that message
 		const uint32_t correctedMasterTime = oldMasterTime + msg.lastTimeAcknowledgeDelay;
-		const uint32_t newOffset = oldLocalTime - correctedMasterTime;
+		const uint32_t measuredOffset = oldLocalTime - correctedMasterTime;
+
+		// Feed the measured offset into the clock filter. If it is too different from what we predicted, start again.
+		float residual = 0.0;
+		if (locSyncCount == 1)
+		{
+			ResetClockFilter(measuredOffset, oldLocalTime);
+		}
+		else
+		{
+			residual = UpdateClockFilter(measuredOffset, oldLocalTime, locSyncCount < MaxSyncCount);
+		}
 
-		//TODO convert this to a PLL, but note that there could be a constant offset if the clocks run at slightly different speeds
-		const uint32_t oldOffset = localTimeOffset;
-		localTimeOffset = newOffset;
-		const int32_t diff = (int32_t)(newOffset - oldOffset);
-		if ((uint32_t)labs(diff) > MaxSyncJitter && locSyncCount > 1)
+		if (fabsf(residual) > (float)MaxSyncJitter)
 		{
+			ResetClockFilter(measuredOffset, oldLocalTime);
 			syncCount = 0;
 			++numJitterResyncs;
 		}
@@ -125,6 +146,7 @@ void StepTimer::Init()
 			whenLastSynced = millis();
 			if (locSyncCount == MaxSyncCount)
 			{
+				const int32_t diff = lrintf(residual);
 				if (!gotJitter)
 				{
 					peakPosJitter = peakNegJitter = diff;
@@ -138,6 +160,8 @@ void StepTimer::Init()
 				{
 					peakNegJitter = diff;
 				}
+				sumSquaredJitter += fsquare(residual);
+				++numJitterSamples;
 				Platform::SetPrinting(msg.isPrinting);
 				if (msgLen >= CanMessageTimeSync::SizeWithRealTime)	// if real time is included
 				{
@@ -215,6 +239,7 @@ extern "C" void STEP_TC_HANDLER() SPEED_CRITICAL;
 
 void STEP_TC_HANDLER()
 {
+	ISR_PROFILE_ENTER();
 	uint8_t tcsr = StepTc->INTFLAG.reg;								// read the status register, which clears the status bits
 	tcsr &= StepTc->INTENSET.reg;									// select only enabled interrupts
 
@@ -227,6 +252,7 @@ void STEP_TC_HANDLER()
 #endif
 		StepTimer::Interrupt();										// this will re-enable the interrupt if necessary
 	}
+	ISR_PROFILE_EXIT(stepTimer);
 }
 
 StepTimer::StepTimer() : next(nullptr), callback(nullptr), active(false)
@@ -267,6 +293,23 @@ bool StepTimer::ScheduleCallbackFromIsr(Ticks when)
 		{
 			break;
 		}
+
+		// Optimise the case of rescheduling the timer that is already due first, for example when a move is stopped or input shaping changes the next step time
+		if (pst == this)
+		{
+			StepTimer * const nextTimer = next;
+			const Ticks now = GetTimerTicks();
+			if (nextTimer == nullptr || (int32_t)(when - now) < (int32_t)(nextTimer->whenDue - now))
+			{
+				if (ScheduleTimerInterrupt(when))
+				{
+					pendingList = nextTimer;
+					active = false;
+					return true;
+				}
+				return false;
+			}
+		}
 		CancelCallbackFromIsr();
 	}
 
@@ -308,6 +351,11 @@ bool StepTimer::ScheduleCallback(Ticks when)
 // Cancel any scheduled callback for this timer. Harmless if there is no callback scheduled.
 void StepTimer::CancelCallbackFromIsr()
 {
+	if (!active)
+	{
+		return;				// this is the common case when the move timer callback reschedules itself, because the ISR has already unlinked it
+	}
+
 	for (StepTimer** ppst = const_cast<StepTimer**>(&pendingList); *ppst != nullptr; ppst = &((*ppst)->next))
 	{
 		if (*ppst == this)
@@ -325,10 +373,82 @@ void StepTimer::CancelCallback()
 	CancelCallbackFromIsr();
 }
 
+// Get the estimated offset between local and master time at the specified local time, extrapolating from the most recent estimate using the estimated drift
+/*static*/ uint32_t StepTimer::GetLocalTimeOffsetAt(uint32_t localTime) noexcept
+{
+	uint32_t offset, baseTime;
+	int32_t fractionQ32, driftQ32;
+	{
+		AtomicCriticalSectionLocker lock;							// the CanClock task may update these at any time
+		offset = localTimeOffset;
+		baseTime = offsetBaseTime;
+		fractionQ32 = offsetFractionQ32;
+		driftQ32 = offsetDriftQ32;
+	}
+	return offset + (int32_t)(((int64_t)driftQ32 * (int32_t)(localTime - baseTime) + fractionQ32 + (1ll << 31)) >> 32);
+}
+
+// Convert a master time to local time, using the estimated time offset at the approximate local time
+/*static*/ uint32_t StepTimer::ConvertToLocalTime(uint32_t masterTime) noexcept
+{
+	return masterTime + GetLocalTimeOffsetAt(masterTime + localTimeOffset);
+}
+
+// Convert a duration in master clock ticks to local ticks. The offset increases by offsetDriftQ32/2^32 per local tick, so a local tick is shorter than a master tick by that fraction.
+// To first order the local duration is the master duration multiplied by (1 + drift). The drift is limited to MaxClockDrift so the second order term is less than 1 tick in 10 seconds.
+/*static*/ uint32_t StepTimer::ConvertToLocalDuration(uint32_t masterClocks) noexcept
+{
+	return masterClocks + (int32_t)(((int64_t)offsetDriftQ32 * masterClocks + (1ll << 31)) >> 32);
+}
+
+// Restart the clock filter from a single measured offset
+/*static*/ void StepTimer::ResetClockFilter(uint32_t offset, uint32_t localTime) noexcept
+{
+	offsetFraction = 0.0;
+	clockDrift = 0.0;
+	SetClockOffset(offset, localTime);
+}
+
+// Update the clock filter with a new measured offset at the specified local time and return the difference between the measured and predicted offsets.
+// This is an alpha-beta filter with the offset and the drift as the state variables, which behaves like a second order PLL. Calculations are done relative to the current offset to preserve precision.
+/*static*/ float StepTimer::UpdateClockFilter(uint32_t measuredOffset, uint32_t localTime, bool acquiring) noexcept
+{
+	const uint32_t interval = localTime - offsetBaseTime;
+	const float predicted = offsetFraction + clockDrift * (float)interval;
+	const float residual = (float)(int32_t)(measuredOffset - localTimeOffset) - predicted;
+	if (fabsf(residual) > (float)MaxSyncJitter || interval == 0)
+	{
+		return residual;											// the caller will reset the filter if the residual is too large
+	}
+
+	const float estimate = predicted + ((acquiring) ? AcquireAlpha : TrackAlpha) * residual;
+	clockDrift = constrain<float>(clockDrift + ((acquiring) ? AcquireBeta : TrackBeta) * residual/(float)interval, -MaxClockDrift, MaxClockDrift);
+	const int32_t wholeTicks = lrintf(estimate);
+	offsetFraction = estimate - (float)wholeTicks;
+	SetClockOffset(localTimeOffset + wholeTicks, localTime);
+	return residual;
+}
+
+// Set the new time offset and drift. The fraction and drift are converted to fixed point so that GetLocalTimeOffsetAt doesn't need floating point maths, because the SAMC21 has no FPU.
+/*static*/ void StepTimer::SetClockOffset(uint32_t offset, uint32_t localTime) noexcept
+{
+	const int32_t fractionQ32 = (int32_t)constrain<float>(offsetFraction * 4294967296.0, -2147483647.0, 2147483647.0);
+	const int32_t driftQ32 = (int32_t)(clockDrift * 4294967296.0);
+	AtomicCriticalSectionLocker lock;
+	localTimeOffset = offset;
+	offsetBaseTime = localTime;
+	offsetFractionQ32 = fractionQ32;
+	offsetDriftQ32 = driftQ32;
+}
+
 /*static*/ void StepTimer::Diagnostics(const StringRef& reply)
 {
-	reply.lcatf("Peak sync jitter %" PRIi32 "/%" PRIi32 ", peak Rx sync delay %" PRIu32 ", resyncs %u/%u, ", peakNegJitter, peakPosJitter, peakReceiveDelay, numTimeoutResyncs, numJitterResyncs);
+	reply.lcatf("Peak sync jitter %" PRIi32 "/%" PRIi32 ", rms %.2f, drift %.2fppm, peak Rx sync delay %" PRIu32 ", resyncs %u/%u, ",
+				peakNegJitter, peakPosJitter, (double)((numJitterSamples == 0) ? 0.0 : sqrtf(sumSquaredJitter/(float)numJitterSamples)), (double)(clockDrift * 1.0e6),
+				peakReceiveDelay, numTimeoutResyncs, numJitterResyncs);
 	gotJitter = false;
+	sumSquaredJitter = 0.0;
+	numJitterSamples = 0;
 	numTimeoutResyncs = numJitterResyncs = 0;
 	peakReceiveDelay = 0;
 
@@ -349,6 +469,25 @@ void StepTimer::CancelCallback()
 	}
 }
 
+// Report the clock sync counters for the compact diagnostics record, resetting them in the same way as Diagnostics does unless it is a telemetry record
+/*static*/ void StepTimer::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
+{
+	rec.Set(DiagnosticsField::syncPeakNegJitter, (uint32_t)peakNegJitter);
+	rec.Set(DiagnosticsField::syncPeakPosJitter, (uint32_t)peakPosJitter);
+	rec.Set(DiagnosticsField::syncDriftPpb, (uint32_t)lrintf(clockDrift * 1.0e9));
+	rec.Set(DiagnosticsField::syncPeakReceiveDelay, peakReceiveDelay);
+	rec.Set(DiagnosticsField::syncTimeoutResyncs, numTimeoutResyncs);
+	rec.Set(DiagnosticsField::syncJitterResyncs, numJitterResyncs);
+	if (rec.ResetCounters())
+	{
+		gotJitter = false;
+		sumSquaredJitter = 0.0;
+		numJitterSamples = 0;
+		numTimeoutResyncs = numJitterResyncs = 0;
+		peakReceiveDelay = 0;
+	}
+}
+
 // Function called by FreeRTOS to read the timer
 extern "C" uint32_t StepTimerGetTimerTicks() noexcept
 {
@@ -57,15 +57,17 @@ public:
 	// ISR called from StepTimer. May sometimes get called prematurely.
 	static void Interrupt() SPEED_CRITICAL;
 
-	static uint32_t GetLocalTimeOffset() { return localTimeOffset; }
+	static uint32_t GetLocalTimeOffset() noexcept { return GetLocalTimeOffsetAt(GetTimerTicks()); }
 	static void ProcessTimeSyncMessage(const CanMessageTimeSync& msg, size_t msgLen, uint16_t timeStamp) noexcept;
-	static uint32_t ConvertToLocalTime(uint32_t masterTime) { return masterTime + localTimeOffset; }
-	static uint32_t ConvertToMasterTime(uint32_t localTime) { return localTime - localTimeOffset; }
-	static uint32_t GetMasterTime() { return ConvertToMasterTime(GetTimerTicks()); }
+	static uint32_t ConvertToLocalTime(uint32_t masterTime) noexcept;
+	static uint32_t ConvertToMasterTime(uint32_t localTime) noexcept { return localTime - GetLocalTimeOffsetAt(localTime); }
+	static uint32_t ConvertToLocalDuration(uint32_t masterClocks) noexcept;		// convert a duration in master clock ticks to local ticks using the estimated drift
+	static uint32_t GetMasterTime() noexcept { return ConvertToMasterTime(GetTimerTicks()); }
 
 	static bool IsSynced();
 
 	static void Diagnostics(const StringRef& reply);
+	static void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;
 
 	static constexpr uint32_t StepClockRate = 48000000/64;						// 48MHz divided by 64
 	static constexpr uint64_t StepClockRateSquared = (uint64_t)StepClockRate * StepClockRate;
@@ -75,6 +77,10 @@ public:
 																				// increased from 1000 because of workaround we added for bad Tx time stamps on SAME70
 private:
 	static bool ScheduleTimerInterrupt(uint32_t tim) SPEED_CRITICAL;			// schedule an interrupt at the specified clock count, or return true if it has passed already
+	static uint32_t GetLocalTimeOffsetAt(uint32_t localTime) noexcept;			// get the estimated local time minus master time at the specified local time
+	static void ResetClockFilter(uint32_t offset, uint32_t localTime) noexcept;
+	static float UpdateClockFilter(uint32_t measuredOffset, uint32_t localTime, bool acquiring) noexcept;
+	static void SetClockOffset(uint32_t offset, uint32_t localTime) noexcept;
 
 	StepTimer *next;
 	Ticks whenDue;
@@ -82,12 +88,23 @@ private:
 	CallbackParameter cbParam;
 	volatile bool active;
 
-	static StepTimer * volatile pendingList;									// list of pending callbacks, soonest first
-	static volatile uint32_t localTimeOffset;									// local time minus master time
+	// List of pending callbacks, soonest first. There are only a few timers (move, closed loop control and GPIO batches) and the move timer is nearly always
+	// at the head or unlinked when it is rescheduled, so insertion takes one or two comparisons and a sorted list is cheaper than a heap or timer wheel.
+	static StepTimer * volatile pendingList;
+	// The clock filter estimates the offset between local and master time and the rate at which it is drifting, so that we can make smooth corrections.
+	// The offset at local time t is localTimeOffset + (offsetFractionQ32 + offsetDriftQ32 * (t - offsetBaseTime)) / 2^32.
+	static uint32_t localTimeOffset;											// local time minus master time at offsetBaseTime, rounded to the nearest tick
+	static uint32_t offsetBaseTime;												// the local time at which localTimeOffset was estimated
+	static int32_t offsetFractionQ32;											// the fractional part of the estimated offset at offsetBaseTime in units of 2^-32 ticks
+	static int32_t offsetDriftQ32;												// the estimated drift in units of 2^-32 ticks per tick
+	static float offsetFraction;												// floating point versions of the above, used by the filter
+	static float clockDrift;
+	static float sumSquaredJitter;												// sum of the squares of the residuals for calculating the RMS jitter
+	static unsigned int numJitterSamples;
 	static volatile uint32_t whenLastSynced;									// the millis tick count when we last synced
 	static uint32_t prevMasterTime;												// the previous master time received
 	static uint32_t prevLocalTime;												// the previous local time when the master time was received, corrected for receive processing delay
-	static int32_t peakPosJitter, peakNegJitter;								// the max and min corrections we made to local time offset while synced
+	static int32_t peakPosJitter, peakNegJitter;								// the max and min differences between measured and predicted time offset while synced
 	static bool gotJitter;														// true if we have recorded the jitter
 	static uint32_t peakReceiveDelay;											// the maximum receive delay we measured by using the receive time stamp
 	static volatile unsigned int syncCount;										// the number of messages we have received since starting sync
@@ -95,6 +112,10 @@ private:
 
 	static constexpr uint32_t MaxSyncJitter = StepClockRate/100;				// 10ms
 	static constexpr unsigned int MaxSyncCount = 10;
+	static constexpr float MaxClockDrift = 0.0005;								// 500ppm, more than the combined tolerance of two crystals
+	// Clock filter gains. Both sets place the two filter poles at the same place, 0.5 when acquiring sync and 0.9 when tracking.
+	static constexpr float AcquireAlpha = 0.75, AcquireBeta = 0.25;
+	static constexpr float TrackAlpha = 0.19, TrackBeta = 0.01;
 };
 
 inline __attribute__((always_inline)) StepTimer::Ticks StepTimer::GetTimerTicks()
@@ -111,4 +132,40 @@ inline __attribute__((always_inline)) StepTimer::Ticks StepTimer::GetTimerTicks(
 	return StepTc->COUNT.reg;
 }
 
+// Class to read the step clock cheaply and repeatedly within an ISR. Reading the TC count needs a read synchronisation, which takes about 1us.
+// On the SAME5x we read the TC count once along with the cycle counter (enabled by LatencyHistograms::Init), then derive later readings from the cycle counter. The derived value may lag the true count by up to one tick
+// because we don't know the phase of the TC prescaler, so it must not be used to check whether we can still schedule an interrupt in time. ScheduleTimerInterrupt still reads the TC.
+// The SAMC21 has no cycle counter, so there we read the TC every time.
+class IsrTickReader
+{
+public:
+	IsrTickReader() noexcept
+	{
+#if SAME5x
+		AtomicCriticalSectionLocker lock;										// a higher priority interrupt between the two reads would make later readings inaccurate
+		baseCycles = DWT->CYCCNT;
+#endif
+		baseTicks = StepTimer::GetTimerTicks();
+	}
+
+	StepTimer::Ticks GetStartTicks() const noexcept { return baseTicks; }
+
+	StepTimer::Ticks Read() const noexcept SPEED_CRITICAL
+	{
+#if SAME5x
+		return baseTicks + (DWT->CYCCNT - baseCycles)/CyclesPerTick;
+#else
+		return StepTimer::GetTimerTicks();
+#endif
+	}
+
+private:
+#if SAME5x
+	static constexpr uint32_t CyclesPerTick = SystemCoreClockFreq/StepTimer::StepClockRate;
+	static_assert(CyclesPerTick * StepTimer::StepClockRate == SystemCoreClockFreq);
+	uint32_t baseCycles;
+#endif
+	StepTimer::Ticks baseTicks;
+};
+
 #endif /* SRC_MOVEMENT_STEPTIMER_H_ */
@@ -0,0 +1,79 @@
+/*
+ * StepTimingStats.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "StepTimingStats.h"
+
+#if SUPPORT_STEP_TIMING_STATS
+
+#include "StepTimer.h"
+
+namespace StepTimingStats
+{
+	volatile bool enabled = false;
+	uint32_t counts[NumDrivers][(size_t)MovePhase::numPhases][NumBuckets];
+	static uint32_t whenEnabled = 0;
+	static const char * const PhaseNames[(size_t)MovePhase::numPhases] = { "accel", "steady", "decel" };
+}
+
+void StepTimingStats::Enable(bool enable) noexcept
+{
+	if (enable && !enabled)
+	{
+		memset(counts, 0, sizeof(counts));
+		whenEnabled = millis();
+	}
+	enabled = enable;
+}
+
+// Report the histograms. We only report the nonzero buckets, giving the upper limit of each one in step clocks.
+void StepTimingStats::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.printf("Step timing %s, %.1fs, one step clock is %.2fus", (enabled) ? "enabled" : "disabled",
+					(double)((float)(millis() - whenEnabled) * 0.001), (double)StepTimer::TicksToFloatMicroseconds(1));
+	for (size_t driver = 0; driver < NumDrivers; ++driver)
+	{
+		for (size_t phase = 0; phase < (size_t)MovePhase::numPhases; ++phase)
+		{
+			uint32_t bucketCounts[NumBuckets];
+			{
+				AtomicCriticalSectionLocker lock;
+				memcpy(bucketCounts, counts[driver][phase], sizeof(bucketCounts));
+				memset(counts[driver][phase], 0, sizeof(counts[driver][phase]));
+			}
+
+			bool reported = false;
+			for (size_t bucket = 0; bucket < NumBuckets; ++bucket)
+			{
+				if (bucketCounts[bucket] != 0)
+				{
+					if (!reported)
+					{
+						reply.lcatf("Driver %u %s:", driver, PhaseNames[phase]);
+						reported = true;
+					}
+					if (bucket == 0)
+					{
+						reply.catf(" early %" PRIu32, bucketCounts[bucket]);
+					}
+					else if (bucket + 1 == NumBuckets)
+					{
+						reply.catf(" more %" PRIu32, bucketCounts[bucket]);
+					}
+					else
+					{
+						reply.catf(" <%u:%" PRIu32, 1u << (bucket - 1), bucketCounts[bucket]);
+					}
+				}
+			}
+		}
+	}
+	whenEnabled = millis();
+}
+
+#endif
+
+// End
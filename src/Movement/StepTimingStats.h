@@ -0,0 +1,51 @@
+/*
+ * StepTimingStats.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MOVEMENT_STEPTIMINGSTATS_H_
+#define SRC_MOVEMENT_STEPTIMINGSTATS_H_
+
+#include <RepRapFirmware.h>
+
+#if SUPPORT_STEP_TIMING_STATS
+
+// The phase of a move that a step was in
+enum class MovePhase : uint8_t
+{
+	accelerating = 0,
+	steady,
+	decelerating,
+	numPhases
+};
+
+// Module to record how late each step pulse was compared to its scheduled time, as a histogram per driver and move phase.
+// The histograms are updated only by the step ISR. Recording is off by default because it adds a little to the step ISR time.
+namespace StepTimingStats
+{
+	constexpr size_t NumBuckets = 12;			// bucket 0 is early, bucket 1 is on time, bucket n > 1 is 2^(n-2) to 2^(n-1) - 1 step clocks late, the last bucket includes all later steps
+
+	extern volatile bool enabled;
+	extern uint32_t counts[NumDrivers][(size_t)MovePhase::numPhases][NumBuckets];
+
+	inline bool IsEnabled() noexcept { return enabled; }
+	void Enable(bool enable) noexcept;
+	void Diagnostics(const StringRef& reply) noexcept;					// append the histograms and reset them
+
+	// Record a step. Called only by the step ISR. 'lateness' is in step clocks and is negative if the step was generated early.
+	inline void Record(size_t driver, MovePhase phase, int32_t lateness) noexcept;
+}
+
+inline void StepTimingStats::Record(size_t driver, MovePhase phase, int32_t lateness) noexcept
+{
+	const size_t bucket = (lateness < 0) ? 0
+							: (lateness == 0) ? 1
+								: min<size_t>((size_t)(33 - __builtin_clz((uint32_t)lateness)), NumBuckets - 1);
+	++counts[driver][(size_t)phase][bucket];
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPTIMINGSTATS_H_ */
@@ -0,0 +1,136 @@
+/*
+ * DriverFaultMonitor.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "DriverFaultMonitor.h"
+
+#if HAS_SMART_DRIVERS
+
+#include <CAN/CanInterface.h>
+
+namespace DriverFaultMonitor
+{
+	// The lowest 8 bits of the status are the ot, otpw, s2ga, s2gb, s2vsa, s2vsb, ola and olb bits.
+	// We only accept these if they appear in 2 successive readings, to avoid reporting transient short-to-ground, short-to-VS and open load readings.
+	constexpr uint32_t FilteredStatusBits = 0x000000FF;
+
+	enum class PendingEvent : uint8_t { none = 0, warning, error };		// in increasing order of importance
+
+	struct DriverFaultState
+	{
+		StandardDriverStatus previousStatus;			// the status we were passed last time
+		StandardDriverStatus lastEventStatus;			// the status which we last reported as an event
+		StandardDriverStatus pendingStatus;				// the status to send with the pending event
+		uint32_t whenOpenLoadStarted;					// the millis() time at which we first saw the open load bits
+		bool noPoll;									// true if the driver is flagged "no poll", zero-initialised so that all drivers start off monitored
+		bool openLoadTimerRunning;
+		volatile PendingEvent pendingEvent;
+	};
+
+	static DriverFaultState states[NumDrivers];
+	static size_t nextDriverToSend = 0;					// so that a driver with frequent events can't lock out the others
+
+	static void QueueEvent(DriverFaultState& ds, StandardDriverStatus stat, PendingEvent ev) noexcept
+	{
+		{
+			AtomicCriticalSectionLocker lock;
+			if (ev >= ds.pendingEvent)
+			{
+				ds.pendingStatus = stat;
+				ds.pendingEvent = ev;
+			}
+		}
+		CanInterface::WakeAsyncSender();
+	}
+}
+
+// Set whether we report events for a driver. Drivers flagged "no poll" are often not connected to a motor, so their status is meaningless.
+void DriverFaultMonitor::SetMonitored(size_t driver, bool monitored) noexcept
+{
+	if (driver < NumDrivers)
+	{
+		DriverFaultState& ds = states[driver];
+		AtomicCriticalSectionLocker lock;
+		ds.noPoll = !monitored;
+		if (!monitored)
+		{
+			ds.previousStatus.all = 0;
+			ds.openLoadTimerRunning = false;
+			ds.pendingEvent = PendingEvent::none;
+		}
+	}
+}
+
+// Process a new driver status. This is called by the drivers task, so it mustn't do anything that takes long.
+void DriverFaultMonitor::ProcessStatus(size_t driver, StandardDriverStatus stat) noexcept
+{
+	if (driver >= NumDrivers || states[driver].noPoll)
+	{
+		return;
+	}
+
+	DriverFaultState& ds = states[driver];
+	const StandardDriverStatus newStatus = stat;
+	stat.all &= ds.previousStatus.all | ~FilteredStatusBits;
+	ds.previousStatus = newStatus;
+
+	// The driver often produces a transient open-load error, especially in stealthchop mode, so we require the condition to persist before we report it.
+	// So clear them unless they have been active for the minimum time.
+	if (stat.IsAnyOpenLoadBitSet())
+	{
+		const uint32_t now = millis();
+		if (!ds.openLoadTimerRunning)
+		{
+			ds.whenOpenLoadStarted = now;
+			ds.openLoadTimerRunning = true;
+			stat.ClearOpenLoadBits();
+		}
+		else if (now - ds.whenOpenLoadStarted < OpenLoadTimeout)
+		{
+			stat.ClearOpenLoadBits();
+		}
+	}
+	else
+	{
+		ds.openLoadTimerRunning = false;
+	}
+
+	const StandardDriverStatus oldStatus = ds.lastEventStatus;
+	ds.lastEventStatus = stat;
+	if (stat.HasNewErrorSince(oldStatus))
+	{
+		QueueEvent(ds, stat, PendingEvent::error);
+	}
+	else if (stat.HasNewWarningSince(oldStatus))
+	{
+		QueueEvent(ds, stat, PendingEvent::warning);
+	}
+}
+
+// Fetch and clear a pending event
+bool DriverFaultMonitor::GetPendingEvent(size_t& driver, StandardDriverStatus& stat, bool& isError) noexcept
+{
+	for (size_t i = 0; i < NumDrivers; ++i)
+	{
+		const size_t d = nextDriverToSend;
+		nextDriverToSend = (nextDriverToSend + 1) % NumDrivers;
+		DriverFaultState& ds = states[d];
+		if (ds.pendingEvent != PendingEvent::none)
+		{
+			AtomicCriticalSectionLocker lock;
+			driver = d;
+			stat = ds.pendingStatus;
+			isError = (ds.pendingEvent == PendingEvent::error);
+			ds.pendingEvent = PendingEvent::none;
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
+
+// End
@@ -0,0 +1,27 @@
+/*
+ * DriverFaultMonitor.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_MOVEMENT_STEPPERDRIVERS_DRIVERFAULTMONITOR_H_
+#define SRC_MOVEMENT_STEPPERDRIVERS_DRIVERFAULTMONITOR_H_
+
+#include <RepRapFirmware.h>
+
+#if HAS_SMART_DRIVERS
+
+// Module to turn the driver status into driver error and warning events.
+// The drivers task passes each new status to ProcessStatus as soon as it has read it, so the reporting latency is the status poll interval.
+// Events are queued here and sent by the CAN async sender task. Only the latest event for each driver is kept, and an error is never replaced by a warning.
+namespace DriverFaultMonitor
+{
+	void SetMonitored(size_t driver, bool monitored) noexcept;								// called by Platform when the driver is set to "no poll" or back again
+	void ProcessStatus(size_t driver, StandardDriverStatus stat) noexcept;					// called by the drivers task when it has read a new status
+	bool GetPendingEvent(size_t& driver, StandardDriverStatus& stat, bool& isError) noexcept;	// called by the CAN async sender task, returns true if an event was fetched
+}
+
+#endif
+
+#endif /* SRC_MOVEMENT_STEPPERDRIVERS_DRIVERFAULTMONITOR_H_ */
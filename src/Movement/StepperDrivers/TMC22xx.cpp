@@ -39,11 +39,14 @@
 #define USE_FAST_CRC	1
 
 #include <TaskPriorities.h>
+#include <LatencyHistograms.h>
+#include <IsrProfiler.h>
 #include <Movement/Move.h>
 #include <Movement/StepTimer.h>
 #include <Cache.h>
 #include <General/Portability.h>
 #include <Hardware/IoPorts.h>
+#include "DriverFaultMonitor.h"
 
 #if SAME5x || SAMC21
 # include <DmacManager.h>
@@ -451,6 +454,7 @@ public:
 	bool DriverAssumedPresent() const noexcept { return numWrites != 0 || numTimeouts < DriverNotPresentTimeouts; }
 
 	void TransferDone() noexcept SPEED_CRITICAL;				// called by the ISR when the SPI transfer has completed
+	bool TakeNewStatus() noexcept { const bool rslt = newStatusRead; newStatusRead = false; return rslt; }	// return true if we have read the drive status since the last call
 	void StartTransfer() noexcept SPEED_CRITICAL;				// called to start a transfer
 	void TransferTimedOut() noexcept
 	{
@@ -493,6 +497,7 @@ private:
 	void UpdateRegister(size_t regIndex, uint32_t regVal) noexcept;
 	void UpdateCurrent() noexcept;
 	void UpdateMaxOpenLoadStepInterval() noexcept;
+	void SelectNextRegisterToRead() noexcept SPEED_CRITICAL;
 #if HAS_STALL_DETECT
 	void ResetLoadRegisters() noexcept
 	{
@@ -595,6 +600,7 @@ private:
 	uint16_t writeErrors;									// how many write errors we had
 	uint16_t numReads;										// how many successful reads we had
 	uint16_t numWrites;										// how many successful writes we had
+	uint16_t numWritesSkipped;								// how many register updates we didn't send because the driver already had the value
 	uint16_t numTimeouts;									// how many times a transfer timed out
 	uint16_t numDmaErrors;
 	uint16_t badChopConfErrors;
@@ -608,6 +614,7 @@ private:
 	uint8_t driverNumber;									// the number of this driver as addressed by the UART multiplexer
 	uint8_t standstillCurrentFraction;						// divide this by 256 to get the motor current standstill fraction
 	uint8_t registerToRead;									// the next register we need to read
+	uint8_t roundRobinRegister;								// the last register we read in the round robin schedule
 	uint8_t regnumBeingUpdated;								// which register we are sending
 	uint8_t lastIfCount;									// the value of the IFCNT register last time we read it
 	uint8_t failedOp;
@@ -618,6 +625,7 @@ private:
 	volatile uint8_t specialReadRegisterNumber;				// the special register number we are reading
 	volatile uint8_t specialWriteRegisterNumber;			// the special register number we are writing
 	bool enabled;											// true if driver is enabled
+	volatile bool newStatusRead;							// true if we have read the drive status and the drivers task hasn't processed it yet
 #if RESET_MICROSTEP_COUNTERS_AT_INIT
 	bool hadStepFailure;
 #endif
@@ -896,11 +904,18 @@ void TmcDriverState::UpdateMaxOpenLoadStepInterval() noexcept
 	}
 }
 
-// Set a register value and flag it for updating
+// Set a register value and flag it for updating.
+// If the register is not already flagged then the driver holds the value in writeRegisters, so we don't send it again if the value hasn't changed.
+// Several updates to a register before it is sent result in just one write of the latest value.
 void TmcDriverState::UpdateRegister(size_t regIndex, uint32_t regVal) noexcept
 {
 	{
 		AtomicCriticalSectionLocker lock;
+		if (regIndex != WriteSpecial && regVal == writeRegisters[regIndex] && (registersToUpdate & (1u << regIndex)) == 0)
+		{
+			++numWritesSkipped;
+			return;
+		}
 		writeRegisters[regIndex] = regVal;
 		registersToUpdate |= (1u << regIndex);								// flag it for sending
 	}
@@ -969,6 +984,7 @@ pre(!driversPowered)
 #endif
 
 	enabled = false;
+	newStatusRead = false;
 #if RESET_MICROSTEP_COUNTERS_AT_INIT
 	hadStepFailure = false;
 #endif
@@ -1000,9 +1016,9 @@ pre(!driversPowered)
 
 	regnumBeingUpdated = 0xFF;
 	failedOp = 0xFF;
-	registerToRead = 0;
+	registerToRead = roundRobinRegister = 0;
 	lastIfCount = 0;
-	readErrors = writeErrors = numReads = numWrites = numTimeouts = numDmaErrors = badChopConfErrors = 0;
+	readErrors = writeErrors = numReads = numWrites = numWritesSkipped = numTimeouts = numDmaErrors = badChopConfErrors = 0;
 #if HAS_STALL_DETECT
 	ResetLoadRegisters();
 #endif
@@ -1327,8 +1343,8 @@ void TmcDriverState::AppendDriverStatus(const StringRef& reply) noexcept
 	ResetLoadRegisters();
 #endif
 
-	reply.catf(", read errors %u, write errors %u, ifcnt %u, reads %u, writes %u, timeouts %u, DMA errors %u, CC errors %u",
-					readErrors, writeErrors, lastIfCount, numReads, numWrites, numTimeouts, numDmaErrors, badChopConfErrors);
+	reply.catf(", read errors %u, write errors %u, ifcnt %u, reads %u, writes %u, skipped %u, timeouts %u, DMA errors %u, CC errors %u",
+					readErrors, writeErrors, lastIfCount, numReads, numWrites, numWritesSkipped, numTimeouts, numDmaErrors, badChopConfErrors);
 	if (failedOp != 0xFF)
 	{
 		reply.catf(", failedOp 0x%02x", failedOp);
@@ -1390,6 +1406,7 @@ inline void TmcDriverState::TransferDone() noexcept
 				{
 					regVal &= ~(TMC_RR_OLA | TMC_RR_OLB);				// open load bits are unreliable at standstill and low speeds
 				}
+				newStatusRead = true;
 			}
 			else if (registerToRead == ReadChopConf)
 			{
@@ -1415,17 +1432,12 @@ inline void TmcDriverState::TransferDone() noexcept
 			if (registerToRead == ReadSpecial)
 			{
 				specialReadRegisterNumber = 0xFE;						// set it to 0xFE to indicate that we have read it and to prevent it being read again
-				registerToRead = 0;
 			}
 			else
 			{
 				accumulatedReadRegisters[registerToRead] |= regVal;
-				++registerToRead;
-				if (registerToRead == ReadSpecial && specialReadRegisterNumber >= 0x80)
-				{
-					registerToRead = 0;
-				}
 			}
+			SelectNextRegisterToRead();
 			++numReads;
 		}
 		else
@@ -1435,6 +1447,24 @@ inline void TmcDriverState::TransferDone() noexcept
 	}
 }
 
+// Choose the next register to read. While the motor is moving we read DRV_STATUS in alternate transfers so that faults are reported promptly,
+// and cycle through the other registers in between. Otherwise we cycle through all the registers.
+inline void TmcDriverState::SelectNextRegisterToRead() noexcept
+{
+	const bool moving = moveInstance->GetStepInterval(axisNumber, microstepShiftFactor) != 0;
+	if (moving && registerToRead != ReadDrvStat)
+	{
+		registerToRead = ReadDrvStat;
+		return;
+	}
+
+	do
+	{
+		roundRobinRegister = (roundRobinRegister >= ReadSpecial) ? 0 : roundRobinRegister + 1;
+	} while ((roundRobinRegister == ReadSpecial && specialReadRegisterNumber >= 0x80) || (moving && roundRobinRegister == ReadDrvStat));
+	registerToRead = roundRobinRegister;
+}
+
 // This is called to abandon the current transfer, if any
 void TmcDriverState::AbortTransfer() noexcept
 {
@@ -1561,8 +1591,10 @@ inline void TmcDriverState::UartTmcHandler() noexcept
 // DMA complete callback
 void TransferCompleteCallback(CallbackParameter, DmaCallbackReason reason) noexcept
 {
+	ISR_PROFILE_ENTER();
 	dmaFinishedReason = reason;
 	tmcTask->GiveFromISR();
+	ISR_PROFILE_EXIT(tmcDma);
 }
 
 # else
@@ -1618,10 +1650,12 @@ bool DoTransaction(size_t driverNumber)
 #else
 	dmaFinished = false;
 #endif
+	const LatencyHistograms::Timestamp probeStartTime = LatencyHistograms::GetTimestamp();
 	currentDriver->StartTransfer();
 
 	// Wait for the end-of-transfer interrupt
 	const bool timedOut = !TaskBase::Take(TransferTimeout);
+	LatencyHistograms::Record(LatencyProbe::tmcTransfer, probeStartTime);
 #if TMC22xx_USES_SERCOM
 	DmacManager::DisableCompletedInterrupt(DmacChanTmcRx);
 #elif TMC22xx_HAS_MUX || TMC22xx_SINGLE_DRIVER
@@ -1642,6 +1676,10 @@ bool DoTransaction(size_t driverNumber)
 #endif
 	{
 		currentDriver->UartTmcHandler();
+		if (currentDriver->TakeNewStatus())
+		{
+			DriverFaultMonitor::ProcessStatus(currentDriver - driverStates, currentDriver->GetStatus(false, false));	// report faults as soon as we see them
+		}
 #if TMC22xx_SINGLE_DRIVER
 		delay(2);						// TMC22xx can't handle back-to-back reads, so we need a short delay
 #endif
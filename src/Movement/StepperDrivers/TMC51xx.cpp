@@ -16,7 +16,11 @@
 #include <Movement/Move.h>
 #include <DmacManager.h>
 #include <TaskPriorities.h>
+#include <PriorityProfiles.h>
+#include <LatencyHistograms.h>
+#include <IsrProfiler.h>
 #include <General/Portability.h>
+#include "DriverFaultMonitor.h"
 
 #if SUPPORT_CLOSED_LOOP
 # include <ClosedLoop/ClosedLoop.h>
@@ -91,6 +95,21 @@ const uint32_t DriversSpiClockFrequency = 500000;			// 500kHz SPI clock
 #endif
 const uint32_t TransferTimeout = 2;							// any transfer should complete within 2 ticks @ 1ms/tick
 
+// Load control. When enabled, we reduce the run current while the stallGuard result shows that the load is light, and restore it quickly when the load increases.
+// The current scale is in units of 1/32 of the configured motor current, to match the resolution of IRUN, so that we only rewrite the current registers when it changes by a useful amount.
+constexpr unsigned int FullCurrentScale = 32;
+
+#if SUPPORT_CLOSED_LOOP
+constexpr unsigned int ClosedLoopOtherTrafficInterval = 8;	// in closed loop mode, one transfer in this many is used for register traffic other than XDIRECT
+#endif
+constexpr uint16_t LoadControlLightLoadSg = 480;			// stallGuard results above this indicate a light load, so we can reduce the current
+constexpr uint16_t LoadControlHeavyLoadSg = 160;			// stallGuard results below this indicate a heavy load, so we must increase the current
+constexpr unsigned int LoadControlIncreaseStep = 4;			// how much we increase the current scale by when the load is heavy
+constexpr unsigned int LoadControlDecreaseCount = 16;		// how many successive light load readings we need before we reduce the current scale by 1
+#if !SUPPORT_CLOSED_LOOP
+const uint32_t IdlePollInterval = 10;						// when no motors are moving we only poll the drivers this often, in ms
+#endif
+
 // GCONF register (0x00, RW)
 constexpr uint8_t REGNUM_GCONF = 0x00;
 
@@ -275,6 +294,8 @@ constexpr uint32_t TMC_RR_OLA = 1 << 29;				// open load A
 constexpr uint32_t TMC_RR_OLB = 1 << 30;				// open load B
 constexpr uint32_t TMC_RR_STST = 1 << 31;				// standstill detected
 constexpr uint32_t TMC_RR_SGRESULT = 0x3FF;				// 10-bit stallGuard2 result
+constexpr uint32_t TMC_RR_CSACTUAL_SHIFT = 16;
+constexpr uint32_t TMC_RR_CSACTUAL_MASK = 31 << TMC_RR_CSACTUAL_SHIFT;	// actual current scale, which coolStep may reduce below IRUN
 
 constexpr unsigned int TMC_RR_STST_BIT_POS = 31;
 constexpr unsigned int TMC_RR_SG_BIT_POS = 24;
@@ -283,9 +304,17 @@ constexpr unsigned int TMC_RR_SG_BIT_POS = 24;
 constexpr uint8_t REGNUM_PWMCONF = 0x70;
 
 constexpr uint32_t DefaultPwmConfReg = 0xC40C001E;			// this is the reset default - try it until we find something better
+constexpr uint32_t PWMCONF_OFS_MASK = 0xFF;					// initial value of the PWM amplitude offset
+constexpr uint32_t PWMCONF_GRAD_SHIFT = 8;
+constexpr uint32_t PWMCONF_GRAD_MASK = 0xFF << PWMCONF_GRAD_SHIFT;	// initial value of the velocity dependent PWM gradient
+constexpr uint32_t PWMCONF_AUTOSCALE = 1 << 18;				// enable automatic current control
+constexpr uint32_t PWMCONF_AUTOGRAD = 1 << 19;				// enable automatic tuning of the PWM gradient
 
 constexpr uint8_t REGNUM_PWM_SCALE = 0x71;
 constexpr uint8_t REGNUM_PWM_AUTO = 0x72;
+constexpr uint32_t PWM_AUTO_OFS_MASK = 0xFF;				// automatically tuned PWM amplitude offset
+constexpr uint32_t PWM_AUTO_GRAD_SHIFT = 16;
+constexpr uint32_t PWM_AUTO_GRAD_MASK = 0xFF << PWM_AUTO_GRAD_SHIFT;	// automatically tuned PWM gradient
 
 // Common data
 static constexpr size_t numTmc51xxDrivers = MaxSmartDrivers;
@@ -325,6 +354,8 @@ enum class DriversState : uint8_t
 
 static DriversState driversState = DriversState::shutDown;
 
+static void WakeTmcTaskIfIdle() noexcept;
+
 //----------------------------------------------------------------------------------------------------------------------------------
 // Private types and methods
 
@@ -342,11 +373,13 @@ public:
 	bool SetDriverMode(unsigned int mode) noexcept;
 	DriverMode GetDriverMode() const noexcept;
 	void SetCurrent(float current) noexcept;
+	float GetCurrent() const noexcept { return (float)motorCurrent; }
 	void Enable(bool en) noexcept;
 	bool UpdatePending() const noexcept { return (registersToUpdate | newRegistersToUpdate) != 0; }
 	void SetStallDetectThreshold(int sgThreshold) noexcept;
 	void SetStallDetectFilter(bool sgFilter) noexcept;
 	void SetStallMinimumStepsPerSecond(unsigned int stepsPerSecond) noexcept;
+	void SetLoadControlMinimumCurrent(unsigned int percent) noexcept;
 	StandardDriverStatus GetStatus(bool accumulated, bool clearAccumulated) noexcept;
 	void AppendStallConfig(const StringRef& reply) const noexcept;
 	void AppendDriverStatus(const StringRef& reply, bool clearGlobalStats) noexcept;
@@ -359,11 +392,16 @@ public:
 	float GetStandstillCurrentPercent() const noexcept;
 	void SetStandstillCurrentPercent(float percent) noexcept;
 
+#if HAS_VOLTAGE_MONITOR
+	GCodeResult MeasureMotor(bool apply, const StringRef& reply) noexcept;
+#endif
+
 	static void TransferTimedOut() noexcept { ++numTimeouts; }
 
 	void GetSpiCommand(uint8_t *sendDataBlock) noexcept;
-	void TransferSucceeded(const uint8_t *rcvDataBlock) noexcept;
+	bool TransferSucceeded(const uint8_t *rcvDataBlock) noexcept;		// returns true if we read a new drive status
 	void TransferFailed() noexcept;
+	bool RegistersWereRestored() noexcept;							// returns true once each time we find that the driver lost its register values
 
 private:
 	bool SetChopConf(uint32_t newVal) noexcept;
@@ -376,6 +414,9 @@ private:
 		minSgLoadRegister = 9999;							// values read from the driver are in the range 0 to 1023, so 9999 indicates that it hasn't been read
 	}
 
+	void UpdateLoadControl(uint32_t drvStatus, uint32_t interval) noexcept;
+	void VerifyRegister(uint32_t regVal) noexcept;
+
 	// Write register numbers are in priority order, most urgent first, in same order as WriteRegNumbers
 	static constexpr unsigned int WriteGConf = 0;			// microstepping and direct mode
 	static constexpr unsigned int WriteIholdIrun = 1;		// current setting
@@ -414,6 +455,12 @@ private:
 	static constexpr unsigned int ReadPwmScale = 3;
 	static constexpr unsigned int ReadPwmAuto = 4;
 	static constexpr unsigned int ReadSpecial = NumReadRegisters;
+	static constexpr unsigned int ReadVerify = NumReadRegisters + 1;	// read back one of the write registers that the driver allows us to read
+
+	// The write registers that can be read back, so we can check that the driver still has the values we sent.
+	// If the driver resets because of a supply glitch these revert to their defaults, and so do the write-only ones such as IHOLD_IRUN.
+	static constexpr unsigned int NumVerifiedRegisters = 2;
+	static const uint8_t VerifiedRegIndices[NumVerifiedRegisters];
 
 	static constexpr uint8_t NoRegIndex = 0xFF;				// this means no register updated, or no register requested
 
@@ -433,14 +480,35 @@ private:
 
 	uint16_t minSgLoadRegister;								// the minimum value of the StallGuard bits we read
 	uint16_t numReads, numWrites;							// how many successful reads and writes we had
+	uint16_t numRegisterRestores;							// how many times we rewrote all the registers because a read-back didn't match
 	static uint16_t numTimeouts;							// how many times a transfer timed out
 
+	uint32_t whenLastStatusRead;							// the step clock when we last read DRV_STATUS
+	uint32_t totalStatusInterval;							// the sum of the intervals between DRV_STATUS reads since we last reported them, in step clocks
+	uint32_t maxStatusInterval;								// the longest interval between DRV_STATUS reads since we last reported it, in step clocks
+	uint16_t numStatusIntervals;							// how many intervals totalStatusInterval includes
+	bool statusReadTimeValid;								// true if whenLastStatusRead is valid
+
+	uint32_t totalRunCurrent;								// the sum of the run currents in mA that we sampled while moving, since we last reported them
+	uint16_t numRunCurrentSamples;							// how many samples totalRunCurrent includes
+	uint8_t currentScale;									// the current run current as a fraction of motorCurrent, in units of 1/32
+	uint8_t minCurrentScale;								// the lowest that load control may reduce currentScale to, or FullCurrentScale if load control is disabled
+	uint8_t lightLoadCount;									// how many successive light load readings we have had
+#if SUPPORT_CLOSED_LOOP && TMC_TYPE == 2160
+	uint8_t closedLoopTransferCount;						// how many transfers we have reserved for XDIRECT since we last allowed other traffic
+#endif
+
 	uint16_t standstillCurrentFraction;						// divide this by 256 to get the motor current standstill fraction
 	uint8_t regIndexBeingUpdated;							// which register we are sending
 	uint8_t regIndexRequested;								// the register we asked to read in the previous transaction, or 0xFF
 	uint8_t previousRegIndexRequested;						// the register we asked to read in the previous transaction, or 0xFF
+	uint8_t roundRobinReadIndex;							// the last register other than DRV_STATUS that we asked to read
 	volatile uint8_t specialReadRegisterNumber;
 	volatile uint8_t specialWriteRegisterNumber;
+	uint8_t verifyIndex;									// index into VerifiedRegIndices of the register we last read back
+	uint32_t verifyExpectedValue;							// the value that register had in writeRegisters when we asked to read it
+	bool verifyFailing;										// true if the last read-back didn't match, so we have already reported it
+	volatile bool registersRestored;						// true if we have rewritten the registers and not reported it yet
 	bool enabled;											// true if driver is enabled
 };
 
@@ -473,6 +541,12 @@ const uint8_t TmcDriverState::ReadRegNumbers[NumReadRegisters] =
 	REGNUM_PWM_AUTO
 };
 
+const uint8_t TmcDriverState::VerifiedRegIndices[NumVerifiedRegisters] =
+{
+	WriteGConf,
+	WriteChopConf
+};
+
 uint16_t TmcDriverState::numTimeouts = 0;								// how many times a transfer timed out
 
 // Initialise the state of the driver and its CS pin
@@ -512,7 +586,21 @@ pre(!driversPowered)
 	accumulatedDriveStatus = 0;
 
 	regIndexBeingUpdated = regIndexRequested = previousRegIndexRequested = NoRegIndex;
+	roundRobinReadIndex = ReadSpecial;
 	numReads = numWrites = 0;
+	numRegisterRestores = 0;
+	verifyIndex = 0;
+	verifyFailing = registersRestored = false;
+	totalStatusInterval = maxStatusInterval = 0;
+	numStatusIntervals = 0;
+	statusReadTimeValid = false;
+	totalRunCurrent = 0;
+	numRunCurrentSamples = 0;
+	currentScale = minCurrentScale = FullCurrentScale;
+	lightLoadCount = 0;
+#if SUPPORT_CLOSED_LOOP && TMC_TYPE == 2160
+	closedLoopTransferCount = 0;
+#endif
 }
 
 // Set a register value and flag it for updating
@@ -520,6 +608,7 @@ void TmcDriverState::UpdateRegister(size_t regIndex, uint32_t regVal) noexcept
 {
 	writeRegisters[regIndex] = regVal;
 	newRegistersToUpdate |= (1u << regIndex);							// flag it for sending
+	WakeTmcTaskIfIdle();
 }
 
 // Calculate the chopper control register and flag it for sending
@@ -533,6 +622,7 @@ void TmcDriverState::SetStallDetectThreshold(int sgThreshold) noexcept
 	const uint32_t sgVal = ((uint32_t)constrain<int>(sgThreshold, -64, 63)) & 127u;
 	writeRegisters[WriteCoolConf] = (writeRegisters[WriteCoolConf] & ~COOLCONF_SGT_MASK) | (sgVal << COOLCONF_SGT_SHIFT);
 	newRegistersToUpdate |= 1u << WriteCoolConf;
+	WakeTmcTaskIfIdle();
 }
 
 // Write all registers. This is called when the drivers are known to be powered up.
@@ -793,13 +883,15 @@ void TmcDriverState::UpdateCurrent() noexcept
 	// Assume a current sense resistor of 0.082 ohms, to which we must add 0.025 ohms internal resistance.
 	// Full scale peak motor current in the high sensitivity range is give by I = 0.18/(R+0.03) = 0.18/0.105 ~= 1.6A
 	// This gives us a range of 50mA to 1.6A in 50mA steps in the high sensitivity range (VSENSE = 1)
-	const uint32_t iRunCsBits = (32 * motorCurrent - 800)/1615;		// formula checked by simulation on a spreadsheet
+	const uint32_t runCurrent = (motorCurrent * currentScale)/FullCurrentScale;
+	const uint32_t iRunCsBits = (32 * runCurrent - 800)/1615;		// formula checked by simulation on a spreadsheet
 	const uint32_t iHoldCurrent = (motorCurrent * standstillCurrentFraction)/256;	// set standstill current
 	const uint32_t iHoldCsBits = (32 * iHoldCurrent - 800)/1615;	// formula checked by simulation on a spreadsheet
 	UpdateRegister(WriteIholdIrun,
 					(writeRegisters[WriteIholdIrun] & ~(IHOLDIRUN_IRUN_MASK | IHOLDIRUN_IHOLD_MASK)) | (iRunCsBits << IHOLDIRUN_IRUN_SHIFT) | (iHoldCsBits << IHOLDIRUN_IHOLD_SHIFT));
 #elif TMC_TYPE == 5160 || TMC_TYPE == 2160
 	// See if we can set IRUN to 31 and do the current adjustment in the global scaler
+	// The standstill current is still a fraction of the full motor current, because load control never reduces the current at standstill
 	uint32_t gs = lrintf(motorCurrent * 256 * RecipFullScaleCurrent);
 	uint32_t iRun = 31;
 	if (gs >= 256)
@@ -817,7 +909,7 @@ void TmcDriverState::UpdateCurrent() noexcept
 	constexpr uint32_t MaxStandstillCurrentTimes256 = 256 * (uint32_t)MaximumStandstillCurrent;
 	const uint16_t desiredStandstillCurrentFraction =
 #if SUPPORT_CLOSED_LOOP
-		(ClosedLoop::GetClosedLoopEnabled()) ? 256 : standstillCurrentFraction;
+		(ClosedLoop::GetClosedLoopEnabled(driverBit.LowestSetBit())) ? 256 : standstillCurrentFraction;
 #else
 		standstillCurrentFraction;
 #endif
@@ -825,14 +917,131 @@ void TmcDriverState::UpdateCurrent() noexcept
 														? desiredStandstillCurrentFraction
 															: (uint16_t)(MaxStandstillCurrentTimes256/motorCurrent);
 	const uint32_t iHold = (iRun * limitedStandstillCurrentFraction)/256;
+	const uint32_t scaledIRun = max<uint32_t>(((iRun + 1) * currentScale)/FullCurrentScale, 1) - 1;		// load control may reduce the run current
 	UpdateRegister(WriteIholdIrun,
-					(writeRegisters[WriteIholdIrun] & ~(IHOLDIRUN_IRUN_MASK | IHOLDIRUN_IHOLD_MASK)) | (iRun << IHOLDIRUN_IRUN_SHIFT) | (iHold << IHOLDIRUN_IHOLD_SHIFT));
+					(writeRegisters[WriteIholdIrun] & ~(IHOLDIRUN_IRUN_MASK | IHOLDIRUN_IHOLD_MASK)) | (scaledIRun << IHOLDIRUN_IRUN_SHIFT) | (iHold << IHOLDIRUN_IHOLD_SHIFT));
 	UpdateRegister(Write5160GlobalScaler, gs);
 #else
 # error unknown device
 #endif
 }
 
+#if HAS_VOLTAGE_MONITOR
+
+// Measure the motor phase resistance using the stealthChop automatic tuning. At standstill with the current at IRUN, the driver adjusts PWM_OFS_AUTO until the coil current
+// matches the current setting, and the datasheet gives PWM_OFS = 374 * R_COIL * I_COIL/V_M, so we can work out R_COIL from the tuned offset, VIN and the configured current.
+// The driver doesn't tell us the coil current, so we can't measure the inductance. The PWM gradient is only tuned while moving, so we report it if the driver was already in stealthChop mode.
+// If 'apply' is true we use the tuned values as the initial PWM offset and gradient, so that stealthChop needs much less tuning after each power up.
+// This blocks the calling task for up to MaxTuningMillis while the driver tunes.
+GCodeResult TmcDriverState::MeasureMotor(bool apply, const StringRef& reply) noexcept
+{
+	constexpr float MinimumTuningVoltage = 10.0;
+	constexpr uint32_t MinTuningMillis = 150;						// the datasheet says tuning at standstill takes at least 130ms
+	constexpr uint32_t StableMillis = 60;
+	constexpr uint32_t MaxTuningMillis = 600;
+	constexpr uint32_t PollMillis = 10;
+
+	if (motorCurrent == 0)
+	{
+		reply.copy("Motor current must be set before measuring the motor");
+		return GCodeResult::error;
+	}
+	if ((writeRegisters[WriteGConf] & GCONF_DIRECT_MODE) != 0)
+	{
+		reply.copy("Can't measure the motor in closed loop mode");
+		return GCodeResult::error;
+	}
+	if ((readRegisters[ReadDrvStat] & TMC_RR_STST) == 0)
+	{
+		reply.copy("Motor must be stationary while it is measured");
+		return GCodeResult::error;
+	}
+	if (motorCurrent > (uint32_t)MaximumStandstillCurrent)
+	{
+		reply.printf("Motor current must not exceed %umA while it is measured", (unsigned int)MaximumStandstillCurrent);
+		return GCodeResult::error;
+	}
+	const float vin = Platform::GetCurrentVinVoltage();
+	if (vin < MinimumTuningVoltage)
+	{
+		reply.copy("VIN too low to measure the motor");
+		return GCodeResult::error;
+	}
+
+	// Switch to stealthChop with automatic tuning and the standstill current equal to the run current
+	const uint32_t savedGConf = writeRegisters[WriteGConf];
+	const uint32_t savedPwmConf = writeRegisters[WritePwmConf];
+	const uint16_t savedStandstillCurrentFraction = standstillCurrentFraction;
+	const uint8_t savedCurrentScale = currentScale;
+	const bool wasEnabled = enabled;
+	const uint32_t initialPwmAuto = readRegisters[ReadPwmAuto];
+
+	standstillCurrentFraction = 256;
+	currentScale = FullCurrentScale;
+	UpdateCurrent();
+	UpdateRegister(WritePwmConf, savedPwmConf | PWMCONF_AUTOSCALE | PWMCONF_AUTOGRAD);
+	UpdateRegister(WriteGConf, savedGConf | GCONF_STEALTHCHOP);
+	Enable(true);
+
+	// Wait for the tuned offset to settle
+	const uint32_t startTime = millis();
+	uint32_t lastChangeTime = startTime;
+	uint32_t pwmOfs = initialPwmAuto & PWM_AUTO_OFS_MASK;
+	for (;;)
+	{
+		delay(PollMillis);
+		const uint32_t now = millis();
+		const uint32_t newPwmOfs = readRegisters[ReadPwmAuto] & PWM_AUTO_OFS_MASK;
+		if (newPwmOfs != pwmOfs)
+		{
+			pwmOfs = newPwmOfs;
+			lastChangeTime = now;
+		}
+		if (now - startTime >= MaxTuningMillis || (now - startTime >= MinTuningMillis && now - lastChangeTime >= StableMillis))
+		{
+			break;
+		}
+	}
+	const bool settled = (millis() - lastChangeTime >= StableMillis);
+
+	// Restore the original settings
+	standstillCurrentFraction = savedStandstillCurrentFraction;
+	currentScale = savedCurrentScale;
+	UpdateCurrent();
+	UpdateRegister(WriteGConf, savedGConf);
+	UpdateRegister(WritePwmConf, savedPwmConf);
+	Enable(wasEnabled);
+
+	if (!settled || pwmOfs == 0 || pwmOfs == PWM_AUTO_OFS_MASK)
+	{
+		reply.printf("Driver tuning did not settle, PWM offset %" PRIu32 ". Check the motor connections.", pwmOfs);
+		return GCodeResult::error;
+	}
+
+	const float resistance = ((float)pwmOfs * vin * 1000.0)/(374.0 * (float)motorCurrent);
+	reply.printf("Phase resistance %.2f ohms (PWM offset %" PRIu32 " at %.1fV and %" PRIu32 "mA)", (double)resistance, pwmOfs, (double)vin, motorCurrent);
+
+	const uint32_t pwmGrad = ((savedGConf & GCONF_STEALTHCHOP) != 0) ? (initialPwmAuto & PWM_AUTO_GRAD_MASK) >> PWM_AUTO_GRAD_SHIFT : 0;
+	if (pwmGrad != 0)
+	{
+		reply.catf(", PWM gradient %" PRIu32 " from previous moves", pwmGrad);
+	}
+
+	if (apply)
+	{
+		uint32_t newPwmConf = (savedPwmConf & ~PWMCONF_OFS_MASK) | pwmOfs;
+		if (pwmGrad != 0)
+		{
+			newPwmConf = (newPwmConf & ~PWMCONF_GRAD_MASK) | (pwmGrad << PWMCONF_GRAD_SHIFT);
+		}
+		UpdateRegister(WritePwmConf, newPwmConf);
+		reply.catf(", PWMCONF set to 0x%08" PRIx32, newPwmConf);
+	}
+	return GCodeResult::ok;
+}
+
+#endif
+
 // Enable or disable the driver
 void TmcDriverState::Enable(bool en) noexcept
 {
@@ -886,8 +1095,40 @@ void TmcDriverState::AppendDriverStatus(const StringRef& reply, bool clearGlobal
 	}
 	ResetLoadRegisters();
 
-	reply.catf(", mspos %u, reads %u, writes %u timeouts %u", (unsigned int)(readRegisters[ReadMsCnt] & 1023), numReads, numWrites, numTimeouts);
+	reply.catf(", mspos %u, reads %u, writes %u timeouts %u, restores %u",
+				(unsigned int)(readRegisters[ReadMsCnt] & 1023), numReads, numWrites, numTimeouts, numRegisterRestores);
 	numReads = numWrites = 0;
+
+	uint32_t totalInterval, maxInterval;
+	unsigned int numIntervals;
+	{
+		TaskCriticalSectionLocker lock;
+		totalInterval = totalStatusInterval;
+		maxInterval = maxStatusInterval;
+		numIntervals = numStatusIntervals;
+		totalStatusInterval = maxStatusInterval = 0;
+		numStatusIntervals = 0;
+	}
+	reply.catf(", status interval avg %" PRIu32 "us max %" PRIu32 "us",
+				(numIntervals == 0) ? 0 : StepTimer::TicksToIntegerMicroseconds(totalInterval/numIntervals), StepTimer::TicksToIntegerMicroseconds(maxInterval));
+
+	uint32_t totalCurrent;
+	unsigned int numCurrentSamples;
+	{
+		TaskCriticalSectionLocker lock;
+		totalCurrent = totalRunCurrent;
+		numCurrentSamples = numRunCurrentSamples;
+		totalRunCurrent = 0;
+		numRunCurrentSamples = 0;
+	}
+	if (numCurrentSamples != 0)
+	{
+		reply.catf(", avg run current %" PRIu32 "mA", totalCurrent/numCurrentSamples);
+	}
+	if (minCurrentScale < FullCurrentScale)
+	{
+		reply.catf(", load control min %u%%", (minCurrentScale * 100)/FullCurrentScale);
+	}
 	if (clearGlobalStats)
 	{
 		numTimeouts = 0;
@@ -905,6 +1146,82 @@ void TmcDriverState::SetStallDetectFilter(bool sgFilter) noexcept
 		writeRegisters[WriteCoolConf] &= ~COOLCONF_SGFILT;
 	}
 	newRegistersToUpdate |= 1u << WriteCoolConf;
+	WakeTmcTaskIfIdle();
+}
+
+// Set the lowest run current that load control may reduce the current to, as a percentage of the configured current. 100 disables load control.
+void TmcDriverState::SetLoadControlMinimumCurrent(unsigned int percent) noexcept
+{
+	minCurrentScale = (uint8_t)constrain<unsigned int>((percent * FullCurrentScale + 50)/100, 1, FullCurrentScale);
+	if (currentScale < minCurrentScale || minCurrentScale == FullCurrentScale)
+	{
+		currentScale = FullCurrentScale;
+		UpdateCurrent();
+	}
+}
+
+// Adjust the run current according to the stallGuard result. Called by the TMC task each time we read DRV_STATUS.
+// At standstill or at speeds too low for the stallGuard result to be valid we restore the full current, so that a move always starts with full torque available.
+void TmcDriverState::UpdateLoadControl(uint32_t drvStatus, uint32_t interval) noexcept
+{
+	const bool sgValid = (drvStatus & TMC_RR_STST) == 0 && interval != 0 && interval <= maxStallStepInterval;
+	if (sgValid)
+	{
+		// Record the run current actually in use, including any reduction made by coolStep in the driver
+		const uint32_t iRun = (writeRegisters[WriteIholdIrun] & IHOLDIRUN_IRUN_MASK) >> IHOLDIRUN_IRUN_SHIFT;
+		const uint32_t csActual = (drvStatus & TMC_RR_CSACTUAL_MASK) >> TMC_RR_CSACTUAL_SHIFT;
+		if (numRunCurrentSamples < 0xFFFF)
+		{
+			totalRunCurrent += (((motorCurrent * currentScale)/FullCurrentScale) * min<uint32_t>(csActual + 1, iRun + 1))/(iRun + 1);
+			++numRunCurrentSamples;
+		}
+	}
+
+	if (minCurrentScale >= FullCurrentScale
+#if SUPPORT_CLOSED_LOOP
+		|| ClosedLoop::GetClosedLoopEnabled(driverBit.LowestSetBit())
+#endif
+	   )
+	{
+		return;
+	}
+
+	unsigned int newScale = currentScale;
+	if (!sgValid)
+	{
+		newScale = FullCurrentScale;
+		lightLoadCount = 0;
+	}
+	else
+	{
+		const uint16_t sgResult = drvStatus & TMC_RR_SGRESULT;
+		if (sgResult < LoadControlHeavyLoadSg)
+		{
+			newScale = min<unsigned int>(currentScale + LoadControlIncreaseStep, FullCurrentScale);
+			lightLoadCount = 0;
+		}
+		else if (sgResult > LoadControlLightLoadSg)
+		{
+			if (++lightLoadCount >= LoadControlDecreaseCount)
+			{
+				lightLoadCount = 0;
+				if (currentScale > minCurrentScale)
+				{
+					newScale = currentScale - 1;
+				}
+			}
+		}
+		else
+		{
+			lightLoadCount = 0;
+		}
+	}
+
+	if (newScale != currentScale)
+	{
+		currentScale = newScale;
+		UpdateCurrent();
+	}
 }
 
 void TmcDriverState::SetStallMinimumStepsPerSecond(unsigned int stepsPerSecond) noexcept
@@ -940,24 +1257,52 @@ void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock) noexcept
 		newRegistersToUpdate = 0;
 	}
 
-	if (registersToUpdate == 0)
+	uint32_t writesPending = registersToUpdate;
+#if SUPPORT_CLOSED_LOOP && TMC_TYPE == 2160
+	// In closed loop mode the coil currents must reach the driver as soon as the control loop has calculated them, so XDIRECT takes priority over all other traffic.
+	// Other writes and the status reads get one transfer in every ClosedLoopOtherTrafficInterval so that they are not starved, and XDIRECT waits during that transfer.
+	if (ClosedLoop::GetClosedLoopEnabled(driverBit.LowestSetBit()))
 	{
-		// Read a register
+		if (++closedLoopTransferCount < ClosedLoopOtherTrafficInterval)
+		{
+			if ((writesPending & (1u << Write2160XDirect)) != 0)
+			{
+				writesPending = 1u << Write2160XDirect;
+			}
+		}
+		else
+		{
+			closedLoopTransferCount = 0;
+			writesPending &= ~(1u << Write2160XDirect);
+		}
+	}
+#endif
+
+	if (writesPending == 0)
+	{
+		// Read a register. We read DRV_STATUS in alternate transfers so that the stall and fault flags are fresh, and cycle through the other registers in between.
 		regIndexBeingUpdated = NoRegIndex;
-		if (regIndexRequested >= ReadSpecial)
+		if (regIndexRequested != ReadDrvStat)
 		{
-			regIndexRequested = 0;
+			regIndexRequested = ReadDrvStat;
 		}
 		else
 		{
-			++regIndexRequested;
-			if (regIndexRequested == ReadSpecial && specialReadRegisterNumber >= 0x80)
+			do
 			{
-				regIndexRequested = 0;
+				roundRobinReadIndex = (roundRobinReadIndex >= ReadVerify) ? 0 : roundRobinReadIndex + 1;
+			} while (roundRobinReadIndex == ReadDrvStat || (roundRobinReadIndex == ReadSpecial && specialReadRegisterNumber >= 0x80));
+			regIndexRequested = roundRobinReadIndex;
+			if (regIndexRequested == ReadVerify)
+			{
+				verifyIndex = (verifyIndex + 1) % NumVerifiedRegisters;
+				verifyExpectedValue = writeRegisters[VerifiedRegIndices[verifyIndex]];
 			}
 		}
 
-		sendDataBlock[0] = (regIndexRequested == ReadSpecial) ? specialReadRegisterNumber : ReadRegNumbers[regIndexRequested];
+		sendDataBlock[0] = (regIndexRequested == ReadSpecial) ? specialReadRegisterNumber
+							: (regIndexRequested == ReadVerify) ? WriteRegNumbers[VerifiedRegIndices[verifyIndex]]
+								: ReadRegNumbers[regIndexRequested];
 		sendDataBlock[1] = 0;
 		sendDataBlock[2] = 0;
 		sendDataBlock[3] = 0;
@@ -966,14 +1311,15 @@ void TmcDriverState::GetSpiCommand(uint8_t *sendDataBlock) noexcept
 	else
 	{
 		// Write a register
-		const size_t regNum = LowestSetBit(registersToUpdate);
+		const size_t regNum = LowestSetBit(writesPending);
 		regIndexBeingUpdated = regNum;
 		sendDataBlock[0] = ((regNum == WriteSpecial) ? specialWriteRegisterNumber : WriteRegNumbers[regNum]) | 0x80;
 		StoreBE32(sendDataBlock + 1, writeRegisters[regNum]);
 	}
 }
 
-void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
+// Process the data returned by the driver and return true if it included a new drive status
+bool TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 {
 	// If we wrote a register, mark it up to date
 	if (regIndexBeingUpdated <= NumWriteRegisters)
@@ -986,12 +1332,30 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 	const uint32_t interval = GetMoveInstance().GetStepInterval(axisNumber, microstepShiftFactor);		// get the full step interval
 
 	// If we read a register, update our copy
+	bool newStatus = false;
 	if (previousRegIndexRequested <= NumReadRegisters)
 	{
 		++numReads;
 		uint32_t regVal = LoadBE32(rcvDataBlock + 1);
 		if (previousRegIndexRequested == ReadDrvStat)
 		{
+			// Record how often we are reading the status
+			const uint32_t now = StepTimer::GetTimerTicks();
+			if (statusReadTimeValid && numStatusIntervals < 0xFFFF)
+			{
+				const uint32_t statusInterval = now - whenLastStatusRead;
+				totalStatusInterval += statusInterval;
+				++numStatusIntervals;
+				if (statusInterval > maxStatusInterval)
+				{
+					maxStatusInterval = statusInterval;
+				}
+			}
+			whenLastStatusRead = now;
+			statusReadTimeValid = true;
+
+			UpdateLoadControl(regVal, interval);
+
 			// We treat the DRV_STATUS register separately
 			if ((regVal & TMC_RR_STST) == 0)							// in standstill, SG_RESULT returns the chopper on-time instead
 			{
@@ -1019,6 +1383,7 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 			readRegisters[ReadDrvStat] = regVal;
 			regVal &= oldDrvStat;
 			accumulatedDriveStatus |= regVal;
+			newStatus = true;
 		}
 		else
 		{
@@ -1029,6 +1394,11 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 			}
 		}
 	}
+	else if (previousRegIndexRequested == ReadVerify)
+	{
+		++numReads;
+		VerifyRegister(LoadBE32(rcvDataBlock + 1));
+	}
 
 	// Deal with the stall status. Note that the TCoolThrs setting prevents us getting a DIAG output at low speeds, but it doesn't seem to affect the stall status
 	if (   (rcvDataBlock[0] & (1u << 2)) != 0							// if the status indicates stalled
@@ -1038,6 +1408,7 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 	{
 		readRegisters[ReadDrvStat] |= TMC_RR_SG;
 		accumulatedDriveStatus |= TMC_RR_SG;
+		Platform::OnDriverStall(driverBit.LowestSetBit());		// stop the motor now if we are doing sensorless homing
 	}
 	else
 	{
@@ -1045,6 +1416,7 @@ void TmcDriverState::TransferSucceeded(const uint8_t *rcvDataBlock) noexcept
 	}
 
 	previousRegIndexRequested = (regIndexBeingUpdated == NoRegIndex) ? regIndexRequested : NoRegIndex;
+	return newStatus;
 }
 
 void TmcDriverState::TransferFailed() noexcept
@@ -1052,6 +1424,44 @@ void TmcDriverState::TransferFailed() noexcept
 	regIndexRequested = previousRegIndexRequested = NoRegIndex;
 }
 
+// Compare a register we read back with the value we sent. If it differs then the driver has probably been reset by a supply glitch, so send all the registers again.
+void TmcDriverState::VerifyRegister(uint32_t regVal) noexcept
+{
+	const size_t regIndex = VerifiedRegIndices[verifyIndex];
+	if (   ((registersToUpdate | newRegistersToUpdate) & (1u << regIndex)) != 0
+		|| writeRegisters[regIndex] != verifyExpectedValue
+		|| specialWriteRegisterNumber == WriteRegNumbers[regIndex]
+	   )
+	{
+		return;													// the value changed since we asked to read it, or the user wrote the register directly
+	}
+
+	if (regVal == verifyExpectedValue)
+	{
+		verifyFailing = false;
+	}
+	else
+	{
+		WriteAll();
+		++numRegisterRestores;
+		if (!verifyFailing)										// while the driver is held in reset we keep rewriting it, but only report it once
+		{
+			verifyFailing = true;
+			registersRestored = true;
+		}
+	}
+}
+
+bool TmcDriverState::RegistersWereRestored() noexcept
+{
+	const bool ret = registersRestored;
+	if (ret)
+	{
+		registersRestored = false;
+	}
+	return ret;
+}
+
 // State structures for all drivers
 static TmcDriverState driverStates[MaxSmartDrivers];
 
@@ -1064,6 +1474,42 @@ static volatile uint8_t rcvData[5 * MaxSmartDrivers];
 
 static volatile DmaCallbackReason dmaFinishedReason;
 
+#if !SUPPORT_CLOSED_LOOP
+
+static volatile bool tmcTaskIdleWaiting = false;					// true when the TMC task is waiting between transfers because no motors are moving
+
+// Return true if no motors are moving and no drivers have registers waiting to be written, so that we only need to poll the drivers occasionally
+static bool DriversIdle() noexcept
+{
+	if (GetMoveInstance().HasExecutingMove())
+	{
+		return false;
+	}
+	for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
+	{
+		if (driverStates[drive].UpdatePending())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
+
+// Wake up the TMC task if it is waiting between transfers, because a register needs to be written
+static void WakeTmcTaskIfIdle() noexcept
+{
+#if !SUPPORT_CLOSED_LOOP
+	TaskCriticalSectionLocker lock;
+	if (tmcTaskIdleWaiting)
+	{
+		tmcTaskIdleWaiting = false;
+		tmcTask.Give();
+	}
+#endif
+}
+
 #if DEBUG_DRIVER_TIMEOUT
 static uint8_t lastFailureStatus;
 static uint8_t lastFailureTxTransferStatus;
@@ -1258,9 +1704,11 @@ void RxDmaCompleteCallback(CallbackParameter param, DmaCallbackReason reason) no
 #if SAME70
 	xdmac_channel_disable_interrupt(XDMAC, DmacChanTmcRx, 0xFFFFFFFF);
 #endif
+	ISR_PROFILE_ENTER();
 	dmaFinishedReason = reason;
 	fastDigitalWriteHigh(GlobalTmc51xxCSPin);			// set CS high
 	tmcTask.GiveFromISR();
+	ISR_PROFILE_EXIT(tmcDma);
 }
 
 extern "C" [[noreturn]] void TmcLoop(void *) noexcept
@@ -1289,7 +1737,10 @@ extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 				for (size_t drive = 0; drive < numTmc51xxDrivers; ++drive)
 				{
 					readPtr -= 5;
-					driverStates[drive].TransferSucceeded(const_cast<const uint8_t*>(readPtr));
+					if (driverStates[drive].TransferSucceeded(const_cast<const uint8_t*>(readPtr)))
+					{
+						DriverFaultMonitor::ProcessStatus(drive, SmartDrivers::GetStatus(drive, false, false));		// report faults as soon as we see them
+					}
 				}
 
 				if (driversState == DriversState::initialising)
@@ -1315,6 +1766,18 @@ extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 
 #if SUPPORT_CLOSED_LOOP
 			ClosedLoop::ControlLoop();	// Allow closed-loop to set the motor currents before we write
+#else
+			// If no motors are moving then there is no point in polling the drivers continuously, so wait until a write is needed or it is time to poll them again
+			if (driversState == DriversState::ready && DriversIdle())
+			{
+				{
+					TaskCriticalSectionLocker lock;
+					TaskBase::ClearNotifyCount();
+					tmcTaskIdleWaiting = true;
+				}
+				(void)TaskBase::Take(IdlePollInterval);
+				tmcTaskIdleWaiting = false;
+			}
 #endif
 			// Set up data to write. Driver 0 is the first in the SPI chain so we must write them in reverse order.
 			volatile uint8_t *writeBufPtr = sendData + 5 * numTmc51xxDrivers;
@@ -1328,6 +1791,7 @@ extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 			// On the SAME5x the only way I have found to get reliable transfers and no timeouts is to disable SPI, enable DMA, and then enable SPI.
 			// Enabling SPI before DMA sometimes results in timeouts.
 			// Unfortunately, when we disable SPI the SCLK line floats. Therefore we disable SPI for as little time as possible.
+			const LatencyHistograms::Timestamp probeStartTime = LatencyHistograms::GetTimestamp();
 			{
 				TaskCriticalSectionLocker lock;
 
@@ -1347,6 +1811,7 @@ extern "C" [[noreturn]] void TmcLoop(void *) noexcept
 			// Wait for the end-of-transfer interrupt
 			timedOut = !TaskBase::Take(TransferTimeout);
 			DisableEndOfTransferInterrupt();
+			LatencyHistograms::Record(LatencyProbe::tmcTransfer, probeStartTime);
 
 #if DEBUG_DRIVER_TIMEOUT
 			if (timedOut || dmaFinishedReason != DmaCallbackReason::complete)
@@ -1501,6 +1966,7 @@ void SmartDrivers::Init() noexcept
 
 	driversState = DriversState::noPower;
 	tmcTask.Create(TmcLoop, "TMC", nullptr, TaskPriority::TmcOpenLoop);
+	PriorityProfiles::SetTaskRole(tmcTask, PriorityProfiles::TaskRole::tmcOpenLoop);
 }
 
 // Shut down the drivers and stop any related interrupts
@@ -1510,6 +1976,7 @@ void SmartDrivers::Exit() noexcept
 #if !TMC51xx_USES_SERCOM
 	NVIC_DisableIRQ(TMC51xx_SPI_IRQn);
 #endif
+	PriorityProfiles::ForgetTask(tmcTask);
 	tmcTask.TerminateAndUnlink();
 	driversState = DriversState::shutDown;						// prevent Spin() calls from doing anything
 }
@@ -1522,6 +1989,12 @@ void SmartDrivers::SetCurrent(size_t driver, float current) noexcept
 	}
 }
 
+// Get the configured motor current in mA, which is the peak coil current in direct mode
+float SmartDrivers::GetCurrent(size_t driver) noexcept
+{
+	return (driver < numTmc51xxDrivers) ? driverStates[driver].GetCurrent() : 0.0;
+}
+
 void SmartDrivers::EnableDrive(size_t driver, bool en) noexcept
 {
 	if (driver < numTmc51xxDrivers)
@@ -1585,7 +2058,7 @@ bool SmartDrivers::SetDriverMode(size_t driver, unsigned int mode) noexcept
 	const bool ret = driver < numTmc51xxDrivers && driverStates[driver].SetDriverMode(mode);
 	if (ret && driver == 0)
 	{
-		tmcTask.SetPriority((mode == (unsigned int)DriverMode::direct) ? TaskPriority::TmcClosedLoop : TaskPriority::TmcOpenLoop);
+		PriorityProfiles::SetTaskRole(tmcTask, (mode == (unsigned int)DriverMode::direct) ? PriorityProfiles::TaskRole::tmcClosedLoop : PriorityProfiles::TaskRole::tmcOpenLoop);
 	}
 	return ret;
 #else
@@ -1650,6 +2123,14 @@ void SmartDrivers::SetStallMinimumStepsPerSecond(size_t driver, unsigned int ste
 	}
 }
 
+void SmartDrivers::SetLoadControlMinimumCurrent(size_t driver, unsigned int percent) noexcept
+{
+	if (driver < numTmc51xxDrivers)
+	{
+		driverStates[driver].SetLoadControlMinimumCurrent(percent);
+	}
+}
+
 void SmartDrivers::AppendStallConfig(size_t driver, const StringRef& reply) noexcept
 {
 	if (driver < numTmc51xxDrivers)
@@ -1719,6 +2200,20 @@ GCodeResult SmartDrivers::SetAnyRegister(size_t driver, const StringRef& reply,
 	return GCodeResult::error;
 }
 
+#if HAS_VOLTAGE_MONITOR
+
+GCodeResult SmartDrivers::MeasureMotor(size_t driver, bool apply, const StringRef& reply) noexcept
+{
+	if (driver < numTmc51xxDrivers && driversState == DriversState::ready)
+	{
+		return driverStates[driver].MeasureMotor(apply, reply);
+	}
+	reply.copy("Invalid smart driver number or drivers not powered");
+	return GCodeResult::error;
+}
+
+#endif
+
 StandardDriverStatus SmartDrivers::GetStatus(size_t driver, bool accumulated, bool clearAccumulated) noexcept
 {
 	StandardDriverStatus rslt;						// default constructor sets all bits to zero
@@ -1732,6 +2227,11 @@ StandardDriverStatus SmartDrivers::GetStatus(size_t driver, bool accumulated, bo
 	return rslt;
 }
 
+bool SmartDrivers::RegistersWereRestored(size_t driver) noexcept
+{
+	return driver < numTmc51xxDrivers && driverStates[driver].RegistersWereRestored();
+}
+
 #endif
 
 // End
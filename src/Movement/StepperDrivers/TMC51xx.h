@@ -22,6 +22,7 @@ namespace SmartDrivers
 	void TurnDriversOff() noexcept;
 
 	void SetCurrent(size_t driver, float current) noexcept;
+	float GetCurrent(size_t driver) noexcept;
 	void EnableDrive(size_t driver, bool en) noexcept;
 	bool SetMicrostepping(size_t drive, unsigned int microsteps, bool interpolation) noexcept;
 	unsigned int GetMicrostepping(size_t drive, bool& interpolation) noexcept;
@@ -35,6 +36,7 @@ namespace SmartDrivers
 	void SetStallThreshold(size_t driver, int sgThreshold) noexcept;
 	void SetStallFilter(size_t driver, bool sgFilter) noexcept;
 	void SetStallMinimumStepsPerSecond(size_t driver, unsigned int stepsPerSecond) noexcept;
+	void SetLoadControlMinimumCurrent(size_t driver, unsigned int percent) noexcept;	// 100 disables load control
 	void AppendStallConfig(size_t driver, const StringRef& reply) noexcept;
 	void AppendDriverStatus(size_t driver, const StringRef& reply) noexcept;
 	float GetStandstillCurrentPercent(size_t driver) noexcept;
@@ -44,6 +46,10 @@ namespace SmartDrivers
 	GCodeResult GetAnyRegister(size_t driver, const StringRef& reply, uint8_t regNum) noexcept;
 	GCodeResult SetAnyRegister(size_t driver, const StringRef& reply, uint8_t regNum, uint32_t regVal) noexcept;
 	StandardDriverStatus GetStatus(size_t driver, bool accumulated = false, bool clearAccumulated = false) noexcept;
+	bool RegistersWereRestored(size_t driver) noexcept;			// returns true once each time the driver was found to have lost its register values
+#if HAS_VOLTAGE_MONITOR
+	GCodeResult MeasureMotor(size_t driver, bool apply, const StringRef& reply) noexcept;	// measure the phase resistance and optionally set the stealthChop PWM starting values
+#endif
 };
 
 #endif
@@ -11,11 +11,15 @@
 #include <AnalogIn.h>
 #include <AnalogOut.h>
 #include <Movement/Move.h>
+#include <Movement/StepTimingStats.h>
 #include "Movement/StepperDrivers/TMC51xx.h"
 #include "Movement/StepperDrivers/TMC22xx.h"
+#include "Movement/StepperDrivers/DriverFaultMonitor.h"
 #include "AdcAveragingFilter.h"
 #include "Movement/StepTimer.h"
 #include <CAN/CanInterface.h>
+#include <CAN/StatusReport.h>
+#include <CAN/CanCapture.h>
 #include <CanMessageBuffer.h>
 #include "Tasks.h"
 #include "Heating/Heat.h"
@@ -25,10 +29,16 @@
 #include <CanMessageGenericTables.h>
 #include <CanMessageGenericParser.h>
 #include <Hardware/Devices.h>
+#include <Hardware/NvmStore.h>
 #include <Math/Isqrt.h>
+#include <Benchmarks.h>
+#include <DiagnosticsRecord.h>
+#include <DataCapture.h>
+#include <PriorityProfiles.h>
+#include <InputMonitors/InputMonitor.h>
 #include <Version.h>
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+#if SUPPORT_ACCELEROMETERS
 # include <CommandProcessing/AccelerometerHandler.h>
 #endif
 
@@ -40,6 +50,10 @@
 # include <Hardware/ATEIO/ExtendedAnalog.h>
 #endif
 
+#if defined(ATEIO) || defined(ATECM)
+# include <CommandProcessing/TestSequence.h>
+#endif
+
 #include <hpl_user_area.h>
 
 #if SAME5x
@@ -95,6 +109,9 @@ namespace Platform
 
 #if SUPPORT_DRIVERS
 	static constexpr float DefaultStepsPerMm = 80.0;
+	static constexpr uint32_t MaxPressureAdvanceSmoothingMillis = 200;
+	static constexpr float DefaultNonlinearExtrusionLimit = 0.2;
+	static constexpr float MaxNonlinearExtrusionLimit = 0.5;
 
 # if SUPPORT_SLOW_DRIVERS
 #  ifdef EXP1XD
@@ -132,11 +149,6 @@ namespace Platform
 #  endif
 # endif
 
-# if !SINGLE_DRIVER
-	uint32_t driveDriverBits[NumDrivers];
-	uint32_t allDriverBits = 0;
-# endif
-
 	static bool directions[NumDrivers];
 	static bool driverAtIdleCurrent[NumDrivers];
 	static int8_t enableValues[NumDrivers] = { 0 };
@@ -148,6 +160,8 @@ namespace Platform
 	static float stepsPerMm[NumDrivers];
 	static float motorCurrents[NumDrivers];
 	static float pressureAdvanceClocks[NumDrivers];
+	static float pressureAdvanceSmoothingClocks[NumDrivers];		// 0 if pressure advance smoothing is disabled
+	static NonlinearExtrusion nonlinearExtrusion[NumDrivers];
 	static float idleCurrentFactor[NumDrivers];
 
 	static void InternalEnableDrive(size_t driver);
@@ -177,8 +191,12 @@ namespace Platform
 	static MinCurMax mcuTemperature;
 	static float mcuTemperatureAdjust = 0.0;
 
-	static uint32_t lastPollTime;
 	static uint32_t lastFanCheckTime = 0;
+	static uint32_t bootTimes[3] = { 0 };								// when we finished the main initialisation, started the deferred initialisation and finished it
+	static void InitPeriodicJobs() noexcept;
+#if HAS_VOLTAGE_MONITOR || HAS_12V_MONITOR
+	static bool powered = false;
+#endif
 	static unsigned int heatTaskIdleTicks = 0;
 
 	static uint32_t whenLastCanMessageProcessed = 0;
@@ -207,8 +225,25 @@ namespace Platform
 # if HAS_SMART_DRIVERS
 	static DriversBitmap temperatureShutdownDrivers, temperatureWarningDrivers;
 	static uint8_t nextDriveToPoll;
-	static StandardDriverStatus lastEventStatus[NumDrivers];			// the status which we last reported as an event
-	static MillisTimer openLoadTimers[NumDrivers];
+#  if HAS_STALL_DETECT
+	static StandardDriverStatus lastPolledStatus[NumDrivers];			// the status when we last polled the driver, so that we can detect new stalls
+#  endif
+
+	// Driver thermal model. We estimate the temperature of each driver from its current and the board temperature, and reduce the current before the driver gets hot enough to shut down.
+	// The temperature rise per amp squared varies a lot between boards and mountings, so we correct it whenever the over-temperature warning flag disagrees with the estimate.
+	constexpr float DriverThermalTimeConstant = 30.0;				// seconds
+	constexpr float DriverWarningTemperature = 120.0;				// the temperature at which the drivers set the over-temperature warning flag
+	constexpr float DriverDeratingStartTemperature = 100.0;			// the estimated temperature at which we start to reduce the current
+	constexpr float DriverMinimumDeratingFactor = 0.5;				// the factor we reduce the current to when the estimated temperature reaches the warning temperature
+	constexpr float DefaultDriverThermalRise = 20.0;				// initial steady state temperature rise in degC per amp squared
+	constexpr float MinDriverThermalRise = 2.0;
+	constexpr float MaxDriverThermalRise = 200.0;
+	constexpr float DriverThermalRiseDecay = 0.95;					// factor we reduce the thermal rise by when the estimate is too high
+
+	static float driverTemperatureEstimates[NumDrivers];
+	static float driverThermalRise[NumDrivers];
+	static float driverDeratingFactors[NumDrivers];
+	static uint32_t whenLastThermalUpdate[NumDrivers];
 # else
 	static bool driverIsEnabled[NumDrivers] = { false };
 # endif
@@ -219,6 +254,9 @@ namespace Platform
 
 # if HAS_STALL_DETECT
 	DriversBitmap eventOnStallDrivers;
+	DriversBitmap stopOnStallDrivers;							// drivers whose motion we stop on this board when they stall, without waiting for the main board
+	volatile DriversBitmap stoppedOnStallDrivers;				// drivers that we stopped because they stalled, which we haven't reported yet
+	int32_t stallStopSteps[MaxSmartDrivers];					// how many steps each driver had taken in the move when we stopped it
 # endif
 #endif
 
@@ -237,6 +275,47 @@ namespace Platform
 	constexpr uint16_t driverPowerOnAdcReading = VinVoltageToAdcReading(10.0);			// minimum voltage at which we initialise the drivers
 	constexpr uint16_t driverPowerOffAdcReading = VinVoltageToAdcReading(9.5);			// voltages below this flag the drivers as unusable
 
+# if SUPPORT_POWER_FAIL_STOP
+	// We check every raw VIN reading against the power fail threshold instead of waiting for the averaged value, so that we stop the motors before the drivers brown out.
+	// We need a few consecutive low readings so that a noise spike doesn't stop a print, and we only arm after VIN has reached the driver power on level.
+	constexpr unsigned int PowerFailReadingsNeeded = 3;
+	static volatile bool powerFailArmed = false;
+	static unsigned int powerFailLowReadings = 0;
+	static uint32_t numPowerFails = 0;
+	static uint32_t lastPowerFailConversionTicks = 0;		// how long it took from the first low reading to stopping the motors
+
+	// This is called by the ADC ISR with every VIN reading
+	static void VinReadingCallback(CallbackParameter cp, uint16_t val) noexcept
+	{
+		if (val >= driverPowerOffAdcReading)
+		{
+			powerFailLowReadings = 0;
+			if (val >= driverPowerOnAdcReading && !powerFailArmed && moveInstance != nullptr && !moveInstance->IsPowerFailed())
+			{
+				powerFailArmed = true;
+			}
+		}
+		else if (powerFailArmed)
+		{
+			static uint32_t whenFirstLowReading;
+			if (powerFailLowReadings == 0)
+			{
+				whenFirstLowReading = StepTimer::GetTimerTicks();
+			}
+			++powerFailLowReadings;
+			if (powerFailLowReadings >= PowerFailReadingsNeeded)
+			{
+				powerFailArmed = false;
+				moveInstance->PowerFailStop();
+				lastPowerFailConversionTicks = StepTimer::GetTimerTicks() - whenFirstLowReading;
+				++numPowerFails;
+			}
+		}
+		vinFilter.CallbackFeedIntoFilter(cp, val);
+	}
+# endif
+
+
 #endif
 
 #if HAS_12V_MONITOR
@@ -256,7 +335,74 @@ namespace Platform
 #if HAS_SMART_DRIVERS
 	static void UpdateMotorCurrent(size_t driver)
 	{
-		SmartDrivers::SetCurrent(driver, (driverAtIdleCurrent[driver]) ? motorCurrents[driver] * idleCurrentFactor[driver] : motorCurrents[driver]);
+		const float current = (driverAtIdleCurrent[driver]) ? motorCurrents[driver] * idleCurrentFactor[driver] : motorCurrents[driver];
+		SmartDrivers::SetCurrent(driver, current * driverDeratingFactors[driver]);
+	}
+
+	static void RaiseDriverWarningEvent(size_t driver, uint16_t status, const char *format, ...) noexcept
+	{
+		va_list vargs;
+		va_start(vargs, format);
+		CanInterface::RaiseEvent(EventType::driver_warning, status, driver, format, vargs);
+		va_end(vargs);
+	}
+
+	// Update the estimated temperature of a driver and the current derating. Called each time we poll the driver status.
+	static void UpdateDriverThermalModel(size_t driver, StandardDriverStatus stat) noexcept
+	{
+		const uint32_t now = millis();
+		const float dt = (float)(now - whenLastThermalUpdate[driver]) * 0.001;
+		whenLastThermalUpdate[driver] = now;
+
+		// The power dissipated is proportional to the square of the current actually delivered, which is 0 if the driver is disabled
+		float ampsSquared = 0.0;
+		if (driverStates[driver].mode != DriverStateControl::driverDisabled)
+		{
+			const float amps = ((driverAtIdleCurrent[driver]) ? motorCurrents[driver] * idleCurrentFactor[driver] : motorCurrents[driver]) * driverDeratingFactors[driver] * 0.001;
+			ampsSquared = fsquare(amps);
+		}
+
+		const float boardTemperature = mcuTemperature.current;
+		const float steadyStateTemperature = boardTemperature + driverThermalRise[driver] * ampsSquared;
+		float& estimate = driverTemperatureEstimates[driver];
+		estimate += (steadyStateTemperature - estimate) * min<float>(dt/DriverThermalTimeConstant, 1.0);
+
+		// Correct the model if the driver flags disagree with it
+		if (stat.ot || stat.otpw)
+		{
+			if (estimate < DriverWarningTemperature)
+			{
+				if (ampsSquared > 0.0)
+				{
+					driverThermalRise[driver] = constrain<float>((DriverWarningTemperature - boardTemperature)/ampsSquared, driverThermalRise[driver], MaxDriverThermalRise);
+				}
+				estimate = DriverWarningTemperature;
+			}
+		}
+		else if (estimate > DriverWarningTemperature)
+		{
+			driverThermalRise[driver] = max<float>(driverThermalRise[driver] * DriverThermalRiseDecay, MinDriverThermalRise);
+			estimate = DriverWarningTemperature;
+		}
+
+		// Derate the current linearly between the start temperature and the warning temperature
+		const float newFactor = (estimate <= DriverDeratingStartTemperature) ? 1.0
+								: max<float>(1.0 - (1.0 - DriverMinimumDeratingFactor) * (estimate - DriverDeratingStartTemperature)/(DriverWarningTemperature - DriverDeratingStartTemperature),
+												DriverMinimumDeratingFactor);
+		const float oldFactor = driverDeratingFactors[driver];
+		if (fabsf(newFactor - oldFactor) >= 0.02 || (newFactor == 1.0 && oldFactor != 1.0))
+		{
+			driverDeratingFactors[driver] = newFactor;
+			UpdateMotorCurrent(driver);
+			if (oldFactor == 1.0)
+			{
+				RaiseDriverWarningEvent(driver, stat.AsU16(), "current reduced to %u%% because estimated driver temperature is %.0fC", (unsigned int)lrintf(newFactor * 100.0), (double)estimate);
+			}
+			else if (newFactor == 1.0)
+			{
+				RaiseDriverWarningEvent(driver, stat.AsU16(), "current restored to 100%%");
+			}
+		}
 	}
 #endif
 
@@ -483,7 +629,7 @@ namespace Platform
 #else
 		const AdcInput adcChan = PinToAdcChannel(pin);
 #endif
-		AnalogIn::EnableChannel(adcChan, thermistorFilters[filterIndex].CallbackFeedIntoFilter, CallbackParameter(&thermistorFilters[filterIndex]), 1, useAlternateAdc);
+		AnalogIn::EnableChannel(adcChan, thermistorFilters[filterIndex].CallbackFeedIntoFilter, CallbackParameter(&thermistorFilters[filterIndex]), ThermistorAdcCallInterval, useAlternateAdc);
 	}
 #endif
 
@@ -518,7 +664,11 @@ namespace Platform
 
 		vinFilter.Init(0);
 		IoPort::SetPinMode(VinMonitorPin, AIN);
+# if SUPPORT_POWER_FAIL_STOP
+		AnalogIn::EnableChannel(PinToAdcChannel(VinMonitorPin), VinReadingCallback, CallbackParameter(&vinFilter), 1, false);
+# else
 		AnalogIn::EnableChannel(PinToAdcChannel(VinMonitorPin), vinFilter.CallbackFeedIntoFilter, CallbackParameter(&vinFilter), 1, false);
+# endif
 #endif
 	}
 
@@ -592,6 +742,7 @@ void Platform::Init()
 #endif
 
 	InitLeds();
+	NvmStore::Init();
 
 #if SUPPORT_CLOSED_LOOP
 	ClosedLoop::Init();
@@ -827,23 +978,28 @@ void Platform::Init()
 #  endif
 # endif
 
-# if !SINGLE_DRIVER
-		const uint32_t driverBit = 1u << (StepPins[i] & 31);
-		driveDriverBits[i] = driverBit;
-		allDriverBits |= driverBit;
-# endif
 		stepsPerMm[i] = DefaultStepsPerMm;
 		directions[i] = true;
 		driverAtIdleCurrent[i] = false;
 		idleCurrentFactor[i] = 0.3;
 		motorCurrents[i] = 0.0;
-		pressureAdvanceClocks[i] = 0.0;
+# if HAS_SMART_DRIVERS
+		driverTemperatureEstimates[i] = 25.0;
+		driverThermalRise[i] = DefaultDriverThermalRise;
+		driverDeratingFactors[i] = 1.0;
+		whenLastThermalUpdate[i] = millis();
+# endif
+		pressureAdvanceClocks[i] = pressureAdvanceSmoothingClocks[i] = 0.0;
+		nonlinearExtrusion[i].A = nonlinearExtrusion[i].B = 0.0;
+		nonlinearExtrusion[i].limit = DefaultNonlinearExtrusionLimit;
 		driverStates[i] = DriverStateControl(DriverStateControl::driverDisabled);
 		// We can't set microstepping here because moveInstance hasn't been created yet
 	}
 
 # if HAS_STALL_DETECT
 	eventOnStallDrivers.Clear();
+	stopOnStallDrivers.Clear();
+	stoppedOnStallDrivers.Clear();
 #endif
 
 # if HAS_SMART_DRIVERS && HAS_VOLTAGE_MONITOR
@@ -878,17 +1034,26 @@ void Platform::Init()
 
 	InitialiseInterrupts();
 
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
+	CanInterface::Init(GetCanAddress(), UseAlternateCanPins, true);
+	InitPeriodicJobs();
+	bootTimes[0] = millis();
+}
+
+// Initialise the devices that are slow to initialise and that the main board doesn't need to know about when we announce ourselves.
+// This is called after the other subsystems have been initialised, so the publish task can announce us while we are doing this.
+// CAN commands are processed by the main task, so none will be processed until this has finished.
+void Platform::InitDeferred() noexcept
+{
+	bootTimes[1] = millis();
+#if SUPPORT_ACCELEROMETERS
 # ifdef TOOL1LC
 	if (boardVariant != 0)
 # endif
 	{
-		AccelerometerHandler::Init();
+		AccelerometerHandler::Init();					// this probes the I2C and SPI buses
 	}
 #endif
-
-	CanInterface::Init(GetCanAddress(), UseAlternateCanPins, true);
-	lastPollTime = millis();
+	bootTimes[2] = millis();
 }
 
 // Perform minimal initialisation prior to updating the bootloader
@@ -900,200 +1065,313 @@ void Platform::InitMinimal()
 	CanInterface::Init(GetCanAddress(), UseAlternateCanPins, false);
 }
 
-void Platform::Spin()
+#if SUPPORT_DRIVERS
+
+// Raise a motion event with some text
+static void RaiseMotionEvent(const char *format, ...) noexcept
 {
-#if HAS_VOLTAGE_MONITOR || HAS_12V_MONITOR
-	static bool powered = false;
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(EventType::driver_warning, 0, 0, format, vargs);
+	va_end(vargs);
+}
+
 #endif
 
-	if (deferredCommand != DeferredCommand::none && millis() - whenDeferredCommandRequested > 200)
+// Raise an event to report an emergency stop
+static void RaiseEmergencyStopEvent(const char *format, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(EventType::driver_warning, 0, 0, format, vargs);
+	va_end(vargs);
+}
+
+namespace Platform
+{
+	static volatile bool emergencyStopped = false;
+	static volatile bool emergencyStopReportDue = false;
+	static bool emergencyStopFromInput;
+	static uint32_t emergencyStopDriverTicks;				// how long it took from the trigger to disabling the drivers, in step clocks
+
+	// Disable the drivers by writing their enable pins directly instead of waiting for the tasks that normally control them, and get the safety monitor to turn the heaters off.
+	// This is safe to call from an ISR with priority no higher than the step ISR. We still reset afterwards to clean up everything else.
+	static void DisableOutputsNow(StepTimer::Ticks whenTriggered, bool fromInput) noexcept
 	{
-		switch (deferredCommand)
 		{
-		case DeferredCommand::firmwareUpdate:
-			DoFirmwareUpdate();
-			break;
+			AtomicCriticalSectionLocker lock;				// the CAN receiver task and an input ISR may both call this
+			if (emergencyStopped)
+			{
+				return;
+			}
+			emergencyStopped = true;
+		}
+		emergencyStopFromInput = fromInput;
 
-		case DeferredCommand::bootloaderUpdate:
-			DoBootloadereUpdate();
-			break;
+#if SUPPORT_DRIVERS
+# if SUPPORT_POWER_FAIL_STOP
+		if (moveInstance != nullptr)
+		{
+			moveInstance->PowerFailStop();					// stop generating steps
+		}
+# endif
+# if SUPPORT_TMC51xx || SUPPORT_TMC2160
+		IoPort::WriteDigital(GlobalTmc51xxEnablePin, true);
+# endif
+# if SUPPORT_TMC22xx
+		IoPort::WriteDigital(GlobalTmc22xxEnablePin, true);
+# endif
+		for (size_t driver = 0; driver < NumDrivers; ++driver)
+		{
+			brakePorts[driver].WriteDigital(false);			// de-energise the brake solenoid to apply the brake
+# if !HAS_SMART_DRIVERS
+			if (enableValues[driver] >= 0)
+			{
+				digitalWrite(EnablePins[driver], enableValues[driver] == 0);
+#  if DIFFERENTIAL_STEPPER_OUTPUTS
+				digitalWrite(InvertedEnablePins[driver], enableValues[driver] != 0);
+#  endif
+			}
+# endif
+		}
+#endif
+		emergencyStopDriverTicks = StepTimer::GetTimerTicks() - whenTriggered;
+		Heat::EmergencyStop(whenTriggered);
+		emergencyStopReportDue = true;
 
-		case DeferredCommand::reset:
-			ShutdownAndReset();
-			break;
+		whenDeferredCommandRequested = millis();
+		deferredCommand = DeferredCommand::reset;
+	}
 
-		case DeferredCommand::testWatchdog:
-			deliberateError = true;
-			SysTick->CTRL &= ~(SysTick_CTRL_TICKINT_Msk);							// disable the system tick interrupt so that we get a watchdog timeout reset
-			break;
+	// Report how long the emergency stop took, once the heaters are off. We report it before the reset because nothing survives the reset.
+	static void ReportEmergencyStop() noexcept
+	{
+		uint32_t heaterTicks;
+		if (Heat::GetEmergencyStopLatency(heaterTicks))
+		{
+			emergencyStopReportDue = false;
+			RaiseEmergencyStopEvent("Emergency stop from %s: drivers disabled after %" PRIu32 "us, heaters after %" PRIu32 "us",
+									(emergencyStopFromInput) ? "input" : "CAN message",
+									(emergencyStopDriverTicks * 1000u)/(StepTimer::StepClockRate/1000u), (heaterTicks * 1000u)/(StepTimer::StepClockRate/1000u));
+		}
+	}
+}
 
-		case DeferredCommand::testDivideByZero:
-			deliberateError = true;
-			(void)Tasks::DoDivide(1, 0);
-			__ISB();
-			deliberateError = false;
-			break;
+#if HAS_SMART_DRIVERS && HAS_STALL_DETECT
 
-		case DeferredCommand::testUnalignedMemoryAccess:
-			deliberateError = true;
-			(void)Tasks::DoMemoryRead(reinterpret_cast<const uint32_t*>(HSRAM_ADDR + 1));
-			__ISB();
-			deliberateError = false;
-			break;
+// Raise a driver stall event with some text
+static void RaiseStallEvent(size_t driver, const char *format, ...) noexcept
+{
+	va_list vargs;
+	va_start(vargs, format);
+	CanInterface::RaiseEvent(EventType::driver_stall, 0, driver, format, vargs);
+	va_end(vargs);
+}
 
-		case DeferredCommand::testBadMemoryAccess:
-			deliberateError = true;
-			(void)Tasks::DoMemoryRead(reinterpret_cast<const uint32_t*>(0x30000000));	// 0x30000000 is invalid on both the SAME5x and the SAMC21
-			__ISB();
-			deliberateError = false;
-			break;
+#endif
 
-		default:
-			break;
-		}
-	}
+namespace Platform
+{
+	// Periodic jobs run by Spin. Each job has a period in milliseconds and is due again one period after it was last due.
+	// When the board is idle we use the longer idle period, so that the main task wakes up less often.
+	// We record how late each job was run so that we can see whether anything is holding up the main task.
+	struct PeriodicJob
+	{
+		void (*function)(uint32_t now) noexcept;
+		const char *name;
+		uint32_t period;
+		uint32_t idlePeriod;
+		uint32_t nextDue;
+		uint32_t maxLateness;
+		unsigned int overruns;											// how many times the job was run more than one period late
+	};
 
-	SpinMinimal();				// update the activity LED and currentVin
+	// Read the supply voltages and tell the drivers whether they are powered
+	static void CheckPowerJob(uint32_t now) noexcept
+	{
+		SpinMinimal();				// update the activity LED and currentVin
 
 #if HAS_VOLTAGE_MONITOR
-	const float voltsVin = GetCurrentVinVoltage();
+		const float voltsVin = GetCurrentVinVoltage();
 #endif
 
 #if HAS_12V_MONITOR
-	currentV12 = v12Filter.GetSum()/v12Filter.NumAveraged();
-	if (v12Filter.IsValid())
-	{
-		if (currentV12 < lowestV12)
+		currentV12 = v12Filter.GetSum()/v12Filter.NumAveraged();
+		if (v12Filter.IsValid())
+		{
+			if (currentV12 < lowestV12)
+			{
+				lowestV12 = currentV12;
+			}
+			if (currentV12 > highestV12)
+			{
+				highestV12 = currentV12;
+			}
+		}
+
+		const float volts12 = (currentV12 * V12MonitorVoltageRange)/(1u << AnalogIn::AdcBits);
+		if (!powered && voltsVin >= 10.5 && volts12 >= 10.5)
 		{
-			lowestV12 = currentV12;
+			powered = true;
+
+# if SUPPORT_POWER_FAIL_STOP
+			if (moveInstance != nullptr)
+			{
+				moveInstance->PowerRestored();				// power has been restored after a power fail stop, so allow motion again
+			}
+# endif
 		}
-		if (currentV12 > highestV12)
+		else if (powered && (voltsVin < 10.0 || volts12 < 10.0))
 		{
-			highestV12 = currentV12;
+			powered = false;
+			++numUnderVoltageEvents;
 		}
-	}
-
-	const float volts12 = (currentV12 * V12MonitorVoltageRange)/(1u << AnalogIn::AdcBits);
-	if (!powered && voltsVin >= 10.5 && volts12 >= 10.5)
-	{
-		powered = true;
-	}
-	else if (powered && (voltsVin < 10.0 || volts12 < 10.0))
-	{
-		powered = false;
-		++numUnderVoltageEvents;
-	}
 #elif HAS_VOLTAGE_MONITOR
 
-	if (!powered && voltsVin >= 10.5)
-	{
-		powered = true;
-	}
-	else if (powered && voltsVin < 10.0)
-	{
-		powered = false;
-	}
+		if (!powered && voltsVin >= 10.5)
+		{
+			powered = true;
+
+# if SUPPORT_POWER_FAIL_STOP
+			if (moveInstance != nullptr)
+			{
+				moveInstance->PowerRestored();				// power has been restored after a power fail stop, so allow motion again
+			}
+# endif
+		}
+		else if (powered && voltsVin < 10.0)
+		{
+			powered = false;
+		}
 #endif
 
 #if HAS_SMART_DRIVERS
-	SmartDrivers::Spin(powered);
+		SmartDrivers::Spin(powered);
+#endif
+	}
 
-	// Check one TMC driver for warnings and errors
-	if (enableValues[nextDriveToPoll] >= 0)				// don't poll driver if it is flagged "no poll"
-	{
-		StandardDriverStatus stat = SmartDrivers::GetStatus(nextDriveToPoll, true, true);
-		const DriversBitmap mask = DriversBitmap::MakeFromBits(nextDriveToPoll);
+#if HAS_SMART_DRIVERS
 
-		// First set the driver temperature status for the temperature sensor code
-		if (stat.ot)
-		{
-			temperatureShutdownDrivers |= mask;
-		}
-		else
+	// Check one TMC driver for temperature warnings and stalls
+	static void PollDriverJob(uint32_t now) noexcept
+	{
+		if (enableValues[nextDriveToPoll] >= 0)				// don't poll driver if it is flagged "no poll"
 		{
-			if (stat.otpw)
+			StandardDriverStatus stat = SmartDrivers::GetStatus(nextDriveToPoll, true, true);
+			const DriversBitmap mask = DriversBitmap::MakeFromBits(nextDriveToPoll);
+
+			// First set the driver temperature status for the temperature sensor code
+			if (stat.ot)
 			{
-				temperatureWarningDrivers |= mask;
+				temperatureShutdownDrivers |= mask;
 			}
 			else
 			{
-				temperatureWarningDrivers &= ~mask;
+				if (stat.otpw)
+				{
+					temperatureWarningDrivers |= mask;
+				}
+				else
+				{
+					temperatureWarningDrivers &= ~mask;
+				}
+				temperatureShutdownDrivers &= ~mask;
 			}
-			temperatureShutdownDrivers &= ~mask;
-		}
+			UpdateDriverThermalModel(nextDriveToPoll, stat);
 
-		// Deal with the open load bits
-		// The driver often produces a transient open-load error, especially in stealthchop mode, so we require the condition to persist before we report it.
-		// So clear them unless they have been active for the minimum time.
-		MillisTimer& timer = openLoadTimers[nextDriveToPoll];
-		if (stat.IsAnyOpenLoadBitSet())
-		{
-			if (timer.IsRunning())
+			// Driver errors and warnings are reported by DriverFaultMonitor when the drivers task reads the status
+
+# if HAS_STALL_DETECT
+			const StandardDriverStatus oldStatus = lastPolledStatus[nextDriveToPoll];
+			lastPolledStatus[nextDriveToPoll] = stat;
+			if (stat.HasNewStallSince(oldStatus))
 			{
-				if (!timer.Check(OpenLoadTimeout))
+				OnDriverStall(nextDriveToPoll);						// in case the drivers task didn't stop the motor already
+				if (eventOnStallDrivers.Intersects(mask))
 				{
-					stat.ClearOpenLoadBits();
+					if (stoppedOnStallDrivers.Intersects(mask))
+					{
+						stoppedOnStallDrivers &= ~mask;
+						RaiseStallEvent(nextDriveToPoll, "stopped after %" PRIi32 " steps", stallStopSteps[nextDriveToPoll]);
+					}
+					else
+					{
+						CanInterface::RaiseEvent(EventType::driver_stall, 0, nextDriveToPoll, "", va_list());
+					}
 				}
 			}
-			else
+# endif
+
+# if SUPPORT_CLOSED_LOOP
+			float shiftSteps;
+			uint32_t whenShifted;
+			if (ClosedLoop::GetLayerShift(nextDriveToPoll, shiftSteps, whenShifted))
 			{
-				timer.Start();
-				stat.ClearOpenLoadBits();
+				RaiseDriverWarningEvent(nextDriveToPoll, 0, "layer shift of %.2f steps detected %" PRIu32 "ms ago", (double)shiftSteps, millis() - whenShifted);
 			}
-		}
-		else
-		{
-			timer.Stop();
-		}
+# endif
 
-		const StandardDriverStatus oldStatus = lastEventStatus[nextDriveToPoll];
-		lastEventStatus[nextDriveToPoll] = stat;
-		if (stat.HasNewErrorSince(oldStatus))
-		{
-			// It's a new error
-			CanInterface::RaiseEvent(EventType::driver_error, stat.AsU16(), nextDriveToPoll, "", va_list());
+# if SUPPORT_TMC51xx || SUPPORT_TMC2160
+			if (SmartDrivers::RegistersWereRestored(nextDriveToPoll))
+			{
+				RaiseDriverWarningEvent(nextDriveToPoll, 0, "driver lost its settings, probably due to a supply glitch, so they were sent again");
+			}
+# endif
 		}
-		else if (stat.HasNewWarningSince(oldStatus))
+
+		// Advance drive number ready for next time
+		++nextDriveToPoll;
+		if (nextDriveToPoll == MaxSmartDrivers)
 		{
-			// It's a new warning
-			CanInterface::RaiseEvent(EventType::driver_warning, stat.AsU16(), nextDriveToPoll, "", va_list());
+			nextDriveToPoll = 0;
 		}
+	}
 
-# if HAS_STALL_DETECT
-		if (stat.HasNewStallSince(oldStatus) && eventOnStallDrivers.Intersects(mask))
+#endif
+
+	// Thermostatically-controlled fans
+	static void CheckFansJob(uint32_t now) noexcept
+	{
+		const bool checkSensors = (now - lastFanCheckTime >= FanCheckInterval);
+		(void)FansManager::CheckFans(checkSensors);
+		if (checkSensors)
 		{
-			CanInterface::RaiseEvent(EventType::driver_stall, 0, nextDriveToPoll, "", va_list());
+			lastFanCheckTime = now;
 		}
-# endif
 	}
 
-	// Advance drive number ready for next time
-	++nextDriveToPoll;
-	if (nextDriveToPoll == MaxSmartDrivers)
+#if SUPPORT_DRIVERS
+	// Tell the main board if we had to stop because the next move didn't arrive in time.
+	// There is no event type for this, so we report it as a driver warning with no status bits set.
+	static void CheckMotionJob(uint32_t now) noexcept
 	{
-		nextDriveToPoll = 0;
+		int32_t slackClocks;
+		uint32_t stopClocks;
+		if (moveInstance != nullptr && moveInstance->GetNewUnderrunStop(slackClocks, stopClocks))
+		{
+			RaiseMotionEvent("move underrun, stopping %.1fms before the end of the last move and taking %.1fms to stop",
+								(double)((float)slackClocks * StepTimer::StepClocksToMillis), (double)((float)stopClocks * StepTimer::StepClocksToMillis));
+		}
 	}
 #endif
 
-	// Thermostatically-controlled fans (do this after getting TMC driver status)
-	const uint32_t now = millis();
-	const bool checkSensors = (now - lastFanCheckTime >= FanCheckInterval);
-	(void)FansManager::CheckFans(checkSensors);
-	if (checkSensors)
+	// Update the Status LED. Flash it quickly (8Hz) if we are not synced to the master, else flash in sync with the master (about 2Hz).
+	static void UpdateStatusLedJob(uint32_t now) noexcept
 	{
-		lastFanCheckTime = now;
+		WriteLed(0,
+					(StepTimer::IsSynced())
+						? (StepTimer::GetMasterTime() & (1u << 19)) != 0
+							: (StepTimer::GetTimerTicks() & (1u << 17)) != 0
+			    );
 	}
 
-	// Update the Status LED. Flash it quickly (8Hz) if we are not synced to the master, else flash in sync with the master (about 2Hz).
-	WriteLed(0,
-				(StepTimer::IsSynced())
-					? (StepTimer::GetMasterTime() & (1u << 19)) != 0
-						: (StepTimer::GetTimerTicks() & (1u << 17)) != 0
-		    );
-
-	if (now - lastPollTime > 2000)
+	// Update the MCU temperature and do other infrequent checks
+	static void SlowPollJob(uint32_t now) noexcept
 	{
-		lastPollTime = now;
+		if (moveInstance != nullptr)
+		{
+			moveInstance->SampleHiccups();						// keep a short hiccup history for the software reset data
+		}
 
 		// Get the chip temperature
 #if SAME5x
@@ -1149,10 +1427,10 @@ void Platform::Spin()
 			moveInstance->Diagnostics(AuxMessage);
 #elif 0
 #elif 0
-//			uint32_t conversionsStarted, conversionsCompleted;
-//			AnalogIn::GetDebugInfo(conversionsStarted, conversionsCompleted);
+	//			uint32_t conversionsStarted, conversionsCompleted;
+	//			AnalogIn::GetDebugInfo(conversionsStarted, conversionsCompleted);
 			debugPrintf(
-//							"Conv %u %u"
+	//							"Conv %u %u"
 						"Addr %u"
 #if HAS_12V_MONITOR
 						" %.1fV %.1fV"
@@ -1163,13 +1441,13 @@ void Platform::Spin()
 #if HAS_VREF_MONITOR
 						" %u %u"
 #endif
-//						", ptat %d, ctat %d"
+	//						", ptat %d, ctat %d"
 #if HAS_SMART_DRIVERS
 						", stat %08" PRIx32 " %08" PRIx32 " %08" PRIx32
 #endif
 						,
-//							(unsigned int)conversionsStarted, (unsigned int)conversionsCompleted,
-//							StepTimer::GetInterruptClocks(),
+	//							(unsigned int)conversionsStarted, (unsigned int)conversionsCompleted,
+	//							StepTimer::GetInterruptClocks(),
 						(unsigned int)CanInterface::GetCanAddress(),
 #if HAS_12V_MONITOR
 						(double)voltsVin, (double)volts12,
@@ -1180,11 +1458,11 @@ void Platform::Spin()
 #if HAS_VREF_MONITOR
 						, (unsigned int)thermistorFilters[VrefFilterIndex].GetSum(), (unsigned int)thermistorFilters[VssaFilterIndex].GetSum()
 #endif
-//						, tp_result, tc_result
+	//						, tp_result, tc_result
 #if HAS_SMART_DRIVERS
 						, SmartDrivers::GetAccumulatedStatus(0, 0), SmartDrivers::GetAccumulatedStatus(1, 0), SmartDrivers::GetAccumulatedStatus(2, 0)
 #endif
-//							, SmartDrivers::GetLiveStatus(0), SmartDrivers::GetLiveStatus(1), SmartDrivers::GetLiveStatus(2)
+	//							, SmartDrivers::GetLiveStatus(0), SmartDrivers::GetLiveStatus(1), SmartDrivers::GetLiveStatus(2)
 					   );
 #endif
 		}
@@ -1209,13 +1487,133 @@ void Platform::Spin()
 				moveInstance->Diagnostics(reply.GetRef());
 				debugPrintf("%s\n", reply.c_str());
 				//moveInstance->DebugPrintCdda();
-#if SUPPORT_I2C_SENSORS && SUPPORT_LIS3DH
-				debugPrintf("LIS3DH detected: %s", AccelerometerHandler::IsPresent() ? "yes" : "no");
+#if SUPPORT_ACCELEROMETERS
+				debugPrintf("Accelerometer detected: %s", AccelerometerHandler::IsPresent() ? "yes" : "no");
 #endif
 			}
 		}
 #endif
 	}
+
+	static PeriodicJob periodicJobs[] =
+	{
+		{ CheckPowerJob,		"power",		2,		10,		0, 0, 0 },
+#if HAS_SMART_DRIVERS
+		{ PollDriverJob,		"drivers",		4,		20,		0, 0, 0 },
+#endif
+		{ CheckFansJob,			"fans",			10,		50,		0, 0, 0 },
+#if SUPPORT_DRIVERS
+		{ CheckMotionJob,		"motion",		10,		50,		0, 0, 0 },
+#endif
+		{ UpdateStatusLedJob,	"LED",			20,		20,		0, 0, 0 },
+		{ SlowPollJob,			"slow poll",	2000,	2000,	0, 0, 0 },
+	};
+
+	static void InitPeriodicJobs() noexcept
+	{
+		const uint32_t now = millis();
+		for (PeriodicJob& job : periodicJobs)
+		{
+			job.nextDue = now + job.period;
+		}
+	}
+}	// end namespace Platform
+
+// Run any deferred command and the periodic jobs that are due. Return the number of milliseconds until the next job is due, so that the caller can sleep until then.
+uint32_t Platform::Spin()
+{
+	if (emergencyStopReportDue)
+	{
+		ReportEmergencyStop();
+	}
+
+	if (deferredCommand != DeferredCommand::none && millis() - whenDeferredCommandRequested > 200)
+	{
+		switch (deferredCommand)
+		{
+		case DeferredCommand::firmwareUpdate:
+			DoFirmwareUpdate();
+			break;
+
+		case DeferredCommand::bootloaderUpdate:
+			DoBootloadereUpdate();
+			break;
+
+		case DeferredCommand::reset:
+			ShutdownAndReset();
+			break;
+
+		case DeferredCommand::testWatchdog:
+			deliberateError = true;
+			SysTick->CTRL &= ~(SysTick_CTRL_TICKINT_Msk);							// disable the system tick interrupt so that we get a watchdog timeout reset
+			break;
+
+		case DeferredCommand::testDivideByZero:
+			deliberateError = true;
+			(void)Tasks::DoDivide(1, 0);
+			__ISB();
+			deliberateError = false;
+			break;
+
+		case DeferredCommand::testUnalignedMemoryAccess:
+			deliberateError = true;
+			(void)Tasks::DoMemoryRead(reinterpret_cast<const uint32_t*>(HSRAM_ADDR + 1));
+			__ISB();
+			deliberateError = false;
+			break;
+
+		case DeferredCommand::testBadMemoryAccess:
+			deliberateError = true;
+			(void)Tasks::DoMemoryRead(reinterpret_cast<const uint32_t*>(0x30000000));	// 0x30000000 is invalid on both the SAME5x and the SAMC21
+			__ISB();
+			deliberateError = false;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	// The board is idle if it isn't executing a move and no heaters are on
+	const bool idle =
+#if SUPPORT_DRIVERS
+						!moveInstance->HasExecutingMove() &&
+#endif
+						!Heat::AnyHeaterActive();
+
+	const uint32_t now = millis();
+	for (PeriodicJob& job : periodicJobs)
+	{
+		const uint32_t lateness = now - job.nextDue;
+		if ((int32_t)lateness >= 0)
+		{
+			const uint32_t period = (idle) ? job.idlePeriod : job.period;
+			if (lateness > job.maxLateness)
+			{
+				job.maxLateness = lateness;
+			}
+			if (lateness >= period)
+			{
+				++job.overruns;
+				job.nextDue = now;										// don't try to catch up on the runs we missed
+			}
+			job.nextDue += period;
+			job.function(now);
+		}
+	}
+
+	const uint32_t timeNow = millis();
+	uint32_t timeToNextJob = UINT32_MAX;
+	for (const PeriodicJob& job : periodicJobs)
+	{
+		const int32_t timeLeft = (int32_t)(job.nextDue - timeNow);
+		if (timeLeft <= 0)
+		{
+			return 0;
+		}
+		timeToNextJob = min<uint32_t>(timeToNextJob, (uint32_t)timeLeft);
+	}
+	return timeToNextJob;
 }
 
 void Platform::SpinMinimal()
@@ -1511,6 +1909,50 @@ void Platform::SetPressureAdvance(size_t driver, float advance)
 	pressureAdvanceClocks[driver] = advance * (float)StepTimer::StepClockRate;
 }
 
+float Platform::GetPressureAdvanceSmoothingClocks(size_t driver)
+{
+	return pressureAdvanceSmoothingClocks[driver];
+}
+
+GCodeResult Platform::SetPressureAdvanceSmoothing(size_t driver, uint32_t milliseconds, const StringRef& reply) noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.printf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
+		return GCodeResult::error;
+	}
+	if (milliseconds > MaxPressureAdvanceSmoothingMillis)
+	{
+		reply.printf("Pressure advance smoothing time must not exceed %" PRIu32 "ms", MaxPressureAdvanceSmoothingMillis);
+		return GCodeResult::error;
+	}
+	pressureAdvanceSmoothingClocks[driver] = (float)milliseconds * (float)(StepTimer::StepClockRate/1000);
+	return GCodeResult::ok;
+}
+
+const NonlinearExtrusion& Platform::GetExtrusionCoefficients(size_t driver) noexcept
+{
+	return nonlinearExtrusion[driver];
+}
+
+GCodeResult Platform::SetNonlinearExtrusion(size_t driver, float a, float b, float limit, const StringRef& reply) noexcept
+{
+	if (driver >= NumDrivers)
+	{
+		reply.printf("No such driver %u.%u", CanInterface::GetCanAddress(), driver);
+		return GCodeResult::error;
+	}
+	if (limit < 0.0 || limit > MaxNonlinearExtrusionLimit || std::isnan(a) || std::isnan(b))
+	{
+		reply.printf("Bad nonlinear extrusion parameters, limit must be between 0 and %.2f", (double)MaxNonlinearExtrusionLimit);
+		return GCodeResult::error;
+	}
+	nonlinearExtrusion[driver].A = a;
+	nonlinearExtrusion[driver].B = b;
+	nonlinearExtrusion[driver].limit = limit;
+	return GCodeResult::ok;
+}
+
 #if 0	// not used yet and may never be
 // Send the status of drivers and filament monitors to the main board
 void Platform::BuildDriverStatusMessage(CanMessageBuffer *buf) noexcept
@@ -1545,6 +1987,15 @@ bool Platform::GetDirectionValue(size_t driver)
 	return (driver < NumDrivers) && directions[driver];
 }
 
+bool Platform::GetForwardDirectionPinLevel(size_t driver) noexcept
+{
+# if DIFFERENTIAL_STEPPER_OUTPUTS || ACTIVE_HIGH_DIR
+	return GetDirectionValue(driver);
+# else
+	return !GetDirectionValue(driver);
+# endif
+}
+
 #if SINGLE_DRIVER
 
 void Platform::SetDirection(bool direction)
@@ -1558,8 +2009,8 @@ void Platform::SetDirection(bool direction)
 # endif
 
 # if SUPPORT_CLOSED_LOOP
-	ClosedLoop::SetStepDirection(d);
-	if (ClosedLoop::GetClosedLoopEnabled())
+	ClosedLoop::SetStepDirection(0, d);
+	if (ClosedLoop::GetClosedLoopEnabled(0))
 	{
 		return;
 	}
@@ -1604,7 +2055,7 @@ void Platform::SetDirection(size_t driver, bool direction)
 		const bool isSlowDriver = slowDriversBitmap.IsBitSet(driver);
 		if (isSlowDriver)
 		{
-			while (StepTimer::GetTimerTicks() - DDA::lastStepLowTime < GetSlowDriverDirHoldClocks()) { }
+			while (StepTimer::GetTimerTicks() - DDA::lastStepLowTimes[driver] < GetSlowDriverDirHoldFromTrailingEdgeClocks()) { }
 		}
 # endif
 		digitalWrite(DirectionPins[driver], d);
@@ -1614,7 +2065,7 @@ void Platform::SetDirection(size_t driver, bool direction)
 # if SUPPORT_SLOW_DRIVERS
 		if (isSlowDriver)
 		{
-			DDA::lastDirChangeTime = StepTimer::GetTimerTicks();
+			DDA::lastDirChangeTimes[driver] = StepTimer::GetTimerTicks();
 		}
 # endif
 	}
@@ -1628,7 +2079,9 @@ void Platform::SetEnableValue(size_t driver, int8_t eVal)
 	if (driver < NumDrivers)
 	{
 		enableValues[driver] = eVal;
-# if !HAS_SMART_DRIVERS
+# if HAS_SMART_DRIVERS
+		DriverFaultMonitor::SetMonitored(driver, eVal >= 0);
+# else
 		if (driverIsEnabled[driver])
 		{
 			EnableDrive(driver);
@@ -1741,10 +2194,16 @@ void Platform::InternalDisableDrive(size_t driver)
 
 void Platform::SetDriverIdle(size_t driver, uint16_t idlePercent)
 {
-	idleCurrentFactor[driver] = (float)idlePercent * 0.01;
+	// The main board sends the driver states often, so don't recalculate the current and queue a driver register write if nothing has changed
+	const float newIdleFactor = (float)idlePercent * 0.01;
+	if (driverStates[driver].mode == DriverStateControl::driverIdle && idleCurrentFactor[driver] == newIdleFactor)
+	{
+		return;
+	}
+	idleCurrentFactor[driver] = newIdleFactor;
 	driverStates[driver] = DriverStateControl::driverIdle;
 #if SUPPORT_CLOSED_LOOP
-	if (!driverEnableOverride)
+	if (!driverEnableOverride[driver])
 #endif
 	{
 		InternalSetDriverIdle(driver);
@@ -1810,8 +2269,11 @@ GCodeResult Platform::ProcessM569Point7(const CanMessageGeneric& msg, const Stri
 
 void Platform::SetMotorCurrent(size_t driver, float current)
 {
-	motorCurrents[driver] = current;
-	UpdateMotorCurrent(driver);
+	if (current != motorCurrents[driver])					// the main board resends unchanged currents, so avoid queueing a driver register write when we can
+	{
+		motorCurrents[driver] = current;
+		UpdateMotorCurrent(driver);
+	}
 }
 
 // TMC driver temperatures
@@ -1823,6 +2285,13 @@ float Platform::GetTmcDriversTemperature()
 				: 0.0;
 }
 
+// Get the estimated temperature of a driver and the factor by which we have reduced its current
+float Platform::GetDriverTemperatureEstimate(size_t driver, float& deratingFactor) noexcept
+{
+	deratingFactor = driverDeratingFactors[driver];
+	return driverTemperatureEstimates[driver];
+}
+
 #  if HAS_STALL_DETECT
 
 void Platform::SetOrResetEventOnStall(DriversBitmap drivers, bool enable) noexcept
@@ -1837,6 +2306,35 @@ void Platform::SetOrResetEventOnStall(DriversBitmap drivers, bool enable) noexce
 	}
 }
 
+void Platform::SetOrResetStopOnStall(DriversBitmap drivers, bool enable) noexcept
+{
+	if (enable)
+	{
+		stopOnStallDrivers |= drivers;
+	}
+	else
+	{
+		stopOnStallDrivers &= ~drivers;
+	}
+}
+
+// Stop the motion of a driver that has stalled if we have been asked to, so that sensorless homing doesn't have to wait for the main board to stop the move.
+// We remember how far it had moved so that we can include that in the stall event.
+void Platform::OnDriverStall(size_t driver) noexcept
+{
+	const DriversBitmap mask = DriversBitmap::MakeFromBits(driver);
+	if (stopOnStallDrivers.Intersects(mask) && !stoppedOnStallDrivers.Intersects(mask))
+	{
+		int32_t stepsTaken;
+		if (moveInstance->StopDriverLocally(driver, stepsTaken))
+		{
+			stallStopSteps[driver] = stepsTaken;
+			AtomicCriticalSectionLocker lock;
+			stoppedOnStallDrivers |= mask;
+		}
+	}
+}
+
 #  endif
 
 # else
@@ -1879,24 +2377,45 @@ const UniqueIdBase& Platform::GetUniqueId() noexcept
 #if SUPPORT_DRIVERS
 
 // Function to broadcast the drivers status message. Called only by the Heat task.
-void Platform::SendDriversStatus(CanMessageBuffer& buf)
+void Platform::SendDriversStatus(CanMessageBuffer& buf, StatusReport *report)
 {
-	CanMessageDriversStatus * const msg = buf.SetupStatusMessage<CanMessageDriversStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
 # if HAS_SMART_DRIVERS
-	msg->SetStandardFields(MaxSmartDrivers);
-	for (size_t driver = 0; driver < MaxSmartDrivers; ++driver)
+	constexpr size_t NumDriversReported = MaxSmartDrivers;
+# else
+	constexpr size_t NumDriversReported = NumDrivers;
+# endif
+	static uint32_t lastSentStatus[NumDriversReported] = { 0 };
+
+	CanMessageDriversStatus * const msg = buf.SetupStatusMessage<CanMessageDriversStatus>(CanInterface::GetCanAddress(), CanInterface::GetCurrentMasterAddress());
+	msg->SetStandardFields(NumDriversReported);
+	bool changed = false;
+	for (size_t driver = 0; driver < NumDriversReported; ++driver)
 	{
+# if HAS_SMART_DRIVERS
 		msg->data[driver] = SmartDrivers::GetStatus(driver).AsU32();
-	}
 # else
-	msg->SetStandardFields(NumDrivers);
-	for (size_t driver = 0; driver < NumDrivers; ++driver)
-	{
 		msg->data[driver] = Platform::GetStandardDriverStatus(driver).AsU32();
-	}
 # endif
+		changed = changed || msg->data[driver] != lastSentStatus[driver];
+	}
+
+	const uint32_t now = millis();
+	if (report != nullptr && !report->IsDue(now, changed))
+	{
+		report->ReportSuppressed();
+		return;
+	}
+
+	for (size_t driver = 0; driver < NumDriversReported; ++driver)
+	{
+		lastSentStatus[driver] = msg->data[driver];
+	}
 	buf.dataLength = msg->GetActualDataLength();
 	CanInterface::Send(&buf);
+	if (report != nullptr)
+	{
+		report->ReportSent(now);
+	}
 }
 
 #endif
@@ -1904,6 +2423,7 @@ void Platform::SendDriversStatus(CanMessageBuffer& buf)
 void Platform::Tick() noexcept
 {
 	++heatTaskIdleTicks;
+	CanInterface::SampleBusActivity();
 }
 
 void Platform::StartFirmwareUpdate()
@@ -1924,10 +2444,18 @@ void Platform::StartReset()
 	deferredCommand = DeferredCommand::reset;
 }
 
-void Platform::EmergencyStop()
+// Stop everything because the main board has sent an emergency stop or has restarted. The latency is measured from when the CAN peripheral received the message.
+void Platform::EmergencyStop(uint16_t canTimeStamp)
 {
-	whenDeferredCommandRequested = millis();
-	deferredCommand = DeferredCommand::reset;
+	// The time stamp counter runs at the CAN normal bit rate, but the step clock runs at 48MHz/64. Calculate the time since the message was received in step clocks.
+	const uint32_t ticksSinceReceived = ((uint32_t)((CanInterface::GetTimeStampCounter() - canTimeStamp) & 0xFFFF) * CanInterface::GetTimeStampPeriod()) >> 6;
+	DisableOutputsNow(StepTimer::GetTimerTicks() - ticksSinceReceived, false);
+}
+
+// Stop everything because an input bound to emergency stop has triggered. This is called from the input ISR, so the latency doesn't depend on any task being scheduled.
+void Platform::EmergencyStopFromInput(uint32_t whenTriggered) noexcept
+{
+	DisableOutputsNow(whenTriggered, true);
 }
 
 // This is called when we start processing any CAN message except for regular messages e.g. time sync
@@ -2060,6 +2588,194 @@ GCodeResult Platform::DoDiagnosticTest(const CanMessageDiagnosticTest& msg, cons
 		}
 		return GCodeResult::ok;
 
+#if SUPPORT_BENCHMARKS
+	case 109:												// run the on-target benchmarks
+		return Benchmarks::Run(reply);
+#endif
+
+#if SUPPORT_INPUT_SHAPING
+	case 200:												// report input shaping
+		reply.printf("Input shaping frequency %.1fHz", (double)moveInstance->GetInputShapingFrequency());
+		return GCodeResult::ok;
+
+	case 201:												// set input shaping frequency, param16 is in units of 0.1Hz, 0 disables shaping
+		moveInstance->SetInputShapingFrequency((float)msg.param16 * 0.1);
+		return GCodeResult::ok;
+#endif
+
+#if SUPPORT_MOVE_TRACE
+	case 202:												// report the move trace, param16 is the number of recent moves to skip
+		moveInstance->AppendMoveTrace(reply, msg.param16);
+		return GCodeResult::ok;
+#endif
+
+#if SUPPORT_STEP_TIMING_STATS
+	case 203:												// enable or disable step timing recording, param16 is 1 to enable or 0 to disable
+		StepTimingStats::Enable(msg.param16 != 0);
+		return GCodeResult::ok;
+
+	case 204:												// report the step timing histograms and reset them
+		StepTimingStats::Diagnostics(reply);
+		return GCodeResult::ok;
+#endif
+
+#if SUPPORT_DRIVERS && !SINGLE_DRIVER
+	case 205:												// set the step coalescing window, param16 is in step clocks
+		return DDA::SetStepCoalesceWindow(msg.param16, reply);
+#endif
+
+#if SUPPORT_DRIVERS
+	case 206:												// set pressure advance smoothing, param16 is the driver number and param32[0] is the smoothing time in milliseconds, 0 to disable
+		return SetPressureAdvanceSmoothing(msg.param16, msg.param32[0], reply);
+
+	case 207:												// set nonlinear extrusion, param16 bits 0-7 are the driver and bits 8-15 the limit in percent, param32[] are the A and B coefficients as floats
+		{
+			float a, b;
+			memcpy(&a, &msg.param32[0], sizeof(a));
+			memcpy(&b, &msg.param32[1], sizeof(b));
+			return SetNonlinearExtrusion(msg.param16 & 0xFF, a, b, (float)(msg.param16 >> 8) * 0.01, reply);
+		}
+#endif
+
+#if SUPPORT_DRIVERS
+	case 208:												// report the exact positions of all drivers
+		{
+			int32_t positions[NumDrivers];
+			const uint32_t when = moveInstance->GetPositionSnapshot(positions);
+			reply.printf("Positions at master time %" PRIu32 ":", when);
+			for (int32_t pos : positions)
+			{
+				reply.catf(" %" PRIi32, pos);
+			}
+			reply.cat(", planned");
+			for (size_t driver = 0; driver < NumDrivers; ++driver)
+			{
+				reply.catf(" %" PRIi32, moveInstance->GetPosition(driver));
+			}
+		}
+		return GCodeResult::ok;
+#endif
+
+#if SUPPORT_POWER_FAIL_STOP
+	case 209:												// report the power fail count and the snapshot taken at the last power fail
+		{
+			Move::PowerFailSnapshot snapshot;
+			reply.printf("Power fails %" PRIu32, numPowerFails);
+			if (moveInstance->GetPowerFailSnapshot(snapshot))
+			{
+				reply.catf(", last stopped in %" PRIu32 "us at master time %" PRIu32 " after %" PRIu32 " moves%s, positions",
+							(lastPowerFailConversionTicks * 1000u)/(StepTimer::StepClockRate/1000u), snapshot.whenTaken, snapshot.movesCompleted,
+							(snapshot.moveWasExecuting) ? " with a move executing" : "");
+				for (int32_t pos : snapshot.positions)
+				{
+					reply.catf(" %" PRIi32, pos);
+				}
+			}
+			if (moveInstance->IsPowerFailed())
+			{
+				reply.cat(", motion stopped until power is restored");
+			}
+		}
+		return GCodeResult::ok;
+#endif
+
+	case 210:												// set the minimum interval between status reports of a class, param16 is the interval in milliseconds
+	case 211:												// classes are sensors, heaters, fans, drivers, board health
+	case 212:
+	case 213:
+	case 214:
+		return Heat::SetStatusReportInterval(msg.testType - 210, msg.param16, reply);
+
+#if SUPPORT_DRIVERS
+	case 215:												// set the deceleration used when the main board stops a driver, param16 is the driver and param32[0] is in steps/sec^2, 0 to stop immediately
+		return DDA::SetStopDeceleration(msg.param16, msg.param32[0], reply);
+
+	case 216:												// add babystepping, param16 is the driver, param32[0] is the signed number of steps and param32[1] the maximum rate in steps/sec or 0 to leave it unchanged
+		return moveInstance->PushBabyStepping(msg.param16, (int32_t)msg.param32[0], msg.param32[1], reply);
+#endif
+
+	case 217:												// select the telemetry record fields, param32[0] is the low 32 bits of the field bitmap and param32[1] the high 32 bits
+		return DiagnosticsRecord::SetTelemetryFields(((uint64_t)msg.param32[1] << 32) | msg.param32[0], reply);
+
+	case 218:												// set the IIR filter of an analog input monitor, param16 is the input handle and param32[0] the filter shift
+		return InputMonitor::SetAnalogFilter(msg.param16, msg.param32[0], reply);
+
+#if SUPPORT_ACCELEROMETERS
+	case 219:												// set up vibration monitoring, param16 is the window in ms or 0 to stop, param32[0] and param32[1] are the RMS and peak thresholds in milli-g
+		return AccelerometerHandler::SetVibrationMonitoring(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 232:												// acceleration limiting from the vibration monitor, param16 is the target RMS vibration in milli-g or 0 to disable
+		return AccelerometerHandler::SetAccelerationLimiting(msg.param16, reply);
+#endif
+
+#if SUPPORT_DATA_CAPTURE
+	case 233:												// unified data capture, param16 is the sample rate in Hz or 0 to stop, param32[0] the channels bitmap and param32[1] the number of samples or 0 to stream
+		return DataCapture::Start(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if defined(ATEIO) || defined(ATECM)
+	case 220:												// add a step to the ATE test sequence, param16 is the step type, param32[0] the pin number and param32[1] the value
+		return TestSequence::AddStep(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if (SUPPORT_TMC51xx || SUPPORT_TMC2160) && HAS_VOLTAGE_MONITOR
+	case 221:												// measure the phase resistance of a motor, param16 is the driver and param32[0] is 1 to set the stealthChop PWM starting values from the results
+		return SmartDrivers::MeasureMotor(msg.param16, msg.param32[0] != 0, reply);
+#endif
+
+#if SUPPORT_CAN_CAPTURE
+	case 222:												// capture or play back received CAN messages, param16 is 0 to stop, 1 to start capturing, 2 to play back the messages captured
+		return CanCapture::SetMode(msg.param16, reply);
+#endif
+
+#if SUPPORT_CLOSED_LOOP
+	case 223:												// start a closed loop frequency response sweep, param16 is the driver, param32[0] the start and end frequencies and param32[1] the amplitude and number of points
+		return ClosedLoop::StartFrequencyResponse(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+	case 224:												// set the total power that the heaters on this board may draw, param32[0] is in watts or 0 for no limit
+		return Heat::SetPowerBudget(msg.param32[0], reply);
+
+	case 225:												// set the power budget details of a heater, param16 is the heater, param32[0] the power at full PWM in watts and param32[1] the priority
+		return Heat::SetHeaterPower(msg.param16, msg.param32[0], msg.param32[1], reply);
+
+	case 226:												// timed feedforward, param16 is the heater, param32[0] the signed extrusion rate change in thousandths and param32[1] the master time it happens
+		return Heat::FeedForward(msg.param16, 0.0, (float)(int32_t)msg.param32[0] * 0.001, msg.param32[1], reply);
+
+	case 234:												// spin a heater when its sensor has new data, param16 is the heater and param32[0] is 1 to enable or 0 to revert to fixed intervals
+		return Heat::SetHeaterSpinOnNewReading(msg.param16, msg.param32[0] != 0, reply);
+
+	case 235:												// select the task priority profile, param16 is 0 balanced, 1 motion first, 2 closed loop first or 3 sensing first
+		return PriorityProfiles::SetProfile(msg.param16, reply);
+
+	case 236:												// bind an input monitor to emergency stop, param16 is the input handle and param32[0] is 1 to bind or 0 to unbind
+		return InputMonitor::SetEmergencyStop(msg.param16, msg.param32[0] != 0, reply);
+
+#if SUPPORT_SPEED_OVERRIDE
+	case 227:												// speed override, param16 is the factor in thousandths, param32[0] the master time of the move boundary and param32[1] the master time the moves already sent end
+		return moveInstance->ApplySpeedOverride((float)msg.param16 * 0.001, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if SUPPORT_LOCAL_RETRACTION
+	case 228:												// configure local retraction, param16 is the driver, param32[0] the retract microsteps (low 16 bits) and signed extra unretract microsteps (high 16 bits),
+															// param32[1] the speed in microsteps/sec (low 16 bits) and the acceleration in units of 100 microsteps/sec^2 (high 16 bits)
+		return moveInstance->ConfigureRetraction(msg.param16, msg.param32[0] & 0xFFFF, (int16_t)(msg.param32[0] >> 16), msg.param32[1] & 0xFFFF, (msg.param32[1] >> 16) * 100, reply);
+
+	case 229:												// local retraction, param16 is 1 to retract or 0 to unretract, param32[0] the drivers bitmap and param32[1] the master time to start or 0 for now
+		return moveInstance->RequestRetraction(msg.param16 != 0, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if SUPPORT_AUTO_MICROSTEPPING
+	case 230:												// automatic microstepping, param16 is the driver, param32[0] the coarse microstepping or 0 to disable and param32[1] the threshold in microsteps/sec
+		return moveInstance->SetAutoMicrostepping(msg.param16, msg.param32[0], msg.param32[1], reply);
+#endif
+
+#if SUPPORT_DRIVERS && !DM_USE_FPU
+	case 231:												// check the integer move preparation against the floating point calculations
+		DDA::CheckFixedPointPrepare(reply);
+		return GCodeResult::ok;
+#endif
+
 #if SAME5x
 	case 500:												// report write buffer
 		reply.printf("Write buffer is %s", (SCnSCB->ACTLR & SCnSCB_ACTLR_DISDEFWBUF_Msk) ? "disabled" : "enabled");
@@ -2182,6 +2898,16 @@ void Platform::AppendBoardAndFirmwareDetails(const StringRef& reply) noexcept
 
 void Platform::AppendDiagnostics(const StringRef& reply) noexcept
 {
+	reply.lcatf("Spin jobs (max late ms, overruns):");
+	for (PeriodicJob& job : periodicJobs)
+	{
+		reply.catf(" %s %" PRIu32 "/%u", job.name, job.maxLateness, job.overruns);
+		job.maxLateness = 0;
+		job.overruns = 0;
+	}
+	NvmStore::Diagnostics(reply);
+	reply.lcatf("Boot times: init %" PRIu32 "ms, deferred init %" PRIu32 "-%" PRIu32 "ms", bootTimes[0], bootTimes[1], bootTimes[2]);
+
 #if SUPPORT_THERMISTORS
 	bool ok = true;
 	for (const ThermistorAveragingFilter& filter : thermistorFilters)
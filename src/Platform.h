@@ -29,6 +29,7 @@
 
 class CanMessageDiagnosticTest;
 class CanMessageBuffer;
+class StatusReport;
 
 #if HAS_CPU_TEMP_SENSOR
 constexpr size_t McuTempReadingsAveraged = 16;
@@ -36,7 +37,10 @@ constexpr size_t McuTempReadingsAveraged = 16;
 
 #if SUPPORT_THERMISTORS
 // Define the number of temperature readings we average for each thermistor. This should be a power of 2 and at least 4 ^ AD_OVERSAMPLE_BITS.
-constexpr size_t ThermistorReadingsAveraged = 64;
+constexpr size_t ThermistorReadingsAveraged = THERMISTOR_READINGS_AVERAGED;
+constexpr unsigned int ThermistorAdcCallInterval = THERMISTOR_ADC_CALL_INTERVAL;
+static_assert((ThermistorReadingsAveraged & (ThermistorReadingsAveraged - 1)) == 0 && ThermistorReadingsAveraged >= 16, "bad THERMISTOR_READINGS_AVERAGED");
+static_assert(ThermistorAdcCallInterval >= 1, "bad THERMISTOR_ADC_CALL_INTERVAL");
 constexpr size_t ZProbeReadingsAveraged = 8;		// We average this number of readings with IR on, and the same number with IR off
 constexpr size_t VinReadingsAveraged = 8;
 
@@ -85,6 +89,16 @@ enum class ErrorCode : uint32_t
 
 class IoPort;
 
+#if SUPPORT_DRIVERS
+// Nonlinear extrusion compensation. The extrusion is multiplied by (1 + min(limit, A * v + B * v^2)) where v is the extrusion speed in mm/sec.
+struct NonlinearExtrusion
+{
+	float A;
+	float B;
+	float limit;
+};
+#endif
+
 namespace Platform
 {
 #if SUPPORT_DRIVERS
@@ -92,8 +106,46 @@ namespace Platform
 # if SINGLE_DRIVER
 	constexpr uint32_t DriverBit = 1u << (StepPins[0] & 31);
 # else
-	extern uint32_t driveDriverBits[NumDrivers];
-	extern uint32_t allDriverBits;
+	// Table of step pin masks indexed by a bitmap of driver numbers, computed at compile time from the StepPins table in the board configuration file.
+	// All step pins are on StepPio, so the ISR can start or end the step pulses of any set of drivers using a single store.
+	static_assert(NumDrivers <= 4, "step pin mask table would be too large");
+
+	struct StepPinMaskTable
+	{
+		constexpr StepPinMaskTable() noexcept : masks()
+		{
+			for (uint32_t drivers = 0; drivers < (1u << NumDrivers); ++drivers)
+			{
+				uint32_t mask = 0;
+				for (size_t driver = 0; driver < NumDrivers; ++driver)
+				{
+					if (drivers & (1u << driver))
+					{
+						mask |= 1u << (StepPins[driver] & 31);
+					}
+				}
+				masks[drivers] = mask;
+			}
+		}
+
+		constexpr bool AllOnSamePort() const noexcept
+		{
+			for (size_t driver = 1; driver < NumDrivers; ++driver)
+			{
+				if ((StepPins[driver] >> 5) != (StepPins[0] >> 5))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		uint32_t masks[1u << NumDrivers];
+	};
+
+	constexpr StepPinMaskTable StepPinMasks;
+	static_assert(StepPinMasks.AllOnSamePort(), "all step pins must be on the same port");
+	constexpr uint32_t allDriverBits = StepPinMasks.masks[(1u << NumDrivers) - 1];
 # endif
 
 # if SUPPORT_SLOW_DRIVERS
@@ -144,7 +196,8 @@ namespace Platform
 
 	void Init();
 	void InitMinimal();
-	void Spin();
+	void InitDeferred() noexcept;
+	uint32_t Spin();						// returns the number of milliseconds until Spin next needs to be called
 	void SpinMinimal();
 
 	inline bool IsPrinting() { return isPrinting; }
@@ -162,6 +215,10 @@ namespace Platform
 	void SetDriveStepsPerUnit(size_t drive, float val);
 	float GetPressureAdvanceClocks(size_t driver);
 	void SetPressureAdvance(size_t driver, float advance);
+	float GetPressureAdvanceSmoothingClocks(size_t driver);
+	GCodeResult SetPressureAdvanceSmoothing(size_t driver, uint32_t milliseconds, const StringRef& reply) noexcept;
+	const NonlinearExtrusion& GetExtrusionCoefficients(size_t driver) noexcept;
+	GCodeResult SetNonlinearExtrusion(size_t driver, float a, float b, float limit, const StringRef& reply) noexcept;
 
 # if SINGLE_DRIVER
 	inline void StepDriverLow()
@@ -202,7 +259,8 @@ namespace Platform
 #  endif
 	}
 
-	inline uint32_t GetDriversBitmap(size_t driver) { return driveDriverBits[driver]; } 		// Get the step bit for this driver
+	inline uint32_t GetDriversBitmap(size_t driver) { return StepPinMasks.masks[1u << driver]; }		// Get the step bit for this driver
+	inline uint32_t GetStepPinsMask(uint32_t drivesBitmap) { return StepPinMasks.masks[drivesBitmap]; }	// Get the step bits for a bitmap of driver numbers
 # endif
 
 	inline unsigned int GetProhibitedExtruderMovements(unsigned int extrusions, unsigned int retractions) { return 0; }
@@ -213,6 +271,7 @@ namespace Platform
 # endif
 	void SetDirectionValue(size_t driver, bool dVal);
 	bool GetDirectionValue(size_t driver);
+	bool GetForwardDirectionPinLevel(size_t driver) noexcept;		// get the direction pin level that SetDirection uses for forward movement
 	void SetEnableValue(size_t driver, int8_t eVal);
 	int8_t GetEnableValue(size_t driver);
 #if SUPPORT_CLOSED_LOOP
@@ -228,8 +287,13 @@ namespace Platform
 # if HAS_SMART_DRIVERS
 	void SetMotorCurrent(size_t driver, float current);		//TODO avoid the int->float->int conversion
 	float GetTmcDriversTemperature();
+	float GetDriverTemperatureEstimate(size_t driver, float& deratingFactor) noexcept;
 #  if HAS_STALL_DETECT
+	constexpr uint8_t StallActionStopMotor = 4;				// M915 R value that makes us stop the motor on this board when it stalls, as well as raising an event
+
 	void SetOrResetEventOnStall(DriversBitmap drivers, bool enable) noexcept;
+	void SetOrResetStopOnStall(DriversBitmap drivers, bool enable) noexcept;
+	void OnDriverStall(size_t driver) noexcept;				// called by the drivers task or by Spin when a driver reports a stall
 #  endif
 # else
 	StandardDriverStatus GetStandardDriverStatus(size_t driver);
@@ -239,7 +303,8 @@ namespace Platform
 	inline void NewDriverFault() { Heat::NewDriverFault(); }
 
 	// Function to send the status of our drivers - must be called only by the Heat task
-	void SendDriversStatus(CanMessageBuffer& buf);
+	// If 'report' is not null then the status is sent only if the report schedule says it is due
+	void SendDriversStatus(CanMessageBuffer& buf, StatusReport *report);
 #endif	//SUPPORT_DRIVERS
 
 #if SUPPORT_THERMISTORS
@@ -275,7 +340,8 @@ namespace Platform
 
 	GCodeResult DoDiagnosticTest(const CanMessageDiagnosticTest& msg, const StringRef& reply);
 
-	void EmergencyStop();
+	void EmergencyStop(uint16_t canTimeStamp);								// called when we receive an emergency stop or startup message
+	void EmergencyStopFromInput(uint32_t whenTriggered) noexcept;				// called by an input monitor bound to emergency stop, usually from its ISR
 
 	[[noreturn]]inline void ResetProcessor()
 	{
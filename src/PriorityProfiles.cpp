@@ -0,0 +1,114 @@
+/*
+ * PriorityProfiles.cpp
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#include "PriorityProfiles.h"
+#include <RTOSIface/RTOSIface.h>
+#include <TaskPriorities.h>
+
+namespace PriorityProfiles
+{
+	constexpr size_t NumRoles = (size_t)TaskRole::numRoles;
+	constexpr size_t MaxRegisteredTasks = 8;
+
+	// The priority of each role in each profile, in the order of the PriorityProfile enumeration.
+	// The safety monitor must always have a higher priority than the Heat task, so that it still runs if the Heat task stalls.
+	// None of these may exceed the priority of the CAN tasks, because movement and clock sync messages must always be received promptly.
+	constexpr uint8_t Priorities[PriorityProfile::NumValues][NumRoles] =
+	{
+		// move						tmcOpenLoop					tmcClosedLoop					heat						heaterSafety						sensorPoll							accelerometer
+		{ TaskPriority::MovePriority,	TaskPriority::TmcOpenLoop,	TaskPriority::TmcClosedLoop,	TaskPriority::HeatPriority,	TaskPriority::HeaterSafetyPriority,	TaskPriority::SensorPollPriority,	TaskPriority::Accelerometer },	// balanced
+		{ 4,							2,							3,								2,							3,									2,									2 },							// motionFirst
+		{ 3,							2,							4,								2,							3,									2,									2 },							// closedLoopFirst
+		{ 3,							2,							3,								3,							4,									3,									4 },							// sensingFirst
+	};
+
+	static_assert(Priorities[0][(size_t)TaskRole::heaterSafety] > Priorities[0][(size_t)TaskRole::heat]);
+	static_assert(Priorities[1][(size_t)TaskRole::heaterSafety] > Priorities[1][(size_t)TaskRole::heat]);
+	static_assert(Priorities[2][(size_t)TaskRole::heaterSafety] > Priorities[2][(size_t)TaskRole::heat]);
+	static_assert(Priorities[3][(size_t)TaskRole::heaterSafety] > Priorities[3][(size_t)TaskRole::heat]);
+
+	struct RegisteredTask
+	{
+		TaskBase *task;
+		TaskRole role;
+	};
+
+	static RegisteredTask registeredTasks[MaxRegisteredTasks];
+	static size_t numRegisteredTasks = 0;
+	static PriorityProfile currentProfile(PriorityProfile::balanced);
+	static unsigned int numProfileChanges = 0;
+}
+
+unsigned int PriorityProfiles::GetPriority(TaskRole role) noexcept
+{
+	return Priorities[currentProfile.ToBaseType()][(size_t)role];
+}
+
+void PriorityProfiles::SetTaskRole(TaskBase& task, TaskRole role) noexcept
+{
+	{
+		TaskCriticalSectionLocker lock;
+		size_t i = 0;
+		while (i < numRegisteredTasks && registeredTasks[i].task != &task)
+		{
+			++i;
+		}
+		if (i == numRegisteredTasks)
+		{
+			if (numRegisteredTasks == MaxRegisteredTasks)
+			{
+				return;												// should not happen, leave the task at its current priority
+			}
+			registeredTasks[i].task = &task;
+			++numRegisteredTasks;
+		}
+		registeredTasks[i].role = role;
+	}
+	task.SetPriority(GetPriority(role));
+}
+
+void PriorityProfiles::ForgetTask(TaskBase& task) noexcept
+{
+	TaskCriticalSectionLocker lock;
+	for (size_t i = 0; i < numRegisteredTasks; ++i)
+	{
+		if (registeredTasks[i].task == &task)
+		{
+			registeredTasks[i] = registeredTasks[--numRegisteredTasks];
+			break;
+		}
+	}
+}
+
+GCodeResult PriorityProfiles::SetProfile(unsigned int profile, const StringRef& reply) noexcept
+{
+	if (profile >= PriorityProfile::NumValues)
+	{
+		reply.printf("Priority profile must be 0 to %u", PriorityProfile::NumValues - 1);
+		return GCodeResult::error;
+	}
+
+	// Changing priorities lets the scheduler switch tasks, so lock the scheduler until all the tasks have their new priorities
+	{
+		TaskCriticalSectionLocker lock;
+		currentProfile = PriorityProfile((uint8_t)profile);
+		++numProfileChanges;
+		for (size_t i = 0; i < numRegisteredTasks; ++i)
+		{
+			registeredTasks[i].task->SetPriority(GetPriority(registeredTasks[i].role));
+		}
+	}
+	reply.printf("Task priority profile %s", currentProfile.ToString());
+	return GCodeResult::ok;
+}
+
+void PriorityProfiles::Diagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Task priority profile %s, %u tasks, changed %u times", currentProfile.ToString(), (unsigned int)numRegisteredTasks, numProfileChanges);
+}
+
+// End
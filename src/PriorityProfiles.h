@@ -0,0 +1,43 @@
+/*
+ * PriorityProfiles.h
+ *
+ *  Created on: 14 Oct 2026
+ *      Author: David
+ */
+
+#ifndef SRC_PRIORITYPROFILES_H_
+#define SRC_PRIORITYPROFILES_H_
+
+#include <RepRapFirmware.h>
+
+// Module to select between sets of task priorities at run time, so that one build can favour whichever path is critical on a particular machine.
+// The tasks whose priority depends on the profile register their role here. When the profile is changed, their priorities are changed to match.
+// The balanced profile uses the priorities in TaskPriorities.h, which is what we use until the configuration selects a profile.
+// Interrupt priorities are not part of the profiles, because the code uses them as BASEPRI levels for critical sections and interrupts that make RTOS calls
+// must stay below configMAX_SYSCALL_INTERRUPT_PRIORITY, so rearranging them at run time isn't safe.
+// The profile is selected by diagnostic test 235.
+NamedEnum(PriorityProfile, uint8_t, balanced, motionFirst, closedLoopFirst, sensingFirst);
+
+namespace PriorityProfiles
+{
+	// The roles of the tasks whose priority depends on the profile
+	enum class TaskRole : uint8_t
+	{
+		move = 0,
+		tmcOpenLoop,
+		tmcClosedLoop,
+		heat,
+		heaterSafety,
+		sensorPoll,
+		accelerometer,
+		numRoles
+	};
+
+	unsigned int GetPriority(TaskRole role) noexcept;						// get the priority of a role in the current profile
+	void SetTaskRole(TaskBase& task, TaskRole role) noexcept;				// register or change the role of a task and set its priority to match
+	void ForgetTask(TaskBase& task) noexcept;								// call this before a registered task is terminated
+	GCodeResult SetProfile(unsigned int profile, const StringRef& reply) noexcept;
+	void Diagnostics(const StringRef& reply) noexcept;
+}
+
+#endif /* SRC_PRIORITYPROFILES_H_ */
@@ -30,6 +30,7 @@ class DriveMovement;
 class Kinematics;
 class TemperatureSensor;
 class FilamentMonitor;
+class DiagnosticsRecord;
 
 // Debugging support
 extern "C" void debugPrintf(const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
@@ -12,14 +12,21 @@
 namespace TaskPriority
 {
 	static constexpr unsigned int SpinPriority = 1;							// priority for tasks that rarely block
+	static constexpr unsigned int DeferredLogPriority = 1;					// formatting the log must never delay real work
 	static constexpr unsigned int HeatPriority = 2;
+	static constexpr unsigned int SensorPollPriority = 2;					// the sensor task polls sensors that are slow to read
+	static constexpr unsigned int PublishPriority = 2;						// the publish task sends the status reports on behalf of the Heat task
 	static constexpr unsigned int TmcOpenLoop = 2;							// priority of the TMC task when in open loop modes
 	static constexpr unsigned int AinPriority = 2;
 	static constexpr unsigned int CanReceiverPriority = 3;
 	static constexpr unsigned int MovePriority = 3;
 	static constexpr unsigned int Accelerometer = 3;
+	static constexpr unsigned int HeaterSafetyPriority = 3;					// higher than the Heat task so that the safety monitor still runs if the Heat task stalls
 	static constexpr unsigned int ClosedLoopDataTransmission = 3;
+	static constexpr unsigned int ScheduledSettingsPriority = 3;			// the same as the Move task so that scheduled settings are applied close to the requested time
+	static constexpr unsigned int DataCapturePriority = 3;					// the same as the Move task so that samples are taken close to the step clock time
 	static constexpr unsigned int TmcClosedLoop = 4;						// priority of the TMC task when in closed loop mode
+	static constexpr unsigned int CanMotionReceiverPriority = 4;			// higher than the general CAN receiver so that other traffic can't delay movement messages
 	static constexpr unsigned int CanAsyncSenderPriority = 5;
 	static constexpr unsigned int CanClockPriority = 5;
 }
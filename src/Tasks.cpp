@@ -12,15 +12,22 @@
 #include <Heating/Heat.h>
 #include <InputMonitors/InputMonitor.h>
 #include <CommandProcessing/CommandProcessor.h>
+#include <CommandProcessing/ScheduledSettings.h>
 #include <FilamentMonitors/FilamentMonitor.h>
 #include <Hardware/Devices.h>
 #include <Hardware/NonVolatileMemory.h>
+#include <LatencyHistograms.h>
+#include <MemoryArenas.h>
+#include <DeferredLog.h>
+#include <DiagnosticsRecord.h>
 #include <CanMessageBuffer.h>
 #include <CanMessageFormats.h>
 #include <Duet3Common.h>
 #include <CAN/CanInterface.h>
 #include <Cache.h>
 #include <Flash.h>
+#include <General/Portability.h>
+#include <limits>
 
 #include <malloc.h>
 
@@ -57,6 +64,52 @@ static Task<MainTaskStackWords> mainTask;
 static Mutex mallocMutex;
 static unsigned int heatTaskIdleTicks = 0;
 
+// Stack profiling. The tick interrupt records the lowest stack pointer it has seen for each task and the PC at that time, which tells us roughly where the deepest stack usage is.
+// The high water mark from the stack painting is exact, so we use that for the recommended stack sizes.
+constexpr size_t MaxStackSampledTasks = 16;
+#if SAME5x
+constexpr unsigned int StackMarginWords = 64;					// the margin we recommend leaving, enough for an exception frame with FPU registers and a little more
+#else
+constexpr unsigned int StackMarginWords = 24;					// the margin we recommend leaving, enough for an exception frame and a little more
+#endif
+
+struct StackSample
+{
+	TaskHandle_t task;
+	uint32_t lowestSp;
+	uint32_t pcAtLowestSp;
+};
+
+static StackSample stackSamples[MaxStackSampledTasks];
+static size_t numStackSampledTasks = 0;
+
+// Record the stack pointer of the task that the tick interrupt interrupted. Called only from the tick interrupt.
+static void SampleTaskStack() noexcept
+{
+	const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	const uint32_t * const sp = reinterpret_cast<const uint32_t *>(__get_PSP());
+	size_t i = 0;
+	while (i < numStackSampledTasks && stackSamples[i].task != task)
+	{
+		++i;
+	}
+	if (i == numStackSampledTasks)
+	{
+		if (i == MaxStackSampledTasks)
+		{
+			return;
+		}
+		stackSamples[i].task = task;
+		stackSamples[i].lowestSp = 0xFFFFFFFF;
+		++numStackSampledTasks;
+	}
+	if (reinterpret_cast<uint32_t>(sp) < stackSamples[i].lowestSp)
+	{
+		stackSamples[i].lowestSp = reinterpret_cast<uint32_t>(sp);
+		stackSamples[i].pcAtLowestSp = sp[6];					// the exception frame is R0-R3, R12, LR, PC, xPSR
+	}
+}
+
 // Idle task data
 constexpr unsigned int IdleTaskStackWords = 50;					// currently we don't use the idle talk for anything, so this can be quite small
 static Task<IdleTaskStackWords> idleTask;
@@ -218,6 +271,7 @@ void *Tasks::GetNVMBuffer(const uint32_t *stk) noexcept
 	NVIC_EnableIRQ(WDT_IRQn);		// enable the watchdog early warning interrupt
 
 	StepTimer::Init();				// initialise the step pulse timer now because we use it for measuring task CPU usage
+	LatencyHistograms::Init();
 	vTaskStartScheduler();			// doesn't return
 	while (true) { }
 }
@@ -225,19 +279,36 @@ void *Tasks::GetNVMBuffer(const uint32_t *stk) noexcept
 // The main task loop that runs during normal operation
 extern "C" [[noreturn]] void MainTask(void *pvParameters) noexcept
 {
+#if SUPPORT_DEFERRED_LOG
+	DeferredLog::Init();
+#endif
 	Platform::Init();
-	Heat::Init();
+	{
+		MemoryArenas::Scope scope(MemoryArena::heat);
+		Heat::Init();
+	}
 	InputMonitor::Init();
 
 #if SUPPORT_DRIVERS
-	moveInstance = new Move();
-	moveInstance->Init();
+	{
+		MemoryArenas::Scope scope(MemoryArena::movement);
+		moveInstance = new Move();
+		moveInstance->Init();
+	}
+#endif
+
+	Platform::InitDeferred();
+#if SUPPORT_COMMAND_WORKER
+	CommandProcessor::Init();
+#endif
+#if SUPPORT_SCHEDULED_SETTINGS
+	ScheduledSettings::Init();
 #endif
 
 	for (;;)
 	{
-		Platform::Spin();
-		CommandProcessor::Spin();
+		const uint32_t timeToNextJob = Platform::Spin();
+		CommandProcessor::Spin(timeToNextJob);						// sleep until a command arrives or a periodic job is due
 #if SUPPORT_DRIVERS
 		FilamentMonitor::Spin();
 #endif
@@ -272,6 +343,7 @@ static FirmwareFlashErrorCode GetBootloaderBlock(uint8_t *blockBuffer)
 
 	uint32_t whenStartedWaiting = millis();
 	uint32_t bytesReceived = 0;
+	uint32_t lastResendOffset = UINT32_MAX;						// the offset we last asked the host to resend from because we saw a gap
 	bool done = false;
 	do
 	{
@@ -294,7 +366,16 @@ static FirmwareFlashErrorCode GetBootloaderBlock(uint8_t *blockBuffer)
 					return FirmwareFlashErrorCode::hostOther;
 
 				case CanMessageFirmwareUpdateResponse::ErrNone:
-					if (response.fileOffset <= bytesReceived)
+					if (response.fileOffset > bytesReceived)
+					{
+						// We missed some data. Ask for it again straight away instead of waiting for the timeout, but only once for each gap because the host will still be sending the rest of the old stream.
+						if (lastResendOffset != bytesReceived)
+						{
+							lastResendOffset = bytesReceived;
+							RequestBootloaderBlock(bytesReceived, FlashBlockSize - bytesReceived, buf);
+						}
+					}
+					else
 					{
 						const uint32_t bufferOffset = response.fileOffset;
 						const uint32_t bytesToCopy = min<uint32_t>(FlashBlockSize - bufferOffset, response.dataLength);
@@ -465,16 +546,34 @@ ptrdiff_t Tasks::GetNeverUsedRam() noexcept
 	return heapLimit - heapTop;
 }
 
+static uint32_t whenRunTimeCountersLastReset = 0;
+
 // Function called by FreeRTOS and internally to reset the run-time counter and return the number of timer ticks since it was last reset
 extern "C" uint32_t TaskResetRunTimeCounter() noexcept
 {
-	static uint32_t whenLastReset = 0;
 	const uint32_t now = StepTimer::GetTimerTicks();
-	const uint32_t ret = now - whenLastReset;
-	whenLastReset = now;
+	const uint32_t ret = now - whenRunTimeCountersLastReset;
+	whenRunTimeCountersLastReset = now;
 	return ret;
 }
 
+// Get the first 4 characters of the name and the percentage of CPU time used by each task since the run time counters were last reset.
+// This is called when we save the software reset data, so it mustn't allocate memory or wait for anything.
+size_t Tasks::GetCpuUsage(uint32_t *taskNames, uint8_t *cpuPercent, size_t maxTasks) noexcept
+{
+	const uint32_t timeSinceLastReset = StepTimer::GetTimerTicks() - whenRunTimeCountersLastReset;
+	size_t numTasks = 0;
+	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr && numTasks < maxTasks; t = t->GetNext())
+	{
+		ExtendedTaskStatus_t taskDetails;
+		vTaskGetExtendedInfo(t->GetFreeRTOSHandle(), &taskDetails);
+		taskNames[numTasks] = LoadLE32(taskDetails.pcTaskName);
+		cpuPercent[numTasks] = (timeSinceLastReset == 0) ? 0 : (uint8_t)min<uint32_t>(((uint64_t)taskDetails.ulRunTimeCounter * 100u)/timeSinceLastReset, 100);
+		++numTasks;
+	}
+	return numTasks;
+}
+
 void Tasks::Diagnostics(const StringRef& reply) noexcept
 {
 	// Append a memory report to a string
@@ -558,6 +657,56 @@ void Tasks::Diagnostics(const StringRef& reply) noexcept
 	}
 }
 
+// Report the stack usage of each task and how many words we could save by reducing its stack to leave StackMarginWords free.
+// The PC is where the task was when the tick interrupt saw its lowest stack pointer, so it shows where the deepest calls are made from.
+void Tasks::StackDiagnostics(const StringRef& reply) noexcept
+{
+	reply.lcatf("Stacks (never used, could save, PC at deepest sample):");
+	unsigned int totalSaving = 0;
+	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
+	{
+		ExtendedTaskStatus_t taskDetails;
+		vTaskGetExtendedInfo(t->GetFreeRTOSHandle(), &taskDetails);
+		const unsigned int neverUsed = taskDetails.usStackHighWaterMark;
+		const unsigned int saving = (neverUsed > StackMarginWords) ? neverUsed - StackMarginWords : 0;
+		totalSaving += saving;
+
+		uint32_t pc = 0;
+		for (size_t i = 0; i < numStackSampledTasks; ++i)
+		{
+			if (stackSamples[i].task == t->GetFreeRTOSHandle())
+			{
+				pc = stackSamples[i].pcAtLowestSp;
+				break;
+			}
+		}
+		reply.catf(" %s(%u,%u,%08" PRIx32 ")", taskDetails.pcTaskName, neverUsed, saving, pc);
+	}
+	reply.catf(", total %u words", totalSaving);
+}
+
+// Report the memory and task counters for the compact diagnostics record. We don't report the CPU usage because that would reset the run time counters that Diagnostics uses.
+void Tasks::GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept
+{
+	unsigned int numTasks = 0;
+	unsigned int minNeverUsed = std::numeric_limits<unsigned int>::max();
+	for (TaskBase *t = TaskBase::GetTaskList(); t != nullptr; t = t->GetNext())
+	{
+		ExtendedTaskStatus_t taskDetails;
+		vTaskGetExtendedInfo(t->GetFreeRTOSHandle(), &taskDetails);
+		++numTasks;
+		if (taskDetails.usStackHighWaterMark < minNeverUsed)
+		{
+			minNeverUsed = taskDetails.usStackHighWaterMark;
+		}
+	}
+	rec.Set(DiagnosticsField::upTime, (uint32_t)(millis64()/1000u));
+	rec.Set(DiagnosticsField::neverUsedRam, (uint32_t)GetNeverUsedRam());
+	rec.Set(DiagnosticsField::freeSystemStack, (uint32_t)(GetHandlerFreeStack()/4));
+	rec.Set(DiagnosticsField::numTasks, numTasks);
+	rec.Set(DiagnosticsField::minTaskStackNeverUsed, minNeverUsed);
+}
+
 // Allocate memory permanently. Using this saves about 8 bytes per object. You must not call free() on the returned object.
 // It doesn't try to allocate from the free list maintained by malloc, only from virgin memory.
 void *Tasks::AllocPermanent(size_t sz, std::align_val_t align) noexcept
@@ -568,12 +717,24 @@ void *Tasks::AllocPermanent(size_t sz, std::align_val_t align) noexcept
 	return ret;
 }
 
+#if configUSE_IDLE_HOOK
+
+// Called by the idle task when no other task is ready to run. Sleep until the next interrupt, which will be the tick interrupt at the latest, to save power.
+extern "C" void vApplicationIdleHook(void) noexcept
+{
+	__DSB();
+	__WFI();
+}
+
+#endif
+
 extern "C" void vApplicationTickHook(void) noexcept
 {
 	CoreSysTick();
 	WatchdogReset();							// kick the watchdog
 	Platform::Tick();
 	++heatTaskIdleTicks;
+	SampleTaskStack();
 #if 0
 	const bool heatTaskStuck = (heatTaskIdleTicks >= MaxTicksInSpinState);
 	if (heatTaskStuck || ticksInSpinState >= MaxTicksInSpinState)		// if we stall for 20 seconds, save diagnostic data and reset
@@ -19,6 +19,9 @@ namespace Tasks
 	ptrdiff_t GetNeverUsedRam() noexcept;
 	void *AllocPermanent(size_t sz, std::align_val_t align = (std::align_val_t)__STDCPP_DEFAULT_NEW_ALIGNMENT__) noexcept;
 	void Diagnostics(const StringRef& reply) noexcept;
+	void StackDiagnostics(const StringRef& reply) noexcept;
+	void GetDiagnosticsRecord(DiagnosticsRecord& rec) noexcept;
+	size_t GetCpuUsage(uint32_t *taskNames, uint8_t *cpuPercent, size_t maxTasks) noexcept;	// get the CPU split without resetting the run time counters
 	uint32_t DoDivide(uint32_t a, uint32_t b) noexcept;
 	uint32_t DoMemoryRead(const uint32_t* addr) noexcept;
 	void *GetNVMBuffer(const uint32_t *stk) noexcept;